@@ -1409,6 +1409,10 @@ hazard3_regfile_1w2r #(
 `include "hazard3_rvfi_monitor.vh"
 `endif
 
+`ifdef HAZARD3_COSIM
+`include "hazard3_cosim_monitor.vh"
+`endif
+
 `ifdef HAZARD3_FORMAL_REGRESSION
 // Each formal regression provides its own file with the below name:
 `include "hazard3_formal_regression.vh"
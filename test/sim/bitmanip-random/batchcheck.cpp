@@ -0,0 +1,329 @@
+// Bulk checker for the bitmanip instructions: generate one program which puts
+// a large array of operands through every instruction, run it once on the
+// RTL (or any simulator with the tb_cxxrtl --dump-bin option), and compare
+// the dumped results against rvcpp's ALU (rv_alu.h), evaluated over the same
+// arrays on the host.
+//
+//   batchcheck gen [-n count] [-s seed] out.bin out.dump > sim_args
+//   $(SIM_EXEC) --cpuret --bin out.bin $(cat sim_args)
+//   batchcheck check out.dump
+//
+// The operands and the list of instructions are in the dumped data, so the
+// check needs nothing but the dump.
+
+#include "rv_alu.h"
+#include "rv_le.h"
+#include "encoding/rv_opcodes.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+enum OperandKind {
+	ONE_OPERAND, // rd = op(rs1)
+	REG_REG,     // rd = op(rs1, rs2)
+	REG_IMM      // rd = op(rs1, shamt), for every shamt
+};
+
+struct TestOp {
+	const char *name;
+	uint32_t bits;
+	rv_op op;
+	OperandKind kind;
+};
+
+// Same instructions as vector-gen. zext.h is pack with rs2 = x0.
+static const TestOp test_ops[] = {
+	{"clz",    RVOPC_CLZ_BITS,    RVOP_CLZ,    ONE_OPERAND},
+	{"cpop",   RVOPC_CPOP_BITS,   RVOP_CPOP,   ONE_OPERAND},
+	{"ctz",    RVOPC_CTZ_BITS,    RVOP_CTZ,    ONE_OPERAND},
+	{"orc.b",  RVOPC_ORC_B_BITS,  RVOP_ORC_B,  ONE_OPERAND},
+	{"rev8",   RVOPC_REV8_BITS,   RVOP_REV8,   ONE_OPERAND},
+	{"sext.b", RVOPC_SEXT_B_BITS, RVOP_SEXT_B, ONE_OPERAND},
+	{"sext.h", RVOPC_SEXT_H_BITS, RVOP_SEXT_H, ONE_OPERAND},
+	{"zext.h", RVOPC_ZEXT_H_BITS, RVOP_PACK,   ONE_OPERAND},
+	{"zip",    RVOPC_ZIP_BITS,    RVOP_ZIP,    ONE_OPERAND},
+	{"unzip",  RVOPC_UNZIP_BITS,  RVOP_UNZIP,  ONE_OPERAND},
+	{"brev8",  RVOPC_BREV8_BITS,  RVOP_BREV8,  ONE_OPERAND},
+	{"sh1add", RVOPC_SH1ADD_BITS, RVOP_SH1ADD, REG_REG},
+	{"sh2add", RVOPC_SH2ADD_BITS, RVOP_SH2ADD, REG_REG},
+	{"sh3add", RVOPC_SH3ADD_BITS, RVOP_SH3ADD, REG_REG},
+	{"andn",   RVOPC_ANDN_BITS,   RVOP_ANDN,   REG_REG},
+	{"max",    RVOPC_MAX_BITS,    RVOP_MAX,    REG_REG},
+	{"maxu",   RVOPC_MAXU_BITS,   RVOP_MAXU,   REG_REG},
+	{"min",    RVOPC_MIN_BITS,    RVOP_MIN,    REG_REG},
+	{"minu",   RVOPC_MINU_BITS,   RVOP_MINU,   REG_REG},
+	{"orn",    RVOPC_ORN_BITS,    RVOP_ORN,    REG_REG},
+	{"rol",    RVOPC_ROL_BITS,    RVOP_ROL,    REG_REG},
+	{"ror",    RVOPC_ROR_BITS,    RVOP_ROR,    REG_REG},
+	{"xnor",   RVOPC_XNOR_BITS,   RVOP_XNOR,   REG_REG},
+	{"clmul",  RVOPC_CLMUL_BITS,  RVOP_CLMUL,  REG_REG},
+	{"clmulh", RVOPC_CLMULH_BITS, RVOP_CLMULH, REG_REG},
+	{"clmulr", RVOPC_CLMULR_BITS, RVOP_CLMULR, REG_REG},
+	{"bclr",   RVOPC_BCLR_BITS,   RVOP_BCLR,   REG_REG},
+	{"bext",   RVOPC_BEXT_BITS,   RVOP_BEXT,   REG_REG},
+	{"binv",   RVOPC_BINV_BITS,   RVOP_BINV,   REG_REG},
+	{"bset",   RVOPC_BSET_BITS,   RVOP_BSET,   REG_REG},
+	{"pack",   RVOPC_PACK_BITS,   RVOP_PACK,   REG_REG},
+	{"packh",  RVOPC_PACKH_BITS,  RVOP_PACKH,  REG_REG},
+	{"rori",   RVOPC_RORI_BITS,   RVOP_RORI,   REG_IMM},
+	{"bclri",  RVOPC_BCLRI_BITS,  RVOP_BCLRI,  REG_IMM},
+	{"bexti",  RVOPC_BEXTI_BITS,  RVOP_BEXTI,  REG_IMM},
+	{"binvi",  RVOPC_BINVI_BITS,  RVOP_BINVI,  REG_IMM},
+	{"bseti",  RVOPC_BSETI_BITS,  RVOP_BSETI,  REG_IMM},
+};
+static const uint N_OPS = sizeof(test_ops) / sizeof(test_ops[0]);
+
+static const uint32_t IO_EXIT   = 0x80000008u;
+static const uint32_t DATA_BASE = 0x10000u;
+static const uint32_t MEM_SIZE  = 16u << 20;
+static const uint32_t MAGIC     = 0x4d425652u; // "RVBM"
+
+// Data layout at DATA_BASE, all words: magic, count, n_ops, op indices,
+// then rs1[count], rs2[count], and count results for each op. Register-
+// immediate ops take the first count / 32 rs1 values, with all 32 shamts.
+struct Layout {
+	uint32_t count;
+	uint32_t rs1, rs2, results, end;
+
+	Layout(uint32_t count_): count(count_) {
+		rs1 = DATA_BASE + 4 * (3 + N_OPS);
+		rs2 = rs1 + 4 * count;
+		results = rs2 + 4 * count;
+		end = results + 4 * count * N_OPS;
+	}
+
+	uint32_t result(uint op) const {
+		return results + 4 * count * op;
+	}
+};
+
+enum {
+	X0 = 0,
+	A0 = 10, A1 = 11, A2 = 12,
+	S0 = 8, S1 = 9, S2 = 18, S3 = 19
+};
+
+struct Assembler {
+	std::vector<uint8_t> &mem;
+	uint32_t pc;
+
+	Assembler(std::vector<uint8_t> &mem_, uint32_t pc_): mem(mem_), pc(pc_) {}
+
+	void emit(uint32_t instr) {
+		le_store32(&mem[pc], instr);
+		pc += 4;
+	}
+
+	void r(uint32_t bits, uint rd, uint rs1, uint rs2) {
+		emit(bits | rd << 7 | rs1 << 15 | rs2 << 20);
+	}
+
+	void i(uint32_t bits, uint rd, uint rs1, uint32_t imm) {
+		emit(bits | rd << 7 | rs1 << 15 | (imm & 0xfffu) << 20);
+	}
+
+	void s(uint32_t bits, uint rs1, uint rs2, uint32_t imm) {
+		emit(bits | (imm & 0x1fu) << 7 | rs1 << 15 | rs2 << 20 | (imm >> 5 & 0x7fu) << 25);
+	}
+
+	void bne(uint rs1, uint rs2, uint32_t target) {
+		uint32_t off = target - pc;
+		emit(RVOPC_BNE_BITS | rs1 << 15 | rs2 << 20 |
+			(off >> 12 & 0x1u) << 31 | (off >> 5 & 0x3fu) << 25 |
+			(off >> 1 & 0xfu) << 8 | (off >> 11 & 0x1u) << 7);
+	}
+
+	void li(uint rd, uint32_t x) {
+		emit(RVOPC_LUI_BITS | rd << 7 | ((x + 0x800u) & 0xfffff000u));
+		i(RVOPC_ADDI_BITS, rd, rd, x);
+	}
+
+	void exit(uint rs) {
+		li(A0, IO_EXIT);
+		s(RVOPC_SW_BITS, A0, rs, 0);
+		emit(RVOPC_JAL_BITS); // j .
+	}
+};
+
+static std::vector<uint32_t> special_values() {
+	std::vector<uint32_t> v{0u, ~0u};
+	for (int i = 0; i < 32; ++i) {
+		v.push_back(1u << i);
+		v.push_back(~(1u << i));
+	}
+	return v;
+}
+
+static int gen(uint32_t count, uint32_t seed, const char *path, const char *dump_path) {
+	Layout l(count);
+	if (count == 0 || count % 32 || l.end > MEM_SIZE || l.end < DATA_BASE) {
+		std::cerr << "Count must be a nonzero multiple of 32, and fit in " << (MEM_SIZE >> 20) << " MiB\n";
+		return -1;
+	}
+	std::vector<uint8_t> mem(l.results);
+
+	// Every pair of special values first, then random values, alternately
+	// dense and sparse (to exercise clz, ctz, orc.b etc.)
+	std::vector<uint32_t> special = special_values();
+	std::mt19937 rng(seed);
+	for (uint32_t k = 0; k < count; ++k) {
+		uint32_t a, b;
+		if (k < special.size() * special.size()) {
+			a = special[k % special.size()];
+			b = special[k / special.size()];
+		} else if (k & 1) {
+			a = rng() & rng() & rng();
+			b = rng() & rng();
+		} else {
+			a = rng();
+			b = rng();
+		}
+		le_store32(&mem[l.rs1 + 4 * k], a);
+		le_store32(&mem[l.rs2 + 4 * k], b);
+	}
+	le_store32(&mem[DATA_BASE], MAGIC);
+	le_store32(&mem[DATA_BASE + 4], count);
+	le_store32(&mem[DATA_BASE + 8], N_OPS);
+	for (uint op = 0; op < N_OPS; ++op)
+		le_store32(&mem[DATA_BASE + 12 + 4 * op], op);
+
+	// Any trap exits with -1
+	Assembler as(mem, 0);
+	as.li(A1, -1u);
+	as.exit(A1);
+
+	as.pc = 0x40;
+	for (uint op = 0; op < N_OPS; ++op) {
+		const TestOp &t = test_ops[op];
+		as.li(S0, l.rs1);
+		as.li(S1, l.rs2);
+		as.li(S2, l.result(op));
+		if (t.kind == REG_IMM) {
+			as.li(S3, l.rs1 + 4 * (count / 32));
+			uint32_t loop = as.pc;
+			as.i(RVOPC_LW_BITS, A1, S0, 0);
+			for (uint shamt = 0; shamt < 32; ++shamt) {
+				as.r(t.bits, A0, A1, shamt);
+				as.s(RVOPC_SW_BITS, S2, A0, 4 * shamt);
+			}
+			as.i(RVOPC_ADDI_BITS, S0, S0, 4);
+			as.i(RVOPC_ADDI_BITS, S2, S2, 4 * 32);
+			as.bne(S0, S3, loop);
+		} else {
+			as.li(S3, l.rs1 + 4 * count);
+			uint32_t loop = as.pc;
+			as.i(RVOPC_LW_BITS, A1, S0, 0);
+			as.i(RVOPC_LW_BITS, A2, S1, 0);
+			as.r(t.bits, A0, A1, t.kind == REG_REG ? A2 : 0);
+			as.s(RVOPC_SW_BITS, S2, A0, 0);
+			as.i(RVOPC_ADDI_BITS, S0, S0, 4);
+			as.i(RVOPC_ADDI_BITS, S1, S1, 4);
+			as.i(RVOPC_ADDI_BITS, S2, S2, 4);
+			as.bne(S0, S3, loop);
+		}
+	}
+	as.exit(X0);
+	if (as.pc > DATA_BASE) {
+		std::cerr << "Program overlaps data\n";
+		return -1;
+	}
+
+	std::ofstream f(path, std::ios::binary);
+	f.write((const char*)mem.data(), mem.size());
+	if (!f) {
+		std::cerr << "Failed to write \"" << path << "\"\n";
+		return -1;
+	}
+	// Generous cycle limit: at most ~8 instructions per vector
+	printf("--cycles %u --dump-bin 0x%08x 0x%08x %s\n", 100000 + 32 * count * N_OPS, DATA_BASE, l.end, dump_path);
+	return 0;
+}
+
+static int check(const char *path) {
+	std::ifstream f(path, std::ios::binary);
+	std::vector<uint8_t> data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+	if (!f.is_open() || data.size() < 12) {
+		std::cerr << "No memory dump in \"" << path << "\"\n";
+		return -1;
+	}
+	auto word = [&](uint32_t addr) {return le_load32(&data[addr - DATA_BASE]);};
+	Layout l(word(DATA_BASE + 4));
+	if (word(DATA_BASE) != MAGIC || word(DATA_BASE + 8) != N_OPS || l.count % 32 || l.end - DATA_BASE != data.size()) {
+		std::cerr << "Dump does not match this version of batchcheck\n";
+		return -1;
+	}
+
+	std::vector<ux_t> rs1(l.count), rs2(l.count), imm_rs1(l.count), shamt(l.count);
+	std::vector<ux_t> zero(l.count, 0), expect(l.count), actual(l.count);
+	for (uint32_t k = 0; k < l.count; ++k) {
+		rs1[k] = word(l.rs1 + 4 * k);
+		rs2[k] = word(l.rs2 + 4 * k);
+		imm_rs1[k] = rs1[k / 32];
+		shamt[k] = k % 32;
+	}
+
+	uint64_t total_fail = 0;
+	for (uint op = 0; op < N_OPS; ++op) {
+		const TestOp &t = test_ops[op];
+		const ux_t *a = t.kind == REG_IMM ? imm_rs1.data() : rs1.data();
+		const ux_t *b = t.kind == REG_IMM ? shamt.data() : t.kind == REG_REG ? rs2.data() : zero.data();
+		rv_alu_array(t.op, a, b, expect.data(), l.count);
+		for (uint32_t k = 0; k < l.count; ++k)
+			actual[k] = word(l.result(op) + 4 * k);
+		uint fail = 0;
+		for (uint32_t k = 0; k < l.count; ++k) {
+			if (actual[k] == expect[k])
+				continue;
+			if (fail++ < 4) {
+				printf("%-7s %08x %08x: got %08x, expected %08x\n",
+					t.name, a[k], b[k], actual[k], expect[k]);
+			}
+		}
+		if (fail)
+			printf("%-7s %u/%u failed\n", t.name, fail, l.count);
+		total_fail += fail;
+	}
+	printf("Checked %u vectors for each of %u instructions: %s\n", l.count, N_OPS, total_fail ? "FAIL" : "PASS");
+	return total_fail ? 1 : 0;
+}
+
+static void exit_help() {
+	std::cerr <<
+		"Usage: batchcheck gen [-n count] [-s seed] out.bin out.dump\n"
+		"       batchcheck check out.dump\n"
+		"gen writes a test program, and prints the simulator arguments to run it,\n"
+		"which dump the results to out.dump. count is the number of vectors per\n"
+		"instruction (default 16384, a multiple of 32). check compares the dump\n"
+		"against rvcpp's ALU.\n";
+	exit(-1);
+}
+
+int main(int argc, char **argv) {
+	if (argc < 3)
+		exit_help();
+	std::string cmd = argv[1];
+	if (cmd == "check" && argc == 3)
+		return check(argv[2]);
+	if (cmd != "gen")
+		exit_help();
+	uint32_t count = 16384;
+	uint32_t seed = 1;
+	int i;
+	for (i = 2; i < argc - 2; i += 2) {
+		std::string s = argv[i];
+		if (s == "-n")
+			count = std::stoul(argv[i + 1], 0, 0);
+		else if (s == "-s")
+			seed = std::stoul(argv[i + 1], 0, 0);
+		else
+			exit_help();
+	}
+	if (i != argc - 2)
+		exit_help();
+	return gen(count, seed, argv[argc - 2], argv[argc - 1]);
+}
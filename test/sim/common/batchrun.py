@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+# Run a manifest of tests (one line per test: name followed by simulator
+# options) using the --batch mode of rvcpp or tb_cxxrtl. The manifest is split
+# across several simulator processes, each of which runs its share of the
+# tests back-to-back without being restarted.
+
+def read_manifest(paths):
+	lines = []
+	for path in paths:
+		with open(path) as f:
+			for l in f:
+				l = l.strip()
+				if l and not l.startswith("#"):
+					lines.append(l)
+	return lines
+
+def main():
+	parser = argparse.ArgumentParser()
+	parser.add_argument("manifest", nargs="+", help="Manifest file(s) listing the tests to run")
+	parser.add_argument("--tb", default="../tb_cxxrtl/tb", help="Simulator executable")
+	parser.add_argument("--tbarg", action="append", default=[],
+		help="Extra argument passed to every simulator process (can be repeated)")
+	parser.add_argument("-j", type=int, default=os.cpu_count(), help="Number of simulator processes")
+	args = parser.parse_args()
+
+	tests = read_manifest(args.manifest)
+	n_procs = max(1, min(args.j, len(tests)))
+	tmpdir = tempfile.TemporaryDirectory()
+	procs = []
+	for i in range(n_procs):
+		chunk = os.path.join(tmpdir.name, f"chunk{i}.txt")
+		with open(chunk, "w") as f:
+			f.write("\n".join(tests[i::n_procs]) + "\n")
+		procs.append(subprocess.Popen([args.tb, *args.tbarg, "--batch", chunk],
+			stdout=subprocess.PIPE, text=True))
+
+	results = []
+	for p in procs:
+		out, _ = p.communicate()
+		for l in out.splitlines():
+			results.append(json.loads(l))
+	tmpdir.cleanup()
+
+	# A simulator which dies part-way through its chunk doesn't report the rest
+	reported = set(r["test"] for r in results)
+	for t in tests:
+		name = t.split()[0]
+		if name not in reported:
+			results.append({"test": name, "exit_code": None, "cycles": 0, "timed_out": False,
+				"dump_check": False, "pass": False})
+
+	results.sort(key=lambda r: r["test"])
+	n_failed = 0
+	for r in results:
+		if r["pass"]:
+			print(f"PASS  {r['test']} ({r['cycles']} cycles)")
+		else:
+			n_failed += 1
+			reason = "hung" if r.get("hung") else \
+				"timed out" if r["timed_out"] else \
+				"memory check failed" if not r["dump_check"] else \
+				f"exit code {r['exit_code']}"
+			print(f"FAIL  {r['test']} ({reason})")
+	print(f"\n{len(results) - n_failed}/{len(results)} passed")
+	sys.exit(1 if n_failed else 0)
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,333 @@
+#!/usr/bin/env python3
+
+import argparse
+import concurrent.futures
+import hashlib
+import itertools
+import json
+import math
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+import simbench
+
+# Design space exploration across hazard3_config parameters. Generates a
+# config_sweep_<hash>.vh variant of a base testbench config for each point in
+# the cartesian product of the --param values, builds a tb for each (in
+# parallel, and reusing the DUT_CACHE, so a variant swept before is not
+# resynthesised), and runs CoreMark, Dhrystone and the Embench subset on each.
+# Each variant is then synthesised with yosys for the area, and the results
+# are printed as a table, with the Pareto-optimal variants (no other is both
+# smaller and faster) marked, e.g.
+#
+#   configsweep.py --param MULDIV_UNROLL=1,2,4 --param MUL_FAST=0,1 --param REDUCED_BYPASS=0,1
+#
+# The software is built for each variant's ISA, as far as its EXTENSION_*
+# parameters go (Zbc, Zcb and Zcmp are left out of -march, as in the default
+# builds). Embench builds with its own scripts, and the -march in its chip.cfg
+# (see embench/Readme.md), so it only runs on variants with all of
+# --embench-isa. Variants without CSR_COUNTER can't time the benchmarks.
+#
+# Area is from the example_soc/synth flows: synth_ice40 -dsp as for the
+# iCEBreaker (LUT4s), synth_ecp5 as for the ULX3S and OrangeCrab (LUT4s), or
+# a generic yosys synth (all cells), of just the processor (--top), with the
+# variant's parameters set on it directly.
+
+SIM_DIR = simbench.SIM_DIR
+TB_DIR = os.path.join(SIM_DIR, "tb_cxxrtl")
+HDL_DIR = os.path.abspath(os.path.join(SIM_DIR, "..", "..", "hdl"))
+EMBENCH_BD = os.path.join(simbench.EMBENCH_DIR, "bd", "src")
+
+# -march is built from these, in canonical order
+MARCH_EXTENSIONS = [("EXTENSION_M", "m"), ("EXTENSION_A", "a"), ("EXTENSION_C", "c")]
+MARCH_Z_EXTENSIONS = [("EXTENSION_ZIFENCEI", "zifencei"), ("EXTENSION_ZBA", "zba"),
+	("EXTENSION_ZBB", "zbb"), ("EXTENSION_ZBKB", "zbkb"), ("EXTENSION_ZBS", "zbs")]
+
+# DMIPS are Dhrystones per second over the VAX 11/780's 1757
+DHRYSTONES_PER_DMIPS = 1757
+
+SYNTH_CMDS = {
+	"ice40": ("synth_ice40 -dsp -top {top}", "SB_LUT4", "LUT4s"),
+	"ecp5": ("synth_ecp5 -top {top}", "LUT4", "LUT4s"),
+	"generic": ("synth -flatten -top {top}", None, "cells"),
+}
+
+LOCALPARAM_RE = re.compile(r"^(localparam\s+(\w+)\s*=\s*)([^;]*)(;.*)$")
+
+def read_config(path):
+	"""Return the lines of a config header, and {name: value} of its localparams"""
+	with open(path) as f:
+		lines = f.read().splitlines()
+	params = {}
+	for l in lines:
+		m = LOCALPARAM_RE.match(l)
+		if m:
+			params[m.group(2)] = m.group(3).strip()
+	return lines, params
+
+def has_param(params, name):
+	return params.get(name, "0") not in ("0", "1'b0")
+
+def march(params):
+	"""-march for the EXTENSION_* parameters of a config"""
+	m = "rv32i" + "".join(e for p, e in MARCH_EXTENSIONS if has_param(params, p)) + "_zicsr"
+	return m + "".join("_" + e for p, e in MARCH_Z_EXTENSIONS if has_param(params, p))
+
+class Variant:
+	def __init__(self, base_name, base_lines, base_params, overrides):
+		self.overrides = overrides
+		self.params = dict(base_params, **overrides)
+		desc = " ".join(f"{k}={v}" for k, v in overrides.items())
+		text = [f"// Generated by configsweep.py from config_{base_name}.vh: {desc or 'unchanged'}"]
+		for l in base_lines:
+			m = LOCALPARAM_RE.match(l)
+			if m and m.group(2) in overrides:
+				# Keep the alignment of the value column
+				l = m.group(1) + overrides[m.group(2)] + m.group(4)
+			text.append(l)
+		self.text = "\n".join(text) + "\n"
+		self.name = "sweep_" + hashlib.sha1(self.text.encode()).hexdigest()[:8]
+		self.config_path = os.path.join(TB_DIR, f"config_{self.name}.vh")
+		self.tb = os.path.join(TB_DIR, f"tb-{self.name}")
+		self.results = {}
+		self.area = None
+		self.error = None
+
+	def write_config(self):
+		# Left alone if unchanged, so make has nothing to do
+		if os.path.exists(self.config_path):
+			with open(self.config_path) as f:
+				if f.read() == self.text:
+					return
+		with open(self.config_path, "w") as f:
+			f.write(self.text)
+
+	def has(self, param):
+		return has_param(self.params, param)
+
+	def march(self):
+		return march(self.params)
+
+def variants(base_name, params):
+	base_lines, base_params = read_config(os.path.join(TB_DIR, f"config_{base_name}.vh"))
+	names = []
+	values = []
+	for p in params:
+		name, _, vals = p.partition("=")
+		if name not in base_params or not vals:
+			sys.exit(f"Bad --param {p}: expected NAME=v1,v2,... with NAME a localparam of config_{base_name}.vh")
+		names.append(name)
+		values.append(vals.split(","))
+	return [Variant(base_name, base_lines, base_params, dict(zip(names, point)))
+		for point in itertools.product(*values)]
+
+def build_tb(v, make_jobs):
+	"""Build one variant's tb. Returns an error message, or None."""
+	v.write_config()
+	cmd = ["make", "-C", TB_DIR, f"-j{make_jobs}", f"CONFIG={v.name}", "TOPOLOGIES=tb", f"TBEXEC=tb-{v.name}"]
+	p = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+	if p.returncode != 0:
+		return "build failed:\n" + p.stdout[-2000:]
+	return None
+
+def software(varis):
+	"""Build CoreMark and Dhrystone for each -march needed, and Embench once.
+	Returns {march: {workload: elf}}, and the Embench ELFs."""
+	elfs = {}
+	for march in sorted(set(v.march() for v in varis)):
+		print(f"Building software for {march}", file=sys.stderr)
+		simbench.build(["make", "-C", os.path.join(SIM_DIR, "coremark", "dist"), f"MARCH={march}",
+			f"OPATH=build/{march}/", f"build/{march}/coremark.elf"])
+		simbench.build(["make", "-C", os.path.join(SIM_DIR, "dhrystone"), f"TMP_PREFIX=tmp/{march}/",
+			f"CCFLAGS=-O3 -fno-inline -march={march} -Wno-implicit-function-declaration -Wno-implicit-int",
+			f"tmp/{march}/dhrystone.elf"])
+		elfs[march] = {
+			"coremark": os.path.join(SIM_DIR, "coremark", "dist", "build", march, "coremark.elf"),
+			"dhrystone": os.path.join(SIM_DIR, "dhrystone", "tmp", march, "dhrystone.elf"),
+		}
+	embench = {}
+	if os.path.exists(os.path.join(simbench.EMBENCH_DIR, "build_all.py")):
+		if not all(os.path.exists(os.path.join(EMBENCH_BD, b, b)) for b in simbench.EMBENCH_SUBSET):
+			simbench.build(["sh", "-c", f"cd {simbench.EMBENCH_DIR} && ./build_all.py --arch riscv32 --chip hazard3 --board hazard3tb"])
+		embench = {f"embench/{b}": os.path.join(EMBENCH_BD, b, b) for b in simbench.EMBENCH_SUBSET}
+	else:
+		print(f"Skipping Embench: {simbench.EMBENCH_DIR} is not checked out", file=sys.stderr)
+	return elfs, embench
+
+def run(tb, elf, max_cycles):
+	"""Return (simulated cycles or None, stdout)"""
+	p = subprocess.run([tb, "--elf", elf, "--cycles", str(max_cycles)], stdout=subprocess.PIPE,
+		stderr=subprocess.DEVNULL, text=True)
+	cycles = None
+	for l in p.stdout.splitlines():
+		if l.startswith("Ran for "):
+			cycles = int(l.split()[2])
+	return cycles, p.stdout
+
+def field(out, label):
+	"""The value of a "label : value" line of benchmark output"""
+	for l in out.splitlines():
+		name, sep, value = l.partition(":")
+		if sep and name.strip() == label:
+			return value.strip()
+	return None
+
+def bench(v, elfs, embench, embench_isa):
+	"""Run the workloads on one variant. The CoreMark and Dhrystone timers
+	count mcycle at 1 MHz, so their scores come out per MHz."""
+	sw = elfs[v.march()]
+	cycles, out = run(v.tb, sw["coremark"], 100000000)
+	ticks, iters = field(out, "Total ticks"), field(out, "Iterations")
+	errors = [l for l in out.splitlines() if "ERROR!" in l and "at least 10 secs" not in l]
+	if cycles is not None and ticks and iters and not errors:
+		v.results["coremark"] = {"cycles": cycles, "per_mhz": int(iters) / (int(ticks) / 1e6)}
+
+	cycles, out = run(v.tb, sw["dhrystone"], 1000000)
+	dhry = field(out, "Dhrystones per Second")
+	if cycles is not None and dhry:
+		v.results["dhrystone"] = {"cycles": cycles, "per_mhz": int(dhry) / DHRYSTONES_PER_DMIPS}
+
+	if all(v.has(f"EXTENSION_{e}") for e in embench_isa):
+		for name, elf in embench.items():
+			cycles, out = run(v.tb, elf, 100000000)
+			if cycles is not None:
+				v.results[name] = {"cycles": cycles}
+
+def file_list(path):
+	"""The files of a .f list, as used by the example_soc synth flows"""
+	files = []
+	base = os.path.dirname(path)
+	with open(path) as f:
+		for l in f:
+			kind, _, arg = l.strip().partition(" ")
+			if kind == "file":
+				files.append(os.path.join(base, arg.strip()))
+			elif kind == "list":
+				files.extend(file_list(os.path.join(base, arg.strip())))
+	return files
+
+def synth_area(v, synth, top):
+	"""Synthesise the processor with this variant's parameters. Returns the
+	area (see SYNTH_CMDS), or None."""
+	cmd, cell, _ = SYNTH_CMDS[synth]
+	# Array-valued parameters (PMP_HARDWIRED etc) keep their defaults, which
+	# follow PMP_REGIONS and NUM_IRQS
+	chparams = " ".join(f"-chparam {k} {val}" for k, val in v.params.items() if "{" not in val)
+	script = (f"read_verilog -I {HDL_DIR} {' '.join(file_list(os.path.join(HDL_DIR, 'hazard3.f')))}; "
+		f"hierarchy -top {top} {chparams}; {cmd.format(top=top)}; tee -o {{stat}} stat")
+	with tempfile.TemporaryDirectory() as tmp:
+		stat = os.path.join(tmp, "stat.txt")
+		p = subprocess.run(["yosys", "-q", "-p", script.format(stat=stat)], stdout=subprocess.DEVNULL,
+			stderr=subprocess.DEVNULL)
+		if p.returncode != 0 or not os.path.exists(stat):
+			return None
+		with open(stat) as f:
+			text = f.read()
+	# The count comes before the cell name in newer yosys, after it in older
+	counts = {}
+	for l in text.splitlines():
+		m = re.match(r"^\s*(\d+)\s+(\S+)\s*$", l) or re.match(r"^\s*(\S+)\s+(\d+)\s*$", l)
+		if m:
+			n, name = (m.group(1), m.group(2)) if m.group(1).isdigit() else (m.group(2), m.group(1))
+			counts[name] = int(n)
+	if cell is None:
+		m = re.search(r"Number of cells:\s+(\d+)", text) or re.search(r"^\s*(\d+)\s+cells\s*$", text, re.M)
+		return int(m.group(1)) if m else None
+	return counts.get(cell)
+
+def geomean(xs):
+	return math.exp(sum(math.log(x) for x in xs) / len(xs)) if xs else None
+
+def score(v, ref):
+	"""Geometric mean speedup over ref, across the workloads both ran"""
+	common = [n for n in ref.results if n in v.results]
+	return geomean([ref.results[n]["cycles"] / v.results[n]["cycles"] for n in common])
+
+def pareto(varis, ref):
+	"""Variants for which no other variant is at least as small and as fast,
+	and strictly one of the two"""
+	points = [(v, v.area, score(v, ref)) for v in varis if v.area is not None and v.results]
+	front = set()
+	for v, a, s in points:
+		if s is None:
+			continue
+		if not any(s2 is not None and a2 <= a and s2 >= s and (a2 < a or s2 > s) for _, a2, s2 in points):
+			front.add(v.name)
+	return front
+
+def print_results(varis, synth, embench):
+	ok = [v for v in varis if not v.error]
+	if not ok:
+		return
+	# Speedups are relative to the variant which ran the most workloads
+	ref = max(ok, key=lambda v: len(v.results))
+	front = pareto(ok, ref)
+	unit = SYNTH_CMDS[synth][2] if synth != "none" else "area"
+	embench_names = list(embench)
+	print(f"{'variant':<16}{unit:>10}{'CM/MHz':>9}{'DMIPS/MHz':>11}{'Embench':>9}{'speedup':>9}  parameters")
+	for v in sorted(ok, key=lambda v: (v.area is None, v.area or 0, v.name)):
+		cm = v.results.get("coremark", {}).get("per_mhz")
+		dh = v.results.get("dhrystone", {}).get("per_mhz")
+		emb = [ref.results[n]["cycles"] / v.results[n]["cycles"] for n in embench_names
+			if n in v.results and n in ref.results]
+		s = score(v, ref)
+		def fmt(x, w, prec=3):
+			return f"{x:>{w}.{prec}f}" if x is not None else f"{'-':>{w}}"
+		area = f"{v.area:>10}" if v.area is not None else f"{'-':>10}"
+		mark = "*" if v.name in front else " "
+		desc = " ".join(f"{k}={val}" for k, val in v.overrides.items())
+		print(f"{mark}{v.name:<15}{area}{fmt(cm, 9)}{fmt(dh, 11)}{fmt(geomean(emb), 9)}{fmt(s, 9)}  {desc}")
+	print(f"\nSpeedups are in cycles, relative to {ref.name}. * marks the Pareto front of {unit} against speedup.")
+	for v in varis:
+		if v.error:
+			print(f"\n{v.name} ({' '.join(f'{k}={val}' for k, val in v.overrides.items())}): {v.error}")
+
+def main():
+	parser = argparse.ArgumentParser()
+	parser.add_argument("--param", action="append", default=[], metavar="NAME=v1,v2,...",
+		help="Values to sweep for one config parameter (can be repeated)")
+	parser.add_argument("--base", default="default", help="Base config, tb_cxxrtl/config_<base>.vh (default: default)")
+	parser.add_argument("--jobs", type=int, default=4, help="Variants to build at once (default 4)")
+	parser.add_argument("--synth", choices=[*SYNTH_CMDS, "none"], default="ice40",
+		help="Synthesis flow for the area (default ice40)")
+	parser.add_argument("--top", default="hazard3_cpu_2port",
+		help="Module to synthesise (default hazard3_cpu_2port, as in the tb topology)")
+	parser.add_argument("--embench-isa", default="M,C,ZBA,ZBB,ZBS",
+		help="Extensions which the Embench build needs (default M,C,ZBA,ZBB,ZBS)")
+	parser.add_argument("--json", help="Append the results to this file, one JSON object per line")
+	args = parser.parse_args()
+
+	varis = variants(args.base, args.param)
+	print(f"{len(varis)} variants of config_{args.base}.vh", file=sys.stderr)
+
+	# Each build gets a share of the host's cores
+	jobs = max(1, min(args.jobs, len(varis)))
+	make_jobs = max(1, (os.cpu_count() or 1) // jobs)
+	with concurrent.futures.ThreadPoolExecutor(jobs) as pool:
+		for v, err in zip(varis, pool.map(lambda v: build_tb(v, make_jobs), varis)):
+			v.error = err
+			print(f"Built {v.name}" + (" (failed)" if err else ""), file=sys.stderr)
+
+	elfs, embench = software([v for v in varis if not v.error])
+	embench_isa = [e.strip().upper() for e in args.embench_isa.split(",") if e.strip()]
+	with concurrent.futures.ThreadPoolExecutor(os.cpu_count() or 1) as pool:
+		list(pool.map(lambda v: bench(v, elfs, embench, embench_isa), [v for v in varis if not v.error]))
+		if args.synth != "none":
+			ok = [v for v in varis if not v.error]
+			for v, area in zip(ok, pool.map(lambda v: synth_area(v, args.synth, args.top), ok)):
+				v.area = area
+
+	print_results(varis, args.synth, embench)
+
+	if args.json:
+		with open(args.json, "a") as f:
+			f.write(json.dumps({"time": int(time.time()), "base": args.base, "synth": args.synth, "top": args.top,
+				"variants": [{"name": v.name, "overrides": v.overrides, "march": v.march(), "area": v.area,
+				"error": v.error, "results": v.results} for v in varis]}) + "\n")
+
+if __name__ == "__main__":
+	main()
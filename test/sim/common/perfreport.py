@@ -0,0 +1,196 @@
+#!/usr/bin/env python3
+
+import argparse
+import json
+import os
+import platform
+import subprocess
+import sys
+import time
+
+import configsweep
+import simbench
+
+# Guest performance record, for catching changes to the RTL (e.g. frontend or
+# bypass) which cost performance. Builds CoreMark and Dhrystone with fixed
+# flags, runs them on tb and on rvcpp's timing model, and prints CoreMark/MHz
+# and DMIPS/MHz for each, e.g.
+#
+#   perfreport.py --json perf.jsonl
+#
+# Scores come from the cycles in each benchmark's region of interest (its
+# timed loop), as printed by both simulators at exit: tb's cycles, and
+# rvcpp --timing's model cycles. Failing that, they come from the
+# benchmark's own output.
+#
+# --json appends a record per run, with the commit of the tree and of the
+# last change to hdl/, and compares with the last record in the file for a
+# different RTL commit. Any score which dropped by more than --threshold
+# is flagged, and the exit code is 1.
+
+SIM_DIR = simbench.SIM_DIR
+HDL_DIR = configsweep.HDL_DIR
+
+# Fixed, so that scores only move with the RTL (and the compiler version,
+# which is part of the record)
+MARCH = "rv32imac_zicsr_zifencei_zba_zbb_zbkb_zbs"
+DHRYSTONE_CFLAGS = f"-O3 -fno-inline -march={MARCH} -Wno-implicit-function-declaration -Wno-implicit-int"
+BUILD_NAME = "perfreport"
+
+CROSS_GCC = "riscv32-unknown-elf-gcc"
+
+def software():
+	"""Build both benchmarks. Returns {name: elf}."""
+	simbench.build(["make", "-C", os.path.join(SIM_DIR, "coremark", "dist"), f"MARCH={MARCH}",
+		f"OPATH=build/{BUILD_NAME}/", f"build/{BUILD_NAME}/coremark.elf"])
+	simbench.build(["make", "-C", os.path.join(SIM_DIR, "dhrystone"), f"TMP_PREFIX=tmp/{BUILD_NAME}/",
+		f"CCFLAGS={DHRYSTONE_CFLAGS}", f"tmp/{BUILD_NAME}/dhrystone.elf"])
+	return {
+		"coremark": os.path.join(SIM_DIR, "coremark", "dist", "build", BUILD_NAME, "coremark.elf"),
+		"dhrystone": os.path.join(SIM_DIR, "dhrystone", "tmp", BUILD_NAME, "dhrystone.elf"),
+	}
+
+def roi_cycles(out, column):
+	"""(cycles, entries) in region 1 from the "Regions of interest" table at
+	exit, using the named counter column, or None. Columns are fixed width,
+	as names may contain spaces."""
+	lines = out.splitlines()
+	for i, l in enumerate(lines):
+		if l.strip() != "Regions of interest:" or i + 1 >= len(lines):
+			continue
+		header = lines[i + 1]
+		names = [header[k:k + 15].strip() for k in range(19, len(header), 15)]
+		if column not in names:
+			return None
+		for row in lines[i + 2:]:
+			fields = row.split()
+			if len(fields) != 2 + len(names) or not all(f.isdigit() for f in fields):
+				break
+			if fields[0] == "1":
+				return int(fields[2 + names.index(column)]), int(fields[1])
+	return None
+
+def git(*args, cwd=SIM_DIR):
+	p = subprocess.run(["git", *args], cwd=cwd, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, text=True)
+	return p.stdout.strip() if p.returncode == 0 else None
+
+def compiler_version():
+	try:
+		p = subprocess.run([CROSS_GCC, "--version"], stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, text=True)
+		return p.stdout.splitlines()[0] if p.stdout else None
+	except OSError:
+		return None
+
+def score(sim, simargs, column, elfs):
+	"""Run both benchmarks on one simulator. Returns {benchmark: {per_mhz,
+	cycles, source}}, leaving out any which failed."""
+	results = {}
+	out = subprocess.run([sim, *simargs, "--elf", elfs["coremark"], "--cycles", "100000000"],
+		stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, text=True).stdout
+	iters = configsweep.field(out, "Iterations")
+	errors = [l for l in out.splitlines() if "ERROR!" in l and "at least 10 secs" not in l]
+	roi = roi_cycles(out, column)
+	ticks = configsweep.field(out, "Total ticks")
+	if iters and not errors:
+		if roi and roi[1] == 1:
+			results["coremark"] = {"per_mhz": int(iters) / (roi[0] / 1e6), "cycles": roi[0], "source": "roi"}
+		elif ticks:
+			results["coremark"] = {"per_mhz": int(iters) / (int(ticks) / 1e6), "cycles": int(ticks),
+				"source": "output"}
+
+	out = subprocess.run([sim, *simargs, "--elf", elfs["dhrystone"], "--cycles", "10000000"],
+		stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, text=True).stdout
+	runs = None
+	for l in out.splitlines():
+		if l.startswith("Trying ") and l.endswith(" runs through Dhrystone:"):
+			runs = int(l.split()[1])
+	roi = roi_cycles(out, column)
+	dhry = configsweep.field(out, "Dhrystones per Second")
+	# The ROI totals cover every attempt, so are only usable for one
+	if runs and roi and roi[1] == 1:
+		results["dhrystone"] = {"per_mhz": runs / (roi[0] / 1e6) / configsweep.DHRYSTONES_PER_DMIPS,
+			"cycles": roi[0], "source": "roi"}
+	elif dhry:
+		results["dhrystone"] = {"per_mhz": int(dhry) / configsweep.DHRYSTONES_PER_DMIPS, "cycles": None,
+			"source": "output"}
+	return results
+
+def baseline(path, rtl_commit):
+	"""The last record in a --json file for another RTL commit, or None"""
+	if not os.path.exists(path):
+		return None
+	with open(path) as f:
+		records = [json.loads(l) for l in f if l.strip()]
+	for r in reversed(records):
+		if r.get("rtl_commit") != rtl_commit:
+			return r
+	return None
+
+def compare(results, old, threshold):
+	"""Print the change in each score. Returns the number of drops beyond the
+	threshold."""
+	drops = 0
+	print(f"Relative to {old.get('rtl_commit') or 'unknown'} ({old.get('commit') or 'unknown'}):")
+	for sim, r in results.items():
+		for bench, s in r.items():
+			o = old["results"].get(sim, {}).get(bench)
+			if not o:
+				continue
+			ratio = s["per_mhz"] / o["per_mhz"]
+			flag = ""
+			if ratio < 1 - threshold:
+				flag = "  DROP"
+				drops += 1
+			print(f"  {sim:<14}{bench:<12}{o['per_mhz']:>9.3f} -> {s['per_mhz']:>9.3f}{ratio:>9.4f}x{flag}")
+	return drops
+
+def main():
+	parser = argparse.ArgumentParser()
+	parser.add_argument("--tb", default=os.path.join(SIM_DIR, "tb_cxxrtl", "tb"),
+		help="tb executable (default tb_cxxrtl/tb), or \"none\"")
+	parser.add_argument("--rvcpp", default=os.path.join(SIM_DIR, "rvcpp", "rvcpp"),
+		help="rvcpp executable, run with --timing (default rvcpp/rvcpp), or \"none\"")
+	parser.add_argument("--json", help="Append the results to this file, one JSON object per line, "
+		"and compare with the last record for another RTL commit")
+	parser.add_argument("--threshold", type=float, default=0.001,
+		help="Relative drop in a score reported as a regression (default 0.001)")
+	args = parser.parse_args()
+
+	sims = []
+	if args.tb != "none":
+		sims.append(("tb", args.tb, [], "cycles"))
+	if args.rvcpp != "none":
+		sims.append(("rvcpp-timing", args.rvcpp, ["--timing"], "model cycles"))
+	if not sims:
+		sys.exit("Nothing to run: both --tb and --rvcpp are none")
+
+	elfs = software()
+	results = {}
+	for name, sim, simargs, column in sims:
+		print(f"Running on {sim}", file=sys.stderr)
+		results[name] = score(sim, simargs, column, elfs)
+
+	print(f"{'simulator':<16}{'CoreMark/MHz':>14}{'DMIPS/MHz':>12}")
+	for name, r in results.items():
+		cm = r.get("coremark", {}).get("per_mhz")
+		dh = r.get("dhrystone", {}).get("per_mhz")
+		print(f"{name:<16}" + (f"{cm:>14.3f}" if cm else f"{'-':>14}") + (f"{dh:>12.3f}" if dh else f"{'-':>12}"))
+	missing = [f"{name}/{b}" for name, r in results.items() for b in ("coremark", "dhrystone") if b not in r]
+	if missing:
+		print(f"No score for: {', '.join(missing)}")
+
+	drops = 0
+	if args.json:
+		rtl_commit = git("log", "-1", "--format=%H", "--", HDL_DIR)
+		old = baseline(args.json, rtl_commit)
+		if old:
+			drops = compare(results, old, args.threshold)
+		with open(args.json, "a") as f:
+			f.write(json.dumps({"time": int(time.time()), "host": platform.node(), "commit": git("rev-parse", "HEAD"),
+				"rtl_commit": rtl_commit, "dirty": bool(git("status", "--porcelain", "--", HDL_DIR)),
+				"compiler": compiler_version(), "march": MARCH, "results": results}) + "\n")
+	if drops or missing:
+		sys.exit(1)
+
+if __name__ == "__main__":
+	main()
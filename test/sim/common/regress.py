@@ -0,0 +1,453 @@
+#!/usr/bin/env python3
+
+import argparse
+import glob
+import hashlib
+import heapq
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import threading
+import time
+
+# Parallel regression orchestrator. Builds a tb_cxxrtl for each selected
+# config_*.vh, then runs sw_testcases, riscv-tests ISA tests and (for the
+# default config) the riscv-arch-test compliance suites against it.
+#
+# Every step is a job in one dependency graph: tb build -> simulate, test
+# compile -> simulate, ISA build -> simulate. Jobs become ready as their
+# dependencies finish, so compiling one test overlaps with simulating
+# another. Idle workers always take the ready job with the longest expected
+# critical path, estimated from the cycle counts recorded on earlier runs, so
+# the slowest tests don't end up straggling at the end.
+#
+# Compiled sw_testcases binaries are cached under sw_testcases/tmp/cache,
+# keyed on a hash of the sources, makefiles and the toolchain version, so only
+# tests whose inputs changed are recompiled.
+
+SIM_DIR = os.path.abspath(os.path.join(os.path.dirname(__file__), ".."))
+TB_DIR = os.path.join(SIM_DIR, "tb_cxxrtl")
+SW_DIR = os.path.join(SIM_DIR, "sw_testcases")
+ISA_DIR = os.path.join(SIM_DIR, "riscv-tests", "riscv-tests", "isa")
+COMPLIANCE_DIR = os.path.join(SIM_DIR, "riscv-compliance", "riscv-arch-test")
+CACHE_DIR = os.path.join(SW_DIR, "tmp", "cache")
+CROSS_PREFIX = "riscv32-unknown-elf-"
+
+SW_MAX_CYCLES = 1000000
+ISA_MAX_CYCLES = 10000
+COMPLIANCE_DEVICES = ["I", "M", "C"]
+
+# Cost assumed for jobs with no history: cycles for simulations, and a large
+# constant for builds, which always gate something.
+DEFAULT_SIM_COST = SW_MAX_CYCLES // 10
+BUILD_COST = 10 ** 9
+
+class Job:
+	def __init__(self, name, func, deps=(), cost=0):
+		self.name = name
+		self.func = func
+		self.deps = list(deps)
+		self.cost = cost
+		self.dependents = []
+		self.n_pending = 0
+		self.priority = 0
+		self.passed = None
+		self.message = ""
+		self.cycles = None
+
+class Scheduler:
+	def __init__(self, n_workers, history):
+		self.n_workers = n_workers
+		self.history = history
+		self.jobs = []
+		self.ready = []
+		self.lock = threading.Condition()
+		self.n_unfinished = 0
+		self.seq = 0
+
+	def add(self, job):
+		self.jobs.append(job)
+		for d in job.deps:
+			d.dependents.append(job)
+		return job
+
+	def _push(self, job):
+		# heapq is a min-heap; seq keeps ordering stable between equal costs
+		heapq.heappush(self.ready, (-job.priority, self.seq, job))
+		self.seq += 1
+
+	def _update_priorities(self):
+		# Priority is the job's own cost plus its most expensive chain of
+		# dependents. Jobs are added after their dependencies, so walk backward.
+		for job in reversed(self.jobs):
+			job.priority = job.cost + max((d.priority for d in job.dependents), default=0)
+
+	def add_dynamic(self, job):
+		"""Add a job from inside a running job, e.g. tests discovered by a build"""
+		with self.lock:
+			self.add(job)
+			job.priority = job.cost
+			self.n_unfinished += 1
+			job.n_pending = sum(1 for d in job.deps if d.passed is None)
+			if any(d.passed is False for d in job.deps):
+				self._skip(job)
+			elif job.n_pending == 0:
+				self._push(job)
+				self.lock.notify()
+
+	def _skip(self, job):
+		job.passed = False
+		job.message = "skipped: dependency failed"
+		self.n_unfinished -= 1
+		for d in job.dependents:
+			if d.passed is None:
+				self._skip(d)
+
+	def _finish(self, job):
+		self.n_unfinished -= 1
+		for d in job.dependents:
+			if d.passed is not None:
+				continue
+			if not job.passed:
+				self._skip(d)
+			else:
+				d.n_pending -= 1
+				if d.n_pending == 0:
+					self._push(d)
+		self.lock.notify_all()
+
+	def _worker(self):
+		while True:
+			with self.lock:
+				while not self.ready and self.n_unfinished > 0:
+					self.lock.wait()
+				if not self.ready:
+					return
+				_, _, job = heapq.heappop(self.ready)
+			try:
+				job.passed, job.message = job.func(job)
+			except Exception as e:
+				job.passed, job.message = False, f"exception: {e}"
+			with self.lock:
+				if job.cycles is not None:
+					self.history[job.name] = job.cycles
+				report(job)
+				self._finish(job)
+
+	def run(self):
+		self._update_priorities()
+		with self.lock:
+			self.n_unfinished = len(self.jobs)
+			for job in self.jobs:
+				job.n_pending = len(job.deps)
+				if job.n_pending == 0:
+					self._push(job)
+		workers = [threading.Thread(target=self._worker) for i in range(self.n_workers)]
+		for w in workers:
+			w.start()
+		for w in workers:
+			w.join()
+
+def report(job):
+	status = "\033[32m[PASSED]\033[39m" if job.passed else "\033[31m[FAILED]\033[39m"
+	extra = f" ({job.cycles} cycles)" if job.cycles is not None and job.passed else ""
+	msg = f" {job.message}" if job.message and not job.passed else ""
+	print(f"{job.name:<50}{status}{extra}{msg}", flush=True)
+
+def run_cmd(cmdline, timeout=None, **kwargs):
+	try:
+		return subprocess.run(cmdline, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+			timeout=timeout, **kwargs)
+	except subprocess.TimeoutExpired:
+		return None
+
+def ran_for_cycles(output_lines):
+	for l in reversed(output_lines):
+		m = re.match(r"Ran for (\d+) cycles", l)
+		if m:
+			return int(m.group(1))
+	return None
+
+###############################################################################
+# Testbench builds
+
+def tb_exec_name(config):
+	return "tb" if config == "default" else f"tb-{config}"
+
+def tb_build_job(config, tb_path):
+	def func(job):
+		ret = run_cmd(["make", "-C", TB_DIR, f"CONFIG={config}", f"TBEXEC={os.path.basename(tb_path)}",
+			f"BUILD_DIR=build-{os.path.basename(tb_path)}"], timeout=3600)
+		if ret is None:
+			return False, "timed out"
+		if ret.returncode != 0:
+			return False, "tb build failed"
+		return True, ""
+	return Job(f"build/{config}/tb", func, cost=BUILD_COST)
+
+###############################################################################
+# sw_testcases
+
+def file_hash(h, path):
+	h.update(path.encode())
+	with open(path, "rb") as f:
+		h.update(f.read())
+
+def toolchain_hash():
+	h = hashlib.sha256()
+	try:
+		h.update(subprocess.run([CROSS_PREFIX + "gcc", "-v"], stdout=subprocess.PIPE,
+			stderr=subprocess.STDOUT).stdout)
+		h.update(subprocess.run([CROSS_PREFIX + "gcc", "-print-prog-name=cc1"],
+			stdout=subprocess.PIPE).stdout)
+	except FileNotFoundError:
+		pass
+	return h.hexdigest()
+
+def sw_source_hash(test, toolchain):
+	# Conservative: any shared header, startup file or makefile change
+	# invalidates every test.
+	h = hashlib.sha256(toolchain.encode())
+	common = os.path.join(SIM_DIR, "common")
+	paths = [os.path.join(SW_DIR, f"{test}.c"), os.path.join(SW_DIR, "Makefile")]
+	paths += sorted(glob.glob(os.path.join(SW_DIR, "include", "*")))
+	paths += sorted(glob.glob(os.path.join(common, "*.[chSs]")))
+	paths += sorted(glob.glob(os.path.join(common, "*.ld")))
+	paths += sorted(glob.glob(os.path.join(common, "*.mk")))
+	for p in paths:
+		file_hash(h, p)
+	return h.hexdigest()[:24]
+
+def sw_compile_job(test, toolchain, state):
+	def func(job):
+		key = sw_source_hash(test, toolchain)
+		cached = os.path.join(CACHE_DIR, f"{test}-{key}.bin")
+		state["bin"] = cached
+		if os.path.exists(cached):
+			return True, ""
+		prefix = f"tmp/build/{test}/"
+		ret = run_cmd(["make", "-C", SW_DIR, f"APP={test}", f"TMP_PREFIX={prefix}", "bin"], timeout=300)
+		if ret is None or ret.returncode != 0:
+			return False, "[MK ERR]"
+		os.makedirs(CACHE_DIR, exist_ok=True)
+		# Write then rename, so concurrent runs never see a partial binary
+		shutil.copyfile(os.path.join(SW_DIR, prefix, f"{test}.bin"), cached + ".part")
+		os.replace(cached + ".part", cached)
+		return True, ""
+	return Job(f"compile/{test}", func, cost=1)
+
+def expected_output(test):
+	test_src = open(os.path.join(SW_DIR, f"{test}.c")).read()
+	if "/*EXPECTED-OUTPUT" not in test_src:
+		return None
+	expected_start = test_src.find("/*EXPECTED-OUTPUT")
+	expected_end = test_src.find("*/", expected_start)
+	expected_lines = test_src[expected_start:expected_end + 1].splitlines()[1:-1]
+	while expected_lines and expected_lines[0].strip() == "":
+		del expected_lines[0]
+	while expected_lines and expected_lines[-1].strip() == "":
+		del expected_lines[-1]
+	# Same rules as runtests: single-line comments are stripped
+	for i, l in enumerate(expected_lines):
+		if "//" in l:
+			expected_lines[i] = l.split("//")[0].rstrip()
+	return expected_lines
+
+def sw_sim_job(test, config, tb_path, tbargs, state, deps, history):
+	name = f"sw/{config}/{test}"
+	def func(job):
+		ret = run_cmd([tb_path, "--bin", state["bin"], "--cycles", str(SW_MAX_CYCLES), *tbargs], timeout=60)
+		if ret is None:
+			return False, "[TIMOUT]"
+		log_dir = os.path.join(SW_DIR, "tmp", config)
+		os.makedirs(log_dir, exist_ok=True)
+		with open(os.path.join(log_dir, f"{test}.log"), "wb") as f:
+			f.write(ret.stdout)
+		if ret.returncode != 0:
+			return False, "Negative return code from testbench!"
+		output_lines = ret.stdout.decode("utf-8", "replace").strip().splitlines()
+		job.cycles = ran_for_cycles(output_lines)
+		returncode = -1
+		if len(output_lines) >= 2 and output_lines[-2].startswith("CPU requested halt"):
+			try:
+				returncode = int(output_lines[-2].split(" ")[-1])
+			except ValueError:
+				pass
+		if returncode != 0:
+			return False, "[BADRET]"
+		expected = expected_output(test)
+		if expected is not None:
+			output_lines = output_lines[:-2]
+			while output_lines and output_lines[0].strip() == "":
+				del output_lines[0]
+			while output_lines and output_lines[-1].strip() == "":
+				del output_lines[-1]
+			if expected != output_lines:
+				return False, "[BADOUT]"
+		return True, ""
+	return Job(name, func, deps, cost=history.get(name, DEFAULT_SIM_COST))
+
+###############################################################################
+# riscv-tests ISA tests
+
+ISA_SUITES = ["rv32ui", "rv32uc", "rv32um", "rv32ua", "rv32mi"]
+
+def isa_build_job():
+	def func(job):
+		ret = run_cmd(["make", "-C", ISA_DIR, f"-j{os.cpu_count()}", "XLEN=32", "SKIP_V=1", *ISA_SUITES],
+			timeout=1800)
+		if ret is None or ret.returncode != 0:
+			return False, "ISA test build failed"
+		return True, ""
+	return Job("build/riscv-tests", func, cost=BUILD_COST)
+
+def isa_sim_job(binpath, config, tb_path, tbargs, deps, history):
+	test = os.path.basename(binpath)[:-len(".bin")]
+	name = f"isa/{config}/{test}"
+	def func(job):
+		ret = run_cmd([tb_path, "--bin", binpath, "--cycles", str(ISA_MAX_CYCLES), "--cpuret", *tbargs],
+			timeout=60)
+		if ret is None:
+			return False, "[TIMOUT]"
+		job.cycles = ran_for_cycles(ret.stdout.decode("utf-8", "replace").splitlines())
+		return ret.returncode == 0, f"return code {ret.returncode}"
+	return Job(name, func, deps, cost=history.get(name, ISA_MAX_CYCLES))
+
+def isa_expand_job(sched, isa_build, configs, tb_jobs, tbargs, history):
+	# The list of ISA tests is only known once their build has finished
+	def func(job):
+		bins = sorted(glob.glob(os.path.join(ISA_DIR, "**", "*-p-*.bin"), recursive=True))
+		if not bins:
+			return False, "no ISA test binaries found"
+		for b in bins:
+			for config, (tb_path, tb_job) in zip(configs, tb_jobs):
+				deps = [isa_build] + ([tb_job] if tb_job else [])
+				sched.add_dynamic(isa_sim_job(b, config, tb_path, tbargs, deps, history))
+		return True, ""
+	return Job("expand/riscv-tests", func, [isa_build], cost=1)
+
+###############################################################################
+# riscv-arch-test compliance
+
+def compliance_job(device, deps):
+	# The hazard3 target in riscv-arch-test runs the default tb_cxxrtl build,
+	# so this only runs against the default config.
+	def func(job):
+		ret = run_cmd(["make", "-C", COMPLIANCE_DIR, "RISCV_TARGET=hazard3", f"RISCV_DEVICE={device}"],
+			timeout=3600)
+		if ret is None:
+			return False, "timed out"
+		if ret.returncode != 0:
+			msg = "see riscv-arch-test output"
+			if device == "C":
+				msg += " (cebreak-01 is an expected failure)"
+			return False, msg
+		return True, ""
+	return Job(f"compliance/default/{device}", func, deps, cost=BUILD_COST)
+
+###############################################################################
+
+def main():
+	parser = argparse.ArgumentParser(formatter_class=argparse.RawDescriptionHelpFormatter)
+	parser.add_argument("tests", nargs="*", help="sw_testcases tests to run (default: all)")
+	parser.add_argument("--config", action="append", default=[],
+		help="tb_cxxrtl config to test, i.e. XXX for config_XXX.vh. Can pass multiple times. Default: all configs.")
+	parser.add_argument("--suite", action="append", choices=["sw", "isa", "compliance"], default=[],
+		help="Test suite to run. Can pass multiple times. Default: all suites whose sources are present.")
+	parser.add_argument("--tb", help="Use this simulator executable instead of building tb_cxxrtl for each config, e.g. ../rvcpp/rvcpp")
+	parser.add_argument("--tbarg", action="append", default=[], help="Extra argument to pass to the simulator. Can pass multiple times.")
+	parser.add_argument("-j", type=int, default=os.cpu_count(), help="Number of parallel jobs")
+	parser.add_argument("--history", default=os.path.join(SIM_DIR, "sw_testcases", "tmp", "regress_history.json"),
+		help="File used to keep cycle counts between runs, for scheduling the longest jobs first")
+	parser.epilog = """
+Example command lines:
+
+Run everything, for every config:
+./regress.py
+
+Run sw_testcases only, against the minimal config:
+./regress.py --suite sw --config min
+
+Run sw_testcases under rvcpp:
+./regress.py --suite sw --tb ../rvcpp/rvcpp
+"""
+	args = parser.parse_args()
+
+	if args.tb:
+		configs = ["custom"]
+	elif args.config:
+		configs = args.config
+	else:
+		configs = sorted(os.path.basename(p)[len("config_"):-len(".vh")]
+			for p in glob.glob(os.path.join(TB_DIR, "config_*.vh")))
+
+	suites = args.suite
+	if not suites:
+		suites = ["sw"]
+		if os.path.isdir(ISA_DIR):
+			suites.append("isa")
+		if os.path.isdir(COMPLIANCE_DIR):
+			suites.append("compliance")
+
+	history = {}
+	if os.path.exists(args.history):
+		with open(args.history) as f:
+			history = json.load(f)
+
+	sched = Scheduler(max(1, args.j), history)
+
+	tb_jobs = []
+	for config in configs:
+		if args.tb:
+			tb_jobs.append((os.path.abspath(args.tb), None))
+		else:
+			tb_path = os.path.join(TB_DIR, tb_exec_name(config))
+			tb_jobs.append((tb_path, sched.add(tb_build_job(config, tb_path))))
+
+	if "sw" in suites:
+		testlist = [t[:-2] if t.endswith(".c") else t for t in args.tests]
+		if not testlist:
+			testlist = [p[:-2] for p in os.listdir(SW_DIR) if p.endswith(".c")]
+		toolchain = toolchain_hash()
+		for test in sorted(testlist):
+			state = {}
+			compile_job = sched.add(sw_compile_job(test, toolchain, state))
+			for config, (tb_path, tb_job) in zip(configs, tb_jobs):
+				deps = [compile_job] + ([tb_job] if tb_job else [])
+				sched.add(sw_sim_job(test, config, tb_path, args.tbarg, state, deps, history))
+
+	if "isa" in suites:
+		isa_build = sched.add(isa_build_job())
+		sched.add(isa_expand_job(sched, isa_build, configs, tb_jobs, args.tbarg, history))
+
+	if "compliance" in suites:
+		if "default" in configs and not args.tb:
+			tb_job = tb_jobs[configs.index("default")][1]
+			for device in COMPLIANCE_DEVICES:
+				sched.add(compliance_job(device, [tb_job]))
+		else:
+			print("Compliance suites only run against the default tb_cxxrtl config, skipping.")
+
+	t_start = time.time()
+	sched.run()
+
+	os.makedirs(os.path.dirname(args.history), exist_ok=True)
+	with open(args.history + ".part", "w") as f:
+		json.dump(history, f, indent=1, sort_keys=True)
+	os.replace(args.history + ".part", args.history)
+
+	failed = [j for j in sched.jobs if not j.passed]
+	n_tests = sum(1 for j in sched.jobs if j.name.split("/")[0] in ("sw", "isa", "compliance"))
+	n_failed = sum(1 for j in failed if j.name.split("/")[0] in ("sw", "isa", "compliance"))
+	print(f"\nPassed: {n_tests - n_failed} out of {n_tests} in {time.time() - t_start:.1f} s")
+	if failed:
+		print("Failed:")
+		for j in failed:
+			print(f"  {j.name}: {j.message}")
+	sys.exit(1 if failed else 0)
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,299 @@
+#!/usr/bin/env python3
+
+import argparse
+import json
+import math
+import os
+import platform
+import subprocess
+import sys
+import tempfile
+import time
+
+# Simulator throughput benchmark, and the training set for the PGO builds
+# (`make pgo` in rvcpp and tb_cxxrtl). Builds fixed workloads (hellow,
+# CoreMark, Dhrystone, an Embench subset, the sw_testcases, and a generated
+# JTAG debug session), runs each on every simulator given, and reports:
+#
+# - Wall-clock time, and simulated cycles per second (for rvcpp, one cycle is
+#   one instruction, so 1000 kHz is 1 MIPS). For the JTAG session, the rate
+#   is JTAG pin writes per second.
+# - Peak RSS
+# - Startup time, i.e. the time to run hellow for one cycle
+#
+# Times are the fastest of --repeat runs. With more than one simulator, each
+# is also compared with the first, e.g.
+#
+#   simbench.py ../rvcpp/rvcpp ../rvcpp/rvcpp-pgo
+#
+# --json appends the results to a file, one JSON object per line, and
+# --baseline compares against the last results in such a file, exiting with
+# an error if any time regressed by more than --threshold.
+#
+# With --train, each simulator just runs the workloads once, and nothing is
+# reported.
+
+SIM_DIR = os.path.abspath(os.path.join(os.path.dirname(__file__), ".."))
+SW_DIR = os.path.join(SIM_DIR, "sw_testcases")
+EMBENCH_DIR = os.path.join(SIM_DIR, "embench", "embench-iot")
+
+# Integer-heavy benchmarks, which don't just measure the soft float library
+EMBENCH_SUBSET = ["crc32", "edn", "huffbench", "matmult-int", "nettle-sha256", "primecount", "wikisort"]
+
+JTAG_ROUNDS = 100
+
+class Workload:
+	def __init__(self, name, runs, requires=None, jtag_writes=None):
+		self.name = name
+		# One argument list for each simulator invocation
+		self.runs = runs
+		# Simulator option this workload needs, e.g. --jtagreplay
+		self.requires = requires
+		# JTAG sessions don't report a cycle count, so their rate is in JTAG
+		# pin writes per second instead
+		self.jtag_writes = jtag_writes
+
+def build(cmd):
+	if subprocess.run(cmd, stdout=subprocess.DEVNULL).returncode != 0:
+		sys.exit(f"Failed: {' '.join(cmd)} (is the RISC-V toolchain on PATH?)")
+
+def bin_runs(bins, max_cycles):
+	return [["--bin", b, "--cycles", str(max_cycles)] for b in bins]
+
+def jtag_session(rounds):
+	"""OpenOCD remote bitbang commands, as recorded by tb --jtagdump, for a
+	session which repeatedly halts the hart, reads all of its GPRs through
+	abstract commands, and resumes it."""
+	out = []
+	def clk(tms, tdi=0, read=False):
+		out.append(str(tms << 1 | tdi))
+		if read:
+			out.append("R")
+		out.append(str(4 | tms << 1 | tdi))
+	def scan(ir, nbits, value):
+		# Run-Test/Idle -> Shift-xR -> Run-Test/Idle
+		clk(1)
+		if ir:
+			clk(1)
+		clk(0)
+		clk(0)
+		for i in range(nbits):
+			clk(int(i == nbits - 1), value >> i & 1, read=True)
+		clk(1)
+		clk(0)
+	def dmi(op, addr, data=0):
+		# 7 address bits, 32 data bits, 2 op bits, then idle for the DTMCS hint
+		scan(False, 41, addr << 34 | data << 2 | op)
+		for i in range(8):
+			clk(0)
+	DMI_NOP, DMI_READ, DMI_WRITE = 0, 1, 2
+	DMCONTROL, DMSTATUS, COMMAND, DATA0 = 0x10, 0x11, 0x17, 0x04
+
+	for i in range(5):
+		clk(1)
+	clk(0)
+	scan(True, 5, 0x11)
+	dmi(DMI_WRITE, DMCONTROL, 0)
+	dmi(DMI_WRITE, DMCONTROL, 0x00000001)
+	for r in range(rounds):
+		dmi(DMI_WRITE, DMCONTROL, 0x80000001)
+		dmi(DMI_READ, DMSTATUS)
+		dmi(DMI_NOP, 0)
+		dmi(DMI_WRITE, DMCONTROL, 0x00000001)
+		for reg in range(1, 32):
+			# 32-bit register read, x1 to x31
+			dmi(DMI_WRITE, COMMAND, 0x00221000 | reg)
+			dmi(DMI_READ, DATA0)
+			dmi(DMI_NOP, 0)
+		dmi(DMI_WRITE, DMCONTROL, 0x40000001)
+	out.append("Q")
+	return "".join(out)
+
+def workloads(tmpdir):
+	loads = []
+	build(["make", "-C", os.path.join(SIM_DIR, "hellow"), "bin"])
+	loads.append(Workload("hellow", bin_runs([os.path.join(SIM_DIR, "hellow", "tmp", "hellow.bin")], 100000)))
+
+	build(["make", "-C", os.path.join(SIM_DIR, "coremark"), "bin"])
+	loads.append(Workload("coremark", bin_runs([os.path.join(SIM_DIR, "coremark", "coremark.bin")], 100000000)))
+
+	build(["make", "-C", os.path.join(SIM_DIR, "dhrystone"), "bin"])
+	loads.append(Workload("dhrystone", bin_runs([os.path.join(SIM_DIR, "dhrystone", "tmp", "dhrystone.bin")], 1000000)))
+
+	# Embench is a submodule, and builds with its own scripts (see
+	# embench/Readme.md), so it is skipped if not checked out
+	if os.path.exists(os.path.join(EMBENCH_DIR, "build_all.py")):
+		bd = os.path.join(EMBENCH_DIR, "bd", "src")
+		if not all(os.path.exists(os.path.join(bd, b, b)) for b in EMBENCH_SUBSET):
+			build(["sh", "-c", f"cd {EMBENCH_DIR} && ./build_all.py --arch riscv32 --chip hazard3 --board hazard3tb"])
+		for b in EMBENCH_SUBSET:
+			loads.append(Workload(f"embench/{b}", [["--elf", os.path.join(bd, b, b), "--cycles", "100000000"]]))
+	else:
+		print(f"Skipping Embench: {EMBENCH_DIR} is not checked out", file=sys.stderr)
+
+	# The sw_testcases are each short, so they are one workload together
+	tests = sorted(f[:-2] for f in os.listdir(SW_DIR) if f.endswith(".c"))
+	for t in tests:
+		build(["make", "-C", SW_DIR, f"APP={t}", f"tmp/{t}.bin"])
+	loads.append(Workload("sw_testcases", bin_runs([os.path.join(SW_DIR, "tmp", f"{t}.bin") for t in tests], 1000000)))
+
+	jtag_path = os.path.join(tmpdir, "jtag_session.txt")
+	session = jtag_session(JTAG_ROUNDS)
+	with open(jtag_path, "w") as f:
+		f.write(session)
+	loads.append(Workload("jtag_session", [["--jtagreplay", jtag_path]], requires="--jtagreplay",
+		jtag_writes=sum(c.isdigit() for c in session)))
+	return loads
+
+def supports(sim, option):
+	# Both simulators print their usage for an unknown argument
+	p = subprocess.run([sim, "--help"], stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+	return option in p.stdout
+
+def run_once(sim, simargs, args):
+	"""Return (wall-clock seconds, simulated cycles or None, peak RSS in kB)"""
+	start = time.perf_counter()
+	p = subprocess.Popen([sim, *simargs, *args], stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, text=True)
+	out = p.stdout.read()
+	_, status, rusage = os.wait4(p.pid, 0)
+	# Reaped by wait4, for its rusage
+	p.returncode = os.waitstatus_to_exitcode(status)
+	elapsed = time.perf_counter() - start
+	cycles = None
+	for l in out.splitlines():
+		if l.startswith("Ran for "):
+			cycles = int(l.split()[2])
+	# No exit request, so the run ended at --cycles
+	if cycles is None and p.returncode == 0 and "--cycles" in args:
+		cycles = int(args[args.index("--cycles") + 1])
+	return elapsed, cycles, rusage.ru_maxrss
+
+def run_workload(sim, simargs, load, repeat):
+	# Exit codes are ignored: some tests are expected to fail under one of
+	# the simulators, and they still count towards throughput.
+	best = None
+	for i in range(repeat):
+		results = [run_once(sim, simargs, r) for r in load.runs]
+		seconds = sum(r[0] for r in results)
+		if best is None or seconds < best["seconds"]:
+			cycles = [r[1] for r in results]
+			best = {
+				"seconds": seconds,
+				"cycles": sum(cycles) if None not in cycles else None,
+				"peak_rss_kb": max(r[2] for r in results),
+			}
+	if load.jtag_writes is not None:
+		best["jtag_writes_per_second"] = load.jtag_writes / best["seconds"]
+	elif best["cycles"] is not None:
+		best["khz"] = best["cycles"] / best["seconds"] / 1000
+	return best
+
+def bench(sims, simargs, loads, repeat):
+	hellow = next(l for l in loads if l.name == "hellow")
+	results = {}
+	for sim in sims:
+		print(f"Benchmarking {sim}", file=sys.stderr)
+		startup = min(run_once(sim, simargs, ["--bin", hellow.runs[0][1], "--cycles", "1"])[0]
+			for i in range(repeat))
+		results[sim] = {"startup_seconds": startup, "workloads": {}}
+		for load in loads:
+			if load.requires and not supports(sim, load.requires):
+				continue
+			results[sim]["workloads"][load.name] = run_workload(sim, simargs, load, repeat)
+	return results
+
+def print_results(sims, results):
+	for sim in sims:
+		r = results[sim]
+		print(f"{sim}: startup {r['startup_seconds'] * 1000:.1f} ms")
+		print(f"  {'workload':<24}{'time':>10}{'rate':>14}{'peak RSS':>12}")
+		for name, w in r["workloads"].items():
+			rate = f"{w['khz']:.0f} kHz" if "khz" in w else \
+				f"{w['jtag_writes_per_second'] / 1000:.0f} k/s" if "jtag_writes_per_second" in w else "-"
+			print(f"  {name:<24}{w['seconds']:>8.3f} s{rate:>14}{w['peak_rss_kb'] / 1024:>9.1f} MB")
+		print()
+
+	if len(sims) > 1:
+		base = results[sims[0]]["workloads"]
+		print(f"Speedup relative to {sims[0]}:")
+		print(f"  {'workload':<24}" + "".join(f"{os.path.basename(s):>20}" for s in sims[1:]))
+		for name in base:
+			print(f"  {name:<24}" + "".join(
+				f"{base[name]['seconds'] / results[s]['workloads'][name]['seconds']:>19.2f}x"
+				if name in results[s]["workloads"] else f"{'-':>20}" for s in sims[1:]))
+		print(f"  {'geomean':<24}" + "".join(f"{geomean_speedup(base, results[s]['workloads']):>19.2f}x"
+			for s in sims[1:]))
+		print()
+
+def geomean_speedup(old, new):
+	common = [n for n in old if n in new]
+	if not common:
+		return float("nan")
+	return math.exp(sum(math.log(old[n]["seconds"] / new[n]["seconds"]) for n in common) / len(common))
+
+def compare_baseline(results, path, threshold):
+	"""Compare with the last record in a --json file. Simulators are matched by
+	file name. Return the number of regressions."""
+	with open(path) as f:
+		baseline = json.loads([l for l in f if l.strip()][-1])["results"]
+	by_name = {os.path.basename(k): v for k, v in baseline.items()}
+	regressions = 0
+	for sim, r in results.items():
+		old = by_name.get(os.path.basename(sim))
+		if old is None:
+			print(f"{sim}: not in baseline")
+			continue
+		print(f"{sim}: relative to baseline (time, peak RSS)")
+		rows = [("startup", old["startup_seconds"], r["startup_seconds"], None, None)]
+		for name, w in r["workloads"].items():
+			if name in old["workloads"]:
+				o = old["workloads"][name]
+				rows.append((name, o["seconds"], w["seconds"], o["peak_rss_kb"], w["peak_rss_kb"]))
+		for name, t_old, t_new, rss_old, rss_new in rows:
+			flag = ""
+			if t_new > t_old * (1 + threshold):
+				flag = "  REGRESSION"
+				regressions += 1
+			rss = f"{rss_new / rss_old:>8.2f}x" if rss_old else f"{'':>9}"
+			print(f"  {name:<24}{t_new / t_old:>8.2f}x{rss}{flag}")
+		print(f"  {'geomean speedup':<24}{geomean_speedup(old['workloads'], r['workloads']):>8.2f}x")
+		print()
+	return regressions
+
+def main():
+	parser = argparse.ArgumentParser()
+	parser.add_argument("sim", nargs="+", help="Simulator executables. Speedups are relative to the first.")
+	parser.add_argument("--simarg", action="append", default=[],
+		help="Extra argument passed to every simulator (can be repeated)")
+	parser.add_argument("--train", action="store_true", help="Run each workload once, without reporting anything")
+	parser.add_argument("--repeat", type=int, default=3, help="Take the fastest of this many runs")
+	parser.add_argument("--json", help="Append the results to this file, one JSON object per line")
+	parser.add_argument("--baseline", help="Compare with the last results in this --json file")
+	parser.add_argument("--threshold", type=float, default=0.05,
+		help="Relative slowdown against --baseline reported as a regression (default 0.05)")
+	args = parser.parse_args()
+
+	tmpdir = tempfile.TemporaryDirectory()
+	loads = workloads(tmpdir.name)
+	if args.train:
+		for sim in args.sim:
+			for load in loads:
+				if load.requires and not supports(sim, load.requires):
+					continue
+				print(f"Training {sim} on {load.name}")
+				for r in load.runs:
+					run_once(sim, args.simarg, r)
+		return
+
+	results = bench(args.sim, args.simarg, loads, args.repeat)
+	print_results(args.sim, results)
+
+	if args.json:
+		with open(args.json, "a") as f:
+			f.write(json.dumps({"time": int(time.time()), "host": platform.node(),
+				"simargs": args.simarg, "results": results}) + "\n")
+	if args.baseline and compare_baseline(results, args.baseline, args.threshold):
+		sys.exit(1)
+
+if __name__ == "__main__":
+	main()
@@ -15,6 +15,10 @@ TBDIR        := $(dir $(abspath $(TBEXEC)))
 INCDIR       ?= ../common
 MAX_CYCLES   ?= 100000
 TMP_PREFIX   ?= tmp/
+# Set to 1 to pass --fast-boot, skipping .bss clearing at startup
+FAST_BOOT    ?=
+# Set to 0 to run without dumping waves, e.g. for benchmarks
+WAVES        ?= 1
 
 # Useless:
 override CCFLAGS += -Wl,--no-warn-rwx-segments
@@ -27,7 +31,7 @@ override CCFLAGS += -Wl,--no-warn-rwx-segments
 all: run
 
 run: $(TMP_PREFIX)$(APP).bin
-	$(TBEXEC) --bin $(TMP_PREFIX)$(APP).bin --vcd $(TMP_PREFIX)$(APP)_run.vcd --cycles $(MAX_CYCLES)
+	$(TBEXEC) --bin $(TMP_PREFIX)$(APP).bin $(if $(filter 1,$(WAVES)),--vcd $(TMP_PREFIX)$(APP)_run.vcd) --cycles $(MAX_CYCLES) $(if $(FAST_BOOT),--fast-boot)
 
 view: run
 	gtkwave $(TMP_PREFIX)$(APP)_run.vcd
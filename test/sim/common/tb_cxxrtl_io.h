@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 
 // ----------------------------------------------------------------------------
 // Testbench IO hardware layout
@@ -19,11 +20,16 @@ typedef struct {
 	volatile uint32_t set_softirq;
 	volatile uint32_t clr_softirq;
 	volatile uint32_t globmon_en;
-	uint32_t _pad1[1];
+	volatile uint32_t waves;
 	volatile uint32_t set_irq;
 	uint32_t _pad2[3];
 	volatile uint32_t clr_irq;
 	uint32_t _pad3[3];
+	volatile uint32_t print_ptr;
+	volatile uint32_t print_len;
+	volatile uint32_t roi;
+	volatile uint32_t fast_boot;
+	volatile uint32_t trace;
 } io_hw_t;
 
 #define mm_io ((io_hw_t *const)IO_BASE)
@@ -44,9 +50,27 @@ static inline void tb_putc(char c) {
 	mm_io->print_char = (uint32_t)c;
 }
 
-static inline void tb_puts(const char *s) {
-	while (*s)
+// Both testbenches can print a whole string from memory at once, through
+// print_ptr/print_len, which is much faster than one IO write per character.
+// Define TB_HAVE_PRINT_BUF to 0 for a testbench without this.
+#ifndef TB_HAVE_PRINT_BUF
+#define TB_HAVE_PRINT_BUF 1
+#endif
+
+static inline void tb_write(const char *s, size_t len) {
+#if TB_HAVE_PRINT_BUF
+	// Make sure the string is in memory before the testbench reads it
+	asm volatile ("" : : : "memory");
+	mm_io->print_ptr = (uint32_t)(uintptr_t)s;
+	mm_io->print_len = len;
+#else
+	while (len--)
 		tb_putc(*s++);
+#endif
+}
+
+static inline void tb_puts(const char *s) {
+	tb_write(s, strlen(s));
 }
 
 static inline void tb_put_u32(uint32_t x) {
@@ -65,9 +89,10 @@ static inline void tb_printf(const char *fmt, ...) {
 	char buf[PRINTF_BUF_SIZE];
 	va_list args;
 	va_start(args, fmt);
-	vsnprintf(buf, PRINTF_BUF_SIZE, fmt, args);
-	tb_puts(buf);
+	int len = vsnprintf(buf, PRINTF_BUF_SIZE, fmt, args);
 	va_end(args);
+	if (len > 0)
+		tb_write(buf, len < PRINTF_BUF_SIZE ? len : PRINTF_BUF_SIZE - 1);
 }
 
 #define tb_assert(cond, ...) if (!(cond)) {tb_printf(__VA_ARGS__); tb_exit(-1);}
@@ -88,6 +113,27 @@ static inline void tb_enable_global_monitor(bool en) {
 	mm_io->globmon_en = en;
 }
 
+// Start/stop waveform dumping, when tb_cxxrtl is run with --vcd-io
+static inline void tb_dump_waves(bool en) {
+	mm_io->waves = en;
+}
+
+// Enter region of interest n (nonzero), for the simulators' per-region
+// counts, and for instrumentation gated with --roi
+static inline void tb_roi_begin(uint32_t n) {
+	mm_io->roi = n;
+}
+
+static inline void tb_roi_end() {
+	mm_io->roi = 0;
+}
+
+// Turn rvcpp's instruction trace on or off, e.g. around a bug (see
+// rvcpp --trace-io)
+static inline void tb_trace(bool en) {
+	mm_io->trace = en;
+}
+
 static inline void tb_set_irq_masked(uint32_t mask) {
 	mm_io->set_irq = mask;
 }
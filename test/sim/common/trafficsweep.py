@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+
+import configsweep
+import perfreport
+import simbench
+
+# CoreMark against background bus traffic: how the core's fetch and
+# load/store performance degrade when another bus master (tb --traffic)
+# shares its memory. Runs CoreMark on tb once per bandwidth and priority,
+# with one traffic generator over the --window, and prints CoreMark/MHz and
+# the slowdown relative to no traffic, e.g.
+#
+#   trafficsweep.py --bandwidth 0,10,25,50 --burst 8 --priority low,high
+#
+# CoreMark is built as for perfreport.py, and scored from the cycles in its
+# region of interest. Any --tbarg (e.g. --waitstates) applies to every run,
+# and also sets the generator's wait states.
+
+SIM_DIR = simbench.SIM_DIR
+
+# All of tb's RAM, which CoreMark's code, data and stack are in
+DEFAULT_WINDOW = ("0x0", "0x1000000")
+
+TRAFFIC_RE = re.compile(r"^Traffic 0: .*, ([0-9.]+)% of cycles for")
+
+def coremark():
+	simbench.build(["make", "-C", os.path.join(SIM_DIR, "coremark", "dist"), f"MARCH={perfreport.MARCH}",
+		f"OPATH=build/{perfreport.BUILD_NAME}/", f"build/{perfreport.BUILD_NAME}/coremark.elf"])
+	return os.path.join(SIM_DIR, "coremark", "dist", "build", perfreport.BUILD_NAME, "coremark.elf")
+
+def run(tb, tbargs, elf, traffic):
+	"""CoreMark/MHz and the generator's achieved bandwidth (percent of
+	cycles), or None for a failed run"""
+	cmd = [tb, *tbargs, "--elf", elf, "--cycles", "200000000"]
+	if traffic:
+		cmd += ["--traffic", *traffic]
+	out = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, text=True).stdout
+	iters = configsweep.field(out, "Iterations")
+	roi = perfreport.roi_cycles(out, "cycles")
+	if not iters or not roi or roi[1] != 1 or any("ERROR!" in l and "at least 10 secs" not in l
+			for l in out.splitlines()):
+		return None
+	achieved = 0.0
+	for l in out.splitlines():
+		m = TRAFFIC_RE.match(l)
+		if m:
+			achieved = float(m.group(1))
+	return int(iters) / (roi[0] / 1e6), achieved
+
+def main():
+	parser = argparse.ArgumentParser()
+	parser.add_argument("--tb", default=os.path.join(SIM_DIR, "tb_cxxrtl", "tb"), help="tb executable")
+	parser.add_argument("--bandwidth", default="0,10,25,50,75",
+		help="Comma-separated requested bandwidths, in percent of cycles (default 0,10,25,50,75)")
+	parser.add_argument("--burst", type=int, default=4, help="Beats per burst (default 4)")
+	parser.add_argument("--pattern", default="linear", help="linear, random or a stride in bytes (default linear)")
+	parser.add_argument("--priority", default="low,high", help="Comma-separated priorities (default low,high)")
+	parser.add_argument("--window", nargs=2, default=DEFAULT_WINDOW, metavar=("START", "END"),
+		help="Address range of the traffic (default all of RAM)")
+	parser.add_argument("--tbarg", action="append", default=[], help="Extra argument for tb (repeatable)")
+	args = parser.parse_args()
+
+	bandwidths = [float(b) for b in args.bandwidth.split(",")]
+	priorities = args.priority.split(",")
+	elf = coremark()
+
+	print(f"Running on {args.tb}", file=sys.stderr)
+	base = run(args.tb, args.tbarg, elf, None)
+	if not base:
+		sys.exit("CoreMark failed without traffic")
+	print(f"{'priority':<10}{'requested':>10}{'achieved':>10}{'CoreMark/MHz':>14}{'relative':>10}")
+	failed = False
+	for prio in priorities:
+		for bw in bandwidths:
+			if bw == 0:
+				r = base
+			else:
+				r = run(args.tb, args.tbarg, elf, [*args.window, str(bw), str(args.burst), args.pattern, prio])
+			if not r:
+				print(f"{prio:<10}{bw:>9.1f}%{'-':>10}{'failed':>14}")
+				failed = True
+				continue
+			print(f"{prio:<10}{bw:>9.1f}%{r[1]:>9.1f}%{r[0]:>14.3f}{r[0] / base[0]:>9.3f}x")
+	if failed:
+		sys.exit(1)
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+
+# Checks rvcpp's --timing model against tb_cxxrtl, with the microbenchmarks
+# of sw_testcases/ubench_timing.c (see sw_testcases/include/ubench.h). The
+# test is built with each benchmark in its own region of interest, and run on
+# both: each benchmark's region cycles, less those of the empty region that
+# ubench_init() times, should be the same in tb's "cycles" and rvcpp's "model
+# cycles". Prints one row per benchmark, with its budget and tb's own
+# mcycle count, and exits with an error if the model is off for any, e.g.
+#
+#   ubench_calibrate.py --timing-config ../tb_cxxrtl/config_min.vh --tb ../tb_cxxrtl/tb-min
+#
+# The tb given should be built for the same config as --timing-config.
+
+SIM_DIR = os.path.abspath(os.path.join(os.path.dirname(__file__), ".."))
+SW_DIR = os.path.join(SIM_DIR, "sw_testcases")
+
+APP = "ubench_timing"
+TMP_PREFIX = "tmp/ubench_roi/"
+MAX_CYCLES = 1000000
+
+# Printed by ubench_report() with -DUBENCH_VERBOSE
+REPORT_RE = re.compile(r"^(\S+): (\d+) cycles \(budget (\d+)\), (\d+) instructions")
+
+def build():
+	cmd = ["make", "-C", SW_DIR, f"APP={APP}", f"TMP_PREFIX={TMP_PREFIX}",
+		"EXTRA_CCFLAGS=-DUBENCH_ROI -DUBENCH_VERBOSE", f"{TMP_PREFIX}{APP}.bin"]
+	if subprocess.run(cmd, stdout=subprocess.DEVNULL).returncode != 0:
+		sys.exit(f"Failed: {' '.join(cmd)} (is the RISC-V toolchain on PATH?)")
+	return os.path.join(SW_DIR, TMP_PREFIX, f"{APP}.bin")
+
+def run(cmd):
+	"""Return the benchmark reports, and {region: [counts...]} from the
+	simulator's region of interest table"""
+	p = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+	reports = []
+	regions = {}
+	in_table = False
+	for l in p.stdout.splitlines():
+		m = REPORT_RE.match(l)
+		if m:
+			reports.append((m.group(1), int(m.group(2)), int(m.group(3))))
+		elif l.startswith("Regions of interest:"):
+			in_table = True
+		elif in_table:
+			fields = l.split()
+			if fields and all(f.isdigit() for f in fields):
+				regions[int(fields[0])] = [int(f) for f in fields[2:]]
+			elif fields and fields[0] != "region":
+				in_table = False
+	if not regions:
+		sys.exit(f"No regions of interest reported by {' '.join(cmd)}:\n{p.stdout[-2000:]}")
+	return reports, regions
+
+def main():
+	parser = argparse.ArgumentParser()
+	parser.add_argument("--tb", default=os.path.join(SIM_DIR, "tb_cxxrtl", "tb"), help="tb_cxxrtl executable")
+	parser.add_argument("--rvcpp", default=os.path.join(SIM_DIR, "rvcpp", "rvcpp"), help="rvcpp executable")
+	parser.add_argument("--timing-config", help="Passed to rvcpp (default: its own defaults, for config_default.vh)")
+	args = parser.parse_args()
+
+	binfile = build()
+	reports, tb_regions = run([args.tb, "--bin", binfile, "--cycles", str(MAX_CYCLES)])
+	rvcpp_cmd = [args.rvcpp, "--bin", binfile, "--cycles", str(MAX_CYCLES)]
+	rvcpp_cmd += ["--timing-config", args.timing_config] if args.timing_config else ["--timing"]
+	_, model_regions = run(rvcpp_cmd)
+
+	# Region 1 is ubench_init()'s empty benchmark. tb's cycles are its first
+	# column, and the model's cycles rvcpp's last.
+	def delta(regions, region, col):
+		return regions[region][col] - regions[1][col] if region in regions and 1 in regions else None
+	mismatches = 0
+	print(f"{'benchmark':<20}{'budget':>8}{'mcycle':>8}{'tb':>8}{'model':>8}")
+	for i, (name, cycles, budget) in enumerate(reports):
+		region = i + 2
+		tb = delta(tb_regions, region, 0)
+		model = delta(model_regions, region, -1)
+		flag = ""
+		if tb is None or model is None or tb != model:
+			flag = "  MISMATCH"
+			mismatches += 1
+		elif cycles != budget:
+			flag = "  over budget" if cycles > budget else "  under budget"
+		fmt = lambda x: f"{x:>8}" if x is not None else f"{'-':>8}"
+		print(f"{name:<20}{budget:>8}{cycles:>8}{fmt(tb)}{fmt(model)}{flag}")
+	print(f"\ntb and model columns are region cycles, less the empty region's. {mismatches} mismatches.")
+	sys.exit(1 if mismatches else 0)
+
+if __name__ == "__main__":
+	main()
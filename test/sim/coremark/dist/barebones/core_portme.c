@@ -17,6 +17,7 @@ Original Author: Shay Gal-on
 */
 #include "coremark.h"
 #include "core_portme.h"
+#include "tb_cxxrtl_io.h"
 
 #if VALIDATION_RUN
 volatile ee_s32 seed1_volatile = 0x3415;
@@ -85,6 +86,7 @@ void
 start_time(void)
 {
     GETMYTIME(&start_time_val);
+    tb_roi_begin(1);
 }
 /* Function : stop_time
         This function will be called right after ending the timed portion of the
@@ -97,6 +99,7 @@ start_time(void)
 void
 stop_time(void)
 {
+    tb_roi_end();
     GETMYTIME(&stop_time_val);
 }
 /* Function : get_time
@@ -384,8 +384,10 @@ extern clock_t	clock();
 #define HZ 1000000
 #define Too_Small_Time 1
 #define CLOCK_TYPE "rdcycle()"
-#define Start_Timer() Begin_Time = read_csr(mcycle)
-#define Stop_Timer() End_Time = read_csr(mcycle)
+// The timed loop is also region of interest 1, for the simulators' counts
+#include "tb_cxxrtl_io.h"
+#define Start_Timer() Begin_Time = read_csr(mcycle); tb_roi_begin(1)
+#define Stop_Timer() tb_roi_end(); End_Time = read_csr(mcycle)
 
 #else
                 /* Use times(2) time function unless    */
@@ -0,0 +1,61 @@
+#include <support.h>
+
+// Embench board support for tb_cxxrtl and rvcpp (see ../run_embench.py).
+// stop_trigger() prints the mcycle and minstret counts of the benchmarked
+// section. Build with -DEMBENCH_NO_COUNTERS for a config without
+// CSR_COUNTER, and with -DEMBENCH_SIZE for the size build, which links
+// against Embench's dummy libraries, so can't print.
+
+#if !defined(EMBENCH_SIZE) && !defined(EMBENCH_NO_COUNTERS)
+
+#include "tb_cxxrtl_io.h"
+#include "hazard3_csr.h"
+
+static uint64_t start_cycle;
+static uint64_t start_instret;
+
+static uint64_t read_mcycle64() {
+	uint32_t hi, lo;
+	do {
+		hi = read_csr(mcycleh);
+		lo = read_csr(mcycle);
+	} while (hi != read_csr(mcycleh));
+	return (uint64_t)hi << 32 | lo;
+}
+
+static uint64_t read_minstret64() {
+	uint32_t hi, lo;
+	do {
+		hi = read_csr(minstreth);
+		lo = read_csr(minstret);
+	} while (hi != read_csr(minstreth));
+	return (uint64_t)hi << 32 | lo;
+}
+
+void initialise_board() {
+}
+
+void __attribute__((noinline)) start_trigger() {
+	start_instret = read_minstret64();
+	start_cycle = read_mcycle64();
+}
+
+void __attribute__((noinline)) stop_trigger() {
+	uint64_t cycles = read_mcycle64() - start_cycle;
+	uint64_t instret = read_minstret64() - start_instret;
+	tb_printf("Embench: %llu cycles, %llu instructions\n",
+		(unsigned long long)cycles, (unsigned long long)instret);
+}
+
+#else
+
+void initialise_board() {
+}
+
+void __attribute__((noinline)) start_trigger() {
+}
+
+void __attribute__((noinline)) stop_trigger() {
+}
+
+#endif
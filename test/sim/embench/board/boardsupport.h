@@ -0,0 +1,7 @@
+#ifndef _BOARDSUPPORT_H
+#define _BOARDSUPPORT_H
+
+// Embench board support for tb_cxxrtl and rvcpp, used by run_embench.py.
+// Nothing here: Embench's support.h declares the functions.
+
+#endif
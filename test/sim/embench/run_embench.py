@@ -0,0 +1,265 @@
+#!/usr/bin/env python3
+
+import argparse
+import concurrent.futures
+import glob
+import json
+import math
+import os
+import re
+import subprocess
+import sys
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "common"))
+import configsweep
+import simbench
+
+# Embench-IoT harness. Builds every Embench benchmark for the ISA of each
+# tb_cxxrtl config_*.vh (its EXTENSION_* parameters, as in configsweep.py),
+# with the board support in board/, and runs each build on that config's tb
+# (cycle-accurate) and on rvcpp with the same --config (functional), all in
+# parallel. Prints Embench's speed and size scores for each config, e.g.
+#
+#   run_embench.py --config default --config min
+#
+# Speed is from the mcycle count of the benchmarked section on tb, and
+# converts to Embench's per-MHz score (baseline time over our time, with the
+# benchmarks built for CPU_MHZ=1). rvcpp's mcycle counts instructions, so it
+# isn't timed: its run checks the result and the instruction count against
+# tb's. Size is the .text of a separate build linked against Embench's dummy
+# libraries, as benchmark_size.py measures it. Both are relative to
+# embench-iot/baseline-data, and summarised by geometric mean, SD and range
+# as in Embench's own scripts. Configs without CSR_COUNTER only get a size.
+#
+# --json appends the results to a file, one JSON object per line, with the
+# git revision of hdl/, so scores can be tracked across RTL changes.
+
+SIM_DIR = simbench.SIM_DIR
+EMBENCH_DIR = simbench.EMBENCH_DIR
+TB_DIR = configsweep.TB_DIR
+COMMON_DIR = os.path.join(SIM_DIR, "common")
+BOARD_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "board")
+TMP_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "tmp")
+RVCPP = os.path.join(SIM_DIR, "rvcpp", "rvcpp")
+CROSS_PREFIX = "riscv32-unknown-elf-"
+
+# md5sum does a hosted printf inside its benchmarked section (see Readme.md)
+EXCLUDE = ["md5sum"]
+DUMMY_LIBS = ["crt0", "libc", "libgcc", "libm"]
+
+RESULT_RE = re.compile(r"^Embench: (\d+) cycles, (\d+) instructions")
+EXIT_RE = re.compile(r"^CPU requested halt\. Exit code (-?\d+)")
+
+class Config:
+	def __init__(self, name):
+		self.name = name
+		self.path = os.path.join(TB_DIR, f"config_{name}.vh")
+		_, self.params = configsweep.read_config(self.path)
+		self.march = configsweep.march(self.params)
+		self.counters = configsweep.has_param(self.params, "CSR_COUNTER")
+		# Not the default tb, which also has the multicore topology
+		self.tb = os.path.join(TB_DIR, f"tb-{name}")
+		self.error = None
+		# {benchmark: {"elf", "size", "tb", "rvcpp", ...}}
+		self.results = {}
+
+def benchmarks():
+	src = os.path.join(EMBENCH_DIR, "src")
+	return sorted(b for b in os.listdir(src) if os.path.isdir(os.path.join(src, b)) and b not in EXCLUDE)
+
+def build_tb(c, make_jobs):
+	"""Build one config's tb. Returns an error message, or None."""
+	cmd = ["make", "-C", TB_DIR, f"-j{make_jobs}", f"CONFIG={c.name}", "TOPOLOGIES=tb", f"TBEXEC={os.path.basename(c.tb)}"]
+	p = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+	if p.returncode != 0:
+		return "tb build failed:\n" + p.stdout[-2000:]
+	return None
+
+def compile_bench(c, bench, args):
+	"""Build the run and size ELFs of one benchmark. Returns an error message
+	for the run build, or None. A failed size build just has no size."""
+	out_dir = os.path.join(TMP_DIR, c.name, bench)
+	os.makedirs(out_dir, exist_ok=True)
+	support = os.path.join(EMBENCH_DIR, "support")
+	srcs = sorted(glob.glob(os.path.join(EMBENCH_DIR, "src", bench, "*.c")))
+	srcs += [os.path.join(support, "main.c"), os.path.join(support, "beebsc.c"), os.path.join(BOARD_DIR, "boardsupport.c")]
+	cflags = [f"-march={c.march}", *args.cflags.split(), "-DHAVE_BOARDSUPPORT_H",
+		f"-DCPU_MHZ={args.cpu_mhz}", "-DWARMUP_HEAT=1", "-I", support, "-I", BOARD_DIR, "-I", COMMON_DIR]
+	if not c.counters:
+		cflags.append("-DEMBENCH_NO_COUNTERS")
+	cc = CROSS_PREFIX + "gcc"
+
+	elf = os.path.join(out_dir, f"{bench}.elf")
+	p = subprocess.run([cc, *cflags, *srcs, os.path.join(COMMON_DIR, "init.S"), "-T", os.path.join(COMMON_DIR, "memmap.ld"),
+		"-Wl,--no-warn-rwx-segments", *args.ldflags.split(), "-lm", "-o", elf],
+		stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+	if p.returncode != 0:
+		return "build failed:\n" + p.stdout[-2000:]
+	c.results[bench] = {"elf": elf}
+
+	size_elf = os.path.join(out_dir, f"{bench}-size.elf")
+	dummies = [os.path.join(support, f"dummy-{l}.c") for l in DUMMY_LIBS]
+	p = subprocess.run([cc, *cflags, "-DEMBENCH_SIZE", *srcs, *dummies, "-nostartfiles", "-nostdlib",
+		*args.ldflags.split(), "-o", size_elf], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+	if p.returncode == 0:
+		c.results[bench]["size"] = text_size(size_elf)
+	return None
+
+def text_size(elf):
+	p = subprocess.run([CROSS_PREFIX + "size", "-A", elf], stdout=subprocess.PIPE, text=True)
+	size = 0
+	for l in p.stdout.splitlines():
+		fields = l.split()
+		if len(fields) >= 2 and fields[0].startswith(".text") and fields[1].isdigit():
+			size += int(fields[1])
+	return size
+
+def run(cmd):
+	"""Return (exit code or None, section cycles or None, section instructions
+	or None)"""
+	p = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, text=True)
+	code = cycles = instrs = None
+	for l in p.stdout.splitlines():
+		m = RESULT_RE.match(l)
+		if m:
+			cycles, instrs = int(m.group(1)), int(m.group(2))
+		m = EXIT_RE.match(l)
+		if m:
+			code = int(m.group(1))
+	return code, cycles, instrs
+
+def run_bench(c, bench, sim, max_cycles):
+	r = c.results[bench]
+	if sim == "tb":
+		cmd = [c.tb, "--elf", r["elf"], "--cycles", str(max_cycles)]
+	else:
+		cmd = [RVCPP, "--elf", r["elf"], "--config", c.path, "--cycles", str(max_cycles)]
+	code, cycles, instrs = run(cmd)
+	# verify_benchmark()'s result is main()'s return value
+	r[sim] = {"passed": code == 0, "cycles": cycles, "instructions": instrs}
+
+def load_baseline(name):
+	"""{benchmark: value} from embench-iot/baseline-data/<name>.json. Sizes
+	may be split by section, in which case the text size is used."""
+	with open(os.path.join(EMBENCH_DIR, "baseline-data", f"{name}.json")) as f:
+		data = json.load(f)
+	return {k: v["text"] if isinstance(v, dict) else v for k, v in data.items()}
+
+def summarise(rel):
+	"""Geometric mean, SD and range, as Embench reports them"""
+	if not rel:
+		return None, None, None
+	n = len(rel)
+	logs = [math.log(x) for x in rel]
+	mean = sum(logs) / n
+	gmean = math.exp(mean)
+	# Population SD of the logs, which reproduces the figures in Readme.md
+	gsd = math.exp(math.sqrt(sum((l - mean) ** 2 for l in logs) / n))
+	return gmean, gsd, gmean * gsd - gmean / gsd
+
+def scores(c, speed_base, size_base, cpu_mhz):
+	"""Fill in each benchmark's relative speed and size"""
+	for bench, r in c.results.items():
+		tb = r.get("tb")
+		if tb and tb["passed"] and tb["cycles"] and bench in speed_base:
+			# Baseline times are in ms. Per MHz, as the benchmarks scale their
+			# iterations with CPU_MHZ.
+			r["speed"] = speed_base[bench] / (tb["cycles"] / (cpu_mhz * 1000.0))
+		if r.get("size") and bench in size_base:
+			r["rel_size"] = r["size"] / size_base[bench]
+
+def print_results(configs):
+	def fmt(x, w, prec=4):
+		return f"{x:>{w}.{prec}f}" if x is not None else f"{'-':>{w}}"
+	for c in configs:
+		print(f"config_{c.name}.vh ({c.march}):")
+		if c.error:
+			print(f"  {c.error}\n")
+			continue
+		print(f"  {'benchmark':<20}{'speed':>9}{'size':>9}{'cycles':>12}{'instrs':>12}  rvcpp")
+		for bench, r in sorted(c.results.items()):
+			if "error" in r:
+				print(f"  {bench:<20}  {r['error'].splitlines()[0]}")
+				continue
+			tb = r.get("tb", {})
+			rv = r.get("rvcpp", {})
+			if not rv.get("passed"):
+				check = "FAILED"
+			elif not c.counters or tb.get("instructions") is None:
+				check = "ok"
+			else:
+				check = "ok" if rv.get("instructions") == tb["instructions"] else \
+					f"{rv.get('instructions')} instructions"
+			flag = "" if tb.get("passed") else "  tb FAILED"
+			cycles = f"{tb['cycles']:>12}" if tb.get("cycles") is not None else f"{'-':>12}"
+			instrs = f"{tb['instructions']:>12}" if tb.get("instructions") is not None else f"{'-':>12}"
+			print(f"  {bench:<20}{fmt(r.get('speed'), 9)}{fmt(r.get('rel_size'), 9)}{cycles}{instrs}  {check}{flag}")
+		speed = summarise([r["speed"] for r in c.results.values() if "speed" in r])
+		size = summarise([r["rel_size"] for r in c.results.values() if "rel_size" in r])
+		for label, i in (("Geometric mean", 0), ("Geometric SD", 1), ("Geometric range", 2)):
+			print(f"  {label:<20}{fmt(speed[i], 9)}{fmt(size[i], 9)}")
+		print()
+	print("Speed is per MHz (higher is better), size is relative .text (lower is better), both against the Embench baseline.")
+
+def hdl_revision():
+	hdl = os.path.join(SIM_DIR, "..", "..", "hdl")
+	rev = subprocess.run(["git", "log", "-1", "--format=%H", "--", "."], cwd=hdl,
+		stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, text=True).stdout.strip()
+	dirty = subprocess.run(["git", "status", "--porcelain", "--", "."], cwd=hdl,
+		stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, text=True).stdout.strip()
+	return rev + ("-dirty" if dirty else "")
+
+def main():
+	parser = argparse.ArgumentParser()
+	parser.add_argument("--config", action="append", default=[],
+		help="tb_cxxrtl/config_<name>.vh to build for (can be repeated; default: every config but configsweep.py's)")
+	parser.add_argument("--bench", action="append", default=[], help="Run only this benchmark (can be repeated)")
+	parser.add_argument("--cflags", default="-O2 -ffunction-sections -fdata-sections",
+		help="Compiler flags, besides -march (default %(default)s)")
+	parser.add_argument("--ldflags", default="-Wl,--gc-sections", help="Linker flags (default %(default)s)")
+	parser.add_argument("--cpu-mhz", type=int, default=1, help="Embench CPU_MHZ, which scales the iterations (default 1)")
+	parser.add_argument("--cycles", type=int, default=500000000, help="Cycle limit for each run (default %(default)s)")
+	parser.add_argument("--jobs", type=int, default=os.cpu_count() or 1, help="Parallel builds and runs (default: one per core)")
+	parser.add_argument("--json", help="Append the results to this file, one JSON object per line")
+	args = parser.parse_args()
+
+	if not os.path.exists(os.path.join(EMBENCH_DIR, "support", "main.c")):
+		sys.exit(f"{EMBENCH_DIR} is not checked out (git submodule update --init {os.path.relpath(EMBENCH_DIR)})")
+	names = args.config or sorted(os.path.basename(p)[len("config_"):-len(".vh")]
+		for p in glob.glob(os.path.join(TB_DIR, "config_*.vh")) if not os.path.basename(p).startswith("config_sweep_"))
+	configs = [Config(n) for n in names]
+	benches = [b for b in benchmarks() if not args.bench or b in args.bench]
+	print(f"{len(benches)} benchmarks for {len(configs)} configs", file=sys.stderr)
+
+	# The tbs share the host's cores while they build, then everything else
+	# is one job per benchmark build or run
+	make_jobs = max(1, args.jobs // len(configs))
+	with concurrent.futures.ThreadPoolExecutor(args.jobs) as pool:
+		for c, err in zip(configs, pool.map(lambda c: build_tb(c, make_jobs), configs)):
+			c.error = err
+			print(f"Built tb for {c.name}" + (" (failed)" if err else ""), file=sys.stderr)
+		ok = [c for c in configs if not c.error]
+		builds = [(c, b) for c in ok for b in benches]
+		for (c, b), err in zip(builds, pool.map(lambda cb: compile_bench(*cb, args), builds)):
+			if err:
+				c.results[b] = {"error": err}
+		if all("error" in r for c in ok for r in c.results.values()):
+			sys.exit("No benchmark built (is the RISC-V toolchain on PATH?)")
+		runs = [(c, b, sim) for c, b in builds if "elf" in c.results.get(b, {}) for sim in ("tb", "rvcpp")]
+		list(pool.map(lambda cbs: run_bench(*cbs, args.cycles), runs))
+
+	speed_base, size_base = load_baseline("speed"), load_baseline("size")
+	for c in configs:
+		scores(c, speed_base, size_base, args.cpu_mhz)
+	print_results(configs)
+
+	if args.json:
+		with open(args.json, "a") as f:
+			f.write(json.dumps({"time": int(time.time()), "hdl_revision": hdl_revision(), "cflags": args.cflags,
+				"configs": [{"name": c.name, "march": c.march, "error": c.error,
+				"results": {b: {k: v for k, v in r.items() if k != "elf"} for b, r in c.results.items()}}
+				for c in configs]}) + "\n")
+
+if __name__ == "__main__":
+	main()
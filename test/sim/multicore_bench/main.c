@@ -0,0 +1,323 @@
+#include "tb_cxxrtl_io.h"
+#include "hazard3_csr.h"
+#include "amo_outline.h"
+
+// Synchronisation throughput on two harts: tb_multicore, or rvcpp --harts 2.
+// Each benchmark runs on both harts at once, between two barriers, and is
+// timed with hart 0's mcycle. The result is in cycles per operation, across
+// both harts, so lower is better and the cost of contention is the
+// difference from the private (uncontended) variant.
+//
+// The benchmarks which use LR/SC across harts run with the testbench's
+// global monitor enabled (IO_GLOBMON_EN), as they are not atomic otherwise.
+// The AMO and private LR/SC benchmarks run with it both off and on, to show
+// what the monitor costs. Each benchmark is also a region of interest, so
+// the simulators' per-region counts (e.g. rvcpp --timing's model cycles)
+// line up with the table.
+
+#define N_HARTS 2
+#define ITERS 256
+
+// Far enough apart that harts' private words never share a reservation
+// granule
+#define PRIVATE_STRIDE 16
+
+static volatile uint32_t shared_word;
+static volatile uint32_t private_words[N_HARTS * PRIVATE_STRIDE] __attribute__((aligned(64)));
+static uint32_t sc_failures[N_HARTS];
+
+static inline void fence(void) {
+	asm volatile ("fence rw, rw" : : : "memory");
+}
+
+static inline uint32_t lr_w(volatile uint32_t *addr) {
+	uint32_t val;
+	asm volatile ("lr.w %0, (%1)" : "=r" (val) : "r" (addr) : "memory");
+	return val;
+}
+
+// Returns 0 on success
+static inline uint32_t sc_w(uint32_t val, volatile uint32_t *addr) {
+	uint32_t fail;
+	asm volatile ("sc.w %0, %1, (%2)" : "=&r" (fail) : "r" (val), "r" (addr) : "memory");
+	return fail;
+}
+
+// ----------------------------------------------------------------------------
+// Sense-reversing barrier
+
+static volatile uint32_t barrier_count;
+static volatile uint32_t barrier_sense;
+static uint32_t barrier_local_sense[N_HARTS];
+
+static void barrier(uint32_t hart) {
+	uint32_t sense = barrier_local_sense[hart] ^= 1;
+	if (amoadd(1, (uint32_t*)&barrier_count) == N_HARTS - 1) {
+		barrier_count = 0;
+		fence();
+		barrier_sense = sense;
+	} else {
+		while (barrier_sense != sense)
+			;
+	}
+	fence();
+}
+
+// ----------------------------------------------------------------------------
+// Benchmarks
+
+static void amoadd_shared(uint32_t hart) {
+	for (int i = 0; i < ITERS; ++i)
+		amoadd(1, (uint32_t*)&shared_word);
+}
+
+static void amoadd_private(uint32_t hart) {
+	uint32_t *p = (uint32_t*)&private_words[hart * PRIVATE_STRIDE];
+	for (int i = 0; i < ITERS; ++i)
+		amoadd(1, p);
+}
+
+static void lrsc_increment(uint32_t hart, volatile uint32_t *p) {
+	uint32_t failures = 0;
+	for (int i = 0; i < ITERS; ++i) {
+		while (sc_w(lr_w(p) + 1, p))
+			++failures;
+	}
+	sc_failures[hart] = failures;
+}
+
+static void lrsc_shared(uint32_t hart) {
+	lrsc_increment(hart, &shared_word);
+}
+
+static void lrsc_private(uint32_t hart) {
+	lrsc_increment(hart, &private_words[hart * PRIVATE_STRIDE]);
+}
+
+// Test-and-test-and-set, guarding a plain increment
+static volatile uint32_t spinlock;
+
+static void spinlock_inc(uint32_t hart) {
+	for (int i = 0; i < ITERS; ++i) {
+		while (true) {
+			while (spinlock)
+				;
+			if (!amoswap(1, (uint32_t*)&spinlock))
+				break;
+		}
+		fence();
+		shared_word = shared_word + 1;
+		fence();
+		spinlock = 0;
+	}
+}
+
+// FIFO ordering: each hart takes a ticket, and waits for it to be served
+static volatile uint32_t ticket_next;
+static volatile uint32_t ticket_serving;
+
+static void ticketlock_inc(uint32_t hart) {
+	for (int i = 0; i < ITERS; ++i) {
+		uint32_t ticket = amoadd(1, (uint32_t*)&ticket_next);
+		while (ticket_serving != ticket)
+			;
+		fence();
+		shared_word = shared_word + 1;
+		fence();
+		ticket_serving = ticket + 1;
+	}
+}
+
+// Lock-free single-producer single-consumer ring, from hart 0 to hart 1:
+// plain loads and stores, ordered by fences. One operation is one item
+// passed across.
+#define QUEUE_SIZE 8
+static volatile uint32_t queue_buf[QUEUE_SIZE];
+static volatile uint32_t queue_head;
+static volatile uint32_t queue_tail;
+
+static void spsc_queue(uint32_t hart) {
+	if (hart == 0) {
+		for (uint32_t i = 0; i < N_HARTS * ITERS; ++i) {
+			uint32_t tail = queue_tail;
+			while (tail - queue_head == QUEUE_SIZE)
+				;
+			queue_buf[tail % QUEUE_SIZE] = i + 1;
+			fence();
+			queue_tail = tail + 1;
+		}
+	} else if (hart == 1) {
+		uint32_t sum = 0;
+		for (uint32_t i = 0; i < N_HARTS * ITERS; ++i) {
+			uint32_t head = queue_head;
+			while (queue_tail == head)
+				;
+			fence();
+			sum += queue_buf[head % QUEUE_SIZE];
+			fence();
+			queue_head = head + 1;
+		}
+		shared_word = sum;
+	}
+}
+
+// Lock-free (Treiber) stack with LR/SC, which is immune to ABA as any write
+// to the top pointer fails the SC. Each hart pops a node and pushes it back,
+// one operation being the pair.
+struct stack_node {
+	struct stack_node *next;
+};
+
+#define STACK_NODES (2 * N_HARTS)
+static struct stack_node stack_nodes[STACK_NODES];
+static volatile uint32_t stack_top;
+
+static void lrsc_stack(uint32_t hart) {
+	uint32_t failures = 0;
+	for (int i = 0; i < ITERS; ++i) {
+		struct stack_node *n;
+		while (true) {
+			n = (struct stack_node*)lr_w(&stack_top);
+			if (!sc_w((uint32_t)n->next, &stack_top))
+				break;
+			++failures;
+		}
+		while (true) {
+			n->next = (struct stack_node*)lr_w(&stack_top);
+			if (!sc_w((uint32_t)n, &stack_top))
+				break;
+			++failures;
+		}
+	}
+	sc_failures[hart] = failures;
+}
+
+// A token passed back and forth through one word: the round trip of a
+// store from one hart to the other, as for a handshake or message passing
+static void ping_pong(uint32_t hart) {
+	for (uint32_t i = 0; i < ITERS; ++i) {
+		uint32_t token = N_HARTS * i + hart;
+		while (shared_word != token)
+			;
+		shared_word = token + 1;
+	}
+}
+
+// ----------------------------------------------------------------------------
+// Harness
+
+typedef struct {
+	const char *name;
+	void (*fn)(uint32_t hart);
+	bool globmon;
+	// Value of shared_word after the benchmark, or 0 for no check
+	uint32_t expect_shared;
+	bool reports_sc_failures;
+} bench_t;
+
+static const bench_t benches[] = {
+	{"amoadd shared",       amoadd_shared,  false, N_HARTS * ITERS,  false},
+	{"amoadd shared",       amoadd_shared,  true,  N_HARTS * ITERS,  false},
+	{"amoadd private",      amoadd_private, false, 0,                false},
+	{"amoadd private",      amoadd_private, true,  0,                false},
+	{"lr/sc private",       lrsc_private,   false, 0,                true },
+	{"lr/sc private",       lrsc_private,   true,  0,                true },
+	{"lr/sc shared",        lrsc_shared,    true,  N_HARTS * ITERS,  true },
+	{"spinlock (amoswap)",  spinlock_inc,   false, N_HARTS * ITERS,  false},
+	{"ticket lock (amoadd)", ticketlock_inc, false, N_HARTS * ITERS, false},
+	{"spsc queue",          spsc_queue,     false, N_HARTS * ITERS * (N_HARTS * ITERS + 1) / 2, false},
+	{"lr/sc stack",         lrsc_stack,     true,  0,                true },
+	{"ping-pong",           ping_pong,      false, N_HARTS * ITERS,  false},
+};
+
+#define N_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static void reset_state(void) {
+	shared_word = 0;
+	for (int i = 0; i < N_HARTS * PRIVATE_STRIDE; ++i)
+		private_words[i] = 0;
+	for (int i = 0; i < N_HARTS; ++i)
+		sc_failures[i] = 0;
+	spinlock = 0;
+	ticket_next = 0;
+	ticket_serving = 0;
+	queue_head = 0;
+	queue_tail = 0;
+	for (int i = 0; i < STACK_NODES; ++i)
+		stack_nodes[i].next = i + 1 < STACK_NODES ? &stack_nodes[i + 1] : NULL;
+	stack_top = (uint32_t)&stack_nodes[0];
+}
+
+static bool check_state(const bench_t *b) {
+	if (b->expect_shared && shared_word != b->expect_shared) {
+		tb_printf("  FAIL: shared word is %u, expected %u\n", shared_word, b->expect_shared);
+		return false;
+	}
+	if (b->fn == amoadd_private || b->fn == lrsc_private) {
+		for (int i = 0; i < N_HARTS; ++i) {
+			if (private_words[i * PRIVATE_STRIDE] != ITERS) {
+				tb_printf("  FAIL: hart %d private word is %u\n", i, private_words[i * PRIVATE_STRIDE]);
+				return false;
+			}
+		}
+	}
+	if (b->fn == lrsc_stack) {
+		int n = 0;
+		for (struct stack_node *p = (struct stack_node*)stack_top; p && n <= STACK_NODES; p = p->next)
+			++n;
+		if (n != STACK_NODES) {
+			tb_printf("  FAIL: stack has %d nodes, expected %d\n", n, STACK_NODES);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool failed;
+
+static void run_benches(uint32_t hart) {
+	for (uint32_t i = 0; i < N_BENCHES; ++i) {
+		const bench_t *b = &benches[i];
+		if (hart == 0) {
+			reset_state();
+			tb_enable_global_monitor(b->globmon);
+		}
+		barrier(hart);
+		uint32_t start = read_csr(mcycle);
+		if (hart == 0)
+			tb_roi_begin(i + 1);
+		b->fn(hart);
+		barrier(hart);
+		if (hart != 0)
+			continue;
+		uint32_t cycles = read_csr(mcycle) - start;
+		tb_roi_end();
+		uint32_t ops = N_HARTS * ITERS;
+		uint32_t cpo_x10 = (cycles * 10 + ops / 2) / ops;
+		tb_printf("%2u  %-21s %-3s  %8u  %4u.%u", i + 1, b->name, b->globmon ? "on" : "off",
+			cycles, cpo_x10 / 10, cpo_x10 % 10);
+		if (b->reports_sc_failures)
+			tb_printf("  %u", sc_failures[0] + sc_failures[1]);
+		tb_puts("\n");
+		failed = !check_state(b) || failed;
+	}
+}
+
+void core1_main() {
+	tb_clr_softirq(1);
+	run_benches(1);
+}
+
+void launch_core1(void (*entry)(void)) {
+	core1_entry_vector = (uintptr_t)entry;
+	tb_set_softirq(1);
+}
+
+int main() {
+	tb_printf("%u harts, %u operations per hart\n", N_HARTS, ITERS);
+	tb_puts("ROI benchmark             mon    cycles  cyc/op  sc.w fails\n");
+	launch_core1(core1_main);
+	run_benches(0);
+	tb_enable_global_monitor(false);
+	return failed;
+}
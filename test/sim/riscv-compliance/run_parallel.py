@@ -0,0 +1,197 @@
+#!/usr/bin/env python3
+
+import argparse
+import glob
+import hashlib
+import json
+import os
+import subprocess
+import sys
+import threading
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+# Fast path for the riscv-arch-test suites: compiles and runs every test in
+# parallel, with the simulator writing each test's signature region straight
+# to a binary file (--signature), which is compared with the reference output
+# here. This replaces the one-test-at-a-time make flow in riscv-arch-test,
+# which scrapes the signature out of the --dump text output.
+#
+# Results are cached under tmp/cache, keyed on a hash of the test ELF and of
+# the RTL (or, for a simulator from outside tb_cxxrtl, of the simulator
+# itself), so an incremental run only simulates tests whose ELF or design has
+# changed.
+
+COMPLIANCE_DIR = os.path.abspath(os.path.dirname(__file__))
+SIM_DIR = os.path.dirname(COMPLIANCE_DIR)
+HDL_DIR = os.path.join(SIM_DIR, "..", "..", "hdl")
+TB_DIR = os.path.join(SIM_DIR, "tb_cxxrtl")
+ARCH_TEST_DIR = os.path.join(COMPLIANCE_DIR, "riscv-arch-test")
+SUITE_DIR = os.path.join(ARCH_TEST_DIR, "riscv-test-suite")
+TARGET_DIR = os.path.join(ARCH_TEST_DIR, "riscv-target", "hazard3")
+WORK_DIR = os.path.join(COMPLIANCE_DIR, "tmp", "work")
+CACHE_DIR = os.path.join(COMPLIANCE_DIR, "tmp", "cache")
+CROSS_PREFIX = "riscv32-unknown-elf-"
+
+DEVICES = {
+	"I": "rv32i",
+	"M": "rv32im",
+	"C": "rv32ic",
+}
+# Reported, but don't fail the run
+EXPECTED_FAILURES = {"C/cebreak-01"}
+MAX_CYCLES = 1000000
+
+def file_hash(h, path):
+	h.update(path.encode())
+	with open(path, "rb") as f:
+		h.update(f.read())
+
+def design_hash(tb_path, tbargs):
+	# The tb is built from these, so this changes whenever it would simulate
+	# differently, but not on a plain rebuild of the same sources.
+	h = hashlib.sha256()
+	tb_path = os.path.abspath(tb_path)
+	if os.path.dirname(tb_path) == os.path.abspath(TB_DIR):
+		paths = glob.glob(os.path.join(HDL_DIR, "**", "*.v"), recursive=True)
+		paths += glob.glob(os.path.join(HDL_DIR, "**", "*.vh"), recursive=True)
+		for ext in ("v", "vh", "f", "cpp", "h"):
+			paths += glob.glob(os.path.join(TB_DIR, f"*.{ext}"))
+		for p in sorted(os.path.relpath(p, SIM_DIR) for p in paths):
+			file_hash(h, os.path.join(SIM_DIR, p))
+		h.update(os.path.basename(tb_path).encode())
+	else:
+		file_hash(h, tb_path)
+	h.update(json.dumps(tbargs).encode())
+	return h.hexdigest()
+
+def read_reference(path):
+	# Hex words, possibly several per line with the highest-addressed first
+	words = []
+	for l in open(path):
+		l = l.strip()
+		line_words = [int(l[i:i + 8], 16) for i in range(0, len(l), 8)]
+		words.extend(reversed(line_words))
+	return b"".join(w.to_bytes(4, "little") for w in words)
+
+def compile_test(device, src, elf):
+	os.makedirs(os.path.dirname(elf), exist_ok=True)
+	env_dir = os.path.join(SUITE_DIR, "env")
+	cmd = [CROSS_PREFIX + "gcc", f"-march={DEVICES[device]}", "-mabi=ilp32", "-static", "-mcmodel=medany",
+		"-fvisibility=hidden", "-nostdlib", "-nostartfiles", f"-I{env_dir}", f"-I{TARGET_DIR}",
+		f"-T{os.path.join(TARGET_DIR, 'link.ld')}", src, "-o", elf]
+	ret = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+	return ret.returncode == 0, ret.stdout.decode("utf-8", "replace")
+
+def run_test(device, src, tb_path, tbargs, design, use_cache):
+	name = os.path.basename(src)[:-len(".S")]
+	work = os.path.join(WORK_DIR, device, name)
+	ok, log = compile_test(device, src, work + ".elf")
+	if not ok:
+		with open(work + ".log", "w") as f:
+			f.write(log)
+		return False, "[MK ERR]", False
+	ref_path = os.path.join(os.path.dirname(os.path.dirname(src)), "references", f"{name}.reference_output")
+	if not os.path.exists(ref_path):
+		return False, "no reference output", False
+	h = hashlib.sha256(design.encode())
+	file_hash(h, work + ".elf")
+	file_hash(h, ref_path)
+	cache_path = os.path.join(CACHE_DIR, h.hexdigest()[:24] + ".json")
+	if use_cache and os.path.exists(cache_path):
+		with open(cache_path) as f:
+			r = json.load(f)
+		return r["passed"], r["message"], True
+
+	if os.path.exists(work + ".sig"):
+		os.remove(work + ".sig")
+	ret = subprocess.run([tb_path, "--elf", work + ".elf", "--signature", work + ".sig",
+		"--cycles", str(MAX_CYCLES), *tbargs], stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+	with open(work + ".log", "wb") as f:
+		f.write(ret.stdout)
+	if ret.returncode != 0 or not os.path.exists(work + ".sig"):
+		passed, message = False, f"return code {ret.returncode}"
+	elif b"Max cycles reached" in ret.stdout or b"Hang detected" in ret.stdout:
+		passed, message = False, "[TIMOUT]"
+	else:
+		gold = read_reference(ref_path)
+		sig = open(work + ".sig", "rb").read()
+		if len(sig) < len(gold):
+			passed, message = False, f"signature is {len(sig)} bytes, reference is {len(gold)}"
+		else:
+			bad = sum(1 for i in range(0, len(gold), 4) if sig[i:i + 4] != gold[i:i + 4])
+			passed, message = bad == 0, f"{bad} of {len(gold) // 4} words differ"
+
+	os.makedirs(CACHE_DIR, exist_ok=True)
+	with open(cache_path + ".part", "w") as f:
+		json.dump({"passed": passed, "message": message}, f)
+	os.replace(cache_path + ".part", cache_path)
+	return passed, message, False
+
+def main():
+	parser = argparse.ArgumentParser(formatter_class=argparse.RawDescriptionHelpFormatter)
+	parser.add_argument("tests", nargs="*", help="Only run tests whose name contains one of these, e.g. add-01")
+	parser.add_argument("--device", action="append", choices=sorted(DEVICES), default=[],
+		help="Test suite to run. Can pass multiple times. Default: all.")
+	parser.add_argument("--tb", default=os.path.join(TB_DIR, "tb"), help="Simulator executable, e.g. ../rvcpp/rvcpp")
+	parser.add_argument("--tbarg", action="append", default=[], help="Extra argument to pass to the simulator. Can pass multiple times.")
+	parser.add_argument("-j", type=int, default=os.cpu_count(), help="Number of parallel jobs")
+	parser.add_argument("--no-cache", action="store_true", help="Run every test, even if its result is cached")
+	parser.epilog = """
+Example command lines:
+
+Run all suites against the default tb_cxxrtl build (make -C ../tb_cxxrtl first):
+./run_parallel.py
+
+Rerun the M suite under rvcpp:
+./run_parallel.py --device M --tb ../rvcpp/rvcpp --no-cache
+"""
+	args = parser.parse_args()
+
+	if not os.path.isdir(SUITE_DIR):
+		sys.exit(f"riscv-arch-test not found at {ARCH_TEST_DIR} (git submodule update --init)")
+	if not os.path.exists(args.tb):
+		sys.exit(f"Simulator {args.tb} not found")
+	tb_path = os.path.abspath(args.tb)
+	design = design_hash(tb_path, args.tbarg)
+
+	tests = []
+	for device in args.device or sorted(DEVICES):
+		for src in sorted(glob.glob(os.path.join(SUITE_DIR, "rv32i_m", device, "src", "*.S"))):
+			name = os.path.basename(src)[:-len(".S")]
+			if not args.tests or any(t in name for t in args.tests):
+				tests.append((device, src))
+
+	print_lock = threading.Lock()
+	def job(test):
+		device, src = test
+		name = f"{device}/{os.path.basename(src)[:-len('.S')]}"
+		passed, message, cached = run_test(device, src, tb_path, args.tbarg, design, not args.no_cache)
+		with print_lock:
+			if passed:
+				status = "\033[32m[PASSED]\033[39m"
+			elif name in EXPECTED_FAILURES:
+				status = "\033[33m[XFAIL] \033[39m"
+			else:
+				status = "\033[31m[FAILED]\033[39m"
+			extra = " (cached)" if cached else ""
+			msg = f" {message}" if not passed else ""
+			print(f"{name:<40}{status}{extra}{msg}", flush=True)
+		return name, passed, message, cached
+
+	t_start = time.time()
+	with ThreadPoolExecutor(max_workers=max(1, args.j)) as pool:
+		results = list(pool.map(job, tests))
+
+	failed = [(n, m) for n, p, m, c in results if not p and n not in EXPECTED_FAILURES]
+	n_cached = sum(1 for r in results if r[3])
+	print(f"\nPassed: {sum(1 for r in results if r[1])} out of {len(results)} "
+		f"({n_cached} cached) in {time.time() - t_start:.1f} s")
+	if failed:
+		print("Failed:")
+		for n, m in failed:
+			print(f"  {n}: {m}")
+	sys.exit(1 if failed else 0)
+
+if __name__ == "__main__":
+	main()
@@ -1,6 +1,15 @@
 set -e
 
-make -C ../tb_cxxrtl tb
+# Runs on tb-fast, unless waveforms are wanted: pass --vcd for a VCD of each
+# test, from the debug build of tb
+TB=tb-fast
+VCD=0
+if [ "$1" = "--vcd" ]; then
+	TB=tb
+	VCD=1
+fi
+
+make -C ../tb_cxxrtl $TB
 cd riscv-tests/isa
 make XLEN=32 clean
 
@@ -8,4 +17,7 @@ make XLEN=32 clean
 # virtual memory test machine configuration.
 make -j$(nproc) XLEN=32 SKIP_V=1 rv32ui rv32uc rv32um rv32ua rv32mi
 
-for test in $(find -name "*-p-*.bin"); do echo $test; ../../../tb_cxxrtl/tb --bin $test --cycles 10000 --vcd $test.vcd --cpuret; done
\ No newline at end of file
+for test in $(find -name "*-p-*.bin"); do
+	echo $test
+	../../../tb_cxxrtl/$TB --bin $test --cycles 10000 $([ $VCD = 1 ] && echo --vcd $test.vcd) --cpuret
+done
@@ -290,6 +290,8 @@
 #define CSR_TDATA1 0x7a1
 #define CSR_TDATA2 0x7a2
 #define CSR_TDATA3 0x7a3
+#define CSR_TINFO 0x7a4
+#define CSR_TCONTROL 0x7a5
 #define CSR_DCSR 0x7b0
 #define CSR_DPC 0x7b1
 #define CSR_DSCRATCH 0x7b2
@@ -425,6 +427,7 @@
 #define CSR_MENTROPY 0xF15
 #define CSR_MNOISE 0x7A9
 
+#define CSR_HAZARD3_PMPCFGM0   0xbd0
 #define CSR_HAZARD3_MEIEA      0xbe0
 #define CSR_HAZARD3_MEIPA      0xbe1
 #define CSR_HAZARD3_MEIFA      0xbe2
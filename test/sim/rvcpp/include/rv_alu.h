@@ -0,0 +1,259 @@
+#pragma once
+
+#include "rv_decode.h"
+
+#include <cstddef>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_AES)
+#include <arm_neon.h>
+#endif
+
+// Pure ALU operations: the result depends only on the rs1 and rs2 values and
+// the immediate. RVCore::execute() instantiates rv_alu<op>() for each of
+// these, and rv_alu_array() evaluates the same code over arrays of operands
+// (for checking against RTL results in bulk), so the two can't diverge.
+//
+// The bitmanip helpers avoid data-dependent branches and loops, so that the
+// array loops vectorise. Where the host has an instruction for an op, it's
+// used instead: see the host kernels below.
+
+#define RV_ALU_OPS(X) \
+	/* RV32I */ \
+	X(ADD) X(SUB) X(SLL) X(SLT) X(SLTU) X(XOR) X(SRL) X(SRA) X(OR) X(AND) \
+	X(ADDI) X(SLTI) X(SLTIU) X(XORI) X(ORI) X(ANDI) X(SLLI) X(SRLI) X(SRAI) \
+	/* M */ \
+	X(MUL) X(MULH) X(MULHSU) X(MULHU) X(DIV) X(DIVU) X(REM) X(REMU) \
+	/* Zba */ \
+	X(SH1ADD) X(SH2ADD) X(SH3ADD) \
+	/* Zbb */ \
+	X(ANDN) X(ORN) X(XNOR) X(CLZ) X(CPOP) X(CTZ) X(MAX) X(MAXU) X(MIN) X(MINU) \
+	X(ORC_B) X(REV8) X(ROL) X(ROR) X(RORI) X(SEXT_B) X(SEXT_H) \
+	/* Zbc */ \
+	X(CLMUL) X(CLMULH) X(CLMULR) \
+	/* Zbs */ \
+	X(BCLR) X(BCLRI) X(BEXT) X(BEXTI) X(BINV) X(BINVI) X(BSET) X(BSETI) \
+	/* Zbkb */ \
+	X(PACK) X(PACKH) X(BREV8) X(ZIP) X(UNZIP)
+
+static inline ux_t alu_ror(ux_t x, uint shamt) {
+	shamt &= 0x1f;
+	return (x >> shamt) | (x << (-shamt & 0x1f));
+}
+
+static inline ux_t alu_rol(ux_t x, uint shamt) {
+	shamt &= 0x1f;
+	return (x << shamt) | (x >> (-shamt & 0x1f));
+}
+
+// Host kernels. Carry-less multiply uses PCLMULQDQ on x86-64, if the CPU has
+// it (checked once at startup, unless the build targets it anyway), and PMULL
+// on AArch64 builds with the crypto extension. zip and unzip use BMI2's pdep
+// and pext only in builds which target BMI2 (e.g. make HOST_FLAGS=-march=native),
+// as they're microcoded on older AMD cores. clz, ctz, cpop and rev8 are the
+// compiler builtins, which become single instructions where the build target
+// has them; cpop is open-coded otherwise, rather than a libgcc call.
+
+#if defined(__x86_64__)
+static inline __attribute__((target("pclmul"))) uint64_t alu_clmul_host(ux_t a, ux_t b) {
+	__m128i p = _mm_clmulepi64_si128(_mm_cvtsi32_si128(a), _mm_cvtsi32_si128(b), 0);
+	return _mm_cvtsi128_si64(p);
+}
+#ifdef __PCLMUL__
+static const bool alu_host_clmul = true;
+#else
+static const bool alu_host_clmul = [] {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul");
+}();
+#endif
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_AES)
+static inline uint64_t alu_clmul_host(ux_t a, ux_t b) {
+	return vgetq_lane_u64(vreinterpretq_u64_p128(vmull_p64(a, b)), 0);
+}
+static const bool alu_host_clmul = true;
+#else
+static inline uint64_t alu_clmul_host(ux_t, ux_t) {
+	return 0;
+}
+static const bool alu_host_clmul = false;
+#endif
+
+// Full 64-bit carry-less product
+static inline uint64_t alu_clmul(ux_t a, ux_t b) {
+	if (alu_host_clmul)
+		return alu_clmul_host(a, b);
+	uint64_t product = 0;
+	for (int i = 0; i < 32; ++i)
+		product ^= ((uint64_t)a << i) & -(uint64_t)((b >> i) & 0x1u);
+	return product;
+}
+
+static inline ux_t alu_cpop(ux_t x) {
+#if defined(__POPCNT__) || defined(__aarch64__)
+	return __builtin_popcount(x);
+#else
+	x = x - ((x >> 1) & 0x55555555u);
+	x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+	x = (x + (x >> 4)) & 0x0f0f0f0fu;
+	return (x * 0x01010101u) >> 24;
+#endif
+}
+
+// Move bit i of the lower halfword to bit 2 * i
+static inline ux_t alu_spread16(ux_t x) {
+	x &= 0xffffu;
+	x = (x | (x << 8)) & 0x00ff00ffu;
+	x = (x | (x << 4)) & 0x0f0f0f0fu;
+	x = (x | (x << 2)) & 0x33333333u;
+	x = (x | (x << 1)) & 0x55555555u;
+	return x;
+}
+
+// Inverse of alu_spread16 (odd bits are discarded)
+static inline ux_t alu_compact16(ux_t x) {
+	x &= 0x55555555u;
+	x = (x | (x >> 1)) & 0x33333333u;
+	x = (x | (x >> 2)) & 0x0f0f0f0fu;
+	x = (x | (x >> 4)) & 0x00ff00ffu;
+	x = (x | (x >> 8)) & 0x0000ffffu;
+	return x;
+}
+
+// Interleave the lower half into the even bits, and the upper into the odd
+static inline ux_t alu_zip(ux_t x) {
+#ifdef __BMI2__
+	return _pdep_u32(x, 0x55555555u) | _pdep_u32(x >> 16, 0xaaaaaaaau);
+#else
+	return alu_spread16(x) | (alu_spread16(x >> 16) << 1);
+#endif
+}
+
+static inline ux_t alu_unzip(ux_t x) {
+#ifdef __BMI2__
+	return _pext_u32(x, 0x55555555u) | (_pext_u32(x, 0xaaaaaaaau) << 16);
+#else
+	return alu_compact16(x) | (alu_compact16(x >> 1) << 16);
+#endif
+}
+
+static inline ux_t alu_brev8(ux_t x) {
+	x = ((x & 0xf0f0f0f0u) >> 4) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x & 0xccccccccu) >> 2) | ((x & 0x33333333u) << 2);
+	x = ((x & 0xaaaaaaaau) >> 1) | ((x & 0x55555555u) << 1);
+	return x;
+}
+
+static inline ux_t alu_orc_b(ux_t x) {
+	// MSB of each byte is set if the byte is nonzero
+	ux_t nonzero = (((x & 0x7f7f7f7fu) + 0x7f7f7f7fu) | x) & 0x80808080u;
+	return (nonzero >> 7) * 0xffu;
+}
+
+template <rv_op OP>
+static inline __attribute__((always_inline)) ux_t rv_alu(ux_t rs1, ux_t rs2, ux_t imm) {
+	switch (OP) {
+
+	// Register-register ops
+
+	case RVOP_ADD:    return rs1 + rs2;
+	case RVOP_SUB:    return rs1 - rs2;
+	case RVOP_SLL:    return rs1 << (rs2 & 0x1f);
+	case RVOP_SLT:    return (sx_t)rs1 < (sx_t)rs2;
+	case RVOP_SLTU:   return rs1 < rs2;
+	case RVOP_XOR:    return rs1 ^ rs2;
+	case RVOP_SRL:    return rs1 >> (rs2 & 0x1f);
+	case RVOP_SRA:    return (sx_t)rs1 >> (rs2 & 0x1f);
+	case RVOP_OR:     return rs1 | rs2;
+	case RVOP_AND:    return rs1 & rs2;
+	case RVOP_XNOR:   return rs1 ^ ~rs2;
+	case RVOP_ORN:    return rs1 | ~rs2;
+	case RVOP_ANDN:   return rs1 & ~rs2;
+	case RVOP_BCLR:   return rs1 & ~(1u << (rs2 & 0x1f));
+	case RVOP_BEXT:   return (rs1 >> (rs2 & 0x1f)) & 0x1u;
+	case RVOP_BINV:   return rs1 ^ (1u << (rs2 & 0x1f));
+	case RVOP_BSET:   return rs1 | (1u << (rs2 & 0x1f));
+	case RVOP_SH1ADD: return (rs1 << 1) + rs2;
+	case RVOP_SH2ADD: return (rs1 << 2) + rs2;
+	case RVOP_SH3ADD: return (rs1 << 3) + rs2;
+	case RVOP_MAX:    return (sx_t)rs1 > (sx_t)rs2 ? rs1 : rs2;
+	case RVOP_MAXU:   return rs1 > rs2 ? rs1 : rs2;
+	case RVOP_MIN:    return (sx_t)rs1 < (sx_t)rs2 ? rs1 : rs2;
+	case RVOP_MINU:   return rs1 < rs2 ? rs1 : rs2;
+	case RVOP_PACK:   return (rs1 & 0xffffu) | (rs2 << 16);
+	case RVOP_PACKH:  return (rs1 & 0xffu) | ((rs2 & 0xffu) << 8);
+	case RVOP_ROR:    return alu_ror(rs1, rs2);
+	case RVOP_ROL:    return alu_rol(rs1, rs2);
+	case RVOP_CLMUL:  return alu_clmul(rs1, rs2);
+	case RVOP_CLMULH: return alu_clmul(rs1, rs2) >> 32;
+	case RVOP_CLMULR: return alu_clmul(rs1, rs2) >> 31;
+
+	// M extension
+
+	case RVOP_MUL:    return rs1 * rs2;
+	case RVOP_MULH:   return ((sdx_t)(sx_t)rs1 * (sdx_t)(sx_t)rs2) >> XLEN;
+	case RVOP_MULHSU: return ((sdx_t)(sx_t)rs1 * (sdx_t)rs2) >> XLEN;
+	case RVOP_MULHU:  return ((uint64_t)rs1 * rs2) >> XLEN;
+	case RVOP_DIV:
+		return rs2 == 0 ? ~0u : rs2 == ~0u ? -rs1 : (ux_t)((sx_t)rs1 / (sx_t)rs2);
+	case RVOP_DIVU:   return rs2 ? rs1 / rs2 : ~0u;
+	case RVOP_REM:
+		// rs2 == -1 would overflow on rs1 == INT_MIN
+		return rs2 == 0 ? rs1 : rs2 == ~0u ? 0 : (ux_t)((sx_t)rs1 % (sx_t)rs2);
+	case RVOP_REMU:   return rs2 ? rs1 % rs2 : rs1;
+
+	// Register-immediate ops (imm is shamt for shifts)
+
+	case RVOP_ADDI:   return rs1 + imm;
+	case RVOP_SLTI:   return (sx_t)rs1 < (sx_t)imm;
+	case RVOP_SLTIU:  return rs1 < imm;
+	case RVOP_XORI:   return rs1 ^ imm;
+	case RVOP_ORI:    return rs1 | imm;
+	case RVOP_ANDI:   return rs1 & imm;
+	case RVOP_SLLI:   return rs1 << imm;
+	case RVOP_SRLI:   return rs1 >> imm;
+	case RVOP_SRAI:   return (sx_t)rs1 >> imm;
+	case RVOP_BCLRI:  return rs1 & ~(1u << imm);
+	case RVOP_BINVI:  return rs1 ^ (1u << imm);
+	case RVOP_BSETI:  return rs1 | (1u << imm);
+	case RVOP_BEXTI:  return (rs1 >> imm) & 0x1u;
+	case RVOP_RORI:   return alu_ror(rs1, imm);
+
+	// Single-operand ops
+
+	case RVOP_CLZ:    return rs1 ? __builtin_clz(rs1) : 32;
+	case RVOP_CPOP:   return alu_cpop(rs1);
+	case RVOP_CTZ:    return rs1 ? __builtin_ctz(rs1) : 32;
+	case RVOP_SEXT_B: return (rs1 & 0xffu) - ((rs1 & 0x80u) << 1);
+	case RVOP_SEXT_H: return (rs1 & 0xffffu) - ((rs1 & 0x8000u) << 1);
+	case RVOP_REV8:   return __builtin_bswap32(rs1);
+	case RVOP_ZIP:    return alu_zip(rs1);
+	case RVOP_UNZIP:  return alu_unzip(rs1);
+	case RVOP_BREV8:  return alu_brev8(rs1);
+	case RVOP_ORC_B:  return alu_orc_b(rs1);
+
+	default:          return 0;
+	}
+}
+
+// Kept out of line, as GCC does not vectorise the loops once they are inlined
+// into a larger function
+template <rv_op OP>
+static __attribute__((noinline)) void rv_alu_loop(const ux_t *a, const ux_t *b, ux_t *rd, size_t n) {
+	for (size_t i = 0; i < n; ++i)
+		rd[i] = rv_alu<OP>(a[i], b[i], b[i]);
+}
+
+// Evaluate rd[i] = op(a[i], b[i]) for i < n, where b is the rs2 value for
+// register-register ops, and the immediate for register-immediate ops.
+// Returns false if op is not in RV_ALU_OPS.
+static inline bool rv_alu_array(rv_op op, const ux_t *a, const ux_t *b, ux_t *rd, size_t n) {
+	switch (op) {
+#define RV_ALU_ARRAY_CASE(name) case RVOP_ ## name: rv_alu_loop<RVOP_ ## name>(a, b, rd, n); return true;
+	RV_ALU_OPS(RV_ALU_ARRAY_CASE)
+#undef RV_ALU_ARRAY_CASE
+	default:
+		return false;
+	}
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+// Architectural checkpoints, for sampled simulation: rvcpp fast-forwards to
+// a point of interest and saves one (--save-arch), and tb_cxxrtl loads it
+// into the RTL through the Debug Module (--restore-arch) to run a detailed
+// window from there. Shared by both, so no C++17, and no dependencies on the
+// rest of rvcpp.
+//
+// Unlike snapshots, which hold each simulator's full internal state, a
+// checkpoint is only what software can see: one hart's GPRs, pc, privilege
+// and CSRs, the timer, the IRQ inputs and RAM. Microarchitectural state
+// (and the Xh3irq controller's per-IRQ state) starts from reset, hence the
+// warm-up window before measuring. The file is text, one field per line:
+//
+//     cycle <n>              Cycle count when saved
+//     pc <addr>
+//     priv <0|3>
+//     x<n> <value>           GPRs 1 to 31
+//     csr <addr> <value>     In the order they must be restored
+//     mtime <value>
+//     mtimecmp <value>
+//     softirq <0|1>
+//     irq <lines>
+//     ram <file>             Raw RAM image from address 0, relative to the
+//                            checkpoint's directory
+//
+// Numbers are hex with a 0x prefix, except cycle and priv.
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct ArchCheckpoint {
+	uint64_t cycle = 0;
+	uint32_t pc = 0;
+	uint32_t priv = 3;
+	uint32_t x[32] = {0};
+	std::vector<std::pair<uint16_t, uint32_t>> csrs;
+	uint64_t mtime = 0;
+	uint64_t mtimecmp = 0;
+	bool softirq = false;
+	uint32_t irq = 0;
+	// Trailing zeroes are not saved
+	std::vector<uint8_t> ram;
+
+	// The RAM image is written to path + ".ram"
+	bool save(const std::string &path, std::string &err) const {
+		std::string ram_path = path + ".ram";
+		std::ofstream f(path);
+		if (!f.is_open()) {
+			err = "Failed to open \"" + path + "\" for writing";
+			return false;
+		}
+		char buf[64];
+		f << "cycle " << cycle << "\n";
+		snprintf(buf, sizeof(buf), "pc 0x%08x\npriv %u\n", pc, priv);
+		f << buf;
+		for (int i = 1; i < 32; ++i) {
+			snprintf(buf, sizeof(buf), "x%d 0x%08x\n", i, x[i]);
+			f << buf;
+		}
+		for (const auto &c : csrs) {
+			snprintf(buf, sizeof(buf), "csr 0x%03x 0x%08x\n", c.first, c.second);
+			f << buf;
+		}
+		snprintf(buf, sizeof(buf), "mtime 0x%016llx\nmtimecmp 0x%016llx\n",
+			(unsigned long long)mtime, (unsigned long long)mtimecmp);
+		f << buf;
+		snprintf(buf, sizeof(buf), "softirq %d\nirq 0x%08x\n", softirq ? 1 : 0, irq);
+		f << buf;
+		f << "ram " << ram_path.substr(ram_path.find_last_of('/') + 1) << "\n";
+		if (!f.good()) {
+			err = "Failed to write \"" + path + "\"";
+			return false;
+		}
+
+		size_t ram_size = ram.size();
+		while (ram_size > 0 && !ram[ram_size - 1])
+			--ram_size;
+		FILE *r = fopen(ram_path.c_str(), "wb");
+		bool ok = r && fwrite(ram.data(), 1, ram_size, r) == ram_size;
+		if (r && fclose(r) != 0)
+			ok = false;
+		if (!ok)
+			err = "Failed to write \"" + ram_path + "\"";
+		return ok;
+	}
+
+	// RAM beyond max_ram is an error
+	bool load(const std::string &path, size_t max_ram, std::string &err) {
+		std::ifstream f(path);
+		if (!f.is_open()) {
+			err = "Failed to open \"" + path + "\"";
+			return false;
+		}
+		std::string ram_path;
+		std::string line;
+		for (int lineno = 1; std::getline(f, line); ++lineno) {
+			std::istringstream s(line);
+			std::string key;
+			if (!(s >> key))
+				continue;
+			unsigned long long a = 0, b = 0;
+			bool ok = true;
+			if (key == "ram") {
+				ok = (bool)(s >> ram_path);
+			} else if (key == "csr") {
+				ok = (bool)(s >> std::hex >> a >> b) && a < 0x1000;
+				csrs.push_back({(uint16_t)a, (uint32_t)b});
+			} else if (key == "cycle" || key == "priv") {
+				ok = (bool)(s >> std::dec >> a);
+			} else {
+				ok = (bool)(s >> std::hex >> a);
+			}
+			if (!ok) {
+				err = "Bad line " + std::to_string(lineno) + " in \"" + path + "\": " + line;
+				return false;
+			}
+			if (key == "cycle")
+				cycle = a;
+			else if (key == "pc")
+				pc = a;
+			else if (key == "priv")
+				priv = a;
+			else if (key == "mtime")
+				mtime = a;
+			else if (key == "mtimecmp")
+				mtimecmp = a;
+			else if (key == "softirq")
+				softirq = a;
+			else if (key == "irq")
+				irq = a;
+			else if (is_gpr(key))
+				x[std::stoul(key.substr(1))] = a;
+			else if (key != "ram" && key != "csr") {
+				err = "Unknown field \"" + key + "\" in \"" + path + "\"";
+				return false;
+			}
+		}
+		if (ram_path.empty()) {
+			err = "No RAM image in \"" + path + "\"";
+			return false;
+		}
+
+		size_t dir_end = path.find_last_of('/');
+		if (ram_path[0] != '/' && dir_end != std::string::npos)
+			ram_path = path.substr(0, dir_end + 1) + ram_path;
+		std::ifstream r(ram_path, std::ios::binary);
+		if (!r.is_open()) {
+			err = "Failed to open \"" + ram_path + "\"";
+			return false;
+		}
+		ram.assign(std::istreambuf_iterator<char>(r), std::istreambuf_iterator<char>());
+		if (ram.size() > max_ram) {
+			err = "RAM image \"" + ram_path + "\" is larger than memory";
+			return false;
+		}
+		return true;
+	}
+
+private:
+	static bool is_gpr(const std::string &key) {
+		if (key.size() < 2 || key.size() > 3 || key[0] != 'x' ||
+				key.find_first_not_of("0123456789", 1) != std::string::npos)
+			return false;
+		unsigned long n = std::stoul(key.substr(1));
+		return n >= 1 && n <= 31;
+	}
+};
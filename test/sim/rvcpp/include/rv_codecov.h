@@ -0,0 +1,177 @@
+#pragma once
+
+// Guest code coverage for rvcpp's --code-coverage. Bitmaps with one bit per
+// halfword of the loaded image record which instructions have executed, and
+// for conditional branches, which ways they have gone. The core marks whole
+// cached blocks at a time as it leaves them (see RVCore::codecov_block),
+// so the cost with --block-cache is per block rather than per instruction.
+//
+// At exit, the bitmaps are mapped through the ELF file's DWARF line table
+// (rv_dwarf.h) to an lcov tracefile: a line is hit if any instruction in
+// its address ranges executed, and a function if its first instruction did.
+// Every conditional branch (found by decoding the image) has two lcov
+// branches, taken and not taken. Counts are 1 for hit and 0 for not, so
+// tracefiles from many runs merge with `lcov -a` into counts of runs.
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "rv_dwarf.h"
+#include "rv_elf.h"
+
+struct CodeCoverage {
+	uint32_t base;
+	uint32_t top;
+	std::vector<uint64_t> executed;
+	std::vector<uint64_t> taken;
+	std::vector<uint64_t> not_taken;
+
+	CodeCoverage(uint32_t base_, uint32_t top_): base(base_ & ~1u), top(top_) {
+		size_t n_words = ((uint64_t)top - base + 127) / 128;
+		executed.resize(n_words, 0);
+		taken.resize(n_words, 0);
+		not_taken.resize(n_words, 0);
+	}
+
+	// Mark the instructions in [start, end) as executed
+	void execute(uint32_t start, uint32_t end) {
+		if (start < base || end > top || start >= end)
+			return;
+		uint32_t i = (start - base) >> 1;
+		uint32_t j = (end - base + 1) >> 1;
+		while (i < j) {
+			uint32_t n = std::min(j - i, 64 - (i & 63));
+			executed[i >> 6] |= (n == 64 ? ~0ull : (1ull << n) - 1) << (i & 63);
+			i += n;
+		}
+	}
+
+	void branch(uint32_t pc, bool was_taken) {
+		if (pc < base || pc >= top)
+			return;
+		uint32_t i = (pc - base) >> 1;
+		(was_taken ? taken : not_taken)[i >> 6] |= 1ull << (i & 63);
+	}
+
+	bool is_executed(uint32_t pc) const {
+		return test(executed, pc);
+	}
+
+	// OR in another map over the same range (e.g. another hart's)
+	void merge(const CodeCoverage &other) {
+		for (size_t i = 0; i < executed.size() && i < other.executed.size(); ++i) {
+			executed[i] |= other.executed[i];
+			taken[i] |= other.taken[i];
+			not_taken[i] |= other.not_taken[i];
+		}
+	}
+
+	// Write an lcov tracefile, with conditional branches found by decoding
+	// `mem` (which holds the image at mem_base), and a one-line summary to
+	// `summary` if not null. Returns false on failure to open the file.
+	bool write_lcov(const std::string &path, const DwarfLines &lines, const ElfFile &elf,
+			const uint8_t *mem, uint32_t mem_base, uint32_t mem_size, FILE *summary) const {
+		struct Branch {
+			uint32_t pc;
+			bool executed;
+		};
+		struct Line {
+			bool hit = false;
+			std::vector<Branch> branches;
+		};
+		struct File {
+			std::map<uint32_t, Line> lines;
+			// (line, name, hit)
+			std::vector<std::pair<uint32_t, std::pair<std::string, bool>>> functions;
+		};
+		std::map<std::string, File> files;
+		for (const DwarfLines::Range &r : lines.ranges) {
+			const std::string &name = lines.files[r.file];
+			if (name.empty() || r.start < base || r.end > top)
+				continue;
+			Line &l = files[name].lines[r.line];
+			for (uint32_t pc = r.start; pc < r.end; ) {
+				if (pc - mem_base >= mem_size || pc - mem_base + 2 > mem_size)
+					break;
+				uint16_t h = mem[pc - mem_base] | mem[pc - mem_base + 1] << 8;
+				bool exec = is_executed(pc);
+				l.hit = l.hit || exec;
+				bool is_branch = (h & 0x7f) == 0x63 || (h & 0xc003) == 0xc001;
+				if (is_branch)
+					l.branches.push_back({pc, exec});
+				pc += (h & 0x3) == 0x3 ? 4 : 2;
+			}
+		}
+		for (auto &fn : elf.functions) {
+			const DwarfLines::Range *r = lines.find(fn.first);
+			if (!r || lines.files[r->file].empty() || fn.first < base || fn.first >= top)
+				continue;
+			files[lines.files[r->file]].functions.push_back(
+				std::make_pair(r->line, std::make_pair(fn.second, is_executed(fn.first))));
+		}
+
+		FILE *f = fopen(path.c_str(), "w");
+		if (!f)
+			return false;
+		uint64_t lf = 0, lh = 0, fnf = 0, fnh = 0, brf = 0, brh = 0;
+		for (auto &it : files) {
+			const File &file = it.second;
+			fprintf(f, "TN:\nSF:%s\n", it.first.c_str());
+			uint64_t file_fnh = 0;
+			for (auto &fn : file.functions)
+				fprintf(f, "FN:%" PRIu32 ",%s\n", fn.first, fn.second.first.c_str());
+			for (auto &fn : file.functions) {
+				fprintf(f, "FNDA:%d,%s\n", fn.second.second, fn.second.first.c_str());
+				file_fnh += fn.second.second;
+			}
+			fprintf(f, "FNF:%zu\nFNH:%" PRIu64 "\n", file.functions.size(), file_fnh);
+			uint64_t file_brf = 0, file_brh = 0;
+			for (auto &l : file.lines) {
+				for (size_t i = 0; i < l.second.branches.size(); ++i) {
+					const Branch &b = l.second.branches[i];
+					for (int way = 0; way < 2; ++way) {
+						bool hit = test(way ? not_taken : taken, b.pc);
+						if (b.executed)
+							fprintf(f, "BRDA:%" PRIu32 ",%zu,%d,%d\n", l.first, i, way, hit);
+						else
+							fprintf(f, "BRDA:%" PRIu32 ",%zu,%d,-\n", l.first, i, way);
+						++file_brf;
+						file_brh += hit;
+					}
+				}
+			}
+			fprintf(f, "BRF:%" PRIu64 "\nBRH:%" PRIu64 "\n", file_brf, file_brh);
+			uint64_t file_lh = 0;
+			for (auto &l : file.lines) {
+				fprintf(f, "DA:%" PRIu32 ",%d\n", l.first, l.second.hit);
+				file_lh += l.second.hit;
+			}
+			fprintf(f, "LF:%zu\nLH:%" PRIu64 "\nend_of_record\n", file.lines.size(), file_lh);
+			lf += file.lines.size();
+			lh += file_lh;
+			fnf += file.functions.size();
+			fnh += file_fnh;
+			brf += file_brf;
+			brh += file_brh;
+		}
+		bool ok = fclose(f) == 0;
+		if (summary) {
+			fprintf(summary, "Code coverage: lines %" PRIu64 "/%" PRIu64 ", functions %" PRIu64 "/%" PRIu64
+				", branches %" PRIu64 "/%" PRIu64 " in %zu files\n", lh, lf, fnh, fnf, brh, brf, files.size());
+		}
+		return ok;
+	}
+
+private:
+	bool test(const std::vector<uint64_t> &bits, uint32_t pc) const {
+		if (pc < base || pc >= top)
+			return false;
+		uint32_t i = (pc - base) >> 1;
+		return bits[i >> 6] >> (i & 63) & 1u;
+	}
+};
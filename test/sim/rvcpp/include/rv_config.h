@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "rv_types.h"
+
+// Read the integer parameters from a Hazard3 config header: `localparam NAME
+// = value;` lines as in tb_cxxrtl/config_*.vh, or `parameter NAME = value,`
+// as in hdl/hazard3_config.vh. Values are plain decimal or sized Verilog
+// literals like 32'h40; anything else (e.g. replications) is skipped. On
+// failure, returns false and sets `err`.
+bool read_config_vh(const std::string &path, std::map<std::string, uint64_t> &params, std::string &err);
+
+// The Hazard3 parameters which change the architecture rvcpp implements.
+// Defaults match tb_cxxrtl/config_default.vh, and load() reads the same file
+// format, so rvcpp can be configured like the RTL it is checked against.
+//
+// Disabled extensions are handled when an instruction is decoded, and
+// decoded instructions are cached, so a smaller configuration costs nothing
+// in the interpreter: its disabled instructions simply decode to
+// RVOP_ILLEGAL, as on the RTL.
+struct RVConfig {
+	enum : uint32_t {
+		EXT_A        = 1u << 0,
+		EXT_C        = 1u << 1,
+		EXT_M        = 1u << 2,
+		EXT_ZBA      = 1u << 3,
+		EXT_ZBB      = 1u << 4,
+		EXT_ZBC      = 1u << 5,
+		EXT_ZBS      = 1u << 6,
+		EXT_ZBKB     = 1u << 7,
+		EXT_ZCB      = 1u << 8,
+		EXT_ZCMP     = 1u << 9,
+		EXT_ZIFENCEI = 1u << 10,
+		EXT_XH3BEXTM = 1u << 11,
+		EXT_XH3IRQ   = 1u << 12,
+		EXT_XH3PMPM  = 1u << 13,
+		EXT_XH3POWER = 1u << 14,
+		EXT_ALL      = (1u << 15) - 1
+	};
+
+	uint32_t ext = EXT_ALL;
+	bool u_mode = true;
+	uint pmp_regions = 4;
+	// mcycle, minstret, mcountinhibit and the HPM CSRs exist (CSR_COUNTER)
+	bool csr_counter = true;
+	// Trigger CSRs exist with debug support, and breakpoint triggers need it
+	bool debug_support = true;
+	uint breakpoint_triggers = 4;
+	// rvcpp's own mhpmcounter events (see HpmEvent). Off by default, and not
+	// read from config headers, as Hazard3 hardwires mhpmcounter3...31 and
+	// mhpmevent3...31 to zero, and the RTL is matched that way.
+	bool hpm_events = false;
+
+	uint triggers() const {
+		return debug_support ? breakpoint_triggers : 0;
+	}
+
+	bool has(uint32_t e) const {
+		return (ext & e) == e;
+	}
+
+	// Value of misa, as the RTL reports it
+	ux_t misa() const;
+
+	// Read EXTENSION_xxx, CSR_COUNTER, U_MODE, PMP_REGIONS, DEBUG_SUPPORT
+	// and BREAKPOINT_TRIGGERS, ignoring the others.
+	// Parameters missing from the file take their hazard3_config.vh
+	// defaults (only A, C and M enabled). On failure, returns false and sets
+	// `err`.
+	bool load(const std::string &path, std::string &err);
+};
@@ -1,11 +1,22 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <optional>
+#include <set>
+#include <vector>
 
+#include "rv_codecov.h"
 #include "rv_csr.h"
+#include "rv_decode.h"
+#include "rv_fault.h"
 #include "rv_types.h"
 #include "rv_mem.h"
+#include "rv_memheat.h"
+#include "rv_power.h"
+#include "rv_semihost.h"
+#include "rv_stats.h"
+#include "rv_trace.h"
 
 struct RVCore {
 	std::array<ux_t, 32> regs;
@@ -14,118 +25,537 @@ struct RVCore {
 	bool load_reserved;
 	MemBase32 &mem;
 	bool stalled_on_wfi;
+	// Steps spent stalled in WFI, which retire no instruction
+	uint64_t wfi_steps;
+	uint hartid;
+
+	// Destination for trace output from step(). Defaults to text on stdout.
+	TraceSink *trace_sink;
+
+	// If present, step() records each retired instruction here
+	ExecStats *stats;
+
+	// If present, steps stalled in WFI, and wakes from them, are counted here
+	PowerStats::Hart *power;
+
+	// If present, every load, store and executed instruction is counted here
+	// (loads and stores once they pass PMP)
+	MemHeatmap *heatmap;
+
+	// If present, executed instructions and branch directions are marked
+	// here: by step() per instruction, and by run_block() per cached block
+	// when it moves on from one (per instruction without --block-cache)
+	CodeCoverage *codecov;
+
+	// If present, semihosting calls (ebreaks between the semihosting marker
+	// instructions) are handled here, instead of trapping. Semihost uses
+	// this core's RAM.
+	Semihost *semihost;
+
+	// Optional global monitor, shared with other harts. If present, its lock
+	// is held for the duration of each LR/SC/AMO.
+	GlobalMonitor *monitor;
+
+	// If present, each access is checked against the bus fault rules armed
+	// here (see rv_fault.h), as this hart's port. Fetches are checked once
+	// per executed instruction, by step(), which run_block() falls back to
+	// for fetches a rule could fail (cached blocks are not used while
+	// any fetch rule is armed). excl_failed is set by the last checked
+	// access if a rule failed it with hexokay low.
+	FaultInjector *faults;
+	bool excl_failed;
+
+	// If `mem` is a MemMap32, plain memory regions in the map are accessed
+	// directly through their host pointers, bypassing the virtual calls.
+	MemMap32 *memmap;
 
 	// A single flat RAM is handled as a special case, in addition to whatever
 	// is in `mem`, because this avoids virtual calls for the majority of
 	// memory accesses. This RAM takes precedence over whatever is mapped at
 	// the same address in `mem`. (Note the size of this RAM may be zero, and
-	// RAM can also be added to the `mem` object.)
-	ux_t *ram;
+	// RAM can also be added to the `mem` object.) The RAM may be shared with
+	// other harts, in which case it's owned by the caller. It is stored
+	// little-endian, byte-addressed from ram_base.
+	uint8_t *ram;
 	ux_t ram_base;
 	ux_t ram_top;
+	bool ram_owned;
+
+	// A 32-bit store to this RAM address with bit 0 set ends the simulation,
+	// with exit code data >> 1, following the riscv-tests `tohost`
+	// convention. Stores here are always single-stepped by run_block(), so
+	// the exit is taken on the right cycle. Default is an unaligned address,
+	// which never matches.
+	ux_t tohost_addr;
+
+	// Decoded instructions fetched from `ram`, direct-mapped by PC. An entry
+	// is valid only for the PC, privilege level and PMP configuration it was
+	// fetched with, so a hit can skip the fetch permission checks as well as
+	// the decode. Entries are invalidated by stores to `ram` which overlap
+	// the instruction, and the whole cache is flushed by fence.i.
+	static const ux_t DCACHE_SIZE = 1u << 16;
+	static const ux_t DCACHE_INVALID_PC = 1u;
+	struct DecodeCacheEntry {
+		ux_t pc;
+		uint pmp_gen;
+		uint priv;
+		RVDecodedInstr d;
+	};
+	std::vector<DecodeCacheEntry> dcache;
+
+	// Block cache, used by run_block() when block_cache_enable is set. A
+	// block is a straight-line run of instructions from `ram`, ending at the
+	// first control transfer, stored pre-decoded so it can be run without any
+	// per-instruction fetch or cache lookup. No host code is generated. Blocks
+	// are tagged like the decode cache, plus a code generation count which is
+	// bumped by a store to any RAM granule containing cached code (or by a
+	// fence.i). The granule map is allocated on first use, as it scales with
+	// RAM.
+	static const ux_t BLOCK_CACHE_SIZE = 1u << 12;
+	static const uint MAX_BLOCK_LEN = 64;
+	static const uint BLOCK_GRANULE_SHIFT = 6;
+	struct CachedBlock {
+		ux_t pc;
+		uint pmp_gen;
+		uint priv;
+		uint code_gen;
+		// Address following the last instruction
+		ux_t end_pc;
+		std::vector<RVDecodedInstr> instrs;
+	};
+	bool block_cache_enable;
+	uint block_code_gen;
+	std::vector<CachedBlock> block_cache;
+	std::vector<uint8_t> block_code_map;
 
-	RVCore(MemBase32 &_mem, ux_t reset_vector, ux_t ram_base_, ux_t ram_size_) : mem(_mem) {
+	// Breakpoints, set by the GDB stub. An instruction at a breakpoint is
+	// never put in the decode cache or a cached block, so fetch_decode()
+	// only needs to check on a cache miss (using a per-page count to skip
+	// the set lookup), and fails the fetch. step() then sets breakpoint_hit
+	// and returns without executing anything. The breakpoint at
+	// bp_ignore_pc, if any, is ignored, for stepping off a breakpoint.
+	static const uint BP_PAGE_SHIFT = 12;
+	std::multiset<ux_t> breakpoints;
+	std::vector<uint16_t> bp_page_count;
+	bool breakpoint_hit;
+	ux_t bp_ignore_pc;
+
+	// Addresses of the armed breakpoint triggers (tdata1/tdata2), marked in
+	// bp_page_count in the same way, so that no fetch pays for a trigger
+	// check unless it misses the decode cache on a page with a trigger.
+	// Whether a trigger fires also depends on privilege and tcontrol.mte,
+	// so fetch_decode() checks that every time it fetches one. Refreshed by
+	// sync_triggers() whenever the CSRs' trigger_gen moves on.
+	std::vector<ux_t> trigger_pcs;
+	uint trigger_gen;
+
+	RVCore(MemBase32 &_mem, ux_t reset_vector, ux_t ram_base_, ux_t ram_size_,
+			uint8_t *shared_ram=nullptr, uint hartid_=0) : csr(hartid_), mem(_mem) {
+		memmap = dynamic_cast<MemMap32*>(&_mem);
+		monitor = nullptr;
+		faults = nullptr;
+		excl_failed = false;
+		trace_sink = nullptr;
+		stats = nullptr;
+		power = nullptr;
+		heatmap = nullptr;
+		codecov = nullptr;
+		semihost = nullptr;
+		hartid = hartid_;
 		std::fill(std::begin(regs), std::end(regs), 0);
 		pc = reset_vector;
 		load_reserved = false;
 		stalled_on_wfi = false;
+		wfi_steps = 0;
 		ram_base = ram_base_;
 		ram_top = ram_base_ + ram_size_;
-		ram = new ux_t[ram_size_ / sizeof(ux_t)];
-		assert(ram);
 		assert(!(ram_base_ & 0x3));
 		assert(!(ram_size_ & 0x3));
 		assert(ram_base_ + ram_size_ >= ram_base_);
-		for (ux_t i = 0; i < ram_size_ / sizeof(ux_t); ++i)
-			ram[i] = 0;
+		tohost_addr = DCACHE_INVALID_PC;
+		ram_owned = !shared_ram;
+		if (shared_ram) {
+			ram = shared_ram;
+		} else {
+			ram = host_ram_alloc(ram_size_);
+		}
+		breakpoint_hit = false;
+		bp_ignore_pc = DCACHE_INVALID_PC;
+		trigger_gen = 0;
+		block_cache_enable = false;
+		block_code_gen = 0;
+		block_cache.resize(BLOCK_CACHE_SIZE);
+		for (auto &b : block_cache)
+			b.pc = DCACHE_INVALID_PC;
+		dcache.resize(DCACHE_SIZE);
+		flush_decode_cache();
 	}
 
 	~RVCore() {
-		delete ram;
-	}
-
-	enum {
-		OPC_LOAD     = 0b00'000,
-		OPC_MISC_MEM = 0b00'011,
-		OPC_OP_IMM   = 0b00'100,
-		OPC_AUIPC    = 0b00'101,
-		OPC_STORE    = 0b01'000,
-		OPC_AMO      = 0b01'011,
-		OPC_OP       = 0b01'100,
-		OPC_LUI      = 0b01'101,
-		OPC_BRANCH   = 0b11'000,
-		OPC_JALR     = 0b11'001,
-		OPC_JAL      = 0b11'011,
-		OPC_SYSTEM   = 0b11'100,
-		OPC_CUSTOM0  = 0b00'010
-	};
+		if (ram_owned)
+			host_ram_free(ram, ram_top - ram_base);
+	}
 
-	// Functions to read/write memory from this hart's point of view
-	std::optional<uint8_t> r8(ux_t addr, uint permissions=0x1u) {
-		if (!(csr.get_pmp_xwr(addr) & permissions)) {
-			return {};
-		} else if (addr >= ram_base && addr < ram_top) {
-			return ram[(addr - ram_base) >> 2] >> 8 * (addr & 0x3) & 0xffu;
-		} else {
-			return mem.r8(addr);
+	// Save or restore hart state (not including RAM) through archive `a`.
+	// The decode cache must be flushed after restoring.
+	template <typename Archive>
+	void serialize(Archive &a) {
+		a(regs);
+		a(pc);
+		a(load_reserved);
+		a(stalled_on_wfi);
+		csr.serialize(a);
+	}
+
+	// Select the extensions, U-mode, PMP regions and triggers to implement (by
+	// default, those of tb_cxxrtl's default config). Must be set before the
+	// core starts running.
+	void set_config(const RVConfig &c) {
+		csr.set_config(c);
+		flush_decode_cache();
+	}
+
+	static ux_t dcache_index(ux_t addr) {
+		return (addr >> 1) & (DCACHE_SIZE - 1);
+	}
+
+	// Must be called if RAM contents are modified other than through w8(),
+	// w16(), w32(), e.g. when loading a new binary.
+	void flush_decode_cache() {
+		for (auto &e : dcache)
+			e.pc = DCACHE_INVALID_PC;
+		flush_block_cache();
+	}
+
+	void flush_block_cache() {
+		++block_code_gen;
+		std::fill(block_code_map.begin(), block_code_map.end(), 0);
+	}
+
+	// Invalidate any cached instruction overlapping the n bytes at addr. A
+	// 32-bit instruction may start up to 2 bytes before the store.
+	void invalidate_decode_cache(ux_t addr, uint n) {
+		if (n == 0)
+			return;
+		ux_t start = (addr & -2u) - 2;
+		uint count = ((addr + n - 1) >> 1) - (addr >> 1) + 2;
+		for (uint i = 0; i < count; ++i) {
+			ux_t pc_match = start + 2 * i;
+			DecodeCacheEntry &e = dcache[dcache_index(pc_match)];
+			if (e.pc == pc_match)
+				e.pc = DCACHE_INVALID_PC;
+		}
+		if (!block_code_map.empty() && (
+				block_code_map[(addr - ram_base) >> BLOCK_GRANULE_SHIFT] ||
+				block_code_map[(addr + n - 1 - ram_base) >> BLOCK_GRANULE_SHIFT])) {
+			flush_block_cache();
 		}
 	}
 
-	bool w8(ux_t addr, uint8_t data) {
-		if (!(csr.get_pmp_xwr(addr) & 0x2u)) {
+	bool is_breakpoint(ux_t addr) const {
+		return !bp_page_count.empty() && bp_page_count[addr >> BP_PAGE_SHIFT] && breakpoints.count(addr);
+	}
+
+	void add_breakpoint(ux_t addr) {
+		if (bp_page_count.empty())
+			bp_page_count.resize(1ull << (32 - BP_PAGE_SHIFT));
+		breakpoints.insert(addr);
+		++bp_page_count[addr >> BP_PAGE_SHIFT];
+		DecodeCacheEntry &e = dcache[dcache_index(addr)];
+		if (e.pc == addr)
+			e.pc = DCACHE_INVALID_PC;
+		flush_block_cache();
+	}
+
+	bool is_trigger_pc(ux_t addr) const {
+		return !bp_page_count.empty() && bp_page_count[addr >> BP_PAGE_SHIFT] &&
+			std::find(trigger_pcs.begin(), trigger_pcs.end(), addr) != trigger_pcs.end();
+	}
+
+	void sync_triggers() {
+		for (ux_t addr : trigger_pcs)
+			--bp_page_count[addr >> BP_PAGE_SHIFT];
+		trigger_pcs = csr.get_trigger_pcs();
+		if (!trigger_pcs.empty() && bp_page_count.empty())
+			bp_page_count.resize(1ull << (32 - BP_PAGE_SHIFT));
+		for (ux_t addr : trigger_pcs) {
+			++bp_page_count[addr >> BP_PAGE_SHIFT];
+			DecodeCacheEntry &e = dcache[dcache_index(addr)];
+			if (e.pc == addr)
+				e.pc = DCACHE_INVALID_PC;
+		}
+		flush_block_cache();
+		trigger_gen = csr.get_trigger_gen();
+	}
+
+	// Removes one instance of the breakpoint at addr. No effect if not set.
+	void remove_breakpoint(ux_t addr) {
+		auto it = breakpoints.find(addr);
+		if (it == breakpoints.end())
+			return;
+		breakpoints.erase(it);
+		--bp_page_count[addr >> BP_PAGE_SHIFT];
+	}
+
+	// Any write by this hart clears other harts' reservations on the same
+	// granule, when the global monitor is enabled
+	void monitor_notify_write(ux_t addr) {
+		if (monitor && monitor->enabled) {
+			std::lock_guard<std::recursive_mutex> guard(monitor->lock);
+			monitor->clear_others(hartid, addr);
+		}
+	}
+
+	void heatmap_count(ux_t addr, MemHeatmap::Kind kind) {
+		if (heatmap)
+			heatmap->access(addr, kind);
+	}
+
+	// Mark the instruction d, which just ran from instr_pc, in codecov
+	void codecov_count(ux_t instr_pc, const RVDecodedInstr &d) {
+		codecov->execute(instr_pc, instr_pc + d.len);
+		codecov_branch(instr_pc, d);
+	}
+
+	// The direction of a conditional branch is known from where pc went.
+	// After an exception, it went neither way.
+	void codecov_branch(ux_t instr_pc, const RVDecodedInstr &d) {
+		if (d.op >= RVOP_BEQ && d.op <= RVOP_BGEU) {
+			if (pc == instr_pc + d.imm)
+				codecov->branch(instr_pc, true);
+			else if (pc == instr_pc + d.len)
+				codecov->branch(instr_pc, false);
+		}
+	}
+
+	// Mark the first n instructions of block b, which ran from its start.
+	// Only the last can be a branch.
+	void codecov_block(const CachedBlock &b, size_t n) {
+		if (n == 0)
+			return;
+		ux_t last_pc = b.end_pc - b.instrs.back().len;
+		if (n < b.instrs.size()) {
+			last_pc = b.pc;
+			for (size_t i = 0; i + 1 < n; ++i)
+				last_pc += b.instrs[i].len;
+		}
+		codecov->execute(b.pc, last_pc);
+		codecov_count(last_pc, b.instrs[n - 1]);
+	}
+
+	std::unique_lock<std::recursive_mutex> lock_monitor() {
+		if (monitor)
+			return std::unique_lock<std::recursive_mutex>(monitor->lock);
+		else
+			return std::unique_lock<std::recursive_mutex>();
+	}
+
+	// Check an access against the armed fault rules. Returns false if it
+	// fails with a bus error; an exclusive access failed with hexokay low
+	// passes, with excl_failed set.
+	bool fault_pass(ux_t addr, uint32_t access, bool excl=false) {
+		FaultInjector::Result r = faults->check(addr, access, excl, hartid);
+		excl_failed = r == FaultInjector::EXFAIL;
+		return r != FaultInjector::FAULT;
+	}
+
+	bool faults_armed() const {
+		return faults && faults->armed();
+	}
+
+	// Functions to read/write memory from this hart's point of view. Each
+	// returns false on a fault. Loads return the data zero-extended in
+	// `data`. Accesses to `ram` are handled inline, as these are the vast
+	// majority; anything else goes through the out-of-line read_slow() and
+	// write_slow(). As on the bus, the address LSBs are ignored for RAM
+	// accesses which are not naturally aligned (e.g. c.lw). Instruction
+	// fetches (permissions 0x4) are not counted in the heatmap here, as most
+	// hit in the decode cache: they're counted as instructions execute. The
+	// same goes for fault injection. Exclusive accesses (excl) only differ
+	// in which fault rules see them.
+
+	bool r8(ux_t addr, ux_t &data, uint permissions=0x1u) {
+		if (!(csr.get_pmp_xwr(addr) & permissions))
+			return false;
+		if (heatmap && permissions != 0x4u)
+			heatmap->access(addr, MemHeatmap::READ);
+		if (faults_armed() && permissions != 0x4u && !fault_pass(addr, FaultRule::READ))
 			return false;
-		} else if (addr >= ram_base && addr < ram_top) {
-			ram[(addr - ram_base) >> 2] &= ~(0xffu << 8 * (addr & 0x3));
-			ram[(addr - ram_base) >> 2] |= (uint32_t)data << 8 * (addr & 0x3);
+		if (addr >= ram_base && addr < ram_top) {
+			data = ram[addr - ram_base];
 			return true;
-		} else {
-			return mem.w8(addr, data);
 		}
+		return read_slow(addr, 1, data);
 	}
 
-	std::optional<uint16_t> r16(ux_t addr, uint permissions=0x1u) {
-		if (!(csr.get_pmp_xwr(addr) & permissions)) {
-			return {};
-		} else if (addr >= ram_base && addr < ram_top) {
-			return ram[(addr - ram_base) >> 2] >> 8 * (addr & 0x2) & 0xffffu;
-		} else {
-			return mem.r16(addr);
+	bool r16(ux_t addr, ux_t &data, uint permissions=0x1u) {
+		if (!(csr.get_pmp_xwr(addr) & permissions))
+			return false;
+		if (heatmap && permissions != 0x4u)
+			heatmap->access(addr, MemHeatmap::READ);
+		if (faults_armed() && permissions != 0x4u && !fault_pass(addr, FaultRule::READ))
+			return false;
+		if (addr >= ram_base && addr < ram_top) {
+			data = le_load16(ram + ((addr & -2u) - ram_base));
+			return true;
 		}
+		return read_slow(addr, 2, data);
 	}
 
-	bool w16(ux_t addr, uint16_t data) {
-		if (!(csr.get_pmp_xwr(addr) & 0x2u)) {
+	bool r32(ux_t addr, ux_t &data, uint permissions=0x1u, bool excl=false) {
+		if (!(csr.get_pmp_xwr(addr) & permissions))
+			return false;
+		if (heatmap && permissions != 0x4u)
+			heatmap->access(addr, MemHeatmap::READ);
+		if (faults_armed() && permissions != 0x4u && !fault_pass(addr, FaultRule::READ, excl))
 			return false;
-		} else if (addr >= ram_base && addr < ram_top) {
-			ram[(addr - ram_base) >> 2] &= ~(0xffffu << 8 * (addr & 0x2));
-			ram[(addr - ram_base) >> 2] |= (uint32_t)data << 8 * (addr & 0x2);
+		if (addr >= ram_base && addr < ram_top) {
+			data = le_load32(ram + ((addr & -4u) - ram_base));
 			return true;
-		} else {
-			return mem.w16(addr, data);
 		}
+		return read_slow(addr, 4, data);
 	}
 
-	std::optional<uint32_t> r32(ux_t addr, uint permissions=0x1u) {
-		if (!(csr.get_pmp_xwr(addr) & permissions)) {
-			return {};
-		} else if (addr >= ram_base && addr < ram_top) {
-			return ram[(addr - ram_base) >> 2];
-		} else {
-			return mem.r32(addr);
+	bool w8(ux_t addr, uint8_t data) {
+		if (!(csr.get_pmp_xwr(addr) & 0x2u))
+			return false;
+		heatmap_count(addr, MemHeatmap::WRITE);
+		if (faults_armed() && !fault_pass(addr, FaultRule::WRITE))
+			return false;
+		monitor_notify_write(addr);
+		if (addr >= ram_base && addr < ram_top) {
+			ram[addr - ram_base] = data;
+			invalidate_decode_cache(addr, 1);
+			return true;
+		}
+		return write_slow(addr, 1, data);
+	}
+
+	bool w16(ux_t addr, uint16_t data) {
+		if (!(csr.get_pmp_xwr(addr) & 0x2u))
+			return false;
+		heatmap_count(addr, MemHeatmap::WRITE);
+		if (faults_armed() && !fault_pass(addr, FaultRule::WRITE))
+			return false;
+		monitor_notify_write(addr);
+		if (addr >= ram_base && addr < ram_top) {
+			le_store16(ram + ((addr & -2u) - ram_base), data);
+			invalidate_decode_cache(addr & -2u, 2);
+			return true;
 		}
+		return write_slow(addr, 2, data);
 	}
 
-	bool w32(ux_t addr, uint32_t data) {
-		if (!(csr.get_pmp_xwr(addr) & 0x2u)) {
+	bool w32(ux_t addr, uint32_t data, bool excl=false) {
+		if (!(csr.get_pmp_xwr(addr) & 0x2u))
 			return false;
-		} else if (addr >= ram_base && addr < ram_top) {
-			ram[(addr - ram_base) >> 2] = data;
+		heatmap_count(addr, MemHeatmap::WRITE);
+		// A write failed with hexokay low has no effect, but doesn't fault
+		if (faults_armed() && (!fault_pass(addr, FaultRule::WRITE, excl) || excl_failed))
+			return excl_failed;
+		monitor_notify_write(addr);
+		if (addr >= ram_base && addr < ram_top) {
+			le_store32(ram + ((addr & -4u) - ram_base), data);
+			invalidate_decode_cache(addr & -4u, 4);
+			if ((addr & -4u) == tohost_addr && (data & 1u))
+				throw TBExitException(data >> 1);
 			return true;
-		} else {
-			return mem.w32(addr, data);
 		}
+		return write_slow(addr, 4, data);
+	}
+
+	// Accesses outside of `ram`, after the PMP check: plain memory regions
+	// in `memmap` through their host pointers, else `mem`
+	bool read_slow(ux_t addr, uint size, ux_t &data);
+	bool write_slow(ux_t addr, uint size, ux_t data);
+
+	// True if the n words at addr (word-aligned) are all in `ram` and all
+	// pass the PMP check, so a multi-word transfer can be one copy
+	bool ram_words_ok(ux_t addr, uint n, uint permissions);
+
+	// Fetch and decode the instruction at addr, through the decode cache if
+	// possible. Returns nullptr on fetch fault. The returned pointer is valid
+	// until the next call; `scratch` is used for uncacheable fetches.
+	const RVDecodedInstr *fetch_decode(ux_t addr, RVDecodedInstr &scratch);
+
+	// True if the instruction at pc is a jump or taken branch to itself, so
+	// the hart will spin there until it takes an IRQ
+	bool at_self_loop();
+
+	// State of a hart stalled in WFI, from msleep (bit 1 powerdown, bit 0
+	// deepsleep), as Hazard3's power controller would have it
+	PowerStats::State sleep_state() const {
+		return csr.get_msleep() & 0x2u ? PowerStats::POWERED_DOWN :
+			csr.get_msleep() & 0x1u ? PowerStats::DEEP_SLEEP : PowerStats::WFI;
 	}
 
+	// Effects of executing one instruction which are applied by the caller.
+	// Plain fields, so execute() and its callers compile to straight-line
+	// code: no GPR is written if regnum_rd is 0 or there is an exception,
+	// and pc_wdata only applies if pc_write is set. Fields which may be
+	// absent are NONE.
+	struct ExecResult {
+		static const uint NONE = ~0u;
+		ux_t rd_wdata = 0;
+		uint regnum_rd = 0;
+		ux_t pc_wdata = 0;
+		bool pc_write = false;
+		uint exception_cause = NONE;
+		// Only set when tracing
+		uint trace_csr_addr = NONE;
+		uint trace_priv = NONE;
+	};
+
+	template <bool TRACE>
+	void execute(const RVDecodedInstr *d, ExecResult &r);
+
+	// True if the instruction can be executed inside run_block(), i.e. it
+	// can't touch CSRs or anything outside of `ram`, so can't change the
+	// core's IRQ state or the state of any other device.
+	bool block_safe(const RVDecodedInstr &d);
+
+	bool block_exec(const RVDecodedInstr &d);
+
+	// Observation hooks in step(). Each combination has its own copy of
+	// step(), so the hooks which are off cost nothing per instruction.
+	static const uint HOOK_TRACE   = 1u << 0; // Trace records to trace_sink
+	static const uint HOOK_STATS   = 1u << 1; // Retirement counts to stats
+	static const uint HOOK_HEATMAP = 1u << 2; // Fetch counts to heatmap
+	static const uint HOOK_CODECOV = 1u << 3; // Executed instructions to codecov
+
+	// The hooks step(trace) uses, given which of stats, heatmap and codecov
+	// are set
+	uint step_hooks(bool trace) const {
+		return (trace ? HOOK_TRACE : 0) | (stats ? HOOK_STATS : 0) | (heatmap ? HOOK_HEATMAP : 0) |
+			(codecov ? HOOK_CODECOV : 0);
+	}
+
+	template <uint HOOKS>
+	void step_hooked();
+
+	// The step() variant for the current hooks, for loops which step many
+	// times: choose once, then call through the pointer. Must be chosen
+	// again if stats, heatmap or codecov change.
+	typedef void (RVCore::*StepFn)();
+	StepFn step_fn(bool trace) const;
+
 	// Fetch and execute one instruction from memory.
-	void step(bool trace=false);
+	void step(bool trace=false) {
+		(this->*step_fn(trace))();
+	}
+
+	// Execute up to max_steps instructions, returning the number executed.
+	// Equivalent to calling step() that many times (with the same counter
+	// and trap behaviour), as long as none of the core's IRQ inputs change
+	// in that time. Execution stops early at anything which may have some
+	// effect outside of the core and its RAM, such as a CSR or MMIO access,
+	// so the caller can update IRQ inputs and devices between calls. It also
+	// stops after a jump or taken branch to itself, so the caller can check
+	// for a hang. A core asleep in WFI, with no IRQ to wake it, sleeps for all
+	// max_steps at once.
+	uint64_t run_block(uint64_t max_steps);
+
+	// Look up the cached block at pc, decoding it if necessary.
+	// Returns nullptr if the instruction at pc can't go in a block.
+	const CachedBlock *block_lookup();
 };
@@ -1,25 +1,72 @@
 #pragma once
 #include <optional>
+#include <vector>
+#include "rv_config.h"
+#include "rv_irq_ctrl.h"
 #include "rv_types.h"
 
+// Events which can be selected by mhpmevent3...31, with
+// RVConfig::hpm_events. Hazard3 hardwires its mhpmcounters to zero, so
+// these are rvcpp's own event numbers.
+enum HpmEvent {
+	HPM_EVENT_NONE         = 0,
+	HPM_EVENT_BRANCH_TAKEN = 1, // Conditional branch taken
+	HPM_EVENT_LOAD         = 2, // Load (including LR and AMOs)
+	HPM_EVENT_STORE        = 3, // Store (including SC and AMOs)
+	HPM_EVENT_TRAP         = 4, // Exception or interrupt entry
+	HPM_EVENT_COMPRESSED   = 5, // 16-bit instruction executed
+	HPM_EVENT_MMIO         = 6, // Load or store outside of RAM
+	HPM_EVENT_WFI_CYCLE    = 7, // Cycle spent stalled in WFI
+	N_HPM_EVENTS
+};
+
+struct CsrProfile;
+
 class RVCSR {
 
 	static const int PMP_REGIONS = 16;
-	static const int IMPLEMENTED_PMP_REGIONS = 4;
+	static const int MAX_TRIGGERS = 16;
+	static const int N_HPM_COUNTERS = 29; // mhpmcounter3...31
+
+	// Extensions, U-mode and the number of implemented PMP regions (of
+	// PMP_REGIONS, the rest reading as zero)
+	RVConfig config;
 
 	// Latched IRQ signals into core
 	bool irq_t;
 	bool irq_s;
-	bool irq_e;
+	// Xh3irq controller, which drives mip.meip from the external IRQ lines
+	IrqCtrl irq_ctrl;
+	// IRQs which may be entered, from mip (all of them, unless checking
+	// against the RTL, which decides when IRQs are taken)
+	ux_t irq_entry_mask;
 
 	// Current core privilege level (M/S/U)
 	uint priv;
 
-	ux_t mcycle;
-	ux_t mcycleh;
-	ux_t minstret;
-	ux_t minstreth;
+	ux_t mhartid;
+
+	// mcycle and minstret are derived from the count of steps when read, so
+	// step() doesn't touch them: a counting counter's value is its value at
+	// the last rebase plus the steps since then. Both are rebased whenever
+	// either one or mcountinhibit is written.
+	uint64_t steps;
+	uint64_t counter_base;
+	uint64_t mcycle;
+	uint64_t minstret;
 	ux_t mcountinhibit;
+
+	// The core counts every event in hpm_event_count, and mhpmcounters are
+	// derived from these when read: a counting mhpmcounter's value is
+	// mhpmcounter (its value at the last rebase) plus the events since then.
+	// Counters are rebased whenever their event or inhibit is changed.
+	uint64_t hpm_event_count[N_HPM_EVENTS];
+	// Set when any mhpmcounter is counting an event. Events are only counted
+	// when set, which is safe because counters are rebased when they start.
+	bool hpm_active;
+	uint64_t mhpmcounter[N_HPM_COUNTERS];
+	uint64_t mhpmcounter_base[N_HPM_COUNTERS];
+	ux_t mhpmevent[N_HPM_COUNTERS];
 	ux_t mstatus;
 	ux_t mie;
 	ux_t mip;
@@ -31,15 +78,113 @@ class RVCSR {
 
 	ux_t pmpaddr[PMP_REGIONS];
 	ux_t pmpcfg[PMP_REGIONS / 4];
+	// Xh3pmpm: regions which apply to M-mode, as though locked
+	ux_t pmpcfgm;
+
+	// Breakpoint triggers: type 2 (mcontrol), execute address match only.
+	// rvcpp has no D-mode, so tdata1.dmode is always clear, and a trigger
+	// with action=1 (enter D-mode) never fires. Debug-mode writes aside,
+	// this is all of the state in hazard3_triggers.v.
+	struct Trigger {
+		bool action;
+		bool m;
+		bool u;
+		bool execute;
+		ux_t tdata2;
+	};
+	ux_t tselect;
+	Trigger triggers[MAX_TRIGGERS];
+	bool tcontrol_mte;
+	bool tcontrol_mpte;
+	// Incremented on every tdata1/tdata2 write, so that the core can
+	// re-mark the triggers' addresses (see RVCore::sync_triggers())
+	uint trigger_gen;
 
 	std::optional<ux_t> pending_write_addr;
 	ux_t pending_write_data;
+	// Write data before set/clear, and the write op (needed by Xh3irq)
+	ux_t pending_write_raw;
+	uint pending_write_op;
+
+	// Incremented on every PMP configuration write, so that cached PMP
+	// check results can be invalidated.
+	uint pmp_gen;
+
+	// Decoded PMP regions in priority order, refreshed whenever the PMP
+	// configuration changes. Regions with A=OFF are left out, so when PMP
+	// is entirely off, this is empty. l is set for regions which apply to
+	// M-mode (locked, or set in pmpcfgm0).
+	struct PMPRegion {
+		int region;
+		ux_t mask;
+		ux_t match;
+		uint xwr;
+		bool l;
+	};
+	PMPRegion pmp_active[PMP_REGIONS];
+	uint pmp_n_active;
+
+	// Permissions for an address which matches no region. Depends on priv
+	// and mstatus, so is refreshed whenever either of them may change.
+	uint pmp_xwr_nomatch;
+
+	void update_pmp_regions();
+	void update_pmp_nomatch();
+	uint get_pmp_xwr_match(ux_t addr);
+	uint get_pmp_xwr_range_match(ux_t addr, ux_t size);
+	uint pmp_region_xwr(const PMPRegion &r);
 
 	ux_t get_effective_xip();
 
+	bool tselect_in_range() const {
+		return tselect < config.triggers();
+	}
+
+	// True if a write to addr (with sufficient privilege) is legal
+	bool writable(uint16_t addr) const;
+
+	uint64_t mcycle_read() const {
+		return mcountinhibit & 0x1u ? mcycle : mcycle + steps - counter_base;
+	}
+
+	uint64_t minstret_read() const {
+		return mcountinhibit & 0x4u ? minstret : minstret + steps - counter_base;
+	}
+
+	void counter_rebase() {
+		mcycle = mcycle_read();
+		minstret = minstret_read();
+		counter_base = steps;
+	}
+
+	bool hpm_counting(int i) {
+		return !(mcountinhibit >> (i + 3) & 0x1u);
+	}
+
+	uint64_t hpm_read(int i) {
+		if (!hpm_counting(i))
+			return mhpmcounter[i];
+		return mhpmcounter[i] + hpm_event_count[mhpmevent[i]] - mhpmcounter_base[i];
+	}
+
+	void hpm_rebase(int i) {
+		mhpmcounter[i] = hpm_read(i);
+		mhpmcounter_base[i] = hpm_event_count[mhpmevent[i]];
+	}
+
+	void update_hpm_active() {
+		hpm_active = false;
+		for (int i = 0; i < N_HPM_COUNTERS; ++i)
+			hpm_active = hpm_active || (hpm_counting(i) && mhpmevent[i] != HPM_EVENT_NONE);
+	}
+
 	// Internal interface for updating trap state. Returns trap target pc.
 	ux_t trap_enter(uint xcause, ux_t xepc);
 
+	// read() and write(), less the profiling
+	std::optional<ux_t> read_impl(uint16_t addr, bool side_effect, ux_t wdata, uint op);
+	bool write_impl(uint16_t addr, ux_t data, uint op);
+
 	ux_t pmpcfg_a(int i) {
 		uint8_t cfg_bits = pmpcfg[i / 4] >> 8 * (i % 4);
 		return (cfg_bits >> 3) & 0x3u;
@@ -60,19 +205,36 @@ public:
 	enum {
 		WRITE = 0,
 		WRITE_SET = 1,
-		WRITE_CLEAR = 2
+		WRITE_CLEAR = 2,
+		// For read(): the CSR is not also written
+		NO_WRITE = 3
 	};
 
-	RVCSR() {
+	// Counts of CSR accesses (reads with side effects, i.e. by instructions,
+	// and writes) and trap entries, or nullptr if not profiling
+	CsrProfile *profile;
+
+	RVCSR(ux_t hartid=0) {
+		profile = nullptr;
+		mhartid = hartid;
 		irq_t = false;
 		irq_s = false;
-		irq_e = false;
+		irq_entry_mask = ~0u;
 		priv = 3;
+		steps = 0;
+		counter_base = 0;
 		mcycle = 0;
-		mcycleh = 0;
 		minstret = 0;
-		minstreth = 0;
 		mcountinhibit = 0x5;
+		for (int i = 0; i < N_HPM_EVENTS; ++i) {
+			hpm_event_count[i] = 0;
+		}
+		for (int i = 0; i < N_HPM_COUNTERS; ++i) {
+			mhpmcounter[i] = 0;
+			mhpmcounter_base[i] = 0;
+			mhpmevent[i] = HPM_EVENT_NONE;
+		}
+		hpm_active = false;
 		mstatus = 0;
 		mie = 0;
 		mip = 0;
@@ -82,18 +244,109 @@ public:
 		mcause = 0;
 		hazard3_msleep = 0;
 		pending_write_addr = {};
+		pmp_gen = 0;
 		for (int i = 0; i < PMP_REGIONS; ++i) {
 			pmpaddr[i] = 0;
 		}
 		for (int i = 0; i < PMP_REGIONS / 4; ++i) {
 			pmpcfg[i] = 0;
 		}
+		pmpcfgm = 0;
+		tselect = 0;
+		for (auto &t : triggers)
+			t = {false, false, false, false, 0};
+		tcontrol_mte = false;
+		tcontrol_mpte = false;
+		trigger_gen = 0;
+		update_pmp_regions();
+		update_pmp_nomatch();
+	}
+
+	// Must be called before the first step(), as it doesn't change existing
+	// state to match (e.g. pmpaddr registers beyond the new region count)
+	void set_config(const RVConfig &c);
+
+	const RVConfig &get_config() const {
+		return config;
+	}
+
+	void step() {
+		++steps;
+		if (pending_write_addr)
+			commit_write();
+		irq_ctrl.step();
+	}
+
+	// Apply the pending write from write(), if any, without advancing the
+	// counters. step() does this after each instruction; it's also used for
+	// writes from outside the hart (e.g. through the librvcpp API).
+	void commit_write();
+
+	// Save or restore all architectural state through archive `a`, which is
+	// called on each field in turn (see rv_snapshot.h)
+	template <typename Archive>
+	void serialize(Archive &a) {
+		a(irq_t); a(irq_s);
+		irq_ctrl.serialize(a);
+		a(priv);
+		// Saved as plain values, and rebased again after loading
+		counter_rebase();
+		a(mcycle); a(minstret);
+		a(mcountinhibit);
+		for (auto &x : hpm_event_count)
+			a(x);
+		for (auto &x : mhpmcounter)
+			a(x);
+		for (auto &x : mhpmcounter_base)
+			a(x);
+		for (auto &x : mhpmevent)
+			a(x);
+		a(mstatus); a(mie); a(mip); a(mtvec); a(mscratch); a(mepc); a(mcause);
+		a(hazard3_msleep);
+		for (auto &x : pmpaddr)
+			a(x);
+		for (auto &x : pmpcfg)
+			a(x);
+		a(pmpcfgm);
+		a(tselect);
+		for (auto &t : triggers) {
+			a(t.action); a(t.m); a(t.u); a(t.execute); a(t.tdata2);
+		}
+		a(tcontrol_mte); a(tcontrol_mpte);
+		a(pending_write_addr); a(pending_write_data); a(pending_write_raw); a(pending_write_op);
+		counter_base = steps;
+		++pmp_gen;
+		++trigger_gen;
+		update_pmp_regions();
+		update_pmp_nomatch();
+		update_hpm_active();
+	}
+
+	// Advance the counters as though step() were called n times, with no
+	// CSR write pending
+	void step_counters(uint64_t n) {
+		steps += n;
+	}
+
+	void count_event(HpmEvent e, uint64_t n = 1) {
+		if (hpm_active)
+			hpm_event_count[e] += n;
 	}
 
-	void step();
+	// Returns None on permission/decode fail. wdata and op are the write
+	// which the same instruction makes, if any: some Xh3irq CSRs use the
+	// write data to select the part of an array which is read.
+	std::optional<ux_t> read(uint16_t addr, bool side_effect=true, ux_t wdata=0, uint op=NO_WRITE);
 
-	// Returns None on permission/decode fail
-	std::optional<ux_t> read(uint16_t addr, bool side_effect=true);
+	// As read() with no side effects, but with M-mode privilege whatever the
+	// current privilege level, as for a debugger
+	std::optional<ux_t> peek(uint16_t addr) {
+		uint p = priv;
+		priv = 3;
+		std::optional<ux_t> x = read(addr, false);
+		priv = p;
+		return x;
+	}
 
 	// Returns false on permission/decode fail
 	bool write(uint16_t addr, ux_t data, uint op=WRITE);
@@ -107,6 +360,13 @@ public:
 	// trap target PC. Otherwise return None.
 	std::optional<ux_t> trap_check_enter_irq(ux_t xepc);
 
+	// True if trap_check_enter_irq() would currently enter an IRQ
+	bool irq_pending();
+
+	// True if an IRQ could be entered without the hart changing any of its
+	// own state, if the IRQ inputs in future_xip (bits as in mip) went high
+	bool irq_possible(ux_t future_xip);
+
 	// Update trap state, return mepc:
 	ux_t trap_mret();
 
@@ -120,6 +380,10 @@ public:
 		return mstatus & 0x00200000u;
 	}
 
+	ux_t get_msleep() const {
+		return hazard3_msleep;
+	}
+
 	void set_irq_t(bool irq) {
 		irq_t = irq;
 	}
@@ -128,16 +392,63 @@ public:
 		irq_s = irq;
 	}
 
-	void set_irq_e(bool irq) {
-		irq_e = irq;
+	// External IRQ lines 0 to 31, seen from the next step(), unless
+	// registered is false (see IrqCtrl)
+	void set_irq_e(ux_t lines, bool registered=true) {
+		irq_ctrl.set_irq_lines(lines, registered);
+	}
+
+	// True if the external IRQ lines change on the next step()
+	bool irq_inputs_settling() {
+		return irq_ctrl.lines_settling();
+	}
+
+	void set_irq_entry_mask(ux_t mask) {
+		irq_entry_mask = mask;
+	}
+
+	void set_num_irqs(uint n) {
+		irq_ctrl.set_num_irqs(n);
 	}
 
 	ux_t get_xcause() {
 		return mcause;
 	}
 
+	uint get_pmp_gen() {
+		return pmp_gen;
+	}
+
+	uint get_trigger_gen() const {
+		return trigger_gen;
+	}
+
+	// Addresses of the triggers which may fire, depending on privilege and
+	// tcontrol.mte, so the core only needs to check these when fetching
+	std::vector<ux_t> get_trigger_pcs() const;
+
+	// True if fetching from pc now breaks on a trigger (an M-mode ebreak
+	// exception, before the instruction executes)
+	bool trigger_fires(ux_t pc) const;
+
 	// Return region, or -1 for no match
 	int get_pmp_match(ux_t addr);
 
-	uint get_pmp_xwr(ux_t addr);
+	uint get_pmp_xwr(ux_t addr) {
+		if (!pmp_n_active) {
+			return pmp_xwr_nomatch;
+		}
+		return get_pmp_xwr_match(addr);
+	}
+
+	// Permissions for all of the size bytes at addr (word-aligned), if they
+	// fall in the same PMP region, or in none. Returns 0 if the range
+	// straddles a region boundary, in which case the caller must check each
+	// word with get_pmp_xwr().
+	uint get_pmp_xwr_range(ux_t addr, ux_t size) {
+		if (!pmp_n_active) {
+			return pmp_xwr_nomatch;
+		}
+		return get_pmp_xwr_range_match(addr, size);
+	}
 };
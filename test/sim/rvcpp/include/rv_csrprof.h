@@ -0,0 +1,202 @@
+#pragma once
+
+// CSR access and trap entry profile shared by rvcpp and tb_cxxrtl (so no
+// C++17, and no dependencies on the rest of rvcpp), for finding the hot
+// spots in trap handlers and IRQ dispatch: e.g. mstatus and mie around
+// critical sections, or the meinext/meicontext loop in common/irq_dispatch.S.
+//
+// Reads, writes and denied accesses (which raise an illegal instruction
+// exception) are counted per CSR, and trap entries per cause, in flat arrays
+// indexed by CSR number and cause, so recording is one increment. A CSR
+// instruction counts as a read unless it is csrrw/csrrwi with rd = x0, and
+// as a write unless it is csrrs/csrrc with rs1 = x0 (or csrrsi/csrrci with
+// a zero immediate), as the spec defines which side effects happen. Trap
+// entries are also counted per (cause, pc), where pc is the instruction
+// which trapped or the one the interrupt was taken before: these are few
+// enough to go in a hash map.
+//
+// rvcpp counts in RVCSR, which sees every CSR access and trap entry, with or
+// without the block cache. tb_cxxrtl decodes the CSR instructions which hart
+// 0 retires, and takes trap causes from mcause, so it counts the same things.
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "rv_elf.h"
+
+struct CsrProfile {
+	static const unsigned N_CSRS = 4096;
+	// Exception causes, then interrupt causes
+	static const unsigned N_CAUSES = 64;
+	// Trap PCs printed at exit
+	static const size_t TOP_PCS = 32;
+
+	uint64_t reads[N_CSRS];
+	uint64_t writes[N_CSRS];
+	uint64_t denied[N_CSRS];
+	uint64_t traps[N_CAUSES];
+	// Keyed on cause index << 32 | pc
+	std::unordered_map<uint64_t, uint64_t> trap_pcs;
+
+	CsrProfile(): reads{}, writes{}, denied{}, traps{} {}
+
+	void read(uint16_t addr, bool ok) {
+		++(ok ? reads : denied)[addr & (N_CSRS - 1)];
+	}
+
+	void write(uint16_t addr, bool ok) {
+		++(ok ? writes : denied)[addr & (N_CSRS - 1)];
+	}
+
+	// cause as written to mcause
+	void trap(uint32_t cause, uint32_t pc) {
+		unsigned i = cause_index(cause);
+		++traps[i];
+		++trap_pcs[(uint64_t)i << 32 | pc];
+	}
+
+	// Decode a CSR instruction (anything else is ignored), and count its
+	// accesses, which were all denied if it trapped
+	void instr(uint32_t instr, bool trapped) {
+		uint32_t funct3 = instr >> 12 & 0x7u;
+		if ((instr & 0x7fu) != 0x73u || funct3 == 0 || funct3 == 4)
+			return;
+		uint16_t addr = instr >> 20;
+		uint32_t rd = instr >> 7 & 0x1fu;
+		uint32_t rs1 = instr >> 15 & 0x1fu;
+		bool is_write = (funct3 & 0x3u) == 1;
+		if (!is_write || rd != 0)
+			read(addr, !trapped);
+		if (is_write || rs1 != 0)
+			write(addr, !trapped);
+	}
+
+	void print(FILE *f, unsigned hartid, const ElfFile *elf) const {
+		uint64_t total_reads = 0, total_writes = 0, total_denied = 0;
+		std::vector<std::pair<uint64_t, unsigned>> csrs;
+		for (unsigned i = 0; i < N_CSRS; ++i) {
+			total_reads += reads[i];
+			total_writes += writes[i];
+			total_denied += denied[i];
+			uint64_t n = reads[i] + writes[i] + denied[i];
+			if (n)
+				csrs.push_back(std::make_pair(n, i));
+		}
+		uint64_t total = total_reads + total_writes + total_denied;
+		uint64_t exceptions = 0, interrupts = 0;
+		for (unsigned i = 0; i < N_CAUSES; ++i)
+			(i < N_CAUSES / 2 ? exceptions : interrupts) += traps[i];
+
+		fprintf(f, "Hart %u: %" PRIu64 " CSR accesses (%" PRIu64 " reads, %" PRIu64 " writes, %" PRIu64
+			" denied), %" PRIu64 " trap entries (%" PRIu64 " exceptions, %" PRIu64 " interrupts)\n",
+			hartid, total, total_reads, total_writes, total_denied, exceptions + interrupts, exceptions,
+			interrupts);
+
+		std::sort(csrs.rbegin(), csrs.rend());
+		if (!csrs.empty())
+			fprintf(f, "  %-18s %12s %12s %12s  %6s\n", "CSR", "Reads", "Writes", "Denied", "%");
+		for (auto &c : csrs) {
+			unsigned i = c.second;
+			fprintf(f, "  %-14s %03x %12" PRIu64 " %12" PRIu64 " %12" PRIu64 "  %5.1f%%\n", csr_name(i).c_str(), i,
+				reads[i], writes[i], denied[i], percent(c.first, total));
+		}
+
+		std::vector<std::pair<uint64_t, unsigned>> causes;
+		for (unsigned i = 0; i < N_CAUSES; ++i) {
+			if (traps[i])
+				causes.push_back(std::make_pair(traps[i], i));
+		}
+		std::sort(causes.rbegin(), causes.rend());
+		if (!causes.empty())
+			fprintf(f, "  %-30s %12s  %6s\n", "Cause", "Entries", "%");
+		for (auto &c : causes)
+			fprintf(f, "  %-30s %12" PRIu64 "  %5.1f%%\n", cause_name(c.second).c_str(), c.first,
+				percent(c.first, exceptions + interrupts));
+
+		std::vector<std::pair<uint64_t, uint64_t>> pcs;
+		for (auto &p : trap_pcs)
+			pcs.push_back(std::make_pair(p.second, p.first));
+		// Ties in PC order, so the report doesn't depend on the hash map
+		std::sort(pcs.begin(), pcs.end(), [](const std::pair<uint64_t, uint64_t> &a,
+			const std::pair<uint64_t, uint64_t> &b) {
+			return a.first != b.first ? a.first > b.first : (uint32_t)a.second < (uint32_t)b.second;
+		});
+		if (!pcs.empty())
+			fprintf(f, "  %-8s  %-30s %12s  %6s  Function\n", "PC", "Cause", "Entries", "%");
+		for (size_t i = 0; i < pcs.size() && i < TOP_PCS; ++i) {
+			uint32_t pc = pcs[i].second;
+			fprintf(f, "  %08x  %-30s %12" PRIu64 "  %5.1f%%", pc, cause_name(pcs[i].second >> 32).c_str(),
+				pcs[i].first, percent(pcs[i].first, exceptions + interrupts));
+			uint32_t offset;
+			const char *func = elf ? elf->function_at(pc, offset) : nullptr;
+			if (func)
+				fprintf(f, "  %s+0x%x", func, offset);
+			fprintf(f, "\n");
+		}
+		if (pcs.size() > TOP_PCS)
+			fprintf(f, "  (%zu more trap PCs)\n", pcs.size() - TOP_PCS);
+	}
+
+	static unsigned cause_index(uint32_t cause) {
+		return (cause & (N_CAUSES / 2 - 1)) | (cause >> 31 ? N_CAUSES / 2 : 0);
+	}
+
+	static std::string cause_name(unsigned i) {
+		static const char *const exception_names[] = {
+			"instr misaligned", "instr fault", "illegal instr", "breakpoint", "load misaligned",
+			"load fault", "store misaligned", "store fault", "ecall from U", "ecall from S", nullptr,
+			"ecall from M"
+		};
+		unsigned code = i % (N_CAUSES / 2);
+		const char *name = nullptr;
+		if (i >= N_CAUSES / 2)
+			name = code == 3 ? "soft" : code == 7 ? "timer" : code == 11 ? "external" : nullptr;
+		else if (code < sizeof(exception_names) / sizeof(exception_names[0]))
+			name = exception_names[code];
+		std::string s = (i >= N_CAUSES / 2 ? "irq " : "exception ") + std::to_string(code);
+		return name ? s + " (" + name + ")" : s;
+	}
+
+	// Name of each CSR which Hazard3 or rvcpp implements, otherwise "-" (the
+	// number is printed alongside)
+	static std::string csr_name(unsigned addr) {
+		static const std::pair<unsigned, const char*> names[] = {
+			{0x300, "mstatus"}, {0x301, "misa"}, {0x304, "mie"}, {0x305, "mtvec"}, {0x320, "mcountinhibit"},
+			{0x340, "mscratch"}, {0x341, "mepc"}, {0x342, "mcause"}, {0x343, "mtval"}, {0x344, "mip"},
+			{0x7a0, "tselect"}, {0x7a1, "tdata1"}, {0x7a2, "tdata2"}, {0x7a4, "tinfo"}, {0x7a5, "tcontrol"},
+			{0x7b0, "dcsr"}, {0x7b1, "dpc"}, {0x7b2, "dscratch0"}, {0x7b3, "dscratch1"},
+			{0xb00, "mcycle"}, {0xb02, "minstret"}, {0xb80, "mcycleh"}, {0xb82, "minstreth"},
+			{0xbd0, "pmpcfgm0"}, {0xbe0, "meiea"}, {0xbe1, "meipa"}, {0xbe2, "meifa"}, {0xbe3, "meipra"},
+			{0xbe4, "meinext"}, {0xbe5, "meicontext"}, {0xbf0, "msleep"},
+			{0xc00, "cycle"}, {0xc02, "instret"}, {0xc80, "cycleh"}, {0xc82, "instreth"},
+			{0xf11, "mvendorid"}, {0xf12, "marchid"}, {0xf13, "mimpid"}, {0xf14, "mhartid"},
+			{0xf15, "mconfigptr"}
+		};
+		for (auto &n : names) {
+			if (n.first == addr)
+				return n.second;
+		}
+		if (addr >= 0x3a0 && addr <= 0x3a3)
+			return "pmpcfg" + std::to_string(addr - 0x3a0);
+		if (addr >= 0x3b0 && addr <= 0x3bf)
+			return "pmpaddr" + std::to_string(addr - 0x3b0);
+		if (addr >= 0x323 && addr <= 0x33f)
+			return "mhpmevent" + std::to_string(addr - 0x320);
+		if (addr >= 0xb03 && addr <= 0xb1f)
+			return "mhpmcounter" + std::to_string(addr - 0xb00);
+		if (addr >= 0xb83 && addr <= 0xb9f)
+			return "mhpmcounter" + std::to_string(addr - 0xb80) + "h";
+		return "-";
+	}
+
+private:
+	static double percent(uint64_t x, uint64_t total) {
+		return total ? 100.0 * x / total : 0.0;
+	}
+};
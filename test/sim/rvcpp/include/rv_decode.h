@@ -0,0 +1,89 @@
+#pragma once
+
+#include "rv_config.h"
+#include "rv_types.h"
+
+// List of decoded operations. Compressed instructions are expanded to their
+// 32-bit equivalents where the two have identical behaviour, so most of the
+// C_xxx entries only exist for the cases where rvcpp's compressed behaviour
+// differs from the expanded instruction (e.g. c.lw has no alignment check).
+
+#define RVOP_LIST(X) \
+	X(ILLEGAL)  \
+	/* RV32I */ \
+	X(LUI) X(AUIPC) X(JAL) X(JALR) \
+	X(BEQ) X(BNE) X(BLT) X(BGE) X(BLTU) X(BGEU) \
+	X(LB) X(LH) X(LW) X(LBU) X(LHU) \
+	X(SB) X(SH) X(SW) \
+	X(ADDI) X(SLTI) X(SLTIU) X(XORI) X(ORI) X(ANDI) X(SLLI) X(SRLI) X(SRAI) \
+	X(ADD) X(SUB) X(SLL) X(SLT) X(SLTU) X(XOR) X(SRL) X(SRA) X(OR) X(AND) \
+	X(FENCE) X(FENCE_I) \
+	X(ECALL) X(EBREAK) X(MRET) X(WFI) \
+	X(CSRRW) X(CSRRS) X(CSRRC) X(CSRRWI) X(CSRRSI) X(CSRRCI) \
+	/* M */ \
+	X(MUL) X(MULH) X(MULHSU) X(MULHU) X(DIV) X(DIVU) X(REM) X(REMU) \
+	/* A */ \
+	X(LR_W) X(SC_W) \
+	X(AMOSWAP_W) X(AMOADD_W) X(AMOXOR_W) X(AMOAND_W) X(AMOOR_W) \
+	X(AMOMIN_W) X(AMOMAX_W) X(AMOMINU_W) X(AMOMAXU_W) \
+	/* Zba */ \
+	X(SH1ADD) X(SH2ADD) X(SH3ADD) \
+	/* Zbb */ \
+	X(ANDN) X(ORN) X(XNOR) X(CLZ) X(CPOP) X(CTZ) X(MAX) X(MAXU) X(MIN) X(MINU) \
+	X(ORC_B) X(REV8) X(ROL) X(ROR) X(RORI) X(SEXT_B) X(SEXT_H) \
+	/* Zbc */ \
+	X(CLMUL) X(CLMULH) X(CLMULR) \
+	/* Zbs */ \
+	X(BCLR) X(BCLRI) X(BEXT) X(BEXTI) X(BINV) X(BINVI) X(BSET) X(BSETI) \
+	/* Zbkb */ \
+	X(PACK) X(PACKH) X(BREV8) X(ZIP) X(UNZIP) \
+	/* Xh3bextm */ \
+	X(H3_BEXTM) X(H3_BEXTMI) \
+	/* C/Zcb instructions with no exact 32-bit equivalent */ \
+	X(C_LW) X(C_SW) X(C_SH) \
+	/* Zcmp */ \
+	X(CM_PUSH) X(CM_POP) X(CM_POPRET) X(CM_POPRETZ) X(CM_MVSA01) X(CM_MVA01S)
+
+enum rv_op : uint8_t {
+#define RVOP_ENUM(name) RVOP_ ## name,
+	RVOP_LIST(RVOP_ENUM)
+#undef RVOP_ENUM
+	RVOP_COUNT
+};
+
+extern const char *const rv_op_names[RVOP_COUNT];
+
+// Fields are pre-extracted from the instruction, so that execution does not
+// need to look at the raw instruction bits (which are kept only for tracing
+// and for some of the more obscure instructions). Meaning of the fields:
+//
+// - imm: sign-extended immediate for I/S/B/U/J formats, shift amount for
+//   immediate shifts, CSR address for CSR instructions, field size for
+//   h3.bextm(i).
+// - rs2: shift amount for h3.bextmi.
+// - rs1/rs2: mapped s-register numbers for cm.mvsa01/cm.mva01s.
+// - rs2: number of registers for cm.push/cm.pop(ret(z)), and imm is the
+//   stack adjustment.
+
+struct RVDecodedInstr {
+	uint32_t instr;
+	rv_op op;
+	uint8_t len;
+	uint8_t rd;
+	uint8_t rs1;
+	uint8_t rs2;
+	ux_t imm;
+};
+
+// Decode a 32-bit instruction word (the upper half is ignored when the lower
+// half is a 16-bit instruction). Never fails: unrecognised instructions
+// decode to RVOP_ILLEGAL. Decoding is a lookup in tables generated at compile
+// time from the patterns in encoding/rv_opcodes.h, so an encoding is valid
+// exactly when it matches one of those patterns. This is the only decoder in
+// rvcpp: the interpreter, decode cache, block cache and the timing
+// model all go through it.
+//
+// Instructions from extensions missing from `ext` (RVConfig::EXT_xxx) also
+// decode to RVOP_ILLEGAL, following the RTL's decoder: e.g. without C, every
+// 16-bit encoding is illegal, and c.mul needs both Zcb and M.
+RVDecodedInstr rv_decode(uint32_t instr, uint32_t ext = RVConfig::EXT_ALL);
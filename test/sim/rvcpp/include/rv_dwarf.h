@@ -0,0 +1,371 @@
+#pragma once
+
+// DWARF line table reader, for mapping addresses back to source lines (as
+// rvcpp's --code-coverage does). No C++17, like rv_elf.h, which it reads
+// from. Only .debug_line is used: each unit's line program is run to get
+// the address range of every row, for DWARF versions 2 to 5 in the 32-bit
+// format, as GCC and Clang emit for RV32.
+//
+// Line info for code which the linker discarded (--gc-sections) is left at
+// address 0 by both GNU ld and LLD, where it would overlap the real code.
+// Sequences starting at 0 are dropped for this reason, which also drops the
+// vector table in common/init.S.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "rv_elf.h"
+
+struct DwarfLines {
+	struct Range {
+		uint32_t start;
+		uint32_t end; // Exclusive
+		uint32_t file; // Index into `files`
+		uint32_t line;
+		bool operator<(const Range &other) const {
+			return start < other.start;
+		}
+	};
+
+	// Full paths where the line table gives the directory
+	std::vector<std::string> files;
+	// Sorted by start address
+	std::vector<Range> ranges;
+
+	// Read the line tables from `elf`. On failure, returns false and sets
+	// `err`.
+	bool load(ElfFile &elf, std::string &err) {
+		std::vector<uint8_t> line, line_str, str;
+		if (!elf.read_section(".debug_line", line)) {
+			err = "No DWARF line info (.debug_line) in ELF file: build with -g";
+			return false;
+		}
+		elf.read_section(".debug_line_str", line_str);
+		elf.read_section(".debug_str", str);
+		Cursor c(line.data(), line.data() + line.size());
+		while (c.p < c.end) {
+			if (!unit(c, line_str, str)) {
+				err = "Malformed or unsupported .debug_line";
+				return false;
+			}
+		}
+		std::sort(ranges.begin(), ranges.end());
+		return true;
+	}
+
+	// The range containing addr, or nullptr if none
+	const Range *find(uint32_t addr) const {
+		Range key = {addr, 0, 0, 0};
+		auto it = std::upper_bound(ranges.begin(), ranges.end(), key);
+		if (it == ranges.begin())
+			return nullptr;
+		--it;
+		return addr < it->end ? &*it : nullptr;
+	}
+
+private:
+	std::map<std::string, uint32_t> file_index;
+
+	struct Cursor {
+		const uint8_t *p;
+		const uint8_t *end;
+		bool ok;
+
+		Cursor(const uint8_t *p_, const uint8_t *end_): p(p_), end(end_), ok(true) {}
+
+		uint64_t fixed(unsigned int n) {
+			uint64_t x = 0;
+			if (end - p < (ptrdiff_t)n) {
+				ok = false;
+				p = end;
+				return 0;
+			}
+			for (unsigned int i = 0; i < n; ++i)
+				x |= (uint64_t)*p++ << 8 * i;
+			return x;
+		}
+
+		uint64_t uleb() {
+			uint64_t x = 0;
+			for (unsigned int shift = 0; ; shift += 7) {
+				if (p == end) {
+					ok = false;
+					return x;
+				}
+				uint8_t b = *p++;
+				if (shift < 64)
+					x |= (uint64_t)(b & 0x7f) << shift;
+				if (!(b & 0x80))
+					return x;
+			}
+		}
+
+		int64_t sleb() {
+			uint64_t x = 0;
+			unsigned int shift = 0;
+			uint8_t b;
+			do {
+				if (p == end) {
+					ok = false;
+					return 0;
+				}
+				b = *p++;
+				if (shift < 64)
+					x |= (uint64_t)(b & 0x7f) << shift;
+				shift += 7;
+			} while (b & 0x80);
+			if (shift < 64 && (b & 0x40))
+				x |= ~0ull << shift;
+			return (int64_t)x;
+		}
+
+		std::string cstr() {
+			const uint8_t *s = p;
+			while (p < end && *p)
+				++p;
+			if (p == end) {
+				ok = false;
+				return "";
+			}
+			return std::string((const char*)s, (const char*)p++);
+		}
+	};
+
+	// Forms which can appear in DWARF 5 directory and file entries
+	enum {
+		DW_FORM_block = 0x09,
+		DW_FORM_data1 = 0x0b,
+		DW_FORM_data2 = 0x05,
+		DW_FORM_data4 = 0x06,
+		DW_FORM_data8 = 0x07,
+		DW_FORM_data16 = 0x1e,
+		DW_FORM_string = 0x08,
+		DW_FORM_strp = 0x0e,
+		DW_FORM_line_strp = 0x1f,
+		DW_FORM_udata = 0x0f
+	};
+	enum {
+		DW_LNCT_path = 1,
+		DW_LNCT_directory_index = 2
+	};
+
+	static std::string section_str(const std::vector<uint8_t> &sec, uint64_t offset) {
+		if (offset >= sec.size())
+			return "";
+		const char *s = (const char*)sec.data() + offset;
+		return std::string(s, strnlen(s, sec.size() - offset));
+	}
+
+	// Read one DWARF 5 entry attribute as a string or number
+	static bool form(Cursor &c, uint64_t f, const std::vector<uint8_t> &line_str, const std::vector<uint8_t> &str,
+			std::string &s, uint64_t &n) {
+		switch (f) {
+		case DW_FORM_string:    s = c.cstr(); break;
+		case DW_FORM_line_strp: s = section_str(line_str, c.fixed(4)); break;
+		case DW_FORM_strp:      s = section_str(str, c.fixed(4)); break;
+		case DW_FORM_udata:     n = c.uleb(); break;
+		case DW_FORM_data1:     n = c.fixed(1); break;
+		case DW_FORM_data2:     n = c.fixed(2); break;
+		case DW_FORM_data4:     n = c.fixed(4); break;
+		case DW_FORM_data8:     n = c.fixed(8); break;
+		case DW_FORM_data16:    c.fixed(8); c.fixed(8); break;
+		case DW_FORM_block: {
+			uint64_t len = c.uleb();
+			if ((uint64_t)(c.end - c.p) < len)
+				return false;
+			c.p += len;
+			break;
+		}
+		default:
+			return false;
+		}
+		return c.ok;
+	}
+
+	// DWARF 5 directory or file name table: a list of (content type, form)
+	// pairs, then the entries
+	static bool entry_table(Cursor &c, const std::vector<uint8_t> &line_str, const std::vector<uint8_t> &str,
+			std::vector<std::pair<std::string, uint64_t>> &entries) {
+		unsigned int n_formats = c.fixed(1);
+		std::vector<std::pair<uint64_t, uint64_t>> formats;
+		for (unsigned int i = 0; i < n_formats; ++i) {
+			uint64_t type = c.uleb();
+			formats.push_back(std::make_pair(type, c.uleb()));
+		}
+		uint64_t n_entries = c.uleb();
+		for (uint64_t i = 0; i < n_entries && c.ok; ++i) {
+			std::string path;
+			uint64_t dir = 0;
+			for (auto &f : formats) {
+				std::string s;
+				uint64_t n = 0;
+				if (!form(c, f.second, line_str, str, s, n))
+					return false;
+				if (f.first == DW_LNCT_path)
+					path = s;
+				else if (f.first == DW_LNCT_directory_index)
+					dir = n;
+			}
+			entries.push_back(std::make_pair(path, dir));
+		}
+		return c.ok;
+	}
+
+	uint32_t intern(const std::string &path) {
+		auto it = file_index.find(path);
+		if (it != file_index.end())
+			return it->second;
+		files.push_back(path);
+		return file_index[path] = files.size() - 1;
+	}
+
+	// Run one unit's line program, leaving the cursor at the next unit
+	bool unit(Cursor &c, const std::vector<uint8_t> &line_str, const std::vector<uint8_t> &str) {
+		uint64_t unit_length = c.fixed(4);
+		if (!c.ok || unit_length >= 0xfffffff0u || unit_length > (uint64_t)(c.end - c.p))
+			return false;
+		const uint8_t *unit_end = c.p + unit_length;
+		Cursor u(c.p, unit_end);
+		c.p = unit_end;
+
+		unsigned int version = u.fixed(2);
+		if (version < 2 || version > 5)
+			return false;
+		if (version >= 5) {
+			unsigned int address_size = u.fixed(1);
+			u.fixed(1); // segment_selector_size
+			if (address_size != 4)
+				return false;
+		}
+		uint64_t header_length = u.fixed(4);
+		if (!u.ok || header_length > (uint64_t)(u.end - u.p))
+			return false;
+		const uint8_t *program = u.p + header_length;
+		unsigned int min_instr_length = u.fixed(1);
+		if (version >= 4)
+			u.fixed(1); // maximum_operations_per_instruction
+		u.fixed(1); // default_is_stmt
+		int line_base = (int8_t)u.fixed(1);
+		unsigned int line_range = u.fixed(1);
+		unsigned int opcode_base = u.fixed(1);
+		if (line_range == 0 || opcode_base == 0)
+			return false;
+		std::vector<uint8_t> opcode_lengths(opcode_base, 0);
+		for (unsigned int i = 1; i < opcode_base; ++i)
+			opcode_lengths[i] = u.fixed(1);
+
+		// File numbers are from 1 before DWARF 5 (with 0 unused), and from 0
+		// in DWARF 5, so they index this directly
+		std::vector<std::string> dirs;
+		std::vector<uint32_t> unit_files;
+		auto add_file = [&](const std::string &name, uint64_t dir) {
+			std::string path = name;
+			if (!name.empty() && name[0] != '/' && dir < dirs.size() && !dirs[dir].empty())
+				path = dirs[dir] + "/" + name;
+			unit_files.push_back(intern(path));
+		};
+		if (version >= 5) {
+			std::vector<std::pair<std::string, uint64_t>> entries;
+			if (!entry_table(u, line_str, str, entries))
+				return false;
+			for (auto &e : entries)
+				dirs.push_back(e.first);
+			entries.clear();
+			if (!entry_table(u, line_str, str, entries))
+				return false;
+			for (auto &e : entries)
+				add_file(e.first, e.second);
+		} else {
+			// Directory 0 is the compilation directory, which is only in
+			// .debug_info, so file names relative to it are left relative
+			dirs.push_back("");
+			for (std::string d = u.cstr(); u.ok && !d.empty(); d = u.cstr())
+				dirs.push_back(d);
+			unit_files.push_back(intern(""));
+			for (std::string f = u.cstr(); u.ok && !f.empty(); f = u.cstr()) {
+				uint64_t dir = u.uleb();
+				u.uleb(); // mtime
+				u.uleb(); // length
+				add_file(f, dir);
+			}
+		}
+		if (!u.ok)
+			return false;
+
+		// State machine registers (only those that matter here)
+		u.p = program;
+		uint32_t addr = 0, file = 1, line = 1;
+		bool seq_dropped = false;
+		bool have_row = false;
+		Range row = {0, 0, 0, 0};
+		auto emit = [&](bool end_sequence) {
+			if (have_row && addr > row.start && !seq_dropped) {
+				row.end = addr;
+				ranges.push_back(row);
+			}
+			if (end_sequence) {
+				have_row = false;
+				seq_dropped = false;
+				return;
+			}
+			if (!have_row)
+				seq_dropped = addr == 0;
+			have_row = true;
+			row.start = addr;
+			row.file = file < unit_files.size() ? unit_files[file] : intern("");
+			row.line = line;
+		};
+		while (u.p < u.end && u.ok) {
+			unsigned int op = u.fixed(1);
+			if (op >= opcode_base) {
+				unsigned int adj = op - opcode_base;
+				addr += adj / line_range * min_instr_length;
+				line += line_base + (int)(adj % line_range);
+				emit(false);
+				continue;
+			}
+			switch (op) {
+			case 0: {
+				uint64_t len = u.uleb();
+				if (len == 0 || len > (uint64_t)(u.end - u.p))
+					return false;
+				const uint8_t *next = u.p + len;
+				unsigned int sub = u.fixed(1);
+				if (sub == 1) {
+					// DW_LNE_end_sequence
+					emit(true);
+					addr = 0;
+					file = 1;
+					line = 1;
+				} else if (sub == 2) {
+					// DW_LNE_set_address
+					addr = u.fixed(len - 1);
+				} else if (sub == 3 && version < 5) {
+					// DW_LNE_define_file
+					std::string f = u.cstr();
+					add_file(f, u.uleb());
+				}
+				u.p = next;
+				break;
+			}
+			case 1: emit(false); break;                                   // DW_LNS_copy
+			case 2: addr += u.uleb() * min_instr_length; break;           // DW_LNS_advance_pc
+			case 3: line += u.sleb(); break;                              // DW_LNS_advance_line
+			case 4: file = u.uleb(); break;                               // DW_LNS_set_file
+			case 8: addr += (255 - opcode_base) / line_range * min_instr_length; break; // DW_LNS_const_add_pc
+			case 9: addr += u.fixed(2); break;                            // DW_LNS_fixed_advance_pc
+			default:
+				// Anything else only has ULEB128 operands we don't need
+				for (unsigned int i = 0; i < opcode_lengths[op]; ++i)
+					u.uleb();
+				break;
+			}
+		}
+		return u.ok;
+	}
+};
@@ -0,0 +1,192 @@
+#pragma once
+
+// ELF loader shared by rvcpp and tb_cxxrtl (so no C++17, and no dependencies
+// on the rest of rvcpp). PT_LOAD segments are mapped copy-on-write straight
+// from the file wherever the file offset and load address have the same
+// alignment within a page, and copied otherwise. The symbol table is kept
+// for looking up symbols like `tohost`, and for attributing addresses to
+// functions. Other sections (e.g. DWARF) can be read by name.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+struct ElfFile {
+	struct Segment {
+		uint32_t addr; // Load address (LMA, as used by objcopy -O binary)
+		uint32_t memsz;
+		uint32_t filesz;
+		uint32_t offset;
+	};
+
+	uint32_t entry = 0;
+	std::vector<Segment> segments;
+	std::map<std::string, uint32_t> symbols;
+	// Function symbols sorted by address
+	std::vector<std::pair<uint32_t, std::string>> functions;
+
+	ElfFile() {}
+	ElfFile(const ElfFile&) = delete;
+
+	~ElfFile() {
+		if (fd >= 0)
+			::close(fd);
+	}
+
+	// Read the headers and symbol table. On failure, returns false and sets
+	// `err`.
+	bool open(const std::string &path, std::string &err) {
+		fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			err = "Failed to open \"" + path + "\"";
+			return false;
+		}
+		Elf32_Ehdr eh;
+		if (!read_at(0, &eh, sizeof(eh)) || memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0) {
+			err = "\"" + path + "\" is not an ELF file";
+			return false;
+		}
+		if (eh.e_ident[EI_CLASS] != ELFCLASS32 || eh.e_ident[EI_DATA] != ELFDATA2LSB || eh.e_machine != EM_RISCV) {
+			err = "\"" + path + "\" is not a 32-bit little-endian RISC-V ELF file";
+			return false;
+		}
+		entry = eh.e_entry;
+		shoff = eh.e_shoff;
+		shentsize = eh.e_shentsize;
+		shnum = eh.e_shnum;
+		shstrndx = eh.e_shstrndx;
+
+		for (unsigned int i = 0; i < eh.e_phnum; ++i) {
+			Elf32_Phdr ph;
+			if (!read_at(eh.e_phoff + i * eh.e_phentsize, &ph, sizeof(ph))) {
+				err = "Truncated program header in \"" + path + "\"";
+				return false;
+			}
+			if (ph.p_type == PT_LOAD && ph.p_memsz > 0)
+				segments.push_back({ph.p_paddr, ph.p_memsz, ph.p_filesz, ph.p_offset});
+		}
+
+		// Symbols are optional (the file may be stripped)
+		for (unsigned int i = 0; i < eh.e_shnum; ++i) {
+			Elf32_Shdr sh, strtab;
+			if (!read_at(eh.e_shoff + i * eh.e_shentsize, &sh, sizeof(sh)) || sh.sh_type != SHT_SYMTAB)
+				continue;
+			if (!read_at(eh.e_shoff + sh.sh_link * eh.e_shentsize, &strtab, sizeof(strtab)))
+				continue;
+			std::vector<char> strings(strtab.sh_size + 1, 0);
+			std::vector<Elf32_Sym> syms(sh.sh_size / sizeof(Elf32_Sym));
+			if (!read_at(strtab.sh_offset, strings.data(), strtab.sh_size) ||
+					!read_at(sh.sh_offset, syms.data(), syms.size() * sizeof(Elf32_Sym)))
+				continue;
+			for (const Elf32_Sym &sym : syms) {
+				if (sym.st_shndx == SHN_UNDEF || sym.st_name >= strtab.sh_size || !strings[sym.st_name])
+					continue;
+				std::string name(&strings[sym.st_name]);
+				unsigned int type = ELF32_ST_TYPE(sym.st_info);
+				if (type == STT_FUNC)
+					functions.push_back(std::make_pair(sym.st_value, name));
+				if (type != STT_SECTION && type != STT_FILE)
+					symbols[name] = sym.st_value;
+			}
+		}
+		std::sort(functions.begin(), functions.end());
+		return true;
+	}
+
+	// Load all segments into host memory `mem`, which holds the address range
+	// [base, base + size), and must be page-aligned and initially zero (e.g.
+	// from anonymous mmap). On failure, returns false and sets `err`.
+	bool load(uint8_t *mem, uint32_t base, uint32_t size, std::string &err) {
+		const uint32_t page = sysconf(_SC_PAGESIZE);
+		for (const Segment &s : segments) {
+			if (s.addr < base || (uint64_t)s.addr + s.memsz > (uint64_t)base + size) {
+				char buf[80];
+				snprintf(buf, sizeof(buf), "Segment at %08x..%08x is outside of memory",
+					s.addr, s.addr + s.memsz);
+				err = buf;
+				return false;
+			}
+			// Map whole pages of file data, and copy the partial pages at
+			// either end. The area past filesz is already zero.
+			uint32_t start = s.addr - base;
+			uint32_t end = start + std::min(s.filesz, s.memsz);
+			uint32_t map_start = end;
+			uint32_t map_end = end;
+			if (start % page == s.offset % page) {
+				map_start = std::min((start + page - 1) / page * page, end);
+				map_end = std::max(end / page * page, map_start);
+			}
+			if (map_end > map_start && mmap(mem + map_start, map_end - map_start, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_FIXED, fd, s.offset + (map_start - start)) == MAP_FAILED) {
+				err = "Failed to map segment";
+				return false;
+			}
+			if (!read_at(s.offset, mem + start, map_start - start) ||
+					!read_at(s.offset + (map_end - start), mem + map_end, end - map_end)) {
+				err = "Failed to read segment";
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Read the contents of section `name`. Returns false if there is no such
+	// section, or it has no contents in the file.
+	bool read_section(const std::string &name, std::vector<uint8_t> &data) {
+		Elf32_Shdr strtab;
+		if (shstrndx == SHN_UNDEF || !read_at(shoff + shstrndx * shentsize, &strtab, sizeof(strtab)))
+			return false;
+		std::vector<char> strings(strtab.sh_size + 1, 0);
+		if (!read_at(strtab.sh_offset, strings.data(), strtab.sh_size))
+			return false;
+		for (unsigned int i = 0; i < shnum; ++i) {
+			Elf32_Shdr sh;
+			if (!read_at(shoff + i * shentsize, &sh, sizeof(sh)) || sh.sh_type == SHT_NOBITS ||
+					sh.sh_name >= strtab.sh_size || name != &strings[sh.sh_name])
+				continue;
+			data.resize(sh.sh_size);
+			return read_at(sh.sh_offset, data.data(), sh.sh_size);
+		}
+		return false;
+	}
+
+	bool lookup(const std::string &name, uint32_t &value) const {
+		auto it = symbols.find(name);
+		if (it == symbols.end())
+			return false;
+		value = it->second;
+		return true;
+	}
+
+	// The function containing addr (more precisely, the closest function
+	// symbol below it), or nullptr if there is none
+	const char *function_at(uint32_t addr, uint32_t &offset) const {
+		auto it = std::upper_bound(functions.begin(), functions.end(), std::make_pair(addr, std::string("\xff")));
+		if (it == functions.begin())
+			return nullptr;
+		--it;
+		offset = addr - it->first;
+		return it->second.c_str();
+	}
+
+private:
+	int fd = -1;
+	uint32_t shoff = 0;
+	unsigned int shentsize = 0;
+	unsigned int shnum = 0;
+	unsigned int shstrndx = SHN_UNDEF;
+
+	bool read_at(uint64_t offset, void *dst, size_t n) {
+		return n == 0 || pread(fd, dst, n, offset) == (ssize_t)n;
+	}
+};
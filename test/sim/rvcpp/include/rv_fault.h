@@ -0,0 +1,157 @@
+#pragma once
+
+// Bus fault injection, shared by rvcpp and tb_cxxrtl (so no C++17, and no
+// dependencies on the rest of rvcpp). Rules are armed by "fault" and
+// "exfail" stimulus events (see rv_stimulus.h), and every bus access is
+// checked against the armed rules, in the order they were armed, until one
+// fires:
+//
+// - A fault rule fails the access with a bus error (hresp), as an unmapped
+//   address would. The access has no effect.
+// - An exfail rule only sees exclusive accesses (lr.w, sc.w and AMOs), and
+//   fails them with hexokay low: an lr.w then gets no reservation, an sc.w
+//   fails without writing, and an AMO faults on its read, or is retried
+//   from its read if its write fails.
+//
+// A rule sees each access which is in its address range, of a kind it
+// selects, from the port it selects. It lets the first nth - 1 of these
+// through, then fires on each of the rest with probability prob, until it
+// has fired count times, and is disarmed. Probabilities come from a per-rule
+// seeded generator, so a campaign of runs is reproducible.
+//
+// In tb_cxxrtl, ports are the bus ports, numbered as in --ahb-trace; in
+// rvcpp, each hart is one port, numbered from 0. Data accesses are the same
+// in both, but tb counts instruction fetches as bus transfers, which include
+// prefetches, where rvcpp counts the fetches of instructions it executes.
+//
+// With no rules armed, a simulator's only cost is checking armed().
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+struct FaultRule {
+	enum Kind {FAULT, EXFAIL};
+	enum Access {
+		READ = 1u << 0,
+		WRITE = 1u << 1,
+		FETCH = 1u << 2,
+		ALL = READ | WRITE | FETCH
+	};
+	static const int ANY_PORT = -1;
+
+	Kind kind;
+	// Inclusive address range
+	uint32_t start;
+	uint32_t end;
+	uint32_t access;
+	int port;
+	// Matching accesses to let through before firing
+	uint64_t skip;
+	// Times left to fire, or 0 for unlimited
+	uint64_t count;
+	// Probability of firing, as a fraction of 2^32 (0 is always)
+	uint32_t prob;
+	uint64_t rng;
+
+	FaultRule(): kind(FAULT), start(0), end(~0u), access(ALL), port(ANY_PORT), skip(0), count(1),
+		prob(0), rng(1) {}
+
+	void seed(uint64_t s) {
+		// xorshift64* state must be nonzero
+		rng = s * 0x9e3779b97f4a7c15ull | 1;
+	}
+
+	bool matches(uint32_t addr, uint32_t acc, bool excl, int port_) const {
+		return addr >= start && addr <= end && (access & acc) && (kind != EXFAIL || excl) &&
+			(port == ANY_PORT || port == port_);
+	}
+
+	bool roll() {
+		if (prob == 0)
+			return true;
+		rng ^= rng >> 12;
+		rng ^= rng << 25;
+		rng ^= rng >> 27;
+		return (uint32_t)((rng * 0x2545f4914f6cdd1dull) >> 32) < prob;
+	}
+};
+
+struct FaultInjector {
+	enum Result {NONE, FAULT, EXFAIL};
+
+	// Faults injected so far, of each kind
+	uint64_t faults;
+	uint64_t exfails;
+	// Set once any rule has been armed, for reporting
+	bool used;
+
+	FaultInjector(): faults(0), exfails(0), used(false), fetch_rules(0) {}
+
+	bool armed() const {
+		return !rules.empty();
+	}
+
+	void arm(const FaultRule &r) {
+		rules.push_back(r);
+		used = true;
+		if (r.access & FaultRule::FETCH)
+			++fetch_rules;
+	}
+
+	void clear() {
+		rules.clear();
+		fetch_rules = 0;
+	}
+
+	bool fetch_armed() const {
+		return fetch_rules;
+	}
+
+	// True if an armed rule could fail a fetch from addr. Simulators which
+	// cache fetches must fetch an instruction here every time.
+	bool covers_fetch(uint32_t addr) const {
+		if (!fetch_rules)
+			return false;
+		for (const FaultRule &r : rules) {
+			if ((r.access & FaultRule::FETCH) && addr >= r.start && addr <= r.end)
+				return true;
+		}
+		return false;
+	}
+
+	// Called for every access, in bus order, while armed()
+	Result check(uint32_t addr, uint32_t access, bool excl, int port) {
+		for (size_t i = 0; i < rules.size(); ++i) {
+			FaultRule &r = rules[i];
+			if (!r.matches(addr, access, excl, port))
+				continue;
+			if (r.skip) {
+				--r.skip;
+				continue;
+			}
+			if (!r.roll())
+				continue;
+			Result result = r.kind == FaultRule::EXFAIL ? EXFAIL : FAULT;
+			++(result == EXFAIL ? exfails : faults);
+			if (r.count && --r.count == 0) {
+				if (r.access & FaultRule::FETCH)
+					--fetch_rules;
+				rules.erase(rules.begin() + i);
+			}
+			return result;
+		}
+		return NONE;
+	}
+
+	void print(FILE *f) const {
+		if (used)
+			fprintf(f, "Fault injection: %" PRIu64 " bus errors, %" PRIu64 " exclusive failures\n", faults, exfails);
+	}
+
+private:
+	std::vector<FaultRule> rules;
+	// Number of armed rules which see fetches
+	int fetch_rules;
+};
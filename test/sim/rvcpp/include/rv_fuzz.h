@@ -0,0 +1,107 @@
+#pragma once
+
+// Random instruction programs and coverage feedback for differential fuzzing
+// of the decoder (tb's --fuzz runs these under --cosim, with rvcpp as the
+// reference). Instructions are drawn from the encoding patterns in
+// encoding/rv_opcodes.h, so every extension rvcpp decodes is covered,
+// plus a share of raw random words for the illegal-instruction paths.
+//
+// Programs are kept runnable by construction: control flow only goes
+// forwards, memory accesses are based on sp and s0 (which nothing else may
+// write) pointing into a data region, CSR writes which would redirect traps,
+// enable interrupts or change PMP are turned into reads, and a trap handler
+// steps over any instruction which traps. The code region is locked
+// read/execute-only through PMP, so nothing can modify code the RTL may
+// already have fetched.
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "rv_trace.h"
+
+struct FuzzInstr {
+	enum Kind : uint8_t {
+		RAW,      // bits is the whole instruction
+		BRANCH,   // 32-bit conditional branch
+		JAL,
+		C_BRANCH, // c.beqz/c.bnez
+		C_J,
+		C_JAL
+	};
+	Kind kind;
+	// Entries to skip forward, for branches and jumps (past the end of the
+	// body is the exit)
+	uint8_t skip;
+	// Everything but the offset, for branches and jumps
+	uint32_t bits;
+};
+
+struct FuzzProgram {
+	// Initial register values (sp and s0 are the data pointers instead)
+	uint32_t regs[32];
+	// Seed for the initial contents of the data region
+	uint32_t data_seed;
+	std::vector<FuzzInstr> body;
+
+	// Memory image from address 0, to be loaded as with --bin: the prologue
+	// at the reset vector, then the body, then the exit and trap handler
+	std::vector<uint8_t> assemble() const;
+};
+
+struct FuzzGenerator {
+	static constexpr uint32_t CODE_SIZE = 0x10000;
+	static constexpr uint32_t DATA_BASE = 0x10000;
+	static constexpr uint32_t DATA_SIZE = 0x10000;
+	static constexpr size_t MAX_BODY = 8192;
+
+	// Write mhpmcounter and mhpmevent, when the reference core is configured
+	// with RVConfig::hpm_events (these are hardwired to zero on the RTL)
+	bool hpm_events = false;
+
+	explicit FuzzGenerator(uint64_t seed): rng(seed * 0x9e3779b97f4a7c15ull | 1) {}
+
+	void generate(FuzzProgram &p, size_t len);
+	// Apply a few random edits to p, possibly splicing in part of `other`
+	void mutate(FuzzProgram &p, const FuzzProgram &other);
+
+	uint32_t rand32() {
+		rng ^= rng >> 12;
+		rng ^= rng << 25;
+		rng ^= rng >> 27;
+		return rng * 0x2545f4914f6cdd1dull >> 32;
+	}
+
+private:
+	uint64_t rng;
+
+	FuzzInstr random_instr();
+	bool fixup_raw(uint32_t &instr);
+	uint32_t random_csr();
+	uint32_t random_reg_value();
+};
+
+// Coverage points hit by the reference core on retirement: each decoded op,
+// by length and by whether it trapped; each pair of consecutive ops; each
+// CSR address, by whether it was written and whether it trapped; and each
+// exception cause.
+struct FuzzCoverage {
+	size_t n_hit;
+
+	FuzzCoverage();
+	void record(const TraceRecord &t);
+	// Forget the previous op, between runs
+	void reset() {prev_op = 0;}
+	void print(FILE *f) const;
+
+private:
+	std::vector<uint8_t> hit;
+	uint prev_op;
+
+	void mark(size_t point) {
+		if (!hit[point]) {
+			hit[point] = 1;
+			++n_hit;
+		}
+	}
+};
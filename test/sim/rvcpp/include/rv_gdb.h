@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+
+#include "rv_core.h"
+#include "rv_mem.h"
+#include "rv_types.h"
+
+// Minimal GDB remote serial protocol stub, for debugging a single hart
+// without the JTAG/OpenOCD round trip of tb_cxxrtl. Supports register and
+// memory access, single-step, continue (with ^C to interrupt), and software
+// and hardware breakpoints. Hardware breakpoints are the same as software
+// ones here, but are limited in number like the Hazard3 trigger unit, so
+// that code which debugs on rvcpp also fits on the real core.
+//
+// Registers are x0-x31 then pc, as in GDB's RISC-V target description, and
+// CSRs are read-only, at register number 65 + CSR address.
+
+struct GdbServer {
+	RVCore &core;
+	TBMemIO &io;
+	uint max_hw_breakpoints;
+	// Single-step with trace output while running
+	bool trace;
+
+	GdbServer(RVCore &core_, TBMemIO &io_, uint max_hw_breakpoints_, bool trace_):
+		core(core_), io(io_), max_hw_breakpoints(max_hw_breakpoints_), trace(trace_),
+		sock_fd(-1), n_hw_breakpoints(0) {}
+
+	// Wait for GDB to connect on port, then serve requests until GDB kills
+	// or detaches (after which the hart runs freely). cyc is updated as the
+	// hart runs. Throws TBExitException if the hart requests an exit.
+	void serve(uint16_t port, int64_t &cyc);
+
+private:
+	int sock_fd;
+	std::string rxbuf;
+	uint n_hw_breakpoints;
+
+	bool recv_more(bool block);
+	bool get_packet(std::string &pkt);
+	void put_packet(const std::string &pkt);
+	std::string handle(const std::string &pkt, bool &resume, bool &step, bool &done);
+	// Run until a breakpoint, interrupt, or (if step) one instruction, and
+	// return the stop reply
+	std::string resume(bool step, int64_t &cyc);
+	// Advance the IO model after the hart runs n cycles
+	void advance(int64_t n, int64_t &cyc);
+	std::string read_reg(uint regnum);
+	bool write_reg(uint regnum, const std::string &hex);
+};
@@ -0,0 +1,117 @@
+#pragma once
+
+// Execute-in-place flash behind an instruction cache, as a timing model only:
+// the memory itself is still ordinary RAM. Shared by rvcpp's --timing and
+// tb_cxxrtl's latency model (so no C++17, and no dependencies on the rest of
+// rvcpp), which take the same --xip and --icache options.
+//
+// Only instruction fetches are modelled. A miss stalls the fetch for the
+// flash latency plus the rest of the line fill, and a hit is free (on top of
+// any --waitstates in tb_cxxrtl).
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+struct XipCacheConfig {
+	bool enabled = false;
+	uint32_t start = 0;
+	uint32_t end = 0;
+	// Cycles to the first word of a line, and then to fill the rest of it
+	unsigned flash_latency = 0;
+	unsigned fill_latency = 0;
+	unsigned ways = 2;
+	unsigned sets = 64;
+	unsigned line_bytes = 16;
+};
+
+// The arguments of --xip: start, end, flash latency and fill latency.
+// Returns an error message, or nullptr.
+static inline const char *parse_xip(char **argv, XipCacheConfig &cfg) {
+	cfg.start = std::stoul(argv[0], 0, 0);
+	cfg.end = std::stoul(argv[1], 0, 0);
+	long flash = std::stol(argv[2], 0, 0);
+	long fill = std::stol(argv[3], 0, 0);
+	if (flash < 0 || fill < 0)
+		return "Flash latencies can't be negative\n";
+	if (cfg.end <= cfg.start)
+		return "XIP region is empty\n";
+	cfg.flash_latency = flash;
+	cfg.fill_latency = fill;
+	cfg.enabled = true;
+	return nullptr;
+}
+
+// The arguments of --icache: ways, sets and line size in bytes
+static inline const char *parse_icache(char **argv, XipCacheConfig &cfg) {
+	auto pow2 = [](unsigned long x) {return x && !(x & (x - 1));};
+	unsigned long ways = std::stoul(argv[0], 0, 0);
+	unsigned long sets = std::stoul(argv[1], 0, 0);
+	unsigned long line_bytes = std::stoul(argv[2], 0, 0);
+	if (ways < 1 || ways > 64)
+		return "I-cache ways must be 1 to 64\n";
+	if (!pow2(sets) || !pow2(line_bytes) || line_bytes < 4)
+		return "I-cache sets and line size must be powers of two, lines at least 4 bytes\n";
+	cfg.ways = ways;
+	cfg.sets = sets;
+	cfg.line_bytes = line_bytes;
+	return nullptr;
+}
+
+// Set-associative with LRU replacement. Each set's tags are kept in MRU
+// order, and a fetch from the same line as the previous one (the common
+// case) skips the lookup altogether.
+class XipCache {
+public:
+	XipCacheConfig cfg;
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+
+	XipCache(const XipCacheConfig &cfg_): cfg(cfg_), tags(cfg_.ways * cfg_.sets, 0) {
+		while ((1u << line_shift) < cfg.line_bytes)
+			++line_shift;
+	}
+
+	bool covers(uint32_t addr) const {
+		return addr >= cfg.start && addr < cfg.end;
+	}
+
+	// Stall cycles for a fetch from addr, which must be covered
+	unsigned fetch(uint32_t addr) {
+		// Tags are line number + 1, so 0 is invalid
+		uint32_t tag = (addr >> line_shift) + 1;
+		if (tag == last_tag) {
+			++hits;
+			return 0;
+		}
+		last_tag = tag;
+		uint32_t *set = &tags[((tag - 1) & (cfg.sets - 1)) * cfg.ways];
+		unsigned way = 0;
+		while (way < cfg.ways - 1 && set[way] != tag)
+			++way;
+		bool hit = set[way] == tag;
+		for (; way > 0; --way)
+			set[way] = set[way - 1];
+		set[0] = tag;
+		if (hit) {
+			++hits;
+			return 0;
+		}
+		++misses;
+		return cfg.flash_latency + cfg.fill_latency;
+	}
+
+	void print(FILE *f, const char *name) const {
+		uint64_t n = hits + misses;
+		fprintf(f, "%s I-cache (%u x %u x %u bytes): %llu fetches, %.2f%% hits, %llu misses, %llu stall cycles\n",
+			name, cfg.ways, cfg.sets, cfg.line_bytes, (unsigned long long)n,
+			n ? 100.0 * hits / n : 0.0, (unsigned long long)misses,
+			(unsigned long long)misses * (cfg.flash_latency + cfg.fill_latency));
+	}
+
+private:
+	std::vector<uint32_t> tags;
+	uint32_t last_tag = 0;
+	unsigned line_shift = 0;
+};
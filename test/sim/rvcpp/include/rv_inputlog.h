@@ -0,0 +1,209 @@
+#pragma once
+
+// Record and replay of a simulation's external inputs (--record-inputs and
+// --replay-inputs), shared by rvcpp and tb_cxxrtl (so no C++17, and no
+// dependencies on the rest of rvcpp). Everything the simulation takes from
+// outside itself -- JTAG bitbang commands and DMI requests from a socket, and
+// the results of semihosting's host calls -- is logged as an event stamped
+// with the cycle it was taken on. On replay, each source takes its events
+// from the log instead of the outside world, on the same cycles, so a run
+// repeats exactly, without the debugger or host files it first needed.
+//
+// The log is a magic number, then for each event: the cycle (as a delta from
+// the last event's), the source and the data length, each as a LEB128
+// varint, then the data. Events are in the order they were taken, which for
+// a deterministic simulation is the order they are taken again on replay. A
+// source which takes something the log doesn't have, or doesn't take
+// something it does, means the runs have diverged: the log is then marked
+// failed, and replay stops.
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+struct InputLog {
+	enum Source {
+		JTAG = 1,
+		DMI = 2,
+		SEMIHOST = 3
+	};
+
+	static const char *source_name(uint64_t source) {
+		switch (source) {
+		case JTAG: return "JTAG";
+		case DMI: return "DMI";
+		case SEMIHOST: return "semihosting";
+		default: return "unknown";
+		}
+	}
+
+	// Set on divergence, with the reason in error
+	bool failed;
+	std::string error;
+
+	InputLog(): failed(false), f(nullptr), replay(false), last_cycle(0), have_next(false),
+		next_cycle(0), next_source(0), n_events(0) {}
+
+	~InputLog() {
+		close();
+	}
+
+	bool open_record(const std::string &path) {
+		f = fopen(path.c_str(), "wb");
+		replay = false;
+		return f && fwrite(magic(), 1, MAGIC_SIZE, f) == MAGIC_SIZE;
+	}
+
+	bool open_replay(const std::string &path) {
+		char buf[MAGIC_SIZE];
+		f = fopen(path.c_str(), "rb");
+		replay = true;
+		if (!f || fread(buf, 1, MAGIC_SIZE, f) != MAGIC_SIZE || std::string(buf, MAGIC_SIZE) != magic())
+			return false;
+		advance();
+		return !failed;
+	}
+
+	void close() {
+		if (f)
+			fclose(f);
+		f = nullptr;
+	}
+
+	bool recording() const {
+		return f && !replay;
+	}
+
+	bool replaying() const {
+		return f && replay;
+	}
+
+	// Events recorded or replayed so far
+	uint64_t events() const {
+		return n_events;
+	}
+
+	// True once every event has been replayed
+	bool done() const {
+		return !have_next;
+	}
+
+	void put(Source source, uint64_t cycle, const void *data, size_t len) {
+		put_varint(cycle - last_cycle);
+		put_varint(source);
+		put_varint(len);
+		fwrite(data, 1, len, f);
+		last_cycle = cycle;
+		++n_events;
+	}
+
+	void put(Source source, uint64_t cycle, const std::string &data) {
+		put(source, cycle, data.data(), data.size());
+	}
+
+	// If the next event is from source on this cycle, take its data. An
+	// earlier event which is still waiting was missed, which is divergence.
+	bool take(Source source, uint64_t cycle, std::string &data) {
+		if (!check(cycle) || !have_next || next_cycle != cycle || next_source != source)
+			return false;
+		data.swap(next_data);
+		++n_events;
+		advance();
+		return true;
+	}
+
+	// As take(), for a source which must find its event in the log
+	bool expect(Source source, uint64_t cycle, std::string &data) {
+		if (take(source, cycle, data))
+			return true;
+		if (!failed)
+			diverge(source, cycle, "which the log doesn't have");
+		return false;
+	}
+
+	// Returns false (and fails) if an event before this cycle is still waiting
+	bool check(uint64_t cycle) {
+		if (failed)
+			return false;
+		if (have_next && next_cycle < cycle)
+			diverge(next_source, next_cycle, "which was not taken");
+		return !failed;
+	}
+
+	// Skip the events before cycle, whose effects are already in a restored
+	// snapshot
+	void seek(uint64_t cycle) {
+		while (have_next && next_cycle < cycle)
+			advance();
+	}
+
+private:
+	static const size_t MAGIC_SIZE = 8;
+	static const char *magic() {
+		return "RVINLOG1";
+	}
+
+	FILE *f;
+	bool replay;
+	uint64_t last_cycle;
+	// The next event to replay
+	bool have_next;
+	uint64_t next_cycle;
+	uint64_t next_source;
+	std::string next_data;
+	uint64_t n_events;
+
+	void put_varint(uint64_t x) {
+		do {
+			fputc((x & 0x7f) | (x > 0x7f ? 0x80 : 0), f);
+			x >>= 7;
+		} while (x);
+	}
+
+	// Returns false at the end of the file
+	bool get_varint(uint64_t &x) {
+		x = 0;
+		for (int shift = 0; shift < 64; shift += 7) {
+			int c = fgetc(f);
+			if (c == EOF)
+				return false;
+			x |= (uint64_t)(c & 0x7f) << shift;
+			if (!(c & 0x80))
+				return true;
+		}
+		return false;
+	}
+
+	void advance() {
+		uint64_t delta, len;
+		have_next = false;
+		if (!get_varint(delta))
+			return;
+		if (!get_varint(next_source) || !get_varint(len)) {
+			truncated();
+			return;
+		}
+		next_data.resize(len);
+		if (len && fread(&next_data[0], 1, len, f) != len) {
+			truncated();
+			return;
+		}
+		next_cycle = last_cycle + delta;
+		last_cycle = next_cycle;
+		have_next = true;
+	}
+
+	void truncated() {
+		failed = true;
+		error = "Input log is truncated after " + std::to_string(n_events) + " events";
+	}
+
+	void diverge(uint64_t source, uint64_t cycle, const char *why) {
+		char buf[160];
+		snprintf(buf, sizeof(buf), "Input replay diverged: %s input on cycle %" PRIu64 ", %s",
+			source_name(source), cycle, why);
+		failed = true;
+		error = buf;
+	}
+};
@@ -0,0 +1,96 @@
+#pragma once
+
+// Memory-mapped IO, shared by rvcpp and tb_cxxrtl (so no C++17, and no
+// dependencies on the rest of rvcpp). Both simulators have the testbench IO
+// block at IO_BASE, with the registers below (tb_cxxrtl_io.h is the software
+// side). Other devices are written once, as an IoDevice: tb_cxxrtl finds them
+// through an IoMap, and rvcpp puts them on its bus with IoDeviceMem32.
+
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+static const uint32_t IO_BASE = 0x80000000u;
+static const uint32_t IO_SIZE = 0x1000;
+
+enum {
+	IO_PRINT_CHAR  = 0x000,
+	IO_PRINT_U32   = 0x004,
+	IO_EXIT        = 0x008,
+	IO_SET_SOFTIRQ = 0x010,
+	IO_CLR_SOFTIRQ = 0x014,
+	IO_GLOBMON_EN  = 0x018,
+	IO_WAVES       = 0x01c, // Waveform dump control in tb_cxxrtl, ignored by rvcpp
+	IO_SET_IRQ     = 0x020,
+	IO_CLR_IRQ     = 0x030,
+	IO_PRINT_PTR   = 0x040,
+	IO_PRINT_LEN   = 0x044, // Print IO_PRINT_LEN bytes of RAM at IO_PRINT_PTR
+	IO_ROI         = 0x048, // Current region of interest, 0 for none
+	IO_FAST_BOOT   = 0x04c, // Reads 1 if .data and .bss are already set up
+	IO_TRACE       = 0x050, // Instruction trace control in rvcpp, ignored by tb_cxxrtl
+	IO_MTIME       = 0x100,
+	IO_MTIMEH      = 0x104,
+	IO_MTIMECMP    = 0x108, // Hart n at IO_MTIMECMP + 8 * n
+	IO_MTIMECMPH   = 0x10c
+};
+
+// Accesses reach a device as 32-bit words at an offset from its base. A
+// narrower access has its own offset, and its write data is replicated
+// across byte lanes, as on Hazard3's bus. Handlers return false for a bus
+// error.
+struct IoDevice {
+	virtual ~IoDevice() {}
+	virtual bool read(uint32_t offset, uint32_t &data) = 0;
+	virtual bool write(uint32_t offset, uint32_t data) = 0;
+};
+
+// Devices are found through a two-level table of 256-byte pages, so a lookup
+// costs the same however many devices there are. Each device covers whole
+// pages, and devices don't overlap.
+struct IoMap {
+	static const unsigned PAGE_SHIFT = 8;
+	static const unsigned L1_SHIFT = 20;
+	static const uint32_t L2_SIZE = 1u << (L1_SHIFT - PAGE_SHIFT);
+
+	struct Page {
+		IoDevice *dev;
+		uint32_t base;
+	};
+
+	IoMap(): table(1u << (32 - L1_SHIFT)) {}
+
+	void add(uint32_t base, uint32_t size, IoDevice *dev) {
+		assert(size > 0 && !((base | size) & ((1u << PAGE_SHIFT) - 1)));
+		assert((uint64_t)base + size <= 1ull << 32);
+		uint64_t end = ((uint64_t)base + size) >> PAGE_SHIFT;
+		for (uint64_t page = base >> PAGE_SHIFT; page < end; ++page) {
+			std::unique_ptr<Page[]> &l2 = table[page / L2_SIZE];
+			if (!l2)
+				l2.reset(new Page[L2_SIZE]());
+			Page &p = l2[page % L2_SIZE];
+			assert(!p.dev);
+			p = Page{dev, base};
+		}
+	}
+
+	// Page containing addr, or nullptr if no device is there
+	const Page *lookup(uint32_t addr) const {
+		const std::unique_ptr<Page[]> &l2 = table[addr >> L1_SHIFT];
+		const Page *p = l2 ? &l2[(addr >> PAGE_SHIFT) % L2_SIZE] : nullptr;
+		return p && p->dev ? p : nullptr;
+	}
+
+	bool read(uint32_t addr, uint32_t &data) const {
+		const Page *p = lookup(addr);
+		return p && p->dev->read(addr - p->base, data);
+	}
+
+	bool write(uint32_t addr, uint32_t data) const {
+		const Page *p = lookup(addr);
+		return p && p->dev->write(addr - p->base, data);
+	}
+
+private:
+	std::vector<std::unique_ptr<Page[]>> table;
+};
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "rv_types.h"
+
+// Model of the Xh3irq external interrupt controller (hdl/hazard3_irq_ctrl.v),
+// i.e. the meiea/meipa/meifa/meipra/meinext/meicontext CSRs, and the mip.meip
+// flag which they generate. Priorities have the full 4 bits, as in
+// tb_cxxrtl's default config.
+//
+// The enable, force and pending arrays are bitsets of 32-bit words. Each
+// priority level also has a bitset of the IRQs with that priority, a mask of
+// the words in which it has an active (pending and enabled) IRQ, and there is
+// one mask of the levels which have any active IRQ. These are refreshed for
+// one word of IRQs whenever its inputs, enables, forces or priorities change,
+// so mip.meip and meinext take a few bit operations, however many IRQs there
+// are.
+class IrqCtrl {
+public:
+	static const uint MAX_IRQS = 512;
+	static const uint N_WORDS = MAX_IRQS / 32;
+	static const uint N_PRIORITIES = 16;
+
+	// IRQs at or above num_irqs are tied off
+	IrqCtrl(uint num_irqs=32);
+
+	void set_num_irqs(uint n);
+
+	uint get_num_irqs() const {
+		return num_irqs;
+	}
+
+	// External IRQ inputs 0 to 31 (all that the testbench IO drives). The
+	// inputs are registered, as in the RTL, so the new value is seen after
+	// the next step(), unless registered is false.
+	void set_irq_lines(ux_t lines, bool registered=true) {
+		lines_in = lines & valid_mask(0);
+		if (!registered)
+			update_lines();
+	}
+
+	// True if the next step() will change the IRQ inputs
+	bool lines_settling() const {
+		return lines_in != lines;
+	}
+
+	// The mip.meip flag: an active IRQ at or above the preemption priority
+	bool meip() const {
+		return active_levels >> meicontext_preempt;
+	}
+
+	// mip.meip for a core without Xh3irq: any (registered) IRQ input
+	bool any_line() const {
+		return lines != 0;
+	}
+
+	static bool is_csr(uint16_t addr);
+
+	// wdata is the raw write data of the CSR instruction (or 0 if it does not
+	// write), which selects the array window. A read of meinext with side
+	// effects clears the force bit of the IRQ it returns, after step().
+	ux_t read(uint16_t addr, ux_t wdata, bool side_effect);
+
+	// Apply a write of data (after any set/clear), with raw write data wdata
+	void write(uint16_t addr, ux_t wdata, ux_t data);
+
+	// Clock the IRQ input registers, and apply read side effects (after any
+	// CSR write on the same instruction)
+	void step() {
+		if (lines_settling())
+			update_lines();
+		if (force_clear_pending) {
+			force_clear_pending = false;
+			meifa[force_clear_irq / 32] &= ~(1u << force_clear_irq % 32);
+			update_word(force_clear_irq / 32);
+		}
+	}
+
+	// Priority save on entry to the external IRQ vector, and priority restore
+	// on mret
+	void trap_enter(bool is_eirq);
+	void trap_mret();
+
+	template <typename Archive>
+	void serialize(Archive &a) {
+		a(num_irqs);
+		a(lines_in); a(lines);
+		a(meiea); a(meifa); a(priority);
+		a(meicontext_pppreempt); a(meicontext_ppreempt); a(meicontext_preempt);
+		a(meicontext_noirq); a(meicontext_irq); a(meicontext_mreteirq);
+		a(force_clear_pending); a(force_clear_irq);
+		rebuild();
+	}
+
+private:
+	uint num_irqs;
+	ux_t lines_in;
+	ux_t lines;
+	ux_t meiea[N_WORDS];
+	ux_t meifa[N_WORDS];
+	uint8_t priority[MAX_IRQS];
+
+	uint meicontext_pppreempt;
+	uint meicontext_ppreempt;
+	uint meicontext_preempt;
+	bool meicontext_noirq;
+	uint meicontext_irq;
+	bool meicontext_mreteirq;
+
+	bool force_clear_pending;
+	uint force_clear_irq;
+
+	// Derived from the above
+	ux_t active[N_WORDS];
+	ux_t level_irqs[N_PRIORITIES][N_WORDS];
+	ux_t level_words[N_PRIORITIES];
+	ux_t active_levels;
+
+	ux_t valid_mask(uint w) const {
+		return num_irqs >= 32 * (w + 1) ? ~0u : num_irqs <= 32 * w ? 0u : ~(~0u << num_irqs % 32);
+	}
+
+	void update_word(uint w);
+
+	void update_lines() {
+		lines = lines_in;
+		update_word(0);
+	}
+	void rebuild();
+
+	// Highest-priority active IRQ at or above meicontext.ppreempt (lowest
+	// number first), or -1 if there is none
+	int next_irq() const {
+		ux_t levels = active_levels & (~0u << meicontext_ppreempt);
+		if (!levels)
+			return -1;
+		uint level = 31 - __builtin_clz(levels);
+		uint w = __builtin_ctz(level_words[level]);
+		return 32 * w + __builtin_ctz(active[w] & level_irqs[level][w]);
+	}
+
+	uint preempt_level_next() const {
+		int irq = next_irq();
+		return irq < 0 ? N_PRIORITIES : priority[irq] + 1;
+	}
+};
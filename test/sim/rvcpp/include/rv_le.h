@@ -0,0 +1,44 @@
+#pragma once
+
+// Little-endian loads and stores on byte-addressed memory, shared by rvcpp
+// and tb_cxxrtl (so no C++17, and no dependencies on the rest of rvcpp).
+// The memcpy compiles to a single, possibly unaligned, host load or store.
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define RV_LE_SWAP16(x) __builtin_bswap16(x)
+#define RV_LE_SWAP32(x) __builtin_bswap32(x)
+#else
+#define RV_LE_SWAP16(x) (x)
+#define RV_LE_SWAP32(x) (x)
+#endif
+
+static inline uint16_t le_load16(const uint8_t *p) {
+	uint16_t x;
+	memcpy(&x, p, sizeof(x));
+	return RV_LE_SWAP16(x);
+}
+
+static inline uint32_t le_load32(const uint8_t *p) {
+	uint32_t x;
+	memcpy(&x, p, sizeof(x));
+	return RV_LE_SWAP32(x);
+}
+
+static inline void le_store16(uint8_t *p, uint16_t x) {
+	x = RV_LE_SWAP16(x);
+	memcpy(p, &x, sizeof(x));
+}
+
+static inline void le_store32(uint8_t *p, uint32_t x) {
+	x = RV_LE_SWAP32(x);
+	memcpy(p, &x, sizeof(x));
+}
+
+// Store the low n bytes of x (n <= 4)
+static inline void le_store_bytes(uint8_t *p, uint32_t x, unsigned n) {
+	x = RV_LE_SWAP32(x);
+	memcpy(p, &x, n);
+}
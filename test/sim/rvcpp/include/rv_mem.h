@@ -1,11 +1,62 @@
 #pragma once
 
 #include "rv_types.h"
+#include "rv_fault.h"
+#include "rv_iomap.h"
+#include "rv_le.h"
+#include "rv_trace.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <tuple>
 #include <cassert>
 #include <vector>
 #include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Simulated RAM is allocated with anonymous mmap, so the OS zeroes pages on
+// first touch, and pages which are never touched cost nothing. Returns
+// nullptr for a zero-sized allocation.
+static inline uint8_t *host_ram_alloc(size_t size) {
+	if (size == 0)
+		return nullptr;
+	void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	assert(p != MAP_FAILED);
+	return (uint8_t*)p;
+}
+
+static inline void host_ram_free(uint8_t *p, size_t size) {
+	if (p)
+		munmap(p, size);
+}
+
+// Map a file copy-on-write over the start of RAM allocated by
+// host_ram_alloc(). Fails (returning false, and leaving RAM unchanged) if the
+// file can't be opened or is larger than the RAM.
+static inline bool host_ram_map_file(uint8_t *ram, size_t ram_size, const char *path, size_t &file_size) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	bool ok = fstat(fd, &st) == 0 && (size_t)st.st_size <= ram_size;
+	if (ok) {
+		file_size = st.st_size;
+		// The remainder of the file's last page reads as zeroes
+		if (file_size > 0)
+			ok = mmap(ram, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED;
+	}
+	close(fd);
+	return ok;
+}
 
 struct MemBase32 {
 	virtual std::optional<uint8_t> r8(__attribute__((unused)) ux_t addr) {return std::nullopt;}
@@ -14,62 +65,174 @@ struct MemBase32 {
 	virtual bool w16(__attribute__((unused)) ux_t addr, __attribute__((unused)) uint16_t data) {return false;}
 	virtual std::optional<uint32_t> r32(__attribute__((unused)) ux_t addr) {return std::nullopt;}
 	virtual bool w32(__attribute__((unused)) ux_t addr, __attribute__((unused)) uint32_t data) {return false;}
+
+	// Plain memory can return a pointer to its backing storage, so that
+	// accesses can bypass the virtual calls. Returns nullptr if this is not
+	// plain memory, or is smaller than `size` bytes, or if `write` is set and
+	// the memory is read-only. The storage is little-endian.
+	virtual uint8_t *get_host_ptr(__attribute__((unused)) ux_t size, __attribute__((unused)) bool write) {return nullptr;}
 };
 
 struct FlatMem32: MemBase32 {
 	uint32_t size;
-	uint32_t *mem;
+	uint8_t *mem;
+	bool read_only;
 
-	FlatMem32(uint32_t size_) {
+	FlatMem32(uint32_t size_, bool read_only_=false) {
 		assert(size_ % sizeof(uint32_t) == 0);
 		size = size_;
-		mem = new uint32_t[size >> 2];
-		for (uint64_t i = 0; i < size >> 2; ++i)
-			mem[i] = 0;
+		read_only = read_only_;
+		mem = host_ram_alloc(size);
 	}
 
 	~FlatMem32() {
-		delete mem;
+		host_ram_free(mem, size);
 	}
 
 	virtual std::optional<uint8_t> r8(ux_t addr) {
 		assert(addr < size);
-		return mem[addr >> 2] >> 8 * (addr & 0x3) & 0xffu;
+		return mem[addr];
 	}
 
 	virtual bool w8(ux_t addr, uint8_t data) {
 		assert(addr < size);
-		mem[addr >> 2] &= ~(0xffu << 8 * (addr & 0x3));
-		mem[addr >> 2] |= (uint32_t)data << 8 * (addr & 0x3);
+		if (read_only)
+			return false;
+		mem[addr] = data;
 		return true;
 	}
 
 	virtual std::optional<uint16_t> r16(ux_t addr) {
 		assert(addr < size && addr + 1 < size); // careful of ~0u
 		assert(addr % 2 == 0);
-		return mem[addr >> 2] >> 8 * (addr & 0x2) & 0xffffu;
+		return le_load16(mem + addr);
 	}
 
 	virtual bool w16(ux_t addr, uint16_t data) {
 		assert(addr < size && addr + 1 < size);
 		assert(addr % 2 == 0);
-		mem[addr >> 2] &= ~(0xffffu << 8 * (addr & 0x2));
-		mem[addr >> 2] |= (uint32_t)data << 8 * (addr & 0x2);
+		if (read_only)
+			return false;
+		le_store16(mem + addr, data);
 		return true;
 	}
 
 	virtual std::optional<uint32_t> r32(ux_t addr) {
 		assert(addr < size && addr + 3 < size);
 		assert(addr % 4 == 0);
-		return mem[addr >> 2];
+		return le_load32(mem + addr);
 	}
 
 	virtual bool w32(ux_t addr, uint32_t data) {
 		assert(addr < size && addr + 3 < size);
 		assert(addr % 4 == 0);
-		mem[addr >> 2] = data;
+		if (read_only)
+			return false;
+		le_store32(mem + addr, data);
 		return true;
 	}
+
+	virtual uint8_t *get_host_ptr(ux_t size_, bool write) {
+		return size_ <= size && !(write && read_only) ? mem : nullptr;
+	}
+};
+
+// Global exclusive monitor shared by all harts, with one reservation per
+// hart, matching the monitor in tb_cxxrtl. While the monitor is disabled,
+// it leaves all exclusive accesses to succeed (based only on the hart's local
+// reservation), again like tb_cxxrtl.
+struct GlobalMonitor {
+	static const ux_t RESERVATION_ADDR_MASK = 0xfffffff8u;
+
+	std::atomic<bool> enabled;
+	std::vector<bool> reservation_valid;
+	std::vector<ux_t> reservation_addr;
+
+	// Held by harts for the duration of any LR/SC/AMO, or any operation on
+	// the monitor, so these are atomic when harts run on multiple threads
+	std::recursive_mutex lock;
+
+	GlobalMonitor(uint n_harts=1) {
+		enabled = false;
+		reservation_valid.resize(n_harts, false);
+		reservation_addr.resize(n_harts, 0);
+	}
+
+	void excl_read(uint hart, ux_t addr) {
+		reservation_valid[hart] = true;
+		reservation_addr[hart] = addr & RESERVATION_ADDR_MASK;
+	}
+
+	// Returns exokay. Caller should not write if this is false.
+	bool excl_write(uint hart, ux_t addr) {
+		if (!enabled)
+			return true;
+		bool exokay = reservation_valid[hart] && reservation_addr[hart] == (addr & RESERVATION_ADDR_MASK);
+		reservation_valid[hart] = false;
+		if (exokay)
+			clear_others(hart, addr);
+		return exokay;
+	}
+
+	template <typename Archive>
+	void serialize(Archive &a) {
+		bool en = enabled;
+		a(en);
+		enabled = en;
+		for (uint i = 0; i < reservation_valid.size(); ++i) {
+			bool valid = reservation_valid[i];
+			a(valid);
+			reservation_valid[i] = valid;
+			a(reservation_addr[i]);
+		}
+	}
+
+	// Any write clears other harts' reservations on the same granule
+	void clear_others(uint hart, ux_t addr) {
+		for (uint i = 0; i < reservation_valid.size(); ++i) {
+			if (i != hart && reservation_addr[i] == (addr & RESERVATION_ADDR_MASK))
+				reservation_valid[i] = false;
+		}
+	}
+};
+
+// Serialise all accesses to a device which is shared between harts running
+// on different threads
+struct MemLock32: MemBase32 {
+	MemBase32 &mem;
+	std::mutex &lock;
+
+	MemLock32(MemBase32 &mem_, std::mutex &lock_): mem(mem_), lock(lock_) {}
+
+	virtual std::optional<uint8_t> r8(ux_t addr) {
+		std::lock_guard<std::mutex> guard(lock);
+		return mem.r8(addr);
+	}
+
+	virtual bool w8(ux_t addr, uint8_t data) {
+		std::lock_guard<std::mutex> guard(lock);
+		return mem.w8(addr, data);
+	}
+
+	virtual std::optional<uint16_t> r16(ux_t addr) {
+		std::lock_guard<std::mutex> guard(lock);
+		return mem.r16(addr);
+	}
+
+	virtual bool w16(ux_t addr, uint16_t data) {
+		std::lock_guard<std::mutex> guard(lock);
+		return mem.w16(addr, data);
+	}
+
+	virtual std::optional<uint32_t> r32(ux_t addr) {
+		std::lock_guard<std::mutex> guard(lock);
+		return mem.r32(addr);
+	}
+
+	virtual bool w32(ux_t addr, uint32_t data) {
+		std::lock_guard<std::mutex> guard(lock);
+		return mem.w32(addr, data);
+	}
 };
 
 struct TBExitException {
@@ -78,56 +241,145 @@ struct TBExitException {
 };
 
 struct TBMemIO: MemBase32 {
-
-	enum {
-		IO_PRINT_CHAR  = 0x000,
-		IO_PRINT_U32   = 0x004,
-		IO_EXIT        = 0x008,
-		IO_SET_SOFTIRQ = 0x010,
-		IO_CLR_SOFTIRQ = 0x014,
-		IO_GLOBMON_EN  = 0x018,
-		IO_SET_IRQ     = 0x020,
-		IO_CLR_IRQ     = 0x030,
-		IO_MTIME       = 0x100,
-		IO_MTIMEH      = 0x104,
-		IO_MTIMECMP    = 0x108,
-		IO_MTIMECMPH   = 0x10c,
-	};
+	// Registers are at the IO_* offsets in rv_iomap.h
+	static const uint MAX_HARTS = 32;
 
 	uint64_t mtime;
-	uint64_t mtimecmp;
-	bool softirq;
+	std::vector<uint64_t> mtimecmp;
+	uint32_t softirq; // One bit per hart
+	uint32_t irq; // External IRQ lines, which all harts share
+	// Timer IRQs forced on by the stimulus scheduler, one bit per hart
+	uint32_t timer_force;
+	// Bus fault rules armed by the stimulus scheduler, which the harts check
+	// their accesses against (not saved in snapshots)
+	FaultInjector faults;
 	bool trace;
+	// If set, trace output is sent here instead of `out`
+	TraceSink *trace_sink;
+	// Printed output, and trace output if there is no trace_sink
+	FILE *out;
+	GlobalMonitor monitor;
+
+	// Set by any write to save_trigger_addr, if present
+	std::optional<ux_t> save_trigger_addr;
+	bool save_triggered;
+
+	// Guest RAM, for IO_PRINT_LEN, which copies strings straight out of it.
+	// Printed output is collected in print_buf and written out a line at a
+	// time (or when PRINT_BUF_FLUSH bytes are buffered).
+	static const size_t PRINT_BUF_FLUSH = 1u << 16;
+	const uint8_t *ram;
+	ux_t ram_base;
+	ux_t ram_size;
+	ux_t print_ptr;
+	std::string print_buf;
 
-	TBMemIO(bool trace_) {
+	// Written through IO_ROI. roi_changed is set by every write, and cleared
+	// by the simulator once it has seen the change.
+	uint32_t roi;
+	bool roi_changed;
+
+	// Read through IO_FAST_BOOT, for --fast-boot
+	bool fast_boot;
+
+	// Written through IO_TRACE: nonzero turns the trace on, and zero off.
+	// trace_changed is set by every write, as for roi_changed.
+	bool trace_on;
+	bool trace_changed;
+
+	TBMemIO(bool trace_, uint n_harts=1): monitor(n_harts) {
+		assert(n_harts >= 1 && n_harts <= MAX_HARTS);
 		mtime = 0;
-		mtimecmp = 0; // -1 would be better, but match tb and tests
-		softirq = false;
+		mtimecmp.resize(n_harts, 0); // -1 would be better, but match tb and tests
+		softirq = 0;
+		irq = 0;
+		timer_force = 0;
 		trace = trace_;
+		trace_sink = nullptr;
+		out = stdout;
+		save_triggered = false;
+		ram = nullptr;
+		ram_base = 0;
+		ram_size = 0;
+		print_ptr = 0;
+		roi = 0;
+		roi_changed = false;
+		fast_boot = false;
+		trace_on = true;
+		trace_changed = false;
+	}
+
+	virtual ~TBMemIO() {
+		flush_print();
+	}
+
+	template <typename Archive>
+	void serialize(Archive &a) {
+		a(mtime);
+		for (auto &x : mtimecmp)
+			a(x);
+		a(softirq);
+		a(irq);
+		a(timer_force);
+		a(print_ptr);
+		a(roi);
+		monitor.serialize(a);
 	}
 
 	virtual bool w32(ux_t addr, uint32_t data) {
+		if (save_trigger_addr && addr == *save_trigger_addr)
+			save_triggered = true;
 		switch (addr) {
-		case IO_PRINT_CHAR:
-			if (trace)
-				printf("IO_PRINT_CHAR: %c\n", (char)data);
-			else
-				printf("%c", (char)data);
+		case IO_PRINT_CHAR: {
+			char c = data;
+			print(&c, 1);
 			return true;
+		}
 		case IO_PRINT_U32:
-			if (trace)
-				printf("IO_PRINT_U32: %08x\n", data);
-			else
-				printf("%08x\n", data);
+			if (trace) {
+				trace_printf("IO_PRINT_U32: %08x\n", data);
+			} else {
+				char text[16];
+				snprintf(text, sizeof(text), "%08x\n", data);
+				print(text, 9);
+			}
+			return true;
+		case IO_PRINT_PTR:
+			print_ptr = data;
+			return true;
+		case IO_ROI:
+			roi = data;
+			roi_changed = true;
+			return true;
+		case IO_TRACE:
+			trace_on = data;
+			trace_changed = true;
+			return true;
+		case IO_PRINT_LEN:
+			if (!ram || print_ptr < ram_base || print_ptr - ram_base > ram_size ||
+					data > ram_size - (print_ptr - ram_base))
+				return false;
+			print((const char*)ram + (print_ptr - ram_base), data);
 			return true;
 		case IO_EXIT:
 			throw TBExitException(data);
 			return true;
 		case IO_SET_SOFTIRQ:
-			softirq = softirq || (data & 0x1);
+			softirq |= data & soft_irq_mask();
 			return true;
 		case IO_CLR_SOFTIRQ:
-			softirq = softirq && !(data & 0x1);
+			softirq &= ~data;
+			return true;
+		case IO_SET_IRQ:
+			irq |= data;
+			return true;
+		case IO_CLR_IRQ:
+			irq &= ~data;
+			return true;
+		case IO_GLOBMON_EN:
+			monitor.enabled = data;
+			return true;
+		case IO_WAVES:
 			return true;
 		case IO_MTIME:
 			mtime = (mtime & 0xffffffff00000000ull) | data;
@@ -135,13 +387,15 @@ struct TBMemIO: MemBase32 {
 		case IO_MTIMEH:
 			mtime = (mtime & 0x00000000ffffffffull) | ((uint64_t)data << 32);
 			return true;
-		case IO_MTIMECMP:
-			mtimecmp = (mtimecmp & 0xffffffff00000000ull) | data;
-			return true;
-		case IO_MTIMECMPH:
-			mtimecmp = (mtimecmp & 0x00000000ffffffffull) | ((uint64_t)data << 32);
-			return true;
 		default:
+			if (addr >= IO_MTIMECMP && addr < IO_MTIMECMP + 8 * mtimecmp.size()) {
+				uint64_t &cmp = mtimecmp[(addr - IO_MTIMECMP) / 8];
+				if (addr & 0x4)
+					cmp = (cmp & 0x00000000ffffffffull) | ((uint64_t)data << 32);
+				else
+					cmp = (cmp & 0xffffffff00000000ull) | data;
+				return true;
+			}
 			return false;
 		}
 	}
@@ -152,48 +406,195 @@ struct TBMemIO: MemBase32 {
 			return mtime & 0xffffffffull;
 		case IO_MTIMEH:
 			return mtime >> 32;
-		case IO_MTIMECMP:
-			return mtimecmp & 0xffffffffull;
-		case IO_MTIMECMPH:
-			return mtimecmp >> 32;
 		case IO_SET_SOFTIRQ:
 		case IO_CLR_SOFTIRQ:
 			return softirq;
+		case IO_SET_IRQ:
+		case IO_CLR_IRQ:
+			return irq;
+		case IO_PRINT_PTR:
+			return print_ptr;
+		case IO_ROI:
+			return roi;
+		case IO_FAST_BOOT:
+			return fast_boot;
+		case IO_TRACE:
+			return trace_on;
 		default:
+			if (addr >= IO_MTIMECMP && addr < IO_MTIMECMP + 8 * mtimecmp.size()) {
+				uint64_t cmp = mtimecmp[(addr - IO_MTIMECMP) / 8];
+				return addr & 0x4 ? cmp >> 32 : cmp & 0xffffffffull;
+			}
 			return {};
 		}
 	}
 
-	void step() {
-		mtime++;
+	void step(uint64_t n=1) {
+		mtime += n;
+	}
+
+	// Output from IO_PRINT_CHAR or IO_PRINT_LEN. When tracing, each
+	// character is a separate line in the trace, as for IO_PRINT_CHAR.
+	void print(const char *text, size_t len) {
+		if (trace) {
+			for (size_t i = 0; i < len; ++i)
+				trace_printf("IO_PRINT_CHAR: %c\n", text[i]);
+			return;
+		}
+		print_buf.append(text, len);
+		if (print_buf.size() >= PRINT_BUF_FLUSH || memchr(text, '\n', len))
+			flush_print();
+	}
+
+	void flush_print() {
+		fwrite(print_buf.data(), 1, print_buf.size(), out);
+		print_buf.clear();
+	}
+
+	template <typename... Args>
+	void trace_printf(const char *fmt, Args... args) {
+		if (trace_sink) {
+			char text[64];
+			int len = snprintf(text, sizeof(text), fmt, args...);
+			trace_sink->message(text, std::min((size_t)len, sizeof(text) - 1));
+		} else {
+			fprintf(out, fmt, args...);
+		}
+	}
+
+	uint32_t soft_irq_mask() {
+		return mtimecmp.size() == 32 ? ~0u : (1u << mtimecmp.size()) - 1;
+	}
+
+	bool timer_irq_pending(uint hart=0) {
+		return mtime >= mtimecmp[hart] || (timer_force & (1u << hart));
+	}
+
+	bool soft_irq_pending(uint hart=0) {
+		return softirq & (1u << hart);
+	}
+
+};
+
+// An IoDevice (rv_iomap.h) on the bus. As in tb_cxxrtl, a narrower access is
+// passed on at its own offset, with its write data replicated across byte
+// lanes, and takes the low bits of the word read.
+struct IoDeviceMem32: MemBase32 {
+	IoDevice &dev;
+
+	IoDeviceMem32(IoDevice &dev_): dev(dev_) {}
+
+	virtual std::optional<uint8_t> r8(ux_t addr) {
+		uint32_t data;
+		if (dev.read(addr, data))
+			return data;
+		return std::nullopt;
+	}
+
+	virtual bool w8(ux_t addr, uint8_t data) {
+		return dev.write(addr, data * 0x01010101u);
 	}
 
-	bool timer_irq_pending() {
-		return mtime >= mtimecmp;
+	virtual std::optional<uint16_t> r16(ux_t addr) {
+		uint32_t data;
+		if (dev.read(addr, data))
+			return data;
+		return std::nullopt;
 	}
 
-	bool soft_irq_pending() {
-		return softirq;
+	virtual bool w16(ux_t addr, uint16_t data) {
+		return dev.write(addr, data * 0x00010001u);
+	}
+
+	virtual std::optional<uint32_t> r32(ux_t addr) {
+		uint32_t data;
+		if (dev.read(addr, data))
+			return data;
+		return std::nullopt;
 	}
 
+	virtual bool w32(ux_t addr, uint32_t data) {
+		return dev.write(addr, data);
+	}
 };
 
 struct MemMap32: MemBase32 {
+	// Regions are found through a two-level table of 4 kiB pages. A page
+	// which is not entirely covered by one region is marked as shared, and
+	// falls back to a scan of the region list (which gives the priority
+	// order: regions added first take precedence). Pages of plain memory
+	// also record a host pointer to the memory's storage, so that accesses
+	// don't need to go through the device's virtual functions.
+	static const uint PAGE_SHIFT = 12;
+	static const uint L1_SHIFT = 22;
+
+	struct Page {
+		MemBase32 *mem;
+		uint32_t base;
+		uint8_t *host_r;
+		uint8_t *host_w;
+		bool shared;
+	};
+
 	std::vector<std::tuple<uint32_t, uint32_t, MemBase32*> > memmap;
+	std::array<std::unique_ptr<Page[]>, 1u << (32 - L1_SHIFT)> page_table;
 
 	void add(uint32_t base, uint32_t size, MemBase32 *mem) {
+		assert(size > 0);
+		assert((uint64_t)base + size <= 1ull << 32);
 		memmap.push_back(std::make_tuple(base, size, mem));
+		uint8_t *host_r = mem->get_host_ptr(size, false);
+		uint8_t *host_w = mem->get_host_ptr(size, true);
+		assert(!(host_r && (base & 0x3)));
+		uint32_t last = base + (size - 1);
+		for (uint64_t page = base >> PAGE_SHIFT; page <= last >> PAGE_SHIFT; ++page) {
+			std::unique_ptr<Page[]> &l2 = page_table[page >> (L1_SHIFT - PAGE_SHIFT)];
+			if (!l2) {
+				l2.reset(new Page[1u << (L1_SHIFT - PAGE_SHIFT)]());
+			}
+			Page &p = l2[page & ((1u << (L1_SHIFT - PAGE_SHIFT)) - 1)];
+			uint64_t page_base = page << PAGE_SHIFT;
+			uint64_t page_last = page_base + (1u << PAGE_SHIFT) - 1;
+			if (p.mem || p.shared || page_base < base || page_last > last) {
+				p = Page{nullptr, 0, nullptr, nullptr, true};
+			} else {
+				p = Page{mem, base, host_r, host_w, false};
+			}
+		}
+	}
+
+	const Page *lookup(uint32_t addr) const {
+		const std::unique_ptr<Page[]> &l2 = page_table[addr >> L1_SHIFT];
+		return l2 ? &l2[(addr >> PAGE_SHIFT) & ((1u << (L1_SHIFT - PAGE_SHIFT)) - 1)] : nullptr;
+	}
+
+	// Pointer to the byte at addr, if it is in plain memory, or nullptr
+	// otherwise. (Plain memory regions are word-aligned, so a naturally
+	// aligned access doesn't leave the region.)
+	uint8_t *host_byte(uint32_t addr, bool write) const {
+		const Page *p = lookup(addr);
+		uint8_t *host = p ? write ? p->host_w : p->host_r : nullptr;
+		return host ? host + (addr - p->base) : nullptr;
 	}
 
 	std::tuple <uint32_t, MemBase32*> map_addr(uint32_t addr) {
+		const Page *p = lookup(addr);
+		if (!p || !p->shared) {
+			if (p && p->mem)
+				return std::make_tuple(addr - p->base, p->mem);
+			else
+				return std::make_tuple(addr, nullptr);
+		}
 		for (auto&& [base, size, mem] : memmap) {
-			if (addr >= base && addr < base + size)
+			if (addr >= base && addr - base < size)
 				return std::make_tuple(addr - base, mem);
 		}
 		return std::make_tuple(addr, nullptr);
 	}
 
 	virtual std::optional<uint8_t> r8(ux_t addr) {
+		if (uint8_t *host = host_byte(addr, false))
+			return *host;
 		auto [offset, mem] = map_addr(addr);
 		if (mem)
 			return mem->r8(offset);
@@ -202,6 +603,10 @@ struct MemMap32: MemBase32 {
 	}
 
 	virtual bool w8(ux_t addr, uint8_t data) {
+		if (uint8_t *host = host_byte(addr, true)) {
+			*host = data;
+			return true;
+		}
 		auto [offset, mem] = map_addr(addr);
 		if (mem)
 			return mem->w8(offset, data);
@@ -210,6 +615,8 @@ struct MemMap32: MemBase32 {
 	}
 
 	virtual std::optional<uint16_t> r16(ux_t addr) {
+		if (uint8_t *host = host_byte(addr, false))
+			return le_load16(host);
 		auto [offset, mem] = map_addr(addr);
 		if (mem)
 			return mem->r16(offset);
@@ -218,6 +625,10 @@ struct MemMap32: MemBase32 {
 	}
 
 	virtual bool w16(ux_t addr, uint16_t data) {
+		if (uint8_t *host = host_byte(addr, true)) {
+			le_store16(host, data);
+			return true;
+		}
 		auto [offset, mem] = map_addr(addr);
 		if (mem)
 			return mem->w16(offset, data);
@@ -226,6 +637,8 @@ struct MemMap32: MemBase32 {
 	}
 
 	virtual std::optional<uint32_t> r32(ux_t addr) {
+		if (uint8_t *host = host_byte(addr, false))
+			return le_load32(host);
 		auto [offset, mem] = map_addr(addr);
 		if (mem)
 			return mem->r32(offset);
@@ -234,6 +647,10 @@ struct MemMap32: MemBase32 {
 	}
 
 	virtual bool w32(ux_t addr, uint32_t data) {
+		if (uint8_t *host = host_byte(addr, true)) {
+			le_store32(host, data);
+			return true;
+		}
 		auto [offset, mem] = map_addr(addr);
 		if (mem)
 			return mem->w32(offset, data);
@@ -0,0 +1,149 @@
+#pragma once
+
+// Memory access heatmap shared by rvcpp and tb_cxxrtl (so no C++17, and no
+// dependencies on the rest of rvcpp), for sizing SRAMs. Counts reads, writes
+// and instruction fetches per block (a cache-line-sized, power-of-two number
+// of bytes) in a sparse two-level table: pages of blocks are allocated on
+// first touch, so the cost scales with the footprint rather than the address
+// space.
+//
+// The working-set curve comes from the same pass. Time is counted in
+// accesses, and each access records the time since the previous access to
+// its block. The average number of distinct blocks touched in a window of t
+// accesses is then the mean of min(gap, t) over all accesses, with first
+// touches counting as infinite gaps (Denning and Schwartz). Gaps are binned
+// by powers of two, keeping each bin's sum, so this is exact for windows
+// which are powers of two.
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct MemHeatmap {
+	enum Kind {READ = 0, WRITE = 1, FETCH = 2, N_KINDS = 3};
+
+	static const unsigned PAGE_BLOCKS_LOG2 = 10;
+	static const unsigned PAGE_BLOCKS = 1u << PAGE_BLOCKS_LOG2;
+
+	struct Block {
+		uint32_t count[N_KINDS];
+		// Time of the most recent access, or 0 if none
+		uint64_t last;
+	};
+	struct Page {
+		Block blocks[PAGE_BLOCKS];
+	};
+
+	unsigned block_shift;
+
+	explicit MemHeatmap(unsigned block_shift_ = 6):
+		block_shift(block_shift_), now(0), first_touches(0), last_page_num(~0u), last_page(nullptr),
+		last_block(~0u), last_blk(nullptr),
+		gap_count{}, gap_sum{} {
+		pages.resize((size_t)1 << (32 - block_shift - PAGE_BLOCKS_LOG2));
+	}
+
+	void access(uint32_t addr, Kind kind) {
+		uint32_t b = addr >> block_shift;
+		++now;
+		if (b == last_block) {
+			// Common case (e.g. sequential fetch): gap of 1
+			++last_blk->count[kind];
+			last_blk->last = now;
+			++gap_count[0];
+			++gap_sum[0];
+			return;
+		}
+		uint32_t page_num = b >> PAGE_BLOCKS_LOG2;
+		if (page_num != last_page_num) {
+			std::unique_ptr<Page> &p = pages[page_num];
+			if (!p)
+				p.reset(new Page());
+			last_page_num = page_num;
+			last_page = p.get();
+		}
+		Block &blk = last_page->blocks[b & (PAGE_BLOCKS - 1)];
+		last_block = b;
+		last_blk = &blk;
+		++blk.count[kind];
+		if (blk.last) {
+			uint64_t gap = now - blk.last;
+			int bin = 63 - __builtin_clzll(gap);
+			++gap_count[bin];
+			gap_sum[bin] += gap;
+		} else {
+			++first_touches;
+		}
+		blk.last = now;
+	}
+
+	// Average blocks touched in a window of `window` accesses
+	double working_set(uint64_t window) const {
+		if (!now)
+			return 0.0;
+		double sum = (double)first_touches * window;
+		for (int bin = 0; bin < 64; ++bin) {
+			if (((uint64_t)2 << bin) - 1 <= window)
+				sum += gap_sum[bin];
+			else
+				sum += (double)gap_count[bin] * window;
+		}
+		double ws = sum / now;
+		return ws < (double)(first_touches) ? ws : (double)first_touches;
+	}
+
+	// Write the heatmap (one line per touched block, in address order) and
+	// the working-set curve to path, and a one-line summary to `summary`.
+	bool write(const std::string &path, FILE *summary) const {
+		FILE *f = fopen(path.c_str(), "w");
+		if (!f)
+			return false;
+		unsigned block_bytes = 1u << block_shift;
+		uint64_t totals[N_KINDS] = {};
+		uint64_t touched = 0;
+		fprintf(f, "# Memory heatmap, %u-byte blocks\n# addr reads writes fetches\n", block_bytes);
+		for (size_t p = 0; p < pages.size(); ++p) {
+			if (!pages[p])
+				continue;
+			for (uint32_t i = 0; i < PAGE_BLOCKS; ++i) {
+				const Block &blk = pages[p]->blocks[i];
+				if (!blk.last)
+					continue;
+				uint32_t addr = (uint32_t)(((uint64_t)p << PAGE_BLOCKS_LOG2 | i) << block_shift);
+				fprintf(f, "%08x %" PRIu32 " %" PRIu32 " %" PRIu32 "\n", addr,
+					blk.count[READ], blk.count[WRITE], blk.count[FETCH]);
+				for (int k = 0; k < N_KINDS; ++k)
+					totals[k] += blk.count[k];
+				++touched;
+			}
+		}
+		fprintf(f, "# Working set: window (accesses), average blocks touched, bytes\n");
+		for (uint64_t window = 1; ; window *= 2) {
+			double ws = working_set(window);
+			fprintf(f, "ws %" PRIu64 " %.2f %.0f\n", window, ws, ws * block_bytes);
+			if (window >= now)
+				break;
+		}
+		bool ok = fclose(f) == 0;
+		if (summary) {
+			fprintf(summary, "Memory heatmap: %" PRIu64 " blocks touched (%" PRIu64 " bytes), %" PRIu64
+				" reads, %" PRIu64 " writes, %" PRIu64 " fetches\n", touched, touched * block_bytes,
+				totals[READ], totals[WRITE], totals[FETCH]);
+		}
+		return ok;
+	}
+
+private:
+	uint64_t now;
+	uint64_t first_touches;
+	uint32_t last_page_num;
+	Page *last_page;
+	uint32_t last_block;
+	Block *last_blk;
+	std::vector<std::unique_ptr<Page>> pages;
+	uint64_t gap_count[64];
+	uint64_t gap_sum[64];
+};
@@ -0,0 +1,172 @@
+#pragma once
+
+// Power-state residency and wake counts (--power-stats), shared by rvcpp and
+// tb_cxxrtl (so no C++17, and no dependencies on the rest of rvcpp). Each
+// hart is in one state per cycle. A sleep is a run of cycles in any state
+// but ACTIVE, and ends with a wake, which is counted by its cause.
+//
+// tb_cxxrtl counts every cycle with add(). rvcpp only counts its sleeping
+// cycles, and sync() counts the rest as active.
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct PowerStats {
+	enum State {
+		ACTIVE,
+		// Stalled in WFI, with the clock running
+		WFI,
+		// Stalled in h3.block, with the clock running
+		SLEEP,
+		// Clock gated (msleep.deepsleep)
+		DEEP_SLEEP,
+		// Power-up request dropped (msleep.powerdown)
+		POWERED_DOWN,
+		N_STATES
+	};
+
+	enum Wake {
+		WAKE_EXTERNAL,
+		WAKE_TIMER,
+		WAKE_SOFT,
+		// h3.unblock from another hart, with no IRQ
+		WAKE_UNBLOCK,
+		WAKE_OTHER,
+		N_WAKES
+	};
+
+	struct Hart {
+		uint64_t cycles[N_STATES];
+		uint64_t wakes[N_WAKES];
+		uint64_t sleeps;
+		State state;
+
+		Hart(): cycles(), wakes(), sleeps(0), state(ACTIVE) {}
+
+		uint64_t total() const {
+			uint64_t t = 0;
+			for (uint64_t c : cycles)
+				t += c;
+			return t;
+		}
+
+		// n cycles in state s. Returns true if this ends a sleep, in which
+		// case the caller follows with wake(), to count its cause.
+		bool add(State s, uint64_t n = 1) {
+			cycles[s] += n;
+			bool woke = s == ACTIVE && state != ACTIVE;
+			if (s != ACTIVE && state == ACTIVE)
+				++sleeps;
+			state = s;
+			return woke;
+		}
+
+		bool asleep() const {
+			return state != ACTIVE;
+		}
+
+		void wake(Wake cause) {
+			state = ACTIVE;
+			++wakes[cause];
+		}
+
+		// Count cycles not yet counted, up to `cycles` in all, as active
+		void sync(uint64_t cycles_) {
+			uint64_t t = total();
+			if (cycles_ > t)
+				cycles[ACTIVE] += cycles_ - t;
+		}
+	};
+
+	// As counted in mcause, for wakes which enter an IRQ handler
+	static Wake irq_wake(uint32_t irq) {
+		return irq == 11 ? WAKE_EXTERNAL : irq == 7 ? WAKE_TIMER : irq == 3 ? WAKE_SOFT : WAKE_OTHER;
+	}
+
+	// Harts are numbered from hart_base, the first hart's mhartid
+	int hart_base;
+	int64_t start_cycle;
+	std::vector<Hart> harts;
+	// Per-window time series, written as each window ends
+	FILE *series;
+	int64_t window;
+	int64_t next_window;
+	std::vector<Hart> last;
+
+	PowerStats(): hart_base(0), start_cycle(0), series(nullptr), window(0), next_window(INT64_MAX) {}
+
+	~PowerStats() {
+		if (series)
+			fclose(series);
+	}
+
+	bool init(int n_harts, int hart_base_, const std::string &series_path, int64_t window_, int64_t start_cycle_) {
+		hart_base = hart_base_;
+		start_cycle = start_cycle_;
+		harts.resize(n_harts);
+		last.resize(n_harts);
+		if (series_path.empty())
+			return true;
+		series = fopen(series_path.c_str(), "w");
+		if (!series) {
+			std::cerr << "Failed to open \"" << series_path << "\"\n";
+			return false;
+		}
+		window = window_;
+		next_window = start_cycle + window;
+		fprintf(series, "cycle,hart,active,wfi,sleep,deep_sleep,powered_down,wakes\n");
+		return true;
+	}
+
+	// n cycles skipped, with every hart staying in its current state
+	void skip(int64_t n) {
+		for (Hart &h : harts)
+			h.cycles[h.state] += n;
+	}
+
+	// Call with the number of cycles run so far
+	void end_window(int64_t cycles) {
+		for (size_t i = 0; i < harts.size(); ++i) {
+			Hart &h = harts[i];
+			const Hart &l = last[i];
+			h.sync(cycles - start_cycle);
+			uint64_t wakes = 0, last_wakes = 0;
+			for (int w = 0; w < N_WAKES; ++w) {
+				wakes += h.wakes[w];
+				last_wakes += l.wakes[w];
+			}
+			fprintf(series, "%" PRId64 ",%d", cycles, hart_base + (int)i);
+			for (int s = 0; s < N_STATES; ++s)
+				fprintf(series, ",%" PRIu64, h.cycles[s] - l.cycles[s]);
+			fprintf(series, ",%" PRIu64 "\n", wakes - last_wakes);
+		}
+		last = harts;
+		next_window = cycles + window;
+	}
+
+	// Call with the number of cycles run so far
+	void print(FILE *f, int64_t cycles) {
+		static const char *const state_names[N_STATES] = {
+			"active", "wfi", "sleep", "deep sleep", "powered down"
+		};
+		static const char *const wake_names[N_WAKES] = {
+			"external", "timer", "soft", "unblock", "other"
+		};
+		for (size_t i = 0; i < harts.size(); ++i) {
+			Hart &h = harts[i];
+			h.sync(cycles - start_cycle);
+			uint64_t total = h.total();
+			fprintf(f, "Power, hart %d: %" PRIu64 " cycles\n ", hart_base + (int)i, total);
+			for (int s = 0; s < N_STATES; ++s)
+				fprintf(f, " %s %" PRIu64 " (%.1f%%)%s", state_names[s], h.cycles[s],
+					total ? 100.0 * h.cycles[s] / total : 0.0, s == N_STATES - 1 ? "\n" : ",");
+			fprintf(f, "  %" PRIu64 " sleeps, wakes:", h.sleeps);
+			for (int w = 0; w < N_WAKES; ++w)
+				fprintf(f, " %" PRIu64 " %s%s", h.wakes[w], wake_names[w], w == N_WAKES - 1 ? "\n" : ",");
+		}
+	}
+};
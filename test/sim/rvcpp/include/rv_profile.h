@@ -0,0 +1,184 @@
+#pragma once
+
+// Sampling PC profiler shared by rvcpp and tb_cxxrtl (so no C++17, and no
+// dependencies on the rest of rvcpp). The simulator calls tick() on every
+// cycle with the current pc, and one sample is taken every `interval` cycles.
+//
+// Optionally, call stacks are tracked from the retired instructions, using
+// the RISC-V calling convention's return address hints: jal/jalr with a link
+// register (ra or t0) as rd is a call, and jalr with a link register as rs1
+// is a return (including c.jr/c.jalr, and Zcmp cm.popret/cm.popretz). Traps
+// push a frame which is popped by mret, so interrupt handlers appear below
+// the code they interrupted. Call stacks are stored as a tree of call sites,
+// so each sample is just a (call site, pc) pair.
+//
+// Output is in the folded stack format used by flamegraph.pl and speedscope,
+// one line per distinct stack: frames separated by semicolons, then the
+// number of samples. Frames are function names where the ELF file has them,
+// otherwise hex addresses.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "rv_elf.h"
+
+struct Profiler {
+	// Deeper calls (e.g. from unbalanced calls and returns) are not tracked
+	static const unsigned int MAX_DEPTH = 256;
+
+	uint64_t interval;
+	bool track_calls;
+
+	Profiler(uint64_t interval_, bool track_calls_):
+		interval(interval_), track_calls(track_calls_), countdown(interval_), node(0), untracked(0) {
+		nodes.push_back({0, 0, 0});
+	}
+
+	void tick(uint32_t pc, uint64_t n = 1) {
+		while (n >= countdown) {
+			n -= countdown;
+			countdown = interval;
+			++samples[(uint64_t)node << 32 | pc];
+		}
+		countdown -= n;
+	}
+
+	// Update the call stack for an instruction which retired at pc
+	void retire(uint32_t pc, uint32_t instr) {
+		if (!track_calls)
+			return;
+		int rd = -1, rs1 = -1;
+		if ((instr & 0x7f) == 0x6f) {
+			// jal
+			rd = instr >> 7 & 0x1f;
+		} else if ((instr & 0x707f) == 0x0067) {
+			// jalr
+			rd = instr >> 7 & 0x1f;
+			rs1 = instr >> 15 & 0x1f;
+		} else if ((instr & 0xe003) == 0x2001) {
+			// c.jal
+			rd = 1;
+		} else if ((instr & 0xe07f) == 0x8002 && (instr & 0xf80)) {
+			// c.jr, c.jalr
+			rd = instr & 0x1000 ? 1 : 0;
+			rs1 = instr >> 7 & 0x1f;
+		} else if ((instr & 0xfd03) == 0xbc02) {
+			// cm.popret, cm.popretz
+			rs1 = 1;
+		} else if (instr == 0x30200073u) {
+			// mret
+			pop();
+			return;
+		} else {
+			return;
+		}
+		bool rd_link = rd == 1 || rd == 5;
+		bool rs1_link = rs1 == 1 || rs1 == 5;
+		if (rs1_link && !(rd_link && rd == rs1))
+			pop();
+		if (rd_link)
+			push(pc);
+	}
+
+	// A trap was taken from pc
+	void trap(uint32_t pc) {
+		if (track_calls)
+			push(pc);
+	}
+
+	// Write out the profile in folded stack format, and print the functions
+	// with the most samples to `summary` (if not null). Returns false on
+	// failure to open the file.
+	bool write(const std::string &path, const ElfFile *elf, FILE *summary) const {
+		FILE *f = fopen(path.c_str(), "w");
+		if (!f)
+			return false;
+		std::map<std::string, uint64_t> stacks;
+		std::map<std::string, uint64_t> flat;
+		uint64_t total = 0;
+		for (const auto &s : samples) {
+			std::vector<uint32_t> frames;
+			for (uint32_t n = s.first >> 32; n != 0; n = nodes[n].parent)
+				frames.push_back(nodes[n].pc);
+			std::reverse(frames.begin(), frames.end());
+			frames.push_back(s.first & 0xffffffffu);
+			std::string stack;
+			for (uint32_t pc : frames)
+				stack += (stack.empty() ? "" : ";") + symbolise(pc, elf);
+			stacks[stack] += s.second;
+			flat[symbolise(frames.back(), elf)] += s.second;
+			total += s.second;
+		}
+		for (const auto &s : stacks)
+			fprintf(f, "%s %lu\n", s.first.c_str(), (unsigned long)s.second);
+		fclose(f);
+
+		if (summary && total) {
+			std::vector<std::pair<uint64_t, std::string>> top;
+			for (const auto &s : flat)
+				top.push_back(std::make_pair(s.second, s.first));
+			std::sort(top.rbegin(), top.rend());
+			fprintf(summary, "Profile: %lu samples, every %lu cycles. Top functions by samples:\n",
+				(unsigned long)total, (unsigned long)interval);
+			for (size_t i = 0; i < top.size() && i < 10; ++i)
+				fprintf(summary, "  %5.1f%%  %s\n", 100.0 * top[i].first / total, top[i].second.c_str());
+		}
+		return true;
+	}
+
+private:
+	struct Node {
+		uint32_t parent;
+		uint32_t pc; // Call site
+		unsigned int depth;
+	};
+
+	uint64_t countdown;
+	uint32_t node;
+	// Pushes not taken because of MAX_DEPTH, which are popped first
+	unsigned int untracked;
+	std::vector<Node> nodes;
+	// Indexed by parent node and call site
+	std::unordered_map<uint64_t, uint32_t> children;
+	// Indexed by node and pc
+	std::unordered_map<uint64_t, uint64_t> samples;
+
+	void push(uint32_t pc) {
+		if (nodes[node].depth >= MAX_DEPTH) {
+			++untracked;
+			return;
+		}
+		auto it = children.find((uint64_t)node << 32 | pc);
+		if (it != children.end()) {
+			node = it->second;
+			return;
+		}
+		uint32_t child = nodes.size();
+		nodes.push_back({node, pc, nodes[node].depth + 1});
+		children[(uint64_t)node << 32 | pc] = child;
+		node = child;
+	}
+
+	void pop() {
+		if (untracked)
+			--untracked;
+		else
+			node = nodes[node].parent;
+	}
+
+	static std::string symbolise(uint32_t pc, const ElfFile *elf) {
+		uint32_t offset;
+		const char *name = elf ? elf->function_at(pc, offset) : nullptr;
+		if (name)
+			return name;
+		char buf[16];
+		snprintf(buf, sizeof(buf), "0x%08x", pc);
+		return buf;
+	}
+};
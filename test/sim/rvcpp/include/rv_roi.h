@@ -0,0 +1,76 @@
+#pragma once
+
+// Region-of-interest markers, shared by rvcpp and tb_cxxrtl (so no C++17, and
+// no dependencies on the rest of rvcpp). Software enters region n (nonzero)
+// by writing n to IO_ROI, and leaves it by writing 0, e.g. around the timed
+// part of a benchmark; writing another n moves straight to that region. The
+// simulator passes the current values of some running counters (cycles,
+// instructions, ...) on each change, and each region's totals are the sums
+// of the counters' changes while in it, over every visit.
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+struct RoiStats {
+	static const uint32_t NONE = 0;
+
+	struct Region {
+		uint64_t entries;
+		std::vector<uint64_t> totals;
+	};
+
+	// Current region, or NONE
+	uint32_t current;
+	std::vector<std::string> names;
+	std::map<uint32_t, Region> regions;
+
+	explicit RoiStats(const std::vector<std::string> &names_): current(NONE), names(names_),
+		start(names_.size(), 0) {}
+
+	bool active() const {
+		return current != NONE;
+	}
+
+	// `counters` has one value for each of `names`
+	void set(uint32_t id, const uint64_t *counters) {
+		if (id == current)
+			return;
+		if (current != NONE) {
+			Region &r = regions[current];
+			for (size_t i = 0; i < names.size(); ++i)
+				r.totals[i] += counters[i] - start[i];
+		}
+		current = id;
+		if (current != NONE) {
+			Region &r = regions[current];
+			if (r.totals.empty())
+				r.totals.resize(names.size(), 0);
+			++r.entries;
+			for (size_t i = 0; i < names.size(); ++i)
+				start[i] = counters[i];
+		}
+	}
+
+	// Nothing is printed if no region was entered
+	void print(FILE *f) const {
+		if (regions.empty())
+			return;
+		fprintf(f, "Regions of interest:\n  %8s %8s", "region", "entries");
+		for (const std::string &n : names)
+			fprintf(f, " %14s", n.c_str());
+		fprintf(f, "\n");
+		for (const auto &it : regions) {
+			fprintf(f, "  %8u %8" PRIu64, it.first, it.second.entries);
+			for (uint64_t x : it.second.totals)
+				fprintf(f, " %14" PRIu64, x);
+			fprintf(f, "\n");
+		}
+	}
+
+private:
+	std::vector<uint64_t> start;
+};
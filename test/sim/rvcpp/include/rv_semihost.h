@@ -0,0 +1,466 @@
+#pragma once
+
+// RISC-V semihosting, shared by rvcpp and tb_cxxrtl (so no C++17, and no
+// dependencies on the rest of rvcpp). A semihosting call is an uncompressed
+// ebreak between two marker instructions:
+//
+//     slli x0, x0, 0x1f
+//     ebreak
+//     srai x0, x0, 7
+//
+// with the operation number in a0, and its parameter (usually a pointer to a
+// block of argument words) in a1. The result is returned in a0. Operations
+// follow the Arm semihosting spec, as used by picolibc, newlib and OpenOCD.
+//
+// Guest memory is a single flat RAM. Files are host file descriptors, read
+// and written in place in guest RAM, so large inputs can be streamed into
+// memory without going through the testbench IO one word at a time. The
+// console (the special file ":tt", and SYS_WRITEC/SYS_WRITE0) goes through
+// the simulator's print function, so it is interleaved correctly with
+// other output. Clocks count simulated cycles, at a nominal TICK_FREQ.
+//
+// Host system calls are the only inputs from outside the simulation. With an
+// input log, each one's result (and anything it read into guest RAM) is
+// recorded, or on replay is taken from the log, and the call isn't made: so
+// a replay doesn't need, or touch, the host files of the recorded run.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rv_inputlog.h"
+
+struct Semihost {
+	static const uint32_t INSTR_ENTRY = 0x01f01013u; // slli x0, x0, 0x1f
+	static const uint32_t INSTR_EBREAK = 0x00100073u;
+	static const uint32_t INSTR_EXIT = 0x40705013u;  // srai x0, x0, 7
+
+	static const uint64_t TICK_FREQ = 100000000u;
+
+	enum {
+		SYS_OPEN          = 0x01,
+		SYS_CLOSE         = 0x02,
+		SYS_WRITEC        = 0x03,
+		SYS_WRITE0        = 0x04,
+		SYS_WRITE         = 0x05,
+		SYS_READ          = 0x06,
+		SYS_READC         = 0x07,
+		SYS_ISERROR       = 0x08,
+		SYS_ISTTY         = 0x09,
+		SYS_SEEK          = 0x0a,
+		SYS_FLEN          = 0x0c,
+		SYS_REMOVE        = 0x0e,
+		SYS_RENAME        = 0x0f,
+		SYS_CLOCK         = 0x10,
+		SYS_TIME          = 0x11,
+		SYS_ERRNO         = 0x13,
+		SYS_GET_CMDLINE   = 0x15,
+		SYS_HEAPINFO      = 0x16,
+		SYS_EXIT          = 0x18,
+		SYS_EXIT_EXTENDED = 0x20,
+		SYS_ELAPSED       = 0x30,
+		SYS_TICKFREQ      = 0x31,
+	};
+
+	// SYS_EXIT reason for a normal exit (ADP_Stopped_ApplicationExit)
+	static const uint32_t EXIT_APPLICATION = 0x20026u;
+
+	uint8_t *ram;
+	uint32_t ram_base;
+	uint32_t ram_size;
+	// Console output
+	std::function<void(const char *, size_t)> print;
+	// Simulated cycle count, for SYS_CLOCK and SYS_ELAPSED
+	std::function<uint64_t()> cycles;
+	// Returned by SYS_GET_CMDLINE
+	std::string cmdline;
+	// Host call results are recorded to, or replayed from, this log if set
+	InputLog *inputs;
+
+	// Set by SYS_EXIT and SYS_EXIT_EXTENDED
+	bool exit_req;
+	uint32_t exit_code;
+
+	Semihost(uint8_t *ram_, uint32_t ram_base_, uint32_t ram_size_):
+		ram(ram_), ram_base(ram_base_), ram_size(ram_size_), inputs(nullptr), exit_req(false),
+		exit_code(0), host_errno(0) {}
+
+	~Semihost() {
+		for (const File &f : files)
+			host_close(f.fd);
+	}
+
+	// True if the ebreak at pc is a semihosting call
+	bool is_call(uint32_t pc) const {
+		uint32_t instr[3];
+		for (int i = 0; i < 3; ++i) {
+			if (!read_word(pc - 4 + 4 * i, instr[i]))
+				return false;
+		}
+		return instr[0] == INSTR_ENTRY && instr[1] == INSTR_EBREAK && instr[2] == INSTR_EXIT;
+	}
+
+	// Run operation op with parameter param, and return the result for a0
+	uint32_t call(uint32_t op, uint32_t param) {
+		uint32_t args[4] = {0, 0, 0, 0};
+		for (int i = 0; i < arg_count(op); ++i) {
+			if (!read_word(param + 4 * i, args[i]))
+				return fail(EFAULT);
+		}
+
+		switch (op) {
+		case SYS_OPEN: {
+			std::string path;
+			if (!read_string(args[0], args[2], path) || args[1] > 11)
+				return fail(EINVAL);
+			return open_file(path, args[1]);
+		}
+		case SYS_CLOSE: {
+			File *f = file(args[0]);
+			if (!f)
+				return fail(EBADF);
+			host_close(f->fd);
+			f->fd = -1;
+			f->kind = File::CLOSED;
+			return 0;
+		}
+		case SYS_WRITEC: {
+			const uint8_t *c = host_ptr(param, 1);
+			if (!c)
+				return fail(EFAULT);
+			print((const char *)c, 1);
+			return 0;
+		}
+		case SYS_WRITE0: {
+			uint32_t len = 0;
+			while (host_ptr(param + len, 1) && *host_ptr(param + len, 1))
+				++len;
+			if (!host_ptr(param + len, 1))
+				return fail(EFAULT);
+			print((const char *)host_ptr(param, len), len);
+			return 0;
+		}
+		case SYS_WRITE: {
+			File *f = file(args[0]);
+			uint8_t *buf = host_ptr(args[1], args[2]);
+			if (!f || !buf) {
+				fail(f ? EFAULT : EBADF);
+				return args[2];
+			}
+			if (f->kind == File::CONSOLE) {
+				print((const char *)buf, args[2]);
+				return 0;
+			}
+			if (f->kind != File::HOST) {
+				fail(EBADF);
+				return args[2];
+			}
+			uint32_t done = 0;
+			while (done < args[2]) {
+				int64_t n = host([&] {return write(f->fd, buf + done, args[2] - done);});
+				if (n <= 0) {
+					fail(errno);
+					break;
+				}
+				done += n;
+			}
+			return args[2] - done;
+		}
+		case SYS_READ: {
+			File *f = file(args[0]);
+			uint8_t *buf = host_ptr(args[1], args[2]);
+			if (!f || !buf) {
+				fail(f ? EFAULT : EBADF);
+				return args[2];
+			}
+			if (f->kind == File::FEATURES) {
+				uint32_t n = std::min(args[2], FEATURES_SIZE - f->pos);
+				memcpy(buf, features() + f->pos, n);
+				f->pos += n;
+				return args[2] - n;
+			}
+			// Console reads return after one line (or whatever is available)
+			int fd = f->kind == File::CONSOLE ? STDIN_FILENO : f->fd;
+			uint32_t done = 0;
+			while (done < args[2]) {
+				int64_t n = host([&] {return read(fd, buf + done, args[2] - done);}, buf + done);
+				if (n < 0)
+					fail(errno);
+				if (n <= 0)
+					break;
+				done += n;
+				if (f->kind == File::CONSOLE)
+					break;
+			}
+			return args[2] - done;
+		}
+		case SYS_READC: {
+			uint8_t c;
+			if (host([&] {return read(STDIN_FILENO, &c, 1);}, &c) != 1)
+				return fail(errno ? errno : EIO);
+			return c;
+		}
+		case SYS_ISERROR:
+			return (int32_t)args[0] < 0;
+		case SYS_ISTTY: {
+			File *f = file(args[0]);
+			if (!f)
+				return fail(EBADF);
+			return f->kind == File::CONSOLE;
+		}
+		case SYS_SEEK: {
+			File *f = file(args[0]);
+			if (!f)
+				return fail(EBADF);
+			if (f->kind == File::FEATURES) {
+				f->pos = args[1] < FEATURES_SIZE ? args[1] : FEATURES_SIZE;
+				return 0;
+			}
+			if (f->kind != File::HOST || host([&] {return lseek(f->fd, args[1], SEEK_SET);}) < 0)
+				return fail(f->kind == File::HOST ? errno : ESPIPE);
+			return 0;
+		}
+		case SYS_FLEN: {
+			File *f = file(args[0]);
+			if (!f)
+				return fail(EBADF);
+			if (f->kind == File::FEATURES)
+				return FEATURES_SIZE;
+			int64_t size = -1;
+			if (f->kind == File::HOST) {
+				size = host([&] {
+					struct stat st;
+					return fstat(f->fd, &st) < 0 ? (int64_t)-1 : (int64_t)st.st_size;
+				});
+			}
+			if (size < 0)
+				return fail(f->kind == File::HOST ? errno : EINVAL);
+			return size;
+		}
+		case SYS_REMOVE: {
+			std::string path;
+			if (!read_string(args[0], args[1], path))
+				return fail(EINVAL);
+			return host([&] {return unlink(path.c_str());}) < 0 ? fail(errno) : 0;
+		}
+		case SYS_RENAME: {
+			std::string from, to;
+			if (!read_string(args[0], args[1], from) || !read_string(args[2], args[3], to))
+				return fail(EINVAL);
+			return host([&] {return rename(from.c_str(), to.c_str());}) < 0 ? fail(errno) : 0;
+		}
+		case SYS_CLOCK:
+			return cycles() / (TICK_FREQ / 100);
+		case SYS_TIME:
+			return host([] {return (int64_t)time(nullptr);});
+		case SYS_ERRNO:
+			return host_errno;
+		case SYS_GET_CMDLINE: {
+			// Block is {buffer, length}, and length is updated
+			uint8_t *buf = host_ptr(args[0], args[1]);
+			if (!buf || cmdline.size() >= args[1])
+				return fail(EINVAL);
+			memcpy(buf, cmdline.c_str(), cmdline.size() + 1);
+			write_word(param + 4, cmdline.size());
+			return 0;
+		}
+		case SYS_HEAPINFO: {
+			// Block is a pointer to {heap base, heap limit, stack base, stack
+			// limit}, which are all unknown, so the program's own defaults
+			// are used.
+			uint32_t block;
+			if (!read_word(param, block))
+				return fail(EFAULT);
+			for (int i = 0; i < 4; ++i)
+				write_word(block + 4 * i, 0);
+			return 0;
+		}
+		case SYS_EXIT:
+			// Only the reason is passed on RV32
+			exit_req = true;
+			exit_code = param == EXIT_APPLICATION ? 0 : 1;
+			return 0;
+		case SYS_EXIT_EXTENDED:
+			exit_req = true;
+			exit_code = args[0] == EXIT_APPLICATION ? args[1] : 1;
+			return 0;
+		case SYS_ELAPSED: {
+			uint64_t t = cycles();
+			if (!write_word(param, t) || !write_word(param + 4, t >> 32))
+				return fail(EFAULT);
+			return 0;
+		}
+		case SYS_TICKFREQ:
+			return TICK_FREQ;
+		default:
+			return fail(ENOSYS);
+		}
+	}
+
+private:
+	struct File {
+		// FEATURES is the ":semihosting-features" file, which advertises
+		// SYS_EXIT_EXTENDED, so that exit codes are passed through
+		enum Kind {CLOSED, CONSOLE, FEATURES, HOST} kind;
+		int fd;
+		uint32_t pos;
+	};
+
+	// Magic, then SH_EXT_EXIT_EXTENDED
+	static const uint32_t FEATURES_SIZE = 5;
+	static const uint8_t *features() {
+		static const uint8_t data[FEATURES_SIZE] = {'S', 'H', 'F', 'B', 0x01};
+		return data;
+	}
+
+	std::vector<File> files;
+	int host_errno;
+
+	// Number of words in the parameter block
+	static int arg_count(uint32_t op) {
+		switch (op) {
+		case SYS_RENAME:
+			return 4;
+		case SYS_OPEN:
+		case SYS_WRITE:
+		case SYS_READ:
+			return 3;
+		case SYS_SEEK:
+		case SYS_REMOVE:
+		case SYS_GET_CMDLINE:
+		case SYS_EXIT_EXTENDED:
+			return 2;
+		case SYS_CLOSE:
+		case SYS_ISERROR:
+		case SYS_ISTTY:
+		case SYS_FLEN:
+			return 1;
+		default:
+			return 0;
+		}
+	}
+
+	// Run a host call, which returns a negative result on failure, with the
+	// reason in errno. A positive result from a read is the number of bytes
+	// read into buf. Results are recorded to the input log, or replayed from
+	// it in place of the call.
+	template <typename F>
+	int64_t host(F f, uint8_t *buf = nullptr) {
+		struct Result {
+			int64_t value;
+			int32_t err;
+		} r;
+		// Zeroed padding, so that logs are reproducible
+		memset(&r, 0, sizeof(r));
+		std::string e;
+		if (inputs && inputs->replaying()) {
+			if (!inputs->expect(InputLog::SEMIHOST, cycles(), e) || e.size() < sizeof(r)) {
+				// Divergence stops the run
+				exit_req = true;
+				exit_code = 1;
+				errno = EIO;
+				return -1;
+			}
+			memcpy(&r, e.data(), sizeof(r));
+			if (buf && r.value > 0)
+				memcpy(buf, e.data() + sizeof(r), std::min<size_t>(r.value, e.size() - sizeof(r)));
+			errno = r.err;
+			return r.value;
+		}
+		r.value = f();
+		r.err = errno;
+		if (inputs && inputs->recording()) {
+			e.assign((const char *)&r, sizeof(r));
+			if (buf && r.value > 0)
+				e.append((const char *)buf, r.value);
+			inputs->put(InputLog::SEMIHOST, cycles(), e);
+		}
+		errno = r.err;
+		return r.value;
+	}
+
+	void host_close(int fd) {
+		if (fd > STDERR_FILENO && !(inputs && inputs->replaying()))
+			close(fd);
+	}
+
+	uint32_t fail(int err) {
+		host_errno = err;
+		return 0xffffffffu;
+	}
+
+	uint8_t *host_ptr(uint32_t addr, uint32_t len) const {
+		if (addr - ram_base > ram_size || len > ram_size - (addr - ram_base))
+			return nullptr;
+		return ram + (addr - ram_base);
+	}
+
+	bool read_word(uint32_t addr, uint32_t &data) const {
+		const uint8_t *p = host_ptr(addr, 4);
+		if (p)
+			memcpy(&data, p, 4);
+		return p;
+	}
+
+	bool write_word(uint32_t addr, uint32_t data) {
+		uint8_t *p = host_ptr(addr, 4);
+		if (p)
+			memcpy(p, &data, 4);
+		return p;
+	}
+
+	// Strings are passed with their length, not counting the terminator
+	bool read_string(uint32_t addr, uint32_t len, std::string &s) const {
+		const uint8_t *p = host_ptr(addr, len);
+		if (p)
+			s.assign((const char *)p, len);
+		return p;
+	}
+
+	File *file(uint32_t handle) {
+		if (handle >= files.size() || files[handle].kind == File::CLOSED)
+			return nullptr;
+		return &files[handle];
+	}
+
+	// Mode is an fopen() mode: r, rb, r+, r+b, w, wb, w+, w+b, a, ab, a+, a+b
+	uint32_t open_file(const std::string &path, uint32_t mode) {
+		File f;
+		f.kind = File::HOST;
+		f.fd = -1;
+		f.pos = 0;
+		if (path == ":tt") {
+			f.kind = File::CONSOLE;
+		} else if (path == ":semihosting-features") {
+			if (mode >= 4)
+				return fail(EACCES);
+			f.kind = File::FEATURES;
+		} else {
+			bool update = mode & 2;
+			int flags = update ? O_RDWR : mode < 4 ? O_RDONLY : O_WRONLY;
+			if (mode >= 4)
+				flags |= O_CREAT | (mode < 8 ? O_TRUNC : O_APPEND);
+			f.fd = host([&] {return open(path.c_str(), flags, 0666);});
+			if (f.fd < 0)
+				return fail(errno);
+		}
+		for (uint32_t i = 0; i < files.size(); ++i) {
+			if (files[i].kind == File::CLOSED) {
+				files[i] = f;
+				return i;
+			}
+		}
+		files.push_back(f);
+		return files.size() - 1;
+	}
+};
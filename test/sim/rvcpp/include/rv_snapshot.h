@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "rv_checkpoint.h"
+#include "rv_core.h"
+#include "rv_mem.h"
+#include "rv_types.h"
+
+// Snapshot file layout: a header, then the state of the IO model and each
+// hart, then the RAM contents starting at a page-aligned offset. The RAM is
+// mapped copy-on-write when a snapshot is restored, so that many runs can
+// be started from the same snapshot without copying it. Snapshots are only
+// meant to be restored by the same build of rvcpp that saved them.
+
+struct SnapshotHeader {
+	static const uint32_t VERSION = 8;
+	// Large enough for any host page size we're likely to see
+	static const uint32_t RAM_ALIGN = 1u << 16;
+
+	char magic[8];
+	uint32_t version;
+	uint32_t ram_size;
+	uint32_t n_harts;
+	uint32_t ram_offset;
+	int64_t cycle;
+};
+
+struct SnapshotWriter {
+	FILE *f;
+	bool ok;
+
+	template <typename T>
+	void operator()(const T &x) {
+		static_assert(std::is_trivially_copyable<T>::value, "Field can't be saved as raw bytes");
+		ok = ok && fwrite(&x, sizeof(T), 1, f) == 1;
+	}
+};
+
+struct SnapshotReader {
+	FILE *f;
+	bool ok;
+
+	template <typename T>
+	void operator()(T &x) {
+		static_assert(std::is_trivially_copyable<T>::value, "Field can't be restored from raw bytes");
+		ok = ok && fread(&x, sizeof(T), 1, f) == 1;
+	}
+};
+
+// Save the IO model, all harts, and the RAM shared by the harts. Returns
+// false (after printing the reason) on failure.
+bool snapshot_save(const std::string &path, int64_t cycle, TBMemIO &io,
+	std::vector<std::unique_ptr<RVCore>> &harts);
+
+// Read a snapshot's header, and map its RAM copy-on-write. Used to size the
+// IO model and harts before calling snapshot_restore().
+bool snapshot_map(const std::string &path, SnapshotHeader &header, uint8_t *&ram);
+
+// Restore the IO model and hart state. The harts must have been created using
+// the RAM returned by snapshot_map().
+bool snapshot_restore(const std::string &path, TBMemIO &io,
+	std::vector<std::unique_ptr<RVCore>> &harts);
+
+// Fill in an architectural checkpoint (see rv_checkpoint.h) from one hart,
+// its timer and IRQ inputs, and the RAM. Only CSRs which exist in the hart's
+// configuration are saved, so it must match the RTL it is restored to.
+void arch_checkpoint_capture(ArchCheckpoint &cp, int64_t cycle, const TBMemIO &io, RVCore &core);
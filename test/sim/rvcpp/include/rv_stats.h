@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+#include "rv_decode.h"
+#include "rv_types.h"
+
+// Dynamic instruction statistics, collected by RVCore::step() when enabled:
+// retired instructions per decoded op (and how many of those were 16-bit),
+// taken branches, and register reads and writes. Everything is a flat array
+// indexed by op or register number, so recording is a few increments.
+//
+// Ops are grouped by the Hazard3 extension parameter which implements them,
+// to show which ones a program actually makes use of.
+struct ExecStats {
+	uint64_t retired[RVOP_COUNT];
+	uint64_t compressed[RVOP_COUNT];
+	// Retired with an explicit pc write, i.e. taken, for branches
+	uint64_t pc_written[RVOP_COUNT];
+	uint64_t reg_reads[32];
+	uint64_t reg_writes[32];
+	// 16-bit instructions from Zcb, most of which decode to the same ops as
+	// their 32-bit equivalents
+	uint64_t zcb;
+
+	ExecStats();
+
+	void record(const RVDecodedInstr &d, bool pc_write, uint rd) {
+		++retired[d.op];
+		if (d.len == 2) {
+			++compressed[d.op];
+			zcb += (d.instr & 0xe003) == 0x8000 || (d.instr & 0xfc03) == 0x9c01;
+		}
+		pc_written[d.op] += pc_write;
+		uint8_t reads = reg_read_mask[d.op];
+		if (reads & READS_RS1)
+			++reg_reads[d.rs1];
+		if (reads & READS_RS2)
+			++reg_reads[d.rs2];
+		++reg_writes[rd];
+	}
+
+	void print(FILE *f, uint hartid) const;
+
+private:
+	enum {
+		READS_RS1 = 0x1,
+		READS_RS2 = 0x2
+	};
+
+	// Which of rs1/rs2 each op reads (Zcmp push/pop, which access lists of
+	// registers, are not counted)
+	uint8_t reg_read_mask[RVOP_COUNT];
+};
@@ -0,0 +1,235 @@
+#pragma once
+
+// Scheduled IRQ stimulus, shared by rvcpp and tb_cxxrtl (so no C++17, and no
+// dependencies on the rest of rvcpp). Each event sets or clears one IRQ input
+// at the end of a given cycle, as though written through the testbench IO on
+// that cycle. Events are kept in a min-heap by cycle, so until the next one
+// is due, the simulator's only cost is comparing the cycle with next_cycle.
+//
+// Events are read from a stimulus file, one per line:
+//
+//     <cycle> irq <n> <0|1>        External IRQ line n
+//     <cycle> softirq <hart> <0|1> Software IRQ
+//     <cycle> timer <hart> <0|1>   1 forces the timer IRQ on, 0 returns it to
+//                                  the mtime/mtimecmp comparison
+//     <cycle> fault|exfail <start> <end> [read] [write] [fetch] [port <n>]
+//             [nth <n>] [count <n>] [prob <p>] [seed <n>]
+//                                  Arm a bus fault injection rule (see
+//                                  rv_fault.h) for addresses start to end
+//                                  inclusive. With no read, write or fetch,
+//                                  it sees all three. nth and count default
+//                                  to 1, and count 0 is unlimited.
+//
+// Anything after a # is ignored. Events on the same cycle are applied in
+// file order. Events can also come from a seeded random generator, which
+// asserts random external IRQ lines at random intervals. The generator is
+// deterministic, so a seed gives the same IRQ storm in both simulators.
+
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "rv_fault.h"
+
+struct StimulusEvent {
+	// For FAULT, index is into Stimulus::fault_rules
+	enum Type {IRQ, SOFTIRQ, TIMER, RANDOM, FAULT};
+
+	uint64_t cycle;
+	// Order of insertion, for ordering events on the same cycle
+	uint64_t seq;
+	Type type;
+	uint32_t index;
+	bool level;
+
+	bool operator>(const StimulusEvent &other) const {
+		return cycle != other.cycle ? cycle > other.cycle : seq > other.seq;
+	}
+};
+
+struct Stimulus {
+	static const uint64_t NEVER = ~0ull;
+	// Limit on IRQ line and hart numbers
+	static const uint32_t MAX_INDEX = 32;
+
+	// Cycle of the next event, or NEVER
+	uint64_t next_cycle;
+	// Armed by FAULT events
+	std::vector<FaultRule> fault_rules;
+
+	Stimulus(): next_cycle(NEVER), seq(0), rng(0), random_interval(0), random_mask(0) {}
+
+	void add(uint64_t cycle, StimulusEvent::Type type, uint32_t index, bool level) {
+		queue.push({cycle, seq++, type, index, level});
+		next_cycle = queue.top().cycle;
+	}
+
+	bool load(const std::string &path, std::string &err) {
+		std::ifstream f(path);
+		if (!f.is_open()) {
+			err = "Failed to open \"" + path + "\"";
+			return false;
+		}
+		std::string line;
+		for (int lineno = 1; std::getline(f, line); ++lineno) {
+			if (!add_line(line, err)) {
+				err = path + ":" + std::to_string(lineno) + ": " + err;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Add the event on one line of a stimulus file (blank lines are fine)
+	bool add_line(std::string line, std::string &err) {
+		line = line.substr(0, line.find('#'));
+		std::istringstream s(line);
+		std::string cycle, type;
+		if (!(s >> cycle))
+			return true;
+		if (!(s >> type) || cycle.find_first_not_of("0123456789") != std::string::npos) {
+			err = "expected \"<cycle> <event> ...\"";
+			return false;
+		}
+		if (type == "fault" || type == "exfail")
+			return add_fault(std::stoull(cycle), type == "exfail", s, err);
+		uint32_t index;
+		int level;
+		StimulusEvent::Type t = StimulusEvent::IRQ;
+		bool ok = (bool)(s >> index >> level) && (level == 0 || level == 1) && index < MAX_INDEX;
+		if (type == "softirq")
+			t = StimulusEvent::SOFTIRQ;
+		else if (type == "timer")
+			t = StimulusEvent::TIMER;
+		else
+			ok = ok && type == "irq";
+		std::string rest;
+		if (!ok || s >> rest) {
+			err = "expected \"<cycle> irq|softirq|timer <n> <0|1>\"";
+			return false;
+		}
+		add(std::stoull(cycle), t, index, level);
+		return true;
+	}
+
+	// From start_cycle onwards, assert a random line from irq_mask every 1
+	// to 2 * interval cycles, and hold it for 1 to interval cycles
+	void add_random(uint64_t seed, uint64_t start_cycle, uint64_t interval, uint32_t irq_mask) {
+		// xorshift64* state must be nonzero
+		rng = seed * 0x9e3779b97f4a7c15ull | 1;
+		random_interval = interval;
+		random_mask = irq_mask;
+		add(start_cycle + next_random(2 * interval), StimulusEvent::RANDOM, 0, true);
+	}
+
+	// Apply every event due by the end of `cycle`, in order, by calling
+	// apply(const StimulusEvent &)
+	template <typename F>
+	void run(uint64_t cycle, F apply) {
+		while (next_cycle <= cycle) {
+			StimulusEvent e = queue.top();
+			queue.pop();
+			if (e.type == StimulusEvent::RANDOM) {
+				e.type = StimulusEvent::IRQ;
+				e.index = random_line();
+				uint64_t hold = next_random(random_interval);
+				queue.push({e.cycle + hold, seq++, StimulusEvent::IRQ, e.index, false});
+				queue.push({e.cycle + next_random(2 * random_interval), seq++, StimulusEvent::RANDOM, 0, true});
+			}
+			apply(e);
+			next_cycle = queue.empty() ? NEVER : queue.top().cycle;
+		}
+	}
+
+private:
+	// The rest of a fault or exfail line, after its type
+	bool add_fault(uint64_t cycle, bool exfail, std::istringstream &s, std::string &err) {
+		FaultRule r;
+		r.kind = exfail ? FaultRule::EXFAIL : FaultRule::FAULT;
+		r.access = 0;
+		r.seed(fault_rules.size() + 1);
+		std::string start, end, word, arg;
+		uint64_t n = 0;
+		bool ok = (bool)(s >> start >> end) && parse_u64(start, UINT32_MAX, n);
+		r.start = n;
+		ok = ok && parse_u64(end, UINT32_MAX, n);
+		r.end = n;
+		while (ok && s >> word) {
+			if (word == "read" || word == "write" || word == "fetch") {
+				r.access |= word == "read" ? FaultRule::READ : word == "write" ? FaultRule::WRITE : FaultRule::FETCH;
+				continue;
+			}
+			ok = (bool)(s >> arg);
+			if (!ok)
+				break;
+			if (word == "prob") {
+				char *arg_end;
+				double p = strtod(arg.c_str(), &arg_end);
+				ok = *arg_end == 0 && p > 0 && p <= 1;
+				r.prob = p >= 1 ? 0 : (uint32_t)(p * 4294967296.0);
+				continue;
+			}
+			ok = parse_u64(arg, word == "port" ? 255 : UINT64_MAX, n);
+			if (word == "port")
+				r.port = n;
+			else if (word == "nth" && n > 0)
+				r.skip = n - 1;
+			else if (word == "count")
+				r.count = n;
+			else if (word == "seed")
+				r.seed(n);
+			else
+				ok = false;
+		}
+		if (!ok || r.start > r.end || (exfail && (r.access & FaultRule::FETCH))) {
+			err = "expected \"<cycle> fault|exfail <start> <end> [read] [write] [fetch] [port <n>] "
+				"[nth <n>] [count <n>] [prob <p>] [seed <n>]\" (no fetch for exfail)";
+			return false;
+		}
+		if (!r.access)
+			r.access = exfail ? FaultRule::READ | FaultRule::WRITE : FaultRule::ALL;
+		add(cycle, StimulusEvent::FAULT, fault_rules.size(), true);
+		fault_rules.push_back(r);
+		return true;
+	}
+
+	// An unsigned number, in decimal, hex (0x) or octal (0), up to max
+	static bool parse_u64(const std::string &x, uint64_t max, uint64_t &v) {
+		if (x.empty() || !isdigit((unsigned char)x[0]))
+			return false;
+		char *end;
+		errno = 0;
+		v = strtoull(x.c_str(), &end, 0);
+		return *end == 0 && errno == 0 && v <= max;
+	}
+
+	std::priority_queue<StimulusEvent, std::vector<StimulusEvent>, std::greater<StimulusEvent>> queue;
+	uint64_t seq;
+	uint64_t rng;
+	uint64_t random_interval;
+	uint32_t random_mask;
+
+	// Uniform in 1 to n
+	uint64_t next_random(uint64_t n) {
+		rng ^= rng >> 12;
+		rng ^= rng << 25;
+		rng ^= rng >> 27;
+		return (rng * 0x2545f4914f6cdd1dull >> 32) % n + 1;
+	}
+
+	uint32_t random_line() {
+		uint32_t k = next_random(__builtin_popcount(random_mask)) - 1;
+		uint32_t mask = random_mask;
+		for (; k > 0; --k)
+			mask &= mask - 1;
+		return __builtin_ctz(mask);
+	}
+};
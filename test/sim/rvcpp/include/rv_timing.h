@@ -0,0 +1,91 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "rv_decode.h"
+#include "rv_icache.h"
+#include "rv_trace.h"
+#include "rv_types.h"
+
+// Hazard3 configuration parameters which affect cycle counts. Defaults match
+// tb_cxxrtl/config_default.vh, and load() reads the same file format.
+struct TimingConfig {
+	bool reduced_bypass = false;
+	uint muldiv_unroll = 2;
+	bool mul_fast = true;
+	bool mul_faster = true;
+	bool mulh_fast = true;
+	bool branch_predictor = true;
+
+	// Read `localparam NAME = value;` lines, ignoring parameters which
+	// don't affect timing. On failure, returns false and sets `err`.
+	bool load(const std::string &path, std::string &err);
+};
+
+// Cycle-approximate model of the Hazard3 pipeline, as a trace sink: each
+// step() record is costed as it arrives, and then passed on to `next` (if
+// any). Modelled:
+//
+// - Register dependencies, through a per-register ready time: load-use
+//   (and fast-multiply-use, without MUL_FASTER) costs 1 cycle, except for
+//   store data. With REDUCED_BYPASS, any dependency on the previous two
+//   instructions stalls until the result is written back.
+// - Taken jumps and branches cost 1 cycle, plus 1 if the target is a 32-bit
+//   instruction which is not word-aligned, as the frontend then needs two
+//   fetches. With the single-entry BTB, a predicted taken branch is free
+//   and a mispredicted one costs the same as an unpredicted taken branch.
+// - Sequential multiply/divide at MULDIV_UNROLL bits per cycle, including
+//   the sign correction cycle.
+// - AMOs, Zcmp push/pop, back-to-back exclusives and trap entry.
+//
+// The fetch buffer is otherwise assumed to keep up, which holds for the
+// dual-ported tb_cxxrtl with zero-wait-state memory. Bus wait states are not
+// modelled. The model is experimental: no comparison against tb_cxxrtl has
+// been recorded yet (../common/ubench_calibrate.py makes one). With an `icache` (for
+// --xip), a fetch which misses stalls issue by the miss penalty, which is
+// not hidden by prefetch.
+struct TimingModel: TraceSink {
+	TimingConfig cfg;
+	// Registers of the core being modelled (read for divide signs). These
+	// still hold the operand values when the step's record is emitted.
+	const ux_t *regs;
+	TraceSink *next;
+	XipCache *icache = nullptr;
+
+	uint64_t cycles = 0;
+	uint64_t instrs = 0;
+
+	TimingModel(const TimingConfig &cfg_, const ux_t *regs_, TraceSink *next_=nullptr):
+		cfg(cfg_), regs(regs_), next(next_) {
+		reg_ready.fill(0);
+		reg_ready_store_data.fill(0);
+	}
+
+	virtual void record(const TraceRecord &t);
+
+	virtual void message(const char *text, size_t len) {
+		if (next)
+			next->message(text, len);
+	}
+
+	void print_summary(FILE *f, uint hartid) const;
+
+private:
+	// Earliest cycle at which each register can be consumed in stage 2. Store
+	// data is consumed in stage 3, so may be one cycle earlier.
+	std::array<uint64_t, 32> reg_ready;
+	std::array<uint64_t, 32> reg_ready_store_data;
+	bool prev_exclusive = false;
+	bool redirected = false;
+	bool btb_valid = false;
+	ux_t btb_pc = 0;
+	ux_t fetch_word = ~(ux_t)0;
+
+	void instr(const TraceRecord &t);
+	void trap_entry();
+	uint muldiv_seq_cycles(const RVDecodedInstr &d) const;
+	void write_rd(uint rd, uint64_t ready, uint64_t ready_store_data);
+};
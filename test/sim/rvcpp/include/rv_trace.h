@@ -0,0 +1,171 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rv_types.h"
+
+// Execution trace of one step() of a core. The text trace is rendered from
+// these records, and the binary trace is an encoding of them.
+struct TraceRecord {
+	enum {
+		INSTR = 0x01, // An instruction was executed (or failed to fetch)
+		RD    = 0x02, // ...with a GPR writeback
+		PCW   = 0x04, // ...with an explicit pc write (jump, branch, WFI stall)
+		CSR   = 0x08, // ...with a CSR write
+		TRAP  = 0x10, // Exception was taken
+		IRQ   = 0x20, // IRQ was taken, in place of an instruction
+		PRIV  = 0x40  // Privilege level was changed
+	};
+
+	uint flags = 0;
+	ux_t pc = 0;
+	uint32_t instr = 0;
+	uint rd = 0;
+	ux_t rd_wdata = 0;
+	ux_t pc_wdata = 0;
+	uint16_t csr_addr = 0;
+	ux_t csr_wdata = 0;
+	uint cause = 0;
+	ux_t trap_pc = 0;
+	uint priv = 0;
+};
+
+// Print a record in the rvcpp --trace text format
+void trace_render_text(FILE *f, const TraceRecord &t);
+
+struct TraceSink {
+	virtual ~TraceSink() {}
+	virtual void record(const TraceRecord &t) = 0;
+	// Other output which is interleaved with the trace, e.g. from IO
+	virtual void message(const char *text, size_t len) = 0;
+};
+
+struct TextTraceSink: TraceSink {
+	FILE *out;
+
+	TextTraceSink(FILE *out_=stdout): out(out_) {}
+
+	virtual void record(const TraceRecord &t) {
+		trace_render_text(out, t);
+	}
+
+	virtual void message(const char *text, size_t len) {
+		fwrite(text, 1, len, out);
+	}
+};
+
+// Passes on the records of one hart to the trace output while tracing is
+// on, in the pc range (for an IRQ entry, its target) and at an enabled
+// privilege level (of the instruction, not of any trap it takes). Messages are always passed on. With a ring of
+// last_n records, the records filtered out since the last one passed on are
+// kept, and dumped on an exception trap or by dump(), e.g. at exit.
+struct TraceGate: TraceSink {
+	TraceSink *next;
+	bool on;
+	// Instructions from pc_lo up to, but not including, pc_hi, if pc_range
+	bool pc_range;
+	ux_t pc_lo, pc_hi;
+	// Bit n for privilege level n
+	uint priv_mask;
+	// Privilege level of the next instruction
+	uint priv;
+
+	TraceGate(TraceSink *next_, size_t last_n): next(next_), on(true), pc_range(false), pc_lo(0), pc_hi(0),
+		priv_mask(0xfu), priv(3), ring(last_n), ring_next(0), ring_count(0) {}
+
+	virtual void record(const TraceRecord &t);
+
+	virtual void message(const char *text, size_t len) {
+		next->message(text, len);
+	}
+
+	// Pass on the ring's records, oldest first, after a line saying why
+	void dump(const char *why);
+
+private:
+	std::vector<TraceRecord> ring;
+	size_t ring_next;
+	size_t ring_count;
+};
+
+// Binary trace format: the magic string, then a sequence of records, each
+// starting with a flags byte:
+//
+// - 0x80: message: varint length, then that many bytes of text
+// - Otherwise, TraceRecord flags, followed by fields for each flag present:
+//   - INSTR: zigzag varint of (pc - expected pc), then the instruction as
+//     2 or 4 little-endian bytes, depending on its two LSBs. The expected
+//     pc is where the previous record left the core (or 0 for the first).
+//   - RD: register number (1 byte), value (4 bytes)
+//   - PCW: zigzag varint of (new pc - pc)
+//   - CSR: address (2 bytes), value (4 bytes)
+//   - TRAP or IRQ: varint cause, then the trap target pc (4 bytes)
+//   - PRIV: new privilege level (1 byte)
+//
+// Output is buffered, and written out by a background thread. If the path
+// ends in .zst, the output is piped through an external zstd process.
+struct BinaryTraceWriter: TraceSink {
+	static constexpr const char *MAGIC = "RVTRACE1";
+	static const uint8_t MESSAGE = 0x80;
+	static const size_t BUF_SIZE = 1u << 20;
+
+	BinaryTraceWriter() {}
+	~BinaryTraceWriter();
+
+	// Returns false on failure to open the output
+	bool open(const std::string &path);
+	// Flush all output and wait for the background thread. Returns false on
+	// write error.
+	bool close();
+
+	virtual void record(const TraceRecord &t);
+	virtual void message(const char *text, size_t len);
+
+private:
+	FILE *out = nullptr;
+	bool is_pipe = false;
+	bool write_error = false;
+	ux_t next_pc = 0;
+
+	std::vector<uint8_t> buf;
+	std::vector<uint8_t> pending;
+	bool have_pending = false;
+	bool done = false;
+	std::mutex lock;
+	std::condition_variable cv;
+	std::thread writer;
+
+	void put_u8(uint8_t x) {
+		buf.push_back(x);
+	}
+
+	void put_u16(uint16_t x) {
+		put_u8(x);
+		put_u8(x >> 8);
+	}
+
+	void put_u32(uint32_t x) {
+		put_u16(x);
+		put_u16(x >> 16);
+	}
+
+	void put_varint(uint32_t x) {
+		while (x >= 0x80) {
+			put_u8(x | 0x80);
+			x >>= 7;
+		}
+		put_u8(x);
+	}
+
+	void put_delta(ux_t x) {
+		put_varint((x << 1) ^ (ux_t)((sx_t)x >> 31));
+	}
+
+	void hand_off();
+	void writer_thread();
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+// C API for embedding rvcpp in another simulator, or calling it from another
+// language through an FFI. Build librvcpp.so with `make lib`. Everything
+// here is plain C, and the handle is opaque, so the ABI doesn't depend on
+// rvcpp's C++ internals.
+//
+// A hart is created with a single flat RAM, to which it has direct access;
+// further RAM and MMIO regions can be added to its memory map. rvcpp_run()
+// executes a batch of instructions in one call, from pre-decoded blocks where
+// possible, and returns when the batch is done or some event stops it, so
+// the caller only crosses the API boundary for MMIO, IRQ changes and
+// events, not for every instruction.
+//
+// Calls on one hart must not overlap, except that the MMIO and retire
+// callbacks may call rvcpp_stop(), rvcpp_set_irqs(), rvcpp_get_pc() and
+// rvcpp_get_reg() on the hart which called them. Different harts are
+// independent, and can run on different threads.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct rvcpp_hart rvcpp_hart;
+
+// Why rvcpp_run() returned
+enum rvcpp_event {
+	RVCPP_EVENT_NONE       = 0, // Ran the whole batch
+	RVCPP_EVENT_EXIT       = 1, // Exit request, through tohost or the testbench IO
+	RVCPP_EVENT_BREAKPOINT = 2, // pc reached a breakpoint (which is not yet executed)
+	RVCPP_EVENT_WFI        = 3, // Asleep in WFI, with no IRQ to wake it
+	RVCPP_EVENT_STOP       = 4  // rvcpp_stop() was called from a callback
+};
+
+// MMIO callbacks. offset is from the base of the region, size is 1, 2 or 4
+// bytes, and data is right-justified. Return 0 on success, or nonzero for a
+// bus fault.
+typedef int (*rvcpp_mmio_read_fn)(void *ctx, uint32_t offset, unsigned size, uint32_t *data);
+typedef int (*rvcpp_mmio_write_fn)(void *ctx, uint32_t offset, unsigned size, uint32_t data);
+
+// Called after each instruction (trap is nonzero if it took an exception).
+// While set, rvcpp_run() single-steps.
+typedef void (*rvcpp_retire_fn)(void *ctx, uint32_t pc, uint32_t instr, int trap);
+
+// Create a hart with ram_size bytes of RAM at ram_base (both word-aligned),
+// zero-initialised, starting from reset_vector. Returns NULL on failure.
+rvcpp_hart *rvcpp_create(uint32_t ram_base, uint32_t ram_size, uint32_t reset_vector);
+void rvcpp_destroy(rvcpp_hart *h);
+
+// The hart's RAM, little-endian. Writes through this pointer must be
+// followed by rvcpp_flush_code() if they may overwrite code which has run.
+uint8_t *rvcpp_ram(rvcpp_hart *h, uint32_t *size);
+void rvcpp_flush_code(rvcpp_hart *h);
+
+// Add a region to the memory map. Regions added first take precedence, and
+// the hart's own RAM takes precedence over all of them. rvcpp_add_ram()
+// returns the new region's storage, or NULL on failure.
+int rvcpp_add_mmio(rvcpp_hart *h, uint32_t base, uint32_t size,
+	rvcpp_mmio_read_fn read, rvcpp_mmio_write_fn write, void *ctx);
+uint8_t *rvcpp_add_ram(rvcpp_hart *h, uint32_t base, uint32_t size, int read_only);
+// Add the rvcpp/tb_cxxrtl testbench IO (print, exit, mtime/mtimecmp and
+// IRQ registers) at base. Its output goes to stdout. mtime then advances
+// by one per instruction, and the IRQ inputs are the OR of the testbench
+// IO's and those set with rvcpp_set_irqs().
+int rvcpp_add_tbio(rvcpp_hart *h, uint32_t base);
+
+// Load an ELF file into the hart's RAM, set pc to its entry point, and use
+// its `tohost` symbol (if any) as the exit address. Returns 0 on success.
+int rvcpp_load_elf(rvcpp_hart *h, const char *path);
+// Implement the extensions, U-mode and PMP regions of a Hazard3 config
+// header, e.g. tb_cxxrtl/config_min.vh (default: all of tb_cxxrtl's default
+// config). Call before running the hart. Returns 0 on success.
+int rvcpp_load_config(rvcpp_hart *h, const char *path);
+// A 32-bit store with bit 0 set to this address requests an exit, with exit
+// code data >> 1, following the riscv-tests convention
+void rvcpp_set_tohost(rvcpp_hart *h, uint32_t addr);
+
+// Execute up to max_instrs instructions (a cycle asleep in WFI counts as
+// one), and return the number executed. *event, if not NULL, is set to the
+// reason for returning.
+uint64_t rvcpp_run(rvcpp_hart *h, uint64_t max_instrs, int *event);
+// Exit code of the last RVCPP_EVENT_EXIT
+int rvcpp_exit_code(rvcpp_hart *h);
+// From a callback: end rvcpp_run() once the current instruction completes
+void rvcpp_stop(rvcpp_hart *h);
+// Run from a cache of pre-decoded basic blocks (default off)
+void rvcpp_set_block_cache(rvcpp_hart *h, int enable);
+
+uint32_t rvcpp_get_pc(rvcpp_hart *h);
+void rvcpp_set_pc(rvcpp_hart *h, uint32_t pc);
+uint32_t rvcpp_get_reg(rvcpp_hart *h, unsigned regnum);
+void rvcpp_set_reg(rvcpp_hart *h, unsigned regnum, uint32_t value);
+// CSR accesses, at the hart's current privilege level, without side
+// effects on reads. Return 0 on success, nonzero if the CSR doesn't exist
+// or is not accessible.
+int rvcpp_read_csr(rvcpp_hart *h, uint16_t addr, uint32_t *data);
+int rvcpp_write_csr(rvcpp_hart *h, uint16_t addr, uint32_t data);
+
+// IRQ inputs: external IRQ lines 0 to 31, and the timer and software IRQs.
+// Applied between blocks, as though written through the testbench IO.
+void rvcpp_set_irqs(rvcpp_hart *h, uint32_t external, int timer, int soft);
+
+void rvcpp_add_breakpoint(rvcpp_hart *h, uint32_t addr);
+void rvcpp_remove_breakpoint(rvcpp_hart *h, uint32_t addr);
+void rvcpp_set_retire_callback(rvcpp_hart *h, rvcpp_retire_fn fn, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,14 +1,35 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <cstdio>
-#include <iostream>
+#include <fcntl.h>
 #include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <sstream>
 #include <tuple>
+#include <unistd.h>
 #include <vector>
 
 #include "rv_types.h"
+#include "rv_config.h"
+#include "rv_codecov.h"
 #include "rv_csr.h"
+#include "rv_csrprof.h"
 #include "rv_core.h"
+#include "rv_elf.h"
+#include "rv_gdb.h"
 #include "rv_mem.h"
+#include "rv_profile.h"
+#include "rv_roi.h"
+#include "rv_snapshot.h"
+#include "rv_stats.h"
+#include "rv_stimulus.h"
+#include "rv_timing.h"
+#include "encoding/rv_csr.h"
 
 // Minimal RISC-V interpreter, supporting:
 // - RV32I
@@ -25,129 +46,1698 @@
 
 #define RAM_SIZE_DEFAULT (16u * (1u << 20))
 #define RAM_BASE         0u
-#define IO_BASE          0x80000000u
-#define TBIO_BASE        (IO_BASE + 0x0000)
 
 const char *help_str =
 "Usage: tb [--bin x.bin] [--dump start end] [--vcd x.vcd] [--cycles n]\n"
 "    --bin x.bin      : Flat binary file loaded to address 0x0 in RAM\n"
+"    --elf x.elf      : ELF file loaded into RAM. The entry point is used as the\n"
+"                       reset vector, and a `tohost` symbol, if present, is used\n"
+"                       to exit as in riscv-tests.\n"
+"    --fast-boot      : Tell software, through IO_FAST_BOOT, that the --bin or\n"
+"                       --elf file was loaded with .data in place and .bss\n"
+"                       zeroed, so that common/init.S skips clearing .bss\n"
 "    --vcd x.vcd      : Dummy option for compatibility with CXXRTL tb\n"
 "    --dump start end : Print out memory contents between start and end (exclusive)\n"
 "                       after execution finishes. Can be passed multiple times.\n"
+"    --dump-check start end x\n"
+"                     : As --expect, and x must be end - start bytes long\n"
+"    --dump-bin start end x\n"
+"                     : Write memory contents between start and end (exclusive)\n"
+"                       to binary file x after execution finishes. Can be passed\n"
+"                       multiple times.\n"
+"    --expect start x : Compare memory from start onwards with binary file x\n"
+"                       after execution finishes, and fail (return code -1, and\n"
+"                       \"dump_check\": false with --batch) if they differ.\n"
+"                       Can be passed multiple times.\n"
+"    --signature x    : Write memory from the --elf file's begin_signature to\n"
+"                       end_signature symbols to binary file x after execution\n"
+"                       finishes, for riscv-arch-test.\n"
 "    --cycles n       : Maximum number of cycles to run before exiting.\n"
 "    --cpuret         : Testbench's return code is the return code written to\n"
-"                       IO_EXIT by the CPU, or -1 if timed out.\n"
+"                       IO_EXIT by the CPU, -1 if timed out, or -2 if hung.\n"
+"    --no-hang-detect : Keep running until --cycles when the hart is hung, i.e.\n"
+"                       asleep in WFI or on a jump to itself, with no IRQ that\n"
+"                       could be taken and no stimulus events to come. Hangs\n"
+"                       are only detected with one hart, and not with --gdb\n"
+"                       or while a --save-state is pending.\n"
 "    --memsize n      : Memory size in units of 1024 bytes, default is 16 MiB\n"
 "    --trace          : Print out execution tracing info\n"
+"    --trace-bin x    : Write execution tracing info to file x in binary format,\n"
+"                       compressed with zstd if x ends in .zst. Convert to text\n"
+"                       with scripts/rvtrace.py.\n"
+"    --trace-from-cycle n\n"
+"                     : Only trace from cycle n on. Runs in blocks until then.\n"
+"    --trace-pc-range lo hi\n"
+"                     : Only trace instructions from lo up to (not including) hi\n"
+"    --trace-priv x   : Only trace instructions at the privilege levels in x, one\n"
+"                       or more of U and M\n"
+"    --trace-io       : Start with the trace off, until software writes a nonzero\n"
+"                       value to IO_TRACE. Writing zero turns it off again, with\n"
+"                       or without this.\n"
+"    --trace-last n   : Keep the last n steps left out of the trace by the\n"
+"                       options above, and write them out before an exception\n"
+"                       trap, and at exit. Without --trace or --trace-bin, only\n"
+"                       these are printed.\n"
+"    --config x       : Implement the extensions, counters, U-mode, PMP regions\n"
+"                       and breakpoint triggers of Hazard3 config header x, e.g.\n"
+"                       ../tb_cxxrtl/config_min.vh\n"
+"                       (default: all of tb_cxxrtl's default config)\n"
+"    --hpm-events     : Count rvcpp's own events in mhpmcounter3...31, selected\n"
+"                       by mhpmevent3...31. Hazard3 hardwires these to zero,\n"
+"                       as rvcpp does by default.\n"
+"    --timing         : Estimate Hazard3 cycle counts with a pipeline timing model,\n"
+"                       and print the estimated CPI at exit (and hart 0's cycles\n"
+"                       for each region of interest). Runs single-stepped.\n"
+"                       Experimental: the model has not been checked against\n"
+"                       tb_cxxrtl (see ../common/ubench_calibrate.py), and\n"
+"                       does not model bus wait states.\n"
+"    --timing-config x: As --timing, with the timing-related parameters read from\n"
+"                       a Hazard3 config header x (default: tb_cxxrtl's defaults)\n"
+"    --xip start end flash fill\n"
+"                     : As --timing, with fetches from start to end (exclusive)\n"
+"                       through an instruction cache per hart, modelling\n"
+"                       execute-in-place flash as tb_cxxrtl's --xip does: a\n"
+"                       miss stalls for flash + fill cycles. Hit rates are\n"
+"                       printed at exit.\n"
+"    --icache ways sets line\n"
+"                     : Geometry of the --xip cache, with line in bytes\n"
+"                       (default: 2 64 16, for 2 KiB)\n"
+"    --stats          : Count retired instructions by op and extension, taken\n"
+"                       branches and register usage, and print them at exit.\n"
+"                       Runs single-stepped.\n"
+"    --csr-profile    : Count each hart's CSR reads and writes per CSR, and trap\n"
+"                       entries per cause and per pc, and print them at exit,\n"
+"                       ranked, to find hot spots in trap and IRQ handlers.\n"
+"                       Runs at full speed with --block-cache.\n"
+"    --power-stats    : Count each hart's cycles active and stalled in WFI, by\n"
+"                       the sleep state msleep selects (wfi, deep sleep or\n"
+"                       powered down), and its wakes by IRQ cause, and print\n"
+"                       them at exit. h3.block is not modelled, so no cycles\n"
+"                       are counted as sleep.\n"
+"    --power-stats-series x n\n"
+"                     : As --power-stats, and also write the counts for every\n"
+"                       window of n cycles to x, in CSV format. With more than\n"
+"                       one hart, windows end on --quantum boundaries.\n"
+"    --profile x      : Sample the pc every --profile-interval cycles, and write\n"
+"                       the profile to x in folded stack format (as used by\n"
+"                       flamegraph.pl), symbolised from the --elf file if any.\n"
+"                       Runs single-stepped. Only supported with one hart.\n"
+"    --profile-interval n\n"
+"                     : Cycles between profile samples, default 100\n"
+"    --profile-calls  : Track call stacks for --profile, from calls and returns\n"
+"    --heatmap x      : Count loads, stores and executed instructions per block of\n"
+"                       memory, and write the counts and the working-set curve\n"
+"                       (average blocks touched per window of n accesses) to x\n"
+"                       at exit. Not supported with --threads.\n"
+"    --heatmap-block n: Heatmap block size in bytes, a power of two from 4 to\n"
+"                       4096, default 64\n"
+"    --code-coverage x: Record which instructions of the --elf file execute, and\n"
+"                       which ways each conditional branch goes, and write them\n"
+"                       to x at exit as an lcov tracefile, by source line from\n"
+"                       the file's DWARF line info (so it must be built with -g).\n"
+"                       Counts are 1 if hit, so tracefiles from many runs merge\n"
+"                       with `lcov -a` into the number of runs which hit each\n"
+"                       line. Runs at full speed with --block-cache.\n"
+"    --roi            : Only trace, time, profile and count --stats, --csr-profile\n"
+"                       and --heatmap while software is in a region of interest\n"
+"                       (a nonzero value written to IO_ROI), and run in blocks\n"
+"                       outside them. Per-region cycle and instruction counts\n"
+"                       are printed at exit with or without this. Not supported\n"
+"                       with --threads or --gdb.\n"
+"    --semihost       : Handle RISC-V semihosting calls (console and host file\n"
+"                       I/O, clocks in simulated cycles, and exit), instead of\n"
+"                       trapping on their ebreak. Only supported with one hart,\n"
+"                       and not with --block-cache-check.\n"
+"    --record-inputs x: Record the results of semihosting's host calls (file\n"
+"                       reads, the console, the clock) to file x, stamped with\n"
+"                       the cycle they were made on\n"
+"    --replay-inputs x: Take semihosting's host call results from file x, as\n"
+"                       recorded by --record-inputs, instead of making the calls.\n"
+"                       Stops if the run diverges from the recorded one.\n"
+"    --stimulus x     : Set and clear IRQ inputs on the cycles scheduled in file x,\n"
+"                       one \"<cycle> irq|softirq|timer <n> <0|1>\" per line. The\n"
+"                       same file can be passed to tb_cxxrtl. Applied between\n"
+"                       quanta with --harts. \"fault\" and \"exfail\" lines arm\n"
+"                       bus fault injection rules (see rv_stimulus.h), with\n"
+"                       each hart as one port. Not supported with --threads.\n"
+"    --stimulus-random seed interval mask\n"
+"                     : Assert random external IRQs from mask, every 1 to\n"
+"                       2 * interval cycles, each held for 1 to interval cycles.\n"
+"                       A seed gives the same IRQs here and in tb_cxxrtl.\n"
+"    --block-cache    : Execute from a cache of pre-decoded basic blocks. No host\n"
+"                       code is generated.\n"
+"    --block-cache-check\n"
+"                     : As --block-cache, but also run a second core using the\n"
+"                       interpreter in lockstep, and stop if the two ever\n"
+"                       disagree.\n"
+"    --irqs n         : Number of external IRQs in the Xh3irq interrupt controller,\n"
+"                       1 to 512, default 32 (as tb_cxxrtl's default config).\n"
+"                       The testbench IO drives IRQs 0 to 31.\n"
+"    --harts n        : Number of harts sharing the memory map, default 1. Harts\n"
+"                       are interleaved deterministically, --quantum cycles at a time.\n"
+"    --quantum n      : Number of cycles each hart runs before moving to the next\n"
+"                       (and mtime advancing), default 1 (i.e. lockstep), or 10000\n"
+"                       with --threads\n"
+"    --threads        : Run each hart on its own host thread, synchronising after\n"
+"                       each quantum. Not deterministic.\n"
+"    --save-state x   : Save the state of the harts, IO and RAM to file x, once\n"
+"                       the first of the --save-* triggers is hit (or at the end\n"
+"                       of --cycles, if there are no triggers)\n"
+"    --save-arch x    : As --save-state, but save an architectural checkpoint of\n"
+"                       one hart (registers, CSRs, timer, IRQ inputs and RAM)\n"
+"                       to x and x.ram, for tb's --restore-arch. --config must\n"
+"                       match the RTL's configuration.\n"
+"    --save-cycle n   : Save state when the cycle count reaches n\n"
+"    --save-pc addr   : Save state when any hart's pc reaches addr (checked once\n"
+"                       per quantum with --harts). Runs single-stepped, so is\n"
+"                       slower than --save-cycle.\n"
+"    --save-io addr   : Save state after the first write to IO address addr\n"
+"    --restore-state x: Start from the state saved in file x, instead of reset.\n"
+"                       RAM is mapped copy-on-write from the file. The memory\n"
+"                       size and number of harts are taken from the file, and\n"
+"                       --cycles counts from the cycle when the state was saved.\n"
+"    --gdb port       : Wait for a GDB connection on localhost:port, and run under\n"
+"                       control of GDB, using its remote serial protocol. Only\n"
+"                       supported with one hart. --cycles is ignored.\n"
+"    --gdb-hw-breakpoints n\n"
+"                     : Number of hardware breakpoints available to GDB, default\n"
+"                       4 (as in tb_cxxrtl's default config)\n"
+"    --batch x        : Run each test listed in manifest file x in turn, in this\n"
+"                       process, with a fresh core and memory for each. Each line\n"
+"                       is a test name followed by its options (e.g. --bin and\n"
+"                       --dump-check), which are added to any other options on\n"
+"                       the command line; blank lines and lines starting with #\n"
+"                       are ignored. Per test, --log x sends the test's output to\n"
+"                       file x (default: stderr). One line of JSON results is\n"
+"                       written to stdout per test, in manifest order. A test\n"
+"                       with bad options fails, with the reason in \"error\".\n"
+"    --instances n    : With --batch, run up to n tests at once, on separate\n"
+"                       threads, default 1. Each test is an independent\n"
+"                       simulation with its own harts, IO and RAM (--bin files are\n"
+"                       mapped copy-on-write, so instances of the same binary share\n"
+"                       its unmodified pages). Output of a test without --log is\n"
+"                       written to stderr in one piece once it finishes.\n"
 ;
 
-void exit_help(std::string errtext = "") {
+[[noreturn]] void exit_help(std::string errtext = "") {
 	std::cerr << errtext << help_str;
 	exit(-1);
 }
 
-int main(int argc, char **argv) {
-	if (argc < 2)
-		exit_help();
+// Thrown by run() for bad options, so that in --batch only the test with the
+// bad options fails. A single run exits with the help text instead.
+struct UsageError {
+	std::string errtext;
+};
+
+[[noreturn]] static void usage_error(std::string errtext) {
+	throw UsageError{errtext};
+}
+
+// As std::stoll and std::stoull with any base, but a bad number is a
+// UsageError, not an exception which would end the process from a --batch
+// --instances worker thread
+static long long parse_signed(const char *arg) {
+	try {
+		return std::stoll(arg, 0, 0);
+	}
+	catch (std::logic_error &) {
+		usage_error("Bad number \"" + std::string(arg) + "\"\n");
+	}
+}
+
+static unsigned long long parse_unsigned(const char *arg) {
+	try {
+		return std::stoull(arg, 0, 0);
+	}
+	catch (std::logic_error &) {
+		usage_error("Bad number \"" + std::string(arg) + "\"\n");
+	}
+}
+
+// IO for the reference core in --block-cache-check mode. Output is
+// discarded, since the main core has already printed it.
+struct QuietTBMemIO: TBMemIO {
+	QuietTBMemIO(): TBMemIO(false) {}
+
+	virtual bool w32(ux_t addr, uint32_t data) {
+		if (addr == IO_PRINT_CHAR || addr == IO_PRINT_U32 || addr == IO_PRINT_LEN)
+			return true;
+		return TBMemIO::w32(addr, data);
+	}
+};
+
+// Passes each step of the core to the profiler, and then on to the next sink
+struct ProfileTraceSink: TraceSink {
+	Profiler &profiler;
+	TraceSink *next;
+	ux_t next_pc;
+
+	ProfileTraceSink(Profiler &profiler_, TraceSink *next_, ux_t reset_vector):
+		profiler(profiler_), next(next_), next_pc(reset_vector) {}
+
+	virtual void record(const TraceRecord &t) {
+		if (t.flags & TraceRecord::INSTR) {
+			profiler.tick(t.pc);
+			if (t.flags & TraceRecord::TRAP)
+				profiler.trap(t.pc);
+			else
+				profiler.retire(t.pc, t.instr);
+			next_pc = t.flags & TraceRecord::PCW ? t.pc_wdata : t.pc + ((t.instr & 0x3) == 0x3 ? 4 : 2);
+		} else {
+			profiler.tick(next_pc);
+			profiler.trap(next_pc);
+		}
+		if (t.flags & (TraceRecord::TRAP | TraceRecord::IRQ))
+			next_pc = t.trap_pc;
+		if (next)
+			next->record(t);
+	}
+
+	virtual void message(const char *text, size_t len) {
+		if (next)
+			next->message(text, len);
+	}
+};
+
+// Simple reusable barrier for --threads. The last thread to arrive runs
+// on_complete() before any thread is released.
+struct RoundBarrier {
+	std::mutex lock;
+	std::condition_variable cv;
+	uint n_threads;
+	uint waiting;
+	uint64_t generation;
+
+	RoundBarrier(uint n): n_threads(n), waiting(0), generation(0) {}
+
+	template <typename F>
+	void wait(F on_complete) {
+		std::unique_lock<std::mutex> guard(lock);
+		if (++waiting == n_threads) {
+			on_complete();
+			waiting = 0;
+			++generation;
+			cv.notify_all();
+		} else {
+			uint64_t gen = generation;
+			cv.wait(guard, [&] {return generation != gen;});
+		}
+	}
+};
+
+// Update a hart's IRQ inputs from the IO model
+static void update_irqs(RVCore &hart, TBMemIO &io) {
+	hart.csr.set_irq_t(io.timer_irq_pending(hart.hartid));
+	hart.csr.set_irq_s(io.soft_irq_pending(hart.hartid));
+	hart.csr.set_irq_e(io.irq);
+}
+
+// Apply a scheduled stimulus event to the IO model's IRQ state, or arm a
+// fault rule
+static void apply_stimulus(TBMemIO &io, const Stimulus &stimulus, const StimulusEvent &e) {
+	if (e.type == StimulusEvent::FAULT) {
+		io.faults.arm(stimulus.fault_rules[e.index]);
+		return;
+	}
+	uint32_t &bits = e.type == StimulusEvent::SOFTIRQ ? io.softirq :
+		e.type == StimulusEvent::TIMER ? io.timer_force : io.irq;
+	if (e.level)
+		bits |= 1u << e.index;
+	else
+		bits &= ~(1u << e.index);
+}
+
+// Run one hart for one quantum. IO state is frozen for the quantum, except
+// for changes made by the harts themselves, so IRQ inputs are updated from
+// the IO model between blocks. If io_lock is set, the IO model is shared with
+// harts on other threads.
+void run_quantum(RVCore &hart, TBMemIO &io, int64_t quantum, bool single_step, bool trace,
+		std::mutex *io_lock=nullptr, std::atomic<bool> *stop=nullptr) {
+	RVCore::StepFn step = hart.step_fn(trace);
+	for (int64_t i = 0; i < quantum && !(stop && *stop);) {
+		{
+			std::unique_lock<std::mutex> guard;
+			if (io_lock)
+				guard = std::unique_lock<std::mutex>(*io_lock);
+			update_irqs(hart, io);
+		}
+		if (single_step || (io_lock && hart.stalled_on_wfi)) {
+			// (With threads, a sleeping hart can be woken by another hart
+			// at any time, so keeps checking its IRQ inputs)
+			(hart.*step)();
+			++i;
+		} else {
+			i += hart.run_block(quantum - i);
+		}
+	}
+}
+
+// Returns false, and prints the differences, if the two cores disagree
+bool compare_lockstep(RVCore &core, RVCore &ref, int64_t cyc, FILE *out) {
+	if (core.pc == ref.pc && core.regs == ref.regs)
+		return true;
+	fprintf(out, "Block cache mismatch after %ld cycles:\n", cyc);
+	fprintf(out, "pc : %08x (interpreter: %08x)\n", core.pc, ref.pc);
+	for (int i = 1; i < 32; ++i) {
+		if (core.regs[i] != ref.regs[i])
+			fprintf(out, "x%-2d: %08x (interpreter: %08x)\n", i, core.regs[i], ref.regs[i]);
+	}
+	return false;
+}
+
+// Outcome of one run, for --batch
+struct RunResult {
+	std::optional<int> exit_code;
+	int64_t cycles = 0;
+	// Also set if hung, i.e. stopped early as the run could only time out
+	bool timed_out = false;
+	bool hung = false;
+	bool dump_check_pass = true;
+	// Why the test couldn't run, e.g. bad options
+	std::string error;
+};
+
+// Returns the process exit code for a single run, or throws UsageError for
+// bad options. All of the run's output (other than errors, on stderr) goes to
+// `out`, so runs on different threads don't interfere.
+int run(int argc, char **argv, RunResult &result, FILE *out=stdout) {
 
 	std::vector<std::tuple<uint32_t, uint32_t>> dump_ranges;
+	std::vector<std::tuple<uint32_t, uint32_t, std::string>> dump_bins;
+	// --expect and --dump-check: start, end if given (else the file's size), file
+	std::vector<std::tuple<uint32_t, std::optional<uint32_t>, std::string>> expects;
+	std::string signature_path;
 	int64_t max_cycles = 100000;
 	uint32_t ram_size = RAM_SIZE_DEFAULT;
 	bool load_bin = false;
 	std::string bin_path;
+	bool load_elf = false;
+	std::string elf_path;
+	bool fast_boot = false;
 	bool trace_execution = false;
+	std::string trace_bin_path;
+	int64_t trace_from_cycle = 0;
+	std::optional<std::pair<ux_t, ux_t>> trace_pc_range;
+	uint trace_priv_mask = 0xfu;
+	bool trace_io = false;
+	size_t trace_last = 0;
 	bool propagate_return_code = false;
+	bool hang_detect = true;
+	bool block_cache = false;
+	bool block_cache_check = false;
+	uint n_harts = 1;
+	uint num_irqs = 32;
+	int64_t quantum = 0;
+	bool threads = false;
+	std::string save_path;
+	std::string save_arch_path;
+	std::string restore_path;
+	std::optional<int64_t> save_cycle;
+	std::optional<ux_t> save_pc;
+	std::optional<ux_t> save_io;
+	bool timing = false;
+	TimingConfig timing_cfg;
+	XipCacheConfig xip_cfg;
+	RVConfig isa_cfg;
+	uint16_t gdb_port = 0;
+	uint gdb_hw_breakpoints = 4;
+	bool stats = false;
+	bool csr_profile_en = false;
+	bool power_stats_en = false;
+	std::string power_series_path;
+	int64_t power_series_window = 0;
+	bool roi_gate = false;
+	std::string profile_path;
+	uint64_t profile_interval = 100;
+	bool profile_calls = false;
+	std::string heatmap_path;
+	uint heatmap_block = 64;
+	std::string codecov_path;
+	bool semihost_en = false;
+	std::string record_inputs_path;
+	std::string replay_inputs_path;
+	Stimulus stimulus;
+	std::optional<std::tuple<uint64_t, uint64_t, uint32_t>> stimulus_random;
 
 	for (int i = 1; i < argc; ++i) {
 		std::string s(argv[i]);
 		if (s == "--bin") {
 			if (argc - i < 2)
-				exit_help("Option --bin requires an argument\n");
+				usage_error("Option --bin requires an argument\n");
 			load_bin = true;
 			bin_path = argv[i + 1];
 			i += 1;
 		}
+		else if (s == "--elf") {
+			if (argc - i < 2)
+				usage_error("Option --elf requires an argument\n");
+			load_elf = true;
+			elf_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--fast-boot") {
+			fast_boot = true;
+		}
 		else if (s == "--vcd") {
 			if (argc - i < 2)
-				exit_help("Option --vcd requires an argument\n");
+				usage_error("Option --vcd requires an argument\n");
 			// (We ignore this argument, it's supported for
 			i += 1;
 		}
 		else if (s == "--dump") {
 			if (argc - i < 3)
-				exit_help("Option --dump requires 2 arguments\n");
+				usage_error("Option --dump requires 2 arguments\n");
 			dump_ranges.push_back(std::make_tuple(
-				std::stoul(argv[i + 1], 0, 0),
-				std::stoul(argv[i + 2], 0, 0)
+				parse_unsigned(argv[i + 1]),
+				parse_unsigned(argv[i + 2])
 			));
 			i += 2;
 		}
+		else if (s == "--dump-check") {
+			if (argc - i < 4)
+				usage_error("Option --dump-check requires 3 arguments\n");
+			expects.push_back(std::make_tuple(
+				parse_unsigned(argv[i + 1]),
+				parse_unsigned(argv[i + 2]),
+				std::string(argv[i + 3])
+			));
+			i += 3;
+		}
+		else if (s == "--dump-bin") {
+			if (argc - i < 4)
+				usage_error("Option --dump-bin requires 3 arguments\n");
+			dump_bins.push_back(std::make_tuple(
+				parse_unsigned(argv[i + 1]),
+				parse_unsigned(argv[i + 2]),
+				std::string(argv[i + 3])
+			));
+			i += 3;
+		}
+		else if (s == "--expect") {
+			if (argc - i < 3)
+				usage_error("Option --expect requires 2 arguments\n");
+			expects.push_back(std::make_tuple(parse_unsigned(argv[i + 1]), std::nullopt, std::string(argv[i + 2])));
+			i += 2;
+		}
+		else if (s == "--signature") {
+			if (argc - i < 2)
+				usage_error("Option --signature requires an argument\n");
+			signature_path = argv[i + 1];
+			i += 1;
+		}
 		else if (s == "--cycles") {
 			if (argc - i < 2)
-				exit_help("Option --cycles requires an argument\n");
-			max_cycles = std::stol(argv[i + 1], 0, 0);
+				usage_error("Option --cycles requires an argument\n");
+			max_cycles = parse_signed(argv[i + 1]);
 			i += 1;
 		}
 		else if (s == "--memsize") {
 			if (argc - i < 2)
-				exit_help("Option --memsize requires an argument\n");
-			ram_size = 1024 * std::stol(argv[i + 1], 0, 0);
+				usage_error("Option --memsize requires an argument\n");
+			ram_size = 1024 * parse_signed(argv[i + 1]);
 			i += 1;
 		}
 		else if (s == "--trace") {
 			trace_execution = true;
 		}
+		else if (s == "--trace-bin") {
+			if (argc - i < 2)
+				usage_error("Option --trace-bin requires an argument\n");
+			trace_execution = true;
+			trace_bin_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--trace-from-cycle") {
+			if (argc - i < 2)
+				usage_error("Option --trace-from-cycle requires an argument\n");
+			trace_from_cycle = parse_signed(argv[i + 1]);
+			i += 1;
+		}
+		else if (s == "--trace-pc-range") {
+			if (argc - i < 3)
+				usage_error("Option --trace-pc-range requires 2 arguments\n");
+			trace_pc_range = std::make_pair((ux_t)parse_unsigned(argv[i + 1]), (ux_t)parse_unsigned(argv[i + 2]));
+			if (trace_pc_range->first >= trace_pc_range->second)
+				usage_error("--trace-pc-range must have lo below hi\n");
+			i += 2;
+		}
+		else if (s == "--trace-priv") {
+			if (argc - i < 2)
+				usage_error("Option --trace-priv requires an argument\n");
+			trace_priv_mask = 0;
+			for (const char *c = argv[i + 1]; *c; ++c) {
+				if (*c == 'U' || *c == 'u')
+					trace_priv_mask |= 1u << PRV_U;
+				else if (*c == 'M' || *c == 'm')
+					trace_priv_mask |= 1u << PRV_M;
+				else
+					usage_error("--trace-priv takes one or more of U and M\n");
+			}
+			if (!trace_priv_mask)
+				usage_error("--trace-priv takes one or more of U and M\n");
+			i += 1;
+		}
+		else if (s == "--trace-io") {
+			trace_io = true;
+		}
+		else if (s == "--trace-last") {
+			if (argc - i < 2)
+				usage_error("Option --trace-last requires an argument\n");
+			trace_last = parse_unsigned(argv[i + 1]);
+			if (trace_last < 1)
+				usage_error("--trace-last must be at least 1\n");
+			i += 1;
+		}
 		else if (s == "--cpuret") {
 			propagate_return_code = true;
 		}
+		else if (s == "--no-hang-detect") {
+			hang_detect = false;
+		}
+		else if (s == "--config") {
+			if (argc - i < 2)
+				usage_error("Option --config requires an argument\n");
+			std::string err;
+			if (!isa_cfg.load(argv[i + 1], err)) {
+				std::cerr << err << "\n";
+				return -1;
+			}
+			i += 1;
+		}
+		else if (s == "--hpm-events") {
+			isa_cfg.hpm_events = true;
+		}
+		else if (s == "--timing") {
+			timing = true;
+		}
+		else if (s == "--timing-config") {
+			if (argc - i < 2)
+				usage_error("Option --timing-config requires an argument\n");
+			std::string err;
+			if (!timing_cfg.load(argv[i + 1], err)) {
+				std::cerr << err << "\n";
+				return -1;
+			}
+			timing = true;
+			i += 1;
+		}
+		else if (s == "--xip") {
+			if (argc - i < 5)
+				usage_error("Option --xip requires 4 arguments\n");
+			if (const char *err = parse_xip(argv + i + 1, xip_cfg))
+				usage_error(err);
+			timing = true;
+			i += 4;
+		}
+		else if (s == "--icache") {
+			if (argc - i < 4)
+				usage_error("Option --icache requires 3 arguments\n");
+			if (const char *err = parse_icache(argv + i + 1, xip_cfg))
+				usage_error(err);
+			i += 3;
+		}
+		else if (s == "--stats") {
+			stats = true;
+		}
+		else if (s == "--csr-profile") {
+			csr_profile_en = true;
+		}
+		else if (s == "--power-stats") {
+			power_stats_en = true;
+		}
+		else if (s == "--power-stats-series") {
+			if (argc - i < 3)
+				usage_error("Option --power-stats-series requires 2 arguments\n");
+			power_stats_en = true;
+			power_series_path = argv[i + 1];
+			power_series_window = parse_signed(argv[i + 2]);
+			if (power_series_window < 1)
+				usage_error("--power-stats-series window must be at least 1 cycle\n");
+			i += 2;
+		}
+		else if (s == "--roi") {
+			roi_gate = true;
+		}
+		else if (s == "--profile") {
+			if (argc - i < 2)
+				usage_error("Option --profile requires an argument\n");
+			profile_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--profile-interval") {
+			if (argc - i < 2)
+				usage_error("Option --profile-interval requires an argument\n");
+			profile_interval = parse_unsigned(argv[i + 1]);
+			i += 1;
+		}
+		else if (s == "--profile-calls") {
+			profile_calls = true;
+		}
+		else if (s == "--heatmap") {
+			if (argc - i < 2)
+				usage_error("Option --heatmap requires an argument\n");
+			heatmap_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--heatmap-block") {
+			if (argc - i < 2)
+				usage_error("Option --heatmap-block requires an argument\n");
+			heatmap_block = parse_unsigned(argv[i + 1]);
+			i += 1;
+		}
+		else if (s == "--code-coverage") {
+			if (argc - i < 2)
+				usage_error("Option --code-coverage requires an argument\n");
+			codecov_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--semihost") {
+			semihost_en = true;
+		}
+		else if (s == "--record-inputs") {
+			if (argc - i < 2)
+				usage_error("Option --record-inputs requires an argument\n");
+			record_inputs_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--replay-inputs") {
+			if (argc - i < 2)
+				usage_error("Option --replay-inputs requires an argument\n");
+			replay_inputs_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--stimulus") {
+			if (argc - i < 2)
+				usage_error("Option --stimulus requires an argument\n");
+			std::string err;
+			if (!stimulus.load(argv[i + 1], err)) {
+				std::cerr << err << "\n";
+				return -1;
+			}
+			i += 1;
+		}
+		else if (s == "--stimulus-random") {
+			if (argc - i < 4)
+				usage_error("Option --stimulus-random requires 3 arguments\n");
+			stimulus_random = std::make_tuple(
+				parse_unsigned(argv[i + 1]),
+				parse_unsigned(argv[i + 2]),
+				(uint32_t)parse_unsigned(argv[i + 3])
+			);
+			i += 3;
+		}
+		else if (s == "--block-cache") {
+			block_cache = true;
+		}
+		else if (s == "--block-cache-check") {
+			block_cache = true;
+			block_cache_check = true;
+		}
+		else if (s == "--irqs") {
+			if (argc - i < 2)
+				usage_error("Option --irqs requires an argument\n");
+			num_irqs = parse_unsigned(argv[i + 1]);
+			i += 1;
+		}
+		else if (s == "--harts") {
+			if (argc - i < 2)
+				usage_error("Option --harts requires an argument\n");
+			n_harts = parse_signed(argv[i + 1]);
+			i += 1;
+		}
+		else if (s == "--quantum") {
+			if (argc - i < 2)
+				usage_error("Option --quantum requires an argument\n");
+			quantum = parse_signed(argv[i + 1]);
+			i += 1;
+		}
+		else if (s == "--threads") {
+			threads = true;
+		}
+		else if (s == "--save-state") {
+			if (argc - i < 2)
+				usage_error("Option --save-state requires an argument\n");
+			save_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--save-arch") {
+			if (argc - i < 2)
+				usage_error("Option --save-arch requires an argument\n");
+			save_arch_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--save-cycle") {
+			if (argc - i < 2)
+				usage_error("Option --save-cycle requires an argument\n");
+			save_cycle = parse_signed(argv[i + 1]);
+			i += 1;
+		}
+		else if (s == "--save-pc") {
+			if (argc - i < 2)
+				usage_error("Option --save-pc requires an argument\n");
+			save_pc = parse_unsigned(argv[i + 1]);
+			i += 1;
+		}
+		else if (s == "--save-io") {
+			if (argc - i < 2)
+				usage_error("Option --save-io requires an argument\n");
+			save_io = parse_unsigned(argv[i + 1]);
+			i += 1;
+		}
+		else if (s == "--restore-state") {
+			if (argc - i < 2)
+				usage_error("Option --restore-state requires an argument\n");
+			restore_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--gdb") {
+			if (argc - i < 2)
+				usage_error("Option --gdb requires an argument\n");
+			gdb_port = parse_unsigned(argv[i + 1]);
+			i += 1;
+		}
+		else if (s == "--gdb-hw-breakpoints") {
+			if (argc - i < 2)
+				usage_error("Option --gdb-hw-breakpoints requires an argument\n");
+			gdb_hw_breakpoints = parse_unsigned(argv[i + 1]);
+			i += 1;
+		}
 		else {
-			std::cerr << "Unrecognised argument " << s << "\n";
-			exit_help("");
+			usage_error("Unrecognised argument " + s + "\n");
+		}
+	}
+
+	bool save_pending = !save_path.empty() || !save_arch_path.empty();
+	if ((save_cycle || save_pc || save_io) && !save_pending)
+		usage_error("--save-cycle, --save-pc and --save-io require --save-state or --save-arch\n");
+	if (save_pending && threads)
+		usage_error("--save-state is not supported with --threads\n");
+	if (!restore_path.empty() && (load_bin || load_elf || block_cache_check))
+		usage_error("--restore-state can't be used with --bin, --elf or --block-cache-check\n");
+	if (load_bin && load_elf)
+		usage_error("Can't specify both --bin and --elf\n");
+	if (fast_boot && !(load_bin || load_elf))
+		usage_error("--fast-boot requires --bin or --elf\n");
+	if (!signature_path.empty() && !load_elf)
+		usage_error("--signature requires --elf\n");
+	if (!codecov_path.empty() && !load_elf)
+		usage_error("--code-coverage requires --elf\n");
+
+	ElfFile elf;
+	if (load_elf) {
+		std::string err;
+		if (!elf.open(elf_path, err)) {
+			std::cerr << err << "\n";
+			return -1;
+		}
+	}
+	DwarfLines lines;
+	if (!codecov_path.empty()) {
+		std::string err;
+		if (!lines.load(elf, err)) {
+			std::cerr << "Failed to read \"" << elf_path << "\": " << err << "\n";
+			return -1;
 		}
 	}
+	ux_t reset_vector = load_elf ? elf.entry : RAM_BASE + 0x40;
 
-	TBMemIO io(trace_execution);
+	SnapshotHeader snapshot;
+	uint8_t *snapshot_ram = nullptr;
+	if (!restore_path.empty()) {
+		if (!snapshot_map(restore_path, snapshot, snapshot_ram))
+			return -1;
+		ram_size = snapshot.ram_size;
+		n_harts = snapshot.n_harts;
+	}
+
+	if (n_harts < 1 || n_harts > TBMemIO::MAX_HARTS)
+		usage_error("Number of harts must be between 1 and 32\n");
+	if (num_irqs < 1 || num_irqs > IrqCtrl::MAX_IRQS)
+		usage_error("Number of IRQs must be between 1 and 512\n");
+	if (quantum < 0)
+		usage_error("Quantum must be positive\n");
+	if (quantum == 0)
+		quantum = threads ? 10000 : 1;
+	if (block_cache_check && n_harts > 1)
+		usage_error("--block-cache-check is only supported with one hart\n");
+	if (!save_arch_path.empty() && n_harts > 1)
+		usage_error("--save-arch is only supported with one hart\n");
+	// Options which narrow the trace, and --trace-last on its own, which
+	// only prints the steps before a trap or exit
+	bool trace_gated = trace_from_cycle > 0 || trace_pc_range || trace_priv_mask != 0xfu || trace_io;
+	if (trace_gated && !trace_execution)
+		usage_error("--trace-from-cycle, --trace-pc-range, --trace-priv and --trace-io need --trace or --trace-bin\n");
+	bool trace_last_only = trace_last > 0 && !trace_execution;
+	trace_gated = trace_gated || trace_last > 0;
+	trace_execution = trace_execution || trace_last_only;
+	if (trace_execution && threads)
+		usage_error("--trace is not supported with --threads\n");
+	if (trace_gated && gdb_port)
+		usage_error("--trace-from-cycle, --trace-pc-range, --trace-priv, --trace-io and --trace-last\n"
+			"are not supported with --gdb\n");
+	if (timing && threads)
+		usage_error("--timing is not supported with --threads\n");
+	if (stats && (threads || gdb_port))
+		usage_error("--stats is not supported with --threads or --gdb\n");
+	if (gdb_port && (n_harts > 1 || block_cache_check || save_pending))
+		usage_error("--gdb is only supported with one hart, and not with --block-cache-check or --save-state\n");
+	if (!profile_path.empty() && n_harts > 1)
+		usage_error("--profile is only supported with one hart\n");
+	if (semihost_en && (n_harts > 1 || block_cache_check))
+		usage_error("--semihost is only supported with one hart, and not with --block-cache-check\n");
+	if (!(record_inputs_path.empty() && replay_inputs_path.empty()) && !semihost_en)
+		usage_error("--record-inputs and --replay-inputs require --semihost\n");
+	if (!record_inputs_path.empty() && !replay_inputs_path.empty())
+		usage_error("--record-inputs and --replay-inputs are mutually exclusive\n");
+	if (gdb_port && (stimulus.next_cycle != Stimulus::NEVER || stimulus_random))
+		usage_error("--stimulus and --stimulus-random are not supported with --gdb\n");
+	if (!stimulus.fault_rules.empty() && threads)
+		usage_error("Fault injection is not supported with --threads\n");
+	if (stimulus_random && (std::get<1>(*stimulus_random) < 1 || !std::get<2>(*stimulus_random)))
+		usage_error("--stimulus-random requires a positive interval and a nonzero mask\n");
+	if (profile_interval < 1)
+		usage_error("Profile interval must be positive\n");
+	if (!heatmap_path.empty() && threads)
+		usage_error("--heatmap is not supported with --threads\n");
+	if (roi_gate && (threads || gdb_port))
+		usage_error("--roi is not supported with --threads or --gdb\n");
+	if (heatmap_block < 4 || heatmap_block > 4096 || (heatmap_block & (heatmap_block - 1)))
+		usage_error("--heatmap-block must be a power of two from 4 to 4096\n");
+
+	BinaryTraceWriter trace_bin;
+	if (!trace_bin_path.empty() && !trace_bin.open(trace_bin_path))
+		return -1;
+
+	// (--trace-last on its own leaves printed output as it is untraced)
+	TBMemIO io(trace_execution && !trace_last_only, n_harts);
+	io.save_trigger_addr = save_io;
+	io.fast_boot = fast_boot;
+	io.out = out;
+	if (!trace_bin_path.empty())
+		io.trace_sink = &trace_bin;
+	TextTraceSink trace_text(out);
+	TraceSink *trace_out = !trace_bin_path.empty() ? (TraceSink*)&trace_bin : trace_execution ? &trace_text : nullptr;
+	// One gate per hart, as each keeps track of its hart's privilege level
+	// and last steps
+	std::vector<std::unique_ptr<TraceGate>> trace_gates;
+	if (trace_gated) {
+		for (uint i = 0; i < n_harts; ++i) {
+			trace_gates.emplace_back(new TraceGate(trace_out, trace_last));
+			TraceGate &g = *trace_gates.back();
+			if (trace_pc_range) {
+				g.pc_range = true;
+				g.pc_lo = trace_pc_range->first;
+				g.pc_hi = trace_pc_range->second;
+			}
+			g.priv_mask = trace_priv_mask;
+		}
+	}
+	std::mutex io_lock;
+	MemLock32 locked_io(io, io_lock);
 	MemMap32 mem;
-	mem.add(0x80000000u, 0x1000, &io);
+	mem.add(IO_BASE, IO_SIZE, threads ? (MemBase32*)&locked_io : &io);
+
+	// All harts share hart 0's RAM (or the RAM mapped from the snapshot)
+	std::vector<std::unique_ptr<RVCore>> harts;
+	for (uint i = 0; i < n_harts; ++i) {
+		harts.emplace_back(new RVCore(mem, reset_vector, RAM_BASE, ram_size,
+			i ? harts[0]->ram : snapshot_ram, i));
+		harts[i]->set_config(isa_cfg);
+		harts[i]->block_cache_enable = block_cache;
+		harts[i]->csr.set_num_irqs(num_irqs);
+		harts[i]->monitor = &io.monitor;
+		if (!stimulus.fault_rules.empty())
+			harts[i]->faults = &io.faults;
+		if (trace_gated)
+			harts[i]->trace_sink = trace_gates[i].get();
+		else
+			harts[i]->trace_sink = trace_out;
+	}
+	RVCore &core = *harts[0];
+	io.ram = core.ram;
+	io.ram_base = RAM_BASE;
+	io.ram_size = ram_size;
+	std::unique_ptr<Semihost> semihost;
+	InputLog inputs;
+	if (!record_inputs_path.empty() && !inputs.open_record(record_inputs_path)) {
+		std::cerr << "Failed to open \"" << record_inputs_path << "\"\n";
+		return -1;
+	}
+	if (!replay_inputs_path.empty() && !inputs.open_replay(replay_inputs_path)) {
+		std::cerr << "\"" << replay_inputs_path << "\" is not an input log\n";
+		return -1;
+	}
+	if (semihost_en) {
+		semihost.reset(new Semihost(core.ram, RAM_BASE, ram_size));
+		semihost->print = [&](const char *text, size_t len) {io.print(text, len);};
+		semihost->cycles = [&] {return io.mtime;};
+		semihost->inputs = &inputs;
+		core.semihost = semihost.get();
+	}
+
+	// The timing model sees every step as a trace record, and passes it on
+	// to the trace output, if any
+	std::vector<std::unique_ptr<TimingModel>> timing_models;
+	std::vector<std::unique_ptr<XipCache>> icaches;
+	if (timing) {
+		for (auto &hart : harts) {
+			TraceSink *next = hart->trace_sink;
+			timing_models.emplace_back(new TimingModel(timing_cfg, hart->regs.data(), next));
+			if (xip_cfg.enabled) {
+				icaches.emplace_back(new XipCache(xip_cfg));
+				timing_models.back()->icache = icaches.back().get();
+			}
+			hart->trace_sink = timing_models.back().get();
+		}
+	}
+	Profiler profiler(profile_interval, profile_calls);
+	std::unique_ptr<ProfileTraceSink> profile_sink;
+	if (!profile_path.empty()) {
+		TraceSink *next = core.trace_sink ? core.trace_sink : trace_execution ? &trace_text : nullptr;
+		profile_sink.reset(new ProfileTraceSink(profiler, next, core.pc));
+		core.trace_sink = profile_sink.get();
+	}
+	std::vector<ExecStats> hart_stats(stats ? n_harts : 0);
+	for (size_t i = 0; i < hart_stats.size(); ++i)
+		harts[i]->stats = &hart_stats[i];
+	std::vector<CsrProfile> csr_profiles(csr_profile_en ? n_harts : 0);
+	for (size_t i = 0; i < csr_profiles.size(); ++i)
+		harts[i]->csr.profile = &csr_profiles[i];
+	// One heatmap for all harts, as they share RAM
+	std::unique_ptr<MemHeatmap> heatmap;
+	if (!heatmap_path.empty()) {
+		heatmap.reset(new MemHeatmap(__builtin_ctz(heatmap_block)));
+		for (auto &hart : harts)
+			hart->heatmap = heatmap.get();
+	}
+	// One map per hart, so harts on different threads don't share words,
+	// over the span of the ELF file's segments
+	std::vector<std::unique_ptr<CodeCoverage>> codecov;
+	if (!codecov_path.empty()) {
+		uint32_t lo = ~0u, hi = 0;
+		for (const ElfFile::Segment &seg : elf.segments) {
+			lo = std::min(lo, seg.addr);
+			hi = std::max(hi, seg.addr + seg.memsz);
+		}
+		for (auto &hart : harts) {
+			codecov.emplace_back(new CodeCoverage(lo, hi));
+			hart->codecov = codecov.back().get();
+		}
+	}
+	bool trace_step = trace_execution || timing || !profile_path.empty();
 
-	RVCore core(mem, RAM_BASE + 0x40, RAM_BASE, ram_size);
+	int64_t start_cyc = 0;
+	if (!restore_path.empty()) {
+		if (!snapshot_restore(restore_path, io, harts))
+			return -1;
+		start_cyc = snapshot.cycle;
+		max_cycles += start_cyc;
+		inputs.seek(io.mtime);
+		for (auto &hart : harts)
+			update_irqs(*hart, io);
+	}
+	for (size_t i = 0; i < trace_gates.size(); ++i)
+		trace_gates[i]->priv = harts[i]->csr.get_true_priv();
+
+	PowerStats power;
+	if (power_stats_en) {
+		if (!power.init(n_harts, harts[0]->hartid, power_series_path, power_series_window, start_cyc))
+			return -1;
+		for (size_t i = 0; i < n_harts; ++i)
+			harts[i]->power = &power.harts[i];
+	}
+
+	// Events before a restored cycle are already reflected in the saved state
+	if (start_cyc > 0)
+		stimulus.run(start_cyc - 1, [](const StimulusEvent &) {});
+	if (stimulus_random) {
+		stimulus.add_random(std::get<0>(*stimulus_random), start_cyc,
+			std::get<1>(*stimulus_random), std::get<2>(*stimulus_random));
+	}
+
+	// Checked between blocks (or rounds of harts); run_block() stops early
+	// at IO accesses, so an IO trigger is seen straight after the write.
+	bool save_at_end = !(save_cycle || save_pc || save_io);
+	auto check_save = [&](int64_t cyc, bool end=false) {
+		if (!save_pending)
+			return true;
+		bool hit = (end && save_at_end) || (save_cycle && cyc >= *save_cycle) || io.save_triggered;
+		for (auto &hart : harts)
+			hit = hit || (save_pc && hart->pc == *save_pc);
+		if (!hit)
+			return true;
+		save_pending = false;
+		io.flush_print();
+		if (!save_path.empty()) {
+			if (!snapshot_save(save_path, cyc, io, harts))
+				return false;
+			fprintf(out, "Saved state to %s after %ld cycles\n", save_path.c_str(), cyc);
+		}
+		if (!save_arch_path.empty()) {
+			ArchCheckpoint cp;
+			arch_checkpoint_capture(cp, cyc, io, core);
+			std::string err;
+			if (!cp.save(save_arch_path, err)) {
+				std::cerr << err << "\n";
+				return false;
+			}
+			fprintf(out, "Saved architectural checkpoint to %s after %ld cycles\n", save_arch_path.c_str(), cyc);
+		}
+		return true;
+	};
+	// Largest number of cycles which can be run without passing --save-cycle
+	auto save_limit = [&](int64_t cyc, int64_t n) {
+		if (save_pending && save_cycle && *save_cycle > cyc && *save_cycle - cyc < n)
+			return *save_cycle - cyc;
+		return n;
+	};
+	bool single_step = trace_step || stats || (save_pending && save_pc);
+
+	// Region-of-interest changes are seen between blocks (or rounds of
+	// harts), as for IO save triggers. Instructions are hart 0's. With --roi,
+	// the hooks are detached outside regions, and the step variant and
+	// single-stepping are chosen again on every change. With --timing, the
+	// model's cycles are counted too, e.g. to compare with tb_cxxrtl's.
+	RoiStats roi(timing ? std::vector<std::string>{"cycles", "instret", "model cycles"} :
+		std::vector<std::string>{"cycles", "instret"});
+	bool trace_live = trace_step;
+	// The trace is open from --trace-from-cycle on, while IO_TRACE has it
+	// on. While it's shut, and nothing else needs the trace records (the
+	// timing model, the profiler or a --trace-last ring), the harts run with
+	// the untraced step(), and in blocks.
+	bool trace_open = true;
+	auto choose_step = [&]() {
+		bool live = !roi_gate || roi.active();
+		bool records = !trace_gated || trace_open || trace_last || timing || !profile_path.empty();
+		trace_live = live && trace_step && records;
+		single_step = trace_live || (live && stats) || (save_pending && save_pc);
+	};
+	auto roi_update = [&](int64_t cyc) {
+		io.roi_changed = false;
+		uint64_t counters[] = {(uint64_t)cyc, (uint64_t)cyc - core.wfi_steps,
+			timing ? timing_models[0]->cycles : 0};
+		roi.set(io.roi, counters);
+		if (!roi_gate)
+			return;
+		bool live = roi.active();
+		for (size_t i = 0; i < n_harts; ++i) {
+			harts[i]->stats = live && stats ? &hart_stats[i] : nullptr;
+			harts[i]->csr.profile = live && csr_profile_en ? &csr_profiles[i] : nullptr;
+			harts[i]->heatmap = live ? heatmap.get() : nullptr;
+		}
+		choose_step();
+	};
+	if (trace_io)
+		io.trace_on = false;
+	// Checked between blocks, which stop at --trace-from-cycle
+	auto trace_update = [&](int64_t cyc) {
+		io.trace_changed = false;
+		trace_open = !trace_last_only && io.trace_on && cyc >= trace_from_cycle;
+		for (auto &g : trace_gates)
+			g->on = trace_open;
+		choose_step();
+	};
+	auto trace_check = [&](int64_t cyc) {
+		return trace_gated && (io.trace_changed || (!trace_open && cyc == trace_from_cycle));
+	};
+	// Largest number of cycles which can be run without passing
+	// --trace-from-cycle
+	auto trace_limit = [&](int64_t cyc, int64_t n) {
+		return cyc < trace_from_cycle && trace_from_cycle - cyc < n ? trace_from_cycle - cyc : n;
+	};
+	auto trace_dump = [&](const char *why) {
+		for (auto &g : trace_gates)
+			g->dump(why);
+	};
+
+	QuietTBMemIO ref_io;
+	MemMap32 ref_mem;
+	ref_io.fast_boot = fast_boot;
+	ref_mem.add(IO_BASE, IO_SIZE, &ref_io);
+	RVCore ref(ref_mem, reset_vector, RAM_BASE, block_cache_check ? ram_size : 0);
+	ref.set_config(isa_cfg);
+	ref.csr.set_num_irqs(num_irqs);
+	if (!stimulus.fault_rules.empty())
+		ref.faults = &ref_io.faults;
 
 	if (load_bin) {
-		std::ifstream fd(bin_path, std::ios::binary | std::ios::ate);
-		std::streamsize bin_size = fd.tellg();
-		if (bin_size > ram_size) {
-			std::cerr << "Binary file (" << bin_size << " bytes) is larger than memory (" << ram_size << " bytes)\n";
+		// Mapped copy-on-write, so only the pages actually used are read
+		size_t bin_size;
+		if (!host_ram_map_file(core.ram, ram_size, bin_path.c_str(), bin_size) ||
+				(block_cache_check && !host_ram_map_file(ref.ram, ram_size, bin_path.c_str(), bin_size))) {
+			std::cerr << "Failed to load \"" << bin_path << "\" (missing, or larger than memory of " << ram_size << " bytes)\n";
 			return -1;
 		}
-		fd.seekg(0, std::ios::beg);
-		fd.read((char*)core.ram, bin_size);
+	}
+	if (load_elf) {
+		std::string err;
+		if (!elf.load(core.ram, RAM_BASE, ram_size, err) ||
+				(block_cache_check && !elf.load(ref.ram, RAM_BASE, ram_size, err))) {
+			std::cerr << "Failed to load \"" << elf_path << "\": " << err << "\n";
+			return -1;
+		}
+		ux_t tohost;
+		if (elf.lookup("tohost", tohost)) {
+			for (auto &hart : harts)
+				hart->tohost_addr = tohost;
+			ref.tohost_addr = tohost;
+		}
+	}
+	ux_t signature_start = 0, signature_end = 0;
+	if (!signature_path.empty() && !(elf.lookup("begin_signature", signature_start) &&
+			elf.lookup("end_signature", signature_end))) {
+		std::cerr << "No begin_signature/end_signature symbols in " << elf_path << "\n";
+		return -1;
 	}
 
 	int64_t cyc;
 	int rc = 0;
+	// Stimulus events applied to the --block-cache-check interpreter's IO at
+	// the end of each block
+	std::vector<StimulusEvent> ref_events;
+	// Checked between blocks of the single-hart loop. A hart spinning on a
+	// jump to itself is only checked once it has been at the same pc for two
+	// checks in a row. Nothing but an IRQ can move it on, and only the timer
+	// and stimulus events change the IRQ inputs.
+	// run_block() returns at a jump to itself, and blocks are limited to
+	// HANG_CHECK_CYCLES, so that a spinning or sleeping hart is seen between
+	// blocks.
+	const int64_t HANG_CHECK_CYCLES = 1 << 20;
+	ux_t hang_last_pc = reset_vector - 1;
+	auto hung = [&]() {
+		bool same_pc = core.pc == hang_last_pc;
+		hang_last_pc = core.pc;
+		if (!hang_detect || save_pending || stimulus.next_cycle != Stimulus::NEVER || io.faults.armed() ||
+				!(core.stalled_on_wfi || (same_pc && core.at_self_loop())))
+			return false;
+		ux_t future_xip = io.mtime < io.mtimecmp[0] ? MIP_MTIP : 0;
+		return !core.csr.irq_inputs_settling() && !core.csr.irq_possible(future_xip);
+	};
+	// Single-hart step() variant, for the hooks in use
+	RVCore::StepFn step = core.step_fn(trace_step);
+	if (!threads && !gdb_port) {
+		roi_update(start_cyc);
+		if (trace_gated)
+			trace_update(start_cyc);
+		step = core.step_fn(trace_live);
+	}
 	try {
-		for (cyc = 0; cyc < max_cycles; ++cyc) {
-			core.step(trace_execution);
-			io.step();
-			core.csr.set_irq_t(io.timer_irq_pending());
-			core.csr.set_irq_s(io.soft_irq_pending());
+		if (n_harts > 1 && !threads) {
+			// Deterministic round-robin, mtime advancing once per round
+			for (cyc = start_cyc; cyc < max_cycles;) {
+				if (!check_save(cyc))
+					return -1;
+				int64_t q = trace_limit(cyc, save_limit(cyc, std::min(quantum, max_cycles - cyc)));
+				for (auto &hart : harts)
+					run_quantum(*hart, io, q, single_step, trace_live);
+				io.step(q);
+				cyc += q;
+				if (cyc >= power.next_window)
+					power.end_window(cyc);
+				if (io.roi_changed)
+					roi_update(cyc);
+				if (trace_check(cyc))
+					trace_update(cyc);
+				stimulus.run(cyc - 1, [&](const StimulusEvent &e) {apply_stimulus(io, stimulus, e);});
+			}
+		}
+		else if (n_harts > 1) {
+			// One thread per hart, meeting at a barrier after each quantum to
+			// advance mtime. Exit requests are passed back to this thread.
+			RoundBarrier barrier(n_harts);
+			std::atomic<bool> stop(false);
+			bool done = false;
+			std::optional<ux_t> exit_code;
+			int64_t exit_cyc = 0;
+			cyc = start_cyc;
+			auto hart_thread = [&](RVCore &hart) {
+				while (!done) {
+					int64_t q = std::min(quantum, max_cycles - cyc);
+					try {
+						run_quantum(hart, io, q, false, false, &io_lock, &stop);
+					}
+					catch (TBExitException e) {
+						std::lock_guard<std::mutex> guard(io_lock);
+						if (!exit_code) {
+							exit_code = e.exitcode;
+							exit_cyc = cyc;
+						}
+						stop = true;
+					}
+					barrier.wait([&] {
+						io.step(q);
+						cyc += q;
+						if (cyc >= power.next_window)
+							power.end_window(cyc);
+						stimulus.run(cyc - 1, [&](const StimulusEvent &e) {apply_stimulus(io, stimulus, e);});
+						done = stop || cyc >= max_cycles;
+					});
+				}
+			};
+			std::vector<std::thread> hart_threads;
+			for (auto &hart : harts)
+				hart_threads.emplace_back(hart_thread, std::ref(*hart));
+			for (auto &t : hart_threads)
+				t.join();
+			if (exit_code) {
+				cyc = exit_cyc;
+				throw TBExitException(*exit_code);
+			}
+		}
+		else if (gdb_port) {
+			cyc = start_cyc;
+			GdbServer gdb(core, io, gdb_hw_breakpoints, trace_step);
+			gdb.serve(gdb_port, cyc);
+		}
+		else for (cyc = start_cyc; cyc < max_cycles;) {
+			if (!check_save(cyc))
+				return -1;
+			int64_t n = 1;
+			if (single_step || cyc == 0) {
+				// Single-step when tracing, and also on the first cycle, as
+				// the IRQ inputs have not yet been updated from the IO model
+				(core.*step)();
+			} else {
+				// Run instructions in blocks, up until the point the timer
+				// IRQ may change. The core stops early on MMIO accesses, so
+				// the other IO state is always up to date.
+				n = trace_limit(cyc, save_limit(cyc, max_cycles - cyc));
+				if (hang_detect && n > HANG_CHECK_CYCLES)
+					n = HANG_CHECK_CYCLES;
+				if (!io.timer_irq_pending() && io.mtimecmp[0] - io.mtime < (uint64_t)n)
+					n = io.mtimecmp[0] - io.mtime;
+				// Stop at the end of the cycle of the next stimulus event
+				if (stimulus.next_cycle - cyc < (uint64_t)n)
+					n = stimulus.next_cycle - cyc + 1;
+				// ...and the end of the --power-stats-series window
+				if (power.next_window - cyc < n)
+					n = power.next_window - cyc;
+				n = core.run_block(n);
+			}
+			io.step(n);
+			// Events are applied at the end of their cycle, and seen by the
+			// core from the next cycle, as for an IO write
+			ref_events.clear();
+			if ((uint64_t)(cyc + n) > stimulus.next_cycle) {
+				stimulus.run(cyc + n - 1, [&](const StimulusEvent &e) {
+					apply_stimulus(io, stimulus, e);
+					if (block_cache_check)
+						ref_events.push_back(e);
+				});
+			}
+			update_irqs(core, io);
+			if (block_cache_check) {
+				bool match = true;
+				try {
+					for (int64_t i = 0; i < n; ++i) {
+						ref.step();
+						ref_io.step();
+						if (i == n - 1) {
+							for (auto &e : ref_events)
+								apply_stimulus(ref_io, stimulus, e);
+						}
+						update_irqs(ref, ref_io);
+					}
+				}
+				catch (TBExitException e) {
+					match = false;
+				}
+				if (!(match && compare_lockstep(core, ref, cyc + n, out))) {
+					fprintf(out, "Interpreter diverged from block cache, stopping.\n");
+					return -1;
+				}
+			}
+			cyc += n;
+			if (cyc >= power.next_window)
+				power.end_window(cyc);
+			if (io.roi_changed) {
+				roi_update(cyc);
+				step = core.step_fn(trace_live);
+			}
+			if (trace_check(cyc)) {
+				trace_update(cyc);
+				step = core.step_fn(trace_live);
+			}
+			if (hung()) {
+				result.hung = true;
+				break;
+			}
+		}
+		if (!check_save(cyc, true))
+			return -1;
+		io.flush_print();
+		trace_dump("exit");
+		if (result.hung) {
+			io.flush_print();
+			fprintf(out, "Hang detected at pc %08x%s after %ld cycles\n", core.pc,
+				core.stalled_on_wfi ? " (in WFI)" : "", cyc);
 		}
 		if (propagate_return_code)
-			rc = -1;
+			rc = result.hung ? -2 : -1;
+		result.cycles = cyc;
+		result.timed_out = true;
 	}
 	catch (TBExitException e) {
-		printf("CPU requested halt. Exit code %d\n", e.exitcode);
-		printf("Ran for %ld cycles\n", cyc + 1);
+		io.flush_print();
+		trace_dump("exit");
+		fprintf(out, "CPU requested halt. Exit code %d\n", e.exitcode);
+		fprintf(out, "Ran for %ld cycles\n", cyc + 1);
 		if (propagate_return_code)
 			rc = e.exitcode;
+		result.exit_code = e.exitcode;
+		result.cycles = cyc + 1;
+	}
+
+	io.flush_print();
+	if (inputs.failed) {
+		std::cerr << inputs.error << "\n";
+		rc = -1;
+	}
+	io.faults.print(out);
+	for (size_t i = 0; i < timing_models.size(); ++i)
+		timing_models[i]->print_summary(out, harts[i]->hartid);
+	for (size_t i = 0; i < hart_stats.size(); ++i)
+		hart_stats[i].print(out, harts[i]->hartid);
+	for (size_t i = 0; i < csr_profiles.size(); ++i)
+		csr_profiles[i].print(out, harts[i]->hartid, load_elf ? &elf : nullptr);
+	if (power_stats_en) {
+		if (power.series && result.cycles > power.next_window - power.window)
+			power.end_window(result.cycles);
+		power.print(out, result.cycles);
+	}
+	if (!threads && !gdb_port) {
+		io.roi = RoiStats::NONE;
+		roi_update(result.cycles);
+		roi.print(out);
+	}
+
+	if (!profile_path.empty() && !profiler.write(profile_path, load_elf ? &elf : nullptr, out)) {
+		std::cerr << "Failed to write profile to \"" << profile_path << "\"\n";
+		rc = -1;
+	}
+	if (heatmap && !heatmap->write(heatmap_path, out)) {
+		std::cerr << "Failed to write heatmap to \"" << heatmap_path << "\"\n";
+		rc = -1;
+	}
+	if (!codecov.empty()) {
+		for (size_t i = 1; i < codecov.size(); ++i)
+			codecov[0]->merge(*codecov[i]);
+		if (!codecov[0]->write_lcov(codecov_path, lines, elf, core.ram, RAM_BASE, ram_size, out)) {
+			std::cerr << "Failed to write code coverage to \"" << codecov_path << "\"\n";
+			rc = -1;
+		}
+	}
+
+	if (!trace_bin.close()) {
+		std::cerr << "Error writing trace output\n";
+		rc = -1;
 	}
 
+	// Ranges within RAM are read straight from its buffer, anything else
+	// byte-by-byte through the hart
+	auto ram_range = [&](uint32_t start, uint32_t end) -> const uint8_t* {
+		return end >= start && start - RAM_BASE <= ram_size && end - RAM_BASE <= ram_size ? core.ram + (start - RAM_BASE) : nullptr;
+	};
+
 	for (auto [start, end] : dump_ranges) {
-		printf("Dumping memory from %08x to %08x:\n", start, end);
-		for (uint32_t i = 0; i < end - start; ++i)
-			printf("%02x%c", *core.r8(start + i), i % 16 == 15 ? '\n' : ' ');
-		printf("\n");
+		fprintf(out, "Dumping memory from %08x to %08x:\n", start, end);
+		const uint8_t *host = ram_range(start, end);
+		for (uint32_t i = 0; i < end - start; ++i) {
+			ux_t b = 0;
+			if (host)
+				b = host[i];
+			else
+				core.r8(start + i, b);
+			fprintf(out, "%02x%c", b, i % 16 == 15 ? '\n' : ' ');
+		}
+		fprintf(out, "\n");
+	}
+
+	if (!signature_path.empty()) {
+		std::ofstream f(signature_path, std::ios::binary);
+		if (const uint8_t *host = ram_range(signature_start, signature_end)) {
+			f.write((const char*)host, signature_end - signature_start);
+		} else {
+			for (uint32_t i = 0; f.good() && i < signature_end - signature_start; ++i) {
+				ux_t b = 0;
+				core.r8(signature_start + i, b);
+				f.put(b);
+			}
+		}
+		if (!f.good()) {
+			std::cerr << "Failed to write signature to \"" << signature_path << "\"\n";
+			rc = -1;
+		}
+	}
+
+	for (auto &[start, end, path] : dump_bins) {
+		std::ofstream f(path, std::ios::binary);
+		if (end < start) {
+			f.setstate(std::ios::failbit);
+		} else if (const uint8_t *host = ram_range(start, end)) {
+			f.write((const char*)host, end - start);
+		} else {
+			for (uint32_t i = 0; f.good() && i < end - start; ++i) {
+				ux_t b = 0;
+				core.r8(start + i, b);
+				f.put(b);
+			}
+		}
+		if (!f.good()) {
+			std::cerr << "Failed to write memory from " << std::hex << start << " to " << end << std::dec <<
+				" to \"" << path << "\"\n";
+			rc = -1;
+		}
+	}
+
+	for (auto &[start, check_end, path] : expects) {
+		std::ifstream f(path, std::ios::binary);
+		std::vector<char> expected((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+		if (!f.is_open()) {
+			std::cerr << "Failed to open \"" << path << "\"\n";
+			rc = -1;
+			result.dump_check_pass = false;
+			continue;
+		}
+		uint32_t end = check_end ? *check_end : start + (uint32_t)expected.size();
+		if (end - start != expected.size()) {
+			fprintf(out, "Memory from %08x to %08x does not match %s, which is %zu bytes\n", start, end,
+				path.c_str(), expected.size());
+			rc = -1;
+			result.dump_check_pass = false;
+			continue;
+		}
+		const uint8_t *host = ram_range(start, end);
+		size_t diff;
+		if (host) {
+			// Only look for where on a mismatch
+			diff = memcmp(host, expected.data(), expected.size()) == 0 ? expected.size() :
+				std::mismatch(expected.begin(), expected.end(), (const char*)host).first - expected.begin();
+		} else {
+			for (diff = 0; diff < expected.size(); ++diff) {
+				ux_t b;
+				if (!core.r8(start + diff, b) || b != (uint8_t)expected[diff])
+					break;
+			}
+		}
+		if (diff == expected.size()) {
+			fprintf(out, "Memory from %08x to %08x matches %s\n", start, end, path.c_str());
+		} else {
+			fprintf(out, "Memory from %08x to %08x does not match %s: first difference at %08x\n",
+				start, end, path.c_str(), start + (uint32_t)diff);
+			rc = -1;
+			result.dump_check_pass = false;
+		}
 	}
 
 	return rc;
 }
+
+static std::string json_string(const std::string &s) {
+	std::string out = "\"";
+	for (char c : s) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if ((unsigned char)c < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			out += buf;
+		} else {
+			out += c;
+		}
+	}
+	return out + "\"";
+}
+
+struct BatchTest {
+	std::string name;
+	std::vector<std::string> args;
+	std::string log_path;
+	// Set for a bad manifest line, which fails without running
+	std::string error;
+};
+
+// Run one test from a manifest, and return its line of JSON results. The
+// test's output goes to its log file if it has one, else to stderr: directly
+// if this is the only instance, or else buffered and written out in one go
+// once the test finishes, so that concurrent tests' output isn't interleaved.
+static std::string run_batch_test(const BatchTest &t, bool buffered, std::mutex &stderr_lock, bool &pass) {
+	std::vector<std::string> args = t.args;
+	std::vector<char*> argv;
+	argv.push_back((char*)"rvcpp");
+	for (auto &a : args)
+		argv.push_back(a.data());
+	argv.push_back(nullptr);
+
+	char *buf = nullptr;
+	size_t buf_size = 0;
+	FILE *out = !t.log_path.empty() ? fopen(t.log_path.c_str(), "w") :
+		buffered ? open_memstream(&buf, &buf_size) : stderr;
+	RunResult r;
+	int rc = -1;
+	if (!t.error.empty()) {
+		r.error = t.error;
+		if (out)
+			fprintf(out, "%s\n", r.error.c_str());
+	} else if (out) {
+		try {
+			rc = run(argv.size() - 1, argv.data(), r, out);
+		}
+		catch (UsageError e) {
+			// Trailing newline is for the help text
+			r.error = e.errtext.substr(0, e.errtext.find_last_not_of('\n') + 1);
+			fprintf(out, "%s\n", r.error.c_str());
+		}
+	}
+	if (out) {
+		if (out != stderr)
+			fclose(out);
+		else
+			fflush(out);
+	} else {
+		r.error = "Failed to open \"" + t.log_path + "\"";
+		std::lock_guard<std::mutex> guard(stderr_lock);
+		std::cerr << r.error << "\n";
+	}
+	if (buf) {
+		std::lock_guard<std::mutex> guard(stderr_lock);
+		fwrite(buf, 1, buf_size, stderr);
+		fflush(stderr);
+	}
+	free(buf);
+
+	pass = rc == 0 && r.exit_code == 0 && r.dump_check_pass;
+	char line[256];
+	snprintf(line, sizeof(line), "\"exit_code\": %s, \"cycles\": %ld, \"timed_out\": %s, \"hung\": %s, "
+		"\"dump_check\": %s, \"pass\": %s",
+		r.exit_code ? std::to_string(*r.exit_code).c_str() : "null",
+		r.cycles, r.timed_out ? "true" : "false", r.hung ? "true" : "false", r.dump_check_pass ? "true" : "false",
+		pass ? "true" : "false");
+	std::string error = r.error.empty() ? "" : ", \"error\": " + json_string(r.error);
+	return "{\"test\": " + json_string(t.name) + ", " + line + error + "}\n";
+}
+
+// Run every test in a manifest, with the test's own options appended to the
+// common options, on up to n_instances threads. Each thread takes the next
+// test from the manifest as soon as it finishes the last, so long and short
+// tests balance out. Results are written to stdout in manifest order, as
+// soon as each test and all those before it have finished; anything else
+// which would go to stdout is sent to stderr.
+int run_batch(const std::string &manifest, const std::vector<std::string> &common_args, uint n_instances) {
+	std::ifstream f(manifest);
+	if (!f.is_open()) {
+		std::cerr << "Failed to open \"" << manifest << "\"\n";
+		return -1;
+	}
+	std::vector<BatchTest> tests;
+	std::string line;
+	while (std::getline(f, line)) {
+		std::istringstream ss(line);
+		BatchTest t;
+		if (!(ss >> t.name) || t.name[0] == '#')
+			continue;
+		t.args = common_args;
+		std::string arg;
+		while (ss >> arg) {
+			if (arg == "--log") {
+				if (!(ss >> t.log_path))
+					t.error = "Option --log requires an argument";
+			} else {
+				t.args.push_back(arg);
+			}
+		}
+		tests.push_back(t);
+	}
+
+	fflush(stdout);
+	FILE *results = fdopen(dup(STDOUT_FILENO), "w");
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+
+	std::mutex lock;
+	std::mutex stderr_lock;
+	std::vector<std::string> result_lines(tests.size());
+	std::vector<bool> finished(tests.size(), false);
+	size_t next_result = 0;
+	std::atomic<size_t> next_test(0);
+	bool all_passed = true;
+	auto worker = [&] {
+		for (size_t i; (i = next_test++) < tests.size();) {
+			bool pass;
+			std::string result = run_batch_test(tests[i], n_instances > 1, stderr_lock, pass);
+			std::lock_guard<std::mutex> guard(lock);
+			result_lines[i] = result;
+			finished[i] = true;
+			all_passed = all_passed && pass;
+			for (; next_result < tests.size() && finished[next_result]; ++next_result)
+				fputs(result_lines[next_result].c_str(), results);
+			fflush(results);
+		}
+	};
+	std::vector<std::thread> threads;
+	for (uint i = 1; i < n_instances && i < tests.size(); ++i)
+		threads.emplace_back(worker);
+	worker();
+	for (auto &t : threads)
+		t.join();
+	fclose(results);
+	return all_passed ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2)
+		exit_help();
+	std::string manifest;
+	uint n_instances = 0;
+	std::vector<std::string> common_args;
+	for (int i = 1; i < argc; ++i) {
+		if (std::string(argv[i]) == "--batch") {
+			if (argc - i < 2)
+				exit_help("Option --batch requires an argument\n");
+			manifest = argv[++i];
+		} else if (std::string(argv[i]) == "--instances") {
+			if (argc - i < 2)
+				exit_help("Option --instances requires an argument\n");
+			try {
+				n_instances = parse_unsigned(argv[++i]);
+			}
+			catch (UsageError e) {
+				exit_help(e.errtext);
+			}
+		} else {
+			common_args.push_back(argv[i]);
+		}
+	}
+	if (n_instances && manifest.empty())
+		exit_help("--instances requires --batch\n");
+	if (!manifest.empty())
+		return run_batch(manifest, common_args, n_instances ? n_instances : 1);
+	RunResult result;
+	try {
+		return run(argc, argv, result);
+	}
+	catch (UsageError e) {
+		exit_help(e.errtext);
+	}
+}
@@ -0,0 +1,306 @@
+#include "rvcpp.h"
+
+#include "rv_core.h"
+#include "rv_elf.h"
+#include "rv_mem.h"
+
+#include <iostream>
+#include <memory>
+#include <vector>
+
+// Region of the memory map backed by the caller's MMIO callbacks
+struct CallbackMem32: MemBase32 {
+	rvcpp_mmio_read_fn read_fn;
+	rvcpp_mmio_write_fn write_fn;
+	void *ctx;
+
+	CallbackMem32(rvcpp_mmio_read_fn read_, rvcpp_mmio_write_fn write_, void *ctx_):
+		read_fn(read_), write_fn(write_), ctx(ctx_) {}
+
+	std::optional<uint32_t> read(ux_t addr, unsigned size) {
+		uint32_t data = 0;
+		if (!read_fn || read_fn(ctx, addr, size, &data) != 0)
+			return std::nullopt;
+		return data;
+	}
+
+	bool write(ux_t addr, unsigned size, uint32_t data) {
+		return write_fn && write_fn(ctx, addr, size, data) == 0;
+	}
+
+	virtual std::optional<uint8_t> r8(ux_t addr) {
+		std::optional<uint32_t> x = read(addr, 1);
+		return x ? std::optional<uint8_t>(*x) : std::nullopt;
+	}
+
+	virtual std::optional<uint16_t> r16(ux_t addr) {
+		std::optional<uint32_t> x = read(addr, 2);
+		return x ? std::optional<uint16_t>(*x) : std::nullopt;
+	}
+
+	virtual std::optional<uint32_t> r32(ux_t addr) {
+		return read(addr, 4);
+	}
+
+	virtual bool w8(ux_t addr, uint8_t data) {
+		return write(addr, 1, data);
+	}
+
+	virtual bool w16(ux_t addr, uint16_t data) {
+		return write(addr, 2, data);
+	}
+
+	virtual bool w32(ux_t addr, uint32_t data) {
+		return write(addr, 4, data);
+	}
+};
+
+// Passes each retired instruction to the caller's callback
+struct RetireTraceSink: TraceSink {
+	rvcpp_retire_fn fn = nullptr;
+	void *ctx = nullptr;
+
+	virtual void record(const TraceRecord &t) {
+		if (t.flags & TraceRecord::INSTR)
+			fn(ctx, t.pc, t.instr, !!(t.flags & TraceRecord::TRAP));
+	}
+
+	virtual void message(__attribute__((unused)) const char *text, __attribute__((unused)) size_t len) {}
+};
+
+struct rvcpp_hart {
+	MemMap32 mem;
+	std::vector<std::unique_ptr<MemBase32>> regions;
+	TBMemIO *tbio = nullptr;
+	RVCore core;
+	RetireTraceSink retire_sink;
+	bool stop = false;
+	int exit_code = 0;
+	uint32_t irq_e = 0;
+	bool irq_t = false;
+	bool irq_s = false;
+
+	rvcpp_hart(uint32_t ram_base, uint32_t ram_size, uint32_t reset_vector):
+		core(mem, reset_vector, ram_base, ram_size) {}
+
+	void update_irqs() {
+		core.csr.set_irq_t(irq_t || (tbio && tbio->timer_irq_pending()));
+		core.csr.set_irq_s(irq_s || (tbio && tbio->soft_irq_pending()));
+		core.csr.set_irq_e(irq_e | (tbio ? tbio->irq : 0));
+	}
+
+	void advance(uint64_t n) {
+		if (tbio)
+			tbio->step(n);
+	}
+};
+
+extern "C" {
+
+rvcpp_hart *rvcpp_create(uint32_t ram_base, uint32_t ram_size, uint32_t reset_vector) {
+	if ((ram_base | ram_size) & 0x3u || (uint64_t)ram_base + ram_size > 1ull << 32)
+		return nullptr;
+	return new rvcpp_hart(ram_base, ram_size, reset_vector);
+}
+
+void rvcpp_destroy(rvcpp_hart *h) {
+	delete h;
+}
+
+uint8_t *rvcpp_ram(rvcpp_hart *h, uint32_t *size) {
+	if (size)
+		*size = h->core.ram_top - h->core.ram_base;
+	return h->core.ram;
+}
+
+void rvcpp_flush_code(rvcpp_hart *h) {
+	h->core.flush_decode_cache();
+}
+
+int rvcpp_add_mmio(rvcpp_hart *h, uint32_t base, uint32_t size,
+		rvcpp_mmio_read_fn read, rvcpp_mmio_write_fn write, void *ctx) {
+	if (size == 0 || (uint64_t)base + size > 1ull << 32)
+		return -1;
+	h->regions.emplace_back(new CallbackMem32(read, write, ctx));
+	h->mem.add(base, size, h->regions.back().get());
+	return 0;
+}
+
+uint8_t *rvcpp_add_ram(rvcpp_hart *h, uint32_t base, uint32_t size, int read_only) {
+	if (size == 0 || (base | size) & 0x3u || (uint64_t)base + size > 1ull << 32)
+		return nullptr;
+	FlatMem32 *ram = new FlatMem32(size, read_only);
+	h->regions.emplace_back(ram);
+	h->mem.add(base, size, ram);
+	return ram->mem;
+}
+
+int rvcpp_add_tbio(rvcpp_hart *h, uint32_t base) {
+	if (h->tbio || (uint64_t)base + 0x1000 > 1ull << 32)
+		return -1;
+	h->tbio = new TBMemIO(false);
+	h->regions.emplace_back(h->tbio);
+	h->tbio->ram = h->core.ram;
+	h->tbio->ram_base = h->core.ram_base;
+	h->tbio->ram_size = h->core.ram_top - h->core.ram_base;
+	h->core.monitor = &h->tbio->monitor;
+	h->mem.add(base, 0x1000, h->tbio);
+	return 0;
+}
+
+int rvcpp_load_elf(rvcpp_hart *h, const char *path) {
+	ElfFile elf;
+	std::string err;
+	if (!elf.open(path, err) ||
+			!elf.load(h->core.ram, h->core.ram_base, h->core.ram_top - h->core.ram_base, err)) {
+		std::cerr << "Failed to load \"" << path << "\": " << err << "\n";
+		return -1;
+	}
+	h->core.flush_decode_cache();
+	h->core.pc = elf.entry;
+	ux_t tohost;
+	if (elf.lookup("tohost", tohost))
+		h->core.tohost_addr = tohost;
+	return 0;
+}
+
+int rvcpp_load_config(rvcpp_hart *h, const char *path) {
+	RVConfig cfg;
+	std::string err;
+	if (!cfg.load(path, err)) {
+		std::cerr << err << "\n";
+		return -1;
+	}
+	h->core.set_config(cfg);
+	return 0;
+}
+
+void rvcpp_set_tohost(rvcpp_hart *h, uint32_t addr) {
+	h->core.tohost_addr = addr;
+}
+
+uint64_t rvcpp_run(rvcpp_hart *h, uint64_t max_instrs, int *event) {
+	RVCore &core = h->core;
+	int ev = RVCPP_EVENT_NONE;
+	uint64_t done = 0;
+	h->stop = false;
+	core.trace_sink = h->retire_sink.fn ? &h->retire_sink : nullptr;
+	try {
+		// Always execute the first instruction, even if there is a
+		// breakpoint on it, as that's where the last run stopped
+		if (max_instrs > 0 && core.is_breakpoint(core.pc)) {
+			h->update_irqs();
+			core.bp_ignore_pc = core.pc;
+			core.step(core.trace_sink != nullptr);
+			core.bp_ignore_pc = RVCore::DCACHE_INVALID_PC;
+			++done;
+			h->advance(1);
+		}
+		while (done < max_instrs && !h->stop && !(done > 0 && core.stalled_on_wfi)) {
+			// IRQ inputs are updated between blocks, as in main()
+			h->update_irqs();
+			uint64_t n = 1;
+			if (core.trace_sink) {
+				core.step(true);
+			} else {
+				// Blocks stop where the testbench timer IRQ may change
+				n = max_instrs - done;
+				if (h->tbio && !h->tbio->timer_irq_pending() && h->tbio->mtimecmp[0] - h->tbio->mtime < n)
+					n = h->tbio->mtimecmp[0] - h->tbio->mtime;
+				n = core.run_block(n);
+			}
+			if (core.breakpoint_hit) {
+				// The step which found the breakpoint did not execute anything
+				core.breakpoint_hit = false;
+				done += n - 1;
+				h->advance(n - 1);
+				ev = RVCPP_EVENT_BREAKPOINT;
+				break;
+			}
+			done += n;
+			h->advance(n);
+		}
+		if (ev == RVCPP_EVENT_NONE && h->stop)
+			ev = RVCPP_EVENT_STOP;
+		else if (ev == RVCPP_EVENT_NONE && core.stalled_on_wfi)
+			ev = RVCPP_EVENT_WFI;
+	}
+	catch (TBExitException e) {
+		if (h->tbio)
+			h->tbio->flush_print();
+		++done;
+		h->advance(1);
+		h->exit_code = e.exitcode;
+		ev = RVCPP_EVENT_EXIT;
+	}
+	if (h->tbio)
+		h->tbio->flush_print();
+	if (event)
+		*event = ev;
+	return done;
+}
+
+int rvcpp_exit_code(rvcpp_hart *h) {
+	return h->exit_code;
+}
+
+void rvcpp_stop(rvcpp_hart *h) {
+	h->stop = true;
+}
+
+void rvcpp_set_block_cache(rvcpp_hart *h, int enable) {
+	h->core.block_cache_enable = enable;
+}
+
+uint32_t rvcpp_get_pc(rvcpp_hart *h) {
+	return h->core.pc;
+}
+
+void rvcpp_set_pc(rvcpp_hart *h, uint32_t pc) {
+	h->core.pc = pc;
+}
+
+uint32_t rvcpp_get_reg(rvcpp_hart *h, unsigned regnum) {
+	return regnum < 32 ? h->core.regs[regnum] : 0;
+}
+
+void rvcpp_set_reg(rvcpp_hart *h, unsigned regnum, uint32_t value) {
+	if (regnum > 0 && regnum < 32)
+		h->core.regs[regnum] = value;
+}
+
+int rvcpp_read_csr(rvcpp_hart *h, uint16_t addr, uint32_t *data) {
+	std::optional<ux_t> x = h->core.csr.read(addr, false);
+	if (!x)
+		return -1;
+	*data = *x;
+	return 0;
+}
+
+int rvcpp_write_csr(rvcpp_hart *h, uint16_t addr, uint32_t data) {
+	if (!h->core.csr.write(addr, data))
+		return -1;
+	h->core.csr.commit_write();
+	return 0;
+}
+
+void rvcpp_set_irqs(rvcpp_hart *h, uint32_t external, int timer, int soft) {
+	h->irq_e = external;
+	h->irq_t = timer;
+	h->irq_s = soft;
+}
+
+void rvcpp_add_breakpoint(rvcpp_hart *h, uint32_t addr) {
+	h->core.add_breakpoint(addr);
+}
+
+void rvcpp_remove_breakpoint(rvcpp_hart *h, uint32_t addr) {
+	h->core.remove_breakpoint(addr);
+}
+
+void rvcpp_set_retire_callback(rvcpp_hart *h, rvcpp_retire_fn fn, void *ctx) {
+	h->retire_sink.fn = fn;
+	h->retire_sink.ctx = ctx;
+}
+
+}
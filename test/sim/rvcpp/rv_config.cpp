@@ -0,0 +1,103 @@
+#include "rv_config.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+bool read_config_vh(const std::string &path, std::map<std::string, uint64_t> &params, std::string &err) {
+	std::ifstream f(path);
+	if (!f.is_open()) {
+		err = "Failed to open \"" + path + "\"";
+		return false;
+	}
+	std::string line;
+	while (std::getline(f, line)) {
+		line = line.substr(0, line.find("//"));
+		std::istringstream ss(line);
+		std::string keyword, name, eq, value;
+		if (!(ss >> keyword >> name >> eq) || (keyword != "localparam" && keyword != "parameter") || eq != "=")
+			continue;
+		std::getline(ss, value, keyword == "parameter" ? ',' : ';');
+		value.erase(std::remove(value.begin(), value.end(), ' '), value.end());
+		value.erase(std::remove(value.begin(), value.end(), '_'), value.end());
+		// Plain decimal, or a sized Verilog literal like 32'h40. Anything
+		// else (e.g. replications) is a parameter we don't need.
+		size_t tick = value.find('\'');
+		int base = 10;
+		if (tick != std::string::npos && tick + 1 < value.size()) {
+			char b = value[tick + 1];
+			base = b == 'h' ? 16 : b == 'b' ? 2 : b == 'o' ? 8 : 10;
+			value = value.substr(tick + 2);
+		}
+		char *end;
+		uint64_t x = strtoull(value.c_str(), &end, base);
+		if (value.empty() || *end)
+			continue;
+		params[name] = x;
+	}
+	return true;
+}
+
+ux_t RVConfig::misa() const {
+	return
+		1u << 30 |                                        // MXL: 32-bit
+		(ext & (EXT_XH3BEXTM | EXT_XH3IRQ | EXT_XH3PMPM | EXT_XH3POWER) ? 1u << 23 : 0) |
+		(u_mode                            ? 1u << 20 : 0) |
+		(has(EXT_M)                        ? 1u << 12 : 0) |
+		1u << 8 |                                         // I
+		(has(EXT_C)                        ? 1u << 2  : 0) |
+		(has(EXT_ZBA | EXT_ZBB | EXT_ZBS)  ? 1u << 1  : 0) | // B is ZbaZbbZbs
+		(has(EXT_A)                        ? 1u << 0  : 0);
+}
+
+bool RVConfig::load(const std::string &path, std::string &err) {
+	std::map<std::string, uint64_t> params;
+	if (!read_config_vh(path, params, err))
+		return false;
+	static const struct {
+		const char *name;
+		uint32_t bit;
+		bool dflt;
+	} exts[] = {
+		{"EXTENSION_A",        EXT_A,        true},
+		{"EXTENSION_C",        EXT_C,        true},
+		{"EXTENSION_M",        EXT_M,        true},
+		{"EXTENSION_ZBA",      EXT_ZBA,      false},
+		{"EXTENSION_ZBB",      EXT_ZBB,      false},
+		{"EXTENSION_ZBC",      EXT_ZBC,      false},
+		{"EXTENSION_ZBS",      EXT_ZBS,      false},
+		{"EXTENSION_ZBKB",     EXT_ZBKB,     false},
+		{"EXTENSION_ZCB",      EXT_ZCB,      false},
+		{"EXTENSION_ZCMP",     EXT_ZCMP,     false},
+		{"EXTENSION_ZIFENCEI", EXT_ZIFENCEI, false},
+		{"EXTENSION_XH3BEXTM", EXT_XH3BEXTM, false},
+		{"EXTENSION_XH3IRQ",   EXT_XH3IRQ,   false},
+		{"EXTENSION_XH3PMPM",  EXT_XH3PMPM,  false},
+		{"EXTENSION_XH3POWER", EXT_XH3POWER, false},
+	};
+	ext = 0;
+	for (const auto &e : exts) {
+		auto it = params.find(e.name);
+		if (it != params.end() ? it->second != 0 : e.dflt)
+			ext |= e.bit;
+	}
+	auto it = params.find("CSR_COUNTER");
+	csr_counter = it != params.end() && it->second;
+	it = params.find("U_MODE");
+	u_mode = it != params.end() && it->second;
+	it = params.find("PMP_REGIONS");
+	pmp_regions = it != params.end() ? it->second : 0;
+	if (pmp_regions > 16) {
+		err = "PMP_REGIONS must be no more than 16";
+		return false;
+	}
+	it = params.find("DEBUG_SUPPORT");
+	debug_support = it != params.end() && it->second;
+	it = params.find("BREAKPOINT_TRIGGERS");
+	breakpoint_triggers = it != params.end() ? it->second : 0;
+	if (breakpoint_triggers > 16) {
+		err = "BREAKPOINT_TRIGGERS must be no more than 16";
+		return false;
+	}
+	return true;
+}
@@ -1,4 +1,6 @@
 #include "rv_core.h"
+#include "rv_alu.h"
+#include "rv_decode.h"
 #include "encoding/rv_opcodes.h"
 #include "encoding/rv_csr.h"
 
@@ -21,922 +23,913 @@ static inline ux_t sext(ux_t bits, int sign_bit) {
 #define GETBITS(x, msb, lsb) (((x) & BITRANGE(msb, lsb)) >> (lsb))
 #define GETBIT(x, bit) (((x) >> (bit)) & 1u)
 
-static inline ux_t imm_i(uint32_t instr) {
-	return (instr >> 20) - (instr >> 19 & 0x1000);
-}
+// Registers saved by cm.push, in order of increasing address: ra, s0-s11
+static const uint8_t zcmp_regs[13] = {1, 8, 9, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27};
 
-static inline ux_t imm_s(uint32_t instr) {
-	return (instr >> 20 & 0xfe0u)
-		+ (instr >> 7 & 0x1fu)
-		- (instr >> 19 & 0x1000u);
+bool RVCore::read_slow(ux_t addr, uint size, ux_t &data) {
+	if (uint8_t *host = memmap ? memmap->host_byte(addr, false) : nullptr) {
+		data = size == 4 ? le_load32(host) : size == 2 ? le_load16(host) : *host;
+		return true;
+	}
+	csr.count_event(HPM_EVENT_MMIO);
+	if (size == 1) {
+		std::optional<uint8_t> r = mem.r8(addr);
+		data = r ? *r : 0;
+		return r.has_value();
+	} else if (size == 2) {
+		std::optional<uint16_t> r = mem.r16(addr);
+		data = r ? *r : 0;
+		return r.has_value();
+	} else {
+		std::optional<uint32_t> r = mem.r32(addr);
+		data = r ? *r : 0;
+		return r.has_value();
+	}
 }
 
-static inline ux_t imm_u(uint32_t instr) {
-	return instr & 0xfffff000u;
+bool RVCore::ram_words_ok(ux_t addr, uint n, uint permissions) {
+	// Armed fault rules must see each word as a separate access
+	if (faults_armed())
+		return false;
+	if (addr < ram_base || addr > ram_top || ram_top - addr < 4 * n)
+		return false;
+	return n == 0 || (csr.get_pmp_xwr_range(addr, 4 * n) & permissions) == permissions;
 }
 
-static inline ux_t imm_b(uint32_t instr) {
-	return (instr >> 7 & 0x1e)
-		+ (instr >> 20 & 0x7e0)
-		+ (instr << 4 & 0x800)
-		- (instr >> 19 & 0x1000);
+bool RVCore::write_slow(ux_t addr, uint size, ux_t data) {
+	if (uint8_t *host = memmap ? memmap->host_byte(addr, true) : nullptr) {
+		le_store_bytes(host, data, size);
+		return true;
+	}
+	csr.count_event(HPM_EVENT_MMIO);
+	if (size == 1)
+		return mem.w8(addr, data);
+	else if (size == 2)
+		return mem.w16(addr, data);
+	else
+		return mem.w32(addr, data);
 }
 
-static inline ux_t imm_j(uint32_t instr) {
-	return (instr >> 20 & 0x7fe)
-		+ (instr >> 9 & 0x800)
-		+ (instr & 0xff000)
-		- (instr >> 11 & 0x100000);
-}
+const RVDecodedInstr *RVCore::fetch_decode(ux_t addr, RVDecodedInstr &scratch) {
+	DecodeCacheEntry &e = dcache[dcache_index(addr)];
+	if (e.pc == addr && e.pmp_gen == csr.get_pmp_gen() && e.priv == csr.get_true_priv()) {
+		return &e.d;
+	}
 
-static inline ux_t imm_ci(uint32_t instr) {
-	return GETBITS(instr, 6, 2) - (GETBIT(instr, 12) << 5);
-}
+	bool at_breakpoint = is_breakpoint(addr);
+	if (at_breakpoint && addr != bp_ignore_pc) {
+		return nullptr;
+	}
+	// Likewise a trigger, which step() turns into an ebreak exception
+	bool at_trigger = is_trigger_pc(addr);
+	if (at_trigger && csr.trigger_fires(addr)) {
+		return nullptr;
+	}
 
-static inline ux_t imm_cj(uint32_t instr) {
-	return -(GETBIT(instr, 12) << 11)
-		+ (GETBIT(instr, 11) << 4)
-		+ (GETBITS(instr, 10, 9) << 8)
-		+ (GETBIT(instr, 8) << 10)
-		+ (GETBIT(instr, 7) << 6)
-		+ (GETBIT(instr, 6) << 7)
-		+ (GETBITS(instr, 5, 3) << 1)
-		+ (GETBIT(instr, 2) << 5);
-}
+	ux_t fetch0, fetch1;
+	if (!r16(addr, fetch0, 0x4u)) {
+		return nullptr;
+	}
+	uint32_t instr = fetch0;
+	if ((instr & 0x3) == 0x3) {
+		if (!r16(addr + 2, fetch1, 0x4u) || csr.get_pmp_match(addr) != csr.get_pmp_match(addr + 2)) {
+			return nullptr;
+		}
+		instr |= fetch1 << 16;
+	}
 
-static inline ux_t imm_cb(uint32_t instr) {
-	return -(GETBIT(instr, 12) << 8)
-		+ (GETBITS(instr, 11, 10) << 3)
-		+ (GETBITS(instr, 6, 5) << 6)
-		+ (GETBITS(instr, 4, 3) << 1)
-		+ (GETBIT(instr, 2) << 5);
+	RVDecodedInstr d = rv_decode(instr, csr.get_config().ext);
+	if (addr >= ram_base && (uint64_t)addr + d.len <= ram_top && !at_breakpoint && !at_trigger) {
+		e.pc = addr;
+		e.pmp_gen = csr.get_pmp_gen();
+		e.priv = csr.get_true_priv();
+		e.d = d;
+		return &e.d;
+	} else {
+		scratch = d;
+		return &scratch;
+	}
 }
 
-static inline uint c_rs1_s(uint32_t instr) {
-	return GETBITS(instr, 9, 7) + 8;
+bool RVCore::at_self_loop() {
+	RVDecodedInstr scratch;
+	const RVDecodedInstr *d = fetch_decode(pc, scratch);
+	if (!d || d->imm != 0)
+		return false;
+	ux_t rs1 = regs[d->rs1], rs2 = regs[d->rs2];
+	switch (d->op) {
+	case RVOP_JAL:  return true;
+	case RVOP_BEQ:  return rs1 == rs2;
+	case RVOP_BNE:  return rs1 != rs2;
+	case RVOP_BLT:  return (sx_t)rs1 < (sx_t)rs2;
+	case RVOP_BGE:  return (sx_t)rs1 >= (sx_t)rs2;
+	case RVOP_BLTU: return rs1 < rs2;
+	case RVOP_BGEU: return rs1 >= rs2;
+	default:        return false;
+	}
 }
 
-static inline uint c_rs2_s(uint32_t instr) {
-	return GETBITS(instr, 4, 2) + 8;
-}
+// Execute a decoded instruction. Memory, CSR and trap state are updated
+// directly, but the GPR and pc updates are returned in `r`, so that the caller
+// can trace them and apply them in the right order. The trace fields of `r`
+// are only written when TRACE is set.
+template <bool TRACE>
+inline __attribute__((always_inline)) void RVCore::execute(const RVDecodedInstr *d, ExecResult &r) {
+
+	ux_t &rd_wdata = r.rd_wdata;
+	ux_t &pc_wdata = r.pc_wdata;
+	bool &pc_write = r.pc_write;
+	uint &exception_cause = r.exception_cause;
+	uint &trace_csr_addr = r.trace_csr_addr;
+	uint &trace_priv = r.trace_priv;
+	uint &regnum_rd = r.regnum_rd;
+	regnum_rd = d->rd;
+
+	ux_t rs1 = regs[d->rs1];
+	ux_t rs2 = regs[d->rs2];
+	ux_t imm = d->imm;
+
+	// Without C, a jump to an address which is not word-aligned traps (on
+	// the jump, rather than the fetch)
+	auto jump = [&](ux_t target) {
+		if ((target & 0x2u) && !csr.get_config().has(RVConfig::EXT_C)) {
+			exception_cause = XCAUSE_INSTR_MISALIGN;
+		} else {
+			pc_write = true;
+			pc_wdata = target;
+		}
+	};
 
-static inline uint c_rs1_l(uint32_t instr) {
-	return GETBITS(instr, 11, 7);
-}
+	// The rd field of a branch is part of the offset
+	auto branch = [&](bool taken) {
+		regnum_rd = 0;
+		if (taken)
+			jump(pc + imm);
+	};
 
-static inline uint c_rs2_l(uint32_t instr) {
-	return GETBITS(instr, 6, 2);
-}
+	switch (d->op) {
 
-static inline uint zcmp_n_regs(uint32_t instr) {
-	uint rlist = GETBITS(instr, 7, 4);
-	return rlist == 0xf ? 13 : rlist - 3;
-}
+	// RV32I, M, Zba, Zbb, Zbc, Zbs, Zbkb ALU ops (see rv_alu.h)
 
-static inline uint zcmp_stack_adj(uint32_t instr) {
-	uint nregs = zcmp_n_regs(instr);
-	uint adj_base =
-		nregs > 12 ? 0x40 :
-		nregs >  8 ? 0x30 :
-		nregs >  4 ? 0x20 : 0x10;
-	return adj_base + 16 * GETBITS(instr, 3, 2);
+#define ALU_CASE(name) case RVOP_ ## name: rd_wdata = rv_alu<RVOP_ ## name>(rs1, rs2, imm); break;
+	RV_ALU_OPS(ALU_CASE)
+#undef ALU_CASE
 
-}
+	// Xh3bextm (imm is field size)
 
-static inline uint32_t zcmp_reg_mask(uint32_t instr) {
-	uint32_t mask = 0;
-	switch (zcmp_n_regs(instr)) {
-		case 13: mask |= 1u << 27; // s11
-		         mask |= 1u << 26; // s10
-		         // fall through
-		case 11: mask |= 1u << 25; // s9
-		         // fall through
-		case 10: mask |= 1u << 24; // s8
-		         // fall through
-		case  9: mask |= 1u << 23; // s7
-		         // fall through
-		case  8: mask |= 1u << 22; // s6
-		         // fall through
-		case  7: mask |= 1u << 21; // s5
-		         // fall through
-		case  6: mask |= 1u << 20; // s4
-		         // fall through
-		case  5: mask |= 1u << 19; // s3
-		         // fall through
-		case  4: mask |= 1u << 18; // s2
-		         // fall through
-		case  3: mask |= 1u <<  9; // s1
-		         // fall through
-		case  2: mask |= 1u <<  8; // s0
-		         // fall through
-		case  1: mask |= 1u <<  1; // ra
-	}
-	return mask;
-}
+	case RVOP_H3_BEXTM:
+		rd_wdata = (rs1 >> (rs2 & 0x1f)) & ~(-1u << imm);
+		break;
 
-static inline uint zcmp_s_mapping(uint s_raw) {
-	return s_raw + 8 + 8 * ((s_raw & 0x6) != 0);
-}
+	case RVOP_H3_BEXTMI:
+		rd_wdata = (rs1 >> d->rs2) & ~(-1u << imm);
+		break;
 
-void RVCore::step(bool trace) {
+	// Control transfer
 
-	std::optional<ux_t> rd_wdata;
-	std::optional<ux_t> pc_wdata;
-	std::optional<uint> exception_cause;
-	uint regnum_rd = 0;
+	case RVOP_BEQ:  branch(rs1 == rs2);             break;
+	case RVOP_BNE:  branch(rs1 != rs2);             break;
+	case RVOP_BLT:  branch((sx_t)rs1 < (sx_t)rs2);  break;
+	case RVOP_BGE:  branch((sx_t)rs1 >= (sx_t)rs2); break;
+	case RVOP_BLTU: branch(rs1 < rs2);              break;
+	case RVOP_BGEU: branch(rs1 >= rs2);             break;
 
-	std::optional<ux_t> trace_csr_addr;
-	std::optional<uint> trace_priv;
+	case RVOP_JAL:
+		rd_wdata = pc + d->len;
+		jump(pc + imm);
+		break;
 
-	std::optional<uint16_t> fetch0 = r16(pc, 0x4u);
-	std::optional<uint16_t> fetch1 = r16(pc + 2, 0x4u);
-	uint32_t instr = *fetch0 | ((uint32_t)*fetch1 << 16);
+	case RVOP_JALR:
+		rd_wdata = pc + d->len;
+		jump((rs1 + imm) & -2u);
+		break;
 
-	uint opc = instr >> 2 & 0x1f;
-	uint funct3 = instr >> 12 & 0x7;
-	uint funct7 = instr >> 25 & 0x7f;
+	case RVOP_LUI:
+		rd_wdata = imm;
+		break;
 
-	bool pmp_straddle = false;
-	if (fetch0 && (*fetch0 & 0x3) == 0x3) {
-		pmp_straddle = csr.get_pmp_match(pc) != csr.get_pmp_match(pc + 2);
-	}
+	case RVOP_AUIPC:
+		rd_wdata = pc + imm;
+		break;
 
-	std::optional<ux_t> irq_target_pc = csr.trap_check_enter_irq(pc);
-	if (irq_target_pc) {
-		// Replace current instruction with IRQ entry
-		stalled_on_wfi = false;
-	} else if (stalled_on_wfi) {
-		// Replace current instruction with jump-to-self
-		pc_wdata = pc;
-	} else if (!fetch0 || ((*fetch0 & 0x3) == 0x3 && (!fetch1 || pmp_straddle))) {
-		exception_cause = XCAUSE_INSTR_FAULT;
-	} else if ((instr & 0x3) == 0x3) {
-		// 32-bit instruction
-		uint regnum_rs1 = instr >> 15 & 0x1f;
-		uint regnum_rs2 = instr >> 20 & 0x1f;
-		regnum_rd       = instr >> 7 & 0x1f;
-		ux_t rs1 = regs[regnum_rs1];
-		ux_t rs2 = regs[regnum_rs2];
-		switch (opc) {
-
-		case OPC_OP: {
-			if (funct7 == 0b00'00000) {
-				if (funct3 == 0b000)
-					rd_wdata = rs1 + rs2;
-				else if (funct3 == 0b001)
-					rd_wdata = rs1 << (rs2 & 0x1f);
-				else if (funct3 == 0b010)
-					rd_wdata = (sx_t)rs1 < (sx_t)rs2;
-				else if (funct3 == 0b011)
-					rd_wdata = rs1 < rs2;
-				else if (funct3 == 0b100)
-					rd_wdata = rs1 ^ rs2;
-				else if (funct3 == 0b101)
-					rd_wdata = rs1  >> (rs2 & 0x1f);
-				else if (funct3 == 0b110)
-					rd_wdata = rs1 | rs2;
-				else if (funct3 == 0b111)
-					rd_wdata = rs1 & rs2;
-				else
-					exception_cause = XCAUSE_INSTR_ILLEGAL;
-			} else if (funct7 == 0b00'00001) {
-				if (funct3 < 0b100) {
-					sdx_t mul_op_a = rs1;
-					sdx_t mul_op_b = rs2;
-					if (funct3 != 0b011)
-						mul_op_a -= (mul_op_a & (1 << (XLEN - 1))) << 1;
-					if (funct3 < 0b010)
-						mul_op_b -= (mul_op_b & (1 << (XLEN - 1))) << 1;
-					sdx_t mul_result = mul_op_a * mul_op_b;
-					if (funct3 == 0b000)
-						rd_wdata = mul_result;
-					else
-						rd_wdata = mul_result >> XLEN;
-				}
-				else {
-					if (funct3 == 0b100) {
-						if (rs2 == 0)
-							rd_wdata = -1;
-						else if (rs2 == ~0u)
-							rd_wdata = -rs1;
-						else
-							rd_wdata = (sx_t)rs1 / (sx_t)rs2;
-					}
-					else if (funct3 == 0b101) {
-						rd_wdata = rs2 ? rs1 / rs2 : ~0ul;
-					}
-					else if (funct3 == 0b110) {
-						if (rs2 == 0)
-							rd_wdata = rs1;
-						else if (rs2 == ~0u) // potential overflow of division
-							rd_wdata = 0;
-						else
-							rd_wdata = (sx_t)rs1 % (sx_t)rs2;
-					}
-					else if (funct3 == 0b111) {
-						rd_wdata = rs2 ? rs1 % rs2 : rs1;
-					}
-				}
-			} else if (funct7 == 0b01'00000) {
-				if (funct3 == 0b000)
-					rd_wdata = rs1 - rs2;
-				else if (funct3 == 0b100)
-					rd_wdata = rs1 ^ ~rs2; // Zbb xnor
-				else if (funct3 == 0b101)
-					rd_wdata = (sx_t)rs1 >> (rs2 & 0x1f);
-				else if (funct3 == 0b110)
-					rd_wdata = rs1 | ~rs2; // Zbb orn
-				else if (funct3 == 0b111)
-					rd_wdata = rs1 & ~rs2; // Zbb andn
-				else
-					exception_cause = XCAUSE_INSTR_ILLEGAL;
-			} else if (RVOPC_MATCH(instr, BCLR)) {
-				rd_wdata = rs1 & ~(1u << (rs2 & 0x1f));
-			} else if (RVOPC_MATCH(instr, BEXT)) {
-				rd_wdata = (rs1 >> (rs2 & 0x1f)) & 0x1u;
-			} else if (RVOPC_MATCH(instr, BINV)) {
-				rd_wdata = rs1 ^ (1u << (rs2 & 0x1f));
-			} else if (RVOPC_MATCH(instr, BSET)) {
-				rd_wdata = rs1 | (1u << (rs2 & 0x1f));
-			} else if (RVOPC_MATCH(instr, SH1ADD)) {
-				rd_wdata = (rs1 << 1) + rs2;
-			} else if (RVOPC_MATCH(instr, SH2ADD)) {
-				rd_wdata = (rs1 << 2) + rs2;
-			} else if (RVOPC_MATCH(instr, SH3ADD)) {
-				rd_wdata = (rs1 << 3) + rs2;
-			} else if (RVOPC_MATCH(instr, MAX)) {
-				rd_wdata = (sx_t)rs1 > (sx_t)rs2 ? rs1 : rs2;
-			} else if (RVOPC_MATCH(instr, MAXU)) {
-				rd_wdata = rs1 > rs2 ? rs1 : rs2;
-			} else if (RVOPC_MATCH(instr, MIN)) {
-				rd_wdata = (sx_t)rs1 < (sx_t)rs2 ? rs1 : rs2;
-			} else if (RVOPC_MATCH(instr, MINU)) {
-				rd_wdata = rs1 < rs2 ? rs1 : rs2;
-			} else if (RVOPC_MATCH(instr, ROR)) {
-				uint shamt = rs2 & 0x1f;
-				rd_wdata = shamt ? (rs1 >> shamt) | (rs1 << (32 - shamt)) : rs1;
-			} else if (RVOPC_MATCH(instr, ROL)) {
-				uint shamt = rs2 & 0x1f;
-				rd_wdata = shamt ? (rs1 << shamt) | (rs1 >> (32 - shamt)) : rs1;
-			} else if (RVOPC_MATCH(instr, PACK)) {
-				rd_wdata = (rs1 & 0xffffu) | (rs2 << 16);
-			} else if (RVOPC_MATCH(instr, PACKH)) {
-				rd_wdata = (rs1 & 0xffu) | ((rs2 & 0xffu) << 8);
-			} else if (RVOPC_MATCH(instr, CLMUL) || RVOPC_MATCH(instr, CLMULH) || RVOPC_MATCH(instr, CLMULR)) {
-				uint64_t product = 0;
-				for (int i = 0; i < 32; ++i) {
-					if (rs2 & (1u << i)) {
-						product ^= (uint64_t)rs1 << i;
-					}
-				}
-				if (RVOPC_MATCH(instr, CLMUL)) {
-					rd_wdata = product;
-				} else if (RVOPC_MATCH(instr, CLMULH)) {
-					rd_wdata = product >> 32;
-				} else {
-					rd_wdata = product >> 31;
-				}
-			} else {
-				exception_cause = XCAUSE_INSTR_ILLEGAL;
-			}
-			break;
+	// Loads and stores
+
+	case RVOP_LB:
+	case RVOP_LH:
+	case RVOP_LW:
+	case RVOP_LBU:
+	case RVOP_LHU: {
+		csr.count_event(HPM_EVENT_LOAD);
+		ux_t load_addr = rs1 + imm;
+		ux_t align_mask =
+			d->op == RVOP_LW ? 0x3u :
+			d->op == RVOP_LH || d->op == RVOP_LHU ? 0x1u : 0x0u;
+		if (load_addr & align_mask) {
+			exception_cause = XCAUSE_LOAD_ALIGN;
+		} else if (!(d->op == RVOP_LW ? r32(load_addr, rd_wdata) :
+				align_mask ? r16(load_addr, rd_wdata) : r8(load_addr, rd_wdata))) {
+			exception_cause = XCAUSE_LOAD_FAULT;
+		} else if (d->op == RVOP_LB) {
+			rd_wdata = sext(rd_wdata, 7);
+		} else if (d->op == RVOP_LH) {
+			rd_wdata = sext(rd_wdata, 15);
 		}
+		break;
+	}
 
-		case OPC_OP_IMM: {
-			ux_t imm = imm_i(instr);
-			if (funct3 == 0b000)
-				rd_wdata = rs1 + imm;
-			else if (funct3 == 0b010)
-				rd_wdata = !!((sx_t)rs1 < (sx_t)imm);
-			else if (funct3 == 0b011)
-				rd_wdata = !!(rs1 < imm);
-			else if (funct3 == 0b100)
-				rd_wdata = rs1 ^ imm;
-			else if (funct3 == 0b110)
-				rd_wdata = rs1 | imm;
-			else if (funct3 == 0b111)
-				rd_wdata = rs1 & imm;
-			else if (funct3 == 0b001 || funct3 == 0b101) {
-				// shamt is regnum_rs2
-				if (funct7 == 0b00'00000 && funct3 == 0b001) {
-					rd_wdata = rs1 << regnum_rs2;
-				} else if (funct7 == 0b00'00000 && funct3 == 0b101) {
-					rd_wdata = rs1 >> regnum_rs2;
-				} else if (funct7 == 0b01'00000 && funct3 == 0b101) {
-					rd_wdata = (sx_t)rs1 >> regnum_rs2;
-				} else if (RVOPC_MATCH(instr, BCLRI)) {
-					rd_wdata = rs1 & ~(1u << regnum_rs2);
-				} else if (RVOPC_MATCH(instr, BINVI)) {
-					rd_wdata = rs1 ^ (1u << regnum_rs2);
-				} else if (RVOPC_MATCH(instr, BSETI)) {
-					rd_wdata = rs1 | (1u << regnum_rs2);
-				} else if (RVOPC_MATCH(instr, CLZ)) {
-					rd_wdata = rs1 ? __builtin_clz(rs1) : 32;
-				} else if (RVOPC_MATCH(instr, CPOP)) {
-					rd_wdata = __builtin_popcount(rs1);
-				} else if (RVOPC_MATCH(instr, CTZ)) {
-					rd_wdata = rs1 ? __builtin_ctz(rs1) : 32;
-				} else if (RVOPC_MATCH(instr, SEXT_B)) {
-					rd_wdata = (rs1 & 0xffu) - ((rs1 & 0x80u) << 1);
-				} else if (RVOPC_MATCH(instr, SEXT_H)) {
-					rd_wdata = (rs1 & 0xffffu) - ((rs1 & 0x8000u) << 1);
-				} else if (RVOPC_MATCH(instr, ZIP)) {
-					ux_t accum = 0;
-					for (int i = 0; i < 32; ++i) {
-						if (rs1 & (1u << i)) {
-							accum |= 1u << ((i >> 4) | ((i & 0xf) << 1));
-						}
-					}
-					rd_wdata = accum;
-				} else if (RVOPC_MATCH(instr, UNZIP)) {
-					ux_t accum = 0;
-					for (int i = 0; i < 32; ++i) {
-						if (rs1 & (1u << i)) {
-							accum |= 1u << ((i >> 1) | ((i & 1) << 4));
-						}
-					}
-					rd_wdata = accum;
-				} else if (RVOPC_MATCH(instr, BEXTI)) {
-					rd_wdata = (rs1 >> regnum_rs2) & 0x1u;
-				} else if (RVOPC_MATCH(instr, BREV8)) {
-					rd_wdata =
-						((rs1 & 0x80808080u) >> 7) | ((rs1 & 0x01010101u) << 7) |
-						((rs1 & 0x40404040u) >> 5) | ((rs1 & 0x02020202u) << 5) |
-						((rs1 & 0x20202020u) >> 3) | ((rs1 & 0x04040404u) << 3) |
-						((rs1 & 0x10101010u) >> 1) | ((rs1 & 0x08080808u) << 1);
-				} else if (RVOPC_MATCH(instr, ORC_B)) {
-					rd_wdata =
-						(rs1 & 0xff000000u ? 0xff000000u : 0u) |
-						(rs1 & 0x00ff0000u ? 0x00ff0000u : 0u) |
-						(rs1 & 0x0000ff00u ? 0x0000ff00u : 0u) |
-						(rs1 & 0x000000ffu ? 0x000000ffu : 0u);
-				} else if (RVOPC_MATCH(instr, REV8)) {
-					rd_wdata = __builtin_bswap32(rs1);
-				} else if (RVOPC_MATCH(instr, RORI)) {
-					rd_wdata = regnum_rs2 ? ((rs1 << (32 - regnum_rs2)) | (rs1 >> regnum_rs2)) : rs1;
-				} else {
-					exception_cause = XCAUSE_INSTR_ILLEGAL;
-				}
-			}
-			else {
-				exception_cause = XCAUSE_INSTR_ILLEGAL;
+	case RVOP_SB:
+	case RVOP_SH:
+	case RVOP_SW: {
+		csr.count_event(HPM_EVENT_STORE);
+		// The rd field of a store is part of the offset
+		regnum_rd = 0;
+		ux_t store_addr = rs1 + imm;
+		ux_t align_mask = d->op == RVOP_SW ? 0x3u : d->op == RVOP_SH ? 0x1u : 0x0u;
+		if (store_addr & align_mask) {
+			exception_cause = XCAUSE_STORE_ALIGN;
+		} else {
+			bool success =
+				d->op == RVOP_SB ? w8(store_addr, rs2 & 0xffu) :
+				d->op == RVOP_SH ? w16(store_addr, rs2 & 0xffffu) : w32(store_addr, rs2);
+			if (!success) {
+				exception_cause = XCAUSE_STORE_FAULT;
 			}
-			break;
 		}
+		break;
+	}
 
-		case OPC_BRANCH: {
-			ux_t target = pc + imm_b(instr);
-			bool taken = false;
-			if ((funct3 & 0b110) == 0b000)
-				taken = rs1 == rs2;
-			else if ((funct3 & 0b110) == 0b100)
-				taken = (sx_t)rs1 < (sx_t) rs2;
-			else if ((funct3 & 0b110) == 0b110)
-				taken = rs1 < rs2;
-			else
-				exception_cause = XCAUSE_INSTR_ILLEGAL;
-			if (!exception_cause && funct3 & 0b001)
-				taken = !taken;
-			if (taken)
-				pc_wdata = target;
-			break;
+	// Compressed loads/stores which are not identical to their 32-bit
+	// counterparts (no alignment check on c.lw/c.sw, and c.sh reports
+	// misalignment as a load alignment fault)
+
+	case RVOP_C_LW:
+		csr.count_event(HPM_EVENT_LOAD);
+		if (!r32(rs1 + imm, rd_wdata)) {
+			exception_cause = XCAUSE_LOAD_FAULT;
 		}
+		break;
 
-		case OPC_LOAD: {
-			ux_t load_addr = rs1 + imm_i(instr);
-			ux_t align_mask = ~(-1u << (funct3 & 0x3));
-			bool misalign = load_addr & align_mask;
-			if (funct3 == 0b011 || funct3 > 0b101) {
-				exception_cause = XCAUSE_INSTR_ILLEGAL;
-			} else if (misalign) {
-				exception_cause = XCAUSE_LOAD_ALIGN;
-			} else if (funct3 == 0b000) {
-				rd_wdata = r8(load_addr);
-				if (rd_wdata) {
-					rd_wdata = sext(*rd_wdata, 7);
-				} else {
-					exception_cause = XCAUSE_LOAD_FAULT;
-				}
-			} else if (funct3 == 0b001) {
-				rd_wdata = r16(load_addr);
-				if (rd_wdata) {
-					rd_wdata = sext(*rd_wdata, 15);
-				} else {
-					exception_cause = XCAUSE_LOAD_FAULT;
-				}
-			} else if (funct3 == 0b010) {
-				rd_wdata = r32(load_addr);
-				if (!rd_wdata) {
-					exception_cause = XCAUSE_LOAD_FAULT;
-				}
-			} else if (funct3 == 0b100) {
-				rd_wdata = r8(load_addr);
-				if (!rd_wdata) {
-					exception_cause = XCAUSE_LOAD_FAULT;
-				}
-			} else if (funct3 == 0b101) {
-				rd_wdata = r16(load_addr);
-				if (!rd_wdata) {
-					exception_cause = XCAUSE_LOAD_FAULT;
-				}
-			}
-			break;
+	case RVOP_C_SW:
+		csr.count_event(HPM_EVENT_STORE);
+		if (!w32(rs1 + imm, rs2)) {
+			exception_cause = XCAUSE_STORE_FAULT;
 		}
+		break;
 
-		case OPC_STORE: {
-			ux_t store_addr = rs1 + imm_s(instr);
-			ux_t align_mask = ~(-1u << (funct3 & 0x3));
-			bool misalign = store_addr & align_mask;
-			if (funct3 > 0b010) {
-				exception_cause = XCAUSE_INSTR_ILLEGAL;
-			} else if (misalign) {
-				exception_cause = XCAUSE_STORE_ALIGN;
-			} else {
-				if (funct3 == 0b000) {
-					if (!w8(store_addr, rs2 & 0xffu)) {
-						exception_cause = XCAUSE_STORE_FAULT;
-					}
-				} else if (funct3 == 0b001) {
-					if (!w16(store_addr, rs2 & 0xffffu)) {
-						exception_cause = XCAUSE_STORE_FAULT;
-					}
-				} else if (funct3 == 0b010) {
-					if (!w32(store_addr, rs2)) {
-						exception_cause = XCAUSE_STORE_FAULT;
-					}
-				}
-			}
-			break;
+	case RVOP_C_SH: {
+		csr.count_event(HPM_EVENT_STORE);
+		uint32_t addr = rs1 + imm;
+		if (addr & 0x1u) {
+			exception_cause = XCAUSE_LOAD_ALIGN;
+		} else if (!w16(addr, rs2)) {
+			exception_cause = XCAUSE_STORE_FAULT;
 		}
+		break;
+	}
 
-		case OPC_AMO: {
-			if (RVOPC_MATCH(instr, LR_W)) {
-				if (rs1 & 0x3) {
-					exception_cause = XCAUSE_LOAD_ALIGN;
-				} else {
-					rd_wdata = r32(rs1);
-					if (rd_wdata) {
-						load_reserved = true;
-					} else {
-						exception_cause = XCAUSE_LOAD_FAULT;
-					}
-				}
-			} else if (RVOPC_MATCH(instr, SC_W)) {
-				if (rs1 & 0x3) {
-					exception_cause = XCAUSE_STORE_ALIGN;
-				} else {
-					if (load_reserved) {
-						load_reserved = false;
-						if (w32(rs1, rs2)) {
-							rd_wdata = 0;
-						} else {
-							exception_cause = XCAUSE_STORE_FAULT;
-						}
-					} else {
-						rd_wdata = 1;
-					}
-				}
-			} else if (
-					RVOPC_MATCH(instr, AMOSWAP_W) ||
-					RVOPC_MATCH(instr, AMOADD_W) ||
-					RVOPC_MATCH(instr, AMOXOR_W) ||
-					RVOPC_MATCH(instr, AMOAND_W) ||
-					RVOPC_MATCH(instr, AMOOR_W) ||
-					RVOPC_MATCH(instr, AMOMIN_W) ||
-					RVOPC_MATCH(instr, AMOMAX_W) ||
-					RVOPC_MATCH(instr, AMOMINU_W) ||
-					RVOPC_MATCH(instr, AMOMAXU_W)) {
-				if (rs1 & 0x3) {
-					exception_cause = XCAUSE_STORE_ALIGN;
-				} else {
-					rd_wdata = r32(rs1);
-					if (!rd_wdata) {
-						exception_cause = XCAUSE_STORE_FAULT; // Yes, AMO/Store
-					} else {
-						bool write_success = false;
-						switch (instr & RVOPC_AMOSWAP_W_MASK) {
-							case RVOPC_AMOSWAP_W_BITS: write_success = w32(rs1, rs2);                                            break;
-							case RVOPC_AMOADD_W_BITS:  write_success = w32(rs1, *rd_wdata + rs2);                                break;
-							case RVOPC_AMOXOR_W_BITS:  write_success = w32(rs1, *rd_wdata ^ rs2);                                break;
-							case RVOPC_AMOAND_W_BITS:  write_success = w32(rs1, *rd_wdata & rs2);                                break;
-							case RVOPC_AMOOR_W_BITS:   write_success = w32(rs1, *rd_wdata | rs2);                                break;
-							case RVOPC_AMOMIN_W_BITS:  write_success = w32(rs1, (sx_t)*rd_wdata < (sx_t)rs2 ? *rd_wdata : rs2);  break;
-							case RVOPC_AMOMAX_W_BITS:  write_success = w32(rs1, (sx_t)*rd_wdata > (sx_t)rs2 ? *rd_wdata : rs2);  break;
-							case RVOPC_AMOMINU_W_BITS: write_success = w32(rs1, *rd_wdata < rs2 ? *rd_wdata : rs2);              break;
-							case RVOPC_AMOMAXU_W_BITS: write_success = w32(rs1, *rd_wdata > rs2 ? *rd_wdata : rs2);              break;
-							default:                   assert(false);                                                break;
-						}
-						if (!write_success) {
-							exception_cause = XCAUSE_STORE_FAULT;
-							rd_wdata = {};
-						}
-					}
+	// A extension
+
+	case RVOP_LR_W: {
+		csr.count_event(HPM_EVENT_LOAD);
+		auto guard = lock_monitor();
+		if (rs1 & 0x3) {
+			exception_cause = XCAUSE_LOAD_ALIGN;
+		} else {
+			excl_failed = false;
+			if (r32(rs1, rd_wdata, 0x1u, true)) {
+				// No reservation if the read was failed with hexokay low
+				load_reserved = !excl_failed;
+				if (monitor && !excl_failed) {
+					monitor->excl_read(hartid, rs1);
 				}
 			} else {
-				exception_cause = XCAUSE_INSTR_ILLEGAL;
+				exception_cause = XCAUSE_LOAD_FAULT;
 			}
-			break;
 		}
+		break;
+	}
 
-		case OPC_JAL:
-			rd_wdata = pc + 4;
-			pc_wdata = pc + imm_j(instr);
-			break;
-
-		case OPC_JALR:
-			rd_wdata = pc + 4;
-			pc_wdata = (rs1 + imm_i(instr)) & -2u;
-			break;
-
-		case OPC_LUI:
-			rd_wdata = imm_u(instr);
-			break;
-
-		case OPC_AUIPC:
-			rd_wdata = pc + imm_u(instr);
-			break;
-
-		case OPC_SYSTEM: {
-			uint16_t csr_addr = instr >> 20;
-			if (funct3 >= 0b001 && funct3 <= 0b011) {
-				// csrrw, csrrs, csrrc
-				uint write_op = funct3 - 0b001;
-				if (write_op != RVCSR::WRITE || regnum_rd != 0) {
-					rd_wdata = csr.read(csr_addr);
-					if (!rd_wdata) {
-						exception_cause = XCAUSE_INSTR_ILLEGAL;
-					}
-				}
-				if (write_op == RVCSR::WRITE || regnum_rs1 != 0) {
-					if (!csr.write(csr_addr, rs1, write_op)) {
-						exception_cause = XCAUSE_INSTR_ILLEGAL;
-					} else if (trace) {
-						trace_csr_addr = csr_addr;
-					}
-				}
-			}
-			else if (funct3 >= 0b101 && funct3 <= 0b111) {
-				// csrrwi, csrrsi, csrrci
-				uint write_op = funct3 - 0b101;
-				if (write_op != RVCSR::WRITE || regnum_rd != 0) {
-					rd_wdata = csr.read(csr_addr);
-					if (!rd_wdata) {
-						exception_cause = XCAUSE_INSTR_ILLEGAL;
-					}
-				}
-				if (write_op == RVCSR::WRITE || regnum_rs1 != 0) {
-					if (!csr.write(csr_addr, regnum_rs1, write_op)) {
-						exception_cause = XCAUSE_INSTR_ILLEGAL;
-					} else if (trace) {
-						trace_csr_addr = csr_addr;
-					}
-				}
-			} else if (RVOPC_MATCH(instr, MRET)) {
-				if (csr.get_true_priv() == PRV_M) {
-					pc_wdata = csr.trap_mret();
-					trace_priv = csr.get_true_priv();
-				} else {
-					exception_cause = XCAUSE_INSTR_ILLEGAL;
-				}
-			} else if (RVOPC_MATCH(instr, ECALL)) {
-				exception_cause = XCAUSE_ECALL_U + csr.get_true_priv();
-			} else if (RVOPC_MATCH(instr, EBREAK)) {
-				exception_cause = XCAUSE_EBREAK;
-			} else if (RVOPC_MATCH(instr, WFI)) {
-				if (csr.get_true_priv() == PRV_U && csr.get_mstatus_tw()) {
-					exception_cause = XCAUSE_INSTR_ILLEGAL;
+	case RVOP_SC_W: {
+		csr.count_event(HPM_EVENT_STORE);
+		auto guard = lock_monitor();
+		if (rs1 & 0x3) {
+			exception_cause = XCAUSE_STORE_ALIGN;
+		} else {
+			// Succeeds only if both the local and the global monitor agree
+			if (load_reserved && (!monitor || monitor->excl_write(hartid, rs1))) {
+				load_reserved = false;
+				excl_failed = false;
+				if (w32(rs1, rs2, true)) {
+					rd_wdata = excl_failed;
 				} else {
-					stalled_on_wfi = true;
+					exception_cause = XCAUSE_STORE_FAULT;
 				}
 			} else {
-				exception_cause = XCAUSE_INSTR_ILLEGAL;
+				load_reserved = false;
+				rd_wdata = 1;
 			}
-			break;
-		}
-
-	case OPC_CUSTOM0: {
-		if (RVOPC_MATCH(instr, H3_BEXTM)) {
-			uint size = GETBITS(instr, 28, 26) + 1;
-			rd_wdata = (rs1 >> (rs2 & 0x1f)) & ~(-1u << size);
-		} else if (RVOPC_MATCH(instr, H3_BEXTMI)) {
-			uint size = GETBITS(instr, 28, 26) + 1;
-			rd_wdata = (rs1 >> regnum_rs2) & ~(-1u << size);
-		} else {
-			exception_cause = XCAUSE_INSTR_ILLEGAL;
 		}
 		break;
 	}
 
-		default:
-			exception_cause = XCAUSE_INSTR_ILLEGAL;
+	case RVOP_AMOSWAP_W:
+	case RVOP_AMOADD_W:
+	case RVOP_AMOXOR_W:
+	case RVOP_AMOAND_W:
+	case RVOP_AMOOR_W:
+	case RVOP_AMOMIN_W:
+	case RVOP_AMOMAX_W:
+	case RVOP_AMOMINU_W:
+	case RVOP_AMOMAXU_W: {
+		csr.count_event(HPM_EVENT_LOAD);
+		csr.count_event(HPM_EVENT_STORE);
+		auto guard = lock_monitor();
+		if (rs1 & 0x3) {
+			exception_cause = XCAUSE_STORE_ALIGN;
 			break;
 		}
-	} else if ((instr & 0x3) == 0x0) {
-		// RVC Quadrant 00:
-		if (RVOPC_MATCH(instr, ILLEGAL16)) {
-			exception_cause = XCAUSE_INSTR_ILLEGAL;
-		} else if (RVOPC_MATCH(instr, C_ADDI4SPN)) {
-			regnum_rd = c_rs2_s(instr);
-			rd_wdata = regs[2]
-				+ (GETBITS(instr, 12, 11) << 4)
-				+ (GETBITS(instr, 10, 7) << 6)
-				+ (GETBIT(instr, 6) << 2)
-				+ (GETBIT(instr, 5) << 3);
-		} else if (RVOPC_MATCH(instr, C_LW)) {
-			regnum_rd = c_rs2_s(instr);
-			uint32_t addr = regs[c_rs1_s(instr)]
-				+ (GETBIT(instr, 6) << 2)
-				+ (GETBITS(instr, 12, 10) << 3)
-				+ (GETBIT(instr, 5) << 6);
-			rd_wdata = r32(addr);
-			if (!rd_wdata) {
-				exception_cause = XCAUSE_LOAD_FAULT;
+		// If RAM is readable and writable here (and this isn't tohost), the
+		// read-modify-write is done in place with a single PMP check
+		uint8_t *host = rs1 != tohost_addr && ram_words_ok(rs1, 1, 0x3u) ? ram + (rs1 - ram_base) : nullptr;
+		if (host) {
+			rd_wdata = le_load32(host);
+			heatmap_count(rs1, MemHeatmap::READ);
+		}
+		excl_failed = false;
+		if (!host && (!r32(rs1, rd_wdata, 0x1u, true) || excl_failed)) {
+			exception_cause = XCAUSE_STORE_FAULT; // Yes, AMO/Store
+		} else {
+			ux_t amo_wdata = 0;
+			switch (d->op) {
+				case RVOP_AMOSWAP_W: amo_wdata = rs2;                                            break;
+				case RVOP_AMOADD_W:  amo_wdata = rd_wdata + rs2;                                break;
+				case RVOP_AMOXOR_W:  amo_wdata = rd_wdata ^ rs2;                                break;
+				case RVOP_AMOAND_W:  amo_wdata = rd_wdata & rs2;                                break;
+				case RVOP_AMOOR_W:   amo_wdata = rd_wdata | rs2;                                break;
+				case RVOP_AMOMIN_W:  amo_wdata = (sx_t)rd_wdata < (sx_t)rs2 ? rd_wdata : rs2;  break;
+				case RVOP_AMOMAX_W:  amo_wdata = (sx_t)rd_wdata > (sx_t)rs2 ? rd_wdata : rs2;  break;
+				case RVOP_AMOMINU_W: amo_wdata = rd_wdata < rs2 ? rd_wdata : rs2;              break;
+				case RVOP_AMOMAXU_W: amo_wdata = rd_wdata > rs2 ? rd_wdata : rs2;              break;
+				default:             assert(false);                                            break;
 			}
-		} else if (RVOPC_MATCH(instr, C_SW)) {
-			uint32_t addr = regs[c_rs1_s(instr)]
-				+ (GETBIT(instr, 6) << 2)
-				+ (GETBITS(instr, 12, 10) << 3)
-				+ (GETBIT(instr, 5) << 6);
-			if (!w32(addr, regs[c_rs2_s(instr)])) {
+			if (host) {
+				monitor_notify_write(rs1);
+				heatmap_count(rs1, MemHeatmap::WRITE);
+				le_store32(host, amo_wdata);
+				invalidate_decode_cache(rs1, 4);
+			} else if (!w32(rs1, amo_wdata, true)) {
 				exception_cause = XCAUSE_STORE_FAULT;
+			} else if (excl_failed) {
+				// The hardware retries from the read, so run it again
+				regnum_rd = 0;
+				pc_write = true;
+				pc_wdata = pc;
 			}
-		} else if (RVOPC_MATCH(instr, C_LBU)) {
-			// Zcb:
-			regnum_rd = c_rs2_s(instr);
-			uint32_t addr = regs[c_rs1_s(instr)]
-				+ (GETBIT(instr, 6) << 0)
-				+ (GETBIT(instr, 5) << 1);
-			rd_wdata = r8(addr);
-			if (!rd_wdata) {
-				exception_cause = XCAUSE_LOAD_FAULT;
-			}
-		} else if (RVOPC_MATCH(instr, C_LHU)) {
-			regnum_rd = c_rs2_s(instr);
-			uint32_t addr = regs[c_rs1_s(instr)] + (GETBIT(instr, 5) << 1);
-			if (addr & 0x1u) {
-				exception_cause = XCAUSE_LOAD_ALIGN;
-			} else {
-				rd_wdata = r16(addr);
-				if (!rd_wdata) {
-					exception_cause = XCAUSE_LOAD_FAULT;
-				}
-			}
-		} else if (RVOPC_MATCH(instr, C_LH)) {
-			regnum_rd = c_rs2_s(instr);
-			uint32_t addr = regs[c_rs1_s(instr)] + (GETBIT(instr, 5) << 1);
-			if (addr & 0x1u) {
-				exception_cause = XCAUSE_LOAD_ALIGN;
+		}
+		break;
+	}
+
+	// System instructions (imm is CSR address for CSR ops)
+
+	case RVOP_CSRRW:
+	case RVOP_CSRRS:
+	case RVOP_CSRRC:
+	case RVOP_CSRRWI:
+	case RVOP_CSRRSI:
+	case RVOP_CSRRCI: {
+		uint16_t csr_addr = imm;
+		bool is_imm = d->op >= RVOP_CSRRWI;
+		uint write_op = is_imm ? d->op - RVOP_CSRRWI : d->op - RVOP_CSRRW;
+		bool csr_write = write_op == RVCSR::WRITE || d->rs1 != 0;
+		ux_t csr_wdata = is_imm ? d->rs1 : rs1;
+		if (write_op != RVCSR::WRITE || regnum_rd != 0) {
+			std::optional<ux_t> rdata = csr.read(csr_addr, true, csr_wdata, csr_write ? write_op : (uint)RVCSR::NO_WRITE);
+			if (rdata) {
+				rd_wdata = *rdata;
 			} else {
-				rd_wdata = r16(addr);
-				if (rd_wdata) {
-					rd_wdata = sext(*rd_wdata, 15);
-				} else {
-					exception_cause = XCAUSE_LOAD_FAULT;
-				}
-			}
-		} else if (RVOPC_MATCH(instr, C_SB)) {
-			uint32_t addr = regs[c_rs1_s(instr)]
-				+ (GETBIT(instr, 6) << 0)
-				+ (GETBIT(instr, 5) << 1);
-			if (!w8(addr, regs[c_rs2_s(instr)])) {
-				exception_cause = XCAUSE_STORE_FAULT;
+				exception_cause = XCAUSE_INSTR_ILLEGAL;
 			}
-		} else if (RVOPC_MATCH(instr, C_SH)) {
-			uint32_t addr = regs[c_rs1_s(instr)] + (GETBIT(instr, 5) << 1);
-			if (addr & 0x1u) {
-				exception_cause = XCAUSE_LOAD_ALIGN;
-			} else if (!w16(addr, regs[c_rs2_s(instr)])) {
-				exception_cause = XCAUSE_STORE_FAULT;
+		}
+		if (csr_write) {
+			if (!csr.write(csr_addr, csr_wdata, write_op)) {
+				exception_cause = XCAUSE_INSTR_ILLEGAL;
+			} else if (TRACE) {
+				trace_csr_addr = csr_addr;
 			}
+		}
+		break;
+	}
+
+	case RVOP_MRET:
+		if (csr.get_true_priv() == PRV_M) {
+			pc_write = true;
+			pc_wdata = csr.trap_mret();
+			if (TRACE)
+				trace_priv = csr.get_true_priv();
 		} else {
 			exception_cause = XCAUSE_INSTR_ILLEGAL;
 		}
-	} else if ((instr & 0x3) == 0x1) {
-		// RVC Quadrant 01:
-		if (RVOPC_MATCH(instr, C_ADDI)) {
-			regnum_rd = c_rs1_l(instr);
-			rd_wdata = regs[c_rs1_l(instr)] + imm_ci(instr);
-		} else if (RVOPC_MATCH(instr, C_JAL)) {
-			pc_wdata = pc + imm_cj(instr);
-			regnum_rd = 1;
-			rd_wdata = pc + 2;
-		} else if (RVOPC_MATCH(instr, C_LI)) {
-			regnum_rd = c_rs1_l(instr);
-			rd_wdata = imm_ci(instr);
-		} else if (RVOPC_MATCH(instr, C_LUI)) {
-			regnum_rd = c_rs1_l(instr);
-			// ADDI16SPN if rd is sp
-			if (regnum_rd == 2) {
-				rd_wdata = regs[2]
-					- (GETBIT(instr, 12) << 9)
-					+ (GETBIT(instr, 6) << 4)
-					+ (GETBIT(instr, 5) << 6)
-					+ (GETBITS(instr, 4, 3) << 7)
-					+ (GETBIT(instr, 2) << 5);
-			} else {
-				rd_wdata = -(GETBIT(instr, 12) << 17)
-				+ (GETBITS(instr, 6, 2) << 12);
-			}
-		} else if (RVOPC_MATCH(instr, C_SRLI)) {
-			regnum_rd = c_rs1_s(instr);
-			rd_wdata = regs[regnum_rd] >> GETBITS(instr, 6, 2);
-		} else if (RVOPC_MATCH(instr, C_SRAI)) {
-			regnum_rd = c_rs1_s(instr);
-			rd_wdata = (sx_t)regs[regnum_rd] >> GETBITS(instr, 6, 2);
-		} else if (RVOPC_MATCH(instr, C_ANDI)) {
-			regnum_rd = c_rs1_s(instr);
-			rd_wdata = regs[regnum_rd] & imm_ci(instr);
-		} else if (RVOPC_MATCH(instr, C_SUB)) {
-			regnum_rd = c_rs1_s(instr);
-			rd_wdata = regs[c_rs1_s(instr)] - regs[c_rs2_s(instr)];
-		} else if (RVOPC_MATCH(instr, C_XOR)) {
-			regnum_rd = c_rs1_s(instr);
-			rd_wdata = regs[c_rs1_s(instr)] ^ regs[c_rs2_s(instr)];
-		} else if (RVOPC_MATCH(instr, C_OR)) {
-			regnum_rd = c_rs1_s(instr);
-			rd_wdata = regs[c_rs1_s(instr)] | regs[c_rs2_s(instr)];
-		} else if (RVOPC_MATCH(instr, C_AND)) {
-			regnum_rd = c_rs1_s(instr);
-			rd_wdata = regs[c_rs1_s(instr)] & regs[c_rs2_s(instr)];
-		} else if (RVOPC_MATCH(instr, C_J)) {
-			pc_wdata = pc + imm_cj(instr);
-		} else if (RVOPC_MATCH(instr, C_BEQZ)) {
-			if (regs[c_rs1_s(instr)] == 0) {
-				pc_wdata = pc + imm_cb(instr);
-			}
-		} else if (RVOPC_MATCH(instr, C_BNEZ)) {
-			if (regs[c_rs1_s(instr)] != 0) {
-				pc_wdata = pc + imm_cb(instr);
-			}
-		} else if (RVOPC_MATCH(instr, C_ZEXT_B)) {
-			// Zcb:
-			regnum_rd = c_rs1_s(instr);
-			rd_wdata = regs[regnum_rd] & 0xffu;
-		} else if (RVOPC_MATCH(instr, C_SEXT_B)) {
-			regnum_rd = c_rs1_s(instr);
-			rd_wdata = sext(regs[regnum_rd], 7);
-		} else if (RVOPC_MATCH(instr, C_ZEXT_H)) {
-			regnum_rd = c_rs1_s(instr);
-			rd_wdata = regs[regnum_rd] & 0xffffu;
-		} else if (RVOPC_MATCH(instr, C_SEXT_H)) {
-			regnum_rd = c_rs1_s(instr);
-			rd_wdata = sext(regs[regnum_rd], 15);
-		} else if (RVOPC_MATCH(instr, C_NOT)) {
-			regnum_rd = c_rs1_s(instr);
-			rd_wdata = ~regs[regnum_rd];
-		} else if (RVOPC_MATCH(instr, C_MUL)) {
-			regnum_rd = c_rs1_s(instr);
-			rd_wdata = regs[c_rs1_s(instr)] * regs[c_rs2_s(instr)];
+		break;
+
+	case RVOP_ECALL:
+		exception_cause = XCAUSE_ECALL_U + csr.get_true_priv();
+		break;
+
+	case RVOP_EBREAK:
+		if (semihost && d->len == 4 && semihost->is_call(pc)) {
+			rd_wdata = semihost->call(regs[10], regs[11]);
+			regnum_rd = 10;
+			if (semihost->exit_req)
+				throw TBExitException(semihost->exit_code);
 		} else {
+			exception_cause = XCAUSE_EBREAK;
+		}
+		break;
+
+	case RVOP_WFI:
+		if (csr.get_true_priv() == PRV_U && csr.get_mstatus_tw()) {
 			exception_cause = XCAUSE_INSTR_ILLEGAL;
+		} else {
+			stalled_on_wfi = true;
 		}
-	} else {
-		// RVC Quadrant 10:
-		if (RVOPC_MATCH(instr, C_SLLI)) {
-			regnum_rd = c_rs1_l(instr);
-			rd_wdata = regs[regnum_rd] << GETBITS(instr, 6, 2);
-		} else if (RVOPC_MATCH(instr, C_MV)) {
-			if (c_rs2_l(instr) == 0) {
-				// c.jr
-				pc_wdata = regs[c_rs1_l(instr)] & -2u;;
-			} else {
-				regnum_rd = c_rs1_l(instr);
-				rd_wdata = regs[c_rs2_l(instr)];
-			}
-		} else if (RVOPC_MATCH(instr, C_ADD)) {
-			if (c_rs2_l(instr) == 0) {
-				if (c_rs1_l(instr) == 0) {
-					// c.ebreak
-					exception_cause = XCAUSE_EBREAK;
-				} else {
-					// c.jalr
-					pc_wdata = regs[c_rs1_l(instr)] & -2u;
-					regnum_rd = 1;
-					rd_wdata = pc + 2;
-				}
-			} else {
-				regnum_rd = c_rs1_l(instr);
-				rd_wdata = regs[c_rs1_l(instr)] + regs[c_rs2_l(instr)];
-			}
-		} else if (RVOPC_MATCH(instr, C_LWSP)) {
-			regnum_rd = c_rs1_l(instr);
-			ux_t addr = regs[2]
-				+ (GETBIT(instr, 12) << 5)
-				+ (GETBITS(instr, 6, 4) << 2)
-				+ (GETBITS(instr, 3, 2) << 6);
-			rd_wdata = r32(addr);
-			if (!rd_wdata) {
-				exception_cause = XCAUSE_LOAD_FAULT;
-			}
-		} else if (RVOPC_MATCH(instr, C_SWSP)) {
-			ux_t addr = regs[2]
-				+ (GETBITS(instr, 12, 9) << 2)
-				+ (GETBITS(instr, 8, 7) << 6);
-			if (!w32(addr, regs[c_rs2_l(instr)])) {
-				exception_cause = XCAUSE_STORE_FAULT;
+		break;
+
+	case RVOP_FENCE:
+		break;
+
+	case RVOP_FENCE_I:
+		flush_decode_cache();
+		break;
+
+	// Zcmp
+
+	case RVOP_CM_PUSH: {
+		csr.count_event(HPM_EVENT_STORE);
+		uint n = d->rs2;
+		// Registers are stored downwards from sp. If the whole area is in RAM
+		// and one PMP region (and doesn't include tohost), store it in one
+		// pass, else word-by-word so that a fault leaves the same partial
+		// stores as the hardware.
+		ux_t base = (regs[2] - 4 * n) & -4u;
+		bool fail = false;
+		if (ram_words_ok(base, n, 0x2u) && ((tohost_addr & 0x3u) || tohost_addr - base >= 4 * n)) {
+			uint8_t *dst = ram + (base - ram_base);
+			for (uint k = 0; k < n; ++k) {
+				le_store32(dst + 4 * k, regs[zcmp_regs[k]]);
+				monitor_notify_write(base + 4 * k);
+				heatmap_count(base + 4 * k, MemHeatmap::WRITE);
 			}
-		// Zcmp:
-		} else if (RVOPC_MATCH(instr, CM_PUSH)) {
+			invalidate_decode_cache(base, 4 * n);
+		} else {
 			ux_t addr = regs[2];
-			bool fail = false;
-			for (uint i = 31; i > 0 && !fail; --i) {
-				if (zcmp_reg_mask(instr) & (1u << i)) {
-					addr -= 4;
-					fail = fail || !w32(addr, regs[i]);
-				}
+			for (uint k = n; k > 0 && !fail; --k) {
+				addr -= 4;
+				fail = !w32(addr, regs[zcmp_regs[k - 1]]);
 			}
-			if (fail) {
-				exception_cause = XCAUSE_STORE_FAULT;
-			} else {
-				regnum_rd = 2;
-				rd_wdata = regs[2] - zcmp_stack_adj(instr);
+		}
+		if (fail) {
+			exception_cause = XCAUSE_STORE_FAULT;
+		} else {
+			regnum_rd = 2;
+			rd_wdata = regs[2] - imm;
+		}
+		break;
+	}
+
+	case RVOP_CM_POP:
+	case RVOP_CM_POPRET:
+	case RVOP_CM_POPRETZ: {
+		csr.count_event(HPM_EVENT_LOAD);
+		bool clear_a0 = d->op == RVOP_CM_POPRETZ;
+		bool ret = clear_a0 || d->op == RVOP_CM_POPRET;
+		uint n = d->rs2;
+		ux_t addr = regs[2] + imm;
+		ux_t base = (addr - 4 * n) & -4u;
+		bool fail = false;
+		if (ram_words_ok(base, n, 0x1u)) {
+			const uint8_t *src = ram + (base - ram_base);
+			for (uint k = 0; k < n; ++k) {
+				regs[zcmp_regs[k]] = le_load32(src + 4 * k);
+				heatmap_count(base + 4 * k, MemHeatmap::READ);
 			}
-		} else if (RVOPC_MATCH(instr, CM_POP) || RVOPC_MATCH(instr, CM_POPRET) || RVOPC_MATCH(instr, CM_POPRETZ)) {
-			bool clear_a0 = RVOPC_MATCH(instr, CM_POPRETZ);
-			bool ret = clear_a0 || RVOPC_MATCH(instr, CM_POPRET);
-			ux_t addr = regs[2] + zcmp_stack_adj(instr);
-			bool fail = false;
-			for (uint i = 31; i > 0 && !fail; --i) {
-				if (zcmp_reg_mask(instr) & (1u << i)) {
-					addr -= 4;
-					std::optional<ux_t> load_result = r32(addr);
-					fail = fail || !load_result;
-					if (load_result) {
-						regs[i] = *load_result;
-					}
+		} else {
+			for (uint k = n; k > 0 && !fail; --k) {
+				addr -= 4;
+				ux_t load_result;
+				if (r32(addr, load_result)) {
+					regs[zcmp_regs[k - 1]] = load_result;
+				} else {
+					fail = true;
 				}
 			}
-			if (fail) {
-				exception_cause = XCAUSE_LOAD_FAULT;
-			} else {
-				if (clear_a0)
-					regs[10] = 0;
-				if (ret)
-					pc_wdata = regs[1];
-				regnum_rd = 2;
-				rd_wdata = regs[2] + zcmp_stack_adj(instr);
-			}
-		} else if (RVOPC_MATCH(instr, CM_MVSA01)) {
-			regs[zcmp_s_mapping(GETBITS(instr, 9, 7))] = regs[10];
-			regs[zcmp_s_mapping(GETBITS(instr, 4, 2))] = regs[11];
-		} else if (RVOPC_MATCH(instr, CM_MVA01S)) {
-			regs[10] = regs[zcmp_s_mapping(GETBITS(instr, 9, 7))];
-			regs[11] = regs[zcmp_s_mapping(GETBITS(instr, 4, 2))];
+		}
+		if (fail) {
+			exception_cause = XCAUSE_LOAD_FAULT;
 		} else {
-			exception_cause = XCAUSE_INSTR_ILLEGAL;
+			if (clear_a0)
+				regs[10] = 0;
+			if (ret) {
+				pc_write = true;
+				pc_wdata = regs[1];
+			}
+			regnum_rd = 2;
+			rd_wdata = regs[2] + imm;
+		}
+		break;
+	}
+
+	case RVOP_CM_MVSA01:
+		regs[d->rs1] = regs[10];
+		regs[d->rs2] = regs[11];
+		break;
+
+	case RVOP_CM_MVA01S:
+		regs[10] = rs1;
+		regs[11] = rs2;
+		break;
+
+	default:
+		exception_cause = XCAUSE_INSTR_ILLEGAL;
+		break;
+	}
+
+	// Other performance counter events are counted in step() and block_exec()
+	if (pc_write && d->op >= RVOP_BEQ && d->op <= RVOP_BGEU)
+		csr.count_event(HPM_EVENT_BRANCH_TAKEN);
+	if (d->len == 2)
+		csr.count_event(HPM_EVENT_COMPRESSED);
+}
+
+template <uint HOOKS>
+void RVCore::step_hooked() {
+	constexpr bool trace = HOOKS & HOOK_TRACE;
+
+	ExecResult r;
+	ux_t &rd_wdata = r.rd_wdata;
+	ux_t &pc_wdata = r.pc_wdata;
+	bool &pc_write = r.pc_write;
+	uint &exception_cause = r.exception_cause;
+	uint &regnum_rd = r.regnum_rd;
+	uint &trace_csr_addr = r.trace_csr_addr;
+	uint &trace_priv = r.trace_priv;
+
+	// Trigger CSRs written last step (or by the API, or a restore)
+	if (csr.get_trigger_gen() != trigger_gen)
+		sync_triggers();
+
+	RVDecodedInstr fetch_scratch;
+	const RVDecodedInstr *d = nullptr;
+	uint32_t instr = 0;
+	bool executed = false;
+
+	std::optional<ux_t> irq_target_pc = csr.trap_check_enter_irq(pc);
+	if (irq_target_pc) {
+		// Replace current instruction with IRQ entry
+		if (power && power->asleep())
+			power->wake(PowerStats::irq_wake(csr.get_xcause() & ~(1u << 31)));
+		stalled_on_wfi = false;
+	} else if (stalled_on_wfi) {
+		// Replace current instruction with jump-to-self
+		++wfi_steps;
+		csr.count_event(HPM_EVENT_WFI_CYCLE);
+		if (power)
+			power->add(sleep_state());
+		pc_write = true;
+		pc_wdata = pc;
+		if (trace) {
+			d = fetch_decode(pc, fetch_scratch);
+			instr = d ? d->instr : 0;
+		}
+	} else if (!(d = fetch_decode(pc, fetch_scratch)) ||
+			(faults && faults->covers_fetch(pc) && !fault_pass(pc, FaultRule::FETCH))) {
+		if (pc != bp_ignore_pc && is_breakpoint(pc)) {
+			breakpoint_hit = true;
+			return;
 		}
+		exception_cause = is_trigger_pc(pc) && csr.trigger_fires(pc) ? XCAUSE_EBREAK : XCAUSE_INSTR_FAULT;
+	} else {
+		instr = d->instr;
+		if (HOOKS & HOOK_HEATMAP)
+			heatmap->access(pc, MemHeatmap::FETCH);
+		// Marked first, as an IO_EXIT store doesn't return
+		if (HOOKS & HOOK_CODECOV)
+			codecov->execute(pc, pc + d->len);
+		execute<trace>(d, r);
+		executed = true;
+		if (exception_cause != ExecResult::NONE)
+			regnum_rd = 0;
+		else if (HOOKS & HOOK_STATS)
+			stats->record(*d, pc_write, regnum_rd);
 	}
 
 	// Ensure pending CSR writes are applied before checking IRQ conditions,
 	// and before reading back the CSR value for tracing
 	csr.step();
 
+	TraceRecord t;
 	if (trace && !irq_target_pc) {
-		printf("%08x: ", pc);
-		if ((instr & 0x3) == 0x3) {
-			printf("%08x : ", instr);
-		} else {
-			printf("    %04x : ", instr & 0xffffu);
-		}
-		bool gpr_writeback = regnum_rd != 0 && rd_wdata;
-		if (gpr_writeback) {
-			printf("%-3s   <- %08x :\n", friendly_reg_names[regnum_rd], *rd_wdata);
-		} else if (pc_wdata) {
-			printf("pc    <- %08x <\n", *pc_wdata);
-		} else {
-			printf("                  :\n");
+		t.flags |= TraceRecord::INSTR;
+		t.pc = pc;
+		t.instr = instr;
+		if (regnum_rd != 0) {
+			t.flags |= TraceRecord::RD;
+			t.rd = regnum_rd;
+			t.rd_wdata = rd_wdata;
 		}
-		if (pc_wdata && gpr_writeback) {
-			printf("                   : pc    <- %08x <\n", *pc_wdata);
+		if (pc_write) {
+			t.flags |= TraceRecord::PCW;
+			t.pc_wdata = pc_wdata;
 		}
-		if (trace_csr_addr) {
-			printf("                   : #%03x  <- %08x :\n", *trace_csr_addr, *csr.read(*trace_csr_addr, false));
+		if (trace_csr_addr != ExecResult::NONE) {
+			t.flags |= TraceRecord::CSR;
+			t.csr_addr = trace_csr_addr;
+			t.csr_wdata = *csr.read(trace_csr_addr, false);
 		}
 	}
 
-	if (exception_cause) {
-		pc_wdata = csr.trap_enter_exception(*exception_cause, pc);
+	bool exception = exception_cause != ExecResult::NONE;
+	if (exception || irq_target_pc)
+		csr.count_event(HPM_EVENT_TRAP);
+	if (exception) {
+		pc_write = true;
+		pc_wdata = csr.trap_enter_exception(exception_cause, pc);
 		if (trace) {
-			printf("^^^ Trap           : cause <- %-2u       :\n", *exception_cause);
-			printf("|||                : pc    <- %08x <\n", *pc_wdata);
+			t.flags |= TraceRecord::TRAP;
+			t.cause = exception_cause;
+			t.trap_pc = pc_wdata;
 			trace_priv = csr.get_true_priv();
 		}
 	} else if (irq_target_pc) {
-		pc_wdata = irq_target_pc;
+		pc_write = true;
+		pc_wdata = *irq_target_pc;
 		if (trace) {
-			printf("^^^ IRQ            : cause <- IRQ + %-2u :\n", csr.get_xcause() & ((1u << 31) - 1));
-			printf("|||                : pc    <- %08x <\n", *pc_wdata);
+			t.flags |= TraceRecord::IRQ;
+			t.cause = csr.get_xcause() & ((1u << 31) - 1);
+			t.trap_pc = pc_wdata;
 			trace_priv = csr.get_true_priv();
 		}
 	}
-	if (trace && trace_priv) {
-		printf("|||                : priv  <- %c        :\n", "US.M"[*trace_priv & 0x3]);
+	if (trace && trace_priv != ExecResult::NONE) {
+		t.flags |= TraceRecord::PRIV;
+		t.priv = trace_priv;
+	}
+	if (trace) {
+		static TextTraceSink stdout_sink;
+		(trace_sink ? trace_sink : &stdout_sink)->record(t);
 	}
 
-	if (pc_wdata)
-		pc = *pc_wdata;
+	ux_t instr_pc = pc;
+	if (pc_write)
+		pc = pc_wdata;
 	else
 		pc = pc + ((instr & 0x3) == 0x3 ? 4 : 2);
-	if (rd_wdata && regnum_rd != 0)
-		regs[regnum_rd] = *rd_wdata;
+	if (regnum_rd != 0)
+		regs[regnum_rd] = rd_wdata;
+	if ((HOOKS & HOOK_CODECOV) && executed)
+		codecov_branch(instr_pc, *d);
+}
+
+RVCore::StepFn RVCore::step_fn(bool trace) const {
+	// Indexed by hooks
+	static const StepFn fns[16] = {
+		&RVCore::step_hooked<0>,
+		&RVCore::step_hooked<1>,
+		&RVCore::step_hooked<2>,
+		&RVCore::step_hooked<3>,
+		&RVCore::step_hooked<4>,
+		&RVCore::step_hooked<5>,
+		&RVCore::step_hooked<6>,
+		&RVCore::step_hooked<7>,
+		&RVCore::step_hooked<8>,
+		&RVCore::step_hooked<9>,
+		&RVCore::step_hooked<10>,
+		&RVCore::step_hooked<11>,
+		&RVCore::step_hooked<12>,
+		&RVCore::step_hooked<13>,
+		&RVCore::step_hooked<14>,
+		&RVCore::step_hooked<15>
+	};
+	return fns[step_hooks(trace)];
+}
+
+// Operations with no side effects outside of the core and its RAM, given an
+// address in RAM for loads/stores
+static bool block_safe_op(rv_op op) {
+	switch (op) {
+	case RVOP_ILLEGAL:
+	case RVOP_FENCE_I:
+	case RVOP_ECALL:
+	case RVOP_EBREAK:
+	case RVOP_MRET:
+	case RVOP_WFI:
+	case RVOP_CSRRW:
+	case RVOP_CSRRS:
+	case RVOP_CSRRC:
+	case RVOP_CSRRWI:
+	case RVOP_CSRRSI:
+	case RVOP_CSRRCI:
+	case RVOP_LR_W:
+	case RVOP_SC_W:
+	case RVOP_AMOSWAP_W:
+	case RVOP_AMOADD_W:
+	case RVOP_AMOXOR_W:
+	case RVOP_AMOAND_W:
+	case RVOP_AMOOR_W:
+	case RVOP_AMOMIN_W:
+	case RVOP_AMOMAX_W:
+	case RVOP_AMOMINU_W:
+	case RVOP_AMOMAXU_W:
+	case RVOP_CM_PUSH:
+	case RVOP_CM_POP:
+	case RVOP_CM_POPRET:
+	case RVOP_CM_POPRETZ:
+		return false;
+	default:
+		return true;
+	}
+}
+
+// Loads/stores whose address is rs1 + imm
+static bool is_load_store_op(rv_op op) {
+	switch (op) {
+	case RVOP_LB:
+	case RVOP_LH:
+	case RVOP_LW:
+	case RVOP_LBU:
+	case RVOP_LHU:
+	case RVOP_SB:
+	case RVOP_SH:
+	case RVOP_SW:
+	case RVOP_C_LW:
+	case RVOP_C_SW:
+	case RVOP_C_SH:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool is_control_transfer_op(rv_op op) {
+	return op == RVOP_JAL || op == RVOP_JALR || (op >= RVOP_BEQ && op <= RVOP_BGEU);
+}
+
+bool RVCore::block_safe(const RVDecodedInstr &d) {
+	if (is_load_store_op(d.op)) {
+		// Same address check as r8() etc, so these never go to `mem`
+		ux_t addr = regs[d.rs1] + d.imm;
+		return addr >= ram_base && addr < ram_top && (addr & -4u) != tohost_addr;
+	}
+	return block_safe_op(d.op);
+}
+
+const RVCore::CachedBlock *RVCore::block_lookup() {
+	CachedBlock &b = block_cache[(pc >> 1) & (BLOCK_CACHE_SIZE - 1)];
+	if (b.pc == pc && b.code_gen == block_code_gen && b.pmp_gen == csr.get_pmp_gen() &&
+			b.priv == csr.get_true_priv()) {
+		return &b;
+	}
+
+	b.pc = DCACHE_INVALID_PC;
+	b.instrs.clear();
+	if (block_code_map.empty())
+		block_code_map.resize(((ram_top - ram_base) >> BLOCK_GRANULE_SHIFT) + 1);
+	RVDecodedInstr fetch_scratch;
+	ux_t addr = pc;
+	while (b.instrs.size() < MAX_BLOCK_LEN && addr >= ram_base && (uint64_t)addr + 4 <= ram_top) {
+		const RVDecodedInstr *d = fetch_decode(addr, fetch_scratch);
+		// A trigger which doesn't fire now may fire when the block is next
+		// run, so triggers are only fetched by step() or without the cache
+		if (!d || !block_safe_op(d->op) || is_trigger_pc(addr)) {
+			break;
+		}
+		b.instrs.push_back(*d);
+		block_code_map[(addr - ram_base) >> BLOCK_GRANULE_SHIFT] = 1;
+		block_code_map[(addr + d->len - 1 - ram_base) >> BLOCK_GRANULE_SHIFT] = 1;
+		addr += d->len;
+		if (is_control_transfer_op(d->op)) {
+			break;
+		}
+	}
+	if (b.instrs.empty()) {
+		return nullptr;
+	}
+	b.pc = pc;
+	b.end_pc = addr;
+	b.code_gen = block_code_gen;
+	b.pmp_gen = csr.get_pmp_gen();
+	b.priv = csr.get_true_priv();
+	return &b;
+}
+
+// Execute a block-safe instruction as part of run_block(). Returns false if
+// the block must end after this instruction.
+inline __attribute__((always_inline)) bool RVCore::block_exec(const RVDecodedInstr &d) {
+	ExecResult r;
+	execute<false>(&d, r);
+	bool exception = r.exception_cause != ExecResult::NONE;
+	if (exception) {
+		// Alignment or PMP fault. Trap entry clears mstatus.MIE, and the
+		// handler is likely to access CSRs, so end the block here.
+		r.pc_write = true;
+		r.pc_wdata = csr.trap_enter_exception(r.exception_cause, pc);
+		r.regnum_rd = 0;
+		csr.count_event(HPM_EVENT_TRAP);
+	}
+	pc = r.pc_write ? r.pc_wdata : pc + d.len;
+	// Unconditional write, then restore x0: cheaper than a branch
+	regs[r.regnum_rd] = r.rd_wdata;
+	regs[0] = 0;
+	return !exception;
+}
+
+uint64_t RVCore::run_block(uint64_t max_steps) {
+	if (max_steps == 0) {
+		return 0;
+	}
+	if (csr.get_trigger_gen() != trigger_gen) {
+		sync_triggers();
+	}
+	// IRQ entry is handled by step(). Checking once is enough, as nothing
+	// executed in the block can change the IRQ state (once any change to the
+	// registered external IRQ inputs has gone through). For the same reason,
+	// a core stalled in WFI stays stalled for the whole block, so skip the
+	// block's worth of jump-to-self steps (as step() would count them).
+	if (csr.irq_pending() || csr.irq_inputs_settling()) {
+		step();
+		return 1;
+	}
+	if (stalled_on_wfi) {
+		wfi_steps += max_steps;
+		csr.step_counters(max_steps);
+		csr.count_event(HPM_EVENT_WFI_CYCLE, max_steps);
+		if (power)
+			power->add(sleep_state(), max_steps);
+		return max_steps;
+	}
+
+	uint64_t n = 0;
+	RVDecodedInstr fetch_scratch;
+	const CachedBlock *b = nullptr;
+	size_t b_index = 0;
+	while (n < max_steps) {
+		const RVDecodedInstr *d;
+		if (faults && faults->covers_fetch(pc)) {
+			// Fetch fault injection is left to step()
+			break;
+		} else if (block_cache_enable && !(faults && faults->fetch_armed())) {
+			// Instructions come from the current cached block, until it
+			// is used up (or invalidated by a store) and we move on to the
+			// block at the current pc
+			if (!b || b_index == b->instrs.size() || b->code_gen != block_code_gen) {
+				// (Before the lookup, which may reuse b's slot)
+				if (b && codecov)
+					codecov_block(*b, b_index);
+				b = block_lookup();
+				b_index = 0;
+				if (!b) {
+					break;
+				}
+			}
+			d = &b->instrs[b_index++];
+		} else {
+			// Straddling or out-of-RAM fetches go the long way (through step())
+			if (pc < ram_base || (uint64_t)pc + 4 > ram_top) {
+				break;
+			}
+			d = fetch_decode(pc, fetch_scratch);
+			if (!d) {
+				break;
+			}
+		}
+		if (!block_safe(*d)) {
+			// Left for step(), so not run as part of the block
+			if (b)
+				--b_index;
+			break;
+		}
+		++n;
+		heatmap_count(pc, MemHeatmap::FETCH);
+		ux_t instr_pc = pc;
+		bool ok = block_exec(*d);
+		if (codecov && !b)
+			codecov_count(instr_pc, *d);
+		if (!ok) {
+			break;
+		}
+		// A jump or taken branch to itself spins until an IRQ, which can't
+		// arrive mid-block, so return and let the caller see the hang
+		if (pc == instr_pc) {
+			break;
+		}
+	}
+	if (b && codecov)
+		codecov_block(*b, b_index);
+
+	if (n == 0) {
+		// First instruction was not block-safe, so run it by itself
+		step();
+		return 1;
+	}
+	csr.step_counters(n);
+	return n;
 }
@@ -1,4 +1,5 @@
 #include "rv_csr.h"
+#include "rv_csrprof.h"
 #include "encoding/rv_csr.h"
 
 #include <cassert>
@@ -10,56 +11,140 @@
 #define GETBITS(x, msb, lsb) (((x) & BITRANGE(msb, lsb)) >> (lsb))
 #define GETBIT(x, bit) (((x) >> (bit)) & 1u)
 
+static inline void set_lo(uint64_t &x, ux_t lo) {
+	x = (x & ~0xffffffffull) | lo;
+}
+
+static inline void set_hi(uint64_t &x, ux_t hi) {
+	x = (x & 0xffffffffull) | (uint64_t)hi << 32;
+}
+
 
 ux_t RVCSR::get_effective_xip() {
+	bool meip = config.has(RVConfig::EXT_XH3IRQ) ? irq_ctrl.meip() : irq_ctrl.any_line();
 	return mip |
 		(irq_s ? MIP_MSIP : 0) |
 		(irq_t ? MIP_MTIP : 0) |
-		(irq_e ? MIP_MEIP : 0);
+		(meip ? MIP_MEIP : 0);
 }
 
-void RVCSR::step() {
-	uint64_t mcycle_64 = ((uint64_t)mcycleh << 32) | mcycle;
-	uint64_t minstret_64 = ((uint64_t)minstreth << 32) | minstret;
-	if (!(mcountinhibit & 0x1u)) {
-		++mcycle_64;
-	}
-	if (!(mcountinhibit & 0x4u)) {
-		++minstret_64;
-	}
-	if (!(pending_write_addr && *pending_write_addr == CSR_MCYCLEH)) {
-		mcycleh = mcycle_64 >> 32;
-	}
-	if (!(pending_write_addr && *pending_write_addr == CSR_MCYCLE)) {
-		mcycle = mcycle_64 & 0xffffffffu;
-	}
-	if (!(pending_write_addr && *pending_write_addr == CSR_MINSTRETH)) {
-		minstreth = minstret_64 >> 32;
-	}
-	if (!(pending_write_addr && *pending_write_addr == CSR_MINSTRET)) {
-		minstret = minstret_64 & 0xffffffffu;
-	}
+void RVCSR::set_config(const RVConfig &c) {
+	config = c;
+	// Without U-mode, MPP is hardwired to M
+	if (!config.u_mode)
+		mstatus |= MSTATUS_MPP;
+}
+
+void RVCSR::commit_write() {
 	if (pending_write_addr) {
 		switch (*pending_write_addr) {
-			case CSR_MSTATUS:        mstatus        = pending_write_data;               break;
+			case CSR_MSTATUS:
+				mstatus = pending_write_data;
+				if (!config.u_mode)
+					mstatus = (mstatus | MSTATUS_MPP) & ~MSTATUS_TW;
+				break;
 			case CSR_MIE:            mie            = pending_write_data;               break;
 			case CSR_MTVEC:          mtvec          = pending_write_data & 0xfffffffdu; break;
 			case CSR_MSCRATCH:       mscratch       = pending_write_data;               break;
-			case CSR_MEPC:           mepc           = pending_write_data & 0xfffffffeu; break;
+			case CSR_MEPC:
+				mepc = pending_write_data & (config.has(RVConfig::EXT_C) ? 0xfffffffeu : 0xfffffffcu);
+				break;
 			case CSR_MCAUSE:         mcause         = pending_write_data & 0x8000000fu; break;
 
-			case CSR_MCYCLE:         mcycle         = pending_write_data;               break;
-			case CSR_MCYCLEH:        mcycleh        = pending_write_data;               break;
-			case CSR_MINSTRET:       minstret       = pending_write_data;               break;
-			case CSR_MINSTRETH:      minstreth      = pending_write_data;               break;
-			case CSR_MCOUNTINHIBIT:  mcountinhibit  = pending_write_data & 0x7u;        break;
+			// Counter writes replace one half, after this step's increment
+			case CSR_MCYCLE:         counter_rebase(); set_lo(mcycle, pending_write_data);   break;
+			case CSR_MCYCLEH:        counter_rebase(); set_hi(mcycle, pending_write_data);   break;
+			case CSR_MINSTRET:       counter_rebase(); set_lo(minstret, pending_write_data); break;
+			case CSR_MINSTRETH:      counter_rebase(); set_hi(minstret, pending_write_data); break;
+			case CSR_MCOUNTINHIBIT:
+				counter_rebase();
+				for (int i = 0; i < N_HPM_COUNTERS; ++i)
+					hpm_rebase(i);
+				// Only cy and ir exist without the HPM event model
+				mcountinhibit = pending_write_data & (config.hpm_events ? 0xfffffffdu : 0x5u);
+				update_hpm_active();
+				break;
 
 			case CSR_HAZARD3_MSLEEP: hazard3_msleep = pending_write_data & 0x7u;        break;
 
-			default:                                                                    break;
+			case CSR_TSELECT: {
+				// Just wide enough to select every trigger (and at least one
+				// bit), so it can still select a nonexistent trigger if the
+				// count isn't a power of two
+				uint w = 1;
+				while (1u << w < config.triggers())
+					++w;
+				if (config.triggers() > 0)
+					tselect = pending_write_data & ((1u << w) - 1);
+				break;
+			}
+			case CSR_TDATA1:
+				if (tselect_in_range()) {
+					Trigger &t = triggers[tselect];
+					t.action = GETBIT(pending_write_data, 12);
+					t.m = GETBIT(pending_write_data, 6);
+					t.u = GETBIT(pending_write_data, 3);
+					t.execute = GETBIT(pending_write_data, 2);
+					++trigger_gen;
+				}
+				break;
+			case CSR_TDATA2:
+				if (tselect_in_range()) {
+					triggers[tselect].tdata2 = pending_write_data;
+					++trigger_gen;
+				}
+				break;
+			case CSR_TCONTROL:
+				tcontrol_mpte = GETBIT(pending_write_data, 7);
+				tcontrol_mte = GETBIT(pending_write_data, 3);
+				break;
+
+			case CSR_HAZARD3_MEICONTEXT:
+				// Writes to mtiesave/msiesave are ORed into mie, and clearts
+				// clears both enables (winning over the OR)
+				mie |= (pending_write_data & 0x8u ? MIP_MTIP : 0) | (pending_write_data & 0x4u ? MIP_MSIP : 0);
+				if (pending_write_op != WRITE_CLEAR && (pending_write_raw & 0x2u))
+					mie &= ~(MIP_MTIP | MIP_MSIP);
+				irq_ctrl.write(*pending_write_addr, pending_write_raw, pending_write_data);
+				break;
+
+			default:
+				if (IrqCtrl::is_csr(*pending_write_addr))
+					irq_ctrl.write(*pending_write_addr, pending_write_raw, pending_write_data);
+				break;
+		}
+
+		// Without the HPM event model, these stay zero as on the RTL
+		if (!config.hpm_events) {
+		} else if (*pending_write_addr >= CSR_MHPMCOUNTER3 && *pending_write_addr <= CSR_MHPMCOUNTER31) {
+			int i = *pending_write_addr - CSR_MHPMCOUNTER3;
+			hpm_rebase(i);
+			set_lo(mhpmcounter[i], pending_write_data);
+		} else if (*pending_write_addr >= CSR_MHPMCOUNTER3H && *pending_write_addr <= CSR_MHPMCOUNTER31H) {
+			int i = *pending_write_addr - CSR_MHPMCOUNTER3H;
+			hpm_rebase(i);
+			set_hi(mhpmcounter[i], pending_write_data);
+		} else if (*pending_write_addr >= CSR_MHPMEVENT3 && *pending_write_addr <= CSR_MHPMEVENT31) {
+			// WARL: unknown events read back as none
+			int i = *pending_write_addr - CSR_MHPMEVENT3;
+			hpm_rebase(i);
+			mhpmevent[i] = pending_write_data < N_HPM_EVENTS ? pending_write_data : (ux_t)HPM_EVENT_NONE;
+			mhpmcounter_base[i] = hpm_event_count[mhpmevent[i]];
+			update_hpm_active();
+		}
+
+		bool pmp_write = (*pending_write_addr >= CSR_PMPCFG0 && *pending_write_addr <= CSR_PMPCFG3) ||
+			(*pending_write_addr >= CSR_PMPADDR0 && *pending_write_addr <= CSR_PMPADDR15) ||
+			*pending_write_addr == CSR_HAZARD3_PMPCFGM0;
+		if (pmp_write) {
+			++pmp_gen;
+		}
+
+		if (*pending_write_addr == CSR_HAZARD3_PMPCFGM0) {
+			pmpcfgm = pending_write_data & ~(~0u << config.pmp_regions);
 		}
 
-		for (uint i = 0; i < IMPLEMENTED_PMP_REGIONS; ++i) {
+		for (uint i = 0; i < config.pmp_regions; ++i) {
 			if (pmpcfg_l(i)) {
 				continue;
 			}
@@ -72,20 +157,86 @@ void RVCSR::step() {
 			}
 		}
 
+		if (pmp_write) {
+			update_pmp_regions();
+		}
+		update_pmp_nomatch();
+
 		pending_write_addr = {};
 	}
 }
 
+// CSRs which are absent without CSR_COUNTER
+static bool is_counter_csr(uint16_t addr) {
+	return addr == CSR_MCYCLE || addr == CSR_MCYCLEH || addr == CSR_MINSTRET || addr == CSR_MINSTRETH ||
+		addr == CSR_MCOUNTINHIBIT ||
+		(addr >= CSR_MHPMCOUNTER3 && addr <= CSR_MHPMCOUNTER31) ||
+		(addr >= CSR_MHPMCOUNTER3H && addr <= CSR_MHPMCOUNTER31H) ||
+		(addr >= CSR_MHPMEVENT3 && addr <= CSR_MHPMEVENT31);
+}
 
 // Returns None on permission/decode fail
-std::optional<ux_t> RVCSR::read(uint16_t addr, bool side_effect) {
-	(void)side_effect;
+std::optional<ux_t> RVCSR::read(uint16_t addr, bool side_effect, ux_t wdata, uint op) {
+	std::optional<ux_t> rdata = read_impl(addr, side_effect, wdata, op);
+	// Reads without side effects are for set/clear writes, and debuggers
+	if (profile && side_effect)
+		profile->read(addr, rdata.has_value());
+	return rdata;
+}
+
+std::optional<ux_t> RVCSR::read_impl(uint16_t addr, bool side_effect, ux_t wdata, uint op) {
 	if (addr >= 1u << 12 || GETBITS(addr, 9, 8) > priv)
 		return {};
 
+	if (IrqCtrl::is_csr(addr) && config.has(RVConfig::EXT_XH3IRQ)) {
+		ux_t rdata = irq_ctrl.read(addr, wdata, side_effect);
+		// meicontext.mtiesave/msiesave read as mie.mtie/msie when the same
+		// write sets clearts
+		if (addr == CSR_HAZARD3_MEICONTEXT && (op == WRITE || op == WRITE_SET) && (wdata & 0x2u))
+			rdata |= (mie & MIP_MTIP ? 0x8u : 0) | (mie & MIP_MSIP ? 0x4u : 0);
+		return rdata;
+	}
+
+	if (!config.csr_counter && is_counter_csr(addr))
+		return {};
+
+	if (addr >= CSR_MHPMCOUNTER3 && addr <= CSR_MHPMCOUNTER31)
+		return hpm_read(addr - CSR_MHPMCOUNTER3) & 0xffffffffu;
+	if (addr >= CSR_MHPMCOUNTER3H && addr <= CSR_MHPMCOUNTER31H)
+		return hpm_read(addr - CSR_MHPMCOUNTER3H) >> 32;
+	if (addr >= CSR_MHPMEVENT3 && addr <= CSR_MHPMEVENT31)
+		return mhpmevent[addr - CSR_MHPMEVENT3];
+
+	// PMP CSRs exist if any region is implemented, and the rest read as zero
+	bool have_pmp = config.pmp_regions > 0;
+	if (addr >= CSR_PMPCFG0 && addr <= CSR_PMPCFG3)
+		return have_pmp ? std::optional<ux_t>(pmpcfg[addr - CSR_PMPCFG0]) : std::nullopt;
+	if (addr >= CSR_PMPADDR0 && addr <= CSR_PMPADDR15)
+		return have_pmp ? std::optional<ux_t>(pmpaddr[addr - CSR_PMPADDR0]) : std::nullopt;
+	if (addr == CSR_HAZARD3_PMPCFGM0)
+		return have_pmp && config.has(RVConfig::EXT_XH3PMPM) ? std::optional<ux_t>(pmpcfgm) : std::nullopt;
+
+	// Trigger CSRs exist with debug support. With no triggers, tselect and
+	// tdata read as zero and tinfo as one (type 0), and tcontrol is absent.
+	if (addr >= CSR_TSELECT && addr <= CSR_TCONTROL && addr != CSR_TDATA3) {
+		if (!config.debug_support || (addr == CSR_TCONTROL && !config.triggers()))
+			return {};
+		const Trigger &t = triggers[tselect];
+		switch (addr) {
+			case CSR_TSELECT:    return tselect;
+			case CSR_TDATA1:
+				if (!tselect_in_range())
+					return 0;
+				return 2u << 28 | (ux_t)t.action << 12 | (ux_t)t.m << 6 | (ux_t)t.u << 3 | (ux_t)t.execute << 2;
+			case CSR_TDATA2:     return tselect_in_range() ? t.tdata2 : 0;
+			case CSR_TINFO:      return tselect_in_range() ? 0x4u : 0x1u;
+			default:             return (ux_t)tcontrol_mpte << 7 | (ux_t)tcontrol_mte << 3;
+		}
+	}
+
 	switch (addr) {
-		case CSR_MISA:           return 0x40901107u; // RV32IMABCX + U
-		case CSR_MHARTID:        return 0;
+		case CSR_MISA:           return config.misa();
+		case CSR_MHARTID:        return mhartid;
 		case CSR_MARCHID:        return 0x1b;        // Hazard3
 		case CSR_MIMPID:         return 0x12345678u; // Match testbench value
 		case CSR_MVENDORID:      return 0xdeadbeefu; // Match testbench value
@@ -101,34 +252,15 @@ std::optional<ux_t> RVCSR::read(uint16_t addr, bool side_effect) {
 		case CSR_MTVAL:          return 0;
 
 		case CSR_MCOUNTINHIBIT:  return mcountinhibit;
-		case CSR_MCYCLE:         return mcycle;
-		case CSR_MCYCLEH:        return mcycleh;
-		case CSR_MINSTRET:       return minstret;
-		case CSR_MINSTRETH:      return minstreth;
-
-		case CSR_PMPCFG0:        return pmpcfg[0];
-		case CSR_PMPCFG1:        return pmpcfg[1];
-		case CSR_PMPCFG2:        return pmpcfg[2];
-		case CSR_PMPCFG3:        return pmpcfg[3];
-
-		case CSR_PMPADDR0:       return pmpaddr[0];
-		case CSR_PMPADDR1:       return pmpaddr[1];
-		case CSR_PMPADDR2:       return pmpaddr[2];
-		case CSR_PMPADDR3:       return pmpaddr[3];
-		case CSR_PMPADDR4:       return pmpaddr[4];
-		case CSR_PMPADDR5:       return pmpaddr[5];
-		case CSR_PMPADDR6:       return pmpaddr[6];
-		case CSR_PMPADDR7:       return pmpaddr[7];
-		case CSR_PMPADDR8:       return pmpaddr[8];
-		case CSR_PMPADDR9:       return pmpaddr[9];
-		case CSR_PMPADDR10:      return pmpaddr[10];
-		case CSR_PMPADDR11:      return pmpaddr[11];
-		case CSR_PMPADDR12:      return pmpaddr[12];
-		case CSR_PMPADDR13:      return pmpaddr[13];
-		case CSR_PMPADDR14:      return pmpaddr[14];
-		case CSR_PMPADDR15:      return pmpaddr[15];
-
-		case CSR_HAZARD3_MSLEEP: return hazard3_msleep;
+		case CSR_MCYCLE:         return mcycle_read() & 0xffffffffu;
+		case CSR_MCYCLEH:        return mcycle_read() >> 32;
+		case CSR_MINSTRET:       return minstret_read() & 0xffffffffu;
+		case CSR_MINSTRETH:      return minstret_read() >> 32;
+
+		case CSR_HAZARD3_MSLEEP:
+			if (config.has(RVConfig::EXT_XH3POWER))
+				return hazard3_msleep;
+			return {};
 
 		default:                 return {};
 	}
@@ -136,10 +268,19 @@ std::optional<ux_t> RVCSR::read(uint16_t addr, bool side_effect) {
 
 // Returns false on permission/decode fail
 bool RVCSR::write(uint16_t addr, ux_t data, uint op) {
+	bool ok = write_impl(addr, data, op);
+	if (profile)
+		profile->write(addr, ok);
+	return ok;
+}
+
+bool RVCSR::write_impl(uint16_t addr, ux_t data, uint op) {
 	if (addr >= 1u << 12 || GETBITS(addr, 9, 8) > priv)
 		return false;
+	pending_write_raw = data;
+	pending_write_op = op;
 	if (op == WRITE_CLEAR || op == WRITE_SET) {
-		std::optional<ux_t> rdata = read(addr, false);
+		std::optional<ux_t> rdata = read_impl(addr, false, data, op);
 		if (!rdata)
 			return false;
 		if (op == WRITE_CLEAR)
@@ -147,11 +288,36 @@ bool RVCSR::write(uint16_t addr, ux_t data, uint op) {
 		else
 			data = *rdata | data;
 	}
-	pending_write_addr = addr;
-	pending_write_data = data;
 	// Actual write is applied at end of step() -- ordering is important
 	// e.g. for mcycle updates. However we validate address for
 	// writability immediately.
+	if (!writable(addr))
+		return false;
+	pending_write_addr = addr;
+	pending_write_data = data;
+	return true;
+}
+
+bool RVCSR::writable(uint16_t addr) const {
+	if (!config.csr_counter && is_counter_csr(addr))
+		return false;
+	if ((addr >= CSR_MHPMCOUNTER3 && addr <= CSR_MHPMCOUNTER31) ||
+			(addr >= CSR_MHPMCOUNTER3H && addr <= CSR_MHPMCOUNTER31H) ||
+			(addr >= CSR_MHPMEVENT3 && addr <= CSR_MHPMEVENT31))
+		return true;
+	if (IrqCtrl::is_csr(addr))
+		return config.has(RVConfig::EXT_XH3IRQ);
+	if ((addr >= CSR_PMPCFG0 && addr <= CSR_PMPCFG3) || (addr >= CSR_PMPADDR0 && addr <= CSR_PMPADDR15))
+		return config.pmp_regions > 0;
+	if (addr == CSR_HAZARD3_PMPCFGM0)
+		return config.pmp_regions > 0 && config.has(RVConfig::EXT_XH3PMPM);
+	if (addr == CSR_HAZARD3_MSLEEP)
+		return config.has(RVConfig::EXT_XH3POWER);
+	// tinfo is read-only, but writes to it don't trap
+	if (addr >= CSR_TSELECT && addr <= CSR_TINFO && addr != CSR_TDATA3)
+		return config.debug_support;
+	if (addr == CSR_TCONTROL)
+		return config.debug_support && config.triggers() > 0;
 	switch (addr) {
 		case CSR_MISA:           break;
 		case CSR_MHARTID:        break;
@@ -173,30 +339,6 @@ bool RVCSR::write(uint16_t addr, ux_t data, uint op) {
 		case CSR_MINSTRETH:      break;
 		case CSR_MCOUNTINHIBIT:  break;
 
-		case CSR_PMPCFG0:        break;
-		case CSR_PMPCFG1:        break;
-		case CSR_PMPCFG2:        break;
-		case CSR_PMPCFG3:        break;
-
-		case CSR_PMPADDR0:       break;
-		case CSR_PMPADDR1:       break;
-		case CSR_PMPADDR2:       break;
-		case CSR_PMPADDR3:       break;
-		case CSR_PMPADDR4:       break;
-		case CSR_PMPADDR5:       break;
-		case CSR_PMPADDR6:       break;
-		case CSR_PMPADDR7:       break;
-		case CSR_PMPADDR8:       break;
-		case CSR_PMPADDR9:       break;
-		case CSR_PMPADDR10:      break;
-		case CSR_PMPADDR11:      break;
-		case CSR_PMPADDR12:      break;
-		case CSR_PMPADDR13:      break;
-		case CSR_PMPADDR14:      break;
-		case CSR_PMPADDR15:      break;
-
-		case CSR_HAZARD3_MSLEEP: break;
-
 		default:                 return false;
 	}
 	return true;
@@ -208,11 +350,19 @@ ux_t RVCSR::trap_enter_exception(uint xcause, ux_t xepc) {
 	return trap_enter(xcause, xepc);
 }
 
+bool RVCSR::irq_pending() {
+	ux_t m_targeted_irqs = get_effective_xip() & mie & irq_entry_mask;
+	return m_targeted_irqs && ((mstatus & MSTATUS_MIE) || priv < PRV_M);
+}
+
+bool RVCSR::irq_possible(ux_t future_xip) {
+	ux_t m_targeted_irqs = (get_effective_xip() | future_xip) & mie & irq_entry_mask;
+	return m_targeted_irqs && ((mstatus & MSTATUS_MIE) || priv < PRV_M);
+}
+
 std::optional<ux_t> RVCSR::trap_check_enter_irq(ux_t xepc) {
-	ux_t m_targeted_irqs = get_effective_xip() & mie;
-	bool take_m_irq = m_targeted_irqs && ((mstatus & MSTATUS_MIE) || priv < PRV_M);
-	if (take_m_irq) {
-		ux_t cause = (1u << 31) | __builtin_ctz(m_targeted_irqs);
+	if (irq_pending()) {
+		ux_t cause = (1u << 31) | __builtin_ctz(get_effective_xip() & mie & irq_entry_mask);
 		return trap_enter(cause, xepc);
 	} else {
 		return std::nullopt;
@@ -221,6 +371,8 @@ std::optional<ux_t> RVCSR::trap_check_enter_irq(ux_t xepc) {
 
 // Update trap state (including change of privilege level), return trap target PC
 ux_t RVCSR::trap_enter(uint xcause, ux_t xepc) {
+	if (profile)
+		profile->trap(xcause, xepc);
 	mstatus = (mstatus & ~MSTATUS_MPP) | (priv << 11);
 	priv = PRV_M;
 
@@ -231,8 +383,16 @@ ux_t RVCSR::trap_enter(uint xcause, ux_t xepc) {
 	}
 	mstatus &= ~MSTATUS_MIE;
 
+	update_pmp_nomatch();
+
+	if (config.debug_support) {
+		tcontrol_mpte = tcontrol_mte;
+		tcontrol_mte = false;
+	}
+
 	mcause = xcause;
 	mepc = xepc;
+	irq_ctrl.trap_enter(xcause == ((1u << 31) | IRQ_M_EXT));
 	if ((mtvec & 0x1) && (xcause & (1u << 31))) {
 		return (mtvec & -2) + 4 * (xcause & ~(1u << 31));
 	} else {
@@ -243,7 +403,8 @@ ux_t RVCSR::trap_enter(uint xcause, ux_t xepc) {
 // Update trap state, return mepc:
 ux_t RVCSR::trap_mret() {
 	priv = GETBITS(mstatus, 12, 11);
-	mstatus &= ~MSTATUS_MPP;
+	if (config.u_mode)
+		mstatus &= ~MSTATUS_MPP;
 	if (priv != PRV_M) {
 		mstatus &= ~MSTATUS_MPRV;
 	}
@@ -254,10 +415,36 @@ ux_t RVCSR::trap_mret() {
 		mstatus &= ~MSTATUS_MIE;
 	}
 	mstatus |= MSTATUS_MPIE;
+	update_pmp_nomatch();
+	irq_ctrl.trap_mret();
+	// Unlike mstatus.mpie, tcontrol.mpte is unchanged
+	if (config.debug_support)
+		tcontrol_mte = tcontrol_mpte;
 
 	return mepc;
 }
 
+std::vector<ux_t> RVCSR::get_trigger_pcs() const {
+	std::vector<ux_t> pcs;
+	for (uint i = 0; i < config.triggers(); ++i) {
+		const Trigger &t = triggers[i];
+		if (t.execute && !t.action && (t.m || t.u))
+			pcs.push_back(t.tdata2);
+	}
+	return pcs;
+}
+
+bool RVCSR::trigger_fires(ux_t pc) const {
+	if (!tcontrol_mte)
+		return false;
+	for (uint i = 0; i < config.triggers(); ++i) {
+		const Trigger &t = triggers[i];
+		if (t.execute && !t.action && t.tdata2 == pc && (priv == PRV_M ? t.m : t.u))
+			return true;
+	}
+	return false;
+}
+
 uint RVCSR::get_effective_priv() {
 	if (mstatus & MSTATUS_MPRV) {
 		return (mstatus & MSTATUS_MPP) >> __builtin_ctz(MSTATUS_MPP);
@@ -266,7 +453,8 @@ uint RVCSR::get_effective_priv() {
 	}
 }
 
-int RVCSR::get_pmp_match(ux_t addr) {
+void RVCSR::update_pmp_regions() {
+	pmp_n_active = 0;
 	for (int i = 0; i < PMP_REGIONS; ++i) {
 		if (pmpcfg_a(i) == 0u) {
 			continue;
@@ -279,35 +467,62 @@ int RVCSR::get_pmp_match(ux_t addr) {
 				mask = 0xfffffffeu << __builtin_ctz(~pmpaddr[i]);
 			}
 		}
-		bool match = ((addr >> 2) & mask) == (pmpaddr[i] & mask);
-		if (match) {
+		pmp_active[pmp_n_active++] = {
+			i, mask, pmpaddr[i] & mask, (uint)pmpcfg_xwr(i), pmpcfg_l(i) || (pmpcfgm >> i & 0x1u)
+		};
+	}
+}
+
+void RVCSR::update_pmp_nomatch() {
+	pmp_xwr_nomatch =
+		get_effective_priv() == PRV_M ? 0x7u  :
+		get_true_priv()      == PRV_M ? PMP_X : 0x0u;
+}
+
+int RVCSR::get_pmp_match(ux_t addr) {
+	for (uint i = 0; i < pmp_n_active; ++i) {
+		if (((addr >> 2) & pmp_active[i].mask) == pmp_active[i].match) {
 			// Lowest-numbered match determines success/failure:
-			return i;
+			return pmp_active[i].region;
 		}
 	}
 	return -1;
 }
 
-uint RVCSR::get_pmp_xwr(ux_t addr) {
-	int region = get_pmp_match(addr);
-	bool match = false;
-	uint matching_xwr = 0;
-	uint matching_l = 0;
-	if (region >= 0) {
-		match = true;
-		matching_xwr = pmpcfg_xwr(region);
-		matching_l = pmpcfg_l(region);
+uint RVCSR::pmp_region_xwr(const PMPRegion &r) {
+	if (get_effective_priv() == PRV_M && !r.l) {
+		return 0x7u;
+	} else if (get_true_priv() == PRV_M && !r.l) {
+		return r.xwr | PMP_X;
+	} else {
+		return r.xwr;
 	}
-	if (match) {
-		if (get_effective_priv() == PRV_M && !matching_l) {
-			return 0x7u;
-		} else if (get_true_priv() == PRV_M && !matching_l) {
-			return matching_xwr | PMP_X;
-		} else {
-			return matching_xwr;
+}
+
+uint RVCSR::get_pmp_xwr_match(ux_t addr) {
+	for (uint i = 0; i < pmp_n_active; ++i) {
+		const PMPRegion &r = pmp_active[i];
+		if (((addr >> 2) & r.mask) == r.match) {
+			return pmp_region_xwr(r);
+		}
+	}
+	return pmp_xwr_nomatch;
+}
+
+uint RVCSR::get_pmp_xwr_range_match(ux_t addr, ux_t size) {
+	// Each region is one naturally aligned block of words, so the range is
+	// either inside it, outside it, or partly covered
+	ux_t first = addr >> 2;
+	ux_t last = (addr + size - 1) >> 2;
+	for (uint i = 0; i < pmp_n_active; ++i) {
+		const PMPRegion &r = pmp_active[i];
+		ux_t r_first = r.match;
+		ux_t r_last = r.match | ~r.mask;
+		if (first >= r_first && last <= r_last) {
+			return pmp_region_xwr(r);
+		} else if (last >= r_first && first <= r_last) {
+			return 0;
 		}
-	} else {
-		return get_effective_priv() == PRV_M ? 0x7u  :
-		       get_true_priv()      == PRV_M ? PMP_X : 0x0u;
 	}
+	return pmp_xwr_nomatch;
 }
@@ -0,0 +1,533 @@
+#include "rv_decode.h"
+#include "encoding/rv_opcodes.h"
+
+#include <iterator>
+
+// Inclusive msb:lsb style, like Verilog (and like the ISA manual)
+#define BITS_UPTO(msb) (~((-1u << (msb)) << 1))
+#define BITRANGE(msb, lsb) (BITS_UPTO((msb) - (lsb)) << (lsb))
+#define GETBITS(x, msb, lsb) (((x) & BITRANGE(msb, lsb)) >> (lsb))
+#define GETBIT(x, bit) (((x) >> (bit)) & 1u)
+
+const char *const rv_op_names[RVOP_COUNT] = {
+#define RVOP_NAME(name) #name,
+	RVOP_LIST(RVOP_NAME)
+#undef RVOP_NAME
+};
+
+static inline ux_t imm_i(uint32_t instr) {
+	return (instr >> 20) - (instr >> 19 & 0x1000);
+}
+
+static inline ux_t imm_s(uint32_t instr) {
+	return (instr >> 20 & 0xfe0u)
+		+ (instr >> 7 & 0x1fu)
+		- (instr >> 19 & 0x1000u);
+}
+
+static inline ux_t imm_u(uint32_t instr) {
+	return instr & 0xfffff000u;
+}
+
+static inline ux_t imm_b(uint32_t instr) {
+	return (instr >> 7 & 0x1e)
+		+ (instr >> 20 & 0x7e0)
+		+ (instr << 4 & 0x800)
+		- (instr >> 19 & 0x1000);
+}
+
+static inline ux_t imm_j(uint32_t instr) {
+	return (instr >> 20 & 0x7fe)
+		+ (instr >> 9 & 0x800)
+		+ (instr & 0xff000)
+		- (instr >> 11 & 0x100000);
+}
+
+static inline ux_t imm_ci(uint32_t instr) {
+	return GETBITS(instr, 6, 2) - (GETBIT(instr, 12) << 5);
+}
+
+static inline ux_t imm_cj(uint32_t instr) {
+	return -(GETBIT(instr, 12) << 11)
+		+ (GETBIT(instr, 11) << 4)
+		+ (GETBITS(instr, 10, 9) << 8)
+		+ (GETBIT(instr, 8) << 10)
+		+ (GETBIT(instr, 7) << 6)
+		+ (GETBIT(instr, 6) << 7)
+		+ (GETBITS(instr, 5, 3) << 1)
+		+ (GETBIT(instr, 2) << 5);
+}
+
+static inline ux_t imm_cb(uint32_t instr) {
+	return -(GETBIT(instr, 12) << 8)
+		+ (GETBITS(instr, 11, 10) << 3)
+		+ (GETBITS(instr, 6, 5) << 6)
+		+ (GETBITS(instr, 4, 3) << 1)
+		+ (GETBIT(instr, 2) << 5);
+}
+
+static inline uint c_rs1_s(uint32_t instr) {
+	return GETBITS(instr, 9, 7) + 8;
+}
+
+static inline uint c_rs2_s(uint32_t instr) {
+	return GETBITS(instr, 4, 2) + 8;
+}
+
+static inline uint c_rs1_l(uint32_t instr) {
+	return GETBITS(instr, 11, 7);
+}
+
+static inline uint c_rs2_l(uint32_t instr) {
+	return GETBITS(instr, 6, 2);
+}
+
+static inline uint zcmp_s_mapping(uint s_raw) {
+	return s_raw + 8 + 8 * ((s_raw & 0x6) != 0);
+}
+
+// Reserved rlist values (below 4) are illegal, as on Hazard3, so are
+// decoded by zcmp_push_pop() before these are used.
+static inline uint zcmp_n_regs(uint32_t instr) {
+	uint rlist = GETBITS(instr, 7, 4);
+	return rlist == 0xf ? 13 : rlist - 3;
+}
+
+static inline uint zcmp_stack_adj(uint32_t instr) {
+	uint nregs = zcmp_n_regs(instr);
+	uint adj_base =
+		nregs > 12 ? 0x40 :
+		nregs >  8 ? 0x30 :
+		nregs >  4 ? 0x20 : 0x10;
+	return adj_base + 16 * GETBITS(instr, 3, 2);
+}
+
+static inline RVDecodedInstr mkop(uint32_t instr, rv_op op, uint rd = 0, uint rs1 = 0, uint rs2 = 0, ux_t imm = 0) {
+	RVDecodedInstr d;
+	d.instr = instr;
+	d.op = op;
+	d.len = (instr & 0x3) == 0x3 ? 4 : 2;
+	d.rd = rd;
+	d.rs1 = rs1;
+	d.rs2 = rs2;
+	d.imm = imm;
+	return d;
+}
+
+static inline RVDecodedInstr zcmp_push_pop(uint32_t instr, rv_op op) {
+	if (GETBITS(instr, 7, 4) < 4)
+		return mkop(instr, RVOP_ILLEGAL);
+	return mkop(instr, op, 0, 0, zcmp_n_regs(instr), zcmp_stack_adj(instr));
+}
+
+// ----------------------------------------------------------------------------
+// Decode tables, generated at compile time from the MASK/BITS pairs in
+// rv_opcodes.h. Where patterns overlap, the first one listed wins.
+
+// Immediate format of a 32-bit instruction (see RVDecodedInstr::imm)
+enum rv_imm_fmt : uint8_t {
+	IMM_NONE, IMM_I, IMM_S, IMM_B, IMM_U, IMM_J, IMM_SHAMT, IMM_CSR, IMM_BEXTM
+};
+
+// ext is the set of extensions the pattern requires (RVConfig::EXT_xxx)
+struct RVPattern32 {
+	uint32_t mask;
+	uint32_t bits;
+	rv_op op;
+	rv_imm_fmt fmt;
+	uint32_t ext;
+};
+
+#define PAT32(name, fmt) {RVOPC_ ## name ## _MASK, RVOPC_ ## name ## _BITS, RVOP_ ## name, fmt, 0}
+#define PAT32_EXT(name, fmt, ext) {RVOPC_ ## name ## _MASK, RVOPC_ ## name ## _BITS, RVOP_ ## name, fmt, RVConfig::EXT_ ## ext}
+
+static constexpr RVPattern32 patterns_32[] = {
+	// Index 0 is the default for unmatched encodings
+	{0, 0, RVOP_ILLEGAL, IMM_NONE, 0},
+	/* RV32I */
+	PAT32(LUI, IMM_U), PAT32(AUIPC, IMM_U), PAT32(JAL, IMM_J), PAT32(JALR, IMM_I),
+	PAT32(BEQ, IMM_B), PAT32(BNE, IMM_B), PAT32(BLT, IMM_B), PAT32(BGE, IMM_B),
+	PAT32(BLTU, IMM_B), PAT32(BGEU, IMM_B),
+	PAT32(LB, IMM_I), PAT32(LH, IMM_I), PAT32(LW, IMM_I), PAT32(LBU, IMM_I), PAT32(LHU, IMM_I),
+	PAT32(SB, IMM_S), PAT32(SH, IMM_S), PAT32(SW, IMM_S),
+	PAT32(ADDI, IMM_I), PAT32(SLTI, IMM_I), PAT32(SLTIU, IMM_I),
+	PAT32(XORI, IMM_I), PAT32(ORI, IMM_I), PAT32(ANDI, IMM_I),
+	PAT32(SLLI, IMM_SHAMT), PAT32(SRLI, IMM_SHAMT), PAT32(SRAI, IMM_SHAMT),
+	PAT32(ADD, IMM_NONE), PAT32(SUB, IMM_NONE), PAT32(SLL, IMM_NONE), PAT32(SLT, IMM_NONE),
+	PAT32(SLTU, IMM_NONE), PAT32(XOR, IMM_NONE), PAT32(SRL, IMM_NONE), PAT32(SRA, IMM_NONE),
+	PAT32(OR, IMM_NONE), PAT32(AND, IMM_NONE),
+	PAT32(FENCE, IMM_NONE), PAT32_EXT(FENCE_I, IMM_NONE, ZIFENCEI),
+	PAT32(ECALL, IMM_NONE), PAT32(EBREAK, IMM_NONE), PAT32(MRET, IMM_NONE), PAT32(WFI, IMM_NONE),
+	PAT32(CSRRW, IMM_CSR), PAT32(CSRRS, IMM_CSR), PAT32(CSRRC, IMM_CSR),
+	PAT32(CSRRWI, IMM_CSR), PAT32(CSRRSI, IMM_CSR), PAT32(CSRRCI, IMM_CSR),
+	/* M */
+	PAT32_EXT(MUL, IMM_NONE, M), PAT32_EXT(MULH, IMM_NONE, M),
+	PAT32_EXT(MULHSU, IMM_NONE, M), PAT32_EXT(MULHU, IMM_NONE, M),
+	PAT32_EXT(DIV, IMM_NONE, M), PAT32_EXT(DIVU, IMM_NONE, M),
+	PAT32_EXT(REM, IMM_NONE, M), PAT32_EXT(REMU, IMM_NONE, M),
+	/* A */
+	PAT32_EXT(LR_W, IMM_NONE, A), PAT32_EXT(SC_W, IMM_NONE, A),
+	PAT32_EXT(AMOSWAP_W, IMM_NONE, A), PAT32_EXT(AMOADD_W, IMM_NONE, A),
+	PAT32_EXT(AMOXOR_W, IMM_NONE, A), PAT32_EXT(AMOAND_W, IMM_NONE, A),
+	PAT32_EXT(AMOOR_W, IMM_NONE, A), PAT32_EXT(AMOMIN_W, IMM_NONE, A),
+	PAT32_EXT(AMOMAX_W, IMM_NONE, A), PAT32_EXT(AMOMINU_W, IMM_NONE, A),
+	PAT32_EXT(AMOMAXU_W, IMM_NONE, A),
+	/* Zba */
+	PAT32_EXT(SH1ADD, IMM_NONE, ZBA), PAT32_EXT(SH2ADD, IMM_NONE, ZBA), PAT32_EXT(SH3ADD, IMM_NONE, ZBA),
+	/* Zbb */
+	PAT32_EXT(ANDN, IMM_NONE, ZBB), PAT32_EXT(ORN, IMM_NONE, ZBB), PAT32_EXT(XNOR, IMM_NONE, ZBB),
+	PAT32_EXT(CLZ, IMM_SHAMT, ZBB), PAT32_EXT(CPOP, IMM_SHAMT, ZBB), PAT32_EXT(CTZ, IMM_SHAMT, ZBB),
+	PAT32_EXT(MAX, IMM_NONE, ZBB), PAT32_EXT(MAXU, IMM_NONE, ZBB),
+	PAT32_EXT(MIN, IMM_NONE, ZBB), PAT32_EXT(MINU, IMM_NONE, ZBB),
+	PAT32_EXT(ORC_B, IMM_SHAMT, ZBB), PAT32_EXT(REV8, IMM_SHAMT, ZBB),
+	PAT32_EXT(ROL, IMM_NONE, ZBB), PAT32_EXT(ROR, IMM_NONE, ZBB), PAT32_EXT(RORI, IMM_SHAMT, ZBB),
+	PAT32_EXT(SEXT_B, IMM_SHAMT, ZBB), PAT32_EXT(SEXT_H, IMM_SHAMT, ZBB),
+	/* Zbc */
+	PAT32_EXT(CLMUL, IMM_NONE, ZBC), PAT32_EXT(CLMULH, IMM_NONE, ZBC), PAT32_EXT(CLMULR, IMM_NONE, ZBC),
+	/* Zbs */
+	PAT32_EXT(BCLR, IMM_NONE, ZBS), PAT32_EXT(BCLRI, IMM_SHAMT, ZBS),
+	PAT32_EXT(BEXT, IMM_NONE, ZBS), PAT32_EXT(BEXTI, IMM_SHAMT, ZBS),
+	PAT32_EXT(BINV, IMM_NONE, ZBS), PAT32_EXT(BINVI, IMM_SHAMT, ZBS),
+	PAT32_EXT(BSET, IMM_NONE, ZBS), PAT32_EXT(BSETI, IMM_SHAMT, ZBS),
+	/* Zbkb (zext.h is pack with rs2 = x0, so needs no pattern of its own,
+	   but it is the Zbb instruction: see decode_32()) */
+	PAT32_EXT(PACK, IMM_NONE, ZBKB), PAT32_EXT(PACKH, IMM_NONE, ZBKB),
+	PAT32_EXT(BREV8, IMM_SHAMT, ZBKB), PAT32_EXT(ZIP, IMM_SHAMT, ZBKB), PAT32_EXT(UNZIP, IMM_SHAMT, ZBKB),
+	/* Xh3bextm */
+	PAT32_EXT(H3_BEXTM, IMM_BEXTM, XH3BEXTM), PAT32_EXT(H3_BEXTMI, IMM_BEXTM, XH3BEXTM)
+};
+
+#undef PAT32
+#undef PAT32_EXT
+
+static const uint N_PATTERNS_32 = std::size(patterns_32);
+static_assert(N_PATTERNS_32 <= 0x100, "32-bit pattern indices must fit in uint8_t");
+
+// The primary 32-bit table is indexed by major opcode, funct3 and funct7.
+// Most entries are the index of the only pattern which can match. Where a
+// pattern also constrains other bits (e.g. the rs2 field of clz/ctz/cpop),
+// or several patterns share one index, the entry instead points to a short
+// zero-terminated list of patterns to check in turn.
+static const uint32_t KEY32_MASK = 0xfe00707cu;
+static const uint N_KEYS_32 = 1u << 15;
+static const uint16_t KEY32_LIST = 0x8000u;
+static const uint KEY32_MAX_LISTS = 256;
+static const uint KEY32_LIST_SIZE = 1024;
+
+static constexpr uint key_32(uint32_t instr) {
+	return (instr >> 2 & 0x1fu) | (instr >> 7 & 0xe0u) | (instr >> 17 & 0x7f00u);
+}
+
+static constexpr uint32_t key_32_instr(uint key) {
+	return (key << 2 & 0x7cu) | (key << 7 & 0x7000u) | (key << 17 & 0xfe000000u) | 0x3u;
+}
+
+static constexpr bool pattern_covers_key(const RVPattern32 &p, uint key) {
+	return (key_32_instr(key) & p.mask & (KEY32_MASK | 0x3u)) == (p.bits & (KEY32_MASK | 0x3u));
+}
+
+struct RVDecodeTable32 {
+	uint16_t entry[N_KEYS_32];
+	uint8_t list[KEY32_LIST_SIZE];
+};
+
+static constexpr RVDecodeTable32 make_decode_table_32() {
+	RVDecodeTable32 t = {};
+	// Keys which need a list, filled in once all patterns have been seen
+	uint16_t list_keys[KEY32_MAX_LISTS] = {};
+	uint n_list_keys = 0;
+	for (uint p = 1; p < N_PATTERNS_32; ++p) {
+		const RVPattern32 &pat = patterns_32[p];
+		bool exact = !(pat.mask & ~(KEY32_MASK | 0x3u));
+		// Visit every key the pattern covers, by counting through the key
+		// bits it leaves free
+		uint32_t free = KEY32_MASK & ~pat.mask;
+		uint32_t sub = 0;
+		do {
+			uint key = key_32(pat.bits | sub);
+			if (t.entry[key] == 0 && exact) {
+				t.entry[key] = p;
+			} else if (t.entry[key] != KEY32_LIST) {
+				t.entry[key] = KEY32_LIST;
+				list_keys[n_list_keys++] = key;
+			}
+			sub = (sub - free) & free;
+		} while (sub);
+	}
+	uint list_size = 0;
+	for (uint i = 0; i < n_list_keys; ++i) {
+		uint key = list_keys[i];
+		t.entry[key] = KEY32_LIST | list_size;
+		for (uint p = 1; p < N_PATTERNS_32; ++p) {
+			if (pattern_covers_key(patterns_32[p], key))
+				t.list[list_size++] = p;
+		}
+		t.list[list_size++] = 0;
+	}
+	return t;
+}
+
+static constexpr RVDecodeTable32 decode_table_32 = make_decode_table_32();
+
+static RVDecodedInstr decode_32(uint32_t instr, uint32_t ext) {
+	uint e = decode_table_32.entry[key_32(instr)];
+	if (e & KEY32_LIST) {
+		const uint8_t *l = &decode_table_32.list[e & ~KEY32_LIST];
+		while (*l && !_RVOPC_MATCH(instr, patterns_32[*l].mask, patterns_32[*l].bits))
+			++l;
+		e = *l;
+	}
+	// Hazard3 decodes zext.h as a Zbb instruction, even with Zbkb
+	uint32_t need = patterns_32[e].op == RVOP_PACK && !(instr >> 20 & 0x1f) ?
+		(uint32_t)RVConfig::EXT_ZBB : patterns_32[e].ext;
+	if (need & ~ext)
+		e = 0;
+	const RVPattern32 &p = patterns_32[e];
+	ux_t imm = 0;
+	switch (p.fmt) {
+		case IMM_I:     imm = imm_i(instr);                  break;
+		case IMM_S:     imm = imm_s(instr);                  break;
+		case IMM_B:     imm = imm_b(instr);                  break;
+		case IMM_U:     imm = imm_u(instr);                  break;
+		case IMM_J:     imm = imm_j(instr);                  break;
+		case IMM_SHAMT: imm = instr >> 20 & 0x1fu;           break;
+		case IMM_CSR:   imm = instr >> 20;                   break;
+		case IMM_BEXTM: imm = GETBITS(instr, 28, 26) + 1;    break;
+		default:                                             break;
+	}
+	return mkop(instr, p.op, instr >> 7 & 0x1f, instr >> 15 & 0x1f, instr >> 20 & 0x1f, imm);
+}
+
+// 16-bit instructions have a full 64k-entry table, giving the index of a
+// pattern whose handler expands the instruction to its decoded operation.
+
+typedef RVDecodedInstr (*rv_expand_fn)(uint32_t instr);
+
+struct RVPattern16 {
+	uint16_t mask;
+	uint16_t bits;
+	uint32_t ext;
+	rv_expand_fn expand;
+};
+
+// Every 16-bit instruction requires C, and some require other extensions too
+#define PAT16(name) RVOPC_ ## name ## _MASK, RVOPC_ ## name ## _BITS, RVConfig::EXT_C
+#define PAT16_EXT(name, ext) RVOPC_ ## name ## _MASK, RVOPC_ ## name ## _BITS, RVConfig::EXT_C | (ext)
+
+static RVDecodedInstr c_illegal(uint32_t instr) {
+	return mkop(instr, RVOP_ILLEGAL);
+}
+
+static constexpr RVPattern16 patterns_16[] = {
+	// Index 0 is the default for unmatched encodings
+	{0, 0, 0, c_illegal},
+
+	// RVC Quadrant 00:
+	{PAT16(ILLEGAL16), c_illegal},
+	{PAT16(C_ADDI4SPN), [](uint32_t instr) {
+		return mkop(instr, RVOP_ADDI, c_rs2_s(instr), 2, 0,
+			(GETBITS(instr, 12, 11) << 4)
+			+ (GETBITS(instr, 10, 7) << 6)
+			+ (GETBIT(instr, 6) << 2)
+			+ (GETBIT(instr, 5) << 3));
+	}},
+	{PAT16(C_LW), [](uint32_t instr) {
+		return mkop(instr, RVOP_C_LW, c_rs2_s(instr), c_rs1_s(instr), 0,
+			(GETBIT(instr, 6) << 2) + (GETBITS(instr, 12, 10) << 3) + (GETBIT(instr, 5) << 6));
+	}},
+	{PAT16(C_SW), [](uint32_t instr) {
+		return mkop(instr, RVOP_C_SW, 0, c_rs1_s(instr), c_rs2_s(instr),
+			(GETBIT(instr, 6) << 2) + (GETBITS(instr, 12, 10) << 3) + (GETBIT(instr, 5) << 6));
+	}},
+	// Zcb:
+	{PAT16_EXT(C_LBU, RVConfig::EXT_ZCB), [](uint32_t instr) {
+		return mkop(instr, RVOP_LBU, c_rs2_s(instr), c_rs1_s(instr), 0,
+			(GETBIT(instr, 6) << 0) + (GETBIT(instr, 5) << 1));
+	}},
+	{PAT16_EXT(C_LHU, RVConfig::EXT_ZCB), [](uint32_t instr) {
+		return mkop(instr, RVOP_LHU, c_rs2_s(instr), c_rs1_s(instr), 0, GETBIT(instr, 5) << 1);
+	}},
+	{PAT16_EXT(C_LH, RVConfig::EXT_ZCB), [](uint32_t instr) {
+		return mkop(instr, RVOP_LH, c_rs2_s(instr), c_rs1_s(instr), 0, GETBIT(instr, 5) << 1);
+	}},
+	{PAT16_EXT(C_SB, RVConfig::EXT_ZCB), [](uint32_t instr) {
+		return mkop(instr, RVOP_SB, 0, c_rs1_s(instr), c_rs2_s(instr),
+			(GETBIT(instr, 6) << 0) + (GETBIT(instr, 5) << 1));
+	}},
+	{PAT16_EXT(C_SH, RVConfig::EXT_ZCB), [](uint32_t instr) {
+		return mkop(instr, RVOP_C_SH, 0, c_rs1_s(instr), c_rs2_s(instr), GETBIT(instr, 5) << 1);
+	}},
+
+	// RVC Quadrant 01:
+	{PAT16(C_ADDI), [](uint32_t instr) {
+		return mkop(instr, RVOP_ADDI, c_rs1_l(instr), c_rs1_l(instr), 0, imm_ci(instr));
+	}},
+	{PAT16(C_JAL), [](uint32_t instr) {
+		return mkop(instr, RVOP_JAL, 1, 0, 0, imm_cj(instr));
+	}},
+	{PAT16(C_LI), [](uint32_t instr) {
+		return mkop(instr, RVOP_ADDI, c_rs1_l(instr), 0, 0, imm_ci(instr));
+	}},
+	{PAT16(C_LUI), [](uint32_t instr) {
+		// ADDI16SPN if rd is sp
+		if (c_rs1_l(instr) == 2) {
+			return mkop(instr, RVOP_ADDI, 2, 2, 0,
+				- (GETBIT(instr, 12) << 9)
+				+ (GETBIT(instr, 6) << 4)
+				+ (GETBIT(instr, 5) << 6)
+				+ (GETBITS(instr, 4, 3) << 7)
+				+ (GETBIT(instr, 2) << 5));
+		} else {
+			return mkop(instr, RVOP_LUI, c_rs1_l(instr), 0, 0,
+				-(GETBIT(instr, 12) << 17) + (GETBITS(instr, 6, 2) << 12));
+		}
+	}},
+	{PAT16(C_SRLI), [](uint32_t instr) {
+		return mkop(instr, RVOP_SRLI, c_rs1_s(instr), c_rs1_s(instr), 0, GETBITS(instr, 6, 2));
+	}},
+	{PAT16(C_SRAI), [](uint32_t instr) {
+		return mkop(instr, RVOP_SRAI, c_rs1_s(instr), c_rs1_s(instr), 0, GETBITS(instr, 6, 2));
+	}},
+	{PAT16(C_ANDI), [](uint32_t instr) {
+		return mkop(instr, RVOP_ANDI, c_rs1_s(instr), c_rs1_s(instr), 0, imm_ci(instr));
+	}},
+	{PAT16(C_SUB), [](uint32_t instr) {
+		return mkop(instr, RVOP_SUB, c_rs1_s(instr), c_rs1_s(instr), c_rs2_s(instr));
+	}},
+	{PAT16(C_XOR), [](uint32_t instr) {
+		return mkop(instr, RVOP_XOR, c_rs1_s(instr), c_rs1_s(instr), c_rs2_s(instr));
+	}},
+	{PAT16(C_OR), [](uint32_t instr) {
+		return mkop(instr, RVOP_OR, c_rs1_s(instr), c_rs1_s(instr), c_rs2_s(instr));
+	}},
+	{PAT16(C_AND), [](uint32_t instr) {
+		return mkop(instr, RVOP_AND, c_rs1_s(instr), c_rs1_s(instr), c_rs2_s(instr));
+	}},
+	{PAT16(C_J), [](uint32_t instr) {
+		return mkop(instr, RVOP_JAL, 0, 0, 0, imm_cj(instr));
+	}},
+	{PAT16(C_BEQZ), [](uint32_t instr) {
+		return mkop(instr, RVOP_BEQ, 0, c_rs1_s(instr), 0, imm_cb(instr));
+	}},
+	{PAT16(C_BNEZ), [](uint32_t instr) {
+		return mkop(instr, RVOP_BNE, 0, c_rs1_s(instr), 0, imm_cb(instr));
+	}},
+	// Zcb:
+	{PAT16_EXT(C_ZEXT_B, RVConfig::EXT_ZCB), [](uint32_t instr) {
+		return mkop(instr, RVOP_ANDI, c_rs1_s(instr), c_rs1_s(instr), 0, 0xffu);
+	}},
+	{PAT16_EXT(C_SEXT_B, RVConfig::EXT_ZCB | RVConfig::EXT_ZBB), [](uint32_t instr) {
+		return mkop(instr, RVOP_SEXT_B, c_rs1_s(instr), c_rs1_s(instr));
+	}},
+	{PAT16_EXT(C_ZEXT_H, RVConfig::EXT_ZCB | RVConfig::EXT_ZBB), [](uint32_t instr) {
+		// zext.h is pack with rs2 = x0
+		return mkop(instr, RVOP_PACK, c_rs1_s(instr), c_rs1_s(instr), 0);
+	}},
+	{PAT16_EXT(C_SEXT_H, RVConfig::EXT_ZCB | RVConfig::EXT_ZBB), [](uint32_t instr) {
+		return mkop(instr, RVOP_SEXT_H, c_rs1_s(instr), c_rs1_s(instr));
+	}},
+	{PAT16_EXT(C_NOT, RVConfig::EXT_ZCB), [](uint32_t instr) {
+		return mkop(instr, RVOP_XORI, c_rs1_s(instr), c_rs1_s(instr), 0, -1u);
+	}},
+	{PAT16_EXT(C_MUL, RVConfig::EXT_ZCB | RVConfig::EXT_M), [](uint32_t instr) {
+		return mkop(instr, RVOP_MUL, c_rs1_s(instr), c_rs1_s(instr), c_rs2_s(instr));
+	}},
+
+	// RVC Quadrant 10:
+	{PAT16(C_SLLI), [](uint32_t instr) {
+		return mkop(instr, RVOP_SLLI, c_rs1_l(instr), c_rs1_l(instr), 0, GETBITS(instr, 6, 2));
+	}},
+	{PAT16(C_MV), [](uint32_t instr) {
+		if (c_rs2_l(instr) == 0) {
+			// c.jr
+			return mkop(instr, RVOP_JALR, 0, c_rs1_l(instr), 0, 0);
+		} else {
+			return mkop(instr, RVOP_ADD, c_rs1_l(instr), 0, c_rs2_l(instr));
+		}
+	}},
+	{PAT16(C_ADD), [](uint32_t instr) {
+		if (c_rs2_l(instr) != 0) {
+			return mkop(instr, RVOP_ADD, c_rs1_l(instr), c_rs1_l(instr), c_rs2_l(instr));
+		} else if (c_rs1_l(instr) == 0) {
+			return mkop(instr, RVOP_EBREAK);
+		} else {
+			// c.jalr
+			return mkop(instr, RVOP_JALR, 1, c_rs1_l(instr), 0, 0);
+		}
+	}},
+	{PAT16(C_LWSP), [](uint32_t instr) {
+		return mkop(instr, RVOP_C_LW, c_rs1_l(instr), 2, 0,
+			(GETBIT(instr, 12) << 5)
+			+ (GETBITS(instr, 6, 4) << 2)
+			+ (GETBITS(instr, 3, 2) << 6));
+	}},
+	{PAT16(C_SWSP), [](uint32_t instr) {
+		return mkop(instr, RVOP_C_SW, 0, 2, c_rs2_l(instr),
+			(GETBITS(instr, 12, 9) << 2)
+			+ (GETBITS(instr, 8, 7) << 6));
+	}},
+	// Zcmp:
+	{PAT16_EXT(CM_PUSH, RVConfig::EXT_ZCMP), [](uint32_t instr) {
+		return zcmp_push_pop(instr, RVOP_CM_PUSH);
+	}},
+	{PAT16_EXT(CM_POP, RVConfig::EXT_ZCMP), [](uint32_t instr) {
+		return zcmp_push_pop(instr, RVOP_CM_POP);
+	}},
+	{PAT16_EXT(CM_POPRET, RVConfig::EXT_ZCMP), [](uint32_t instr) {
+		return zcmp_push_pop(instr, RVOP_CM_POPRET);
+	}},
+	{PAT16_EXT(CM_POPRETZ, RVConfig::EXT_ZCMP), [](uint32_t instr) {
+		return zcmp_push_pop(instr, RVOP_CM_POPRETZ);
+	}},
+	{PAT16_EXT(CM_MVSA01, RVConfig::EXT_ZCMP), [](uint32_t instr) {
+		return mkop(instr, RVOP_CM_MVSA01, 0,
+			zcmp_s_mapping(GETBITS(instr, 9, 7)), zcmp_s_mapping(GETBITS(instr, 4, 2)));
+	}},
+	{PAT16_EXT(CM_MVA01S, RVConfig::EXT_ZCMP), [](uint32_t instr) {
+		return mkop(instr, RVOP_CM_MVA01S, 0,
+			zcmp_s_mapping(GETBITS(instr, 9, 7)), zcmp_s_mapping(GETBITS(instr, 4, 2)));
+	}}
+};
+
+#undef PAT16
+#undef PAT16_EXT
+
+static const uint N_PATTERNS_16 = std::size(patterns_16);
+static_assert(N_PATTERNS_16 <= 0x100, "16-bit pattern indices must fit in uint8_t");
+
+struct RVDecodeTable16 {
+	uint8_t entry[1u << 16];
+};
+
+static constexpr RVDecodeTable16 make_decode_table_16() {
+	RVDecodeTable16 t = {};
+	for (uint p = 1; p < N_PATTERNS_16; ++p) {
+		// Visit every encoding the pattern matches
+		uint32_t free = ~patterns_16[p].mask & 0xffffu;
+		uint32_t sub = 0;
+		do {
+			uint8_t &e = t.entry[patterns_16[p].bits | sub];
+			if (e == 0)
+				e = p;
+			sub = (sub - free) & free;
+		} while (sub);
+	}
+	return t;
+}
+
+static constexpr RVDecodeTable16 decode_table_16 = make_decode_table_16();
+
+static RVDecodedInstr decode_16(uint32_t instr, uint32_t ext) {
+	instr &= 0xffffu;
+	const RVPattern16 &p = patterns_16[decode_table_16.entry[instr]];
+	if (p.ext & ~ext)
+		return c_illegal(instr);
+	return p.expand(instr);
+}
+
+RVDecodedInstr rv_decode(uint32_t instr, uint32_t ext) {
+	if ((instr & 0x3) == 0x3)
+		return decode_32(instr, ext);
+	else
+		return decode_16(instr, ext);
+}
@@ -0,0 +1,428 @@
+#include "rv_fuzz.h"
+#include "rv_decode.h"
+#include "encoding/rv_csr.h"
+#include "encoding/rv_opcodes.h"
+
+#include <algorithm>
+
+// Hazard3 testbench memory map
+static const uint32_t RESET_VECTOR = 0x40;
+static const uint32_t IO_EXIT_ADDR = 0x80000008;
+
+static const uint32_t SP_INIT = FuzzGenerator::DATA_BASE + 0x8000;
+static const uint32_t S0_INIT = FuzzGenerator::DATA_BASE + 0x4000;
+// Where the trap handler saves its second scratch register
+static const uint32_t HANDLER_SAVE = FuzzGenerator::DATA_BASE + 0xf000;
+
+// Registers the trap handler and prologue use as scratch
+static const uint X30 = 30;
+static const uint X31 = 31;
+
+struct fuzz_template {
+	uint32_t bits;
+	uint32_t mask;
+};
+
+#define FUZZ_TEMPLATE(name) {RVOPC_ ## name ## _BITS, RVOPC_ ## name ## _MASK},
+static const fuzz_template templates[] = {
+	FUZZ_TEMPLATE(LUI) FUZZ_TEMPLATE(AUIPC)
+	FUZZ_TEMPLATE(LB) FUZZ_TEMPLATE(LH) FUZZ_TEMPLATE(LW) FUZZ_TEMPLATE(LBU) FUZZ_TEMPLATE(LHU)
+	FUZZ_TEMPLATE(SB) FUZZ_TEMPLATE(SH) FUZZ_TEMPLATE(SW)
+	FUZZ_TEMPLATE(ADDI) FUZZ_TEMPLATE(SLLI) FUZZ_TEMPLATE(SLTI) FUZZ_TEMPLATE(SLTIU) FUZZ_TEMPLATE(XORI)
+	FUZZ_TEMPLATE(SRLI) FUZZ_TEMPLATE(SRAI) FUZZ_TEMPLATE(ORI) FUZZ_TEMPLATE(ANDI)
+	FUZZ_TEMPLATE(ADD) FUZZ_TEMPLATE(SUB) FUZZ_TEMPLATE(SLL) FUZZ_TEMPLATE(SLT) FUZZ_TEMPLATE(SLTU)
+	FUZZ_TEMPLATE(XOR) FUZZ_TEMPLATE(SRL) FUZZ_TEMPLATE(SRA) FUZZ_TEMPLATE(OR) FUZZ_TEMPLATE(AND)
+	FUZZ_TEMPLATE(FENCE) FUZZ_TEMPLATE(FENCE_I) FUZZ_TEMPLATE(ECALL) FUZZ_TEMPLATE(EBREAK)
+	FUZZ_TEMPLATE(CSRRW) FUZZ_TEMPLATE(CSRRS) FUZZ_TEMPLATE(CSRRC)
+	FUZZ_TEMPLATE(CSRRWI) FUZZ_TEMPLATE(CSRRSI) FUZZ_TEMPLATE(CSRRCI)
+	FUZZ_TEMPLATE(MUL) FUZZ_TEMPLATE(MULH) FUZZ_TEMPLATE(MULHSU) FUZZ_TEMPLATE(MULHU)
+	FUZZ_TEMPLATE(DIV) FUZZ_TEMPLATE(DIVU) FUZZ_TEMPLATE(REM) FUZZ_TEMPLATE(REMU)
+	FUZZ_TEMPLATE(LR_W) FUZZ_TEMPLATE(SC_W) FUZZ_TEMPLATE(AMOSWAP_W) FUZZ_TEMPLATE(AMOADD_W)
+	FUZZ_TEMPLATE(AMOXOR_W) FUZZ_TEMPLATE(AMOAND_W) FUZZ_TEMPLATE(AMOOR_W) FUZZ_TEMPLATE(AMOMIN_W)
+	FUZZ_TEMPLATE(AMOMAX_W) FUZZ_TEMPLATE(AMOMINU_W) FUZZ_TEMPLATE(AMOMAXU_W)
+	FUZZ_TEMPLATE(SH1ADD) FUZZ_TEMPLATE(SH2ADD) FUZZ_TEMPLATE(SH3ADD)
+	FUZZ_TEMPLATE(ANDN) FUZZ_TEMPLATE(CLZ) FUZZ_TEMPLATE(CPOP) FUZZ_TEMPLATE(CTZ) FUZZ_TEMPLATE(MAX)
+	FUZZ_TEMPLATE(MAXU) FUZZ_TEMPLATE(MIN) FUZZ_TEMPLATE(MINU) FUZZ_TEMPLATE(ORC_B) FUZZ_TEMPLATE(ORN)
+	FUZZ_TEMPLATE(REV8) FUZZ_TEMPLATE(ROL) FUZZ_TEMPLATE(ROR) FUZZ_TEMPLATE(RORI) FUZZ_TEMPLATE(SEXT_B)
+	FUZZ_TEMPLATE(SEXT_H) FUZZ_TEMPLATE(XNOR) FUZZ_TEMPLATE(ZEXT_H)
+	FUZZ_TEMPLATE(CLMUL) FUZZ_TEMPLATE(CLMULH) FUZZ_TEMPLATE(CLMULR)
+	FUZZ_TEMPLATE(BCLR) FUZZ_TEMPLATE(BCLRI) FUZZ_TEMPLATE(BEXT) FUZZ_TEMPLATE(BEXTI)
+	FUZZ_TEMPLATE(BINV) FUZZ_TEMPLATE(BINVI) FUZZ_TEMPLATE(BSET) FUZZ_TEMPLATE(BSETI)
+	FUZZ_TEMPLATE(PACK) FUZZ_TEMPLATE(PACKH) FUZZ_TEMPLATE(BREV8) FUZZ_TEMPLATE(UNZIP) FUZZ_TEMPLATE(ZIP)
+	FUZZ_TEMPLATE(XPERM_B) FUZZ_TEMPLATE(XPERM_N)
+	FUZZ_TEMPLATE(H3_BEXTM) FUZZ_TEMPLATE(H3_BEXTMI)
+	FUZZ_TEMPLATE(ILLEGAL16) FUZZ_TEMPLATE(C_ADDI4SPN) FUZZ_TEMPLATE(C_LW) FUZZ_TEMPLATE(C_SW)
+	FUZZ_TEMPLATE(C_ADDI) FUZZ_TEMPLATE(C_LI) FUZZ_TEMPLATE(C_LUI) FUZZ_TEMPLATE(C_SRLI)
+	FUZZ_TEMPLATE(C_SRAI) FUZZ_TEMPLATE(C_ANDI) FUZZ_TEMPLATE(C_SUB) FUZZ_TEMPLATE(C_XOR)
+	FUZZ_TEMPLATE(C_OR) FUZZ_TEMPLATE(C_AND) FUZZ_TEMPLATE(C_SLLI) FUZZ_TEMPLATE(C_MV)
+	FUZZ_TEMPLATE(C_ADD) FUZZ_TEMPLATE(C_LWSP) FUZZ_TEMPLATE(C_SWSP)
+	FUZZ_TEMPLATE(C_LBU) FUZZ_TEMPLATE(C_LHU) FUZZ_TEMPLATE(C_LH) FUZZ_TEMPLATE(C_SB) FUZZ_TEMPLATE(C_SH)
+	FUZZ_TEMPLATE(C_ZEXT_B) FUZZ_TEMPLATE(C_SEXT_B) FUZZ_TEMPLATE(C_ZEXT_H) FUZZ_TEMPLATE(C_SEXT_H)
+	FUZZ_TEMPLATE(C_NOT) FUZZ_TEMPLATE(C_MUL)
+	FUZZ_TEMPLATE(CM_PUSH) FUZZ_TEMPLATE(CM_POP) FUZZ_TEMPLATE(CM_MVA01S)
+};
+#undef FUZZ_TEMPLATE
+
+static const uint32_t branch_templates[] = {
+	RVOPC_BEQ_BITS, RVOPC_BNE_BITS, RVOPC_BLT_BITS, RVOPC_BGE_BITS, RVOPC_BLTU_BITS, RVOPC_BGEU_BITS
+};
+
+// CSR address ranges to pick from, most of them implemented
+static const struct {uint16_t first, last;} csr_ranges[] = {
+	{0x300, 0x30f}, {0x320, 0x33f}, {0x340, 0x34f}, {0x3a0, 0x3ef}, {0x7a0, 0x7a5}, {0x7b0, 0x7b3},
+	{0xb00, 0xb9f}, {0xbc0, 0xbff}, {0xc00, 0xc9f}, {0xf11, 0xf15}
+};
+
+static bool is_16bit(uint32_t instr) {
+	return (instr & 0x3) != 0x3;
+}
+
+static uint32_t instr_size(const FuzzInstr &fi) {
+	if (fi.kind == FuzzInstr::RAW)
+		return is_16bit(fi.bits) ? 2 : 4;
+	return fi.kind == FuzzInstr::BRANCH || fi.kind == FuzzInstr::JAL ? 4 : 2;
+}
+
+// Fill in the offset fields of each branch/jump format
+static uint32_t enc_b_offset(int32_t imm) {
+	return (imm >> 12 & 0x1) << 31 | (imm >> 5 & 0x3f) << 25 | (imm >> 1 & 0xf) << 8 | (imm >> 11 & 0x1) << 7;
+}
+
+static uint32_t enc_j_offset(int32_t imm) {
+	return (imm >> 20 & 0x1) << 31 | (imm >> 1 & 0x3ff) << 21 | (imm >> 11 & 0x1) << 20 | (imm >> 12 & 0xff) << 12;
+}
+
+static uint32_t enc_cb_offset(int32_t imm) {
+	return (imm >> 8 & 0x1) << 12 | (imm >> 3 & 0x3) << 10 | (imm >> 6 & 0x3) << 5 |
+		(imm >> 1 & 0x3) << 3 | (imm >> 5 & 0x1) << 2;
+}
+
+static uint32_t enc_cj_offset(int32_t imm) {
+	return (imm >> 11 & 0x1) << 12 | (imm >> 4 & 0x1) << 11 | (imm >> 8 & 0x3) << 9 | (imm >> 10 & 0x1) << 8 |
+		(imm >> 6 & 0x1) << 7 | (imm >> 7 & 0x1) << 6 | (imm >> 1 & 0x7) << 3 | (imm >> 5 & 0x1) << 2;
+}
+
+static uint32_t enc_i(uint32_t bits, uint rd, uint rs1, int32_t imm) {
+	return bits | rd << 7 | rs1 << 15 | (uint32_t)imm << 20;
+}
+
+static uint32_t enc_s(uint32_t bits, uint rs1, uint rs2, int32_t imm) {
+	return bits | rs1 << 15 | rs2 << 20 | (imm & 0x1f) << 7 | (uint32_t)(imm >> 5) << 25;
+}
+
+static uint32_t enc_csr(uint32_t bits, uint rd, uint csr, uint rs1) {
+	return bits | rd << 7 | rs1 << 15 | csr << 20;
+}
+
+static void put(std::vector<uint8_t> &image, uint32_t &pc, uint32_t instr, uint32_t size) {
+	for (uint32_t i = 0; i < size; ++i)
+		image[pc + i] = instr >> 8 * i;
+	pc += size;
+}
+
+static void put_li(std::vector<uint8_t> &image, uint32_t &pc, uint rd, uint32_t value) {
+	uint32_t hi = (value + 0x800u) & 0xfffff000u;
+	put(image, pc, RVOPC_LUI_BITS | rd << 7 | hi, 4);
+	put(image, pc, enc_i(RVOPC_ADDI_BITS, rd, rd, value - hi), 4);
+}
+
+// Prologue: trap vector, PMP lock on the code region, then every register
+static const uint32_t PROLOGUE_SIZE = 4 * (2 + 1 + 2 + 1 + 1 + 1 + 2 * 31);
+
+std::vector<uint8_t> FuzzProgram::assemble() const {
+	std::vector<uint8_t> image(FuzzGenerator::DATA_BASE + FuzzGenerator::DATA_SIZE);
+	uint64_t r = data_seed * 0x9e3779b97f4a7c15ull | 1;
+	for (uint32_t i = FuzzGenerator::DATA_BASE; i < image.size(); i += 4) {
+		r ^= r >> 12;
+		r ^= r << 25;
+		r ^= r >> 27;
+		uint32_t w = r * 0x2545f4914f6cdd1dull >> 32;
+		for (int b = 0; b < 4; ++b)
+			image[i + b] = w >> 8 * b;
+	}
+
+	std::vector<uint32_t> offsets(body.size() + 1);
+	uint32_t body_start = RESET_VECTOR + PROLOGUE_SIZE;
+	offsets[0] = body_start;
+	for (size_t i = 0; i < body.size(); ++i)
+		offsets[i + 1] = offsets[i] + instr_size(body[i]);
+	uint32_t exit_addr = offsets[body.size()];
+	uint32_t handler = (exit_addr + 12 + 3) & ~0x3u;
+
+	uint32_t pc = RESET_VECTOR;
+	put_li(image, pc, X31, handler);
+	put(image, pc, enc_csr(RVOPC_CSRRW_BITS, 0, CSR_MTVEC, X31), 4);
+	// Locked NAPOT region over the code, R and X only
+	put_li(image, pc, X31, (FuzzGenerator::CODE_SIZE >> 3) - 1);
+	put(image, pc, enc_csr(RVOPC_CSRRW_BITS, 0, CSR_PMPADDR0, X31), 4);
+	put(image, pc, enc_i(RVOPC_ADDI_BITS, X31, 0, 0x9d), 4);
+	put(image, pc, enc_csr(RVOPC_CSRRW_BITS, 0, CSR_PMPCFG0, X31), 4);
+	for (uint rd = 1; rd < 32; ++rd)
+		put_li(image, pc, rd, rd == 2 ? SP_INIT : rd == 8 ? S0_INIT : regs[rd]);
+
+	for (size_t i = 0; i < body.size(); ++i) {
+		const FuzzInstr &fi = body[i];
+		int32_t offset = offsets[std::min(i + fi.skip, body.size())] - offsets[i];
+		switch (fi.kind) {
+		case FuzzInstr::RAW:      put(image, pc, fi.bits, instr_size(fi));                break;
+		case FuzzInstr::BRANCH:   put(image, pc, fi.bits | enc_b_offset(offset), 4);     break;
+		case FuzzInstr::JAL:      put(image, pc, fi.bits | enc_j_offset(offset), 4);     break;
+		case FuzzInstr::C_BRANCH: put(image, pc, fi.bits | enc_cb_offset(offset), 2);    break;
+		case FuzzInstr::C_J:
+		case FuzzInstr::C_JAL:    put(image, pc, fi.bits | enc_cj_offset(offset), 2);    break;
+		}
+	}
+
+	// Exit, from the end of the body or from the handler on a fetch fault
+	put(image, pc, RVOPC_LUI_BITS | X31 << 7 | (IO_EXIT_ADDR & 0xfffff000u), 4);
+	put(image, pc, enc_s(RVOPC_SW_BITS, X31, 0, IO_EXIT_ADDR & 0xfffu), 4);
+	put(image, pc, RVOPC_JAL_BITS, 4);
+	while (pc < handler)
+		put(image, pc, 0x0001, 2); // c.nop
+
+	// Trap handler: step over the trapping instruction (its length from its
+	// low bits), and return to M-mode, or exit on an instruction fetch fault
+	put(image, pc, enc_csr(RVOPC_CSRRW_BITS, 0, CSR_MSCRATCH, X31), 4);
+	put(image, pc, RVOPC_LUI_BITS | X31 << 7 | HANDLER_SAVE, 4);
+	put(image, pc, enc_s(RVOPC_SW_BITS, X31, X30, 0), 4);
+	put(image, pc, enc_csr(RVOPC_CSRRS_BITS, X30, CSR_MCAUSE, 0), 4);
+	put(image, pc, enc_i(RVOPC_SLTIU_BITS, X30, X30, XCAUSE_INSTR_FAULT + 1), 4);
+	put(image, pc, RVOPC_BEQ_BITS | X30 << 15 | enc_b_offset(8), 4);
+	put(image, pc, RVOPC_JAL_BITS | enc_j_offset(exit_addr - pc), 4);
+	put(image, pc, enc_csr(RVOPC_CSRRS_BITS, X30, CSR_MEPC, 0), 4);
+	put(image, pc, enc_i(RVOPC_LHU_BITS, X31, X30, 0), 4);
+	put(image, pc, enc_i(RVOPC_ANDI_BITS, X31, X31, 3), 4);
+	put(image, pc, enc_i(RVOPC_ADDI_BITS, X31, X31, -3), 4);
+	put(image, pc, enc_i(RVOPC_ADDI_BITS, X30, X30, 2), 4);
+	put(image, pc, RVOPC_BNE_BITS | X31 << 15 | enc_b_offset(8), 4);
+	put(image, pc, enc_i(RVOPC_ADDI_BITS, X30, X30, 2), 4);
+	put(image, pc, enc_csr(RVOPC_CSRRW_BITS, 0, CSR_MEPC, X30), 4);
+	put_li(image, pc, X30, MSTATUS_MPP);
+	put(image, pc, enc_csr(RVOPC_CSRRS_BITS, 0, CSR_MSTATUS, X30), 4);
+	put(image, pc, RVOPC_LUI_BITS | X31 << 7 | HANDLER_SAVE, 4);
+	put(image, pc, enc_i(RVOPC_LW_BITS, X30, X31, 0), 4);
+	put(image, pc, enc_csr(RVOPC_CSRRS_BITS, X31, CSR_MSCRATCH, 0), 4);
+	put(image, pc, RVOPC_MRET_BITS, 4);
+	return image;
+}
+
+static bool is_mem_op(rv_op op) {
+	return (op >= RVOP_LB && op <= RVOP_SW) || (op >= RVOP_LR_W && op <= RVOP_AMOMAXU_W) ||
+		op == RVOP_C_LW || op == RVOP_C_SW || op == RVOP_C_SH;
+}
+
+// Writes to these would redirect traps, enable interrupts, change PMP, or
+// arm breakpoint triggers: one with tdata1.action = 1 enters Debug Mode on
+// the RTL, which rvcpp does not model. Trigger CSRs are still read. The
+// HPM counters and events are only written if rvcpp models them.
+static bool csr_write_allowed(uint32_t csr, bool hpm_events) {
+	bool hpm = (csr >= CSR_MHPMEVENT3 && csr <= CSR_MHPMEVENT31) ||
+		(csr >= CSR_MHPMCOUNTER3 && csr <= CSR_MHPMCOUNTER31) ||
+		(csr >= CSR_MHPMCOUNTER3H && csr <= CSR_MHPMCOUNTER31H);
+	return !(csr == CSR_MIE || csr == CSR_MTVEC || (csr >= CSR_PMPCFG0 && csr <= 0x3ef) || (csr & 0xff0) == 0xbd0 ||
+		(csr >= CSR_TSELECT && csr <= 0x7af) || (hpm && !hpm_events));
+}
+
+// Make a random instruction safe to run, or return false to reject it
+bool FuzzGenerator::fixup_raw(uint32_t &instr) {
+	if (is_16bit(instr))
+		instr &= 0xffffu;
+	RVDecodedInstr d = rv_decode(instr);
+	switch (d.op) {
+	// Control flow is generated separately, so that it only goes forwards
+	case RVOP_JAL: case RVOP_JALR: case RVOP_MRET:
+	case RVOP_BEQ: case RVOP_BNE: case RVOP_BLT: case RVOP_BGE: case RVOP_BLTU: case RVOP_BGEU:
+	case RVOP_CM_POPRET: case RVOP_CM_POPRETZ:
+	// Nothing to wake from
+	case RVOP_WFI:
+	// Writes s0
+	case RVOP_CM_MVSA01:
+		return false;
+	case RVOP_CM_POP:
+		// s0 is reloaded for more than just ra
+		return d.rs2 < 2;
+	case RVOP_SLT:
+		// h3.block, which also has nothing to wake it
+		return instr != RVOPC_SLT_BITS;
+	case RVOP_CSRRW: case RVOP_CSRRS: case RVOP_CSRRC:
+	case RVOP_CSRRWI: case RVOP_CSRRSI: case RVOP_CSRRCI: {
+		if (rand32() % 4 != 0)
+			instr = (instr & 0xfffffu) | random_csr() << 20;
+		uint32_t csr = instr >> 20;
+		bool writes = d.op == RVOP_CSRRW || d.op == RVOP_CSRRWI || (instr >> 15 & 0x1f) != 0;
+		if (writes && !csr_write_allowed(csr, hpm_events))
+			instr = (instr & ~(0x1fu << 15 | 0x7u << 12)) | (RVOPC_CSRRS_BITS & 0x7000u);
+		break;
+	}
+	default:
+		break;
+	}
+	if (is_mem_op(d.op) && d.rs1 != 2 && d.rs1 != 8)
+		return false;
+	return d.rd != 2 && d.rd != 8;
+}
+
+uint32_t FuzzGenerator::random_csr() {
+	const auto &range = csr_ranges[rand32() % (sizeof(csr_ranges) / sizeof(csr_ranges[0]))];
+	return range.first + rand32() % (range.last - range.first + 1);
+}
+
+uint32_t FuzzGenerator::random_reg_value() {
+	switch (rand32() % 8) {
+	case 0:  return 0;
+	case 1:  return -(rand32() % 4);
+	case 2:  return 0x7fffffffu + rand32() % 3;
+	case 3:  return 1u << (rand32() % 32);
+	case 4:  return (int32_t)(int8_t)rand32();
+	case 5:  return DATA_BASE + (rand32() % DATA_SIZE);
+	default: return rand32();
+	}
+}
+
+static uint random_rd(FuzzGenerator &gen) {
+	uint rd;
+	do {
+		rd = gen.rand32() % 32;
+	} while (rd == 2 || rd == 8);
+	return rd;
+}
+
+FuzzInstr FuzzGenerator::random_instr() {
+	FuzzInstr fi = {FuzzInstr::RAW, 0, 0};
+	uint32_t kind = rand32() % 16;
+	if (kind < 2) {
+		fi.skip = 1 + rand32() % 16;
+		switch (rand32() % 5) {
+		case 0:
+			fi.kind = FuzzInstr::BRANCH;
+			fi.bits = branch_templates[rand32() % 6] | (rand32() % 32) << 15 | (rand32() % 32) << 20;
+			break;
+		case 1:
+			fi.kind = FuzzInstr::JAL;
+			fi.bits = RVOPC_JAL_BITS | random_rd(*this) << 7;
+			break;
+		case 2:
+			fi.kind = FuzzInstr::C_BRANCH;
+			fi.bits = (rand32() % 2 ? RVOPC_C_BEQZ_BITS : RVOPC_C_BNEZ_BITS) | (rand32() % 8) << 7;
+			break;
+		case 3:
+			fi.kind = FuzzInstr::C_J;
+			fi.bits = RVOPC_C_J_BITS;
+			break;
+		default:
+			fi.kind = FuzzInstr::C_JAL;
+			fi.bits = RVOPC_C_JAL_BITS;
+			break;
+		}
+		return fi;
+	}
+	for (;;) {
+		uint32_t instr;
+		if (kind == 2) {
+			// Anything at all, for the illegal instruction paths
+			instr = rand32();
+		} else {
+			const fuzz_template &t = templates[rand32() % (sizeof(templates) / sizeof(templates[0]))];
+			instr = t.bits | (rand32() & ~t.mask);
+		}
+		if (fixup_raw(instr)) {
+			fi.bits = instr;
+			return fi;
+		}
+	}
+}
+
+void FuzzGenerator::generate(FuzzProgram &p, size_t len) {
+	for (uint i = 0; i < 32; ++i)
+		p.regs[i] = random_reg_value();
+	p.data_seed = rand32();
+	p.body.clear();
+	for (size_t i = 0; i < std::min(len, MAX_BODY); ++i)
+		p.body.push_back(random_instr());
+}
+
+void FuzzGenerator::mutate(FuzzProgram &p, const FuzzProgram &other) {
+	int n = 1 + rand32() % 4;
+	for (int i = 0; i < n; ++i) {
+		uint32_t op = rand32() % 8;
+		if (p.body.empty())
+			op = 1;
+		size_t pos = p.body.empty() ? 0 : rand32() % p.body.size();
+		switch (op) {
+		case 0:
+			p.body[pos] = random_instr();
+			break;
+		case 1:
+			if (p.body.size() < MAX_BODY)
+				p.body.insert(p.body.begin() + pos, random_instr());
+			break;
+		case 2:
+			p.body.erase(p.body.begin() + pos);
+			break;
+		case 3:
+		case 4: {
+			// Flip a bit of an instruction, keeping the old one if the
+			// result is rejected
+			FuzzInstr &fi = p.body[pos];
+			if (fi.kind != FuzzInstr::RAW)
+				break;
+			uint32_t instr = fi.bits ^ 1u << (rand32() % (is_16bit(fi.bits) ? 16 : 32));
+			if (fixup_raw(instr))
+				fi.bits = instr;
+			break;
+		}
+		case 5: {
+			// Splice in a run of instructions from another program
+			if (other.body.empty())
+				break;
+			size_t start = rand32() % other.body.size();
+			size_t count = std::min<size_t>({1 + rand32() % 16, other.body.size() - start,
+				MAX_BODY - std::min(p.body.size(), MAX_BODY)});
+			p.body.insert(p.body.begin() + pos, other.body.begin() + start, other.body.begin() + start + count);
+			break;
+		}
+		case 6:
+			p.regs[rand32() % 32] = random_reg_value();
+			break;
+		default:
+			p.data_seed = rand32();
+			break;
+		}
+	}
+}
+
+// Coverage map layout
+static const size_t COV_OPS = 0;
+static const size_t COV_PAIRS = COV_OPS + RVOP_COUNT * 4;
+static const size_t COV_CSRS = COV_PAIRS + RVOP_COUNT * RVOP_COUNT;
+static const size_t COV_CAUSES = COV_CSRS + 4096 * 4;
+static const size_t COV_SIZE = COV_CAUSES + 16;
+
+FuzzCoverage::FuzzCoverage(): n_hit(0), hit(COV_SIZE), prev_op(0) {}
+
+void FuzzCoverage::record(const TraceRecord &t) {
+	if (!(t.flags & TraceRecord::INSTR))
+		return;
+	bool trap = t.flags & TraceRecord::TRAP;
+	if (trap) {
+		mark(COV_CAUSES + (t.cause & 0xf));
+		// No instruction to speak of
+		if (t.cause == XCAUSE_INSTR_FAULT || t.cause == XCAUSE_INSTR_MISALIGN)
+			return;
+	}
+	RVDecodedInstr d = rv_decode(t.instr);
+	mark(COV_OPS + d.op * 4 + (d.len == 2) * 2 + trap);
+	mark(COV_PAIRS + prev_op * RVOP_COUNT + d.op);
+	prev_op = d.op;
+	if (d.op >= RVOP_CSRRW && d.op <= RVOP_CSRRCI)
+		mark(COV_CSRS + (t.instr >> 20) * 4 + !!(t.flags & TraceRecord::CSR) * 2 + trap);
+}
+
+void FuzzCoverage::print(FILE *f) const {
+	auto count = [&](size_t first, size_t last) {
+		return (size_t)std::count(hit.begin() + first, hit.begin() + last, 1);
+	};
+	fprintf(f, "%zu ops, %zu op pairs, %zu CSR accesses, %zu exception causes",
+		count(COV_OPS, COV_PAIRS), count(COV_PAIRS, COV_CSRS), count(COV_CSRS, COV_CAUSES),
+		count(COV_CAUSES, COV_SIZE));
+}
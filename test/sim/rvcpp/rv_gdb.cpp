@@ -0,0 +1,359 @@
+#include "rv_gdb.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Instructions run between checks for a ^C from GDB
+static const int64_t POLL_INTERVAL = 1 << 16;
+static const uint N_GPRS = 32;
+static const uint REGNUM_PC = 32;
+static const uint REGNUM_CSR0 = 65;
+
+static const char hexchars[] = "0123456789abcdef";
+
+static std::string hex_le32(ux_t x) {
+	std::string s;
+	for (int i = 0; i < 4; ++i, x >>= 8) {
+		s += hexchars[x >> 4 & 0xf];
+		s += hexchars[x & 0xf];
+	}
+	return s;
+}
+
+static int hexval(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static bool parse_hex_le32(const std::string &s, size_t pos, ux_t &x) {
+	if (s.size() < pos + 8)
+		return false;
+	x = 0;
+	for (int i = 0; i < 4; ++i) {
+		int hi = hexval(s[pos + 2 * i]), lo = hexval(s[pos + 2 * i + 1]);
+		if (hi < 0 || lo < 0)
+			return false;
+		x |= (ux_t)(hi << 4 | lo) << 8 * i;
+	}
+	return true;
+}
+
+// Parse a big-endian hex number (as used for addresses and lengths) starting
+// at pos, and advance pos past it
+static bool parse_hex(const std::string &s, size_t &pos, ux_t &x) {
+	size_t start = pos;
+	x = 0;
+	for (int v; pos < s.size() && (v = hexval(s[pos])) >= 0; ++pos)
+		x = x << 4 | v;
+	return pos > start;
+}
+
+bool GdbServer::recv_more(bool block) {
+	char buf[4096];
+	ssize_t n = recv(sock_fd, buf, sizeof(buf), block ? 0 : MSG_DONTWAIT);
+	if (n > 0) {
+		rxbuf.append(buf, n);
+		return true;
+	}
+	if (n == 0 || block || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		// Connection closed, or failed: treat it as a detach
+		close(sock_fd);
+		sock_fd = -1;
+	}
+	return false;
+}
+
+// Returns false if the connection was lost
+bool GdbServer::get_packet(std::string &pkt) {
+	while (true) {
+		size_t start = rxbuf.find('$');
+		size_t end = start == std::string::npos ? start : rxbuf.find('#', start);
+		if (end != std::string::npos && rxbuf.size() >= end + 3) {
+			pkt = rxbuf.substr(start + 1, end - start - 1);
+			uint8_t sum = 0;
+			for (char c : pkt)
+				sum += c;
+			int hi = hexval(rxbuf[end + 1]), lo = hexval(rxbuf[end + 2]);
+			rxbuf.erase(0, end + 3);
+			bool ok = hi >= 0 && lo >= 0 && (uint8_t)(hi << 4 | lo) == sum;
+			send(sock_fd, ok ? "+" : "-", 1, 0);
+			if (ok)
+				return true;
+			continue;
+		}
+		// Drop acks, and any ^C sent while already stopped
+		if (start == std::string::npos)
+			rxbuf.clear();
+		else
+			rxbuf.erase(0, start);
+		if (!recv_more(true))
+			return false;
+	}
+}
+
+void GdbServer::put_packet(const std::string &pkt) {
+	uint8_t sum = 0;
+	for (char c : pkt)
+		sum += c;
+	std::string framed = "$" + pkt + "#" + hexchars[sum >> 4] + hexchars[sum & 0xf];
+	send(sock_fd, framed.data(), framed.size(), 0);
+}
+
+std::string GdbServer::read_reg(uint regnum) {
+	if (regnum < N_GPRS)
+		return hex_le32(core.regs[regnum]);
+	if (regnum == REGNUM_PC)
+		return hex_le32(core.pc);
+	if (regnum >= REGNUM_CSR0 && regnum < REGNUM_CSR0 + 4096) {
+		std::optional<ux_t> x = core.csr.read(regnum - REGNUM_CSR0, false);
+		if (x)
+			return hex_le32(*x);
+	}
+	return "E01";
+}
+
+bool GdbServer::write_reg(uint regnum, const std::string &hex) {
+	ux_t x;
+	if (!parse_hex_le32(hex, 0, x))
+		return false;
+	if (regnum < N_GPRS) {
+		if (regnum != 0)
+			core.regs[regnum] = x;
+		return true;
+	}
+	if (regnum == REGNUM_PC) {
+		core.pc = x;
+		return true;
+	}
+	return false;
+}
+
+void GdbServer::advance(int64_t n, int64_t &cyc) {
+	if (n == 0)
+		return;
+	io.step(n);
+	core.csr.set_irq_t(io.timer_irq_pending());
+	core.csr.set_irq_s(io.soft_irq_pending());
+	core.csr.set_irq_e(io.irq);
+	cyc += n;
+}
+
+std::string GdbServer::resume(bool step, int64_t &cyc) {
+	// Always execute the first instruction, even if there is a breakpoint
+	// on it, as that's where the last stop was
+	core.bp_ignore_pc = core.pc;
+	core.step(trace);
+	core.bp_ignore_pc = RVCore::DCACHE_INVALID_PC;
+	advance(1, cyc);
+	if (step)
+		return "S05";
+
+	int64_t since_poll = 0;
+	while (true) {
+		if (sock_fd >= 0 && since_poll >= POLL_INTERVAL) {
+			since_poll = 0;
+			while (recv_more(false))
+				;
+			if (rxbuf.find('\x03') != std::string::npos) {
+				rxbuf.erase(0, rxbuf.find('\x03') + 1);
+				return "S02";
+			}
+		}
+		int64_t n = 1;
+		if (trace) {
+			core.step(true);
+		} else {
+			// As in main(), stop blocks where the timer IRQ may change
+			n = POLL_INTERVAL;
+			if (!io.timer_irq_pending() && io.mtimecmp[0] - io.mtime < (uint64_t)n)
+				n = io.mtimecmp[0] - io.mtime;
+			n = core.run_block(n);
+		}
+		if (core.breakpoint_hit) {
+			// The step which found the breakpoint did not execute anything
+			core.breakpoint_hit = false;
+			advance(n - 1, cyc);
+			return "S05";
+		}
+		advance(n, cyc);
+		// Count each block as at least a few instructions, so that a program
+		// stuck doing MMIO still gets polled regularly
+		since_poll += std::max<int64_t>(n, 256);
+	}
+}
+
+std::string GdbServer::handle(const std::string &pkt, bool &resume, bool &step, bool &done) {
+	size_t pos = 1;
+	ux_t addr, len;
+	char cmd = pkt.empty() ? 0 : pkt[0];
+	switch (cmd) {
+	case '?':
+		return "S05";
+	case 'g': {
+		std::string s;
+		for (uint i = 0; i <= REGNUM_PC; ++i)
+			s += read_reg(i);
+		return s;
+	}
+	case 'G':
+		for (uint i = 0; i <= REGNUM_PC; ++i) {
+			if (!write_reg(i, pkt.substr(1 + 8 * i, 8)))
+				return "E01";
+		}
+		return "OK";
+	case 'p':
+		if (!parse_hex(pkt, pos, addr))
+			return "E01";
+		return read_reg(addr);
+	case 'P': {
+		if (!parse_hex(pkt, pos, addr) || pos >= pkt.size() || pkt[pos] != '=')
+			return "E01";
+		return write_reg(addr, pkt.substr(pos + 1)) ? "OK" : "E01";
+	}
+	case 'm': {
+		if (!parse_hex(pkt, pos, addr) || pkt[pos++] != ',' || !parse_hex(pkt, pos, len))
+			return "E01";
+		std::string s;
+		for (ux_t i = 0; i < len; ++i) {
+			ux_t b;
+			if (!core.r8(addr + i, b, 0x7u))
+				break;
+			s += hexchars[b >> 4];
+			s += hexchars[b & 0xf];
+		}
+		return s.empty() && len ? "E01" : s;
+	}
+	case 'M': {
+		if (!parse_hex(pkt, pos, addr) || pkt[pos++] != ',' || !parse_hex(pkt, pos, len) ||
+				pkt[pos++] != ':' || pkt.size() < pos + 2 * len)
+			return "E01";
+		for (ux_t i = 0; i < len; ++i) {
+			int hi = hexval(pkt[pos + 2 * i]), lo = hexval(pkt[pos + 2 * i + 1]);
+			if (hi < 0 || lo < 0 || !core.w8(addr + i, hi << 4 | lo))
+				return "E01";
+		}
+		return "OK";
+	}
+	case 'c':
+	case 's':
+		if (parse_hex(pkt, pos, addr))
+			core.pc = addr;
+		resume = true;
+		step = cmd == 's';
+		return "";
+	case 'Z':
+	case 'z': {
+		if (pkt.size() < 2 || (pkt[1] != '0' && pkt[1] != '1'))
+			return "";
+		pos = 2;
+		if (pkt[pos++] != ',' || !parse_hex(pkt, pos, addr))
+			return "E01";
+		bool hw = pkt[1] == '1';
+		if (cmd == 'Z') {
+			if (hw && n_hw_breakpoints >= max_hw_breakpoints)
+				return "E01";
+			core.add_breakpoint(addr);
+			n_hw_breakpoints += hw;
+		} else {
+			if (hw && n_hw_breakpoints > 0 && core.is_breakpoint(addr))
+				--n_hw_breakpoints;
+			core.remove_breakpoint(addr);
+		}
+		return "OK";
+	}
+	case 'k':
+		done = true;
+		return "";
+	case 'D':
+		done = true;
+		return "OK";
+	case 'H':
+		return "OK";
+	case 'q':
+		if (pkt.compare(0, 10, "qSupported") == 0)
+			return "PacketSize=4000;swbreak+;hwbreak+";
+		if (pkt.compare(0, 9, "qAttached") == 0)
+			return "1";
+		return "";
+	default:
+		// Empty reply means unsupported, e.g. for vCont, X and watchpoints
+		return "";
+	}
+}
+
+void GdbServer::serve(uint16_t port, int64_t &cyc) {
+	int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (server_fd < 0) {
+		std::cerr << "Failed to create socket\n";
+		return;
+	}
+	int opt = 1;
+	setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	sockaddr_in sock_addr;
+	memset(&sock_addr, 0, sizeof(sock_addr));
+	sock_addr.sin_family = AF_INET;
+	sock_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sock_addr.sin_port = htons(port);
+	if (bind(server_fd, (sockaddr*)&sock_addr, sizeof(sock_addr)) < 0 || listen(server_fd, 1) < 0) {
+		std::cerr << "Failed to listen on port " << port << "\n";
+		close(server_fd);
+		return;
+	}
+	printf("Waiting for GDB connection on port %u\n", port);
+	fflush(stdout);
+	sock_fd = accept(server_fd, nullptr, nullptr);
+	close(server_fd);
+	if (sock_fd < 0) {
+		std::cerr << "Failed to accept connection\n";
+		return;
+	}
+	setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+	bool done = false;
+	std::string pkt;
+	try {
+		while (!done && get_packet(pkt)) {
+			bool resume_req = false, step = false;
+			std::string reply = handle(pkt, resume_req, step, done);
+			if (resume_req)
+				reply = resume(step, cyc);
+			if (!(done && pkt[0] == 'k'))
+				put_packet(reply);
+		}
+	}
+	catch (TBExitException e) {
+		if (sock_fd >= 0) {
+			char reply[8];
+			snprintf(reply, sizeof(reply), "W%02x", e.exitcode & 0xffu);
+			put_packet(reply);
+			close(sock_fd);
+		}
+		throw;
+	}
+
+	if (sock_fd >= 0) {
+		close(sock_fd);
+		sock_fd = -1;
+	}
+	if (done && pkt[0] == 'k')
+		return;
+
+	// Detached (or GDB went away), so run until the hart exits
+	while (!core.breakpoints.empty())
+		core.remove_breakpoint(*core.breakpoints.begin());
+	while (true)
+		resume(false, cyc);
+}
@@ -0,0 +1,181 @@
+#include "rv_irq_ctrl.h"
+#include "encoding/rv_csr.h"
+
+#include <algorithm>
+#include <iterator>
+
+IrqCtrl::IrqCtrl(uint num_irqs_) {
+	num_irqs = num_irqs_;
+	lines_in = 0;
+	lines = 0;
+	std::fill(std::begin(meiea), std::end(meiea), 0);
+	std::fill(std::begin(meifa), std::end(meifa), 0);
+	std::fill(std::begin(priority), std::end(priority), 0);
+	meicontext_pppreempt = 0;
+	meicontext_ppreempt = 0;
+	meicontext_preempt = 0;
+	meicontext_noirq = true;
+	meicontext_irq = 0;
+	meicontext_mreteirq = false;
+	force_clear_pending = false;
+	force_clear_irq = 0;
+	rebuild();
+}
+
+void IrqCtrl::set_num_irqs(uint n) {
+	num_irqs = n;
+	lines_in &= valid_mask(0);
+	lines &= valid_mask(0);
+	for (uint w = 0; w < N_WORDS; ++w) {
+		meiea[w] &= valid_mask(w);
+		meifa[w] &= valid_mask(w);
+	}
+	std::fill(priority + num_irqs, std::end(priority), 0);
+	rebuild();
+}
+
+bool IrqCtrl::is_csr(uint16_t addr) {
+	return addr >= CSR_HAZARD3_MEIEA && addr <= CSR_HAZARD3_MEICONTEXT;
+}
+
+void IrqCtrl::update_word(uint w) {
+	active[w] = ((w == 0 ? lines : 0) | meifa[w]) & meiea[w];
+	for (uint level = 0; level < N_PRIORITIES; ++level) {
+		if (active[w] & level_irqs[level][w])
+			level_words[level] |= 1u << w;
+		else
+			level_words[level] &= ~(1u << w);
+		if (level_words[level])
+			active_levels |= 1u << level;
+		else
+			active_levels &= ~(1u << level);
+	}
+}
+
+void IrqCtrl::rebuild() {
+	for (uint level = 0; level < N_PRIORITIES; ++level) {
+		std::fill(std::begin(level_irqs[level]), std::end(level_irqs[level]), 0);
+		level_words[level] = 0;
+	}
+	active_levels = 0;
+	for (uint irq = 0; irq < num_irqs; ++irq)
+		level_irqs[priority[irq]][irq / 32] |= 1u << irq % 32;
+	for (uint w = 0; w < N_WORDS; ++w)
+		update_word(w);
+}
+
+// Arrays of one bit per IRQ are accessed through a 16-bit window in the
+// upper half of the CSR, selected by the 5 LSBs of the write data. word is
+// the word of the array which contains the window.
+static ux_t window_read(ux_t word, ux_t wdata) {
+	return (word >> 16 * (wdata & 0x1u)) << 16;
+}
+
+static void window_write(ux_t &word, ux_t wdata, ux_t data) {
+	uint shift = 16 * (wdata & 0x1u);
+	word = (word & ~(0xffffu << shift)) | (data >> 16) << shift;
+}
+
+ux_t IrqCtrl::read(uint16_t addr, ux_t wdata, bool side_effect) {
+	uint w = (wdata & 0x1fu) / 2;
+	switch (addr) {
+	case CSR_HAZARD3_MEIEA:
+		return window_read(meiea[w], wdata);
+	case CSR_HAZARD3_MEIPA:
+		return window_read((w == 0 ? lines : 0) | meifa[w], wdata);
+	case CSR_HAZARD3_MEIFA:
+		return window_read(meifa[w], wdata);
+	case CSR_HAZARD3_MEIPRA: {
+		// Four 4-bit priorities per window, selected by the 7 LSBs
+		uint first = 4 * (wdata & 0x7fu);
+		ux_t rdata = 0;
+		for (uint i = 0; i < 4; ++i)
+			rdata |= (ux_t)priority[first + i] << (16 + 4 * i);
+		return rdata;
+	}
+	case CSR_HAZARD3_MEINEXT: {
+		int irq = next_irq();
+		if (irq < 0)
+			return 1u << 31;
+		if (side_effect) {
+			force_clear_pending = true;
+			force_clear_irq = irq;
+		}
+		return (ux_t)irq << 2;
+	}
+	case CSR_HAZARD3_MEICONTEXT:
+		return meicontext_pppreempt << 28 | meicontext_ppreempt << 24 | meicontext_preempt << 16 |
+			(ux_t)meicontext_noirq << 15 | meicontext_irq << 4 | (ux_t)meicontext_mreteirq;
+	default:
+		return 0;
+	}
+}
+
+void IrqCtrl::write(uint16_t addr, ux_t wdata, ux_t data) {
+	uint w = (wdata & 0x1fu) / 2;
+	switch (addr) {
+	case CSR_HAZARD3_MEIEA:
+		window_write(meiea[w], wdata, data);
+		meiea[w] &= valid_mask(w);
+		update_word(w);
+		break;
+	case CSR_HAZARD3_MEIFA:
+		window_write(meifa[w], wdata, data);
+		meifa[w] &= valid_mask(w);
+		update_word(w);
+		break;
+	case CSR_HAZARD3_MEIPRA: {
+		uint first = 4 * (wdata & 0x7fu);
+		for (uint irq = first; irq < first + 4 && irq < num_irqs; ++irq) {
+			level_irqs[priority[irq]][irq / 32] &= ~(1u << irq % 32);
+			priority[irq] = data >> (16 + 4 * (irq - first)) & 0xfu;
+			level_irqs[priority[irq]][irq / 32] |= 1u << irq % 32;
+		}
+		update_word(first / 32);
+		break;
+	}
+	case CSR_HAZARD3_MEINEXT:
+		if (data & 0x1u) {
+			// Update meicontext from the IRQ now at the head of meinext
+			int irq = next_irq();
+			meicontext_preempt = preempt_level_next();
+			meicontext_noirq = irq < 0;
+			meicontext_irq = irq < 0 ? 0 : irq;
+		}
+		break;
+	case CSR_HAZARD3_MEICONTEXT:
+		meicontext_pppreempt = data >> 28 & 0xfu;
+		meicontext_ppreempt = data >> 24 & 0xfu;
+		meicontext_preempt = data >> 16 & 0x1fu;
+		meicontext_noirq = data >> 15 & 0x1u;
+		meicontext_irq = data >> 4 & 0x1ffu;
+		meicontext_mreteirq = data & 0x1u;
+		break;
+	default:
+		// meipa is read-only
+		break;
+	}
+}
+
+void IrqCtrl::trap_enter(bool is_eirq) {
+	if (is_eirq) {
+		// (The MSB of preempt needn't be saved, as an IRQ can't be taken
+		// when it is set)
+		uint preempt = preempt_level_next();
+		meicontext_pppreempt = meicontext_ppreempt;
+		meicontext_ppreempt = meicontext_preempt & 0xfu;
+		meicontext_preempt = preempt;
+		meicontext_mreteirq = true;
+	} else {
+		meicontext_mreteirq = false;
+	}
+}
+
+void IrqCtrl::trap_mret() {
+	if (meicontext_mreteirq) {
+		meicontext_preempt = meicontext_ppreempt;
+		meicontext_ppreempt = meicontext_pppreempt;
+		meicontext_pppreempt = 0;
+	}
+	meicontext_mreteirq = false;
+}
@@ -0,0 +1,141 @@
+#include "rv_snapshot.h"
+#include "encoding/rv_csr.h"
+
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static const char SNAPSHOT_MAGIC[8] = {'r', 'v', 'c', 'p', 'p', 's', 'n', 'p'};
+
+bool snapshot_save(const std::string &path, int64_t cycle, TBMemIO &io,
+		std::vector<std::unique_ptr<RVCore>> &harts) {
+	FILE *f = fopen(path.c_str(), "wb");
+	if (!f) {
+		std::cerr << "Failed to open \"" << path << "\" for writing\n";
+		return false;
+	}
+	RVCore &core = *harts[0];
+	SnapshotHeader header;
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SnapshotHeader::VERSION;
+	header.ram_size = core.ram_top - core.ram_base;
+	header.n_harts = harts.size();
+	header.ram_offset = 0;
+	header.cycle = cycle;
+
+	// Write the state, then go back and fill in the RAM offset
+	SnapshotWriter w{f, true};
+	w(header);
+	io.serialize(w);
+	for (auto &hart : harts)
+		hart->serialize(w);
+	long state_end = ftell(f);
+	header.ram_offset = (state_end + SnapshotHeader::RAM_ALIGN - 1) & ~(long)(SnapshotHeader::RAM_ALIGN - 1);
+	w.ok = w.ok && fseek(f, header.ram_offset, SEEK_SET) == 0;
+	w.ok = w.ok && fwrite(core.ram, 1, header.ram_size, f) == header.ram_size;
+	w.ok = w.ok && fseek(f, 0, SEEK_SET) == 0;
+	w(header);
+	if (fclose(f) != 0)
+		w.ok = false;
+	if (!w.ok)
+		std::cerr << "Failed to write snapshot \"" << path << "\"\n";
+	return w.ok;
+}
+
+static bool read_header(FILE *f, const std::string &path, SnapshotHeader &header) {
+	SnapshotReader r{f, true};
+	r(header);
+	if (!r.ok || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+		std::cerr << "\"" << path << "\" is not an rvcpp snapshot\n";
+		return false;
+	}
+	if (header.version != SnapshotHeader::VERSION) {
+		std::cerr << "Snapshot \"" << path << "\" has version " << header.version
+			<< ", expected " << SnapshotHeader::VERSION << "\n";
+		return false;
+	}
+	return true;
+}
+
+bool snapshot_map(const std::string &path, SnapshotHeader &header, uint8_t *&ram) {
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f) {
+		std::cerr << "Failed to open \"" << path << "\"\n";
+		return false;
+	}
+	bool ok = read_header(f, path, header);
+	if (ok && header.ram_size > 0) {
+		// The mapping outlives the file descriptor
+		void *p = mmap(nullptr, header.ram_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			fileno(f), header.ram_offset);
+		if (p == MAP_FAILED) {
+			std::cerr << "Failed to map RAM from snapshot \"" << path << "\"\n";
+			ok = false;
+		} else {
+			ram = (uint8_t*)p;
+		}
+	}
+	fclose(f);
+	return ok;
+}
+
+bool snapshot_restore(const std::string &path, TBMemIO &io,
+		std::vector<std::unique_ptr<RVCore>> &harts) {
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f) {
+		std::cerr << "Failed to open \"" << path << "\"\n";
+		return false;
+	}
+	SnapshotHeader header;
+	bool ok = read_header(f, path, header);
+	if (ok && header.n_harts != harts.size()) {
+		std::cerr << "Snapshot has " << header.n_harts << " harts, but " << harts.size() << " were created\n";
+		ok = false;
+	}
+	if (ok) {
+		SnapshotReader r{f, true};
+		io.serialize(r);
+		for (auto &hart : harts) {
+			hart->serialize(r);
+			hart->flush_decode_cache();
+		}
+		ok = r.ok;
+		if (!ok)
+			std::cerr << "Snapshot \"" << path << "\" is truncated\n";
+	}
+	fclose(f);
+	return ok;
+}
+
+void arch_checkpoint_capture(ArchCheckpoint &cp, int64_t cycle, const TBMemIO &io, RVCore &core) {
+	cp.cycle = cycle;
+	cp.pc = core.pc;
+	cp.priv = core.csr.get_true_priv();
+	for (int i = 0; i < 32; ++i)
+		cp.x[i] = core.regs[i];
+	// In restore order: pmpaddr before pmpcfg, as locking a region makes
+	// its pmpaddr read-only, and the counters last
+	std::vector<uint16_t> addrs;
+	for (uint16_t a = CSR_PMPADDR0; a <= CSR_PMPADDR15; ++a)
+		addrs.push_back(a);
+	addrs.push_back(CSR_HAZARD3_PMPCFGM0);
+	for (uint16_t a = CSR_PMPCFG0; a <= CSR_PMPCFG3; ++a)
+		addrs.push_back(a);
+	for (uint16_t a : {CSR_MTVEC, CSR_MSCRATCH, CSR_MEPC, CSR_MCAUSE, CSR_MIE, CSR_HAZARD3_MSLEEP,
+			CSR_MSTATUS, CSR_MCOUNTINHIBIT, CSR_MCYCLE, CSR_MCYCLEH, CSR_MINSTRET, CSR_MINSTRETH})
+		addrs.push_back(a);
+	cp.csrs.clear();
+	for (uint16_t a : addrs) {
+		std::optional<ux_t> x = core.csr.peek(a);
+		if (x)
+			cp.csrs.push_back({a, *x});
+	}
+	cp.mtime = io.mtime;
+	cp.mtimecmp = io.mtimecmp[0];
+	cp.softirq = io.softirq & 0x1u;
+	cp.irq = io.irq;
+	cp.ram.assign(core.ram, core.ram + (core.ram_top - core.ram_base));
+}
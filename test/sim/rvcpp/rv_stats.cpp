@@ -0,0 +1,179 @@
+#include "rv_stats.h"
+
+#include <algorithm>
+#include <cctype>
+#include <string>
+#include <utility>
+#include <vector>
+
+static const char *op_extension(rv_op op) {
+	if (op == RVOP_FENCE_I)
+		return "Zifencei";
+	if (op >= RVOP_LUI && op <= RVOP_CSRRCI)
+		return "I";
+	if (op >= RVOP_MUL && op <= RVOP_REMU)
+		return "M";
+	if (op >= RVOP_LR_W && op <= RVOP_AMOMAXU_W)
+		return "A";
+	if (op >= RVOP_SH1ADD && op <= RVOP_SH3ADD)
+		return "Zba";
+	if (op >= RVOP_ANDN && op <= RVOP_SEXT_H)
+		return "Zbb";
+	if (op >= RVOP_CLMUL && op <= RVOP_CLMULR)
+		return "Zbc";
+	if (op >= RVOP_BCLR && op <= RVOP_BSETI)
+		return "Zbs";
+	if (op >= RVOP_PACK && op <= RVOP_UNZIP)
+		return "Zbkb";
+	if (op == RVOP_H3_BEXTM || op == RVOP_H3_BEXTMI)
+		return "Xh3bextm";
+	if (op == RVOP_C_LW || op == RVOP_C_SW)
+		return "C";
+	if (op == RVOP_C_SH)
+		return "Zcb";
+	if (op >= RVOP_CM_PUSH && op <= RVOP_CM_MVA01S)
+		return "Zcmp";
+	return "illegal";
+}
+
+static uint8_t op_reg_reads(rv_op op) {
+	switch (op) {
+	case RVOP_ILLEGAL:
+	case RVOP_LUI:
+	case RVOP_AUIPC:
+	case RVOP_JAL:
+	case RVOP_FENCE:
+	case RVOP_FENCE_I:
+	case RVOP_ECALL:
+	case RVOP_EBREAK:
+	case RVOP_MRET:
+	case RVOP_WFI:
+	case RVOP_CSRRWI:
+	case RVOP_CSRRSI:
+	case RVOP_CSRRCI:
+	case RVOP_CM_PUSH:
+	case RVOP_CM_POP:
+	case RVOP_CM_POPRET:
+	case RVOP_CM_POPRETZ:
+	case RVOP_CM_MVSA01:
+		return 0;
+
+	case RVOP_JALR:
+	case RVOP_LB:
+	case RVOP_LH:
+	case RVOP_LW:
+	case RVOP_LBU:
+	case RVOP_LHU:
+	case RVOP_ADDI:
+	case RVOP_SLTI:
+	case RVOP_SLTIU:
+	case RVOP_XORI:
+	case RVOP_ORI:
+	case RVOP_ANDI:
+	case RVOP_SLLI:
+	case RVOP_SRLI:
+	case RVOP_SRAI:
+	case RVOP_CSRRW:
+	case RVOP_CSRRS:
+	case RVOP_CSRRC:
+	case RVOP_LR_W:
+	case RVOP_CLZ:
+	case RVOP_CPOP:
+	case RVOP_CTZ:
+	case RVOP_ORC_B:
+	case RVOP_REV8:
+	case RVOP_RORI:
+	case RVOP_SEXT_B:
+	case RVOP_SEXT_H:
+	case RVOP_BCLRI:
+	case RVOP_BEXTI:
+	case RVOP_BINVI:
+	case RVOP_BSETI:
+	case RVOP_BREV8:
+	case RVOP_ZIP:
+	case RVOP_UNZIP:
+	case RVOP_H3_BEXTMI:
+	case RVOP_C_LW:
+		return 0x1;
+
+	default:
+		return 0x3;
+	}
+}
+
+static std::string op_name(rv_op op) {
+	std::string s = rv_op_names[op];
+	for (char &c : s)
+		c = c == '_' ? '.' : std::tolower(c);
+	return s;
+}
+
+ExecStats::ExecStats() {
+	std::fill(std::begin(retired), std::end(retired), 0);
+	std::fill(std::begin(compressed), std::end(compressed), 0);
+	std::fill(std::begin(pc_written), std::end(pc_written), 0);
+	std::fill(std::begin(reg_reads), std::end(reg_reads), 0);
+	std::fill(std::begin(reg_writes), std::end(reg_writes), 0);
+	zcb = 0;
+	for (int op = 0; op < RVOP_COUNT; ++op)
+		reg_read_mask[op] = op_reg_reads((rv_op)op);
+}
+
+static double percent(uint64_t x, uint64_t total) {
+	return total ? 100.0 * x / total : 0.0;
+}
+
+void ExecStats::print(FILE *f, uint hartid) const {
+	uint64_t total = 0, total_compressed = 0, branches = 0, taken = 0;
+	std::vector<std::pair<std::string, uint64_t>> extensions;
+	for (int op = 0; op < RVOP_COUNT; ++op) {
+		total += retired[op];
+		total_compressed += compressed[op];
+		if (op >= RVOP_BEQ && op <= RVOP_BGEU) {
+			branches += retired[op];
+			taken += pc_written[op];
+		}
+		if (!retired[op])
+			continue;
+		std::string ext = op_extension((rv_op)op);
+		auto it = std::find_if(extensions.begin(), extensions.end(),
+			[&](const std::pair<std::string, uint64_t> &e) {return e.first == ext;});
+		if (it == extensions.end())
+			extensions.push_back(std::make_pair(ext, retired[op]));
+		else
+			it->second += retired[op];
+	}
+
+	fprintf(f, "Hart %u: %lu instructions retired, %lu 16-bit (%.1f%%) of which %lu Zcb, "
+		"%lu of %lu branches taken (%.1f%%)\n",
+		hartid, total, total_compressed, percent(total_compressed, total), zcb, taken, branches,
+		percent(taken, branches));
+
+	fprintf(f, "  Extension       Retired       %%\n");
+	for (auto &e : extensions)
+		fprintf(f, "  %-10s %12lu  %5.1f%%\n", e.first.c_str(), e.second, percent(e.second, total));
+
+	std::vector<std::pair<uint64_t, int>> ops;
+	for (int op = 0; op < RVOP_COUNT; ++op) {
+		if (retired[op])
+			ops.push_back(std::make_pair(retired[op], op));
+	}
+	std::sort(ops.rbegin(), ops.rend());
+	fprintf(f, "  Op              Retired       %%       16-bit  Taken\n");
+	for (auto &o : ops) {
+		rv_op op = (rv_op)o.second;
+		fprintf(f, "  %-10s %12lu  %5.1f%% %12lu", op_name(op).c_str(), retired[op],
+			percent(retired[op], total), compressed[op]);
+		if (op >= RVOP_BEQ && op <= RVOP_BGEU)
+			fprintf(f, "  %5.1f%%", percent(pc_written[op], retired[op]));
+		fprintf(f, "\n");
+	}
+
+	fprintf(f, "  Reg        Reads       Writes\n");
+	for (int i = 0; i < 32; ++i) {
+		if (i == 0)
+			fprintf(f, "  x%-2d %12lu            -\n", i, reg_reads[i]);
+		else
+			fprintf(f, "  x%-2d %12lu %12lu\n", i, reg_reads[i], reg_writes[i]);
+	}
+}
@@ -0,0 +1,313 @@
+#include "rv_timing.h"
+#include "rv_config.h"
+
+#include <algorithm>
+#include <map>
+
+bool TimingConfig::load(const std::string &path, std::string &err) {
+	std::map<std::string, uint64_t> params;
+	if (!read_config_vh(path, params, err))
+		return false;
+	for (const auto &p : params) {
+		if (p.first == "REDUCED_BYPASS")
+			reduced_bypass = p.second;
+		else if (p.first == "MULDIV_UNROLL")
+			muldiv_unroll = p.second;
+		else if (p.first == "MUL_FAST")
+			mul_fast = p.second;
+		else if (p.first == "MUL_FASTER")
+			mul_faster = p.second;
+		else if (p.first == "MULH_FAST")
+			mulh_fast = p.second;
+		else if (p.first == "BRANCH_PREDICTOR")
+			branch_predictor = p.second;
+	}
+	if (muldiv_unroll == 0 || (muldiv_unroll & (muldiv_unroll - 1)) || muldiv_unroll > 32) {
+		err = "MULDIV_UNROLL must be a power of 2, no more than 32";
+		return false;
+	}
+	mul_faster = mul_faster && mul_fast;
+	mulh_fast = mulh_fast && mul_fast;
+	return true;
+}
+
+static bool uses_rs1(rv_op op) {
+	switch (op) {
+	case RVOP_ILLEGAL:
+	case RVOP_LUI:
+	case RVOP_AUIPC:
+	case RVOP_JAL:
+	case RVOP_FENCE:
+	case RVOP_FENCE_I:
+	case RVOP_ECALL:
+	case RVOP_EBREAK:
+	case RVOP_MRET:
+	case RVOP_WFI:
+	case RVOP_CSRRWI:
+	case RVOP_CSRRSI:
+	case RVOP_CSRRCI:
+	case RVOP_CM_PUSH:
+	case RVOP_CM_POP:
+	case RVOP_CM_POPRET:
+	case RVOP_CM_POPRETZ:
+	case RVOP_CM_MVSA01:
+	case RVOP_CM_MVA01S:
+		return false;
+	default:
+		return true;
+	}
+}
+
+// rs2 is store data, which is consumed in stage 3
+static bool is_store_data(rv_op op) {
+	switch (op) {
+	case RVOP_SB: case RVOP_SH: case RVOP_SW: case RVOP_C_SW: case RVOP_C_SH:
+	case RVOP_SC_W:
+	case RVOP_AMOSWAP_W: case RVOP_AMOADD_W: case RVOP_AMOXOR_W: case RVOP_AMOAND_W:
+	case RVOP_AMOOR_W: case RVOP_AMOMIN_W: case RVOP_AMOMAX_W: case RVOP_AMOMINU_W:
+	case RVOP_AMOMAXU_W:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool uses_rs2(rv_op op) {
+	switch (op) {
+	case RVOP_BEQ: case RVOP_BNE: case RVOP_BLT: case RVOP_BGE: case RVOP_BLTU: case RVOP_BGEU:
+	case RVOP_ADD: case RVOP_SUB: case RVOP_SLL: case RVOP_SLT: case RVOP_SLTU:
+	case RVOP_XOR: case RVOP_SRL: case RVOP_SRA: case RVOP_OR: case RVOP_AND:
+	case RVOP_MUL: case RVOP_MULH: case RVOP_MULHSU: case RVOP_MULHU:
+	case RVOP_DIV: case RVOP_DIVU: case RVOP_REM: case RVOP_REMU:
+	case RVOP_SH1ADD: case RVOP_SH2ADD: case RVOP_SH3ADD:
+	case RVOP_ANDN: case RVOP_ORN: case RVOP_XNOR:
+	case RVOP_MAX: case RVOP_MAXU: case RVOP_MIN: case RVOP_MINU:
+	case RVOP_ROL: case RVOP_ROR:
+	case RVOP_CLMUL: case RVOP_CLMULH: case RVOP_CLMULR:
+	case RVOP_BCLR: case RVOP_BEXT: case RVOP_BINV: case RVOP_BSET:
+	case RVOP_PACK: case RVOP_PACKH:
+	case RVOP_H3_BEXTM:
+		return true;
+	default:
+		return is_store_data(op);
+	}
+}
+
+static bool is_exclusive(rv_op op) {
+	return op == RVOP_LR_W || op == RVOP_SC_W || (op >= RVOP_AMOSWAP_W && op <= RVOP_AMOMAXU_W);
+}
+
+uint TimingModel::muldiv_seq_cycles(const RVDecodedInstr &d) const {
+	bool neg1 = regs[d.rs1] >> 31;
+	bool neg2 = regs[d.rs2] >> 31;
+	bool sign_fixup =
+		(d.op == RVOP_DIV && neg1 != neg2 && regs[d.rs2] != 0) ||
+		(d.op == RVOP_REM && neg1) ||
+		(d.op == RVOP_MULH && neg1 != neg2) ||
+		(d.op == RVOP_MULHSU && neg1);
+	return 32 / cfg.muldiv_unroll + 2 + sign_fixup;
+}
+
+void TimingModel::write_rd(uint rd, uint64_t ready, uint64_t ready_store_data) {
+	if (rd == 0)
+		return;
+	if (cfg.reduced_bypass) {
+		// Consumers wait for writeback, two stages after the result
+		// would otherwise be bypassed from stage 2
+		ready = std::max(ready, cycles + 2);
+		ready_store_data = ready;
+	}
+	reg_ready[rd] = ready;
+	reg_ready_store_data[rd] = ready_store_data;
+}
+
+void TimingModel::trap_entry() {
+	// Exceptions and IRQs are taken from stage 3, flushing stages 1 and 2
+	cycles += 2;
+	redirected = true;
+	btb_valid = false;
+}
+
+void TimingModel::instr(const TraceRecord &t) {
+	RVDecodedInstr d = rv_decode(t.instr);
+	bool pcw = t.flags & TraceRecord::PCW;
+
+	// Stalled on WFI: the instruction is replayed each cycle
+	if (d.op == RVOP_WFI && pcw && t.pc_wdata == t.pc) {
+		++cycles;
+		return;
+	}
+
+	// A nonsequential fetch of a 32-bit instruction which straddles a word
+	// boundary needs a second bus cycle
+	uint64_t issue = cycles;
+	if (redirected && (t.pc & 0x2) && d.len == 4)
+		++issue;
+	// Each word is fetched once, unless refetched after a redirect
+	if (icache) {
+		for (ux_t w = t.pc & ~(ux_t)3; w < t.pc + d.len; w += 4) {
+			if ((redirected || w != fetch_word) && icache->covers(w))
+				issue += icache->fetch(w);
+			fetch_word = w;
+		}
+	}
+	redirected = false;
+
+	// Operands, and back-to-back exclusives (AHB5 can't pipeline them)
+	if (uses_rs1(d.op))
+		issue = std::max(issue, reg_ready[d.rs1]);
+	if (uses_rs2(d.op))
+		issue = std::max(issue, is_store_data(d.op) ? reg_ready_store_data[d.rs2] : reg_ready[d.rs2]);
+	bool exclusive = is_exclusive(d.op);
+	if (exclusive && prev_exclusive)
+		issue = std::max(issue, cycles + 1);
+	prev_exclusive = exclusive;
+	if (d.op == RVOP_CM_PUSH || d.op == RVOP_CM_POP || d.op == RVOP_CM_POPRET || d.op == RVOP_CM_POPRETZ)
+		issue = std::max(issue, reg_ready[2]);
+	else if (d.op == RVOP_CM_MVSA01)
+		issue = std::max(issue, std::max(reg_ready[10], reg_ready[11]));
+	else if (d.op == RVOP_CM_MVA01S)
+		issue = std::max(issue, std::max(reg_ready[d.rs1], reg_ready[d.rs2]));
+
+	uint cost = 1;
+	bool late_result = false;
+	switch (d.op) {
+	case RVOP_LB: case RVOP_LH: case RVOP_LW: case RVOP_LBU: case RVOP_LHU: case RVOP_C_LW:
+	case RVOP_LR_W: case RVOP_SC_W:
+		late_result = true;
+		break;
+
+	case RVOP_AMOSWAP_W: case RVOP_AMOADD_W: case RVOP_AMOXOR_W: case RVOP_AMOAND_W:
+	case RVOP_AMOOR_W: case RVOP_AMOMIN_W: case RVOP_AMOMAX_W: case RVOP_AMOMINU_W:
+	case RVOP_AMOMAXU_W:
+		cost = 4;
+		break;
+
+	case RVOP_MUL:
+		if (cfg.mul_fast)
+			late_result = !cfg.mul_faster;
+		else
+			cost = muldiv_seq_cycles(d);
+		break;
+
+	case RVOP_MULH: case RVOP_MULHSU: case RVOP_MULHU:
+		if (cfg.mulh_fast)
+			late_result = !cfg.mul_faster;
+		else
+			cost = muldiv_seq_cycles(d);
+		break;
+
+	case RVOP_DIV: case RVOP_DIVU: case RVOP_REM: case RVOP_REMU:
+		cost = muldiv_seq_cycles(d);
+		break;
+
+	case RVOP_JAL: case RVOP_JALR: case RVOP_MRET:
+		cost = 2;
+		redirected = true;
+		break;
+
+	case RVOP_FENCE_I:
+		cost = 2;
+		redirected = true;
+		btb_valid = false;
+		break;
+
+	case RVOP_BEQ: case RVOP_BNE: case RVOP_BLT: case RVOP_BGE: case RVOP_BLTU: case RVOP_BGEU: {
+		bool predicted = cfg.branch_predictor && btb_valid && btb_pc == t.pc;
+		if (predicted && !pcw) {
+			// Mispredicted: clear the BTB and refetch the fall-through path
+			cost = 2;
+			redirected = true;
+			btb_valid = false;
+		} else if (!predicted && pcw) {
+			cost = 2;
+			redirected = true;
+			if (cfg.branch_predictor && (d.imm >> 31)) {
+				btb_valid = true;
+				btb_pc = t.pc;
+			}
+		}
+		break;
+	}
+
+	case RVOP_CM_PUSH:
+		cost = 1 + d.rs2;
+		break;
+
+	case RVOP_CM_POP:
+		cost = 1 + d.rs2;
+		late_result = true;
+		break;
+
+	case RVOP_CM_POPRET:
+	case RVOP_CM_POPRETZ:
+		// The single-register forms stall on the loaded return address
+		cost = std::max(2u + d.rs2, 4u) + (d.op == RVOP_CM_POPRETZ);
+		redirected = true;
+		break;
+
+	case RVOP_CM_MVSA01:
+	case RVOP_CM_MVA01S:
+		cost = 2;
+		break;
+
+	default:
+		break;
+	}
+
+	cycles = issue + cost;
+	if (t.flags & TraceRecord::TRAP) {
+		trap_entry();
+		return;
+	}
+	++instrs;
+
+	uint64_t ready = cycles + late_result;
+	uint64_t ready_store_data = cycles;
+	switch (d.op) {
+	case RVOP_CM_PUSH:
+		write_rd(2, ready, ready_store_data);
+		break;
+	case RVOP_CM_POP:
+	case RVOP_CM_POPRET:
+	case RVOP_CM_POPRETZ:
+		// ra, then s0 upwards
+		for (uint i = 0; i < d.rs2; ++i)
+			write_rd(i == 0 ? 1 : i < 3 ? i + 7 : i + 15, ready, ready);
+		write_rd(2, cycles, cycles);
+		if (d.op == RVOP_CM_POPRETZ)
+			write_rd(10, cycles, cycles);
+		break;
+	case RVOP_CM_MVSA01:
+		write_rd(d.rs1, ready, ready_store_data);
+		write_rd(d.rs2, ready, ready_store_data);
+		break;
+	case RVOP_CM_MVA01S:
+		write_rd(10, ready, ready_store_data);
+		write_rd(11, ready, ready_store_data);
+		break;
+	default:
+		write_rd(d.rd, ready, ready_store_data);
+		break;
+	}
+}
+
+void TimingModel::record(const TraceRecord &t) {
+	if (next)
+		next->record(t);
+	if (t.flags & TraceRecord::INSTR) {
+		instr(t);
+	} else if (t.flags & TraceRecord::IRQ) {
+		// Takes the place of an instruction
+		cycles += 1;
+		trap_entry();
+	}
+}
+
+void TimingModel::print_summary(FILE *f, uint hartid) const {
+	fprintf(f, "Hart %u: minstret %lu, estimated %lu cycles, CPI %.3f (experimental model, not validated "
+		"against tb_cxxrtl)\n",
+		hartid, instrs, cycles, instrs ? (double)cycles / instrs : 0.0);
+	if (icache)
+		icache->print(f, ("Hart " + std::to_string(hartid)).c_str());
+}
@@ -0,0 +1,188 @@
+#include "rv_trace.h"
+#include "encoding/rv_opcodes.h"
+
+#include <algorithm>
+#include <iostream>
+
+void trace_render_text(FILE *f, const TraceRecord &t) {
+	if (t.flags & TraceRecord::INSTR) {
+		fprintf(f, "%08x: ", t.pc);
+		if ((t.instr & 0x3) == 0x3) {
+			fprintf(f, "%08x : ", t.instr);
+		} else {
+			fprintf(f, "    %04x : ", t.instr & 0xffffu);
+		}
+		if (t.flags & TraceRecord::RD) {
+			fprintf(f, "%-3s   <- %08x :\n", friendly_reg_names[t.rd], t.rd_wdata);
+		} else if (t.flags & TraceRecord::PCW) {
+			fprintf(f, "pc    <- %08x <\n", t.pc_wdata);
+		} else {
+			fprintf(f, "                  :\n");
+		}
+		if ((t.flags & TraceRecord::PCW) && (t.flags & TraceRecord::RD)) {
+			fprintf(f, "                   : pc    <- %08x <\n", t.pc_wdata);
+		}
+		if (t.flags & TraceRecord::CSR) {
+			fprintf(f, "                   : #%03x  <- %08x :\n", t.csr_addr, t.csr_wdata);
+		}
+	}
+	if (t.flags & TraceRecord::TRAP) {
+		fprintf(f, "^^^ Trap           : cause <- %-2u       :\n", t.cause);
+		fprintf(f, "|||                : pc    <- %08x <\n", t.trap_pc);
+	} else if (t.flags & TraceRecord::IRQ) {
+		fprintf(f, "^^^ IRQ            : cause <- IRQ + %-2u :\n", t.cause);
+		fprintf(f, "|||                : pc    <- %08x <\n", t.trap_pc);
+	}
+	if (t.flags & TraceRecord::PRIV) {
+		fprintf(f, "|||                : priv  <- %c        :\n", "US.M"[t.priv & 0x3]);
+	}
+}
+
+void TraceGate::record(const TraceRecord &t) {
+	// An IRQ entry has no instruction, so goes by its target
+	ux_t pc = t.flags & TraceRecord::INSTR ? t.pc : t.trap_pc;
+	bool pass = on && (priv_mask >> priv & 1u) && !(pc_range && (pc < pc_lo || pc >= pc_hi));
+	if (t.flags & TraceRecord::PRIV)
+		priv = t.priv;
+	if (pass) {
+		ring_count = 0;
+		next->record(t);
+		return;
+	}
+	if (ring.empty())
+		return;
+	ring[ring_next] = t;
+	ring_next = (ring_next + 1) % ring.size();
+	ring_count = std::min(ring_count + 1, ring.size());
+	if (t.flags & TraceRecord::TRAP)
+		dump("trap");
+}
+
+void TraceGate::dump(const char *why) {
+	if (ring_count == 0)
+		return;
+	char text[64];
+	int len = snprintf(text, sizeof(text), "--- Last %zu steps before %s:\n", ring_count, why);
+	next->message(text, len);
+	for (size_t i = 0; i < ring_count; ++i)
+		next->record(ring[(ring_next + ring.size() - ring_count + i) % ring.size()]);
+	ring_count = 0;
+}
+
+bool BinaryTraceWriter::open(const std::string &path) {
+	if (path.size() > 4 && path.compare(path.size() - 4, 4, ".zst") == 0) {
+		// Quote the path for the shell
+		std::string quoted = "'";
+		for (char c : path) {
+			if (c == '\'')
+				quoted += "'\\''";
+			else
+				quoted += c;
+		}
+		quoted += "'";
+		out = popen(("zstd -q -f -o " + quoted).c_str(), "w");
+		is_pipe = true;
+	} else {
+		out = fopen(path.c_str(), "wb");
+		is_pipe = false;
+	}
+	if (!out) {
+		std::cerr << "Failed to open trace output \"" << path << "\"\n";
+		return false;
+	}
+	buf.reserve(BUF_SIZE + 64);
+	pending.reserve(BUF_SIZE + 64);
+	for (const char *p = MAGIC; *p; ++p)
+		put_u8(*p);
+	writer = std::thread(&BinaryTraceWriter::writer_thread, this);
+	return true;
+}
+
+bool BinaryTraceWriter::close() {
+	if (!out)
+		return true;
+	hand_off();
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		done = true;
+	}
+	cv.notify_all();
+	writer.join();
+	int rc = is_pipe ? pclose(out) : fclose(out);
+	out = nullptr;
+	return !write_error && rc == 0;
+}
+
+BinaryTraceWriter::~BinaryTraceWriter() {
+	close();
+}
+
+// Pass the current buffer to the writer thread, waiting for it to finish
+// with the previous one
+void BinaryTraceWriter::hand_off() {
+	std::unique_lock<std::mutex> guard(lock);
+	cv.wait(guard, [&] {return !have_pending;});
+	std::swap(buf, pending);
+	have_pending = true;
+	cv.notify_all();
+}
+
+void BinaryTraceWriter::writer_thread() {
+	std::unique_lock<std::mutex> guard(lock);
+	while (true) {
+		cv.wait(guard, [&] {return have_pending || done;});
+		if (!have_pending)
+			return;
+		guard.unlock();
+		if (fwrite(pending.data(), 1, pending.size(), out) != pending.size())
+			write_error = true;
+		pending.clear();
+		guard.lock();
+		have_pending = false;
+		cv.notify_all();
+	}
+}
+
+void BinaryTraceWriter::record(const TraceRecord &t) {
+	put_u8(t.flags);
+	ux_t pc = next_pc;
+	if (t.flags & TraceRecord::INSTR) {
+		put_delta(t.pc - next_pc);
+		pc = t.pc;
+		if ((t.instr & 0x3) == 0x3)
+			put_u32(t.instr);
+		else
+			put_u16(t.instr);
+		next_pc = pc + ((t.instr & 0x3) == 0x3 ? 4 : 2);
+	}
+	if (t.flags & TraceRecord::RD) {
+		put_u8(t.rd);
+		put_u32(t.rd_wdata);
+	}
+	if (t.flags & TraceRecord::PCW) {
+		put_delta(t.pc_wdata - pc);
+		next_pc = t.pc_wdata;
+	}
+	if (t.flags & TraceRecord::CSR) {
+		put_u16(t.csr_addr);
+		put_u32(t.csr_wdata);
+	}
+	if (t.flags & (TraceRecord::TRAP | TraceRecord::IRQ)) {
+		put_varint(t.cause);
+		put_u32(t.trap_pc);
+		next_pc = t.trap_pc;
+	}
+	if (t.flags & TraceRecord::PRIV) {
+		put_u8(t.priv);
+	}
+	if (buf.size() >= BUF_SIZE)
+		hand_off();
+}
+
+void BinaryTraceWriter::message(const char *text, size_t len) {
+	put_u8(MESSAGE);
+	put_varint(len);
+	buf.insert(buf.end(), text, text + len);
+	if (buf.size() >= BUF_SIZE)
+		hand_off();
+}
@@ -1,59 +1,220 @@
 #!/usr/bin/env python3
 
 import argparse
+import bisect
+import functools
+import hashlib
+import mmap
+import multiprocessing
+import os
 import re
+import shutil
+import struct
+import subprocess
 import sys
+import tempfile
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import rvtrace
 
 # Script for annotating rvcpp trace output with the contents of an objdump
 # disassembly file. Multiple disassembly files can be passed, in which case
 # they will be merged. (Usually these files would be for non-overlapping
 # address ranges: if the files overlap, the later file in command line order
-# takes precedence for the overlapping address.)
-
-parser = argparse.ArgumentParser()
-parser.add_argument("logfile", help="Raw log file to be annotated, output from rvcpp --trace")
-parser.add_argument("out", help="Output path for annotated log file (pass - for stdout)")
-parser.add_argument("-d", "--dis", action="append", help="Specify a disassembly file (output of objdump -d) with which to annotate the log")
-args = parser.parse_args()
-
-if args.dis is None:
-	sys.exit("At least one disassembly file must be specified")
-
-label_dict = {}
-instr_dict = {}
-for dispath in args.dis:
-	for l in open(dispath).readlines():
-		if re.match(r"^\s*[0-9a-f]+:", l):
-			instruction_addr = int(l.split(":")[0], 16)
-			instruction_text = " ".join(l.strip().split()[2:])
-			instr_dict[instruction_addr] = instruction_text
-		elif re.match("^[0-9a-f]+ <", l):
-			label_addr = int(l.split()[0], 16)
-			label_text = l.split("<")[-1].strip("\n>:")
-			label_dict[label_addr] = label_text
-
-ifile = open(args.logfile)
-if args.out == "-":
-	ofile = sys.stdout
-else:
-	ofile = open(args.out, "w")
-
-for l in ifile.readlines():
-	# Not an addressed line, so just pass it through unmodified.
-	if not re.match("^[0-9a-f]{8}:", l):
-		ofile.write(l)
-		continue
-	addr = int(l[:8], 16)
-	# If there is a label, there ought also be an instruction to be labelled.
-	# assert(not (addr in label_dict and addr not in instr_dict))
-	# Not an address we know about, so pass it through unmodified.
-	if addr not in label_dict and addr not in instr_dict:
-		ofile.write(l)
-		continue
-	# Removed label lines for now as the label is usually present on the jump instruction
-	# if addr in label_dict:
-	# 	ofile.write(" " * 42 + label_dict[addr] + ":\n")
-	if addr in instr_dict:
-		ofile.write(l.strip() + " " * 2 + instr_dict[addr] + "\n")
+# takes precedence for the overlapping address.) Alternatively pass --elf,
+# and the disassembly is made with objdump.
+#
+# The log can be either the text output of rvcpp --trace, or a binary trace
+# from rvcpp --trace-bin (optionally .zst compressed), which is much faster.
+#
+# The disassembly is parsed once into a sorted address index, which is
+# cached on disk keyed by the hash of the ELF (or of the disassembly files),
+# and memory-mapped for lookups. The log is streamed, so memory use doesn't
+# grow with its size. A large text log is split into chunks at line
+# boundaries which are annotated in parallel (--jobs). Binary traces are
+# delta-encoded, so are always decoded in one pass.
+
+INDEX_MAGIC = b"RVANNOT1"
+# Below this, a text log isn't worth splitting
+MIN_CHUNK = 16 << 20
+
+ADDR_LINE = re.compile(rb"^[0-9a-f]{8}:")
+
+def parse_disassembly(paths):
+	"""Return {addr: instruction text} from objdump -d output files"""
+	instr_dict = {}
+	for dispath in paths:
+		with open(dispath) as f:
+			for l in f:
+				if re.match(r"^\s*[0-9a-f]+:", l):
+					instruction_addr = int(l.split(":")[0], 16)
+					instruction_text = " ".join(l.strip().split()[2:])
+					instr_dict[instruction_addr] = instruction_text
+	return instr_dict
+
+def write_index(path, instr_dict):
+	"""Index layout: magic, count n, n sorted u32 addresses, n + 1 u32 offsets
+	into the text that follows (UTF-8)"""
+	addrs = sorted(instr_dict)
+	texts = [instr_dict[a].encode() for a in addrs]
+	offsets = [0]
+	for t in texts:
+		offsets.append(offsets[-1] + len(t))
+	tmp = path + ".tmp{}".format(os.getpid())
+	with open(tmp, "wb") as f:
+		f.write(INDEX_MAGIC + struct.pack("<I", len(addrs)))
+		f.write(struct.pack("<{}I".format(len(addrs)), *addrs))
+		f.write(struct.pack("<{}I".format(len(offsets)), *offsets))
+		f.write(b"".join(texts))
+	# Atomic, so concurrent runs can share the cache
+	os.replace(tmp, path)
+
+class Index:
+	"""Memory-mapped address index, as written by write_index()"""
+
+	def __init__(self, path):
+		with open(path, "rb") as f:
+			self.map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+		if self.map[:len(INDEX_MAGIC)] != INDEX_MAGIC:
+			raise ValueError("{} is not an annotation index".format(path))
+		n = struct.unpack_from("<I", self.map, len(INDEX_MAGIC))[0]
+		base = len(INDEX_MAGIC) + 4
+		view = memoryview(self.map)
+		self.addrs = view[base:base + 4 * n].cast("I")
+		self.offsets = view[base + 4 * n:base + 8 * n + 4].cast("I")
+		self.text_base = base + 8 * n + 4
+		self.lookup = functools.lru_cache(maxsize=1 << 16)(self._lookup)
+
+	def _lookup(self, addr):
+		"""Instruction text (bytes) at addr, or None"""
+		i = bisect.bisect_left(self.addrs, addr)
+		if i == len(self.addrs) or self.addrs[i] != addr:
+			return None
+		return self.map[self.text_base + self.offsets[i]:self.text_base + self.offsets[i + 1]]
+
+def hash_files(paths, extra=b""):
+	h = hashlib.sha256(extra)
+	for p in paths:
+		with open(p, "rb") as f:
+			for block in iter(lambda: f.read(1 << 20), b""):
+				h.update(block)
+	return h.hexdigest()
+
+def get_index(args, tmpdir):
+	"""Return the path of the index, building it if it isn't cached"""
+	if args.elf:
+		key = hash_files([args.elf], args.objdump.encode())
+	else:
+		key = hash_files(args.dis)
+	if args.no_cache:
+		path = os.path.join(tmpdir, "index")
+	else:
+		os.makedirs(args.cache_dir, exist_ok=True)
+		path = os.path.join(args.cache_dir, key + ".idx")
+		if os.path.exists(path):
+			return path
+	if args.elf:
+		dispath = os.path.join(tmpdir, "dis")
+		with open(dispath, "w") as f:
+			if subprocess.run([args.objdump, "-d", args.elf], stdout=f).returncode != 0:
+				sys.exit("Failed: {} -d {}".format(args.objdump, args.elf))
+		dis = [dispath]
+	else:
+		dis = args.dis
+	write_index(path, parse_disassembly(dis))
+	return path
+
+def annotate_text(index_path, logfile, start, end, ofile):
+	"""Annotate the lines of a text log from offset start (the start of a
+	line) up to the first line starting at or after end"""
+	index = Index(index_path)
+	with open(logfile, "rb") as ifile:
+		ifile.seek(start)
+		pos = start
+		for l in ifile:
+			if pos >= end:
+				break
+			pos += len(l)
+			# Not an addressed line, or not an address we know about, so
+			# pass it through unmodified.
+			text = index.lookup(int(l[:8], 16)) if ADDR_LINE.match(l) else None
+			if text is None:
+				ofile.write(l)
+			else:
+				ofile.write(l.strip() + b"  " + text + b"\n")
+
+def annotate_chunk(job):
+	index_path, logfile, start, end, part = job
+	with open(part, "wb") as f:
+		annotate_text(index_path, logfile, start, end, f)
+
+def line_start_after(logfile, offset):
+	"""Offset of the first line starting at or after offset"""
+	with open(logfile, "rb") as f:
+		if offset == 0:
+			return 0
+		f.seek(offset - 1)
+		f.readline()
+		return f.tell()
+
+def annotate_binary(index_path, logfile, ofile):
+	index = Index(index_path)
+	for r in rvtrace.decode(rvtrace.open_trace(logfile)):
+		if isinstance(r, str):
+			ofile.write(r.encode())
+		elif r.flags & rvtrace.INSTR:
+			text = index.lookup(r.pc)
+			ofile.write(rvtrace.render(r, text.decode() if text is not None else None).encode())
+		else:
+			ofile.write(rvtrace.render(r).encode())
+
+def main():
+	parser = argparse.ArgumentParser()
+	parser.add_argument("logfile", help="Raw log file to be annotated, output from rvcpp --trace or --trace-bin")
+	parser.add_argument("out", help="Output path for annotated log file (pass - for stdout)")
+	parser.add_argument("-d", "--dis", action="append", help="Specify a disassembly file (output of objdump -d) with which to annotate the log")
+	parser.add_argument("-e", "--elf", help="Disassemble this ELF file with --objdump, instead of passing --dis")
+	parser.add_argument("--objdump", default="riscv32-unknown-elf-objdump", help="objdump for --elf (default %(default)s)")
+	parser.add_argument("-j", "--jobs", type=int, default=os.cpu_count(), help="Processes annotating a text log in parallel (default: one per core)")
+	parser.add_argument("--cache-dir", default=os.path.join(os.path.expanduser("~"), ".cache", "rvcpp-annotate"),
+		help="Where to keep address indices (default %(default)s)")
+	parser.add_argument("--no-cache", action="store_true", help="Build the index afresh, and don't keep it")
+	args = parser.parse_args()
+
+	if bool(args.dis) == bool(args.elf):
+		sys.exit("Either --elf or at least one disassembly file must be specified")
+
+	out_dir = os.path.dirname(os.path.abspath(args.out)) if args.out != "-" else None
+	with tempfile.TemporaryDirectory(dir=out_dir) as tmpdir:
+		index_path = get_index(args, tmpdir)
+		ofile = sys.stdout.buffer if args.out == "-" else open(args.out, "wb")
+
+		with open(args.logfile, "rb") as f:
+			is_binary = args.logfile.endswith(".zst") or f.read(len(rvtrace.MAGIC)) == rvtrace.MAGIC
+		if is_binary:
+			annotate_binary(index_path, args.logfile, ofile)
+			ofile.flush()
+			return
 
+		size = os.path.getsize(args.logfile)
+		jobs = max(1, min(args.jobs, size // MIN_CHUNK))
+		if jobs == 1:
+			annotate_text(index_path, args.logfile, 0, size, ofile)
+			ofile.flush()
+			return
+		# Several chunks per process, to even out the load. Each chunk is
+		# annotated to its own part file, and the parts are joined in order.
+		n_chunks = jobs * 4
+		bounds = [line_start_after(args.logfile, size * i // n_chunks) for i in range(n_chunks)] + [size]
+		chunks = [(index_path, args.logfile, bounds[i], bounds[i + 1], os.path.join(tmpdir, "part{}".format(i)))
+			for i in range(n_chunks) if bounds[i] < bounds[i + 1]]
+		with multiprocessing.Pool(jobs) as pool:
+			for i, _ in enumerate(pool.imap(annotate_chunk, chunks)):
+				part = chunks[i][4]
+				with open(part, "rb") as f:
+					shutil.copyfileobj(f, ofile, 1 << 20)
+				os.remove(part)
+		ofile.flush()
 
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,279 @@
+#!/usr/bin/env python3
+
+import argparse
+import ctypes
+import os
+import sys
+
+# Python bindings for librvcpp (include/rvcpp.h), through ctypes, so there is
+# nothing to build beyond `make lib`. Instructions run natively in batches of
+# rvcpp_run(), so a script costs a few calls per test, not per instruction.
+# Guest RAM is exposed as a writable memoryview on the hart's own memory (no
+# copy), which numpy.frombuffer() also accepts. Python MMIO callbacks are only
+# called for accesses outside of RAM.
+#
+# Run as a script to execute a flat binary with the testbench IO, as with
+# `rvcpp --bin`.
+
+EVENT_NONE       = 0
+EVENT_EXIT       = 1
+EVENT_BREAKPOINT = 2
+EVENT_WFI        = 3
+EVENT_STOP       = 4
+
+IO_BASE = 0x80000000
+
+_MMIO_READ_FN = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_void_p, ctypes.c_uint32,
+	ctypes.c_uint, ctypes.POINTER(ctypes.c_uint32))
+_MMIO_WRITE_FN = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_void_p, ctypes.c_uint32,
+	ctypes.c_uint, ctypes.c_uint32)
+_RETIRE_FN = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_uint32,
+	ctypes.c_uint32, ctypes.c_int)
+
+_lib = None
+
+def load_library(path=None):
+	"""Load librvcpp.so from path, or $RVCPP_LIB, or next to this script's
+	directory. Called automatically on creating the first Hart."""
+	global _lib
+	if _lib is not None:
+		return _lib
+	if path is None:
+		path = os.environ.get("RVCPP_LIB", os.path.join(
+			os.path.dirname(os.path.abspath(__file__)), "..", "librvcpp.so"))
+	lib = ctypes.CDLL(path)
+	hart = ctypes.c_void_p
+	u8p = ctypes.POINTER(ctypes.c_uint8)
+	u32 = ctypes.c_uint32
+	sigs = {
+		"rvcpp_create":            (hart, [u32, u32, u32]),
+		"rvcpp_destroy":           (None, [hart]),
+		"rvcpp_ram":               (u8p, [hart, ctypes.POINTER(u32)]),
+		"rvcpp_flush_code":        (None, [hart]),
+		"rvcpp_add_mmio":          (ctypes.c_int, [hart, u32, u32, _MMIO_READ_FN, _MMIO_WRITE_FN, ctypes.c_void_p]),
+		"rvcpp_add_ram":           (u8p, [hart, u32, u32, ctypes.c_int]),
+		"rvcpp_add_tbio":          (ctypes.c_int, [hart, u32]),
+		"rvcpp_load_elf":          (ctypes.c_int, [hart, ctypes.c_char_p]),
+		"rvcpp_set_tohost":        (None, [hart, u32]),
+		"rvcpp_run":               (ctypes.c_uint64, [hart, ctypes.c_uint64, ctypes.POINTER(ctypes.c_int)]),
+		"rvcpp_exit_code":         (ctypes.c_int, [hart]),
+		"rvcpp_stop":              (None, [hart]),
+		"rvcpp_set_block_cache":   (None, [hart, ctypes.c_int]),
+		"rvcpp_get_pc":            (u32, [hart]),
+		"rvcpp_set_pc":            (None, [hart, u32]),
+		"rvcpp_get_reg":           (u32, [hart, ctypes.c_uint]),
+		"rvcpp_set_reg":           (None, [hart, ctypes.c_uint, u32]),
+		"rvcpp_read_csr":          (ctypes.c_int, [hart, ctypes.c_uint16, ctypes.POINTER(u32)]),
+		"rvcpp_write_csr":         (ctypes.c_int, [hart, ctypes.c_uint16, u32]),
+		"rvcpp_set_irqs":          (None, [hart, u32, ctypes.c_int, ctypes.c_int]),
+		"rvcpp_add_breakpoint":    (None, [hart, u32]),
+		"rvcpp_remove_breakpoint": (None, [hart, u32]),
+		"rvcpp_set_retire_callback": (None, [hart, _RETIRE_FN, ctypes.c_void_p]),
+	}
+	for name, (restype, argtypes) in sigs.items():
+		f = getattr(lib, name)
+		f.restype = restype
+		f.argtypes = argtypes
+	_lib = lib
+	return lib
+
+def _buffer(ptr, size):
+	return memoryview((ctypes.c_uint8 * size).from_address(ctypes.addressof(ptr.contents))).cast("B")
+
+class Hart:
+	"""One rvcpp hart, with size bytes of RAM at ram_base. See include/rvcpp.h
+	for the semantics of each method."""
+
+	def __init__(self, ram_base=0, ram_size=16 << 20, reset_vector=None, tbio=True, block_cache=True):
+		self._h = None
+		self._lib = load_library()
+		self._h = self._lib.rvcpp_create(ram_base, ram_size,
+			ram_base + 0x40 if reset_vector is None else reset_vector)
+		if not self._h:
+			raise ValueError("invalid RAM base or size")
+		self.ram_base = ram_base
+		size = ctypes.c_uint32()
+		ptr = self._lib.rvcpp_ram(self._h, ctypes.byref(size))
+		self.ram = _buffer(ptr, size.value)
+		# ctypes callback objects must outlive the hart
+		self._callbacks = []
+		self._error = None
+		if tbio:
+			self._lib.rvcpp_add_tbio(self._h, IO_BASE)
+		self._lib.rvcpp_set_block_cache(self._h, block_cache)
+
+	def close(self):
+		if self._h:
+			self.ram.release()
+			self._lib.rvcpp_destroy(self._h)
+			self._h = None
+
+	def __enter__(self):
+		return self
+
+	def __exit__(self, *exc):
+		self.close()
+
+	def __del__(self):
+		self.close()
+
+	def load(self, data, addr=None):
+		"""Copy bytes into RAM at addr (default the base of RAM)"""
+		offs = (self.ram_base if addr is None else addr) - self.ram_base
+		self.ram[offs:offs + len(data)] = data
+		self._lib.rvcpp_flush_code(self._h)
+
+	def load_elf(self, path):
+		if self._lib.rvcpp_load_elf(self._h, os.fsencode(path)) != 0:
+			raise ValueError("failed to load {}".format(path))
+
+	def set_tohost(self, addr):
+		self._lib.rvcpp_set_tohost(self._h, addr)
+
+	def flush_code(self):
+		"""Call after modifying code in RAM through self.ram"""
+		self._lib.rvcpp_flush_code(self._h)
+
+	def _guard(self, f, fault):
+		# Exceptions can't propagate through C, so the access faults, and the
+		# hart stops and re-raises from run()
+		def wrapped(*args):
+			try:
+				return f(*args)
+			except BaseException as e:
+				self._error = e
+				self._lib.rvcpp_stop(self._h)
+				return fault
+		return wrapped
+
+	def add_mmio(self, base, size, read=None, write=None):
+		"""Map read(offset, size) -> int and write(offset, size, data) over
+		[base, base + size). Returning None from read, or False from write,
+		is a bus fault."""
+		def c_read(ctx, offset, size, data):
+			x = read(offset, size) if read else None
+			if x is None:
+				return 1
+			data[0] = x & 0xffffffff
+			return 0
+		def c_write(ctx, offset, size, data):
+			return 0 if write and write(offset, size, data) is not False else 1
+		cb = (_MMIO_READ_FN(self._guard(c_read, 1)), _MMIO_WRITE_FN(self._guard(c_write, 1)))
+		self._callbacks.append(cb)
+		if self._lib.rvcpp_add_mmio(self._h, base, size, cb[0], cb[1], None) != 0:
+			raise ValueError("invalid MMIO region")
+
+	def add_ram(self, base, size, read_only=False):
+		"""Add another RAM region, and return a memoryview of it"""
+		ptr = self._lib.rvcpp_add_ram(self._h, base, size, read_only)
+		if not ptr:
+			raise ValueError("invalid RAM region")
+		return _buffer(ptr, size)
+
+	def set_retire_callback(self, f):
+		"""f(pc, instr, trap) is called after each instruction, and the hart
+		single-steps while it is set. None removes it."""
+		if f is None:
+			self._lib.rvcpp_set_retire_callback(self._h, _RETIRE_FN(), None)
+			return
+		cb = _RETIRE_FN(self._guard(lambda ctx, pc, instr, trap: f(pc, instr, bool(trap)), None))
+		self._callbacks.append(cb)
+		self._lib.rvcpp_set_retire_callback(self._h, cb, None)
+
+	def run(self, max_instrs):
+		"""Run up to max_instrs instructions. Return (count, event)."""
+		event = ctypes.c_int()
+		n = self._lib.rvcpp_run(self._h, max_instrs, ctypes.byref(event))
+		if self._error is not None:
+			e, self._error = self._error, None
+			raise e
+		return n, event.value
+
+	def run_to_exit(self, max_instrs, batch=1 << 24):
+		"""Run until an exit request, or max_instrs instructions. Return the
+		exit code, or None on timeout. Breakpoints and WFI don't stop it."""
+		while max_instrs > 0:
+			n, event = self.run(min(batch, max_instrs))
+			max_instrs -= n
+			if event == EVENT_EXIT:
+				return self.exit_code
+			if event == EVENT_STOP:
+				break
+		return None
+
+	def stop(self):
+		self._lib.rvcpp_stop(self._h)
+
+	@property
+	def exit_code(self):
+		return self._lib.rvcpp_exit_code(self._h)
+
+	@property
+	def pc(self):
+		return self._lib.rvcpp_get_pc(self._h)
+
+	@pc.setter
+	def pc(self, value):
+		self._lib.rvcpp_set_pc(self._h, value)
+
+	def get_reg(self, regnum):
+		return self._lib.rvcpp_get_reg(self._h, regnum)
+
+	def set_reg(self, regnum, value):
+		self._lib.rvcpp_set_reg(self._h, regnum, value & 0xffffffff)
+
+	def read_csr(self, addr):
+		data = ctypes.c_uint32()
+		if self._lib.rvcpp_read_csr(self._h, addr, ctypes.byref(data)) != 0:
+			raise ValueError("CSR {:03x} is not accessible".format(addr))
+		return data.value
+
+	def write_csr(self, addr, value):
+		if self._lib.rvcpp_write_csr(self._h, addr, value & 0xffffffff) != 0:
+			raise ValueError("CSR {:03x} is not accessible".format(addr))
+
+	def set_irqs(self, external=0, timer=False, soft=False):
+		self._lib.rvcpp_set_irqs(self._h, external, timer, soft)
+
+	def add_breakpoint(self, addr):
+		self._lib.rvcpp_add_breakpoint(self._h, addr)
+
+	def remove_breakpoint(self, addr):
+		self._lib.rvcpp_remove_breakpoint(self._h, addr)
+
+	def read_words(self, start, end):
+		"""Little-endian words of RAM in [start, end), as a list"""
+		return list(self.ram[start - self.ram_base:end - self.ram_base].cast("I")) \
+			if sys.byteorder == "little" else \
+			[int.from_bytes(self.ram[a - self.ram_base:a - self.ram_base + 4], "little")
+				for a in range(start, end, 4)]
+
+if __name__ == "__main__":
+	parser = argparse.ArgumentParser()
+	parser.add_argument("bin", help="Flat binary file loaded to address 0x0 in RAM")
+	parser.add_argument("--cycles", type=lambda x: int(x, 0), default=100000,
+		help="Maximum number of instructions to run")
+	parser.add_argument("--memsize", type=int, default=16 * 1024,
+		help="Memory size in units of 1024 bytes")
+	parser.add_argument("--dump", nargs=2, action="append", default=[], metavar=("START", "END"),
+		type=lambda x: int(x, 0), help="Print out memory contents between start and end (exclusive)")
+	parser.add_argument("--no-block-cache", action="store_true", help="Don't use the block cache")
+	args = parser.parse_args()
+
+	# The testbench IO prints through C stdio, so flush it before printing
+	libc = ctypes.CDLL(None)
+	with Hart(ram_size=args.memsize * 1024, block_cache=not args.no_block_cache) as hart:
+		hart.load(open(args.bin, "rb").read())
+		exit_code = hart.run_to_exit(args.cycles)
+		libc.fflush(None)
+		if exit_code is None:
+			print("Timed out")
+		else:
+			print("CPU requested halt. Exit code {}".format(exit_code))
+		for start, end in args.dump:
+			print("Dumping memory from {:08x} to {:08x}:".format(start, end))
+			data = hart.ram[start - hart.ram_base:end - hart.ram_base]
+			for i in range(0, len(data), 16):
+				print(" ".join("{:02x}".format(b) for b in data[i:i + 16]))
+			print()
+	sys.exit(0 if exit_code is not None else -1)
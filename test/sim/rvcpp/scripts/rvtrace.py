@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+
+import argparse
+import subprocess
+import sys
+
+# Streaming decoder for the binary trace format written by rvcpp --trace-bin
+# (see BinaryTraceWriter in rv_trace.h), and a renderer for the same text
+# format as rvcpp --trace. Run as a script to convert a binary trace to text.
+
+MAGIC = b"RVTRACE1"
+MESSAGE = 0x80
+
+INSTR = 0x01
+RD    = 0x02
+PCW   = 0x04
+CSR   = 0x08
+TRAP  = 0x10
+IRQ   = 0x20
+PRIV  = 0x40
+
+REG_NAMES = [
+	"x0", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "s0", "s1", "a0", "a1", "a2",
+	"a3", "a4", "a5", "a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7", "s8", "s9",
+	"s10", "s11", "t3", "t4", "t5", "t6"
+]
+
+class Record:
+	__slots__ = ["flags", "pc", "instr", "rd", "rd_wdata", "pc_wdata",
+		"csr_addr", "csr_wdata", "cause", "trap_pc", "priv"]
+
+	def __init__(self, flags):
+		self.flags = flags
+
+def open_trace(path):
+	"""Open a binary trace for reading, decompressing if it ends in .zst"""
+	if path.endswith(".zst"):
+		proc = subprocess.Popen(["zstd", "-dcq", path], stdout=subprocess.PIPE)
+		return proc.stdout
+	return open(path, "rb")
+
+def decode(f, chunk_size=1 << 20):
+	"""Yield a Record or a message string for each entry in the trace file f"""
+	buf = f.read(chunk_size)
+	if buf[:len(MAGIC)] != MAGIC:
+		raise ValueError("not an rvcpp binary trace")
+	pos = len(MAGIC)
+	next_pc = 0
+
+	def varint():
+		nonlocal pos
+		x = 0
+		shift = 0
+		while True:
+			b = buf[pos]
+			pos += 1
+			x |= (b & 0x7f) << shift
+			shift += 7
+			if not b & 0x80:
+				return x
+
+	def delta():
+		x = varint()
+		return (x >> 1) ^ -(x & 1)
+
+	def u(n):
+		nonlocal pos
+		x = int.from_bytes(buf[pos:pos + n], "little")
+		pos += n
+		return x
+
+	while True:
+		# Refill when less than the largest possible record remains (a long
+		# message is completed separately below)
+		if len(buf) - pos < 64:
+			buf = buf[pos:] + f.read(chunk_size)
+			pos = 0
+			if not buf:
+				return
+
+		flags = buf[pos]
+		pos += 1
+		if flags == MESSAGE:
+			n = varint()
+			while len(buf) - pos < n:
+				more = f.read(chunk_size)
+				if not more:
+					raise ValueError("truncated trace")
+				buf = buf[pos:] + more
+				pos = 0
+			yield buf[pos:pos + n].decode(errors="replace")
+			pos += n
+			continue
+		elif flags & 0x80:
+			raise ValueError("bad record flags {:02x}".format(flags))
+
+		r = Record(flags)
+		pc = next_pc
+		if flags & INSTR:
+			pc = (next_pc + delta()) & 0xffffffff
+			r.pc = pc
+			r.instr = u(2)
+			if r.instr & 0x3 == 0x3:
+				r.instr |= u(2) << 16
+				next_pc = pc + 4
+			else:
+				next_pc = pc + 2
+		if flags & RD:
+			r.rd = u(1)
+			r.rd_wdata = u(4)
+		if flags & PCW:
+			r.pc_wdata = (pc + delta()) & 0xffffffff
+			next_pc = r.pc_wdata
+		if flags & CSR:
+			r.csr_addr = u(2)
+			r.csr_wdata = u(4)
+		if flags & (TRAP | IRQ):
+			r.cause = varint()
+			r.trap_pc = u(4)
+			next_pc = r.trap_pc
+		if flags & PRIV:
+			r.priv = u(1)
+		next_pc &= 0xffffffff
+		yield r
+
+def render(r, annotation=None):
+	"""Return the text trace lines for a record. If present, the annotation is
+	appended to the first line."""
+	lines = []
+	if r.flags & INSTR:
+		if r.instr & 0x3 == 0x3:
+			l = "{:08x}: {:08x} : ".format(r.pc, r.instr)
+		else:
+			l = "{:08x}:     {:04x} : ".format(r.pc, r.instr & 0xffff)
+		if r.flags & RD:
+			l += "{:<3s}   <- {:08x} :".format(REG_NAMES[r.rd], r.rd_wdata)
+		elif r.flags & PCW:
+			l += "pc    <- {:08x} <".format(r.pc_wdata)
+		else:
+			l += "                  :"
+		if annotation is not None:
+			l += "  " + annotation
+		lines.append(l + "\n")
+		if r.flags & PCW and r.flags & RD:
+			lines.append("                   : pc    <- {:08x} <\n".format(r.pc_wdata))
+		if r.flags & CSR:
+			lines.append("                   : #{:03x}  <- {:08x} :\n".format(r.csr_addr, r.csr_wdata))
+	if r.flags & TRAP:
+		lines.append("^^^ Trap           : cause <- {:<2d}       :\n".format(r.cause))
+		lines.append("|||                : pc    <- {:08x} <\n".format(r.trap_pc))
+	elif r.flags & IRQ:
+		lines.append("^^^ IRQ            : cause <- IRQ + {:<2d} :\n".format(r.cause))
+		lines.append("|||                : pc    <- {:08x} <\n".format(r.trap_pc))
+	if r.flags & PRIV:
+		lines.append("|||                : priv  <- {}        :\n".format("US.M"[r.priv & 0x3]))
+	return "".join(lines)
+
+if __name__ == "__main__":
+	parser = argparse.ArgumentParser()
+	parser.add_argument("trace", help="Binary trace file, output from rvcpp --trace-bin")
+	parser.add_argument("out", nargs="?", default="-", help="Output path for text trace (default stdout)")
+	args = parser.parse_args()
+	ofile = sys.stdout if args.out == "-" else open(args.out, "w")
+	for r in decode(open_trace(args.trace)):
+		ofile.write(r if isinstance(r, str) else render(r))
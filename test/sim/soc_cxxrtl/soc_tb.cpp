@@ -0,0 +1,516 @@
+// Testbench for the example SoC (example_soc/soc/example_soc.v), for running
+// board software in simulation. The design is the whole SoC, so unlike tb
+// there is no memory or IO model in C++: the program is written straight
+// into the SRAM's CXXRTL memory before reset, the UART's pins are connected
+// to the terminal, and OpenOCD connects to the SoC's own JTAG-DTM through
+// tb's remote_bitbang server.
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "dut.h"
+#include <cxxrtl/cxxrtl_vcd.h>
+
+#include "../rvcpp/include/rv_elf.h"
+#include "../tb_cxxrtl/tb_jtag.h"
+
+// Fixed by example_soc.v
+static const uint32_t RESET_VECTOR = 0x40;
+static const uint32_t SRAM_BASE = 0x0;
+
+static const size_t WAVES_PUSH_THRESHOLD = 1 << 20;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void handle_sigint(int) {
+	interrupted = 1;
+}
+
+// -----------------------------------------------------------------------------
+// SRAM preload
+
+// The SRAM's storage, found by name among the CXXRTL memories under the
+// SRAM's instance: either one 32-bit memory, or several memories of the same
+// depth which are lanes of the word (e.g. one per byte), least-significant
+// first in name order.
+struct sram_image {
+	std::vector<const cxxrtl::debug_item*> lanes;
+	uint32_t lane_width;
+	uint32_t depth;
+
+	sram_image(): lane_width(0), depth(0) {}
+
+	bool find(const cxxrtl::debug_items &items, const std::string &prefix, std::string &err) {
+		lanes.clear();
+		for (auto &it : items.table) {
+			if (it.first.compare(0, prefix.size(), prefix) != 0)
+				continue;
+			for (auto &item : it.second) {
+				if (item.type == cxxrtl::debug_item::MEMORY)
+					lanes.push_back(&item);
+			}
+		}
+		if (lanes.empty()) {
+			err = "No memory found under \"" + prefix + "\"";
+			return false;
+		}
+		lane_width = lanes[0]->width;
+		depth = lanes[0]->depth;
+		for (const cxxrtl::debug_item *l : lanes) {
+			if (l->width != lane_width || l->depth != depth) {
+				err = "Memories under \"" + prefix + "\" do not have the same shape";
+				return false;
+			}
+		}
+		if (lane_width * lanes.size() != 32) {
+			err = "Memories under \"" + prefix + "\" are not the lanes of a 32-bit word";
+			return false;
+		}
+		return true;
+	}
+
+	uint32_t size_bytes() const {
+		return 4 * depth;
+	}
+
+	// Write `size` bytes of `data` from the start of the SRAM
+	void write(const uint8_t *data, uint32_t size) {
+		uint32_t mask = lane_width == 32 ? ~0u : (1u << lane_width) - 1;
+		for (uint32_t addr = 0; addr < size && addr < size_bytes(); addr += 4) {
+			uint32_t word = 0;
+			for (uint32_t i = 0; i < 4 && addr + i < size; ++i)
+				word |= (uint32_t)data[addr + i] << 8 * i;
+			uint32_t row = addr / 4;
+			for (size_t l = 0; l < lanes.size(); ++l) {
+				const cxxrtl::debug_item &item = *lanes[l];
+				if (row < item.zero_at || row - item.zero_at >= item.depth)
+					continue;
+				item.curr[row - item.zero_at] = word >> (l * lane_width) & mask;
+			}
+		}
+	}
+};
+
+// -----------------------------------------------------------------------------
+// UART terminal
+
+// Receives from the SoC's uart_tx onto stdout, and sends stdin (with
+// --stdin) to its uart_rx, 8n1. The bit period is in system clock cycles.
+// Unless given, it is learned as the shortest pulse seen on uart_tx, which is
+// one bit period in the first character with an isolated 0 or 1 bit
+// (nearly every printable one).
+//
+// Output is batched, and only written out at the end of a line, once
+// `flush_interval` cycles have passed since the oldest character waiting,
+// or at exit, so a chatty program spends little time in the terminal.
+struct uart_terminal {
+	int64_t period;
+	int64_t flush_interval;
+	bool stdin_en;
+
+	// TX decode: the edges of the frame in progress, from its start bit
+	bool tx_last;
+	int64_t tx_last_edge;
+	bool in_frame;
+	std::vector<int64_t> frame_edges;
+	uint64_t framing_errors;
+
+	std::string out;
+	int64_t out_since;
+
+	// RX drive: the frame being sent, LSB first, and its current bit
+	std::string rx_queue;
+	size_t rx_queue_pos;
+	uint32_t rx_frame;
+	int rx_bit;
+	int64_t rx_next;
+	bool stdin_open;
+
+	static const int64_t STDIN_POLL_INTERVAL = 1 << 14;
+
+	uart_terminal(): period(0), flush_interval(1000000), stdin_en(false), tx_last(true), tx_last_edge(-1),
+		in_frame(false), framing_errors(0), out_since(0), rx_queue_pos(0), rx_frame(0), rx_bit(-1), rx_next(0),
+		stdin_open(true) {}
+
+	// Call once per cycle with the value of uart_tx
+	void tx(int64_t cycle, bool level) {
+		if (level != tx_last) {
+			// Runs are only measured inside frames, not from reset
+			if (in_frame && (period == 0 || cycle - tx_last_edge < period))
+				period = cycle - tx_last_edge;
+			if (!level && in_frame && period > 0 && 2 * (cycle - frame_edges[0]) >= 19 * period)
+				finish_frame();
+			if (!level && !in_frame) {
+				in_frame = true;
+				frame_edges.clear();
+			}
+			if (in_frame)
+				frame_edges.push_back(cycle);
+			tx_last = level;
+			tx_last_edge = cycle;
+		} else if (in_frame && period > 0 && cycle - frame_edges[0] >= 10 * period) {
+			finish_frame();
+		}
+		if (!out.empty() && cycle - out_since >= flush_interval)
+			flush();
+	}
+
+	// The value of uart_rx for this cycle
+	bool rx(int64_t cycle) {
+		if (stdin_en && stdin_open && rx_queue_pos >= rx_queue.size() && cycle % STDIN_POLL_INTERVAL == 0)
+			poll_stdin();
+		if (rx_bit < 0 && rx_queue_pos < rx_queue.size() && period > 0) {
+			rx_frame = (uint32_t)(uint8_t)rx_queue[rx_queue_pos++] << 1 | 1u << 9;
+			rx_bit = 0;
+			rx_next = cycle + period;
+		}
+		if (rx_bit >= 0 && cycle >= rx_next) {
+			rx_next += period;
+			if (++rx_bit == 10)
+				rx_bit = -1;
+		}
+		return rx_bit < 0 || (rx_frame >> rx_bit & 1u);
+	}
+
+	void flush() {
+		if (!out.empty()) {
+			fwrite(out.data(), 1, out.size(), stdout);
+			fflush(stdout);
+			out.clear();
+		}
+	}
+
+private:
+	// Level at `t` within the frame: low from the start bit, then toggling
+	// at each later edge
+	bool frame_level(int64_t t) const {
+		size_t n = std::upper_bound(frame_edges.begin(), frame_edges.end(), t) - frame_edges.begin();
+		return n > 0 && (n - 1) % 2 == 1;
+	}
+
+	void finish_frame() {
+		int64_t start = frame_edges[0];
+		uint8_t c = 0;
+		for (int i = 0; i < 8; ++i)
+			c |= frame_level(start + (2 * i + 3) * period / 2) << i;
+		in_frame = false;
+		if (!frame_level(start + 19 * period / 2)) {
+			++framing_errors;
+			return;
+		}
+		if (out.empty())
+			out_since = frame_edges.back();
+		out.push_back((char)c);
+		if (c == '\n')
+			flush();
+	}
+
+	void poll_stdin() {
+		struct pollfd p = {STDIN_FILENO, POLLIN, 0};
+		if (poll(&p, 1, 0) <= 0 || !(p.revents & (POLLIN | POLLHUP)))
+			return;
+		char buf[256];
+		ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+		if (n <= 0) {
+			stdin_open = false;
+			return;
+		}
+		rx_queue.assign(buf, n);
+		rx_queue_pos = 0;
+	}
+};
+
+// -----------------------------------------------------------------------------
+
+struct soc_jtag_pins {
+	cxxrtl_design::p_example__soc &top;
+
+	void set_trst_n(bool x) {
+		top.p_trst__n.set<bool>(x);
+	}
+
+	void set(bool tck, bool tms, bool tdi) {
+		top.p_tck.set<bool>(tck);
+		top.p_tms.set<bool>(tms);
+		top.p_tdi.set<bool>(tdi);
+	}
+
+	bool tdo() {
+		return top.p_tdo.get<bool>();
+	}
+};
+
+const char *help_str =
+"Usage: soc_tb [--bin x.bin | --elf x.elf] [--port n] [--cycles n] [--vcd x.vcd] \\\n"
+"          [--uart-period n] [--uart-flush n] [--stdin] [--mem-item x]\n"
+"\n"
+"    --bin x.bin      : Flat binary file loaded to the start of SRAM (0x0)\n"
+"    --elf x.elf      : ELF file loaded into SRAM. If the entry point is not the\n"
+"                       reset vector, a jump to it is placed at the reset vector.\n"
+"    --port n         : Port number to listen for OpenOCD remote bitbang. Sim\n"
+"                       runs in lockstep with JTAG bitbang, not free-running.\n"
+"    --cycles n       : Maximum number of cycles to run before exiting. Default\n"
+"                       is to run until OpenOCD quits, or the sim is interrupted.\n"
+"    --vcd x.vcd      : Dump waveforms (all signals, so slow) to x.vcd.\n"
+"    --uart-period n  : UART bit period in system clock cycles. By default it is\n"
+"                       learned from the shortest pulse on uart_tx.\n"
+"    --uart-flush n   : Write UART output waiting for the end of its line after n\n"
+"                       cycles (default 1000000).\n"
+"    --stdin          : Send stdin to the UART's rx pin, once the bit period is\n"
+"                       known. A terminal sends it a line at a time.\n"
+"    --mem-item x     : Preload the memories under this CXXRTL hierarchy prefix\n"
+"                       (default \"sram0 \").\n"
+;
+
+void exit_help(std::string errtext = "") {
+	std::cerr << errtext << help_str;
+	exit(-1);
+}
+
+int main(int argc, char **argv) {
+	bool load_bin = false;
+	std::string bin_path;
+	bool load_elf = false;
+	std::string elf_path;
+	bool dump_waves = false;
+	std::string waves_path;
+	int64_t max_cycles = -1;
+	uint16_t port = 0;
+	std::string mem_item = "sram0 ";
+	uart_terminal uart;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string s(argv[i]);
+		if (s.rfind("--", 0) != 0) {
+			std::cerr << "Unexpected positional argument " << s << "\n";
+			exit_help("");
+		}
+		else if (s == "--bin") {
+			if (argc - i < 2)
+				exit_help("Option --bin requires an argument\n");
+			load_bin = true;
+			bin_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--elf") {
+			if (argc - i < 2)
+				exit_help("Option --elf requires an argument\n");
+			load_elf = true;
+			elf_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--port") {
+			if (argc - i < 2)
+				exit_help("Option --port requires an argument\n");
+			port = std::stol(argv[i + 1], 0, 0);
+			i += 1;
+		}
+		else if (s == "--cycles") {
+			if (argc - i < 2)
+				exit_help("Option --cycles requires an argument\n");
+			max_cycles = std::stol(argv[i + 1], 0, 0);
+			i += 1;
+		}
+		else if (s == "--vcd") {
+			if (argc - i < 2)
+				exit_help("Option --vcd requires an argument\n");
+			dump_waves = true;
+			waves_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--uart-period") {
+			if (argc - i < 2)
+				exit_help("Option --uart-period requires an argument\n");
+			uart.period = std::stol(argv[i + 1], 0, 0);
+			if (uart.period < 1)
+				exit_help("Option --uart-period must be at least 1\n");
+			i += 1;
+		}
+		else if (s == "--uart-flush") {
+			if (argc - i < 2)
+				exit_help("Option --uart-flush requires an argument\n");
+			uart.flush_interval = std::stol(argv[i + 1], 0, 0);
+			i += 1;
+		}
+		else if (s == "--stdin") {
+			uart.stdin_en = true;
+		}
+		else if (s == "--mem-item") {
+			if (argc - i < 2)
+				exit_help("Option --mem-item requires an argument\n");
+			mem_item = argv[i + 1];
+			i += 1;
+		}
+		else {
+			std::cerr << "Unrecognised argument " << s << "\n";
+			exit_help("");
+		}
+	}
+	if (load_bin && load_elf)
+		exit_help("Options --bin and --elf are mutually exclusive\n");
+
+	cxxrtl_design::p_example__soc top;
+	cxxrtl::debug_items items;
+	top.debug_info(&items, /*scopes=*/nullptr, "");
+
+	sram_image sram;
+	std::string err;
+	if ((load_bin || load_elf) && !sram.find(items, mem_item, err)) {
+		std::cerr << err << "\n";
+		return -1;
+	}
+
+	// Images are loaded into a host buffer first, as ElfFile maps segments
+	// from the file, then written into the design's memory
+	if (load_bin || load_elf) {
+		uint32_t sram_size = sram.size_bytes();
+		uint8_t *mem = (uint8_t*)mmap(nullptr, sram_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED) {
+			std::cerr << "Failed to allocate " << sram_size << " bytes\n";
+			return -1;
+		}
+		uint32_t loaded_size = 0;
+		if (load_bin) {
+			int fd = open(bin_path.c_str(), O_RDONLY);
+			struct stat st;
+			if (fd < 0 || fstat(fd, &st) != 0) {
+				std::cerr << "Failed to open \"" << bin_path << "\"\n";
+				return -1;
+			}
+			if ((uint64_t)st.st_size > sram_size) {
+				std::cerr << "Binary file (" << st.st_size << " bytes) is larger than SRAM ("
+					<< sram_size << " bytes)\n";
+				return -1;
+			}
+			if (read(fd, mem, st.st_size) != st.st_size) {
+				std::cerr << "Failed to read \"" << bin_path << "\"\n";
+				return -1;
+			}
+			close(fd);
+			loaded_size = st.st_size;
+		}
+		if (load_elf) {
+			ElfFile elf;
+			if (!elf.open(elf_path, err) || !elf.load(mem, SRAM_BASE, sram_size, err)) {
+				std::cerr << err << "\n";
+				return -1;
+			}
+			for (auto &seg : elf.segments)
+				loaded_size = std::max(loaded_size, seg.addr - SRAM_BASE + seg.memsz);
+			if (elf.entry != RESET_VECTOR) {
+				// As in tb: jump from the reset vector to the entry point,
+				// clobbering t0, as long as nothing was loaded there
+				bool reset_vector_used = false;
+				for (auto &seg : elf.segments)
+					reset_vector_used = reset_vector_used ||
+						(seg.addr < RESET_VECTOR + 8 && seg.addr + seg.memsz > RESET_VECTOR);
+				if (reset_vector_used) {
+					std::cerr << "Warning: ignoring ELF entry point, as something is loaded at the reset vector\n";
+				} else {
+					uint32_t hi = (elf.entry + 0x800u) & 0xfffff000u;
+					uint32_t lo = elf.entry - hi;
+					uint32_t trampoline[2] = {
+						hi | (5u << 7) | 0x37u,      // lui t0, %hi(entry)
+						(lo << 20) | (5u << 15) | 0x67u // jalr zero, %lo(entry)(t0)
+					};
+					memcpy(mem + RESET_VECTOR - SRAM_BASE, trampoline, sizeof(trampoline));
+					loaded_size = std::max<uint32_t>(loaded_size, RESET_VECTOR - SRAM_BASE + sizeof(trampoline));
+				}
+			}
+		}
+		sram.write(mem, loaded_size);
+		munmap(mem, sram_size);
+	}
+
+	cxxrtl::vcd_writer vcd;
+	std::ofstream waves_fd;
+	if (dump_waves) {
+		waves_fd.open(waves_path);
+		if (!waves_fd.is_open()) {
+			std::cerr << "Failed to open \"" << waves_path << "\"\n";
+			return -1;
+		}
+		vcd.timescale(1, "us");
+		vcd.add_without_memories(items);
+	}
+
+	jtag_bitbang_server jtag;
+	soc_jtag_pins pins = {top};
+	if (port != 0)
+		jtag.start(port);
+
+	signal(SIGINT, handle_sigint);
+
+	// Reset + initial clock pulse
+	top.p_rst__n.set<bool>(false);
+	top.p_trst__n.set<bool>(false);
+	top.p_uart__rx.set<bool>(true);
+	top.step();
+	top.p_clk.set<bool>(true);
+	top.p_tck.set<bool>(true);
+	top.step();
+	top.p_clk.set<bool>(false);
+	top.p_tck.set<bool>(false);
+	top.p_trst__n.set<bool>(true);
+	top.p_rst__n.set<bool>(true);
+	top.step();
+	top.step(); // workaround for github.com/YosysHQ/yosys/issues/2780
+
+	auto t_start = std::chrono::steady_clock::now();
+	int64_t cycle;
+	for (cycle = 0; max_cycles < 0 || cycle < max_cycles; ++cycle) {
+		if (interrupted)
+			break;
+		// As in tb, with --port, each JTAG pin write takes one cycle
+		if (port != 0 && !jtag.cycle(pins))
+			break;
+		top.p_uart__rx.set<bool>(uart.rx(cycle));
+
+		top.p_clk.set<bool>(false);
+		top.step();
+		if (dump_waves)
+			vcd.sample(cycle * 2);
+		top.p_clk.set<bool>(true);
+		top.step();
+		top.step(); // workaround for github.com/YosysHQ/yosys/issues/2780
+		if (dump_waves) {
+			vcd.sample(cycle * 2 + 1);
+			if (vcd.buffer.size() >= WAVES_PUSH_THRESHOLD) {
+				waves_fd << vcd.buffer;
+				vcd.buffer.clear();
+			}
+		}
+
+		uart.tx(cycle, top.p_uart__tx.get<bool>());
+	}
+	uart.flush();
+
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+	fprintf(stderr, "Ran %" PRId64 " cycles in %.2f s (%.1f kHz)", cycle, secs, secs > 0 ? cycle / secs / 1e3 : 0.0);
+	if (uart.period > 0)
+		fprintf(stderr, ", UART bit period %" PRId64 " cycles", uart.period);
+	if (uart.framing_errors)
+		fprintf(stderr, ", %" PRIu64 " UART framing errors", uart.framing_errors);
+	fprintf(stderr, "\n");
+
+	if (dump_waves) {
+		waves_fd << vcd.buffer;
+		vcd.buffer.clear();
+	}
+	return 0;
+}
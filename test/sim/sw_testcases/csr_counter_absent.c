@@ -0,0 +1,61 @@
+#include "tb_cxxrtl_io.h"
+#include "hazard3_csr.h"
+
+// With CSR_COUNTER = 0, the counters, mcountinhibit and the HPM CSRs do not
+// exist, so all accesses to them are illegal. Run with ./runtests --config min
+
+/*TB-CONFIG: min*/
+
+/*EXPECTED-OUTPUT***************************************************************
+
+csrr a0, mcycle
+Exception, mcause = 2
+32-bit illegal instruction: b0002573
+csrr a0, mcycleh
+Exception, mcause = 2
+32-bit illegal instruction: b8002573
+csrr a0, minstret
+Exception, mcause = 2
+32-bit illegal instruction: b0202573
+csrr a0, minstreth
+Exception, mcause = 2
+32-bit illegal instruction: b8202573
+csrw mcycle, zero
+Exception, mcause = 2
+32-bit illegal instruction: b0001073
+csrr a0, mcountinhibit
+Exception, mcause = 2
+32-bit illegal instruction: 32002573
+csrr a0, mhpmcounter3
+Exception, mcause = 2
+32-bit illegal instruction: b0302573
+csrr a0, mhpmevent3
+Exception, mcause = 2
+32-bit illegal instruction: 32302573
+
+*******************************************************************************/
+
+#define test_absent(instr) do { \
+	tb_puts(instr "\n"); \
+	asm volatile (instr : : : "a0"); \
+} while (0)
+
+int main() {
+	test_absent("csrr a0, mcycle");
+	test_absent("csrr a0, mcycleh");
+	test_absent("csrr a0, minstret");
+	test_absent("csrr a0, minstreth");
+	test_absent("csrw mcycle, zero");
+	test_absent("csrr a0, mcountinhibit");
+	test_absent("csrr a0, mhpmcounter3");
+	test_absent("csrr a0, mhpmevent3");
+	return 0;
+}
+
+void __attribute__((interrupt)) handle_exception() {
+	uintptr_t mepc = read_csr(mepc);
+	uint32_t mcause = read_csr(mcause);
+	tb_printf("Exception, mcause = %u\n", mcause);
+	tb_printf("32-bit illegal instruction: %08x\n", *(uint32_t*)mepc);
+	write_csr(mepc, mepc + 4);
+}
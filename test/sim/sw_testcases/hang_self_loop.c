@@ -0,0 +1,20 @@
+#include "tb_cxxrtl_io.h"
+
+// Spin on a jump to itself, with interrupts disabled as they are out of
+// reset. Nothing can move the hart on, so the simulator must report a hang at
+// the jump straight away, rather than spin until --cycles. rvcpp once ran a
+// whole block of the loop (up to 2^20 cycles) before checking.
+
+// The last line of output is the pc the hang should be reported at.
+/*EXPECTED-HANG*/
+
+extern char spin[];
+
+int main() {
+	tb_printf("%08x\n", (uint32_t)spin);
+	asm volatile (
+		".global spin\n"
+		"spin: j spin\n"
+	);
+	return 0;
+}
@@ -0,0 +1,146 @@
+#ifndef _UBENCH_H
+#define _UBENCH_H
+
+// Cycle-accurate microbenchmarks. UBENCH() times UBENCH_REPS unrolled copies
+// of an instruction sequence with mcycle and minstret, subtracts the cost of
+// the counter reads, and checks the cycle count against a budget: the total
+// expected for all UBENCH_REPS copies, on the default tb_cxxrtl config with
+// zero-wait-state memory (see doc/sections/instruction_timings.adoc). Each
+// benchmark prints "name: ok", or its counts if it missed the budget, so a
+// suite of them can check its EXPECTED-OUTPUT against RTL timing changes.
+//
+// Under rvcpp, mcycle counts instructions, so budgets are only met there by
+// sequences of single-cycle instructions. Build with -DUBENCH_ROI to run
+// each benchmark in its own region of interest (numbered from 1, in order),
+// and compare the per-region cycles of tb_cxxrtl and rvcpp --timing: this is
+// what ../common/ubench_calibrate.py does. -DUBENCH_VERBOSE prints every
+// benchmark's counts, met or not.
+//
+// Sequences are assembled without compressed instructions, so branch targets
+// are word-aligned. They can write any register in their clobber list but sp
+// (which must be restored by the end of each copy), gp and tp. t0 points to
+// ubench_data, which setup code can fill.
+
+#include "tb_cxxrtl_io.h"
+#include "hazard3_csr.h"
+
+#ifndef UBENCH_REPS
+#define UBENCH_REPS 16
+#endif
+
+#define UBENCH_STR(x) #x
+#define UBENCH_XSTR(x) UBENCH_STR(x)
+
+static uint32_t __attribute__((used, aligned(16))) ubench_data[16];
+
+static uint32_t ubench_overhead_cycles;
+static uint32_t ubench_overhead_instrs;
+static uint32_t ubench_region;
+static int ubench_failures;
+
+// Time `body` (assembly text, repeated UBENCH_REPS times), after `setup`.
+// The trailing arguments are the clobber list, which must name every
+// register the setup and body write. Counts are without the counter reads.
+#define UBENCH_TIME(cycles, instrs, setup, body, ...) do { \
+	uint32_t _c0, _c1, _i0, _i1; \
+	ubench_roi_begin(); \
+	asm volatile ( \
+		".option push\n" \
+		".option norvc\n" \
+		"la t0, ubench_data\n" \
+		setup "\n" \
+		".p2align 2\n" \
+		"csrr %1, minstret\n" \
+		"csrr %0, mcycle\n" \
+		".rept " UBENCH_XSTR(UBENCH_REPS) "\n" \
+		body "\n" \
+		".endr\n" \
+		"csrr %2, mcycle\n" \
+		"csrr %3, minstret\n" \
+		".option pop\n" \
+		: "=&r" (_c0), "=&r" (_i0), "=&r" (_c1), "=&r" (_i1) \
+		: \
+		: "t0", "memory", ##__VA_ARGS__ \
+	); \
+	ubench_roi_end(); \
+	(cycles) = _c1 - _c0 - ubench_overhead_cycles; \
+	(instrs) = _i1 - _i0 - ubench_overhead_instrs; \
+} while (0)
+
+// As UBENCH_TIME, then check the total cycles against `budget`
+#define UBENCH(name, budget, setup, body, ...) do { \
+	uint32_t _cycles, _instrs; \
+	UBENCH_TIME(_cycles, _instrs, setup, body, ##__VA_ARGS__); \
+	ubench_report(name, _cycles, _instrs, budget); \
+} while (0)
+
+static inline void ubench_roi_begin() {
+	++ubench_region;
+#ifdef UBENCH_ROI
+	tb_roi_begin(ubench_region);
+#endif
+}
+
+static inline void ubench_roi_end() {
+#ifdef UBENCH_ROI
+	tb_roi_end();
+#endif
+}
+
+static void ubench_report(const char *name, uint32_t cycles, uint32_t instrs, uint32_t budget) {
+	bool ok = cycles == budget;
+	if (!ok)
+		++ubench_failures;
+#ifndef UBENCH_VERBOSE
+	if (ok) {
+		tb_printf("%s: ok\n", name);
+		return;
+	}
+#endif
+	tb_printf("%s: %lu cycles (budget %lu), %lu instructions, %lu.%02lu cycles/rep%s\n", name,
+		(unsigned long)cycles, (unsigned long)budget, (unsigned long)instrs,
+		(unsigned long)(cycles / UBENCH_REPS), (unsigned long)(cycles % UBENCH_REPS * 100 / UBENCH_REPS),
+		ok ? "" : " FAILED");
+}
+
+// Measure the counter reads on their own, as region 1. Call before any
+// other benchmark.
+static void ubench_init() {
+	uint32_t cycles, instrs;
+	ubench_overhead_cycles = 0;
+	ubench_overhead_instrs = 0;
+	UBENCH_TIME(cycles, instrs, "", "");
+	ubench_overhead_cycles = cycles;
+	ubench_overhead_instrs = instrs;
+}
+
+// Returns 0 if every benchmark met its budget, for main()
+static int ubench_finish() {
+	return ubench_failures;
+}
+
+// Trap handler for timing trap entry and exit: returns past the trapping
+// instruction, which must be 32-bit. Install with ubench_trap_begin().
+static void __attribute__((naked, aligned(4))) ubench_trap_handler() {
+	asm volatile (
+		".option push\n"
+		".option norvc\n"
+		"csrr t6, mepc\n"
+		"addi t6, t6, 4\n"
+		"csrw mepc, t6\n"
+		"mret\n"
+		".option pop\n"
+	);
+}
+
+// Direct-mode mtvec to ubench_trap_handler. Returns the old mtvec, for
+// ubench_trap_end().
+static inline uint32_t ubench_trap_begin() {
+	return read_write_csr(mtvec, (uint32_t)(uintptr_t)&ubench_trap_handler);
+}
+
+static inline void ubench_trap_end(uint32_t old) {
+	write_csr(mtvec, old);
+}
+
+#endif
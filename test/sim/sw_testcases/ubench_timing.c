@@ -0,0 +1,65 @@
+#include "tb_cxxrtl_io.h"
+#include "ubench.h"
+
+// Cycle budgets for the default config, from the instruction timings in the
+// documentation (and rvcpp's timing model, for mret). Each benchmark is 16
+// copies of its sequence, so e.g. a 3-cycle sequence has a budget of 48.
+
+/*EXPECTED-OUTPUT***************************************************************
+
+alu: ok
+load_independent: ok
+load_use: ok
+load_store_data: ok
+load_addr_chain: ok  // Each load's address is the one before's data
+branch_not_taken: ok
+branch_taken: ok
+branch_predicted: ok // Loop of 4: mispredicted on entry and exit
+jal: ok
+mul_chain: ok
+mulh: ok
+divu: ok
+div_sign_fixup: ok
+amo: ok
+csr: ok
+zcmp_push_pop: ok
+trap: ok
+
+*******************************************************************************/
+
+int main() {
+	ubench_init();
+
+	UBENCH("alu", 16, "", "add t1, t2, t3", "t1");
+	UBENCH("load_independent", 32, "", "lw t1, 0(t0)\n add t2, t3, t3", "t1", "t2");
+	UBENCH("load_use", 48, "", "lw t1, 0(t0)\n add t2, t1, t1", "t1", "t2");
+	UBENCH("load_store_data", 32, "", "lw t1, 0(t0)\n sw t1, 4(t0)", "t1");
+	// 16 loads, 15 of them stalled on the one before
+	UBENCH("load_addr_chain", 31, "sw t0, 0(t0)", "lw t0, 0(t0)");
+
+	UBENCH("branch_not_taken", 16, "", "bne zero, zero, .+8", "t1");
+	UBENCH("branch_taken", 32, "", "beq zero, zero, .+8\n nop");
+	// Per copy: li, 4 addi, then the branch is taken unpredicted (2), taken
+	// predicted (1, 1), and mispredicted when the loop exits (2)
+	UBENCH("branch_predicted", 176, "", "li t1, 4\n 1: addi t1, t1, -1\n bnez t1, 1b", "t1");
+	UBENCH("jal", 32, "", "jal zero, .+4");
+
+	UBENCH("mul_chain", 16, "li t1, 3\n li t2, 5", "mul t1, t1, t2", "t1", "t2");
+	UBENCH("mulh", 16, "li t2, -3\n li t3, 5", "mulh t1, t2, t3", "t1", "t2", "t3");
+	UBENCH("divu", 16 * 18, "li t2, 1000\n li t3, 7", "divu t1, t2, t3", "t1", "t2", "t3");
+	UBENCH("div_sign_fixup", 16 * 19, "li t2, -1000\n li t3, 7", "div t1, t2, t3", "t1", "t2", "t3");
+
+	// Separated by an ALU op, as back-to-back exclusives are not pipelined
+	UBENCH("amo", 16 * 5, "li t2, 1", "amoadd.w t1, t2, (t0)\n addi t3, t3, 1", "t1", "t2", "t3");
+	UBENCH("csr", 32, "", "csrr t1, mscratch\n csrw mscratch, t2", "t1");
+
+	// cm.push {ra, s0-s1}, -16 and cm.pop {ra, s0-s1}, 16: 1 + 3 cycles each
+	UBENCH("zcmp_push_pop", 16 * 8, "", ".hword 0xb862\n .hword 0xba62", "ra", "s0", "s1");
+
+	// ecall to mtvec (3), then the handler's 3 instructions and mret (2)
+	uint32_t mtvec = ubench_trap_begin();
+	UBENCH("trap", 16 * 8, "", "ecall", "t6");
+	ubench_trap_end(mtvec);
+
+	return ubench_finish();
+}
@@ -0,0 +1,69 @@
+#include "tb_cxxrtl_io.h"
+#include "hazard3_csr.h"
+
+// Zcmp push/pop with a reserved rlist (0 to 3) is illegal on Hazard3, and
+// must not touch memory or sp. rvcpp once took these as saving no
+// registers, and crashed on them with --block-cache.
+
+/*EXPECTED-OUTPUT***************************************************************
+
+cm.push rlist=0
+Exception, mcause = 2
+16-bit illegal instruction: b802
+cm.push rlist=3
+Exception, mcause = 2
+16-bit illegal instruction: b83e
+cm.pop rlist=1
+Exception, mcause = 2
+16-bit illegal instruction: ba12
+cm.popretz rlist=2
+Exception, mcause = 2
+16-bit illegal instruction: bc22
+cm.popret rlist=3
+Exception, mcause = 2
+16-bit illegal instruction: be32
+
+*******************************************************************************/
+
+#define test_reserved(instr_bits, instr_name) do { \
+	uint32_t sp_before, sp_after; \
+	tb_puts(instr_name "\n"); \
+	asm volatile ( \
+		"mv %0, sp\n" \
+		".hword " #instr_bits "\n" \
+		"mv %1, sp\n" \
+		: "=r" (sp_before), "=r" (sp_after) \
+	); \
+	if (sp_before != sp_after) { \
+		tb_printf("sp changed: %08x -> %08x\n", sp_before, sp_after); \
+		failed = true; \
+	} \
+} while (0)
+
+int main() {
+	bool failed = false;
+	test_reserved(0xb802, "cm.push rlist=0");
+	test_reserved(0xb83e, "cm.push rlist=3");
+	test_reserved(0xba12, "cm.pop rlist=1");
+	test_reserved(0xbc22, "cm.popretz rlist=2");
+	test_reserved(0xbe32, "cm.popret rlist=3");
+	return failed;
+}
+
+void __attribute__((interrupt)) handle_exception() {
+	uintptr_t mepc = read_csr(mepc);
+	uint32_t mcause = read_csr(mcause);
+	tb_printf("Exception, mcause = %u\n", mcause);
+
+	uint16_t i0 = *(uint16_t*)mepc;
+	if ((i0 & 0x3u) == 0x3u) {
+		uint16_t i1 = *(uint16_t*)(mepc + 2);
+		tb_printf("32-bit illegal instruction: %04x%04x\n", i1, i0);
+		mepc += 4;
+	}
+	else {
+		tb_printf("16-bit illegal instruction: %04x\n", i0);
+		mepc += 2;
+	}
+	write_csr(mepc, mepc);
+}
@@ -0,0 +1,233 @@
+// Plays back a tb --ahb-trace through the latency model, without the design,
+// to compare --waitstates, --contention and --traffic settings for the same
+// transfers.
+//
+// Each port issues its recorded transfers in order. A transfer's address
+// phase is issued as many cycles after the previous transfer on its port
+// completed as it was in the trace (the time the core spent between them),
+// so a port stalled by a slower memory issues later, as the core would. The
+// per-cycle handling of ports is the same as tb's, and idle and stalled
+// stretches are skipped over.
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tb_bus.h"
+
+static const char *help_str =
+"Usage: ahb_replay trace [--waitstates ports start end nonseq seq] [--contention]\n"
+"          [--traffic start end bw burst pattern prio] [--xip start end flash fill] [--icache ways sets line]\n"
+"    trace            : File written by tb --ahb-trace\n"
+"    --waitstates ports start end nonseq seq\n"
+"    --contention\n"
+"    --traffic start end bw burst pattern prio\n"
+"    --xip start end flash fill\n"
+"    --icache ways sets line\n"
+"                     : As for tb, in place of those the trace was recorded with\n"
+;
+
+static void exit_help(const std::string &errtext = "") {
+	std::cerr << errtext << help_str;
+	exit(-1);
+}
+
+struct replay_port {
+	// Indices of this port's records, in order
+	std::vector<size_t> records;
+	size_t next;
+	// Cycle on which the next record's address phase is issued
+	int64_t issue_cycle;
+	bool req_vld;
+	int64_t req_cycle;
+	port_timing timing;
+
+	uint64_t waits;
+	uint64_t latency;
+	uint64_t recorded_waits;
+	uint64_t n_reads;
+	uint64_t n_writes;
+	uint64_t n_fetches;
+
+	replay_port(): next(0), issue_cycle(0), req_vld(false), req_cycle(0), waits(0), latency(0),
+		recorded_waits(0), n_reads(0), n_writes(0), n_fetches(0) {}
+
+	bool pending() const {
+		return next < records.size();
+	}
+};
+
+int main(int argc, char **argv) {
+	if (argc < 2 || argv[1][0] == '-')
+		exit_help();
+	std::string trace_path = argv[1];
+	latency_model latency;
+	traffic_model traffic;
+	XipCacheConfig xip_cfg;
+	for (int i = 2; i < argc; ++i) {
+		std::string s(argv[i]);
+		if (s == "--waitstates") {
+			if (argc - i < 6)
+				exit_help("Option --waitstates requires 5 arguments\n");
+			wait_region r;
+			if (const char *err = parse_wait_region(argv + i + 1, r))
+				exit_help(err);
+			latency.regions.push_back(r);
+			i += 5;
+		}
+		else if (s == "--contention") {
+			latency.contention = true;
+		}
+		else if (s == "--traffic") {
+			if (argc - i < 7)
+				exit_help("Option --traffic requires 6 arguments\n");
+			traffic_gen g;
+			if (const char *err = parse_traffic(argv + i + 1, g))
+				exit_help(err);
+			traffic.gens.push_back(g);
+			i += 6;
+		}
+		else if (s == "--xip") {
+			if (argc - i < 5)
+				exit_help("Option --xip requires 4 arguments\n");
+			if (const char *err = parse_xip(argv + i + 1, xip_cfg))
+				exit_help(err);
+			i += 4;
+		}
+		else if (s == "--icache") {
+			if (argc - i < 4)
+				exit_help("Option --icache requires 3 arguments\n");
+			if (const char *err = parse_icache(argv + i + 1, xip_cfg))
+				exit_help(err);
+			i += 3;
+		}
+		else {
+			exit_help("Unrecognised argument " + s + "\n");
+		}
+	}
+
+	std::vector<ahb_record> records;
+	if (!ahb_trace_load(trace_path, records)) {
+		std::cerr << "Failed to read \"" << trace_path << "\" (not an --ahb-trace file?)\n";
+		return -1;
+	}
+	if (records.empty()) {
+		std::cerr << "Trace is empty\n";
+		return -1;
+	}
+
+	int n_ports = 0;
+	replay_port ports[MAX_BUS_PORTS];
+	int64_t recorded_start = records[0].cycle;
+	int64_t recorded_end = 0;
+	for (size_t i = 0; i < records.size(); ++i) {
+		const ahb_record &r = records[i];
+		if (r.port >= MAX_BUS_PORTS) {
+			std::cerr << "Bad port number in trace\n";
+			return -1;
+		}
+		n_ports = std::max(n_ports, r.port + 1);
+		ports[r.port].records.push_back(i);
+		recorded_start = std::min(recorded_start, (int64_t)r.cycle);
+		recorded_end = std::max(recorded_end, (int64_t)(r.cycle + 1 + r.waits));
+	}
+	for (int p = 0; p < n_ports; ++p) {
+		if (ports[p].pending())
+			ports[p].issue_cycle = records[ports[p].records[0]].cycle;
+	}
+	std::vector<std::unique_ptr<XipCache>> icaches(n_ports);
+	if (xip_cfg.enabled) {
+		for (auto &c : icaches)
+			c.reset(new XipCache(xip_cfg));
+	}
+
+	auto t_start = std::chrono::steady_clock::now();
+	int64_t cycle = recorded_start;
+	int64_t end = cycle;
+	while (true) {
+		// Skip to the next cycle on which anything but a wait state happens
+		int64_t skip = INT64_MAX;
+		for (int p = 0; p < n_ports; ++p) {
+			const replay_port &ps = ports[p];
+			if (ps.req_vld)
+				skip = std::min(skip, (int64_t)ps.timing.stall);
+			else if (ps.pending())
+				skip = std::min(skip, ps.issue_cycle - cycle);
+		}
+		if (skip == INT64_MAX)
+			break;
+		if (skip > 0) {
+			cycle += skip;
+			traffic.skip(skip, latency);
+			for (int p = 0; p < n_ports; ++p) {
+				if (ports[p].req_vld)
+					ports[p].timing.stall -= skip;
+			}
+		}
+
+		bool new_access[MAX_BUS_PORTS];
+		for (int p = n_ports - 1; p >= 0; --p) {
+			replay_port &ps = ports[p];
+			new_access[p] = false;
+			if (ps.req_vld && ps.timing.stall > 0) {
+				--ps.timing.stall;
+				continue;
+			}
+			if (ps.req_vld) {
+				// Data phase completes
+				const ahb_record &r = records[ps.records[ps.next]];
+				ps.waits += cycle - ps.req_cycle - 1;
+				ps.latency += cycle - ps.req_cycle;
+				ps.recorded_waits += r.waits;
+				++(r.flags & ahb_record::AHB_WRITE ? ps.n_writes : r.flags & ahb_record::AHB_FETCH ? ps.n_fetches : ps.n_reads);
+				ps.req_vld = false;
+				end = cycle;
+				if (++ps.next < ps.records.size()) {
+					const ahb_record &n = records[ps.records[ps.next]];
+					int64_t gap = (int64_t)n.cycle - (int64_t)(r.cycle + 1 + r.waits);
+					ps.issue_cycle = cycle + std::max(gap, (int64_t)0);
+				}
+			}
+			if (ps.pending() && ps.issue_cycle == cycle) {
+				const ahb_record &r = records[ps.records[ps.next]];
+				ps.req_vld = true;
+				ps.req_cycle = cycle;
+				start_access(latency, ps.timing, p, r.addr, r.size(), r.flags & ahb_record::AHB_SEQ,
+					r.flags & ahb_record::AHB_FETCH ? icaches[p].get() : nullptr);
+				ps.timing.stall += traffic.claim(r.addr, ps.timing.stall);
+				new_access[p] = true;
+			}
+		}
+		if (latency.contention)
+			apply_contention(ports, n_ports, new_access);
+		traffic.step(latency);
+		++cycle;
+	}
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+
+	printf("Replayed %zu transfers: %" PRId64 " cycles (recorded %" PRId64 "), in %.3f s (%.2f M transfers/s)\n",
+		records.size(), end - recorded_start, recorded_end - recorded_start, secs,
+		secs > 0 ? records.size() / secs * 1e-6 : 0.0);
+	printf("  %4s %12s %12s %12s %14s %14s %12s\n", "port", "reads", "writes", "fetches",
+		"wait states", "recorded", "latency");
+	for (int p = 0; p < n_ports; ++p) {
+		const replay_port &ps = ports[p];
+		uint64_t n = ps.records.size();
+		if (n == 0)
+			continue;
+		printf("  %4d %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %14" PRIu64 " %14" PRIu64 " %12.3f\n",
+			p, ps.n_reads, ps.n_writes, ps.n_fetches, ps.waits, ps.recorded_waits, (double)ps.latency / n);
+	}
+	traffic.print(stdout, end - recorded_start);
+	for (int p = 0; p < n_ports; ++p) {
+		// D ports don't fetch
+		if (icaches[p] && icaches[p]->hits + icaches[p]->misses)
+			icaches[p]->print(stdout, ("Port " + std::to_string(p)).c_str());
+	}
+	return 0;
+}
@@ -0,0 +1,186 @@
+// Rebuilds the PC stream of a tb --btrace branch trace, from the trace and
+// the ELF of the program it ran. Instructions between discontinuities are
+// followed through the ELF's loaded segments, so the program must not have
+// changed its own code (or run code not in the ELF).
+//
+// Prints one line per retired instruction: its PC, then with --symbols the
+// function and offset, and a note on the instruction before each trap or
+// interrupt. A summary goes to stderr.
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+
+#include "../rvcpp/include/rv_elf.h"
+#include "tb_btrace.h"
+
+static const char *help_str =
+"Usage: btrace_decode trace elf [--symbols] [--count]\n"
+"    trace            : File written by tb --btrace\n"
+"    elf              : The program that tb ran\n"
+"    --symbols        : Print the function and offset of each PC\n"
+"    --count          : Only print the summary\n"
+;
+
+static void exit_help(const std::string &errtext = "") {
+	std::cerr << errtext << help_str;
+	exit(-1);
+}
+
+// The ELF's loaded segments, in one zero-filled buffer
+struct elf_image {
+	uint32_t base;
+	uint32_t size;
+	uint8_t *mem;
+
+	elf_image(): base(0), size(0), mem(nullptr) {}
+
+	~elf_image() {
+		if (mem)
+			munmap(mem, size);
+	}
+
+	bool load(ElfFile &elf, std::string &err) {
+		const uint32_t page = sysconf(_SC_PAGESIZE);
+		uint64_t lo = UINT32_MAX, hi = 0;
+		for (const ElfFile::Segment &s : elf.segments) {
+			lo = std::min<uint64_t>(lo, s.addr);
+			hi = std::max<uint64_t>(hi, (uint64_t)s.addr + s.memsz);
+		}
+		if (hi <= lo) {
+			err = "ELF has nothing to load";
+			return false;
+		}
+		base = lo / page * page;
+		size = (hi - base + page - 1) / page * page;
+		mem = (uint8_t*)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED) {
+			mem = nullptr;
+			err = "Failed to allocate memory";
+			return false;
+		}
+		return elf.load(mem, base, size, err);
+	}
+
+	bool fetch(uint32_t pc, uint32_t &instr) const {
+		if (pc < base || pc - base > size - 2)
+			return false;
+		instr = mem[pc - base] | mem[pc - base + 1] << 8;
+		if (btrace_instr_len(instr) == 4) {
+			if (pc - base > size - 4)
+				return false;
+			instr |= (uint32_t)(mem[pc - base + 2] | mem[pc - base + 3] << 8) << 16;
+		}
+		return true;
+	}
+};
+
+int main(int argc, char **argv) {
+	if (argc < 3 || argv[1][0] == '-' || argv[2][0] == '-')
+		exit_help();
+	bool symbols = false;
+	bool count_only = false;
+	for (int i = 3; i < argc; ++i) {
+		std::string s(argv[i]);
+		if (s == "--symbols")
+			symbols = true;
+		else if (s == "--count")
+			count_only = true;
+		else
+			exit_help("Unrecognised argument " + s + "\n");
+	}
+
+	btrace_reader trace;
+	if (!trace.open(argv[1])) {
+		std::cerr << "Failed to read \"" << argv[1] << "\" (not a --btrace file?)\n";
+		return -1;
+	}
+	ElfFile elf;
+	elf_image image;
+	std::string err;
+	if (!elf.open(argv[2], err) || !image.load(elf, err)) {
+		std::cerr << err << "\n";
+		return -1;
+	}
+
+	uint64_t instructions = 0;
+	uint64_t counts[BTRACE_END + 1] = {0};
+	auto emit = [&](uint32_t pc, const char *note) {
+		++instructions;
+		if (count_only)
+			return;
+		printf("%08x", pc);
+		uint32_t offset;
+		const char *func = symbols ? elf.function_at(pc, offset) : nullptr;
+		if (func)
+			printf(" %s+0x%x", func, offset);
+		if (note)
+			printf(" (%s)", note);
+		printf("\n");
+	};
+
+	uint64_t start;
+	if (!trace.varint(start)) {
+		std::cerr << "Trace is empty\n";
+		return -1;
+	}
+	uint32_t pc = start;
+	uint32_t last_pc = pc;
+	bool ended = false;
+	uint64_t header;
+	while (!ended && trace.varint(header)) {
+		btrace_kind kind = (btrace_kind)(header & 0x7u);
+		uint64_t n = header >> 3;
+		if (kind > BTRACE_END) {
+			std::cerr << "Bad packet at offset " << trace.pos << "\n";
+			return -1;
+		}
+		uint64_t z = 0;
+		if (kind != BTRACE_DIRECT && kind != BTRACE_END && !trace.varint(z))
+			break;
+		++counts[kind];
+		// Straight-line instructions, the last of which leads to the
+		// discontinuity
+		uint32_t instr = 0;
+		for (uint64_t i = 0; i < n; ++i) {
+			if (!image.fetch(pc, instr)) {
+				fprintf(stderr, "PC %08x is outside of the ELF, after %" PRIu64 " instructions\n", pc, instructions);
+				return -1;
+			}
+			const char *note = nullptr;
+			if (i + 1 == n && kind == BTRACE_EXCEPTION)
+				note = "trap";
+			else if (i + 1 == n && kind == BTRACE_INTERRUPT)
+				note = "interrupt taken";
+			emit(pc, note);
+			last_pc = pc;
+			if (i + 1 < n)
+				pc += btrace_instr_len(instr);
+		}
+		switch (kind) {
+		case BTRACE_DIRECT:
+			if (n == 0 || !btrace_direct_target(instr, pc, pc)) {
+				fprintf(stderr, "Trace does not match the ELF: no branch or jump at %08x\n", last_pc);
+				return -1;
+			}
+			break;
+		case BTRACE_END:
+			ended = true;
+			break;
+		default:
+			pc = btrace_unzigzag(z, last_pc);
+			break;
+		}
+	}
+	if (!ended)
+		std::cerr << "Warning: trace is incomplete (tb stopped before closing it?)\n";
+	fprintf(stderr, "%" PRIu64 " instructions from %08x: %" PRIu64 " direct, %" PRIu64 " indirect, %" PRIu64
+		" exceptions, %" PRIu64 " interrupts, in %zu bytes of trace\n", instructions, (uint32_t)start,
+		counts[BTRACE_DIRECT], counts[BTRACE_JUMP], counts[BTRACE_EXCEPTION], counts[BTRACE_INTERRUPT],
+		trace.data.size());
+	return 0;
+}
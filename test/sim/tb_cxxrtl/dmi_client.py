@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+
+import argparse
+import socket
+import struct
+import sys
+
+# Client for tb --dmi-port, which gives direct access to the Debug Module's
+# DMI bus without bit-banging JTAG. Memory is loaded and dumped through System
+# Bus Access, with a whole block of requests in flight at a time.
+
+DMCONTROL            = 0x10
+SBCS                 = 0x38
+SBADDRESS0           = 0x39
+SBDATA0              = 0x3c
+
+SBCS_SBBUSYERROR     = 1 << 22
+SBCS_SBBUSY          = 1 << 21
+SBCS_SBREADONADDR    = 1 << 20
+SBCS_SBACCESS_32     = 2 << 17
+SBCS_SBAUTOINCREMENT = 1 << 16
+SBCS_SBREADONDATA    = 1 << 15
+SBCS_SBERROR_MASK    = 7 << 12
+
+BLOCK_WORDS = 1024
+
+class DMI:
+	def __init__(self, host, port):
+		self.sock = socket.create_connection((host, port))
+		self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+		self.rxbuf = b""
+
+	def _transact(self, requests):
+		self.sock.sendall("".join(r + "\n" for r in requests).encode())
+		responses = []
+		while len(responses) < len(requests):
+			while b"\n" not in self.rxbuf:
+				data = self.sock.recv(65536)
+				if not data:
+					sys.exit("Connection closed by tb")
+				self.rxbuf += data
+			line, self.rxbuf = self.rxbuf.split(b"\n", 1)
+			line = line.decode().strip()
+			if line == "E":
+				sys.exit(f"DMI error response to \"{requests[len(responses)]}\"")
+			responses.append(line)
+		return responses
+
+	def read(self, addr):
+		return int(self._transact([f"r {addr:x}"])[0], 16)
+
+	def write(self, addr, data):
+		self._transact([f"w {addr:x} {data:x}"])
+
+	def check_sba(self):
+		sbcs = self.read(SBCS)
+		if sbcs & (SBCS_SBBUSYERROR | SBCS_SBERROR_MASK):
+			# Clear the (write-1-to-clear) error flags before giving up
+			self.write(SBCS, SBCS_SBBUSYERROR | SBCS_SBERROR_MASK)
+			sys.exit(f"System bus access failed, sbcs = {sbcs:08x}")
+
+	def activate(self):
+		self.write(DMCONTROL, 1)
+
+	def load(self, addr, data):
+		data += bytes(-len(data) % 4)
+		words = struct.unpack(f"<{len(data) // 4}I", data)
+		self.write(SBCS, SBCS_SBACCESS_32 | SBCS_SBAUTOINCREMENT)
+		self.write(SBADDRESS0, addr)
+		for i in range(0, len(words), BLOCK_WORDS):
+			# Each write waits for the previous bus access to finish
+			requests = []
+			for w in words[i:i + BLOCK_WORDS]:
+				requests.append(f"p {SBCS:x} {SBCS_SBBUSY:x}")
+				requests.append(f"w {SBDATA0:x} {w:x}")
+			self._transact(requests)
+		self.check_sba()
+
+	def dump(self, addr, n_bytes):
+		n_words = (n_bytes + 3) // 4
+		self.write(SBCS, SBCS_SBACCESS_32 | SBCS_SBAUTOINCREMENT | SBCS_SBREADONADDR | SBCS_SBREADONDATA)
+		self.write(SBADDRESS0, addr)
+		words = []
+		for i in range(0, n_words, BLOCK_WORDS):
+			requests = []
+			for j in range(min(BLOCK_WORDS, n_words - i)):
+				requests.append(f"p {SBCS:x} {SBCS_SBBUSY:x}")
+				requests.append(f"r {SBDATA0:x}")
+			words.extend(int(r, 16) for r in self._transact(requests)[1::2])
+		self.check_sba()
+		return struct.pack(f"<{len(words)}I", *words)[:n_bytes]
+
+def anyint(x):
+	return int(x, 0)
+
+def main():
+	parser = argparse.ArgumentParser()
+	parser.add_argument("--host", default="localhost")
+	parser.add_argument("--port", type=int, default=9825, help="Port passed to tb --dmi-port")
+	sub = parser.add_subparsers(dest="cmd", required=True)
+	p = sub.add_parser("read", help="Read a DM register")
+	p.add_argument("addr", type=anyint)
+	p = sub.add_parser("write", help="Write a DM register")
+	p.add_argument("addr", type=anyint)
+	p.add_argument("data", type=anyint)
+	p = sub.add_parser("load", help="Load a flat binary file into memory through SBA")
+	p.add_argument("file")
+	p.add_argument("addr", type=anyint, nargs="?", default=0)
+	p = sub.add_parser("dump", help="Dump memory to a file through SBA")
+	p.add_argument("addr", type=anyint)
+	p.add_argument("size", type=anyint)
+	p.add_argument("file")
+	args = parser.parse_args()
+
+	dmi = DMI(args.host, args.port)
+	if args.cmd == "read":
+		print(f"{dmi.read(args.addr):08x}")
+	elif args.cmd == "write":
+		dmi.write(args.addr, args.data)
+	elif args.cmd == "load":
+		dmi.activate()
+		dmi.load(args.addr, open(args.file, "rb").read())
+	elif args.cmd == "dump":
+		dmi.activate()
+		with open(args.file, "wb") as f:
+			f.write(dmi.dump(args.addr, args.size))
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,59 @@
+// ----------------------------------------------------------------------------
+// Retirement monitor for tb_cxxrtl --cosim, --profile and --irq-latency
+// ----------------------------------------------------------------------------
+// To be included into hazard3_core.v when HAZARD3_COSIM is defined. Reports
+// each instruction as it crosses the M/W pipe register, in the same way as
+// the RVFI monitor, through registers which the testbench reads as CXXRTL
+// debug items after each clock edge. The register writeback of the reported
+// instruction is in mw_rd/mw_result on the same cycle.
+//
+// Instructions executed in Debug Mode are not reported, as the testbench's
+// reference model does not run them.
+
+reg        cosim_m_valid;
+reg [31:0] cosim_m_pc;
+reg        cosim_irq_entered;
+
+(* keep *) reg        cosim_valid;
+(* keep *) reg [31:0] cosim_pc;
+(* keep *) reg        cosim_trap;
+// First instruction after an interrupt was taken
+(* keep *) reg        cosim_intr;
+// Cycle after an interrupt was taken, when mcause has its cause
+(* keep *) reg        cosim_irq_enter;
+
+always @ (posedge clk or negedge rst_n) begin
+	if (!rst_n) begin
+		cosim_m_valid <= 1'b0;
+		cosim_m_pc <= 32'h0;
+		cosim_irq_entered <= 1'b0;
+		cosim_valid <= 1'b0;
+		cosim_pc <= 32'h0;
+		cosim_trap <= 1'b0;
+		cosim_intr <= 1'b0;
+		cosim_irq_enter <= 1'b0;
+	end else begin
+		if (!x_stall) begin
+			// As for RVFI: X is squashed by any trap, and fetch faults are
+			// not instructions
+			cosim_m_valid <= |df_cir_use && !m_trap_enter_vld && !debug_mode && !(
+				d_except == EXCEPT_INSTR_FAULT ||
+				d_except == EXCEPT_INSTR_MISALIGN
+			);
+			cosim_m_pc <= d_pc;
+		end else if (!m_stall) begin
+			cosim_m_valid <= 1'b0;
+		end
+		cosim_valid <= cosim_m_valid && !m_stall;
+		cosim_intr <= cosim_irq_entered;
+		cosim_irq_enter <= m_trap_enter_vld && m_trap_enter_rdy && m_trap_is_irq && !m_trap_is_debug_entry;
+		if (!m_stall) begin
+			cosim_pc <= cosim_m_pc;
+			cosim_trap <= xm_except != EXCEPT_NONE && xm_except != EXCEPT_MRET;
+		end
+		if (m_trap_enter_vld && m_trap_enter_rdy && m_trap_is_irq && !m_trap_is_debug_entry)
+			cosim_irq_entered <= 1'b1;
+		else if (cosim_m_valid && !m_stall)
+			cosim_irq_entered <= 1'b0;
+	end
+end
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+
+import argparse
+import math
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+# Sampled simulation: estimate a program's cycle count on the RTL without
+# simulating all of it. rvcpp runs the whole program once to count its
+# instructions, then fast-forwards to evenly spaced points and saves an
+# architectural checkpoint at each (--save-arch). tb restores each checkpoint
+# into the RTL (--restore-arch), retires a warm-up window of instructions so
+# that the microarchitectural state is no longer cold, then measures the
+# cycles taken by a window of instructions. The total is extrapolated from
+# the mean CPI of the windows.
+#
+# rvcpp retires one instruction per cycle, apart from sleeping in WFI, so its
+# cycle count stands in for the instruction count.
+
+def run(cmd, check=True):
+	p = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, universal_newlines=True)
+	if check and p.returncode != 0:
+		sys.exit("Command failed: {}\n{}".format(" ".join(cmd), p.stdout))
+	return p.stdout
+
+def main():
+	parser = argparse.ArgumentParser()
+	prog = parser.add_mutually_exclusive_group(required=True)
+	prog.add_argument("--bin", help="Flat binary, loaded at address 0")
+	prog.add_argument("--elf")
+	parser.add_argument("--rvcpp", default=os.path.join(os.path.dirname(__file__), "../rvcpp/rvcpp"))
+	parser.add_argument("--tb", default=os.path.join(os.path.dirname(__file__), "tb"))
+	parser.add_argument("--config", default=os.path.join(os.path.dirname(__file__), "config_default.vh"),
+		help="Config header tb was built with, passed to rvcpp --config")
+	parser.add_argument("--cycles", type=int, help="Limit on the rvcpp run, for programs which don't exit")
+	parser.add_argument("--samples", type=int, default=10, help="Number of windows, default 10")
+	parser.add_argument("--warmup", type=int, default=10000, help="Warm-up instructions per window, default 10000")
+	parser.add_argument("--measure", type=int, default=10000, help="Measured instructions per window, default 10000")
+	parser.add_argument("--dir", help="Directory for checkpoints (default: a temporary directory)")
+	args = parser.parse_args()
+
+	load = ["--bin", args.bin] if args.bin else ["--elf", args.elf]
+	rvcpp = [args.rvcpp] + load + ["--config", args.config]
+
+	out = run(rvcpp + (["--cycles", str(args.cycles)] if args.cycles else []))
+	m = re.search(r"Ran for (\d+) cycles", out)
+	if m:
+		total = int(m.group(1))
+	elif args.cycles:
+		total = args.cycles
+	else:
+		sys.exit("rvcpp run did not exit:\n" + out)
+	window = args.warmup + args.measure
+	if total < window + 1:
+		sys.exit("Program is only {} instructions, shorter than one window".format(total))
+	print("rvcpp: {} instructions".format(total))
+
+	tmpdir = None
+	workdir = args.dir
+	if not workdir:
+		tmpdir = tempfile.TemporaryDirectory()
+		workdir = tmpdir.name
+	os.makedirs(workdir, exist_ok=True)
+
+	cpis = []
+	for k in range(args.samples):
+		if args.samples > 1:
+			start = (total - window) * k // (args.samples - 1)
+		else:
+			start = (total - window) // 2
+		start = max(1, start)
+		cp = os.path.join(workdir, "cp{}".format(k))
+		run(rvcpp + ["--cycles", str(start), "--save-arch", cp])
+		out = run([args.tb, "--restore-arch", cp, "--sample-warmup", str(args.warmup),
+			"--sample-measure", str(args.measure)], check=False)
+		m = re.search(r"Sample: measured \d+ instructions in (\d+) cycles, CPI ([0-9.]+)", out)
+		if not m:
+			print("Sample {} at {}: no measurement\n{}".format(k, start, out.rstrip()))
+			continue
+		cpi = int(m.group(1)) / args.measure
+		cpis.append(cpi)
+		print("Sample {} at {}: CPI {:.4f}".format(k, start, cpi))
+
+	if not cpis:
+		sys.exit("No samples were measured")
+	mean = sum(cpis) / len(cpis)
+	print("Mean CPI {:.4f} over {} samples".format(mean, len(cpis)))
+	if len(cpis) > 1:
+		sd = math.sqrt(sum((c - mean) ** 2 for c in cpis) / (len(cpis) - 1))
+		err = 1.96 * sd / math.sqrt(len(cpis))
+		print("Estimated {:.0f} cycles (95% interval {:.0f} to {:.0f})".format(
+			mean * total, (mean - err) * total, (mean + err) * total))
+	else:
+		print("Estimated {:.0f} cycles".format(mean * total))
+
+if __name__ == "__main__":
+	main()
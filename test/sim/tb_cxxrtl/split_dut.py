@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+
+import argparse
+import re
+import sys
+
+# Split a CXXRTL design implementation (write_cxxrtl -header) into several
+# translation units, so that the parts compile in parallel. Each definition in
+# the design namespace (eval(), commit(), debug_info() etc. for each module) is
+# assigned to the part with the least source so far. Anything that isn't an
+# out-of-line member definition is copied into every part. Everything outside
+# of the design namespace goes in the first part, except for the #includes,
+# which every part gets.
+
+def top_level_items(src):
+	# Yield (start, end) of each declaration or definition at brace depth 0.
+	# Skips over comments and literals, but not preprocessor lines (CXXRTL
+	# doesn't emit any braces in those).
+	depth = 0
+	start = 0
+	i = 0
+	n = len(src)
+	while i < n:
+		c = src[i]
+		if src.startswith("//", i):
+			i = src.find("\n", i)
+			i = n if i < 0 else i
+			continue
+		if src.startswith("/*", i):
+			i = src.find("*/", i + 2)
+			i = n if i < 0 else i + 2
+			continue
+		if c == '"' or c == "'":
+			i += 1
+			while i < n and src[i] != c:
+				i += 2 if src[i] == "\\" else 1
+		elif c == "{":
+			depth += 1
+		elif c == "}":
+			depth -= 1
+			# A definition ends with its closing brace, unless a semicolon
+			# follows (struct or initialiser)
+			if depth == 0 and not re.match(r"\s*;", src[i + 1:]):
+				yield start, i + 1
+				start = i + 1
+		elif c == ";" and depth == 0:
+			yield start, i + 1
+			start = i + 1
+		i += 1
+	if src[start:].strip():
+		yield start, n
+
+def split(src, nparts):
+	m_open = re.search(r"^namespace (\S+) \{\n", src, re.M)
+	m_close = m_open and re.search(r"^\} // namespace " + re.escape(m_open.group(1)) + r"\n", src[m_open.end():], re.M)
+	if not m_close:
+		# Not the layout we expect: don't split
+		return [src] + [""] * (nparts - 1)
+	body_start = m_open.end()
+	body_end = body_start + m_close.start()
+	head = src[:body_start]
+	tail = src[body_end:]
+	# The other parts get the unconditional #includes and using-declarations
+	# (not e.g. the C API implementation, which is in an #if block)
+	common = ""
+	if_depth = 0
+	for l in src[:m_open.start()].splitlines(True):
+		if re.match(r"#\s*if", l):
+			if_depth += 1
+		elif re.match(r"#\s*endif", l):
+			if_depth -= 1
+		elif if_depth == 0 and re.match(r"#\s*include|using ", l):
+			common += l
+
+	parts = [[] for i in range(nparts)]
+	sizes = [0] * nparts
+	for start, end in top_level_items(src[body_start:body_end]):
+		item = src[body_start + start:body_start + end]
+		# Comments before the definition may contain anything
+		signature = re.sub(r"//[^\n]*|/\*.*?\*/", "", item, flags=re.S).split("{", 1)[0]
+		if "::" not in signature or item.rstrip().endswith(";"):
+			for p in parts:
+				p.append(item)
+			continue
+		p = sizes.index(min(sizes))
+		parts[p].append(item)
+		sizes[p] += len(item)
+
+	ns = m_open.group(1)
+	out = []
+	for p, items in enumerate(parts):
+		out.append(
+			(head if p == 0 else common + "\nnamespace " + ns + " {\n") +
+			"".join(items) + "\n" +
+			(tail if p == 0 else "} // namespace " + ns + "\n")
+		)
+	return out
+
+if __name__ == "__main__":
+	parser = argparse.ArgumentParser()
+	parser.add_argument("src", help="dut.cpp generated by write_cxxrtl -header")
+	parser.add_argument("nparts", type=int)
+	parser.add_argument("out_prefix", help="Parts are written to <out_prefix><n>.cpp")
+	args = parser.parse_args()
+	if args.nparts < 1:
+		sys.exit("nparts must be at least 1")
+	src = open(args.src).read()
+	for i, part in enumerate(split(src, args.nparts)):
+		with open("{}{}.cpp".format(args.out_prefix, i), "w") as f:
+			f.write(part)
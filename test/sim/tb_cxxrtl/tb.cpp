@@ -1,17 +1,77 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <cinttypes>
 #include <cstdint>
 #include <string>
 #include <stdio.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
-// Device-under-test model generated by CXXRTL:
+// Device-under-test model generated by CXXRTL. The Makefile compiles the
+// design separately, and builds this file once per topology (TB_TOPOLOGY),
+// against that topology's header and in a namespace of its own, so that one
+// tb contains them all. Built without TB_TOPOLOGY, it includes the design.
+#ifdef TB_TOPOLOGY
+#define TB_CAT_(a, b) a ## b
+#define TB_CAT(a, b) TB_CAT_(a, b)
+#include "dut.h"
+namespace cxxrtl_design = TB_CAT(cxxrtl_design_, TB_TOPOLOGY);
+#else
 #include "dut.cpp"
+#endif
 #include <cxxrtl/cxxrtl_vcd.h>
 
+#include "../rvcpp/include/rv_checkpoint.h"
+#include "../rvcpp/include/rv_csrprof.h"
+#include "../rvcpp/include/rv_elf.h"
+#include "../rvcpp/include/rv_fault.h"
+#include "../rvcpp/include/rv_iomap.h"
+#include "../rvcpp/include/rv_le.h"
+#include "../rvcpp/include/rv_memheat.h"
+#include "../rvcpp/include/rv_power.h"
+#include "../rvcpp/include/rv_profile.h"
+#include "../rvcpp/include/rv_roi.h"
+#include "../rvcpp/include/rv_inputlog.h"
+#include "../rvcpp/include/rv_semihost.h"
+#include "../rvcpp/include/rv_stimulus.h"
+#include "tb_btrace.h"
+#include "tb_bus.h"
+#include "tb_coverage.h"
+#include "tb_events.h"
+#include "tb_jtag.h"
+#include "tb_output.h"
+#include "tb_shm.h"
+#ifdef COSIM
+#include "../rvcpp/include/rv_core.h"
+#include "../rvcpp/include/rv_fuzz.h"
+#include "../rvcpp/include/encoding/rv_csr.h"
+// Config header the design was built with (set by the Makefile)
+#ifndef TB_CONFIG_VH
+#define TB_CONFIG_VH "config_default.vh"
+#endif
+#endif
+
 // There must be a better way
 #ifdef __x86_64__
 #define I64_FMT "%ld"
@@ -19,65 +79,459 @@
 #define I64_FMT "%lld"
 #endif
 
+// mhartid of the design's first hart, for a tb_cluster<N>_<base> topology
+#ifndef TB_HART_BASE
+#define TB_HART_BASE 0
+#endif
+
+#ifdef TB_TOPOLOGY
+namespace TB_CAT(topology_, TB_TOPOLOGY) {
+#endif
+
+// -----------------------------------------------------------------------------
+// Design ports
+
+// The testbench logic (bus model, IO, JTAG and DMI) sees the design only
+// through its top-level ports, bound by name to these fields, so that it does
+// not depend on the simulation backend (see tb_dut).
+
+// One bit field of a design signal. CXXRTL stores signals in 32-bit chunks;
+// 8- and 16-bit storage is also handled, for backends which use it.
+struct dut_field {
+	const void *curr;
+	void *next;
+	uint8_t bytes;
+	unsigned shift;
+	uint32_t mask;
+
+	dut_field(): curr(nullptr), next(nullptr), bytes(4), shift(0), mask(0) {}
+
+	uint32_t get() const {
+		uint32_t x = bytes == 1 ? *(const uint8_t*)curr : bytes == 2 ? *(const uint16_t*)curr :
+			*(const uint32_t*)curr;
+		return x >> shift & mask;
+	}
+
+	void set(uint32_t x) const {
+		if (bytes == 1)
+			put<uint8_t>(x);
+		else if (bytes == 2)
+			put<uint16_t>(x);
+		else
+			put<uint32_t>(x);
+	}
+
+	// Bind to bits [lsb, lsb + width) of a signal with `bytes` of storage.
+	// Fails if the field would cross a 32-bit word.
+	bool bind(const void *curr_, void *next_, size_t bytes_, unsigned lsb, unsigned width) {
+		if (bytes_ > 4) {
+			curr_ = (const uint32_t*)curr_ + lsb / 32;
+			next_ = (uint32_t*)next_ + lsb / 32;
+			bytes_ = 4;
+			lsb %= 32;
+		}
+		if (width == 0 || lsb + width > 8 * bytes_)
+			return false;
+		curr = curr_;
+		next = next_;
+		bytes = bytes_;
+		shift = lsb;
+		mask = width == 32 ? ~0u : (1u << width) - 1;
+		return true;
+	}
+
+private:
+	template <typename T>
+	void put(uint32_t x) const {
+		T &w = *(T*)next;
+		w = (w & ~(mask << shift)) | (x & mask) << shift;
+	}
+};
+
+// Top-level ports other than the bus ports, named as in tb.v
+struct dut_ports {
+	dut_field clk, rst_n;
+	dut_field tck, trst_n, tms, tdi, tdo;
+	// Direct DMI access from the testbench, bypassing the DTM
+	dut_field dmi_direct_en, dmi_direct_psel, dmi_direct_penable, dmi_direct_pwrite, dmi_direct_paddr;
+	dut_field dmi_direct_pwdata, dmi_direct_prdata, dmi_direct_pready, dmi_direct_pslverr;
+	// External IRQs are shared by all harts. Soft and timer IRQs have one bit
+	// per hart.
+	dut_field irq, soft_irq, timer_irq;
+};
+
 // -----------------------------------------------------------------------------
 
 static const int MEM_SIZE = 16 * 1024 * 1024;
-static const int N_RESERVATIONS = 2;
+// Must match RESET_VECTOR in the config header
+static const uint32_t RESET_VECTOR = 0x40;
+// Harts in one design (one bit each of the IRQ inputs). MAX_BUS_PORTS, in
+// tb_shm.h, is the limit across all processes of a --shm-cluster simulation.
+static const int MAX_HARTS = 8;
 static const uint32_t RESERVATION_ADDR_MASK = 0xfffffff8u;
+// Printed output is written out at each newline, or when this much is buffered
+static const size_t PRINT_BUF_FLUSH = 1u << 16;
+static const size_t CONSOLE_RING_SIZE = 1u << 20;
 
-static const unsigned int IO_BASE = 0x80000000;
-enum {
-	IO_PRINT_CHAR  = 0x000,
-	IO_PRINT_U32   = 0x004,
-	IO_EXIT        = 0x008,
-	IO_SET_SOFTIRQ = 0x010,
-	IO_CLR_SOFTIRQ = 0x014,
-	IO_GLOBMON_EN  = 0x018,
-	IO_SET_IRQ     = 0x020,
-	IO_CLR_IRQ     = 0x030,
-	IO_MTIME       = 0x100,
-	IO_MTIMEH      = 0x104,
-	IO_MTIMECMP0   = 0x108,
-	IO_MTIMECMP0H  = 0x10c,
-	IO_MTIMECMP1   = 0x110,
-	IO_MTIMECMP1H  = 0x114
-};
 
 struct mem_io_state {
 	uint64_t mtime;
-	uint64_t mtimecmp[2];
+	// Harts in the design, from the width of its IRQ inputs. Its hart n
+	// is hart hart_base + n of all the harts sharing io, of which there
+	// are io_harts (more than n_harts only with --shm-cluster).
+	int n_harts;
+	int hart_base;
+	int io_harts;
+	tb_shared_io local_io;
+	tb_shared_io *io;
 
 	bool exit_req;
 	uint32_t exit_code;
 
+	// A write to tohost_addr with bit 0 set requests exit, if tohost_en
+	bool tohost_en;
+	uint32_t tohost_addr;
+
+	// Set by a write to save_io_addr, if save_io_en
+	bool save_io_en;
+	uint32_t save_io_addr;
+	bool save_req;
+
+	// Written by software through IO_WAVES, for --vcd-io
+	bool waves_on;
+
+	// Region of interest, written by software through IO_ROI. roi_changed
+	// is set by every write, and cleared once the main loop has seen it.
+	uint32_t roi;
+	bool roi_changed;
+	// Data phases of all bus ports, for the per-region counts
+	uint64_t transfers;
+
+	// Read back through IO_FAST_BOOT, for --fast-boot: the program was loaded
+	// with .data in place and .bss zeroed, so its startup code need not.
+	bool fast_boot;
+
+	// A write to IO_PRINT_LEN prints that many bytes from guest memory at
+	// print_ptr. All printed output is collected here and passed to the
+	// console stream a line at a time.
+	uint32_t print_ptr;
+	std::string print_buf;
+	tb_output_stream console;
+
+	// Standard output of this run: the console, and every message and
+	// report from run(). Not always stdout, as --threads runs several tests
+	// at once.
+	FILE *out;
+
+	// Timer IRQs forced on by --stimulus, one bit per hart
+	uint8_t timer_force;
+
+	// Bus fault rules armed by --stimulus, checked by mem_access()
+	FaultInjector faults;
+
 	uint8_t *mem;
+	// Guest RAM is shared with --shm-cluster, and not ours to free
+	bool mem_shared;
 
-	bool monitor_enabled;
-	bool reservation_valid[2];
-	uint32_t reservation_addr[2];
+	// If present, every bus transfer is counted here
+	MemHeatmap *heatmap;
 
-	mem_io_state() {
+	// Everything outside of RAM: the IO block (tb_io_block), and any other
+	// devices
+	IoMap devices;
+	// Devices with timed behaviour, which step() wakes when due. The timer
+	// (tb_timer) is woken through timer_changed() when its inputs change.
+	tb_event_queue events;
+	tb_timed_device *timer;
+
+	explicit mem_io_state(FILE *out_ = stdout) {
 		mtime = 0;
-		mtimecmp[0] = 0;
-		mtimecmp[1] = 0;
+		n_harts = 2;
+		hart_base = 0;
+		io_harts = 2;
+		io = &local_io;
 		exit_req = false;
 		exit_code = 0;
-		monitor_enabled = false;
-		for (int i = 0; i < N_RESERVATIONS; ++i) {
-			reservation_valid[i] = false;
-			reservation_addr[i] = 0;
+		tohost_en = false;
+		tohost_addr = 0;
+		save_io_en = false;
+		save_io_addr = 0;
+		save_req = false;
+		waves_on = false;
+		roi = 0;
+		roi_changed = false;
+		transfers = 0;
+		fast_boot = false;
+		print_ptr = 0;
+		timer_force = 0;
+		mem_shared = false;
+		heatmap = nullptr;
+		timer = nullptr;
+		out = out_;
+		console.open_file(out, CONSOLE_RING_SIZE);
+		// Pages are zeroed by the OS on first touch
+		mem = (uint8_t*)mmap(nullptr, MEM_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (mem == MAP_FAILED) {
+			fprintf(stderr, "Failed to allocate memory\n");
+			exit(-1);
+		}
+	}
+
+	// Memory is freed for --batch, which runs many tests in one process
+	~mem_io_state() {
+		if (!mem_shared)
+			munmap(mem, MEM_SIZE);
+	}
+
+	void use_shm(tb_shm_cluster *shm) {
+		munmap(mem, MEM_SIZE);
+		mem = (uint8_t*)shm + shm->mem_offset;
+		mem_shared = true;
+		io = &shm->io;
+	}
+
+	mem_io_state(const mem_io_state&) = delete;
+
+	void print(const char *text, size_t len) {
+		print_buf.append(text, len);
+		if (print_buf.size() >= PRINT_BUF_FLUSH || memchr(text, '\n', len)) {
+			console.write(print_buf);
+			print_buf.clear();
+		}
+	}
+
+	// Call before printing anything else to out, so it comes after all
+	// of the guest's output
+	void flush_print() {
+		console.write(print_buf);
+		print_buf.clear();
+		console.sync();
+	}
+
+	void step(uint64_t n = 1) {
+		mtime += n;
+		events.advance(n);
+	}
+
+	// Call when mtime, mtimecmp or timer_force change other than by step()
+	void timer_changed() {
+		if (timer)
+			events.schedule(timer, events.now);
+	}
+
+	uint8_t hart_mask() const {
+		return (1u << n_harts) - 1;
+	}
+
+	// The soft and external IRQ inputs follow io, which is also changed by
+	// other processes with --shm-cluster: see sync_irqs(). Soft IRQ bits
+	// are numbered across all harts sharing io.
+	void update_irqs(dut_ports &dut, uint32_t soft_set, uint32_t soft_clr,
+			uint32_t irq_set, uint32_t irq_clr) {
+		if (soft_set)
+			io->soft_irq.fetch_or(soft_set, std::memory_order_relaxed);
+		if (soft_clr)
+			io->soft_irq.fetch_and(~soft_clr, std::memory_order_relaxed);
+		if (irq_set)
+			io->irq.fetch_or(irq_set, std::memory_order_relaxed);
+		if (irq_clr)
+			io->irq.fetch_and(~irq_clr, std::memory_order_relaxed);
+		sync_irqs(dut);
+	}
+
+	void sync_irqs(dut_ports &dut) {
+		dut.soft_irq.set(io->soft_irq.load(std::memory_order_relaxed) >> hart_base & hart_mask());
+		dut.irq.set(io->irq.load(std::memory_order_relaxed));
+	}
+
+	bool monitor_enabled() const {
+		return io->monitor_enabled.load(std::memory_order_relaxed);
+	}
+
+	void request_exit(uint32_t code) {
+		if (exit_req)
+			return;
+		exit_req = true;
+		exit_code = code;
+		if (mem_shared)
+			tb_shm->request_exit(code);
+	}
+
+	// Apply a --stimulus event, before step() on its cycle. Harts beyond
+	// those in the design are ignored.
+	void apply_stimulus(dut_ports &dut, const Stimulus &stimulus, const StimulusEvent &e) {
+		uint32_t bit = 1u << e.index;
+		if (e.type == StimulusEvent::FAULT) {
+			faults.arm(stimulus.fault_rules[e.index]);
+		} else if (e.type == StimulusEvent::IRQ) {
+			update_irqs(dut, 0, 0, e.level ? bit : 0, e.level ? 0 : bit);
+		} else if (e.index >= (uint32_t)n_harts) {
+			return;
+		} else if (e.type == StimulusEvent::SOFTIRQ) {
+			bit <<= hart_base;
+			update_irqs(dut, e.level ? bit : 0, e.level ? 0 : bit, 0, 0);
+		} else {
+			timer_force = e.level ? timer_force | bit : timer_force & ~bit;
+			timer_changed();
+		}
+	}
+};
+
+// The testbench IO block, at IO_BASE. Its registers are those of rvcpp's
+// TBMemIO, but the state behind them is in mem_io_state, shared with other
+// processes for --shm-cluster, and the IRQ registers drive the design.
+struct tb_io_block: IoDevice {
+	mem_io_state &memio;
+	dut_ports &dut;
+
+	tb_io_block(mem_io_state &memio_, dut_ports &dut_): memio(memio_), dut(dut_) {}
+
+	bool write(uint32_t offset, uint32_t data) override {
+		switch (offset) {
+		case IO_PRINT_CHAR: {
+			char c = data;
+			memio.print(&c, 1);
+			return true;
+		}
+		case IO_PRINT_U32: {
+			char text[16];
+			snprintf(text, sizeof(text), "%08x\n", data);
+			memio.print(text, 9);
+			return true;
 		}
-		mem = new uint8_t[MEM_SIZE];
-		for (size_t i = 0; i < MEM_SIZE; ++i)
-			mem[i] = 0;
+		case IO_PRINT_PTR:
+			memio.print_ptr = data;
+			return true;
+		case IO_PRINT_LEN:
+			if (memio.print_ptr > (uint32_t)MEM_SIZE || data > MEM_SIZE - memio.print_ptr)
+				return false;
+			memio.print((const char*)memio.mem + memio.print_ptr, data);
+			return true;
+		case IO_EXIT:
+			memio.request_exit(data);
+			return true;
+		case IO_SET_SOFTIRQ:
+			memio.update_irqs(dut, data, 0, 0, 0);
+			return true;
+		case IO_CLR_SOFTIRQ:
+			memio.update_irqs(dut, 0, data, 0, 0);
+			return true;
+		case IO_GLOBMON_EN:
+			memio.io->monitor_enabled.store(data, std::memory_order_relaxed);
+			return true;
+		case IO_WAVES:
+			memio.waves_on = data;
+			return true;
+		case IO_TRACE:
+			return true;
+		case IO_ROI:
+			memio.roi = data;
+			memio.roi_changed = true;
+			return true;
+		case IO_SET_IRQ:
+			memio.update_irqs(dut, 0, 0, data, 0);
+			return true;
+		case IO_CLR_IRQ:
+			memio.update_irqs(dut, 0, 0, 0, data);
+			return true;
+		case IO_MTIME:
+			memio.mtime = (memio.mtime & 0xffffffff00000000u) | data;
+			memio.timer_changed();
+			return true;
+		case IO_MTIMEH:
+			memio.mtime = (memio.mtime & 0x00000000ffffffffu) | ((uint64_t)data << 32);
+			memio.timer_changed();
+			return true;
+		default:
+			if (std::atomic<uint64_t> *cmp = mtimecmp(offset)) {
+				uint64_t x = cmp->load(std::memory_order_relaxed);
+				if (offset & 4)
+					x = (x & 0x00000000ffffffffu) | ((uint64_t)data << 32);
+				else
+					x = (x & 0xffffffff00000000u) | data;
+				cmp->store(x, std::memory_order_relaxed);
+				memio.timer_changed();
+				return true;
+			}
+			return false;
+		}
+	}
+
+	bool read(uint32_t offset, uint32_t &data) override {
+		switch (offset) {
+		case IO_SET_SOFTIRQ:
+		case IO_CLR_SOFTIRQ:
+			data = memio.io->soft_irq.load(std::memory_order_relaxed);
+			return true;
+		case IO_SET_IRQ:
+		case IO_CLR_IRQ:
+			data = memio.io->irq.load(std::memory_order_relaxed);
+			return true;
+		case IO_PRINT_PTR:
+			data = memio.print_ptr;
+			return true;
+		case IO_ROI:
+			data = memio.roi;
+			return true;
+		case IO_FAST_BOOT:
+			data = memio.fast_boot;
+			return true;
+		case IO_MTIME:
+			data = memio.mtime;
+			return true;
+		case IO_MTIMEH:
+			data = memio.mtime >> 32;
+			return true;
+		default:
+			if (std::atomic<uint64_t> *cmp = mtimecmp(offset)) {
+				uint64_t x = cmp->load(std::memory_order_relaxed);
+				data = offset & 4 ? x >> 32 : x;
+				return true;
+			}
+			return false;
+		}
+	}
+
+private:
+	// One per hart sharing the IO block
+	std::atomic<uint64_t> *mtimecmp(uint32_t offset) {
+		if ((offset & 3) || offset < IO_MTIMECMP || offset >= IO_MTIMECMP + 8u * memio.io_harts)
+			return nullptr;
+		return &memio.io->mtimecmp[(offset - IO_MTIMECMP) / 8];
+	}
+};
+
+// Drives the timer IRQs from mtime and mtimecmp. mtime only counts up between
+// writes, so each IRQ changes only when mtime reaches its mtimecmp, or when
+// one of them is written: the timer sleeps until the earliest of those.
+struct tb_timer: tb_timed_device {
+	mem_io_state &memio;
+	dut_ports &dut;
+
+	tb_timer(mem_io_state &memio_, dut_ports &dut_): memio(memio_), dut(dut_) {
+		memio.timer = this;
+		memio.events.add(this);
+		memio.timer_changed();
 	}
 
-	// Where we're going we don't need a destructor B-)
+	~tb_timer() {
+		memio.timer = nullptr;
+	}
 
-	void step(cxxrtl_design::p_tb &tb) {
-		// Default update logic for mtime, mtimecmp
-		++mtime;
-		tb.p_timer__irq.set<uint8_t>((mtime >= mtimecmp[0]) | (mtime >= mtimecmp[1]) << 1);
+	void wake(uint64_t now) override {
+		uint8_t timer_irq = memio.timer_force;
+		uint64_t next = TB_NEVER;
+		for (int i = 0; i < memio.n_harts; ++i) {
+			uint64_t mtimecmp = memio.io->mtimecmp[memio.hart_base + i].load(std::memory_order_relaxed);
+			if (memio.mtime >= mtimecmp)
+				timer_irq |= 1u << i;
+			else
+				next = std::min(next, mtimecmp - memio.mtime);
+		}
+		dut.timer_irq.set(timer_irq);
+		if (next != TB_NEVER)
+			memio.events.schedule(this, now + next);
 	}
 };
 
@@ -92,9 +546,12 @@ struct bus_request {
 	bus_size_t size;
 	bool write;
 	bool excl;
+	// Instruction fetch, from HPROT[0]
+	bool fetch;
 	uint32_t wdata;
+	// Index of the requesting port, which is also its reservation
 	int reservation_id;
-	bus_request(): addr(0), size(SIZE_BYTE), write(0), excl(0), wdata(0), reservation_id(0) {}
+	bus_request(): addr(0), size(SIZE_BYTE), write(0), excl(0), fetch(0), wdata(0), reservation_id(0) {}
 };
 
 struct bus_response {
@@ -105,142 +562,91 @@ struct bus_response {
 	bus_response(): rdata(0), stall_cycles(0), err(false), exokay(true) {}
 };
 
-bus_response mem_access(cxxrtl_design::p_tb &tb, mem_io_state &memio, bus_request req) {
+bus_response mem_access(dut_ports &dut, mem_io_state &memio, bus_request req) {
 	bus_response resp;
 
-	// Global monitor. When monitor is not enabled, HEXOKAY is tied high
-	if (memio.monitor_enabled) {
-		if (req.excl) {
-			// Always set reservation on read. Always clear reservation on
-			// write. On successful write, clear others' matching reservations.
-			if (req.write) {
-				resp.exokay = memio.reservation_valid[req.reservation_id] &&
-					memio.reservation_addr[req.reservation_id] == (req.addr & RESERVATION_ADDR_MASK);
-				memio.reservation_valid[req.reservation_id] = false;
-				if (resp.exokay) {
-					for (int i = 0; i < N_RESERVATIONS; ++i) {
-						if (i == req.reservation_id)
-							continue;
-						if (memio.reservation_addr[i] == (req.addr & RESERVATION_ADDR_MASK))
-							memio.reservation_valid[i] = false;
-					}
-				}
-			}
-			else {
+	++memio.transfers;
+	if (memio.heatmap) {
+		memio.heatmap->access(req.addr, req.write ? MemHeatmap::WRITE :
+			req.fetch ? MemHeatmap::FETCH : MemHeatmap::READ);
+	}
+
+	// An injected bus error has no effect, like an unmapped address. An
+	// injected exclusive failure leaves the monitor alone, and fails the
+	// access with hexokay low: a read still returns data.
+	bool excl_fail = false;
+	if (memio.faults.armed()) {
+		FaultInjector::Result f = memio.faults.check(req.addr, req.write ? FaultRule::WRITE :
+			req.fetch ? FaultRule::FETCH : FaultRule::READ, req.excl, req.reservation_id);
+		if (f == FaultInjector::FAULT) {
+			resp.err = true;
+			resp.exokay = false;
+			return resp;
+		}
+		excl_fail = f == FaultInjector::EXFAIL;
+	}
+
+	// Global monitor. When monitor is not enabled, HEXOKAY is tied high.
+	// Reads and most writes don't touch the monitor, so only take the lock
+	// (which only matters with --shm-cluster) when they do.
+	if (excl_fail) {
+		resp.exokay = false;
+	}
+	else if (memio.monitor_enabled()) {
+		global_monitor &monitor = memio.io->monitor;
+		uint32_t res_addr = req.addr & RESERVATION_ADDR_MASK;
+		int port = req.reservation_id;
+		resp.exokay = false;
+		if (req.excl || (req.write && monitor.may_hold(res_addr))) {
+			memio.io->monitor_lock.lock();
+			if (req.excl && !req.write) {
+				// Always set reservation on read
 				resp.exokay = true;
-				memio.reservation_valid[req.reservation_id] = true;
-				memio.reservation_addr[req.reservation_id] = req.addr & RESERVATION_ADDR_MASK;
+				monitor.reserve(port, res_addr);
 			}
-		}
-		else {
-			resp.exokay = false;
-			// Non-exclusive write still clears others' reservations
-			if (req.write) {
-				for (int i = 0; i < N_RESERVATIONS; ++i) {
-					if (i == req.reservation_id)
-						continue;
-					if (memio.reservation_addr[i] == (req.addr & RESERVATION_ADDR_MASK))
-						memio.reservation_valid[i] = false;
-				}
+			else if (req.excl) {
+				// Always clear reservation on write. On successful write,
+				// clear others' matching reservations.
+				resp.exokay = monitor.holds(port, res_addr);
+				monitor.clear(port);
+				if (resp.exokay)
+					monitor.snoop(port, res_addr);
+			}
+			else {
+				// Non-exclusive write still clears others' reservations
+				monitor.snoop(port, res_addr);
 			}
+			memio.io->monitor_lock.unlock();
 		}
 	}
 
+	if (req.write && memio.save_io_en && req.addr == memio.save_io_addr) {
+		memio.save_req = true;
+	}
 
 	if (req.write) {
-		if (memio.monitor_enabled && req.excl && !resp.exokay) {
+		if ((memio.monitor_enabled() || excl_fail) && req.excl && !resp.exokay) {
 			// Failed exclusive write; do nothing
 		}
 		else if (req.addr <= MEM_SIZE - 4u) {
 			unsigned int n_bytes = 1u << (int)req.size;
 			// Note we are relying on hazard3's byte lane replication
-			for (unsigned int i = 0; i < n_bytes; ++i) {
-				memio.mem[req.addr + i] = req.wdata >> (8 * i) & 0xffu;
-			}
-		}
-		else if (req.addr == IO_BASE + IO_PRINT_CHAR) {
-			putchar(req.wdata);
-		}
-		else if (req.addr == IO_BASE + IO_PRINT_U32) {
-			printf("%08x\n", req.wdata);
-		}
-		else if (req.addr == IO_BASE + IO_EXIT) {
-			if (!memio.exit_req) {
-				memio.exit_req = true;
-				memio.exit_code = req.wdata;
+			le_store_bytes(memio.mem + req.addr, req.wdata, n_bytes);
+			if (memio.tohost_en && req.addr == memio.tohost_addr && req.size == SIZE_WORD &&
+					(req.wdata & 1u)) {
+				memio.request_exit(req.wdata >> 1);
 			}
 		}
-		else if (req.addr == IO_BASE + IO_SET_SOFTIRQ) {
-			tb.p_soft__irq.set<uint8_t>(tb.p_soft__irq.get<uint8_t>() | req.wdata);
-		}
-		else if (req.addr == IO_BASE + IO_CLR_SOFTIRQ) {
-			tb.p_soft__irq.set<uint8_t>(tb.p_soft__irq.get<uint8_t>() & ~req.wdata);
-		}
-		else if (req.addr == IO_BASE + IO_GLOBMON_EN) {
-			memio.monitor_enabled = req.wdata;
-		}
-		else if (req.addr == IO_BASE + IO_SET_IRQ) {
-			tb.p_irq.set<uint32_t>(tb.p_irq.get<uint32_t>() | req.wdata);
-		}
-		else if (req.addr == IO_BASE + IO_CLR_IRQ) {
-			tb.p_irq.set<uint32_t>(tb.p_irq.get<uint32_t>() & ~req.wdata);
-		}
-		else if (req.addr == IO_BASE + IO_MTIME) {
-			memio.mtime = (memio.mtime & 0xffffffff00000000u) | req.wdata;
-		}
-		else if (req.addr == IO_BASE + IO_MTIMEH) {
-			memio.mtime = (memio.mtime & 0x00000000ffffffffu) | ((uint64_t)req.wdata << 32);
-		}
-		else if (req.addr == IO_BASE + IO_MTIMECMP0) {
-			memio.mtimecmp[0] = (memio.mtimecmp[0] & 0xffffffff00000000u) | req.wdata;
-		}
-		else if (req.addr == IO_BASE + IO_MTIMECMP0H) {
-			memio.mtimecmp[0] = (memio.mtimecmp[0] & 0x00000000ffffffffu) | ((uint64_t)req.wdata << 32);
-		}
-		else if (req.addr == IO_BASE + IO_MTIMECMP1) {
-			memio.mtimecmp[1] = (memio.mtimecmp[1] & 0xffffffff00000000u) | req.wdata;
-		}
-		else if (req.addr == IO_BASE + IO_MTIMECMP1H) {
-			memio.mtimecmp[1] = (memio.mtimecmp[1] & 0x00000000ffffffffu) | ((uint64_t)req.wdata << 32);
-		}
-		else {
+		else if (!memio.devices.write(req.addr, req.wdata)) {
 			resp.err = true;
 		}
 	}
 	else {
 		if (req.addr <= MEM_SIZE - (1u << (int)req.size)) {
 			req.addr &= ~0x3u;
-			resp.rdata =
-				(uint32_t)memio.mem[req.addr] |
-				memio.mem[req.addr + 1] << 8 |
-				memio.mem[req.addr + 2] << 16 |
-				memio.mem[req.addr + 3] << 24;
-		}
-		else if (req.addr == IO_BASE + IO_SET_SOFTIRQ || req.addr == IO_BASE + IO_CLR_SOFTIRQ) {
-			resp.rdata = tb.p_soft__irq.get<uint8_t>();
-		}
-		else if (req.addr == IO_BASE + IO_SET_IRQ || req.addr == IO_BASE + IO_CLR_IRQ) {
-			resp.rdata = tb.p_irq.get<uint32_t>();
-		}
-		else if (req.addr == IO_BASE + IO_MTIME) {
-			resp.rdata = memio.mtime;
-		}
-		else if (req.addr == IO_BASE + IO_MTIMEH) {
-			resp.rdata = memio.mtime >> 32;
+			resp.rdata = le_load32(memio.mem + req.addr);
 		}
-		else if (req.addr == IO_BASE + IO_MTIMECMP0) {
-			resp.rdata = memio.mtimecmp[0];
-		}
-		else if (req.addr == IO_BASE + IO_MTIMECMP0H) {
-			resp.rdata = memio.mtimecmp[0] >> 32;
-		}
-		else if (req.addr == IO_BASE + IO_MTIMECMP1) {
-			resp.rdata = memio.mtimecmp[1];
-		}
-		else if (req.addr == IO_BASE + IO_MTIMECMP1H) {
-			resp.rdata = memio.mtimecmp[1] >> 32;
-		}
-		else {
+		else if (!memio.devices.read(req.addr, resp.rdata)) {
 			resp.err = true;
 		}
 	}
@@ -251,250 +657,3926 @@ bus_response mem_access(cxxrtl_design::p_tb &tb, mem_io_state &memio, bus_reques
 }
 
 // -----------------------------------------------------------------------------
+// Waveform output
 
-const char *help_str =
-"Usage: tb [--bin x.bin] [--port n] [--vcd x.vcd] [--dump start end] \\\n"
-"          [--cycles n] [--cpuret] [--jtagdump x] [--jtagreplay x]\n"
-"\n"
-"    --bin x.bin      : Flat binary file loaded to address 0x0 in RAM\n"
-"    --vcd x.vcd      : Path to dump waveforms to\n"
-"    --dump start end : Print out memory contents from start to end (exclusive)\n"
-"                       after execution finishes. Can be passed multiple times.\n"
-"    --cycles n       : Maximum number of cycles to run before exiting.\n"
-"                       Default is 0 (no maximum).\n"
-"    --port n         : Port number to listen for openocd remote bitbang. Sim\n"
-"                       runs in lockstep with JTAG bitbang, not free-running.\n"
-"    --cpuret         : Testbench's return code is the return code written to\n"
-"                       IO_EXIT by the CPU, or -1 if timed out.\n"
-"    --jtagdump       : Dump OpenOCD JTAG bitbang commands to a file so they\n"
-"                       can be replayed. (Lower perf impact than VCD dumping)\n"
-"    --jtagreplay     : Play back some dumped OpenOCD JTAG bitbang commands\n"
-;
+// The simulation only waits on disk if it gets a whole ring ahead of the
+// output thread (tb_output.h). VCD text is buffered up to the push threshold
+// first, to keep writes to the ring infrequent.
+static const size_t WAVES_RING_SIZE = 64 * 1024 * 1024;
+static const size_t WAVES_PUSH_THRESHOLD = 64 * 1024;
 
-void exit_help(std::string errtext = "") {
-	std::cerr << errtext << help_str;
-	exit(-1);
+// Filters on debug item names are hierarchy globs, with . as the separator.
+// No filters matches everything.
+static bool hier_match(const std::vector<std::string> &filters, const std::string &name) {
+	if (filters.empty())
+		return true;
+	for (auto &f : filters) {
+		std::string pattern = f;
+		std::replace(pattern.begin(), pattern.end(), '.', ' ');
+		if (fnmatch(pattern.c_str(), name.c_str(), 0) == 0)
+			return true;
+	}
+	return false;
 }
 
-int wait_for_connection(int server_fd, uint16_t port, struct sockaddr *sock_addr, socklen_t *sock_addr_len) {
-	int sock_fd;
-	printf("Waiting for connection on port %u\n", port);
-	if (listen(server_fd, 3) < 0) {
-		fprintf(stderr, "listen failed\n");
-		exit(-1);
-	}
-	sock_fd = accept(server_fd, sock_addr, sock_addr_len);
-	if (sock_fd < 0) {
-		fprintf(stderr, "accept failed\n");
-		exit(-1);
-	}
-	printf("Connected\n");
-	return sock_fd;
+// Limits on when waveforms are sampled. All conditions which are enabled
+// must hold.
+struct wave_window {
+	std::vector<std::string> filters;
+	bool cycles_en;
+	int64_t cycle_start;
+	int64_t cycle_end;
+	bool pc_en;
+	uint32_t pc_start;
+	uint32_t pc_end;
+	bool io_en;
+	bool roi_en;
+	wave_window(): cycles_en(false), cycle_start(0), cycle_end(0), pc_en(false), pc_start(0), pc_end(0),
+		io_en(false), roi_en(false) {}
+
+	bool match(const std::string &name) const {
+		return hier_match(filters, name);
+	}
+
+	bool active(int64_t cycle, uint32_t fetch_addr, const mem_io_state &memio) const {
+		return (!cycles_en || (cycle >= cycle_start && cycle < cycle_end)) &&
+			(!pc_en || (fetch_addr >= pc_start && fetch_addr < pc_end)) &&
+			(!io_en || memio.waves_on) &&
+			(!roi_en || memio.roi);
+	}
+};
+
+// -----------------------------------------------------------------------------
+// Simulation backend
+
+// tb_dut is the design as simulated by CXXRTL, behind the interface the rest
+// of tb uses. Besides the ports, it provides:
+//
+// - port(name, lsb, width, f): bind f to bits of the top-level port `name`
+// - port_width(name): width of a top-level port, or 0 if there is none
+// - step(): settle the design after its inputs change, e.g. the clock
+// - eval_commit(): one delta cycle, returning whether anything changed (see
+//   NEEDS_SETTLE_STEP and --fast)
+// - waves_open(), waves_sample(timestamp), waves_close(): dump waveforms
+// - save_initial() and reset(): put the design back as it was at power-on,
+//   for --batch and --fuzz
+// - debug_info(): the CXXRTL debug items, through which the monitors find
+//   signals inside the design
+
+// Design state is found through the CXXRTL debug items: this covers all
+// wires (including every register), memories and inputs. Other values are
+// recomputed on the next eval (or may be constants), and aliases and
+// outlines hold no state.
+static bool is_state_item(const cxxrtl::debug_item &item) {
+	return item.type == cxxrtl::debug_item::WIRE ||
+		item.type == cxxrtl::debug_item::MEMORY ||
+		(item.type == cxxrtl::debug_item::VALUE && (item.flags & cxxrtl::debug_item::INPUT));
+}
+
+static size_t state_item_chunks(const cxxrtl::debug_item &item) {
+	const size_t chunk_bits = 8 * sizeof(*item.curr);
+	return (item.width + chunk_bits - 1) / chunk_bits * item.depth;
 }
 
-static const int TCP_BUF_SIZE = 256;
+struct tb_dut: dut_ports {
+	// The step after the clock edge may not settle the design:
+	// github.com/YosysHQ/yosys/issues/2780
+	static const bool NEEDS_SETTLE_STEP = true;
 
-int main(int argc, char **argv) {
+	cxxrtl_design::p_tb top;
 
-	bool load_bin = false;
-	std::string bin_path;
-	bool dump_waves = false;
-	std::string waves_path;
-	std::vector<std::pair<uint32_t, uint32_t>> dump_ranges;
-	int64_t max_cycles = 0;
-	bool propagate_return_code = false;
-	uint16_t port = 0;
-	bool dump_jtag = false;
-	std::string jtag_dump_path;
-	bool replay_jtag = false;
-	std::string jtag_replay_path;
+	tb_dut() {
+		top.debug_info(&items, /*scopes=*/nullptr, "");
+	}
 
-	for (int i = 1; i < argc; ++i) {
-		std::string s(argv[i]);
-		if (s.rfind("--", 0) != 0) {
-			std::cerr << "Unexpected positional argument " << s << "\n";
-			exit_help("");
-		}
-		else if (s == "--bin") {
-			if (argc - i < 2)
-				exit_help("Option --bin requires an argument\n");
-			load_bin = true;
-			bin_path = argv[i + 1];
-			i += 1;
+	tb_dut(const tb_dut&) = delete;
+
+	const cxxrtl::debug_items &debug_info() const {
+		return items;
+	}
+
+	bool port(const std::string &name, unsigned lsb, unsigned width, dut_field &f) const {
+		const cxxrtl::debug_item *i = find_port(name);
+		return i && lsb + width <= i->width && f.bind(i->curr, i->next ? i->next : i->curr,
+			state_item_chunks(*i) * sizeof(*i->curr), lsb, width);
+	}
+
+	unsigned port_width(const std::string &name) const {
+		const cxxrtl::debug_item *i = find_port(name);
+		return i ? i->width : 0;
+	}
+
+	void step() {
+		top.step();
+	}
+
+	bool eval_commit() {
+		top.eval();
+		return top.commit();
+	}
+
+	bool waves_open(const std::string &path, const wave_window &window) {
+		bool fst = path.size() >= 4 && path.compare(path.size() - 4, 4, ".fst") == 0;
+		if (!(fst ? waves_fd.open_pipe("vcd2fst - \"" + path + "\"", WAVES_RING_SIZE) :
+				waves_fd.open(path, WAVES_RING_SIZE)))
+			return false;
+		vcd.timescale(1, "us");
+		vcd.add(items, [&](const std::string &name, const cxxrtl::debug_item &) {
+			return window.match(name);
+		});
+		return true;
+	}
+
+	void waves_sample(uint64_t timestamp) {
+		vcd.sample(timestamp);
+		if (vcd.buffer.size() >= WAVES_PUSH_THRESHOLD) {
+			waves_fd.write(vcd.buffer);
+			vcd.buffer.clear();
 		}
-		else if (s == "--vcd") {
-			if (argc - i < 2)
-				exit_help("Option --vcd requires an argument\n");
-			dump_waves = true;
-			waves_path = argv[i + 1];
-			i += 1;
+	}
+
+	void waves_close() {
+		waves_fd.write(vcd.buffer);
+		vcd.buffer.clear();
+		waves_fd.close();
+	}
+
+	// A copy of every state item
+	void save_initial() {
+		initial_state.clear();
+		for (auto &it : items.table) {
+			for (auto &item : it.second) {
+				if (!is_state_item(item))
+					continue;
+				const uint8_t *p = (const uint8_t*)item.curr;
+				initial_state.insert(initial_state.end(), p, p + state_item_chunks(item) * sizeof(*item.curr));
+			}
 		}
-		else if (s == "--jtagdump") {
-			if (argc - i < 2)
-				exit_help("Option --jtagdump requires an argument\n");
-			dump_jtag = true;
-			jtag_dump_path = argv[i + 1];
-			i += 1;
+	}
+
+	void reset() {
+		size_t pos = 0;
+		for (auto &it : items.table) {
+			for (auto &item : it.second) {
+				if (!is_state_item(item))
+					continue;
+				size_t n_bytes = state_item_chunks(item) * sizeof(*item.curr);
+				memcpy(item.curr, &initial_state[pos], n_bytes);
+				if (item.next)
+					memcpy(item.next, item.curr, n_bytes);
+				pos += n_bytes;
+			}
 		}
-		else if (s == "--jtagreplay") {
-			if (argc - i < 2)
-				exit_help("Option --jtagreplay requires an argument\n");
-			replay_jtag = true;
-			jtag_replay_path = argv[i + 1];
-			i += 1;
+	}
+
+private:
+	cxxrtl::debug_items items;
+	// FST is written by piping VCD through gtkwave's vcd2fst
+	tb_output_stream waves_fd;
+	cxxrtl::vcd_writer vcd;
+	std::vector<uint8_t> initial_state;
+
+	const cxxrtl::debug_item *find_port(const std::string &name) const {
+		auto it = items.table.find(name);
+		if (it == items.table.end() || (it->second[0].type != cxxrtl::debug_item::VALUE &&
+				it->second[0].type != cxxrtl::debug_item::WIRE))
+			return nullptr;
+		return &it->second[0];
+	}
+};
+
+// -----------------------------------------------------------------------------
+// Snapshots
+
+// Layout: header, testbench state, then the name and contents of each design
+// state item, then memory contents at a page-aligned offset. Memory is mapped
+// copy-on-write on restore, so many runs can start from the same snapshot
+// cheaply. Snapshots are only meant to be restored by the same build of tb.
+
+static const char SNAPSHOT_MAGIC[8] = {'h', '3', 't', 'b', 's', 'n', 'p', '6'};
+static const uint32_t SNAPSHOT_MEM_ALIGN = 1u << 16;
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t mem_size;
+	uint32_t mem_offset;
+	int64_t cycle;
+};
+
+// Testbench state carried from one cycle to the next, other than mem_io_state
+struct port_state {
+	// Address-phase request, carried into its data phase
+	bus_request req;
+	bool req_vld;
+	// Cycle the address phase was accepted, and whether it was htrans=SEQ
+	int64_t req_cycle;
+	bool req_seq;
+	port_timing timing;
+	port_state(): req_vld(false), req_cycle(0), req_seq(false) {}
+};
+
+struct tb_loop_state {
+	port_state port[MAX_BUS_PORTS];
+};
+
+// For --ahb-trace, as a data phase completes on `cycle`
+static void ahb_trace_data_phase(ahb_trace_writer &w, int64_t cycle, int port, const port_state &ps,
+		const bus_response &resp) {
+	ahb_record r;
+	r.cycle = ps.req_cycle;
+	r.addr = ps.req.addr;
+	r.data = ps.req.write ? ps.req.wdata : resp.rdata;
+	r.waits = std::min(cycle - ps.req_cycle - 1, (int64_t)0xffff);
+	r.port = port;
+	r.flags = (ps.req.write ? ahb_record::AHB_WRITE : 0) | (ps.req.excl ? ahb_record::AHB_EXCL : 0) |
+		(ps.req.fetch ? ahb_record::AHB_FETCH : 0) | (ps.req_seq ? ahb_record::AHB_SEQ : 0) |
+		(resp.err ? ahb_record::AHB_ERR : 0) | (resp.exokay ? ahb_record::AHB_EXOKAY : 0) |
+		ps.req.size << 4;
+	w.record(r);
+}
+
+// An AHB-Lite master port of the design
+struct bus_port {
+	dut_field htrans, hwrite, hsize, haddr, hexcl, hprot, hwdata;
+	dut_field hready, hresp, hexokay, hrdata;
+};
+
+static bool bind_dut_ports(tb_dut &dut) {
+	bool ok = true;
+	auto bind = [&](dut_field &f, const char *name) {
+		if (!dut.port(name, 0, dut.port_width(name), f)) {
+			std::cerr << "Port " << name << " not found in design\n";
+			ok = false;
 		}
-		else if (s == "--dump") {
-			if (argc - i < 3)
-				exit_help("Option --dump requires 2 arguments\n");
-			dump_ranges.push_back(std::pair<uint32_t, uint32_t>(
-				std::stoul(argv[i + 1], 0, 0),
-				std::stoul(argv[i + 2], 0, 0)
-			));;
-			i += 2;
+	};
+	bind(dut.clk, "clk");
+	bind(dut.rst_n, "rst_n");
+	bind(dut.tck, "tck");
+	bind(dut.trst_n, "trst_n");
+	bind(dut.tms, "tms");
+	bind(dut.tdi, "tdi");
+	bind(dut.tdo, "tdo");
+	bind(dut.dmi_direct_en, "dmi_direct_en");
+	bind(dut.dmi_direct_psel, "dmi_direct_psel");
+	bind(dut.dmi_direct_penable, "dmi_direct_penable");
+	bind(dut.dmi_direct_pwrite, "dmi_direct_pwrite");
+	bind(dut.dmi_direct_paddr, "dmi_direct_paddr");
+	bind(dut.dmi_direct_pwdata, "dmi_direct_pwdata");
+	bind(dut.dmi_direct_prdata, "dmi_direct_prdata");
+	bind(dut.dmi_direct_pready, "dmi_direct_pready");
+	bind(dut.dmi_direct_pslverr, "dmi_direct_pslverr");
+	bind(dut.irq, "irq");
+	bind(dut.soft_irq, "soft_irq");
+	bind(dut.timer_irq, "timer_irq");
+	return ok;
+}
+
+// Bus ports are named i_<signal> and d_<signal> (ports 0 and 1) in tb.v and
+// tb_multicore.v. In tb_cluster.v each signal is one vector, with a slice
+// per hart, and port n belongs to hart n.
+static bool bind_bus_ports(const tb_dut &dut, std::vector<bus_port> &ports) {
+	unsigned packed_width = dut.port_width("haddr");
+	int n_ports = packed_width ? packed_width / 32 : 2;
+	if (n_ports > MAX_BUS_PORTS) {
+		std::cerr << "Design has " << n_ports << " bus ports, but the testbench supports up to " << MAX_BUS_PORTS << "\n";
+		return false;
+	}
+	bool ok = true;
+	auto bind = [&](dut_field &f, int port, const char *signal, unsigned width) {
+		bool found = packed_width ? dut.port(signal, port * width, width, f) :
+			dut.port(std::string(port ? "d_" : "i_") + signal, 0, width, f);
+		if (!found) {
+			std::cerr << "Bus port " << port << " signal " << signal << " not found in design\n";
+			ok = false;
 		}
-		else if (s == "--cycles") {
-			if (argc - i < 2)
-				exit_help("Option --cycles requires an argument\n");
-			max_cycles = std::stol(argv[i + 1], 0, 0);
-			i += 1;
+	};
+	ports.resize(n_ports);
+	for (int p = 0; p < n_ports; ++p) {
+		bus_port &b = ports[p];
+		bind(b.htrans,  p, "htrans",  2);
+		bind(b.hwrite,  p, "hwrite",  1);
+		bind(b.hsize,   p, "hsize",   3);
+		bind(b.haddr,   p, "haddr",   32);
+		bind(b.hexcl,   p, "hexcl",   1);
+		bind(b.hprot,   p, "hprot",   4);
+		bind(b.hwdata,  p, "hwdata",  32);
+		bind(b.hready,  p, "hready",  1);
+		bind(b.hresp,   p, "hresp",   1);
+		bind(b.hexokay, p, "hexokay", 1);
+		bind(b.hrdata,  p, "hrdata",  32);
+	}
+	return ok;
+}
+
+// Harts in the design, from the width of its per-hart IRQ inputs
+static int design_harts(const tb_dut &dut) {
+	unsigned width = dut.port_width("timer_irq");
+	return width ? std::min((int)width, MAX_HARTS) : 2;
+}
+
+// Bus outputs sampled by the testbench on each cycle. Used by --fast to check
+// whether this model needs the extra step after the clock edge.
+static const int N_BUS_OUTPUTS = 6 * MAX_BUS_PORTS;
+
+static void sample_bus_outputs(const std::vector<bus_port> &ports, uint32_t *out) {
+	for (const bus_port &b : ports) {
+		*out++ = b.htrans.get();
+		*out++ = b.hwrite.get();
+		*out++ = b.hsize.get();
+		*out++ = b.haddr.get();
+		*out++ = b.hexcl.get();
+		*out++ = b.hwdata.get();
+	}
+}
+
+bool snapshot_save(const std::string &path, int64_t cycle, tb_dut &dut,
+		mem_io_state &memio, tb_loop_state &loop) {
+	FILE *f = fopen(path.c_str(), "wb");
+	if (!f) {
+		std::cerr << "Failed to open \"" << path << "\" for writing\n";
+		return false;
+	}
+	bool ok = true;
+	auto put = [&](const void *p, size_t n) {ok = ok && fwrite(p, 1, n, f) == n;};
+
+	snapshot_header header;
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.mem_size = MEM_SIZE;
+	header.mem_offset = 0;
+	header.cycle = cycle;
+	put(&header, sizeof(header));
+	put(&memio.mtime, sizeof(memio.mtime));
+	put(memio.io, sizeof(*memio.io));
+	put(&memio.print_ptr, sizeof(memio.print_ptr));
+	put(&memio.timer_force, sizeof(memio.timer_force));
+	put(&memio.roi, sizeof(memio.roi));
+	put(&loop, sizeof(loop));
+
+	const cxxrtl::debug_items &items = dut.debug_info();
+	for (auto &it : items.table) {
+		for (auto &item : it.second) {
+			if (!is_state_item(item))
+				continue;
+			uint32_t name_len = it.first.size();
+			put(&name_len, sizeof(name_len));
+			put(it.first.data(), name_len);
+			put(item.curr, state_item_chunks(item) * sizeof(*item.curr));
+		}
+	}
+	uint32_t end_marker = 0;
+	put(&end_marker, sizeof(end_marker));
+
+	header.mem_offset = (ftell(f) + SNAPSHOT_MEM_ALIGN - 1) & ~(long)(SNAPSHOT_MEM_ALIGN - 1);
+	ok = ok && fseek(f, header.mem_offset, SEEK_SET) == 0;
+	put(memio.mem, MEM_SIZE);
+	ok = ok && fseek(f, 0, SEEK_SET) == 0;
+	put(&header, sizeof(header));
+	if (fclose(f) != 0)
+		ok = false;
+	if (!ok)
+		std::cerr << "Failed to write snapshot \"" << path << "\"\n";
+	return ok;
+}
+
+// Returns the cycle count at which the snapshot was taken, or -1 on failure
+int64_t snapshot_restore(const std::string &path, tb_dut &dut,
+		mem_io_state &memio, tb_loop_state &loop) {
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f) {
+		std::cerr << "Failed to open \"" << path << "\"\n";
+		return -1;
+	}
+	bool ok = true;
+	auto get = [&](void *p, size_t n) {ok = ok && fread(p, 1, n, f) == n;};
+
+	snapshot_header header;
+	get(&header, sizeof(header));
+	if (!ok || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.mem_size != MEM_SIZE) {
+		std::cerr << "\"" << path << "\" is not a snapshot from this testbench\n";
+		fclose(f);
+		return -1;
+	}
+	get(&memio.mtime, sizeof(memio.mtime));
+	get(memio.io, sizeof(*memio.io));
+	get(&memio.print_ptr, sizeof(memio.print_ptr));
+	get(&memio.timer_force, sizeof(memio.timer_force));
+	memio.timer_changed();
+	get(&memio.roi, sizeof(memio.roi));
+	memio.roi_changed = memio.roi != 0;
+	get(&loop, sizeof(loop));
+
+	// Items are saved in name order, so a mismatch means a different design
+	const cxxrtl::debug_items &items = dut.debug_info();
+	for (auto &it : items.table) {
+		for (auto &item : it.second) {
+			if (!ok || !is_state_item(item))
+				continue;
+			uint32_t name_len = 0;
+			get(&name_len, sizeof(name_len));
+			std::string name(ok ? name_len : 0, '\0');
+			get(&name[0], name.size());
+			if (ok && name != it.first) {
+				std::cerr << "Snapshot item \"" << name << "\" does not match design item \"" << it.first << "\"\n";
+				ok = false;
+			}
+			size_t n_bytes = state_item_chunks(item) * sizeof(*item.curr);
+			get(item.curr, n_bytes);
+			if (ok && item.next)
+				memcpy(item.next, item.curr, n_bytes);
+		}
+	}
+	uint32_t end_marker = 1;
+	get(&end_marker, sizeof(end_marker));
+	ok = ok && end_marker == 0;
+
+	if (ok) {
+		void *p = mmap(nullptr, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), header.mem_offset);
+		if (p == MAP_FAILED) {
+			ok = false;
+		} else {
+			munmap(memio.mem, MEM_SIZE);
+			memio.mem = (uint8_t*)p;
+		}
+	}
+	fclose(f);
+	if (!ok) {
+		std::cerr << "Failed to restore snapshot \"" << path << "\"\n";
+		return -1;
+	}
+	return header.cycle;
+}
+
+// -----------------------------------------------------------------------------
+// Flight recorder
+
+// Keeps the last n cycles of the selected debug items in memory, and only
+// writes them out as a VCD when something goes wrong. Memories and outlines
+// are not recorded.
+struct flight_recorder {
+	struct source {
+		const cxxrtl::chunk_t *curr;
+		size_t n_chunks;
+	};
+	std::vector<source> sources;
+	// Items with curr pointing into `scratch`, for replaying frames through
+	// a vcd_writer
+	cxxrtl::debug_items shadow;
+	std::vector<cxxrtl::chunk_t> scratch;
+	size_t frame_chunks;
+
+	std::vector<cxxrtl::chunk_t> frames;
+	std::vector<uint64_t> timestamps;
+	size_t n_frames;
+	size_t next_frame;
+	size_t n_recorded;
+
+	flight_recorder(): frame_chunks(0), n_frames(0), next_frame(0), n_recorded(0) {}
+
+	void init(tb_dut &dut, const wave_window &window, int64_t n_cycles) {
+		const cxxrtl::debug_items &items = dut.debug_info();
+		std::vector<std::pair<std::string, cxxrtl::debug_item>> selected;
+		frame_chunks = 0;
+		for (auto &it : items.table) {
+			for (auto &item : it.second) {
+				if (item.type == cxxrtl::debug_item::MEMORY || item.type == cxxrtl::debug_item::OUTLINE ||
+						!window.match(it.first))
+					continue;
+				source src;
+				src.curr = item.curr;
+				src.n_chunks = state_item_chunks(item);
+				sources.push_back(src);
+				frame_chunks += src.n_chunks;
+				selected.push_back(std::make_pair(it.first, item));
+			}
+		}
+		scratch.resize(frame_chunks);
+		size_t pos = 0;
+		for (auto &sel : selected) {
+			cxxrtl::debug_item copy = sel.second;
+			copy.curr = &scratch[pos];
+			copy.next = nullptr;
+			pos += state_item_chunks(copy);
+			shadow.add(sel.first, std::move(copy));
+		}
+		// Two samples per cycle, as for --vcd
+		n_frames = 2 * n_cycles;
+		frames.resize(n_frames * frame_chunks);
+		timestamps.resize(n_frames);
+	}
+
+	void sample(uint64_t timestamp) {
+		cxxrtl::chunk_t *dst = &frames[next_frame * frame_chunks];
+		for (auto &src : sources) {
+			memcpy(dst, src.curr, src.n_chunks * sizeof(*dst));
+			dst += src.n_chunks;
+		}
+		timestamps[next_frame] = timestamp;
+		next_frame = (next_frame + 1) % n_frames;
+		n_recorded = std::min(n_recorded + 1, n_frames);
+	}
+
+	bool write(const std::string &path) {
+		std::ofstream f(path);
+		if (!f.is_open())
+			return false;
+		cxxrtl::vcd_writer vcd;
+		vcd.timescale(1, "us");
+		vcd.add(shadow, [](const std::string &, const cxxrtl::debug_item &) { return true; });
+		for (size_t i = 0; i < n_recorded; ++i) {
+			size_t frame = (next_frame + n_frames - n_recorded + i) % n_frames;
+			memcpy(scratch.data(), &frames[frame * frame_chunks], frame_chunks * sizeof(scratch[0]));
+			vcd.sample(timestamps[frame]);
+			f << vcd.buffer;
+			vcd.buffer.clear();
+		}
+		return true;
+	}
+};
+
+#ifdef COSIM
+// -----------------------------------------------------------------------------
+// Lockstep co-simulation against rvcpp (--cosim)
+
+// Each instruction retired by the RTL, as reported by hazard3_cosim_monitor.vh.
+// Sampled into a ring buffer every cycle, and checked against the reference
+// core a batch at a time.
+struct cosim_record {
+	enum {
+		TRAP = 0x1,
+		INTR = 0x2
+	};
+	int64_t cycle;
+	uint32_t pc;
+	uint32_t rd_wdata;
+	uint8_t rd;
+	uint8_t flags;
+	// IRQ inputs when the instruction retired, to replay interrupt entry
+	uint8_t irq_t;
+	uint8_t irq_s;
+	uint32_t irq_e;
+};
+
+// IO region of the reference core. IO is not modelled: reads return zero,
+// and the value the RTL read is used instead.
+struct cosim_io: MemBase32 {
+	bool accessed = false;
+	std::optional<uint8_t> r8(ux_t) override {accessed = true; return 0;}
+	bool w8(ux_t, uint8_t) override {accessed = true; return true;}
+	std::optional<uint16_t> r16(ux_t) override {accessed = true; return 0;}
+	bool w16(ux_t, uint16_t) override {accessed = true; return true;}
+	std::optional<uint32_t> r32(ux_t) override {accessed = true; return 0;}
+	bool w32(ux_t, uint32_t) override {accessed = true; return true;}
+};
+
+struct cosim_trace_sink: TraceSink {
+	TraceRecord last;
+	virtual void record(const TraceRecord &t) {last = t;}
+	virtual void message(const char *, size_t) {}
+};
+
+// The reference core has its own copy of memory, taken after loading, and
+// steps once per RTL retirement (taking an IRQ first if the RTL did). Values
+// which depend on timing, i.e. IO loads and reads of counters and mip, are
+// copied from the RTL rather than compared.
+struct cosim_checker {
+	static const size_t RING_SIZE = 4096;
+	static const size_t HISTORY_SIZE = 16;
+	// For instruction fetch faults, which the RTL does not report
+	static const int MAX_SKIPPED_TRAPS = 16;
+
+	cosim_io io;
+	MemMap32 mem;
+	std::unique_ptr<RVCore> core;
+	cosim_trace_sink sink;
+
+	const cxxrtl::chunk_t *valid, *pc, *trap, *intr, *rd, *rd_wdata;
+
+	std::vector<cosim_record> ring;
+	size_t ring_count;
+	std::vector<std::pair<cosim_record, TraceRecord>> history;
+	size_t history_next;
+	uint64_t n_checked;
+	// Updated with each checked instruction, for --fuzz
+	FuzzCoverage *coverage;
+	// Where mismatches are reported
+	FILE *out;
+
+	cosim_checker(): ring(RING_SIZE), ring_count(0), history(HISTORY_SIZE), history_next(0), n_checked(0),
+		coverage(nullptr), out(stdout) {}
+
+	// Only the first ram_used bytes of RAM (the extent of what was loaded)
+	// are copied, as the rest is still zero
+	bool init(tb_dut &dut, const uint8_t *ram, size_t ram_used) {
+		const cxxrtl::debug_items &items = dut.debug_info();
+		// Hart 0 only, on multicore tb
+		std::string prefix = items.table.count("cpu core cosim_valid") ? "cpu core " : "cpu0 core ";
+		auto find = [&](const char *name) -> const cxxrtl::chunk_t* {
+			auto it = items.table.find(prefix + name);
+			return it == items.table.end() ? nullptr : it->second[0].curr;
+		};
+		valid = find("cosim_valid");
+		pc = find("cosim_pc");
+		trap = find("cosim_trap");
+		intr = find("cosim_intr");
+		rd = find("mw_rd");
+		rd_wdata = find("mw_result");
+		if (!(valid && pc && trap && intr && rd && rd_wdata)) {
+			std::cerr << "Retirement monitor not found in design (was it built with COSIM=1?)\n";
+			return false;
+		}
+		mem.add(IO_BASE, IO_SIZE, &io);
+		core.reset(new RVCore(mem, RESET_VECTOR, 0, MEM_SIZE));
+		// The reference core implements the same extensions as the design
+		RVConfig cfg;
+		std::string err;
+		if (!cfg.load(TB_CONFIG_VH, err)) {
+			std::cerr << err << " (for --cosim)\n";
+			return false;
+		}
+		core->set_config(cfg);
+		core->trace_sink = &sink;
+		memcpy(core->ram, ram, ram_used);
+		// The reference core's Xh3irq controller follows the IRQ lines, but
+		// only takes an external IRQ when the RTL did
+		core->csr.set_irq_entry_mask(~(ux_t)MIP_MEIP);
+		return true;
+	}
+
+	// Call after each rising clock edge. Returns false on a mismatch.
+	bool sample(tb_dut &dut, int64_t cycle) {
+		if (!*valid)
+			return true;
+		cosim_record &r = ring[ring_count++];
+		r.cycle = cycle;
+		r.pc = *pc;
+		r.rd = *rd;
+		r.rd_wdata = *rd_wdata;
+		r.flags = (*trap ? cosim_record::TRAP : 0) | (*intr ? cosim_record::INTR : 0);
+		r.irq_t = dut.timer_irq.get() & 0x1;
+		r.irq_s = dut.soft_irq.get() & 0x1;
+		r.irq_e = dut.irq.get();
+		return ring_count < RING_SIZE || drain();
+	}
+
+	// Check all sampled records. Returns false on a mismatch.
+	bool drain() {
+		size_t n = ring_count;
+		ring_count = 0;
+		for (size_t i = 0; i < n; ++i) {
+			if (!check(ring[i]))
+				return false;
+		}
+		return true;
+	}
+
+	bool check(const cosim_record &r) {
+		RVCore &c = *core;
+		c.csr.set_irq_e(r.irq_e, false);
+		if (r.flags & cosim_record::INTR) {
+			c.csr.set_irq_t(r.irq_t);
+			c.csr.set_irq_s(r.irq_s);
+			c.csr.set_irq_entry_mask(~0u);
+			sink.last = TraceRecord();
+			c.step(true);
+			c.csr.set_irq_t(false);
+			c.csr.set_irq_s(false);
+			c.csr.set_irq_entry_mask(~(ux_t)MIP_MEIP);
+			if (!(sink.last.flags & TraceRecord::IRQ))
+				return mismatch(r, "RTL took an interrupt, and rvcpp did not");
+		}
+		// The RTL only reports an instruction once it has left any WFI sleep
+		c.stalled_on_wfi = false;
+		for (int i = 0; ; ++i) {
+			io.accessed = false;
+			c.step(true);
+			const TraceRecord &t = sink.last;
+			bool fetch_fault = (t.flags & TraceRecord::TRAP) &&
+				(t.cause == XCAUSE_INSTR_FAULT || t.cause == XCAUSE_INSTR_MISALIGN);
+			if (!fetch_fault || i == MAX_SKIPPED_TRAPS)
+				break;
+		}
+		const TraceRecord &t = sink.last;
+
+		if (t.pc != r.pc)
+			return mismatch(r, "pc differs");
+		if (!!(t.flags & TraceRecord::TRAP) != !!(r.flags & cosim_record::TRAP))
+			return mismatch(r, "trap differs");
+		if (!(r.flags & cosim_record::TRAP)) {
+			uint t_rd = t.flags & TraceRecord::RD ? t.rd : 0;
+			if (t_rd != r.rd)
+				return mismatch(r, "destination register differs");
+			if (r.rd != 0 && t.rd_wdata != r.rd_wdata) {
+				if (!(io.accessed || reads_timing_csr(t.instr)))
+					return mismatch(r, "register write data differs");
+				c.regs[r.rd] = r.rd_wdata;
+			}
+		}
+		history[history_next] = std::make_pair(r, t);
+		history_next = (history_next + 1) % HISTORY_SIZE;
+		++n_checked;
+		if (coverage)
+			coverage->record(t);
+		return true;
+	}
+
+	static bool reads_timing_csr(uint32_t instr) {
+		if ((instr & 0x7f) != 0x73 || (instr >> 12 & 0x7) == 0)
+			return false;
+		uint32_t csr = instr >> 20;
+		return csr == CSR_MIP || csr == CSR_HAZARD3_MEIPA || csr == CSR_HAZARD3_MEINEXT ||
+			(csr >= CSR_MCYCLE && csr <= CSR_MHPMCOUNTER31) ||
+			(csr >= CSR_MCYCLEH && csr <= CSR_MHPMCOUNTER31H) ||
+			(csr >= CSR_CYCLE && csr <= CSR_HPMCOUNTER31) ||
+			(csr >= CSR_CYCLEH && csr <= CSR_HPMCOUNTER31H);
+	}
+
+	void print_rtl(const cosim_record &r) {
+		fprintf(out, "  RTL:   cycle " I64_FMT ": pc %08x", r.cycle, r.pc);
+		if (r.rd && !(r.flags & cosim_record::TRAP))
+			fprintf(out, ", x%-2u <- %08x", r.rd, r.rd_wdata);
+		if (r.flags & cosim_record::TRAP)
+			fprintf(out, ", trap");
+		if (r.flags & cosim_record::INTR)
+			fprintf(out, ", first instruction after interrupt");
+		fprintf(out, "\n");
+	}
+
+	bool mismatch(const cosim_record &r, const char *reason) {
+		fprintf(out, "Co-simulation mismatch after %lu instructions: %s\n", (unsigned long)n_checked, reason);
+		size_t n_history = std::min<uint64_t>(n_checked, HISTORY_SIZE);
+		if (n_history > 0)
+			fprintf(out, "Previous instructions:\n");
+		for (size_t i = 0; i < n_history; ++i) {
+			auto &h = history[(history_next + HISTORY_SIZE - n_history + i) % HISTORY_SIZE];
+			print_rtl(h.first);
+			fprintf(out, "  rvcpp: ");
+			trace_render_text(out, h.second);
+		}
+		fprintf(out, "Mismatching instruction:\n");
+		print_rtl(r);
+		fprintf(out, "  rvcpp: ");
+		trace_render_text(out, sink.last);
+		return false;
+	}
+};
+
+// One --fuzz iteration: the program to load in place of --bin, and the
+// coverage maps which its run adds to
+struct fuzz_run {
+	const std::vector<uint8_t> *program;
+	FuzzCoverage *coverage;
+	// RTL coverage with --coverage, kept across runs
+	coverage_map *rtl_coverage;
+};
+
+#endif
+
+// -----------------------------------------------------------------------------
+// Retirement monitors (--btrace, --csr-profile, --irq-latency)
+
+// Branch trace (--btrace), for hart 0, from the instructions reported by
+// hazard3_cosim_monitor.vh. Each retired instruction is compared with where
+// the previous one would have gone next, and only the differences are
+// recorded (see tb_btrace.h). Instructions are read back from memory, to
+// tell whether a discontinuity needs its target recorded.
+struct btrace_monitor {
+	btrace_writer writer;
+	const cxxrtl::chunk_t *valid, *pc, *trap, *intr;
+	bool started;
+	uint32_t last_pc;
+	uint32_t last_instr;
+	bool last_trap;
+	// Instructions retired since the last packet
+	uint64_t n;
+	uint64_t instructions;
+
+	btrace_monitor(): valid(nullptr), pc(nullptr), trap(nullptr), intr(nullptr), started(false), last_pc(0),
+		last_instr(0), last_trap(false), n(0), instructions(0) {}
+
+	bool init(tb_dut &dut, const std::string &path) {
+		const cxxrtl::debug_items &items = dut.debug_info();
+		std::string prefix = items.table.count("cpu core cosim_valid") ? "cpu core " : "cpu0 core ";
+		auto find = [&](const char *name) -> const cxxrtl::chunk_t* {
+			auto it = items.table.find(prefix + name);
+			return it == items.table.end() ? nullptr : it->second[0].curr;
+		};
+		valid = find("cosim_valid");
+		pc = find("cosim_pc");
+		trap = find("cosim_trap");
+		intr = find("cosim_intr");
+		if (!(valid && pc && trap && intr)) {
+			std::cerr << "Retirement monitor not found in design\n";
+			return false;
+		}
+		if (!writer.open(path)) {
+			std::cerr << "Failed to open \"" << path << "\"\n";
+			return false;
+		}
+		return true;
+	}
+
+	// Call after each rising clock edge
+	void sample(const mem_io_state &memio) {
+		if (!*valid)
+			return;
+		uint32_t p = *pc;
+		if (!started) {
+			writer.start(p);
+			started = true;
+		} else if (*intr) {
+			emit(BTRACE_INTERRUPT, p);
+		} else if (last_trap) {
+			emit(BTRACE_EXCEPTION, p);
+		} else if (p != last_pc + btrace_instr_len(last_instr)) {
+			uint32_t target;
+			if (btrace_direct_target(last_instr, last_pc, target) && target == p)
+				emit(BTRACE_DIRECT, p);
+			else
+				emit(BTRACE_JUMP, p);
+		}
+		++n;
+		++instructions;
+		last_pc = p;
+		last_trap = *trap;
+		last_instr = 0;
+		if (p <= (uint32_t)MEM_SIZE - 4)
+			memcpy(&last_instr, memio.mem + p, sizeof(last_instr));
+	}
+
+	void close() {
+		if (started)
+			writer.packet(BTRACE_END, n);
+		writer.close();
+	}
+
+	void print(FILE *f) const {
+		uint64_t branches = writer.packets ? writer.packets - 1 : 0;
+		fprintf(f, "Branch trace: %" PRIu64 " instructions, %" PRIu64 " discontinuities, %" PRIu64 " bytes "
+			"(%.2f bits per instruction, %.2f bytes per discontinuity)\n", instructions, branches, writer.bytes,
+			instructions ? 8.0 * writer.bytes / instructions : 0.0, branches ? (double)writer.bytes / branches : 0.0);
+	}
+
+private:
+	void emit(btrace_kind kind, uint32_t target) {
+		writer.packet(kind, n, target, last_pc);
+		n = 0;
+	}
+};
+
+// CSR access and trap entry profile (--csr-profile), for hart 0, from the
+// instructions reported by hazard3_cosim_monitor.vh: CSR instructions are
+// read back from memory and decoded, and trap entries are counted from
+// mcause and mepc when the first instruction of the handler retires.
+struct csr_profile_monitor {
+	CsrProfile profile;
+	const cxxrtl::chunk_t *valid, *pc, *trap, *intr, *mcause_irq, *mcause_code, *mepc;
+	bool trap_pending;
+
+	csr_profile_monitor(): valid(nullptr), pc(nullptr), trap(nullptr), intr(nullptr), mcause_irq(nullptr),
+		mcause_code(nullptr), mepc(nullptr), trap_pending(false) {}
+
+	bool init(tb_dut &dut) {
+		const cxxrtl::debug_items &items = dut.debug_info();
+		std::string prefix = items.table.count("cpu core cosim_valid") ? "cpu core " : "cpu0 core ";
+		auto find = [&](const char *name) -> const cxxrtl::chunk_t* {
+			auto it = items.table.find(prefix + name);
+			return it == items.table.end() ? nullptr : it->second[0].curr;
+		};
+		valid = find("cosim_valid");
+		pc = find("cosim_pc");
+		trap = find("cosim_trap");
+		intr = find("cosim_intr");
+		mcause_irq = find("csr_u mcause_irq");
+		mcause_code = find("csr_u mcause_code");
+		mepc = find("csr_u mepc");
+		if (!(valid && pc && trap && intr && mcause_irq && mcause_code && mepc)) {
+			std::cerr << "Retirement monitor not found in design\n";
+			return false;
+		}
+		return true;
+	}
+
+	// Call after each rising clock edge
+	void sample(const mem_io_state &memio) {
+		if (!*valid)
+			return;
+		if (trap_pending || *intr)
+			profile.trap((uint32_t)(*mcause_irq & 0x1u) << 31 | (*mcause_code & 0xfu), *mepc);
+		uint32_t p = *pc;
+		trap_pending = *trap;
+		if (p <= (uint32_t)MEM_SIZE - 4) {
+			uint32_t instr;
+			memcpy(&instr, memio.mem + p, sizeof(instr));
+			profile.instr(instr, trap_pending);
+		}
+	}
+};
+
+// Interrupt latency (--irq-latency), for hart 0: cycles from the rising edge
+// of each IRQ input (as seen by the core) to the core entering the trap
+// vector, and to the handler being dispatched. For timer and soft IRQs the
+// handler is whatever retires first at the vector. For external IRQs, if
+// the ELF has the _external_irq_table of common/irq_dispatch.S, it is the
+// first retirement at the line's entry in the table, so this includes the
+// dispatch code. A line which falls again before any interrupt is taken is
+// dropped, as Xh3irq only sees it while high.
+struct irq_latency_monitor {
+	static const int N_EXT = 32;
+	static const int LINE_SOFT = N_EXT;
+	static const int LINE_TIMER = N_EXT + 1;
+	static const int N_LINES = N_EXT + 2;
+	static const int64_t NONE = -1;
+
+	struct line_state {
+		// Cycles of the pending edge, and of its trap entry, or NONE
+		int64_t edge;
+		int64_t entered;
+		uint64_t count, dispatched, dropped;
+		int64_t entry_min, entry_max, dispatch_min, dispatch_max;
+		uint64_t entry_sum, dispatch_sum;
+		// Buckets of dispatch latency, or entry latency if not dispatched
+		std::map<int64_t, uint64_t> histogram;
+		line_state(): edge(NONE), entered(NONE), count(0), dispatched(0), dropped(0),
+			entry_min(INT64_MAX), entry_max(0), dispatch_min(INT64_MAX), dispatch_max(0),
+			entry_sum(0), dispatch_sum(0) {}
+	};
+
+	int64_t bucket;
+	const cxxrtl::chunk_t *valid, *pc, *intr, *irq_enter, *mcause_code;
+	// Address of _external_irq_table, if any
+	bool table_en;
+	uint32_t table;
+	uint32_t last_irq;
+	bool last_soft, last_timer;
+	// Lines whose interrupt was taken, waiting for the handler
+	uint64_t awaiting;
+	line_state lines[N_LINES];
+
+	explicit irq_latency_monitor(int64_t bucket_): bucket(bucket_), valid(nullptr), pc(nullptr), intr(nullptr),
+		irq_enter(nullptr), mcause_code(nullptr), table_en(false), table(0), last_irq(0), last_soft(false),
+		last_timer(false), awaiting(0) {}
+
+	bool init(tb_dut &dut) {
+		const cxxrtl::debug_items &items = dut.debug_info();
+		// Hart 0 only, on multicore tb
+		std::string prefix = items.table.count("cpu core cosim_valid") ? "cpu core " : "cpu0 core ";
+		auto find = [&](const char *name) -> const cxxrtl::chunk_t* {
+			auto it = items.table.find(prefix + name);
+			return it == items.table.end() ? nullptr : it->second[0].curr;
+		};
+		valid = find("cosim_valid");
+		pc = find("cosim_pc");
+		intr = find("cosim_intr");
+		irq_enter = find("cosim_irq_enter");
+		mcause_code = find("csr_u mcause_code");
+		if (!(valid && pc && intr && irq_enter && mcause_code)) {
+			std::cerr << "Retirement monitor not found in design\n";
+			return false;
+		}
+		return true;
+	}
+
+	// Call after each rising clock edge
+	void sample(tb_dut &dut, const mem_io_state &memio, int64_t cycle) {
+		uint32_t irq = dut.irq.get();
+		bool soft = dut.soft_irq.get() & 1u;
+		bool timer = dut.timer_irq.get() & 1u;
+		if (irq != last_irq || soft != last_soft || timer != last_timer) {
+			for (int i = 0; i < N_EXT; ++i)
+				edge(i, irq >> i & 1u, last_irq >> i & 1u, cycle);
+			edge(LINE_SOFT, soft, last_soft, cycle);
+			edge(LINE_TIMER, timer, last_timer, cycle);
+			last_irq = irq;
+			last_soft = soft;
+			last_timer = timer;
+		}
+
+		if (*irq_enter) {
+			// Standard cause numbers, as mcause
+			uint32_t cause = *mcause_code & 0xfu;
+			if (cause == 11) {
+				for (int i = 0; i < N_EXT; ++i)
+					enter(i, cycle, table_en);
+			} else if (cause == 3) {
+				enter(LINE_SOFT, cycle, true);
+			} else if (cause == 7) {
+				enter(LINE_TIMER, cycle, true);
+			}
+		}
+
+		if (!awaiting || !*valid)
+			return;
+		if (*intr) {
+			dispatch(LINE_SOFT, cycle);
+			dispatch(LINE_TIMER, cycle);
+		}
+		for (int i = 0; i < N_EXT; ++i) {
+			uint32_t entry = table + 4 * i;
+			if ((awaiting >> i & 1u) && entry <= (uint32_t)MEM_SIZE - 4 && le_load32(memio.mem + entry) == *pc)
+				dispatch(i, cycle);
+		}
+	}
+
+	void edge(int i, bool now, bool before, int64_t cycle) {
+		line_state &l = lines[i];
+		if (now && !before && l.edge == NONE) {
+			l.edge = cycle;
+		} else if (!now && before && l.edge != NONE && l.entered == NONE) {
+			l.edge = NONE;
+			++l.dropped;
+		}
+	}
+
+	// If wait, the line's latency is complete once its handler is dispatched
+	void enter(int i, int64_t cycle, bool wait) {
+		line_state &l = lines[i];
+		if (l.edge == NONE || l.entered != NONE)
+			return;
+		l.entered = cycle;
+		int64_t t = cycle - l.edge;
+		++l.count;
+		l.entry_sum += t;
+		l.entry_min = std::min(l.entry_min, t);
+		l.entry_max = std::max(l.entry_max, t);
+		if (wait) {
+			awaiting |= 1ull << i;
+		} else {
+			++l.histogram[t / bucket];
+			l.edge = l.entered = NONE;
+		}
+	}
+
+	void dispatch(int i, int64_t cycle) {
+		line_state &l = lines[i];
+		if (!(awaiting >> i & 1u))
+			return;
+		awaiting &= ~(1ull << i);
+		int64_t t = cycle - l.edge;
+		++l.dispatched;
+		l.dispatch_sum += t;
+		l.dispatch_min = std::min(l.dispatch_min, t);
+		l.dispatch_max = std::max(l.dispatch_max, t);
+		++l.histogram[t / bucket];
+		l.edge = l.entered = NONE;
+	}
+
+	void print(FILE *f) const {
+		fprintf(f, "IRQ latency, in cycles from rising edge:\n");
+		for (int i = 0; i < N_LINES; ++i) {
+			const line_state &l = lines[i];
+			if (!l.count && !l.dropped)
+				continue;
+			char name[16];
+			if (i == LINE_SOFT)
+				snprintf(name, sizeof(name), "soft");
+			else if (i == LINE_TIMER)
+				snprintf(name, sizeof(name), "timer");
+			else
+				snprintf(name, sizeof(name), "irq %d", i);
+			fprintf(f, "  %s: %" PRIu64 " taken, %" PRIu64 " dropped\n", name, l.count, l.dropped);
+			if (l.count) {
+				fprintf(f, "    Trap entry: min " I64_FMT ", avg %.1f, max " I64_FMT "\n",
+					l.entry_min, (double)l.entry_sum / l.count, l.entry_max);
+			}
+			if (l.dispatched) {
+				fprintf(f, "    Dispatch:   min " I64_FMT ", avg %.1f, max " I64_FMT "\n",
+					l.dispatch_min, (double)l.dispatch_sum / l.dispatched, l.dispatch_max);
+			}
+			for (const auto &it : l.histogram) {
+				fprintf(f, "    %6lld-%-6lld %8" PRIu64 "\n", (long long)(it.first * bucket),
+					(long long)(it.first * bucket + bucket - 1), it.second);
+			}
+		}
+	}
+};
+
+// -----------------------------------------------------------------------------
+// Monitors driven by run() once a cycle: --profile, --bus-stats, --traffic,
+// --power-stats, hang detection, sleep skipping and the --shm-cluster barrier
+
+#include "tb_monitor.h"
+
+// -----------------------------------------------------------------------------
+// Switching activity (--toggle)
+
+// Counts the toggles of the selected debug items at the end of every cycle,
+// by XOR with their values on the last cycle and a popcount, a chunk at a
+// time, and the cycles each bit spends high. Outlines (nets which CXXRTL
+// computes on demand) are evaluated first. Counts are kept per IO_ROI region,
+// with region 0 outside any region, and written out at exit as SAIF, for the
+// whole run and then for each region. A multi-bit net (or memory) is one
+// SAIF net: its TC is the sum over its bits, and T0 and T1 are the means.
+struct toggle_monitor {
+	struct net {
+		std::string name;
+		const cxxrtl::chunk_t *curr;
+		size_t n_chunks;
+		uint64_t n_bits;
+	};
+	struct counts {
+		uint64_t cycles;
+		std::vector<uint64_t> tc;
+		std::vector<uint64_t> t1;
+	};
+	std::vector<net> nets;
+	std::vector<cxxrtl::debug_outline*> outlines;
+	std::vector<cxxrtl::chunk_t> prev;
+	std::map<uint32_t, counts> regions;
+	counts *current;
+
+	toggle_monitor(): current(nullptr) {}
+
+	bool init(tb_dut &dut, const std::vector<std::string> &filters) {
+		const cxxrtl::debug_items &items = dut.debug_info();
+		for (auto &it : items.table) {
+			for (auto &item : it.second) {
+				// Aliases are the same net as another item
+				if (item.type == cxxrtl::debug_item::ALIAS || !hier_match(filters, it.first))
+					continue;
+				if (item.type == cxxrtl::debug_item::OUTLINE &&
+						std::find(outlines.begin(), outlines.end(), item.outline) == outlines.end())
+					outlines.push_back(item.outline);
+				nets.push_back({it.first, item.curr, state_item_chunks(item), (uint64_t)item.width * item.depth});
+			}
+		}
+		if (nets.empty()) {
+			std::cerr << "No debug items match --toggle-filter\n";
+			return false;
+		}
+		size_t n_chunks = 0;
+		for (const net &n : nets)
+			n_chunks += n.n_chunks;
+		prev.resize(n_chunks);
+		capture();
+		set_region(0);
+		return true;
+	}
+
+	// Take the current values as the last cycle's
+	void capture() {
+		for (auto *o : outlines)
+			o->eval();
+		cxxrtl::chunk_t *p = prev.data();
+		for (const net &n : nets) {
+			memcpy(p, n.curr, n.n_chunks * sizeof(*p));
+			p += n.n_chunks;
+		}
+	}
+
+	void set_region(uint32_t roi) {
+		current = &regions[roi];
+		if (current->tc.empty()) {
+			current->cycles = 0;
+			current->tc.resize(nets.size(), 0);
+			current->t1.resize(nets.size(), 0);
+		}
+	}
+
+	// Call at the end of each counted cycle
+	void sample() {
+		for (auto *o : outlines)
+			o->eval();
+		cxxrtl::chunk_t *p = prev.data();
+		uint64_t *tc = current->tc.data();
+		uint64_t *t1 = current->t1.data();
+		for (size_t i = 0; i < nets.size(); ++i) {
+			const cxxrtl::chunk_t *c = nets[i].curr;
+			uint64_t toggles = 0, ones = 0;
+			for (size_t k = 0; k < nets[i].n_chunks; ++k) {
+				toggles += __builtin_popcount(c[k] ^ p[k]);
+				ones += __builtin_popcount(c[k]);
+				p[k] = c[k];
+			}
+			p += nets[i].n_chunks;
+			tc[i] += toggles;
+			t1[i] += ones;
+		}
+		++current->cycles;
+	}
+
+	// Writes `path` for the whole run, and for each region n, the same with
+	// .roi<n> before its extension
+	bool write(const std::string &path) const {
+		counts total;
+		total.cycles = 0;
+		total.tc.resize(nets.size(), 0);
+		total.t1.resize(nets.size(), 0);
+		for (auto &it : regions) {
+			total.cycles += it.second.cycles;
+			for (size_t i = 0; i < nets.size(); ++i) {
+				total.tc[i] += it.second.tc[i];
+				total.t1[i] += it.second.t1[i];
+			}
+		}
+		if (!write_saif(path, total))
+			return false;
+		size_t dot = path.find_last_of('.');
+		if (dot == std::string::npos || path.find('/', dot) != std::string::npos)
+			dot = path.size();
+		for (auto &it : regions) {
+			std::string region_path = path.substr(0, dot) + ".roi" + std::to_string(it.first) + path.substr(dot);
+			if (it.first != 0 && !write_saif(region_path, it.second))
+				return false;
+		}
+		return true;
+	}
+
+	void print(FILE *f) const {
+		fprintf(f, "Toggles: %zu nets\n  %8s %14s %14s %10s\n", nets.size(), "region", "cycles", "toggles",
+			"per cycle");
+		for (auto &it : regions) {
+			uint64_t toggles = 0;
+			for (uint64_t x : it.second.tc)
+				toggles += x;
+			if (it.first == 0 && it.second.cycles == 0)
+				continue;
+			fprintf(f, "  %8u %14" PRIu64 " %14" PRIu64 " %10.2f\n", it.first, it.second.cycles, toggles,
+				it.second.cycles ? (double)toggles / it.second.cycles : 0.0);
+		}
+	}
+
+private:
+	// SAIF nets sit in a tree of instances, from the spaces in the names
+	struct scope {
+		std::map<std::string, scope> children;
+		std::vector<std::pair<std::string, size_t>> nets;
+	};
+
+	static std::string saif_name(const std::string &name) {
+		std::string escaped;
+		for (char c : name) {
+			if (!(isalnum((unsigned char)c) || c == '_'))
+				escaped += '\\';
+			escaped += c;
+		}
+		return escaped;
+	}
+
+	void write_scope(std::ostream &f, const scope &sc, const counts &c, int depth) const {
+		std::string indent(depth, '\t');
+		if (!sc.nets.empty()) {
+			f << indent << "(NET\n";
+			for (auto &n : sc.nets) {
+				uint64_t t1 = c.t1[n.second] / nets[n.second].n_bits;
+				f << indent << "\t(" << saif_name(n.first) << " (T0 " << c.cycles - t1 << ") (T1 " << t1 <<
+					") (TC " << c.tc[n.second] << "))\n";
+			}
+			f << indent << ")\n";
+		}
+		for (auto &it : sc.children) {
+			f << indent << "(INSTANCE " << saif_name(it.first) << "\n";
+			write_scope(f, it.second, c, depth + 1);
+			f << indent << ")\n";
+		}
+	}
+
+	// Time is in cycles
+	bool write_saif(const std::string &path, const counts &c) const {
+		std::ofstream f(path);
+		if (!f.is_open())
+			return false;
+		scope top;
+		for (size_t i = 0; i < nets.size(); ++i) {
+			scope *sc = &top;
+			std::string name = nets[i].name;
+			for (size_t sp; (sp = name.find(' ')) != std::string::npos; name = name.substr(sp + 1))
+				sc = &sc->children[name.substr(0, sp)];
+			sc->nets.push_back(std::make_pair(name, i));
+		}
+		f << "(SAIFILE\n(SAIFVERSION \"2.0\")\n(DIRECTION \"backward\")\n(DESIGN \"tb\")\n"
+			"(PROGRAM_NAME \"tb\")\n(DIVIDER / )\n(TIMESCALE 1 ns)\n(DURATION " << c.cycles << ")\n"
+			"(INSTANCE tb\n";
+		write_scope(f, top, c, 1);
+		f << ")\n)\n";
+		return f.good();
+	}
+};
+
+// -----------------------------------------------------------------------------
+// RTL coverage (--coverage)
+
+// Toggle coverage of the items selected by --coverage-filter, and FSM
+// coverage of those selected by --cover-fsm, sampled at the end of every
+// cycle into a coverage_map (tb_coverage.h). Rises and falls are found a
+// chunk at a time against the last cycle's values, as for --toggle. An FSM
+// is any small register: its value is its state, so counters and one-hot
+// vectors work too.
+struct coverage_monitor {
+	struct toggle_source {
+		const cxxrtl::chunk_t *curr;
+		size_t n_chunks;
+		size_t set;
+	};
+	struct fsm_source {
+		const cxxrtl::chunk_t *curr;
+		size_t set;
+		uint32_t prev;
+	};
+	std::vector<toggle_source> toggle_sources;
+	std::vector<fsm_source> fsm_sources;
+	std::vector<cxxrtl::debug_outline*> outlines;
+	std::vector<cxxrtl::chunk_t> prev;
+	coverage_map *map;
+
+	coverage_monitor(): map(nullptr) {}
+
+	// Builds the sets in `m`, or if it has them already (an earlier --fuzz
+	// run), checks they match so that this run adds to them
+	bool init(tb_dut &dut, const std::vector<std::string> &toggle_filters,
+			const std::vector<std::string> &fsm_filters, coverage_map &m) {
+		coverage_map selected;
+		const cxxrtl::debug_items &items = dut.debug_info();
+		for (auto &it : items.table) {
+			for (auto &item : it.second) {
+				if (item.type == cxxrtl::debug_item::ALIAS)
+					continue;
+				bool toggle = hier_match(toggle_filters, it.first);
+				bool fsm = !fsm_filters.empty() && hier_match(fsm_filters, it.first);
+				if (fsm && (item.depth != 1 || item.width > coverage_set::FSM_MAX_WIDTH)) {
+					std::cerr << "Warning: not covering \"" << it.first << "\" as an FSM, as it is wider than " <<
+						coverage_set::FSM_MAX_WIDTH << " bits or a memory\n";
+					fsm = false;
+				}
+				if (!(toggle || fsm))
+					continue;
+				if (item.type == cxxrtl::debug_item::OUTLINE &&
+						std::find(outlines.begin(), outlines.end(), item.outline) == outlines.end())
+					outlines.push_back(item.outline);
+				if (toggle) {
+					size_t n_chunks = state_item_chunks(item);
+					toggle_sources.push_back({item.curr, n_chunks, selected.sets.size()});
+					selected.sets.emplace_back(coverage_set::TOGGLE, it.first, item.width * item.depth, n_chunks);
+				}
+				if (fsm) {
+					fsm_sources.push_back({item.curr, selected.sets.size(), 0});
+					selected.sets.emplace_back(coverage_set::FSM, it.first, item.width, 0);
+				}
+			}
+		}
+		if (toggle_sources.empty() && fsm_sources.empty()) {
+			std::cerr << "No debug items match --coverage-filter or --cover-fsm\n";
+			return false;
+		}
+		if (!fsm_filters.empty() && fsm_sources.empty()) {
+			std::cerr << "No debug items match --cover-fsm\n";
+			return false;
+		}
+		if (m.sets.empty()) {
+			m = selected;
+		} else if (!m.matches(selected)) {
+			std::cerr << "Coverage points differ from the earlier run's\n";
+			return false;
+		}
+		map = &m;
+		size_t n_chunks = 0;
+		for (const toggle_source &t : toggle_sources)
+			n_chunks += t.n_chunks;
+		prev.resize(n_chunks);
+		for (auto *o : outlines)
+			o->eval();
+		cxxrtl::chunk_t *p = prev.data();
+		for (const toggle_source &t : toggle_sources) {
+			memcpy(p, t.curr, t.n_chunks * sizeof(*p));
+			p += t.n_chunks;
+		}
+		for (fsm_source &f : fsm_sources)
+			f.prev = f.curr[0];
+		return true;
+	}
+
+	// Call at the end of each cycle
+	void sample() {
+		for (auto *o : outlines)
+			o->eval();
+		cxxrtl::chunk_t *p = prev.data();
+		for (const toggle_source &t : toggle_sources) {
+			coverage_set &s = map->sets[t.set];
+			uint32_t *rose = s.bits.data();
+			uint32_t *fell = rose + s.n_words;
+			for (size_t k = 0; k < t.n_chunks; ++k) {
+				cxxrtl::chunk_t x = t.curr[k];
+				rose[k] |= x & ~p[k];
+				fell[k] |= ~x & p[k];
+				p[k] = x;
+			}
+			p += t.n_chunks;
+		}
+		for (fsm_source &f : fsm_sources) {
+			coverage_set &s = map->sets[f.set];
+			uint32_t v = f.curr[0];
+			s.mark(v);
+			if (s.has_transitions() && v != f.prev)
+				s.mark((1ull << s.width) + ((uint64_t)f.prev << s.width | v));
+			f.prev = v;
+		}
+	}
+};
+
+// -----------------------------------------------------------------------------
+// Progress reports
+
+// A report is printed to stderr every --progress n seconds, and whenever the
+// process gets SIGUSR1. With --progress-socket x, each connection to Unix
+// socket x is also sent one report as JSON, and then closed.
+//
+// Reports only read counters which the simulation keeps anyway: the cycle
+// count, bus transfers, and each hart's minstret, M-mode bit and retired pc
+// (or fetch address, without the retirement monitor). The main loop's only
+// cost is comparing the cycle count against progress_request, which the
+// signal handler and the reporter's threads set to 0 to ask for a report.
+static std::atomic<int64_t> progress_request(INT64_MAX);
+
+static void progress_signal(int) {
+	progress_request.store(0, std::memory_order_relaxed);
+}
+
+struct progress_reporter {
+	struct hart_items {
+		const cxxrtl::chunk_t *minstret, *minstreth, *m_mode, *pc;
+		uint64_t last_instret;
+	};
+	std::vector<hart_items> harts;
+	int hart_base;
+	int n_ports;
+	// Counters at the previous report, for the rates
+	std::chrono::steady_clock::time_point last_time;
+	int64_t last_cycle;
+	uint64_t last_transfers;
+
+	int interval;
+	int server_fd;
+	std::string socket_path;
+	std::thread heartbeat_thread, socket_thread;
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool stopping;
+	// Reports for the socket, counted so that a connection waits for one
+	// made after it arrived
+	std::string json;
+	uint64_t json_count;
+
+	progress_reporter(): hart_base(0), n_ports(0), last_cycle(0), last_transfers(0), interval(0),
+		server_fd(-1), stopping(false), json_count(0) {}
+
+	~progress_reporter() {
+		stop();
+	}
+
+	// Harts are found by their minstret. Without one, only the cycle and bus
+	// counts are reported.
+	bool start(tb_dut &dut, const mem_io_state &memio, int n_ports_, int64_t cycle,
+			int interval_, const std::string &socket_path_) {
+		const cxxrtl::debug_items &items = dut.debug_info();
+		const std::string suffix = "csr_u minstret";
+		for (auto &it : items.table) {
+			const std::string &name = it.first;
+			if (name.size() < suffix.size() || name.compare(name.size() - suffix.size(), suffix.size(), suffix))
+				continue;
+			std::string prefix = name.substr(0, name.size() - suffix.size());
+			auto find = [&](const std::string &n) -> const cxxrtl::chunk_t* {
+				auto i = items.table.find(prefix + n);
+				return i == items.table.end() ? nullptr : i->second[0].curr;
+			};
+			hart_items h;
+			h.minstret = it.second[0].curr;
+			h.minstreth = find("csr_u minstreth");
+			h.m_mode = find("csr_u m_mode");
+			h.pc = find("cosim_pc");
+			if (!h.pc)
+				h.pc = find("frontend fetch_addr");
+			h.last_instret = 0;
+			harts.push_back(h);
+		}
+		hart_base = memio.hart_base;
+		n_ports = n_ports_;
+		last_time = std::chrono::steady_clock::now();
+		last_cycle = cycle;
+		last_transfers = memio.transfers;
+		for (hart_items &h : harts)
+			h.last_instret = instret(h);
+
+		signal(SIGUSR1, progress_signal);
+		interval = interval_;
+		if (interval > 0)
+			heartbeat_thread = std::thread([this] {heartbeat();});
+		if (!socket_path_.empty()) {
+			server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+			struct sockaddr_un addr;
+			memset(&addr, 0, sizeof(addr));
+			addr.sun_family = AF_UNIX;
+			if (server_fd < 0 || socket_path_.size() >= sizeof(addr.sun_path)) {
+				std::cerr << "Can't create progress socket \"" << socket_path_ << "\"\n";
+				return false;
+			}
+			strcpy(addr.sun_path, socket_path_.c_str());
+			unlink(addr.sun_path);
+			if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(server_fd, 4) < 0) {
+				std::cerr << "Can't listen on progress socket \"" << socket_path_ << "\"\n";
+				return false;
+			}
+			socket_path = socket_path_;
+			socket_thread = std::thread([this] {serve();});
+		}
+		return true;
+	}
+
+	// Called from the main loop once cycle reaches progress_request
+	void report(int64_t cycle, const mem_io_state &memio) {
+		progress_request.store(INT64_MAX, std::memory_order_relaxed);
+		auto now = std::chrono::steady_clock::now();
+		double secs = std::chrono::duration<double>(now - last_time).count();
+		double rate = secs > 0 ? 1.0 / secs : 0.0;
+		int64_t cycles = cycle - last_cycle;
+		uint64_t transfers = memio.transfers - last_transfers;
+		double bus = cycles > 0 && n_ports ? 100.0 * transfers / ((double)cycles * n_ports) : 0.0;
+
+		char buf[256];
+		snprintf(buf, sizeof(buf), "Progress: cycle " I64_FMT ", %.1f kHz, bus %.1f%%", cycle,
+			cycles * rate * 1e-3, bus);
+		std::string text = buf;
+		snprintf(buf, sizeof(buf), "{\"cycle\": " I64_FMT ", \"khz\": %.3f, \"bus_utilisation\": %.2f, \"harts\": [",
+			cycle, cycles * rate * 1e-3, bus);
+		std::string js = buf;
+		for (size_t i = 0; i < harts.size(); ++i) {
+			hart_items &h = harts[i];
+			uint64_t n = instret(h);
+			double mips = (n - h.last_instret) * rate * 1e-6;
+			uint32_t pc = h.pc ? *h.pc : 0;
+			const char *priv = !h.m_mode ? "?" : *h.m_mode ? "M" : "U";
+			snprintf(buf, sizeof(buf), "; hart %d: minstret %" PRIu64 ", %.2f MIPS, pc %08x, %s-mode",
+				hart_base + (int)i, n, mips, pc, priv);
+			text += buf;
+			snprintf(buf, sizeof(buf), "%s{\"hart\": %d, \"minstret\": %" PRIu64 ", \"mips\": %.3f, "
+				"\"pc\": %u, \"priv\": \"%s\"}", i ? ", " : "", hart_base + (int)i, n, mips, pc, priv);
+			js += buf;
+			h.last_instret = n;
+		}
+		js += "]}\n";
+		fprintf(stderr, "%s\n", text.c_str());
+		last_time = now;
+		last_cycle = cycle;
+		last_transfers = memio.transfers;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		json = js;
+		++json_count;
+		cond.notify_all();
+	}
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (stopping)
+				return;
+			stopping = true;
+			cond.notify_all();
+		}
+		if (heartbeat_thread.joinable())
+			heartbeat_thread.join();
+		if (server_fd >= 0) {
+			// Wakes the socket thread from accept()
+			shutdown(server_fd, SHUT_RDWR);
+			if (socket_thread.joinable())
+				socket_thread.join();
+			close(server_fd);
+			if (!socket_path.empty())
+				unlink(socket_path.c_str());
+		}
+		signal(SIGUSR1, SIG_DFL);
+	}
+
+private:
+	static uint64_t instret(const hart_items &h) {
+		return (h.minstreth ? (uint64_t)*h.minstreth << 32 : 0) | *h.minstret;
+	}
+
+	void heartbeat() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!cond.wait_for(lock, std::chrono::seconds(interval), [this] {return stopping;}))
+			progress_request.store(0, std::memory_order_relaxed);
+	}
+
+	void serve() {
+		while (true) {
+			int fd = accept(server_fd, nullptr, nullptr);
+			if (fd < 0)
+				return;
+			std::string reply;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				uint64_t want = json_count + 1;
+				progress_request.store(0, std::memory_order_relaxed);
+				cond.wait(lock, [&] {return stopping || json_count >= want;});
+				reply = json;
+			}
+			size_t pos = 0;
+			while (pos < reply.size()) {
+				ssize_t n = send(fd, reply.data() + pos, reply.size() - pos, MSG_NOSIGNAL);
+				if (n <= 0)
+					break;
+				pos += n;
+			}
+			close(fd);
+		}
+	}
+};
+
+// -----------------------------------------------------------------------------
+
+const char *help_str =
+"Usage: tb [--bin x.bin | --elf x.elf] [--fast-boot] [--port n] [--vcd x.vcd] [--dump start end] [--signature x] \\\n"
+"          [--vcd-filter x] [--vcd-cycles start end] [--vcd-pc start end] [--vcd-io] \\\n"
+"          [--flight x.vcd n] [--cosim] \\\n"
+"          [--profile x [--profile-interval n] [--profile-calls]] [--irq-latency [--irq-latency-bucket n]] \\\n"
+"          [--cycles n] [--cpuret] [--no-hang-detect] [--fast] [--no-skip-sleep] [--jtagdump x] [--jtagreplay x] [--jtag-edges n] \\\n"
+"          [--dmi-port n] [--semihost] [--record-inputs x] [--replay-inputs x] [--stimulus x] [--stimulus-random seed interval mask] \\\n"
+"          [--save-state x [--save-cycle n] [--save-io addr]] [--restore-state x] \\\n"
+"          [--restore-arch x] [--sample-warmup n] [--sample-measure n] \\\n"
+"          [--waitstates ports start end nonseq seq] [--contention] [--traffic start end bw burst pattern prio]\n"
+"          [--xip start end flash fill] [--icache ways sets line] [--ahb-trace x] [--btrace x] [--csr-profile]\n"
+"          [--bus-stats] [--roi]\n"
+"          [--power-stats] [--toggle x [--toggle-filter x]] [--coverage x [--coverage-filter x] [--cover-fsm x]] \\\n"
+"          [--progress n] [--progress-socket x]\n"
+"       tb --coverage-merge out in...\n"
+"\n"
+"    --bin x.bin      : Flat binary file loaded to address 0x0 in RAM\n"
+"    --elf x.elf      : ELF file loaded into RAM. If the entry point is not the\n"
+"                       reset vector, a jump to it is placed at the reset vector.\n"
+"                       A `tohost` symbol, if present, is used to exit as in\n"
+"                       riscv-tests.\n"
+"    --fast-boot      : Tell software, through IO_FAST_BOOT, that the --bin or\n"
+"                       --elf file was loaded with .data in place and .bss\n"
+"                       zeroed (RAM starts out zero), so that common/init.S\n"
+"                       skips clearing .bss. Cold boot is the default.\n"
+"    --vcd x.vcd      : Path to dump waveforms to. A path ending in .fst is written\n"
+"                       in FST format, through gtkwave's vcd2fst.\n"
+"    --vcd-filter x   : Only dump signals whose hierarchical name matches glob x,\n"
+"                       e.g. 'cpu.core.*'. Can be passed multiple times.\n"
+"    --vcd-cycles start end\n"
+"                     : Only dump waveforms from cycle start to end (exclusive)\n"
+"    --vcd-pc start end\n"
+"                     : Only dump waveforms while the most recent instruction\n"
+"                       fetch address is from start to end (exclusive)\n"
+"    --vcd-io         : Only dump waveforms after software writes a nonzero\n"
+"                       value to IO_WAVES, and until it writes zero\n"
+"    --flight x.vcd n : Keep the last n cycles of waveforms in memory, and write\n"
+"                       them to x.vcd on the first bus error response, on a\n"
+"                       nonzero exit code, or on reaching --cycles. Uses the\n"
+"                       --vcd-filter signals, without memories.\n"
+"    --cosim          : Run rvcpp's core in lockstep with the RTL, and stop at\n"
+"                       the first retired instruction whose pc, trap or register\n"
+"                       write differs. Requires tb built with `make COSIM=1`.\n"
+"                       Not compatible with --restore-state.\n"
+"    --profile x      : Sample the pc of the most recently retired instruction\n"
+"                       every --profile-interval cycles, and write the profile\n"
+"                       to x in folded stack format (as used by flamegraph.pl),\n"
+"                       symbolised from the --elf file if any. Hart 0 only.\n"
+"    --profile-interval n\n"
+"                     : Cycles between profile samples, default 100\n"
+"    --profile-calls  : Track call stacks for --profile, from calls and returns\n"
+"    --irq-latency    : Measure hart 0's interrupt latency, in cycles from each\n"
+"                       rising edge of an IRQ input to trap entry, and to the\n"
+"                       handler's first instruction (through irq_dispatch.S's\n"
+"                       _external_irq_table, if the --elf file has one), and\n"
+"                       print min/avg/max and a histogram per IRQ at exit\n"
+"    --irq-latency-bucket n\n"
+"                     : Histogram bucket width in cycles, default 4\n"
+"    --heatmap x      : Count bus reads, writes and fetches per block of memory,\n"
+"                       and write the counts and the working-set curve (average\n"
+"                       blocks touched per window of n transfers) to x at exit.\n"
+"                       The same format as rvcpp's, which counts instructions\n"
+"                       rather than fetch transfers.\n"
+"    --heatmap-block n: Heatmap block size in bytes, a power of two from 4 to\n"
+"                       4096, default 64\n"
+"    --ahb-trace x    : Record every bus transfer to x: address phase cycle,\n"
+"                       port, address, size, direction, data and response,\n"
+"                       in binary. ahb_replay plays traces back through other\n"
+"                       --waitstates, --contention and --traffic settings.\n"
+"    --btrace x       : Record hart 0's changes of control flow to x (taken\n"
+"                       branches, jumps, traps and interrupts), with the number\n"
+"                       of instructions between them, in a compact binary\n"
+"                       format. btrace_decode rebuilds the full PC stream from\n"
+"                       it and the program's ELF.\n"
+"    --csr-profile    : Count hart 0's CSR reads and writes per CSR, and trap\n"
+"                       entries per cause and per pc, and print them at exit,\n"
+"                       ranked, as rvcpp --csr-profile does.\n"
+"    --bus-stats      : Count busy, idle and stalled cycles, transfer types and\n"
+"                       sizes, exclusive failures and error responses for each\n"
+"                       bus port, and print them at exit. Ports are numbered\n"
+"                       as in --waitstates.\n"
+"    --bus-stats-series x n\n"
+"                     : As --bus-stats, and also write the counts for every\n"
+"                       window of n cycles to x, in CSV format\n"
+"    --power-stats    : Count each hart's cycles active, in WFI, asleep on\n"
+"                       h3.block, in deep sleep (clock gated) and powered down,\n"
+"                       and its wakes by cause, and print them at exit\n"
+"    --power-stats-series x n\n"
+"                     : As --power-stats, and also write the counts for every\n"
+"                       window of n cycles to x, in CSV format\n"
+"    --toggle x       : Count the toggles of every net selected by --toggle-filter\n"
+"                       at the end of each cycle, and write them to x as SAIF at\n"
+"                       exit, along with x.roi<n> for each region of interest n\n"
+"                       (with .roi<n> before any extension). Multi-bit nets are\n"
+"                       summed over their bits.\n"
+"    --toggle-filter x: Only count nets matching hierarchy glob x for --toggle,\n"
+"                       as for --vcd-filter, e.g. \"cpu.core.*\". Can be passed\n"
+"                       multiple times. Default is every net.\n"
+"    --coverage x     : Record which bits of each net selected by\n"
+"                       --coverage-filter have risen and fallen, and the values\n"
+"                       and transitions of each register selected by --cover-fsm,\n"
+"                       and write them to x at exit with a summary to stdout.\n"
+"                       With --fuzz, programs which reach new coverage also join\n"
+"                       the corpus.\n"
+"    --coverage-filter x\n"
+"                     : Only record toggle coverage of nets matching hierarchy\n"
+"                       glob x, as for --toggle-filter. Can be passed multiple\n"
+"                       times. Default is every net.\n"
+"    --cover-fsm x    : Record the values (up to 16 bits) and transitions (up to\n"
+"                       8 bits) of registers matching hierarchy glob x, e.g.\n"
+"                       \"*.bus_state\". Can be passed multiple times.\n"
+"    --coverage-merge out in...\n"
+"                     : Combine the --coverage files in... from runs of the same\n"
+"                       design and options into out, and print which nets have\n"
+"                       not toggled both ways and the values each FSM has held.\n"
+"                       Must be the first option.\n"
+"    --roi            : Only dump waveforms, profile and count --heatmap,\n"
+"                       --csr-profile, --bus-stats and --toggle while software\n"
+"                       is in a region of interest (a nonzero value written to\n"
+"                       IO_ROI). Per-region cycle, instruction and bus transfer\n"
+"                       counts are printed at exit with or without this.\n"
+"    --progress n     : Print a progress report to stderr every n seconds: the\n"
+"                       cycle count, simulation speed and bus utilisation, and\n"
+"                       each hart's minstret, MIPS, pc and mode. A report is\n"
+"                       also printed on SIGUSR1, with or without this.\n"
+"    --progress-socket x\n"
+"                     : Listen on Unix socket x, and send each connection one\n"
+"                       progress report as a line of JSON\n"
+"    --dump start end : Print out memory contents from start to end (exclusive)\n"
+"                       after execution finishes. Can be passed multiple times.\n"
+"    --dump-check start end x\n"
+"                     : As --expect, and x must be end - start bytes long\n"
+"    --dump-bin start end x\n"
+"                     : Write memory contents from start to end (exclusive) to\n"
+"                       binary file x after execution finishes. Can be passed\n"
+"                       multiple times.\n"
+"    --expect start x : Compare memory from start onwards with binary file x\n"
+"                       after execution finishes, and fail (return code -1, and\n"
+"                       \"dump_check\": false with --batch) if they differ.\n"
+"                       Can be passed multiple times.\n"
+"    --signature x    : Write memory from the --elf file's begin_signature to\n"
+"                       end_signature symbols to binary file x after execution\n"
+"                       finishes, for riscv-arch-test.\n"
+"    --cycles n       : Maximum number of cycles to run before exiting.\n"
+"                       Default is 0 (no maximum).\n"
+"    --port n         : Port number to listen for openocd remote bitbang. Sim\n"
+"                       runs in lockstep with JTAG bitbang, not free-running.\n"
+"    --cpuret         : Testbench's return code is the return code written to\n"
+"                       IO_EXIT by the CPU, -1 if timed out, or -2 if hung.\n"
+"    --no-hang-detect : Keep running until --cycles when a single hart is hung,\n"
+"                       i.e. asleep in WFI or retiring at the same pc over and\n"
+"                       over, with no IRQ input which can change. Hangs are not\n"
+"                       detected with --stimulus events to come, --port,\n"
+"                       --dmi-port, --jtagreplay, --semihost, --shm-cluster, or\n"
+"                       while a --save-state or --restore-arch is pending.\n"
+"    --fast           : Free-running mode tuned for speed, with identical\n"
+"                       cycle behaviour. Idle bus ports are not serviced, and\n"
+"                       the extra settling step after each clock edge is\n"
+"                       dropped if the model is found not to need it. Not\n"
+"                       compatible with --vcd, --port or --jtagreplay.\n"
+"    --no-skip-sleep  : Clock the design through every cycle of clock-gated\n"
+"                       sleep. By default, once all harts are asleep with\n"
+"                       clk_en low, the testbench skips ahead to the next timer\n"
+"                       IRQ, and advances mcycle to match (unless waveforms,\n"
+"                       a debugger, --semihost, --cosim or --save-state are in\n"
+"                       use).\n"
+"    --jtagdump       : Dump OpenOCD JTAG bitbang commands to a file so they\n"
+"                       can be replayed. (Lower perf impact than VCD dumping)\n"
+"                       A path ending in .jtc gets a compact format, with runs\n"
+"                       of repeated commands encoded once, and an index for\n"
+"                       seeking.\n"
+"    --jtagreplay     : Play back some dumped OpenOCD JTAG bitbang commands,\n"
+"                       in either format. With --restore-state, playback\n"
+"                       starts from the snapshot's cycle (quickly, through the\n"
+"                       index of a .jtc dump).\n"
+"    --dmi-port n     : Port number to listen on for direct access to the Debug\n"
+"                       Module's DMI bus, bypassing JTAG, e.g. for fast loading\n"
+"                       through System Bus Access with dmi_client.py. While\n"
+"                       enabled, DMI accesses through JTAG fail. Sim runs\n"
+"                       free, checking the socket every 64 cycles when idle.\n"
+"    --semihost       : Handle RISC-V semihosting calls (console and host file\n"
+"                       I/O, clocks in simulated cycles, and exit) from M-mode,\n"
+"                       through the Debug Module on the direct DMI port, with\n"
+"                       dcsr.ebreakm set. Not compatible with --port,\n"
+"                       --dmi-port, --jtagreplay, --cosim, --save-state or\n"
+"                       --restore-state.\n"
+"    --record-inputs x: Record every input from outside the simulation to file\n"
+"                       x, stamped with the cycle it was taken on: JTAG\n"
+"                       bitbang commands from --port, requests from --dmi-port,\n"
+"                       and the results of --semihost's host calls\n"
+"    --replay-inputs x: Take the inputs recorded by --record-inputs from file x\n"
+"                       instead, on the same cycles, so that the run repeats\n"
+"                       exactly. Pass the other options of the recorded run:\n"
+"                       --port and --dmi-port don't listen, and host calls\n"
+"                       aren't made. Stops if the run diverges from the\n"
+"                       recorded one. With --restore-state, replay starts from\n"
+"                       the snapshot's cycle. Not compatible with --jtagreplay.\n"
+"    --stimulus x     : Set and clear IRQ inputs on the cycles scheduled in file x,\n"
+"                       one \"<cycle> irq|softirq|timer <n> <0|1>\" per line, as\n"
+"                       for rvcpp's --stimulus. \"fault\" and \"exfail\" lines arm\n"
+"                       bus fault injection rules (see rv_stimulus.h), with\n"
+"                       ports numbered as in --ahb-trace.\n"
+"    --stimulus-random seed interval mask\n"
+"                     : Assert random external IRQs from mask, every 1 to\n"
+"                       2 * interval cycles, each held for 1 to interval cycles.\n"
+"                       A seed gives the same IRQs here and in rvcpp.\n"
+"    --jtag-edges n   : Apply up to n JTAG bitbang pin writes per system clock\n"
+"                       cycle, instead of one. The system clock always catches\n"
+"                       up before a TDO read, and DM accesses which don't\n"
+"                       complete in time are retried through DTM busy, so this\n"
+"                       is still correct, just a less exact lockstep. Default 1.\n"
+"    --save-state x   : Save the design, testbench and memory state to file x\n"
+"                       when a --save-* trigger is hit (or at the end of\n"
+"                       --cycles, if there are no triggers)\n"
+"    --save-cycle n   : Save state after n cycles\n"
+"    --save-io addr   : Save state at the end of the first cycle which writes\n"
+"                       to address addr\n"
+"    --restore-state x: Start from the state saved in file x, instead of reset.\n"
+"                       Memory is mapped copy-on-write from the file, and\n"
+"                       --cycles counts from the cycle when the state was saved.\n"
+"    --restore-arch x : Start from the architectural checkpoint in file x, as\n"
+"                       saved by rvcpp's --save-arch, instead of the program's\n"
+"                       own startup. RAM, the timer and the IRQ inputs are\n"
+"                       loaded directly, and hart 0's registers and CSRs\n"
+"                       through the Debug Module on the direct DMI port.\n"
+"    --sample-warmup n: With --sample-measure, instructions to retire before\n"
+"                       measuring, to warm up the microarchitectural state\n"
+"    --sample-measure n\n"
+"                     : Count the cycles hart 0 takes to retire n instructions,\n"
+"                       after --sample-warmup (counting from --restore-arch,\n"
+"                       or from reset), print the CPI, and stop\n"
+"    --waitstates ports start end nonseq seq\n"
+"                     : Insert wait states on accesses from start to end\n"
+"                       (exclusive) by ports i, d or id, or by a list of\n"
+"                       port numbers such as 0,2 (port n is hart n's, in\n"
+"                       multicore topologies): nonseq for a non-sequential\n"
+"                       access, seq for htrans=SEQ or an access following\n"
+"                       on from the port's previous one. Can be passed\n"
+"                       multiple times; the first match wins.\n"
+"    --contention     : Ports accessing the same --waitstates region at the\n"
+"                       same time are serialised, highest-numbered port\n"
+"                       (D port) first.\n"
+"    --traffic start end bw burst pattern prio\n"
+"                     : Background bus master, such as a DMA, moving bursts\n"
+"                       of burst words within start to end (exclusive), for\n"
+"                       bw percent of cycles on average. pattern is linear,\n"
+"                       random or a stride in bytes. Accesses by the core to\n"
+"                       the same range wait for the current word, or with\n"
+"                       prio high (not low) for the whole burst. Words take\n"
+"                       one cycle plus any --waitstates. Memory is not\n"
+"                       changed. Can be passed multiple times. Bandwidth\n"
+"                       and stalls are printed at exit.\n"
+"    --xip start end flash fill\n"
+"                     : Fetch from start to end (exclusive) through an\n"
+"                       instruction cache per port, as for execute-in-place\n"
+"                       flash: a miss waits flash cycles for the first word\n"
+"                       and fill cycles for the rest of the line, on top of\n"
+"                       any --waitstates. Hit rates are printed at exit. The\n"
+"                       cache starts cold after --restore-state.\n"
+"    --icache ways sets line\n"
+"                     : Geometry of the --xip cache, with line in bytes\n"
+"                       (default: 2 64 16, for 2 KiB)\n"
+"    --batch x        : Run each test listed in manifest file x in turn, in this\n"
+"                       process, resetting the design and memory between tests\n"
+"                       (the design model is only constructed once). Each line\n"
+"                       is a test name followed by its options (e.g. --bin and\n"
+"                       --dump-check), which are added to any other options on\n"
+"                       the command line; blank lines and lines starting with #\n"
+"                       are ignored. Per test, --log x sends the test's output to\n"
+"                       file x (default: stderr). One line of JSON results is\n"
+"                       written to stdout per test. A test with bad options\n"
+"                       fails, with the reason in \"error\".\n"
+"    --threads n      : With --batch, run n tests at once, each thread with its\n"
+"                       own copy of the design. A test without --log has its\n"
+"                       output written to stderr once it finishes. Results are\n"
+"                       in order of completion. Tests with --progress or\n"
+"                       --progress-socket fail.\n"
+"    --fuzz n         : Differential fuzzing of the decoder against rvcpp: run n\n"
+"                       (0 for no limit) random programs over every extension\n"
+"                       under --cosim, in this process, mutating those which\n"
+"                       reach new op, op pair, CSR or exception coverage in\n"
+"                       rvcpp. A program which mismatches or times out is\n"
+"                       written to the --fuzz-out directory, to rerun with\n"
+"                       --bin. Requires tb built with `make COSIM=1`.\n"
+"    --fuzz-seed n    : Random seed for --fuzz, default 1\n"
+"    --fuzz-len n     : Instructions per --fuzz program, default 200\n"
+"    --fuzz-out x     : Directory for failing --fuzz programs, default .\n"
+"    --topology x     : Testbench topology, where tb was built with more than one:\n"
+"                       tb (single core, dual port), tb_multicore (dual core,\n"
+"                       single port) or tb_cluster<N>[_<base>] (N single-port\n"
+"                       cores, with mhartid from base). The default is tb, or the\n"
+"                       topology of the link tb is run through, e.g. tb_multicore.\n"
+"    --shm-cluster x,y,...\n"
+"                     : Simulate one multicore system in several processes, one\n"
+"                       per topology listed, each simulating its own harts (e.g.\n"
+"                       tb_cluster1_0,tb_cluster1_1 for two harts). Memory, IRQs,\n"
+"                       mtimecmp and the global monitor are shared. The first\n"
+"                       process loads memory, and prints the exit status.\n"
+"    --quantum n      : Cycles each --shm-cluster process runs between waiting\n"
+"                       for the others (default 1000). mtime is kept by each\n"
+"                       process, and accesses from different processes within a\n"
+"                       quantum are unordered.\n"
+;
+
+[[noreturn]] void exit_help(std::string errtext = "") {
+	std::cerr << errtext << help_str;
+	exit(-1);
+}
+
+// Thrown by run() for bad options, so that in --batch only the test with the
+// bad options fails. A single run exits with the help text instead.
+struct bad_usage {
+	std::string errtext;
+};
+
+[[noreturn]] static void usage_error(std::string errtext) {
+	throw bad_usage{errtext};
+}
+
+// As std::stoll and std::stoull with any base, but a bad number is a
+// bad_usage, not an exception which would end the process from a --batch
+// --threads worker
+static long long parse_signed(const char *arg) {
+	try {
+		return std::stoll(arg, 0, 0);
+	}
+	catch (std::logic_error &) {
+		usage_error("Bad number \"" + std::string(arg) + "\"\n");
+	}
+}
+
+static unsigned long long parse_unsigned(const char *arg) {
+	try {
+		return std::stoull(arg, 0, 0);
+	}
+	catch (std::logic_error &) {
+		usage_error("Bad number \"" + std::string(arg) + "\"\n");
+	}
+}
+
+// Direct access to the DM's DMI bus for --dmi-port, without going through the
+// DTM. Line-based text protocol, numbers in hex:
+//
+//   r addr           -> "data", or "E" on error
+//   w addr data      -> "OK", or "E"
+//   p addr mask      -> read addr until (data & mask) == 0, then "data"
+//
+// Requests can be pipelined, and are answered in order. Responses are only
+// flushed when there are no more complete requests waiting, so a client can
+// send a whole block (e.g. an SBA download) at a time.
+struct dmi_server {
+	// How often to check the socket while idle, in cycles
+	static const int POLL_INTERVAL = 64;
+
+	uint16_t port;
+	int server_fd;
+	int sock_fd;
+	struct sockaddr_in sock_addr;
+	std::string rx;
+	std::string tx;
+
+	enum {DMI_IDLE, DMI_SETUP, DMI_ACCESS} state;
+	char op;
+	uint32_t addr;
+	uint32_t wdata;
+	bool ready;
+	bool err;
+	uint32_t rdata;
+	int poll_countdown;
+	// Requests are recorded to, or replayed from, this log if set
+	InputLog *inputs;
+	int64_t cycle;
+	// For connection messages
+	FILE *out;
+
+	dmi_server(): port(0), server_fd(-1), sock_fd(-1), state(DMI_IDLE), op(0), addr(0), wdata(0),
+		ready(false), err(false), rdata(0), poll_countdown(0), inputs(nullptr), cycle(0), out(stdout) {}
+
+	void start(uint16_t port_) {
+		port = port_;
+		if (inputs && inputs->replaying())
+			return;
+		server_fd = open_server(port, sock_addr);
+		socklen_t len = sizeof(sock_addr);
+		sock_fd = wait_for_connection(server_fd, port, (struct sockaddr *)&sock_addr, &len, out);
+	}
+
+	void stop() {
+		if (server_fd < 0)
+			return;
+		close(sock_fd);
+		close(server_fd);
+		server_fd = -1;
+	}
+
+	~dmi_server() {
+		stop();
+	}
+
+	// Called with the clock low, before the edge: APB completes on this edge
+	// if the access phase sees pready.
+	void sample(dut_ports &dut) {
+		if (state != DMI_ACCESS)
+			return;
+		ready = dut.dmi_direct_pready.get();
+		err = dut.dmi_direct_pslverr.get();
+		rdata = dut.dmi_direct_prdata.get();
+	}
+
+	// Called after the clock edge, to set up the next cycle's APB signals
+	void drive(dut_ports &dut, int64_t cycle_) {
+		cycle = cycle_;
+		if (state == DMI_ACCESS) {
+			if (!ready)
+				return;
+			if (op == 'p' && !err && (rdata & wdata) != 0) {
+				// Poll again
+				dut.dmi_direct_penable.set(false);
+				state = DMI_SETUP;
+				return;
+			}
+			char buf[16];
+			if (err)
+				tx += "E\n";
+			else if (op == 'w')
+				tx += "OK\n";
+			else {
+				snprintf(buf, sizeof(buf), "%08x\n", rdata);
+				tx += buf;
+			}
+			dut.dmi_direct_psel.set(false);
+			dut.dmi_direct_penable.set(false);
+			state = DMI_IDLE;
+		}
+		if (state == DMI_SETUP) {
+			dut.dmi_direct_penable.set(true);
+			state = DMI_ACCESS;
+			return;
+		}
+		if (next_request()) {
+			dut.dmi_direct_psel.set(true);
+			dut.dmi_direct_penable.set(false);
+			dut.dmi_direct_pwrite.set(op == 'w');
+			dut.dmi_direct_paddr.set(addr);
+			dut.dmi_direct_pwdata.set(wdata);
+			state = DMI_SETUP;
+		}
+	}
+
+	// Each request is logged as it's started, as its op, address and data
+	bool next_request() {
+		if (inputs && inputs->replaying()) {
+			std::string e;
+			// Responses go nowhere
+			tx.clear();
+			if (!inputs->take(InputLog::DMI, cycle, e) || e.size() != 9)
+				return false;
+			op = e[0];
+			addr = le_load32((const uint8_t *)&e[1]);
+			wdata = le_load32((const uint8_t *)&e[5]);
+			return true;
+		}
+		if (!next_socket_request())
+			return false;
+		if (inputs && inputs->recording()) {
+			uint8_t e[9] = {(uint8_t)op};
+			le_store32(e + 1, addr);
+			le_store32(e + 5, wdata);
+			inputs->put(InputLog::DMI, cycle, e, sizeof(e));
+		}
+		return true;
+	}
+
+	bool next_socket_request() {
+		while (true) {
+			size_t eol = rx.find('\n');
+			if (eol != std::string::npos) {
+				std::string line = rx.substr(0, eol);
+				rx.erase(0, eol + 1);
+				unsigned int a = 0, d = 0;
+				char c = 0;
+				int n = sscanf(line.c_str(), " %c %x %x", &c, &a, &d);
+				if ((c == 'r' && n >= 2) || ((c == 'w' || c == 'p') && n == 3)) {
+					op = c;
+					addr = a;
+					wdata = d;
+					return true;
+				}
+				if (n > 0)
+					tx += "E\n";
+				continue;
+			}
+			// Nothing left to do until the client hears back
+			if (!tx.empty()) {
+				send(sock_fd, tx.data(), tx.size(), 0);
+				tx.clear();
+				poll_countdown = 0;
+			}
+			if (poll_countdown-- > 0)
+				return false;
+			poll_countdown = POLL_INTERVAL;
+			char buf[TCP_BUF_SIZE];
+			ssize_t n = recv(sock_fd, buf, sizeof(buf), MSG_DONTWAIT);
+			if (n == 0) {
+				// The socket is closed. Wait for another connection.
+				close(sock_fd);
+				rx.clear();
+				socklen_t len = sizeof(sock_addr);
+				sock_fd = wait_for_connection(server_fd, port, (struct sockaddr *)&sock_addr, &len, out);
+				return false;
+			}
+			if (n < 0)
+				return false;
+			rx.append(buf, n);
+			poll_countdown = 0;
+		}
+	}
+};
+
+// Queued accesses to the DM through the direct DMI port, for testbench agents
+// which drive the DM themselves. Reads can poll until a field has some value,
+// and run a callback with the result, which may queue further accesses.
+struct dmi_master {
+	enum {
+		DM_DATA0      = 0x04,
+		DM_DMCONTROL  = 0x10,
+		DM_DMSTATUS   = 0x11,
+		DM_ABSTRACTCS = 0x16,
+		DM_COMMAND    = 0x17,
+		DM_PROGBUF0   = 0x20,
+		DM_PROGBUF1   = 0x21
+	};
+
+	static const uint32_t DMCONTROL_DMACTIVE = 1u << 0;
+	static const uint32_t DMCONTROL_RESUMEREQ = 1u << 30;
+	static const uint32_t DMCONTROL_HALTREQ = 1u << 31;
+	static const uint32_t DMSTATUS_ALLHALTED = 1u << 9;
+	static const uint32_t DMSTATUS_ALLRESUMEACK = 1u << 17;
+	static const uint32_t ABSTRACTCS_BUSY = 1u << 12;
+	static const uint32_t ABSTRACTCS_CMDERR = 7u << 8;
+
+	// Access register commands, 32-bit
+	static const uint32_t CMD_READ = 0x00220000u;
+	static const uint32_t CMD_WRITE = 0x00230000u;
+	static const uint32_t CMD_POSTEXEC = 0x00040000u;
+	static const uint32_t REG_GPR0 = 0x1000;
+	static const uint32_t REG_A0 = 0x100a;
+	static const uint32_t REG_A1 = 0x100b;
+
+	static const uint32_t INSTR_CSRR_A0_DCSR = 0x7b002573u;
+	static const uint32_t INSTR_CSRW_DCSR_A0 = 0x7b051073u;
+	static const uint32_t INSTR_CSRR_A0_DPC = 0x7b102573u;
+	static const uint32_t INSTR_CSRW_DPC_A0 = 0x7b151073u;
+
+	bool failed;
+
+	dmi_master(mem_io_state &memio_, const char *name_): failed(false), memio(memio_), name(name_),
+		state(DMI_IDLE), ready(false), err(false), rdata(0) {}
+	virtual ~dmi_master() {}
+
+	// Called with the clock low, before the edge: APB completes on this edge
+	// if the access phase sees pready.
+	void sample(dut_ports &dut) {
+		if (state != DMI_ACCESS)
+			return;
+		ready = dut.dmi_direct_pready.get();
+		err = dut.dmi_direct_pslverr.get();
+		rdata = dut.dmi_direct_prdata.get();
+	}
+
+	// Called after the clock edge, to set up the next cycle's APB signals
+	void drive(dut_ports &dut) {
+		if (state == DMI_ACCESS) {
+			if (!ready)
+				return;
+			dmi_op &op = ops.front();
+			if ((rdata & op.mask) != op.match && !err) {
+				// Poll again
+				dut.dmi_direct_penable.set(false);
+				state = DMI_SETUP;
+				return;
+			}
+			dut.dmi_direct_psel.set(false);
+			dut.dmi_direct_penable.set(false);
+			state = DMI_IDLE;
+			std::function<void(uint32_t)> done = std::move(op.done);
+			ops.pop_front();
+			if (err)
+				fail("DMI access failed");
+			else if (done)
+				done(rdata);
+		}
+		if (state == DMI_SETUP) {
+			dut.dmi_direct_penable.set(true);
+			state = DMI_ACCESS;
+			return;
+		}
+		if (ops.empty() && !failed)
+			idle();
+		if (!ops.empty() && !failed) {
+			const dmi_op &op = ops.front();
+			dut.dmi_direct_psel.set(true);
+			dut.dmi_direct_penable.set(false);
+			dut.dmi_direct_pwrite.set(op.write);
+			dut.dmi_direct_paddr.set(op.addr);
+			dut.dmi_direct_pwdata.set(op.wdata);
+			state = DMI_SETUP;
+		}
+	}
+
+protected:
+	mem_io_state &memio;
+
+	// Called when there is nothing queued, and may queue more
+	virtual void idle() {}
+
+	void write(uint32_t addr, uint32_t data) {
+		ops.push_back({true, addr, data, 0, 0, nullptr});
+	}
+
+	void read(uint32_t addr, std::function<void(uint32_t)> done) {
+		ops.push_back({false, addr, 0, 0, 0, std::move(done)});
+	}
+
+	void poll(uint32_t addr, uint32_t mask, uint32_t match) {
+		ops.push_back({false, addr, 0, mask, match, nullptr});
+	}
+
+	void command(uint32_t cmd) {
+		write(DM_COMMAND, cmd);
+		poll(DM_ABSTRACTCS, ABSTRACTCS_BUSY, 0);
+		read(DM_ABSTRACTCS, [this](uint32_t abstractcs) {
+			if (abstractcs & ABSTRACTCS_CMDERR)
+				fail("abstract command failed");
+		});
+	}
+
+	void read_reg(uint32_t regno, std::function<void(uint32_t)> done) {
+		command(CMD_READ | regno);
+		read(DM_DATA0, [this, done](uint32_t data) {
+			if (!failed)
+				done(data);
+		});
+	}
+
+	void halt_hart() {
+		write(DM_DMCONTROL, DMCONTROL_DMACTIVE);
+		write(DM_DMCONTROL, DMCONTROL_DMACTIVE | DMCONTROL_HALTREQ);
+		poll(DM_DMSTATUS, DMSTATUS_ALLHALTED, DMSTATUS_ALLHALTED);
+		write(DM_DMCONTROL, DMCONTROL_DMACTIVE);
+	}
+
+	void resume_hart() {
+		write(DM_DMCONTROL, DMCONTROL_DMACTIVE | DMCONTROL_RESUMEREQ);
+		poll(DM_DMSTATUS, DMSTATUS_ALLRESUMEACK, DMSTATUS_ALLRESUMEACK);
+		write(DM_DMCONTROL, DMCONTROL_DMACTIVE);
+	}
+
+	void fail(const char *msg) {
+		if (failed)
+			return;
+		memio.flush_print();
+		fprintf(memio.out, "%s: %s\n", name, msg);
+		failed = true;
+	}
+
+private:
+	struct dmi_op {
+		bool write;
+		uint32_t addr;
+		uint32_t wdata;
+		// Reads are repeated until (rdata & mask) == match
+		uint32_t mask;
+		uint32_t match;
+		std::function<void(uint32_t)> done;
+	};
+
+	const char *name;
+	std::deque<dmi_op> ops;
+	enum {DMI_IDLE, DMI_SETUP, DMI_ACCESS} state;
+	bool ready;
+	bool err;
+	uint32_t rdata;
+};
+
+// Semihosting for --semihost, through the DM on the direct DMI port.
+// dcsr.ebreakm is set at startup, so M-mode ebreaks enter Debug Mode. The
+// agent polls dmstatus while the hart runs, and when it halts, reads the call
+// from a0/a1 and dpc, runs it on the host, then writes the result to a0 and
+// resumes after the ebreak. CSRs are accessed through the program buffer,
+// with a0 as scratch (it is restored, or holds the result).
+struct semihost_agent: dmi_master {
+	static const int POLL_INTERVAL = 64;
+	static const uint32_t DCSR_EBREAKM_BIT = 1u << 15;
+
+	Semihost host;
+
+	semihost_agent(mem_io_state &memio_): dmi_master(memio_, "Semihosting"), host(memio_.mem, 0, MEM_SIZE),
+		running(false), poll_countdown(0), cycle(0), saved_a0(0), call_op(0), call_param(0) {
+		host.print = [this](const char *text, size_t len) {memio.print(text, len);};
+		host.cycles = [this] {return cycle;};
+	}
+
+	// Halt the hart, set dcsr.ebreakm, and resume it
+	void start(dut_ports &dut) {
+		dut.dmi_direct_en.set(true);
+		halt_hart();
+		write(DM_PROGBUF1, Semihost::INSTR_EBREAK);
+		read_reg(REG_A0, [this](uint32_t a0) {
+			saved_a0 = a0;
+			write(DM_PROGBUF0, INSTR_CSRR_A0_DCSR);
+			command(CMD_POSTEXEC);
+			read_reg(REG_A0, [this](uint32_t dcsr) {
+				write(DM_DATA0, dcsr | DCSR_EBREAKM_BIT);
+				write(DM_PROGBUF0, INSTR_CSRW_DCSR_A0);
+				command(CMD_WRITE | CMD_POSTEXEC | REG_A0);
+				write(DM_DATA0, saved_a0);
+				command(CMD_WRITE | REG_A0);
+				resume();
+			});
+		});
+	}
+
+	void drive(dut_ports &dut, int64_t cycle_) {
+		cycle = cycle_;
+		dmi_master::drive(dut);
+	}
+
+private:
+	bool running;
+	int poll_countdown;
+	uint64_t cycle;
+	uint32_t saved_a0;
+	uint32_t call_op;
+	uint32_t call_param;
+
+	void idle() override {
+		if (running && poll_countdown-- <= 0) {
+			poll_countdown = POLL_INTERVAL;
+			read(DM_DMSTATUS, [this](uint32_t dmstatus) {
+				if (dmstatus & DMSTATUS_ALLHALTED)
+					service();
+			});
+		}
+	}
+
+	void resume() {
+		resume_hart();
+		running = true;
+		poll_countdown = POLL_INTERVAL;
+	}
+
+	void service() {
+		running = false;
+		read_reg(REG_A0, [this](uint32_t a0) {
+			call_op = a0;
+			read_reg(REG_A1, [this](uint32_t a1) {
+				call_param = a1;
+				write(DM_PROGBUF0, INSTR_CSRR_A0_DPC);
+				command(CMD_POSTEXEC);
+				read_reg(REG_A0, [this](uint32_t dpc) {
+					if (!host.is_call(dpc)) {
+						char buf[64];
+						snprintf(buf, sizeof(buf), "hart halted at %08x, which is not a semihosting call", dpc);
+						fail(buf);
+						return;
+					}
+					uint32_t result = host.call(call_op, call_param);
+					if (host.exit_req) {
+						memio.request_exit(host.exit_code);
+						return;
+					}
+					write(DM_DATA0, dpc + 4);
+					write(DM_PROGBUF0, INSTR_CSRW_DPC_A0);
+					command(CMD_WRITE | CMD_POSTEXEC | REG_A0);
+					write(DM_DATA0, result);
+					command(CMD_WRITE | REG_A0);
+					resume();
+				});
+			});
+		});
+	}
+};
+
+// Loads an architectural checkpoint from rvcpp's --save-arch into the design
+// for --restore-arch, through the DM on the direct DMI port. RAM, the timer
+// and the IRQ inputs are set directly. The reset vector is replaced with a
+// jump-to-self until the hart is halted, so that the program's own startup
+// code doesn't run. CSRs are written through the program buffer with a0 as
+// scratch, then the GPRs, then the hart resumes at the checkpoint's pc and
+// privilege, through dpc and dcsr.prv. Debug Mode has no architectural side
+// effects, so everything else is exactly as saved.
+struct arch_restore_agent: dmi_master {
+	static const uint32_t INSTR_JAL_SELF = 0x0000006fu;
+	static const uint32_t DCSR_PRV_MASK = 0x3u;
+
+	// Set once the hart has resumed from the checkpoint
+	bool done;
+	int64_t done_cycle;
+
+	arch_restore_agent(mem_io_state &memio_): dmi_master(memio_, "Checkpoint restore"), done(false),
+		done_cycle(0), cycle(0), saved_reset_instr(0) {}
+
+	// Call before reset
+	bool load(const std::string &path, dut_ports &dut) {
+		std::string err;
+		if (!cp.load(path, MEM_SIZE, err)) {
+			std::cerr << err << "\n";
+			return false;
+		}
+		memcpy(memio.mem, cp.ram.data(), cp.ram.size());
+		memio.mtime = cp.mtime;
+		memio.io->mtimecmp[memio.hart_base].store(cp.mtimecmp, std::memory_order_relaxed);
+		memio.timer_changed();
+		memio.update_irqs(dut, cp.softirq ? 1u << memio.hart_base : 0, 0, cp.irq, 0);
+		saved_reset_instr = le_load32(memio.mem + RESET_VECTOR);
+		le_store32(memio.mem + RESET_VECTOR, INSTR_JAL_SELF);
+		return true;
+	}
+
+	void start(dut_ports &dut) {
+		dut.dmi_direct_en.set(true);
+		halt_hart();
+		read(DM_DMSTATUS, [this](uint32_t) {
+			le_store32(memio.mem + RESET_VECTOR, saved_reset_instr);
+		});
+		write(DM_PROGBUF1, Semihost::INSTR_EBREAK);
+		for (const auto &c : cp.csrs)
+			write_csr(c.first, c.second);
+		write(DM_DATA0, cp.pc);
+		write(DM_PROGBUF0, INSTR_CSRW_DPC_A0);
+		command(CMD_WRITE | CMD_POSTEXEC | REG_A0);
+		write(DM_PROGBUF0, INSTR_CSRR_A0_DCSR);
+		command(CMD_POSTEXEC);
+		read_reg(REG_A0, [this](uint32_t dcsr) {
+			write(DM_DATA0, (dcsr & ~DCSR_PRV_MASK) | (cp.priv & DCSR_PRV_MASK));
+			write(DM_PROGBUF0, INSTR_CSRW_DCSR_A0);
+			command(CMD_WRITE | CMD_POSTEXEC | REG_A0);
+			for (uint32_t i = 1; i < 32; ++i) {
+				write(DM_DATA0, cp.x[i]);
+				command(CMD_WRITE | (REG_GPR0 + i));
+			}
+			resume_hart();
+			read(DM_DMSTATUS, [this](uint32_t) {
+				done = true;
+				done_cycle = cycle;
+				memio.flush_print();
+				fprintf(memio.out, "Restored checkpoint from cycle " I64_FMT " at pc %08x\n", (int64_t)cp.cycle, cp.pc);
+			});
+		});
+	}
+
+	void drive(dut_ports &dut, int64_t cycle_) {
+		cycle = cycle_;
+		dmi_master::drive(dut);
+	}
+
+private:
+	ArchCheckpoint cp;
+	int64_t cycle;
+	uint32_t saved_reset_instr;
+
+	// csrw csr, a0
+	void write_csr(uint16_t addr, uint32_t data) {
+		write(DM_DATA0, data);
+		write(DM_PROGBUF0, (uint32_t)addr << 20 | 10u << 15 | 1u << 12 | 0x73u);
+		command(CMD_WRITE | CMD_POSTEXEC | REG_A0);
+	}
+};
+
+// Warm-up and measurement windows for sampled simulation (--sample-warmup
+// and --sample-measure), counted in instructions retired by hart 0 from the
+// start of the run, or from when a checkpoint is restored. The core's
+// instr_ret is used rather than minstret, which software may inhibit.
+struct sample_window {
+	int64_t warmup;
+	int64_t measure;
+	const cxxrtl::chunk_t *instr_ret;
+	int64_t retired;
+	int64_t start_cycle;
+	int64_t warmup_end_cycle;
+	int64_t end_cycle;
+
+	sample_window(): warmup(0), measure(0), instr_ret(nullptr), retired(0), start_cycle(-1),
+		warmup_end_cycle(-1), end_cycle(-1) {}
+
+	bool init(tb_dut &dut) {
+		const cxxrtl::debug_items &items = dut.debug_info();
+		const std::string suffix = "csr_u instr_ret";
+		for (auto &it : items.table) {
+			const std::string &name = it.first;
+			if (name.size() >= suffix.size() && !name.compare(name.size() - suffix.size(), suffix.size(), suffix)) {
+				instr_ret = it.second[0].curr;
+				return true;
+			}
+		}
+		std::cerr << "Retirement signal not found in design\n";
+		return false;
+	}
+
+	void start(int64_t cycle) {
+		start_cycle = cycle;
+		if (warmup == 0)
+			warmup_end_cycle = cycle;
+	}
+
+	// Call once per cycle, after the clock edge. Returns true at the end of
+	// the measurement window.
+	bool sample(int64_t cycle) {
+		if (start_cycle < 0 || end_cycle >= 0 || !(*instr_ret & 1u))
+			return false;
+		++retired;
+		if (retired == warmup)
+			warmup_end_cycle = cycle + 1;
+		if (retired == warmup + measure) {
+			end_cycle = cycle + 1;
+			return true;
+		}
+		return false;
+	}
+
+	void print(FILE *f) const {
+		if (warmup_end_cycle < 0) {
+			fprintf(f, "Sample: warm-up incomplete, " I64_FMT " of " I64_FMT " instructions\n", retired, warmup);
+			return;
+		}
+		fprintf(f, "Sample: warm-up of " I64_FMT " instructions in " I64_FMT " cycles\n",
+			warmup, warmup_end_cycle - start_cycle);
+		if (end_cycle < 0) {
+			fprintf(f, "Sample: measurement incomplete, " I64_FMT " of " I64_FMT " instructions\n",
+				retired - warmup, measure);
+			return;
+		}
+		fprintf(f, "Sample: measured " I64_FMT " instructions in " I64_FMT " cycles, CPI %.4f\n",
+			measure, end_cycle - warmup_end_cycle, (double)(end_cycle - warmup_end_cycle) / measure);
+	}
+};
+
+// Per-region counts for IO_ROI: cycles, instructions retired by hart 0 (if
+// the design has the core's instr_ret), and bus transfers on all ports.
+// Instructions are only counted inside a region. With --roi, the caller
+// also gates its other instrumentation on active().
+struct roi_monitor {
+	const cxxrtl::chunk_t *instr_ret;
+	uint64_t retired;
+	RoiStats stats;
+
+	explicit roi_monitor(tb_dut &dut): instr_ret(find_instr_ret(dut)), retired(0),
+		stats(instr_ret ? std::vector<std::string>{"cycles", "instret", "transfers"} :
+			std::vector<std::string>{"cycles", "transfers"}) {}
+
+	bool active() const {
+		return stats.active();
+	}
+
+	// Call once per cycle while active(), after the clock edge
+	void sample() {
+		if (instr_ret)
+			retired += *instr_ret & 1u;
+	}
+
+	// Call with the cycle count when memio.roi_changed is seen
+	void update(int64_t cycles, mem_io_state &memio) {
+		memio.roi_changed = false;
+		uint64_t counters[3] = {(uint64_t)cycles, retired, memio.transfers};
+		if (!instr_ret)
+			counters[1] = memio.transfers;
+		stats.set(memio.roi, counters);
+	}
+
+	static const cxxrtl::chunk_t *find_instr_ret(tb_dut &dut) {
+		const cxxrtl::debug_items &items = dut.debug_info();
+		const std::string suffix = "csr_u instr_ret";
+		for (auto &it : items.table) {
+			const std::string &name = it.first;
+			if (name.size() >= suffix.size() && !name.compare(name.size() - suffix.size(), suffix.size(), suffix))
+				return it.second[0].curr;
+		}
+		return nullptr;
+	}
+};
+
+// -----------------------------------------------------------------------------
+// JTAG dumps
+
+// --jtagdump writes the OpenOCD bitbang commands which were consumed, either
+// as they are, or (for a path ending in .jtc) in a compact format, which
+// --jtagreplay recognises by its magic:
+//
+// - Records, each either a literal run (0x80 | (n - 1), then n commands)
+//   or a repeat (k from 1 to 8, then a k-command pattern and a LEB128
+//   count); idle clocks and constant shifts become a single repeat
+// - 0x00, then an index of markers: a LEB128 count, then for each a LEB128
+//   cycle and the file offset of the first record of that cycle
+// - The offset of the index, 8 bytes little-endian
+//
+// The index lets a replay restored from a snapshot (--restore-state) seek to
+// the snapshot's cycle without replaying what comes before it.
+
+static const char JTAG_DUMP_MAGIC[8] = {'h', '3', 'j', 't', 'a', 'g', 'c', '1'};
+
+struct jtag_dump_writer {
+	static const size_t FLUSH_SIZE = 1u << 16;
+	static const int64_t MARK_INTERVAL = 1 << 16;
+	static const int MAX_PERIOD = 8;
+	// Shorter repeats are cheaper as literals
+	static const size_t MIN_REPEAT = 8;
+	static const size_t RING_SIZE = 1u << 22;
+
+	tb_output_stream out;
+	bool compact;
+	std::string pending;
+	std::string lit;
+	std::vector<std::pair<int64_t, uint64_t>> marks;
+	int64_t next_mark;
+
+	jtag_dump_writer(): compact(false), next_mark(0) {}
+
+	~jtag_dump_writer() {
+		close();
+	}
+
+	bool open(const std::string &path) {
+		compact = path.size() >= 4 && path.compare(path.size() - 4, 4, ".jtc") == 0;
+		if (!out.open(path, RING_SIZE))
+			return false;
+		if (compact)
+			out.write(JTAG_DUMP_MAGIC, sizeof(JTAG_DUMP_MAGIC));
+		return true;
+	}
+
+	void put(char c) {
+		pending.push_back(c);
+		if (pending.size() >= FLUSH_SIZE)
+			flush();
+	}
+
+	// Called at the start of each cycle which consumes commands
+	void mark(int64_t cycle) {
+		if (!compact || cycle < next_mark)
+			return;
+		flush();
+		marks.push_back(std::make_pair(cycle, out.offset()));
+		next_mark = cycle + MARK_INTERVAL;
+	}
+
+	void close() {
+		if (!out.is_open())
+			return;
+		flush();
+		if (compact) {
+			uint64_t index = out.offset() + 1;
+			out.put(0);
+			put_varint(marks.size());
+			for (auto &m : marks) {
+				put_varint(m.first);
+				put_varint(m.second);
+			}
+			for (int i = 0; i < 8; ++i)
+				out.put(index >> 8 * i & 0xff);
+		}
+		out.close();
+	}
+
+private:
+	void put_varint(uint64_t x) {
+		do {
+			out.put((x & 0x7f) | (x > 0x7f ? 0x80 : 0));
+			x >>= 7;
+		} while (x);
+	}
+
+	void flush_lit() {
+		for (size_t i = 0; i < lit.size(); i += 128) {
+			size_t n = std::min(lit.size() - i, (size_t)128);
+			out.put(0x80 | (n - 1));
+			out.write(lit.data() + i, n);
+		}
+		lit.clear();
+	}
+
+	void flush() {
+		if (!compact) {
+			out.write(pending);
+			pending.clear();
+			return;
+		}
+		const char *p = pending.data();
+		size_t n = pending.size();
+		size_t i = 0;
+		while (i < n) {
+			// Longest run of whole periods, for the period which covers most
+			size_t best_len = 0;
+			int best_k = 0;
+			for (int k = 1; k <= MAX_PERIOD && i + 2 * k <= n; ++k) {
+				size_t len = k;
+				while (i + len < n && p[i + len] == p[i + len - k])
+					++len;
+				len -= len % k;
+				if (len > best_len) {
+					best_len = len;
+					best_k = k;
+				}
+			}
+			if (best_len >= MIN_REPEAT && best_len >= 2u * best_k) {
+				flush_lit();
+				out.put(best_k);
+				out.write(p + i, best_k);
+				put_varint(best_len / best_k);
+				i += best_len;
+			}
+			else {
+				lit.push_back(p[i++]);
+			}
+		}
+		flush_lit();
+		pending.clear();
+	}
+};
+
+// Reads either format of --jtagdump
+struct jtag_replay_reader {
+	FILE *f;
+	bool compact;
+	// Left of the current repeat, or literal run
+	char pattern[jtag_dump_writer::MAX_PERIOD];
+	int period;
+	int phase;
+	uint64_t rep_left;
+	size_t lit_left;
+	bool eof;
+	// A command which seek() read one too far, or -1
+	int unread;
+
+	jtag_replay_reader(): f(nullptr), compact(false), period(0), phase(0), rep_left(0), lit_left(0), eof(false),
+		unread(-1) {}
+
+	~jtag_replay_reader() {
+		if (f)
+			fclose(f);
+	}
+
+	bool open(const std::string &path) {
+		f = fopen(path.c_str(), "rb");
+		if (!f)
+			return false;
+		char magic[sizeof(JTAG_DUMP_MAGIC)];
+		compact = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+			!memcmp(magic, JTAG_DUMP_MAGIC, sizeof(magic));
+		if (!compact)
+			rewind(f);
+		return true;
+	}
+
+	// Returns 0 at the end of the commands
+	size_t read(char *buf, size_t n) {
+		size_t got = 0;
+		if (unread >= 0 && n > 0) {
+			buf[got++] = unread;
+			unread = -1;
+		}
+		if (!compact)
+			return got + fread(buf + got, 1, n - got, f);
+		while (got < n && next_record()) {
+			if (rep_left) {
+				for (; got < n && rep_left; ++got) {
+					buf[got] = pattern[phase];
+					if (++phase == period) {
+						phase = 0;
+						--rep_left;
+					}
+				}
+			}
+			else {
+				size_t m = fread(buf + got, 1, std::min(n - got, lit_left), f);
+				if (m == 0) {
+					eof = true;
+					break;
+				}
+				got += m;
+				lit_left -= m;
+			}
+		}
+		return got;
+	}
+
+	// Skip the commands consumed by the cycles before `cycle`, as the
+	// parsing in run() would consume them. A pin write ends a cycle once it
+	// is the edges_per_cycle'th of that cycle, and so do r, s and Q.
+	bool seek(int64_t cycle, int edges_per_cycle) {
+		int64_t at = 0;
+		if (compact) {
+			uint64_t offset = 0;
+			if (!find_mark(cycle, at, offset) || fseek(f, offset, SEEK_SET) != 0)
+				return false;
+			rep_left = 0;
+			lit_left = 0;
+			eof = false;
+		}
+		int edges = 0;
+		while (at < cycle) {
+			char c;
+			if (read(&c, 1) == 0)
+				return false;
+			if (c >= '0' && c <= '7')
+				++edges;
+			if (c == 'R' && edges > 0) {
+				// Resync: the R is read again by the next cycle
+				if (++at == cycle)
+					unread = c;
+				edges = 0;
+			}
+			else if (c == 'r' || c == 's' || c == 'Q' || edges == edges_per_cycle) {
+				++at;
+				edges = 0;
+			}
+		}
+		return true;
+	}
+
+private:
+	bool get_varint(uint64_t &x) {
+		x = 0;
+		for (int shift = 0; shift < 64; shift += 7) {
+			int c = getc(f);
+			if (c == EOF)
+				return false;
+			x |= (uint64_t)(c & 0x7f) << shift;
+			if (!(c & 0x80))
+				return true;
+		}
+		return false;
+	}
+
+	// Start the next record, if the current one is used up
+	bool next_record() {
+		if (rep_left || lit_left)
+			return true;
+		if (eof)
+			return false;
+		int op = getc(f);
+		if (op == EOF || op == 0 || (op > jtag_dump_writer::MAX_PERIOD && op < 0x80)) {
+			eof = true;
+			return false;
+		}
+		if (op & 0x80) {
+			lit_left = (op & 0x7f) + 1;
+			return true;
+		}
+		period = op;
+		phase = 0;
+		if (fread(pattern, 1, period, f) != (size_t)period || !get_varint(rep_left)) {
+			eof = true;
+			rep_left = 0;
+		}
+		return !eof;
+	}
+
+	// Latest marker at or before `cycle`
+	bool find_mark(int64_t cycle, int64_t &mark_cycle, uint64_t &offset) {
+		uint8_t tail[8];
+		uint64_t index = 0;
+		if (fseek(f, -8, SEEK_END) != 0 || fread(tail, 1, 8, f) != 8)
+			return false;
+		for (int i = 0; i < 8; ++i)
+			index |= (uint64_t)tail[i] << 8 * i;
+		uint64_t n;
+		if (fseek(f, index, SEEK_SET) != 0 || !get_varint(n))
+			return false;
+		bool found = false;
+		for (uint64_t i = 0; i < n; ++i) {
+			uint64_t c, o;
+			if (!get_varint(c) || !get_varint(o))
+				return false;
+			if ((int64_t)c > cycle)
+				break;
+			mark_cycle = c;
+			offset = o;
+			found = true;
+		}
+		return found;
+	}
+};
+
+// Outcome of one run, for --batch
+struct run_result {
+	bool exited;
+	uint32_t exit_code;
+	int64_t cycles;
+	// Also set if hung, i.e. stopped early as the run could only time out
+	bool timed_out;
+	bool hung;
+	bool dump_check_pass;
+	// Why the test couldn't run, e.g. bad options
+	std::string error;
+	run_result(): exited(false), exit_code(0), cycles(0), timed_out(false), hung(false), dump_check_pass(true) {}
+};
+
+struct fuzz_run;
+
+// Returns the process exit code for a single run, or throws bad_usage for bad
+// options. The design must be in its power-on state.
+int run(int argc, char **argv, tb_dut &dut, run_result &result, FILE *out = stdout,
+		const fuzz_run *fuzz = nullptr) {
+
+	bool load_bin = false;
+	std::string bin_path;
+	bool load_elf = false;
+	std::string elf_path;
+	bool fast_boot = false;
+	bool dump_waves = false;
+	std::string waves_path;
+	std::vector<std::pair<uint32_t, uint32_t>> dump_ranges;
+	struct dump_check {
+		uint32_t start;
+		uint32_t end;
+		std::string path;
+		// For --expect: end is start plus the file's size
+		bool to_file_end;
+	};
+	// --expect and --dump-check
+	std::vector<dump_check> expects;
+	// Same fields: binary dumps for --dump-bin
+	std::vector<dump_check> dump_bins;
+	std::string signature_path;
+	int64_t max_cycles = 0;
+	bool propagate_return_code = false;
+	bool hang_detect = true;
+	bool fast = false;
+	bool skip_sleep = true;
+	uint16_t port = 0;
+	bool dump_jtag = false;
+	std::string jtag_dump_path;
+	bool replay_jtag = false;
+	std::string jtag_replay_path;
+	std::string record_inputs_path;
+	std::string replay_inputs_path;
+	int jtag_edges_per_cycle = 1;
+	uint16_t dmi_port = 0;
+	bool save_state = false;
+	std::string save_path;
+	int64_t save_cycle = 0;
+	bool save_io = false;
+	uint32_t save_io_addr = 0;
+	bool restore_state = false;
+	std::string restore_path;
+	std::string restore_arch_path;
+	sample_window sampler;
+	latency_model latency;
+	traffic_model traffic;
+	XipCacheConfig xip_cfg;
+	wave_window window;
+	bool flight = false;
+	std::string flight_path;
+	int64_t flight_cycles = 0;
+	bool cosim = false;
+	std::string profile_path;
+	uint64_t profile_interval = 100;
+	bool profile_calls = false;
+	bool irq_latency_en = false;
+	int64_t irq_latency_bucket = 4;
+	std::string heatmap_path;
+	std::string ahb_trace_path;
+	std::string btrace_path;
+	bool csr_profile_en = false;
+	bool bus_stats_en = false;
+	bool power_stats_en = false;
+	std::string toggle_path;
+	std::vector<std::string> toggle_filters;
+	std::string coverage_path;
+	std::vector<std::string> coverage_filters;
+	std::vector<std::string> fsm_filters;
+	std::string power_series_path;
+	int64_t power_series_window = 0;
+	int progress_interval = 0;
+	std::string progress_socket;
+	std::string bus_series_path;
+	int64_t bus_series_window = 0;
+	uint32_t heatmap_block = 64;
+	bool semihost_en = false;
+	Stimulus stimulus;
+	bool stimulus_random = false;
+	uint64_t stimulus_seed = 0;
+	uint64_t stimulus_interval = 0;
+	uint32_t stimulus_mask = 0;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string s(argv[i]);
+		if (s.rfind("--", 0) != 0) {
+			usage_error("Unexpected positional argument " + s + "\n");
+		}
+		else if (s == "--bin") {
+			if (argc - i < 2)
+				usage_error("Option --bin requires an argument\n");
+			load_bin = true;
+			bin_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--elf") {
+			if (argc - i < 2)
+				usage_error("Option --elf requires an argument\n");
+			load_elf = true;
+			elf_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--vcd") {
+			if (argc - i < 2)
+				usage_error("Option --vcd requires an argument\n");
+			dump_waves = true;
+			waves_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--vcd-filter") {
+			if (argc - i < 2)
+				usage_error("Option --vcd-filter requires an argument\n");
+			window.filters.push_back(argv[i + 1]);
+			i += 1;
+		}
+		else if (s == "--vcd-cycles") {
+			if (argc - i < 3)
+				usage_error("Option --vcd-cycles requires 2 arguments\n");
+			window.cycles_en = true;
+			window.cycle_start = parse_signed(argv[i + 1]);
+			window.cycle_end = parse_signed(argv[i + 2]);
+			i += 2;
+		}
+		else if (s == "--vcd-pc") {
+			if (argc - i < 3)
+				usage_error("Option --vcd-pc requires 2 arguments\n");
+			window.pc_en = true;
+			window.pc_start = parse_unsigned(argv[i + 1]);
+			window.pc_end = parse_unsigned(argv[i + 2]);
+			i += 2;
+		}
+		else if (s == "--vcd-io") {
+			window.io_en = true;
+		}
+		else if (s == "--flight") {
+			if (argc - i < 3)
+				usage_error("Option --flight requires 2 arguments\n");
+			flight = true;
+			flight_path = argv[i + 1];
+			flight_cycles = parse_signed(argv[i + 2]);
+			if (flight_cycles <= 0)
+				usage_error("Cycle count for --flight must be positive\n");
+			i += 2;
+		}
+		else if (s == "--cosim") {
+#ifdef COSIM
+			cosim = true;
+#else
+			usage_error("Option --cosim requires tb to be built with `make COSIM=1`\n");
+#endif
+		}
+		else if (s == "--profile") {
+			if (argc - i < 2)
+				usage_error("Option --profile requires an argument\n");
+			profile_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--profile-interval") {
+			if (argc - i < 2)
+				usage_error("Option --profile-interval requires an argument\n");
+			profile_interval = parse_unsigned(argv[i + 1]);
+			if (profile_interval < 1)
+				usage_error("Profile interval must be positive\n");
+			i += 1;
+		}
+		else if (s == "--profile-calls") {
+			profile_calls = true;
+		}
+		else if (s == "--irq-latency") {
+			irq_latency_en = true;
+		}
+		else if (s == "--irq-latency-bucket") {
+			if (argc - i < 2)
+				usage_error("Option --irq-latency-bucket requires an argument\n");
+			irq_latency_bucket = parse_signed(argv[i + 1]);
+			if (irq_latency_bucket < 1)
+				usage_error("--irq-latency-bucket must be at least 1 cycle\n");
+			i += 1;
+		}
+		else if (s == "--bus-stats") {
+			bus_stats_en = true;
+		}
+		else if (s == "--power-stats") {
+			power_stats_en = true;
+		}
+		else if (s == "--power-stats-series") {
+			if (argc - i < 3)
+				usage_error("Option --power-stats-series requires 2 arguments\n");
+			power_stats_en = true;
+			power_series_path = argv[i + 1];
+			power_series_window = parse_signed(argv[i + 2]);
+			if (power_series_window < 1)
+				usage_error("--power-stats-series window must be at least 1 cycle\n");
+			i += 2;
+		}
+		else if (s == "--toggle") {
+			if (argc - i < 2)
+				usage_error("Option --toggle requires an argument\n");
+			toggle_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--toggle-filter") {
+			if (argc - i < 2)
+				usage_error("Option --toggle-filter requires an argument\n");
+			toggle_filters.push_back(argv[i + 1]);
+			i += 1;
+		}
+		else if (s == "--coverage") {
+			if (argc - i < 2)
+				usage_error("Option --coverage requires an argument\n");
+			coverage_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--coverage-filter") {
+			if (argc - i < 2)
+				usage_error("Option --coverage-filter requires an argument\n");
+			coverage_filters.push_back(argv[i + 1]);
+			i += 1;
+		}
+		else if (s == "--cover-fsm") {
+			if (argc - i < 2)
+				usage_error("Option --cover-fsm requires an argument\n");
+			fsm_filters.push_back(argv[i + 1]);
+			i += 1;
+		}
+		else if (s == "--progress") {
+			if (argc - i < 2)
+				usage_error("Option --progress requires an argument\n");
+			progress_interval = parse_signed(argv[i + 1]);
+			if (progress_interval <= 0)
+				usage_error("--progress interval must be positive\n");
+			i += 1;
+		}
+		else if (s == "--progress-socket") {
+			if (argc - i < 2)
+				usage_error("Option --progress-socket requires an argument\n");
+			progress_socket = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--roi") {
+			window.roi_en = true;
+		}
+		else if (s == "--fast-boot") {
+			fast_boot = true;
+		}
+		else if (s == "--bus-stats-series") {
+			if (argc - i < 3)
+				usage_error("Option --bus-stats-series requires 2 arguments\n");
+			bus_stats_en = true;
+			bus_series_path = argv[i + 1];
+			bus_series_window = parse_signed(argv[i + 2]);
+			if (bus_series_window < 1)
+				usage_error("--bus-stats-series window must be at least 1 cycle\n");
+			i += 2;
+		}
+		else if (s == "--heatmap") {
+			if (argc - i < 2)
+				usage_error("Option --heatmap requires an argument\n");
+			heatmap_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--ahb-trace") {
+			if (argc - i < 2)
+				usage_error("Option --ahb-trace requires an argument\n");
+			ahb_trace_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--btrace") {
+			if (argc - i < 2)
+				usage_error("Option --btrace requires an argument\n");
+			btrace_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--csr-profile") {
+			csr_profile_en = true;
+		}
+		else if (s == "--heatmap-block") {
+			if (argc - i < 2)
+				usage_error("Option --heatmap-block requires an argument\n");
+			heatmap_block = parse_unsigned(argv[i + 1]);
+			if (heatmap_block < 4 || heatmap_block > 4096 || (heatmap_block & (heatmap_block - 1)))
+				usage_error("--heatmap-block must be a power of two from 4 to 4096\n");
+			i += 1;
+		}
+		else if (s == "--jtagdump") {
+			if (argc - i < 2)
+				usage_error("Option --jtagdump requires an argument\n");
+			dump_jtag = true;
+			jtag_dump_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--jtagreplay") {
+			if (argc - i < 2)
+				usage_error("Option --jtagreplay requires an argument\n");
+			replay_jtag = true;
+			jtag_replay_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--dmi-port") {
+			if (argc - i < 2)
+				usage_error("Option --dmi-port requires an argument\n");
+			dmi_port = parse_signed(argv[i + 1]);
+			i += 1;
+		}
+		else if (s == "--semihost") {
+			semihost_en = true;
+		}
+		else if (s == "--record-inputs") {
+			if (argc - i < 2)
+				usage_error("Option --record-inputs requires an argument\n");
+			record_inputs_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--replay-inputs") {
+			if (argc - i < 2)
+				usage_error("Option --replay-inputs requires an argument\n");
+			replay_inputs_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--stimulus") {
+			if (argc - i < 2)
+				usage_error("Option --stimulus requires an argument\n");
+			std::string err;
+			if (!stimulus.load(argv[i + 1], err)) {
+				std::cerr << err << "\n";
+				return -1;
+			}
+			i += 1;
+		}
+		else if (s == "--stimulus-random") {
+			if (argc - i < 4)
+				usage_error("Option --stimulus-random requires 3 arguments\n");
+			stimulus_random = true;
+			stimulus_seed = parse_unsigned(argv[i + 1]);
+			stimulus_interval = parse_unsigned(argv[i + 2]);
+			stimulus_mask = parse_unsigned(argv[i + 3]);
+			if (stimulus_interval < 1 || !stimulus_mask)
+				usage_error("--stimulus-random requires a positive interval and a nonzero mask\n");
+			i += 3;
+		}
+		else if (s == "--jtag-edges") {
+			if (argc - i < 2)
+				usage_error("Option --jtag-edges requires an argument\n");
+			jtag_edges_per_cycle = parse_signed(argv[i + 1]);
+			if (jtag_edges_per_cycle < 1)
+				usage_error("--jtag-edges must be at least 1\n");
+			i += 1;
+		}
+		else if (s == "--dump") {
+			if (argc - i < 3)
+				usage_error("Option --dump requires 2 arguments\n");
+			dump_ranges.push_back(std::pair<uint32_t, uint32_t>(
+				parse_unsigned(argv[i + 1]),
+				parse_unsigned(argv[i + 2])
+			));;
+			i += 2;
+		}
+		else if (s == "--dump-check") {
+			if (argc - i < 4)
+				usage_error("Option --dump-check requires 3 arguments\n");
+			dump_check c;
+			c.start = parse_unsigned(argv[i + 1]);
+			c.end = parse_unsigned(argv[i + 2]);
+			c.path = argv[i + 3];
+			c.to_file_end = false;
+			expects.push_back(c);
+			i += 3;
+		}
+		else if (s == "--dump-bin") {
+			if (argc - i < 4)
+				usage_error("Option --dump-bin requires 3 arguments\n");
+			dump_check c;
+			c.start = parse_unsigned(argv[i + 1]);
+			c.end = parse_unsigned(argv[i + 2]);
+			c.path = argv[i + 3];
+			c.to_file_end = false;
+			dump_bins.push_back(c);
+			i += 3;
+		}
+		else if (s == "--expect") {
+			if (argc - i < 3)
+				usage_error("Option --expect requires 2 arguments\n");
+			dump_check c;
+			c.start = parse_unsigned(argv[i + 1]);
+			c.end = 0;
+			c.path = argv[i + 2];
+			c.to_file_end = true;
+			expects.push_back(c);
+			i += 2;
+		}
+		else if (s == "--signature") {
+			if (argc - i < 2)
+				usage_error("Option --signature requires an argument\n");
+			signature_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--cycles") {
+			if (argc - i < 2)
+				usage_error("Option --cycles requires an argument\n");
+			max_cycles = parse_signed(argv[i + 1]);
+			i += 1;
 		}
 		else if (s == "--port") {
 			if (argc - i < 2)
-				exit_help("Option --port requires an argument\n");
-			port = std::stol(argv[i + 1], 0, 0);
+				usage_error("Option --port requires an argument\n");
+			port = parse_signed(argv[i + 1]);
 			i += 1;
 		}
 		else if (s == "--cpuret") {
 			propagate_return_code = true;
 		}
+		else if (s == "--fast") {
+			fast = true;
+		}
+		else if (s == "--no-skip-sleep") {
+			skip_sleep = false;
+		}
+		else if (s == "--no-hang-detect") {
+			hang_detect = false;
+		}
+		else if (s == "--save-state") {
+			if (argc - i < 2)
+				usage_error("Option --save-state requires an argument\n");
+			save_state = true;
+			save_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--save-cycle") {
+			if (argc - i < 2)
+				usage_error("Option --save-cycle requires an argument\n");
+			save_cycle = parse_signed(argv[i + 1]);
+			i += 1;
+		}
+		else if (s == "--save-io") {
+			if (argc - i < 2)
+				usage_error("Option --save-io requires an argument\n");
+			save_io = true;
+			save_io_addr = parse_unsigned(argv[i + 1]);
+			i += 1;
+		}
+		else if (s == "--waitstates") {
+			if (argc - i < 6)
+				usage_error("Option --waitstates requires 5 arguments\n");
+			wait_region r;
+			if (const char *err = parse_wait_region(argv + i + 1, r))
+				usage_error(err);
+			latency.regions.push_back(r);
+			i += 5;
+		}
+		else if (s == "--contention") {
+			latency.contention = true;
+		}
+		else if (s == "--traffic") {
+			if (argc - i < 7)
+				usage_error("Option --traffic requires 6 arguments\n");
+			traffic_gen g;
+			if (const char *err = parse_traffic(argv + i + 1, g))
+				usage_error(err);
+			traffic.gens.push_back(g);
+			i += 6;
+		}
+		else if (s == "--xip") {
+			if (argc - i < 5)
+				usage_error("Option --xip requires 4 arguments\n");
+			if (const char *err = parse_xip(argv + i + 1, xip_cfg))
+				usage_error(err);
+			i += 4;
+		}
+		else if (s == "--icache") {
+			if (argc - i < 4)
+				usage_error("Option --icache requires 3 arguments\n");
+			if (const char *err = parse_icache(argv + i + 1, xip_cfg))
+				usage_error(err);
+			i += 3;
+		}
+		else if (s == "--restore-state") {
+			if (argc - i < 2)
+				usage_error("Option --restore-state requires an argument\n");
+			restore_state = true;
+			restore_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--restore-arch") {
+			if (argc - i < 2)
+				usage_error("Option --restore-arch requires an argument\n");
+			restore_arch_path = argv[i + 1];
+			i += 1;
+		}
+		else if (s == "--sample-warmup") {
+			if (argc - i < 2)
+				usage_error("Option --sample-warmup requires an argument\n");
+			sampler.warmup = parse_signed(argv[i + 1]);
+			i += 1;
+		}
+		else if (s == "--sample-measure") {
+			if (argc - i < 2)
+				usage_error("Option --sample-measure requires an argument\n");
+			sampler.measure = parse_signed(argv[i + 1]);
+			i += 1;
+		}
 		else {
-			std::cerr << "Unrecognised argument " << s << "\n";
-			exit_help("");
+			usage_error("Unrecognised argument " + s + "\n");
 		}
 	}
-	if (!(load_bin || port != 0 || replay_jtag))
-		exit_help("At least one of --bin, --port or --jtagreplay must be specified.\n");
+	bool restore_arch = !restore_arch_path.empty();
+	bool sampling = sampler.measure > 0;
+	if (!(load_bin || load_elf || port != 0 || dmi_port != 0 || replay_jtag || restore_state || restore_arch || fuzz))
+		usage_error("At least one of --bin, --elf, --port, --dmi-port, --jtagreplay, --restore-state or --restore-arch must be specified.\n");
+	if (fuzz && (load_bin || load_elf || restore_state))
+		usage_error("--fuzz can't be used with --bin, --elf or --restore-state\n");
+	if (dmi_port != 0 && dmi_port == port)
+		usage_error("--dmi-port must be different from --port\n");
+	if (!signature_path.empty() && !load_elf)
+		usage_error("--signature requires --elf\n");
+	if (load_bin && load_elf)
+		usage_error("Can't specify both --bin and --elf\n");
+	if (fast_boot && !(load_bin || load_elf))
+		usage_error("--fast-boot requires --bin or --elf\n");
+	if ((save_cycle != 0 || save_io) && !save_state)
+		usage_error("--save-cycle and --save-io require --save-state\n");
+	if (restore_state && cosim)
+		usage_error("--cosim can't be used with --restore-state\n");
+	if (!stimulus.fault_rules.empty() && cosim)
+		usage_error("--cosim can't be used with fault injection, which the reference core doesn't see\n");
+	if (restore_state && (load_bin || load_elf))
+		usage_error("Can't specify --restore-state with --bin or --elf\n");
 	if (dump_jtag && port == 0)
-		exit_help("--jtagdump specified, but there is no JTAG socket to dump from.\n");
+		usage_error("--jtagdump specified, but there is no JTAG socket to dump from.\n");
 	if (replay_jtag && port != 0)
-		exit_help("Can't specify both --port and --jtagreplay\n");
+		usage_error("Can't specify both --port and --jtagreplay\n");
+	if (!record_inputs_path.empty() && !replay_inputs_path.empty())
+		usage_error("--record-inputs and --replay-inputs are mutually exclusive\n");
+	if (replay_jtag && !(record_inputs_path.empty() && replay_inputs_path.empty()))
+		usage_error("--record-inputs and --replay-inputs are not compatible with --jtagreplay\n");
+	if (!toggle_filters.empty() && toggle_path.empty())
+		usage_error("--toggle-filter requires --toggle\n");
+	if (!(coverage_filters.empty() && fsm_filters.empty()) && coverage_path.empty())
+		usage_error("--coverage-filter and --cover-fsm require --coverage\n");
+	if (!window.filters.empty() && !(dump_waves || flight))
+		usage_error("--vcd-filter requires --vcd or --flight\n");
+	if ((window.cycles_en || window.pc_en || window.io_en) && !dump_waves)
+		usage_error("--vcd-cycles, --vcd-pc and --vcd-io require --vcd\n");
+	if (fast && (dump_waves || flight || port != 0 || dmi_port != 0 || replay_jtag))
+		usage_error("--fast is not compatible with --vcd, --flight, --port, --dmi-port or --jtagreplay\n");
+	if (semihost_en && (port != 0 || dmi_port != 0 || replay_jtag || cosim || save_state || restore_state))
+		usage_error("--semihost is not compatible with --port, --dmi-port, --jtagreplay, --cosim, --save-state or --restore-state\n");
+	if (tb_shm && (cosim || save_state || restore_state || !heatmap_path.empty()))
+		usage_error("--shm-cluster is not compatible with --cosim, --save-state, --restore-state or --heatmap\n");
+	if (restore_arch && (load_bin || load_elf || fuzz || restore_state || cosim || semihost_en || tb_shm ||
+			port != 0 || dmi_port != 0 || replay_jtag))
+		usage_error("--restore-arch is not compatible with --bin, --elf, --fuzz, --restore-state, --cosim, --semihost,\n"
+			"--shm-cluster, --port, --dmi-port or --jtagreplay\n");
+	if (sampler.warmup < 0 || sampler.measure < 0 || (sampler.warmup > 0 && !sampling))
+		usage_error("--sample-warmup requires --sample-measure, and both must be positive\n");
+	if (!bind_dut_ports(dut))
+		return -1;
+
+	InputLog inputs;
+	if (!record_inputs_path.empty() && !inputs.open_record(record_inputs_path)) {
+		std::cerr << "Failed to open \"" << record_inputs_path << "\"\n";
+		return -1;
+	}
+	if (!replay_inputs_path.empty() && !inputs.open_replay(replay_inputs_path)) {
+		std::cerr << "\"" << replay_inputs_path << "\" is not an input log\n";
+		return -1;
+	}
+	// The JTAG commands taken on this cycle, for the input log
+	std::string jtag_inputs;
 
-	int server_fd, sock_fd;
+	int server_fd = -1, sock_fd = -1;
 	struct sockaddr_in sock_addr;
-	int sock_opt = 1;
 	socklen_t sock_addr_len = sizeof(sock_addr);
 	char txbuf[TCP_BUF_SIZE], rxbuf[TCP_BUF_SIZE];
 	int rx_ptr = 0, rx_remaining = 0, tx_ptr = 0;
 
-	if (port != 0) {
-		server_fd = socket(AF_INET, SOCK_STREAM, 0);
-		if (server_fd == 0) {
-			fprintf(stderr, "socket creation failed\n");
-			exit(-1);
-		}
+	if (port != 0 && !inputs.replaying()) {
+		server_fd = open_server(port, sock_addr);
+		sock_fd = wait_for_connection(server_fd, port, (struct sockaddr *)&sock_addr, &sock_addr_len, out);
+	}
 
-		int setsockopt_rc = setsockopt(
-			server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT,
-			&sock_opt, sizeof(sock_opt)
-		);
+	dmi_server dmi;
+	dmi.inputs = &inputs;
+	dmi.out = out;
+	if (dmi_port != 0) {
+		dmi.start(dmi_port);
+		dut.dmi_direct_en.set(true);
+	}
 
-		if (setsockopt_rc) {
-			fprintf(stderr, "setsockopt failed\n");
-			exit(-1);
-		}
+	mem_io_state memio(out);
+	tb_io_block io_block(memio, dut);
+	memio.devices.add(IO_BASE, IO_SIZE, &io_block);
+	tb_timer timer(memio, dut);
+	memio.save_io_en = save_io;
+	memio.save_io_addr = save_io_addr;
+	memio.fast_boot = fast_boot;
+	// With --shm-cluster, the first process loads the shared memory for all
+	if (tb_shm)
+		memio.use_shm(tb_shm);
+	bool first_process = !tb_shm || tb_shm_rank == 0;
+	// Extent of what was loaded, for --cosim's copy of memory
+	size_t loaded_size = 0;
 
-		sock_addr.sin_family = AF_INET;
-		sock_addr.sin_addr.s_addr = INADDR_ANY;
-		sock_addr.sin_port = htons(port);
-		if (bind(server_fd, (struct sockaddr *)&sock_addr, sizeof(sock_addr)) < 0) {
-			fprintf(stderr, "bind failed\n");
-			exit(-1);
+	if (load_bin && first_process) {
+		// Map the file copy-on-write over the start of memory. The remainder
+		// of the file's last page reads as zeroes.
+		int fd = open(bin_path.c_str(), O_RDONLY);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0) {
+			std::cerr << "Failed to open \"" << bin_path << "\"\n";
+			return -1;
+		}
+		if (st.st_size > MEM_SIZE) {
+			std::cerr << "Binary file (" << st.st_size << " bytes) is larger than memory (" << MEM_SIZE << " bytes)\n";
+			return -1;
+		}
+		if (memio.mem_shared) {
+			// Shared memory can't be mapped from the file, so copy it in
+			for (off_t pos = 0; pos < st.st_size; ) {
+				ssize_t n = pread(fd, memio.mem + pos, st.st_size - pos, pos);
+				if (n <= 0) {
+					std::cerr << "Failed to read \"" << bin_path << "\"\n";
+					return -1;
+				}
+				pos += n;
+			}
+		} else if (st.st_size > 0 && mmap(memio.mem, st.st_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+			std::cerr << "Failed to map \"" << bin_path << "\"\n";
+			return -1;
 		}
+		close(fd);
+		loaded_size = st.st_size;
+	}
+#ifdef COSIM
+	if (fuzz) {
+		memcpy(memio.mem, fuzz->program->data(), fuzz->program->size());
+		loaded_size = fuzz->program->size();
+	}
+#endif
 
-		sock_fd = wait_for_connection(server_fd, port, (struct sockaddr *)&sock_addr, &sock_addr_len);
+	ElfFile elf;
+	if (load_elf) {
+		std::string err;
+		if (!elf.open(elf_path, err) || (first_process && !elf.load(memio.mem, 0, MEM_SIZE, err))) {
+			std::cerr << err << "\n";
+			return -1;
+		}
+		for (auto &seg : elf.segments)
+			loaded_size = std::max<size_t>(loaded_size, (size_t)seg.addr + seg.memsz);
+		if (first_process && elf.entry != RESET_VECTOR) {
+			// The reset vector is fixed in hardware, so jump from there to the
+			// entry point, clobbering t0 (as long as nothing was loaded there)
+			bool reset_vector_used = false;
+			for (auto &seg : elf.segments)
+				reset_vector_used = reset_vector_used ||
+					(seg.addr < RESET_VECTOR + 8 && seg.addr + seg.memsz > RESET_VECTOR);
+			if (reset_vector_used) {
+				std::cerr << "Warning: ignoring ELF entry point, as something is loaded at the reset vector\n";
+			} else {
+				uint32_t hi = (elf.entry + 0x800u) & 0xfffff000u;
+				uint32_t lo = elf.entry - hi;
+				uint32_t trampoline[2] = {
+					hi | (5u << 7) | 0x37u,      // lui t0, %hi(entry)
+					(lo << 20) | (5u << 15) | 0x67u // jalr zero, %lo(entry)(t0)
+				};
+				memcpy(memio.mem + RESET_VECTOR, trampoline, sizeof(trampoline));
+				loaded_size = std::max<size_t>(loaded_size, RESET_VECTOR + sizeof(trampoline));
+			}
+		}
+		uint32_t tohost;
+		if (elf.lookup("tohost", tohost)) {
+			memio.tohost_en = true;
+			memio.tohost_addr = tohost;
+		}
+	}
+	uint32_t signature_start = 0, signature_end = 0;
+	if (!signature_path.empty() && !(elf.lookup("begin_signature", signature_start) &&
+			elf.lookup("end_signature", signature_end) && signature_start <= signature_end &&
+			signature_end <= (uint32_t)MEM_SIZE)) {
+		std::cerr << "No valid begin_signature/end_signature symbols in " << elf_path << "\n";
+		return -1;
 	}
 
-	mem_io_state memio;
+#ifdef COSIM
+	cosim_checker checker;
+	checker.out = out;
+	if (cosim && !checker.init(dut, memio.mem, std::min<size_t>(loaded_size, MEM_SIZE)))
+		return -1;
+	if (fuzz)
+		checker.coverage = fuzz->coverage;
+#endif
+	bool cosim_failed = false;
 
-	if (load_bin) {
-		std::ifstream fd(bin_path, std::ios::binary | std::ios::ate);
-		if (!fd){
-			std::cerr << "Failed to open \"" << bin_path << "\"\n";
+	profile_monitor profile(profile_interval, profile_calls);
+	std::unique_ptr<MemHeatmap> heatmap;
+	if (!heatmap_path.empty()) {
+		heatmap.reset(new MemHeatmap(__builtin_ctz(heatmap_block)));
+		memio.heatmap = heatmap.get();
+	}
+	if (!profile_path.empty() && !profile.init(dut, memio))
+		return -1;
+	ahb_trace_writer ahb_trace;
+	bool ahb_trace_en = !ahb_trace_path.empty();
+	if (ahb_trace_en && !ahb_trace.open(ahb_trace_path)) {
+		std::cerr << "Failed to open \"" << ahb_trace_path << "\"\n";
+		return -1;
+	}
+	btrace_monitor btrace;
+	bool btrace_en = !btrace_path.empty();
+	if (btrace_en && !btrace.init(dut, btrace_path))
+		return -1;
+	// ~100 KiB of counters, so only allocated when used
+	std::unique_ptr<csr_profile_monitor> csr_profile;
+	if (csr_profile_en) {
+		csr_profile.reset(new csr_profile_monitor);
+		if (!csr_profile->init(dut))
 			return -1;
-		}
-		std::streamsize bin_size = fd.tellg();
-		if (bin_size > MEM_SIZE) {
-			std::cerr << "Binary file (" << bin_size << " bytes) is larger than memory (" << MEM_SIZE << " bytes)\n";
+	}
+
+	irq_latency_monitor irq_latency(irq_latency_bucket);
+	if (irq_latency_en) {
+		if (!irq_latency.init(dut))
 			return -1;
-		}
-		fd.seekg(0, std::ios::beg);
-		fd.read((char*)memio.mem, bin_size);
+		irq_latency.table_en = load_elf && elf.lookup("_external_irq_table", irq_latency.table);
 	}
 
-	std::ofstream jtag_dump_fd;
+	// Changes of region are seen at the end of the cycle of the IO_ROI
+	// write. With --roi, instrumentation is switched on and off with them.
+	roi_monitor roi(dut);
+	bus_stats bstats;
+	bool csr_profile_live = csr_profile_en;
+	bool toggle_en = !toggle_path.empty();
+	bool toggle_live = toggle_en;
+	toggle_monitor toggles;
+	auto roi_update = [&](int64_t cycles) {
+		roi.update(cycles, memio);
+		if (toggle_en)
+			toggles.set_region(memio.roi);
+		if (!window.roi_en)
+			return;
+		bool live = roi.active();
+		memio.heatmap = live ? heatmap.get() : nullptr;
+		profile.live = live;
+		csr_profile_live = live && csr_profile_en;
+		bstats.live = live && bus_stats_en;
+		toggle_live = live && toggle_en;
+	};
+
+	semihost_agent semihost(memio);
+	semihost.host.inputs = &inputs;
+	if (semihost_en)
+		semihost.start(dut);
+
+	arch_restore_agent arch_restore(memio);
+	if (sampling && !sampler.init(dut))
+		return -1;
+
+	// Anything which sees the design or testbench every cycle rules out
+	// skipping (--save-state only until the state is saved)
+	skip_sleep = skip_sleep && !(dump_waves || flight || port != 0 || dmi_port != 0 || replay_jtag ||
+		semihost_en || cosim || restore_arch || toggle_en || !coverage_path.empty());
+	sleep_skipper skipper;
+	if (skip_sleep && !skipper.init(dut, memio))
+		return -1;
+	hang_detector hang;
+	hang_detect = hang_detect && memio.n_harts == 1 && !(port != 0 || dmi_port != 0 || replay_jtag ||
+		semihost_en || tb_shm) && hang.init(dut, memio);
+	bool hung = false;
+
+	jtag_dump_writer jtag_dump;
 	if (dump_jtag) {
-		jtag_dump_fd.open(jtag_dump_path);
-		if (!jtag_dump_fd.is_open()) {
+		if (!jtag_dump.open(jtag_dump_path)) {
 			std::cerr << "Failed to open \"" << jtag_dump_path << "\"\n";
 			return -1;
 		}
 	}
 
-	std::ifstream jtag_replay_fd;
+	jtag_replay_reader jtag_replay;
 	if (replay_jtag) {
-		jtag_replay_fd.open(jtag_replay_path);
-		if (!jtag_replay_fd.is_open()) {
+		if (!jtag_replay.open(jtag_replay_path)) {
 			std::cerr << "Failed to open \"" << jtag_replay_path << "\"\n";
 			return -1;
 		}
 	}
 
-	cxxrtl_design::p_tb top;
+	if (dump_waves && !dut.waves_open(waves_path, window)) {
+		std::cerr << "Failed to open \"" << waves_path << "\"\n";
+		return -1;
+	}
 
-	std::ofstream waves_fd;
-	cxxrtl::vcd_writer vcd;
-	if (dump_waves) {
-		waves_fd.open(waves_path);
-		cxxrtl::debug_items all_debug_items;
-		top.debug_info(&all_debug_items, /*scopes=*/nullptr, "");
-		vcd.timescale(1, "us");
-		vcd.add(all_debug_items);
+	flight_recorder recorder;
+	if (flight)
+		recorder.init(dut, window, flight_cycles);
+	bool flight_written = false;
+	auto flight_dump = [&](const char *reason) {
+		if (!recorder.write(flight_path))
+			std::cerr << "Failed to open \"" << flight_path << "\"\n";
+		else
+			fprintf(out, "Flight recorder (%s): wrote last " I64_FMT " cycles to %s\n", reason,
+				(int64_t)(recorder.n_recorded / 2), flight_path.c_str());
+		flight_written = true;
+	};
+
+	std::vector<bus_port> ports;
+	if (!bind_bus_ports(dut, ports))
+		return -1;
+	const int n_ports = ports.size();
+	memio.n_harts = design_harts(dut);
+	memio.io_harts = memio.n_harts;
+	if (tb_shm) {
+		memio.hart_base = TB_HART_BASE;
+		if (memio.hart_base + std::max(n_ports, memio.n_harts) > MAX_BUS_PORTS) {
+			std::cerr << "Harts " << memio.hart_base << " onwards are beyond the " << MAX_BUS_PORTS << " supported by --shm-cluster\n";
+			return -1;
+		}
+		tb_shm->harts[tb_shm_rank].base = memio.hart_base;
+		tb_shm->harts[tb_shm_rank].count = memio.n_harts;
 	}
 
-	// Loop-carried address-phase requests
-	bus_request req_i;
-	bus_request req_d;
-	bool req_i_vld = false;
-	bool req_d_vld = false;
-	req_i.reservation_id = 0;
-	req_d.reservation_id = 1;
+	// Loop-carried address-phase requests. Port n is hart n's, so its
+	// reservation is numbered the same way as the hart.
+	tb_loop_state loop;
+	for (int p = 0; p < n_ports; ++p)
+		loop.port[p].req.reservation_id = memio.hart_base + p;
+
+	// Not part of the loop state, as their size depends on --icache
+	std::vector<std::unique_ptr<XipCache>> icaches(n_ports);
+	if (xip_cfg.enabled) {
+		for (auto &c : icaches)
+			c.reset(new XipCache(xip_cfg));
+	}
 
 	// Set bus interfaces to generate good IDLE responses at first
-	top.p_i__hready.set<bool>(true);
-	top.p_d__hready.set<bool>(true);
+	for (const bus_port &b : ports)
+		b.hready.set(true);
+
+	// The reset vector is patched until the hart is halted for restore
+	if (restore_arch) {
+		if (!arch_restore.load(restore_arch_path, dut))
+			return -1;
+		arch_restore.start(dut);
+	} else if (sampling) {
+		sampler.start(0);
+	}
 
 	// Reset + initial clock pulse
 
-	top.step();
-	top.p_clk.set<bool>(true);
-	top.p_tck.set<bool>(true);
-	top.step();
-	top.p_clk.set<bool>(false);
-	top.p_tck.set<bool>(false);
-	top.p_trst__n.set<bool>(true);
-	top.p_rst__n.set<bool>(true);
-	top.step();
-	top.step(); // workaround for github.com/YosysHQ/yosys/issues/2780
+	dut.step();
+	dut.clk.set(true);
+	dut.tck.set(true);
+	dut.step();
+	dut.clk.set(false);
+	dut.tck.set(false);
+	dut.trst_n.set(true);
+	dut.rst_n.set(true);
+	dut.step();
+	dut.step(); // workaround for github.com/YosysHQ/yosys/issues/2780
+
+	// Restoring overwrites all state, including the inputs driven above
+	int64_t start_cycle = 0;
+	if (restore_state) {
+		start_cycle = snapshot_restore(restore_path, dut, memio, loop);
+		if (start_cycle < 0)
+			return -1;
+		if (max_cycles != 0)
+			max_cycles += start_cycle;
+		if (replay_jtag && !jtag_replay.seek(start_cycle, jtag_edges_per_cycle)) {
+			std::cerr << "\"" << jtag_replay_path << "\" does not reach cycle " << start_cycle << "\n";
+			return -1;
+		}
+		inputs.seek(start_cycle);
+	}
+	// Events before a restored cycle are already reflected in the saved state
+	if (start_cycle > 0)
+		stimulus.run(start_cycle - 1, [](const StimulusEvent &) {});
+	if (stimulus_random)
+		stimulus.add_random(stimulus_seed, start_cycle, stimulus_interval, stimulus_mask);
+
+	// With --fast, the workaround step is replaced by a single eval/commit for
+	// the first few cycles, and kept only if that changes anything the
+	// testbench looks at (this depends on the yosys version). Any delta with
+	// the CPU running shows up within a few cycles of reset.
+	const int64_t SETTLE_PROBE_CYCLES = 1000;
+	bool need_settle_step = !fast && tb_dut::NEEDS_SETTLE_STEP;
+	bool bus_error = false;
+	int64_t settle_probe_end = start_cycle + (tb_dut::NEEDS_SETTLE_STEP ? SETTLE_PROBE_CYCLES : 0);
+
+	// Everything which sees the design once a cycle, or is skipped along
+	// with the harts' sleep. The barrier goes first, as it can request an
+	// exit and change the IRQ inputs.
+	std::vector<tb_monitor*> monitors;
+	shm_barrier_monitor barrier;
+	if (tb_shm) {
+		if (!barrier.init(dut, memio, start_cycle))
+			return -1;
+		monitors.push_back(&barrier);
+	}
+	bool cluster_stopped = false;
+	if (!profile_path.empty())
+		monitors.push_back(&profile);
+	if (bus_stats_en) {
+		if (!bstats.init(n_ports, memio.hart_base, bus_series_path, bus_series_window, start_cycle))
+			return -1;
+		monitors.push_back(&bstats);
+	}
+	power_monitor power;
+	if (power_stats_en) {
+		if (!power.init(dut, memio.n_harts, memio.hart_base, power_series_path, power_series_window, start_cycle))
+			return -1;
+		monitors.push_back(&power);
+	}
+	traffic_monitor traffic_mon(traffic, latency);
+	if (!traffic.empty())
+		monitors.push_back(&traffic_mon);
+	if (hang_detect) {
+		hang.quiet = [&] {
+			return stimulus.next_cycle == Stimulus::NEVER && !memio.faults.armed() && !save_state &&
+				!(restore_arch && !arch_restore.done);
+		};
+		monitors.push_back(&hang);
+	}
+	if (skip_sleep)
+		monitors.push_back(&skipper);
+	if (toggle_en && !toggles.init(dut, toggle_filters))
+		return -1;
+	bool coverage_en = !coverage_path.empty();
+	coverage_map local_coverage;
+	coverage_map *rtl_coverage_ptr = &local_coverage;
+#ifdef COSIM
+	if (fuzz && fuzz->rtl_coverage)
+		rtl_coverage_ptr = fuzz->rtl_coverage;
+#endif
+	coverage_map &rtl_coverage = *rtl_coverage_ptr;
+	coverage_monitor coverage;
+	if (coverage_en && !coverage.init(dut, coverage_filters, fsm_filters, rtl_coverage))
+		return -1;
 
+	roi_update(start_cycle);
+	progress_reporter progress;
+	if (!progress.start(dut, memio, n_ports, start_cycle, progress_interval, progress_socket))
+		return -1;
 	bool timed_out = false;
-	for (int64_t cycle = 0; cycle < max_cycles || max_cycles == 0; ++cycle) {
-		top.p_clk.set<bool>(false);
-		top.step();
-		if (dump_waves)
-			vcd.sample(cycle * 2);
-		top.p_clk.set<bool>(true);
-		top.step();
-		top.step(); // workaround for github.com/YosysHQ/yosys/issues/2780
+	for (int64_t cycle = start_cycle; cycle < max_cycles || max_cycles == 0; ++cycle) {
+		bool sample_waves = dump_waves && window.active(cycle, loop.port[PORT_I].req.addr, memio);
+		dut.clk.set(false);
+		dut.step();
+		if (dmi_port != 0)
+			dmi.sample(dut);
+		if (semihost_en)
+			semihost.sample(dut);
+		if (restore_arch)
+			arch_restore.sample(dut);
+		if (sample_waves)
+			dut.waves_sample(cycle * 2);
+		if (flight && !flight_written)
+			recorder.sample(cycle * 2);
+		dut.clk.set(true);
+		dut.step();
+		if (need_settle_step) {
+			dut.step(); // workaround for github.com/YosysHQ/yosys/issues/2780
+		} else if (cycle < settle_probe_end) {
+			uint32_t before[N_BUS_OUTPUTS] = {0}, after[N_BUS_OUTPUTS] = {0};
+			sample_bus_outputs(ports, before);
+			bool changed = dut.eval_commit();
+			sample_bus_outputs(ports, after);
+			if (changed || memcmp(before, after, sizeof(before)) != 0) {
+				need_settle_step = true;
+				dut.step();
+			}
+		}
+#ifdef COSIM
+		if (cosim && !checker.sample(dut, cycle)) {
+			cosim_failed = true;
+			break;
+		}
+#endif
+		for (tb_monitor *m : monitors)
+			m->sample();
+		if (btrace_en)
+			btrace.sample(memio);
+		if (csr_profile_live)
+			csr_profile->sample(memio);
+		if (roi.active())
+			roi.sample();
+		if (toggle_live)
+			toggles.sample();
+		if (coverage_en)
+			coverage.sample();
+		if (irq_latency_en)
+			irq_latency.sample(dut, memio, cycle);
+		bool sample_done = sampling && sampler.sample(cycle);
 
 		// If --port is specified, we run the simulator in lockstep with the
 		// remote bitbang commands, to get more consistent simulation traces.
@@ -502,187 +4584,475 @@ int main(int argc, char **argv) {
 		// free-running.
 		//
 		// Most bitbang commands complete in one cycle (e.g. TCK/TMS/TDI
-		// writes) but reads take 0 cycles, step=false.
+		// writes) but reads take 0 cycles, step=false. With --jtag-edges,
+		// several pin writes share a cycle, each followed by a step() to
+		// evaluate the TCK domain.
+		//
+		// The input log has the commands processed on each cycle, including a
+		// resync R on both of its cycles, so a replayed cycle drops any R left
+		// over from the last.
 		bool got_exit_cmd = false;
 		bool step = false;
+		int jtag_edges = 0;
 		if (port != 0 or replay_jtag) {
+			if (dump_jtag)
+				jtag_dump.mark(cycle);
+			if (inputs.replaying())
+				rx_remaining = 0;
 			while (!step) {
 				if (rx_remaining > 0) {
 					char c = rxbuf[rx_ptr++];
 					--rx_remaining;
+					if (inputs.recording())
+						jtag_inputs += c;
+					// Except for a resync R, which is put back for the next cycle
+					if (dump_jtag && !(c == 'R' && jtag_edges > 0))
+						jtag_dump.put(c);
 
 					if (c == 'r' || c == 's') {
-						top.p_trst__n.set<bool>(true);
+						dut.trst_n.set(true);
 						step = true;
 					}
 					else if (c == 't' || c == 'u') {
-						top.p_trst__n.set<bool>(false);
+						dut.trst_n.set(false);
 					}
 					else if (c >= '0' && c <= '7') {
 						int mask = c - '0';
-						top.p_tck.set<bool>(mask & 0x4);
-						top.p_tms.set<bool>(mask & 0x2);
-						top.p_tdi.set<bool>(mask & 0x1);
+						dut.tck.set(mask & 0x4);
+						dut.tms.set(mask & 0x2);
+						dut.tdi.set(mask & 0x1);
+						if (++jtag_edges < jtag_edges_per_cycle)
+							dut.step();
+						else
+							step = true;
+					}
+					else if (c == 'R' && jtag_edges > 0) {
+						// Resync: finish this cycle, then read TDO on the next
+						--rx_ptr;
+						++rx_remaining;
 						step = true;
 					}
 					else if (c == 'R') {
-						txbuf[tx_ptr++] = top.p_tdo.get<bool>() ? '1' : '0';
-						if (tx_ptr >= TCP_BUF_SIZE || rx_remaining == 0) {
+						txbuf[tx_ptr++] = dut.tdo.get() ? '1' : '0';
+						if (tx_ptr >= TCP_BUF_SIZE) {
 							send(sock_fd, txbuf, tx_ptr, 0);
 							tx_ptr = 0;
 						}
 					}
 					else if (c == 'Q') {
-						printf("OpenOCD sent quit command\n");
+						fprintf(out, "OpenOCD sent quit command\n");
 						got_exit_cmd = true;
 						step = true;
 					}
 				}
 				else {
-					// Potentially the last command was not a read command, but
-					// OpenOCD is still waiting for a last response from its
-					// last command packet before it sends us any more, so now is
-					// the time to flush TX.
-					if (tx_ptr > 0) {
-						send(sock_fd, txbuf, tx_ptr, 0);
-						tx_ptr = 0;
-					}	
+					// Take anything else that has already arrived without
+					// blocking, so its responses are coalesced with ours.
+					// Otherwise OpenOCD may be waiting for a response from
+					// its last command packet before it sends us any more,
+					// so now is the time to flush TX.
 					rx_ptr = 0;
-					if (replay_jtag) {
-						rx_remaining = jtag_replay_fd.readsome(rxbuf, TCP_BUF_SIZE);
-					}
-					else {
-						rx_remaining = read(sock_fd, &rxbuf, TCP_BUF_SIZE);
+					rx_remaining = 0;
+					if (!replay_jtag && !inputs.replaying()) {
+						rx_remaining = recv(sock_fd, &rxbuf, TCP_BUF_SIZE, MSG_DONTWAIT);
+						if (rx_remaining < 0)
+							rx_remaining = 0;
 					}
-					if (dump_jtag && rx_remaining > 0) {
-						jtag_dump_fd.write(rxbuf, rx_remaining);
+					if (rx_remaining == 0) {
+						if (tx_ptr > 0) {
+							send(sock_fd, txbuf, tx_ptr, 0);
+							tx_ptr = 0;
+						}
+						if (inputs.replaying()) {
+							// The end of the log is the end of the session
+							std::string e;
+							if (!inputs.done() && inputs.expect(InputLog::JTAG, cycle, e)) {
+								rx_remaining = std::min(e.size(), (size_t)TCP_BUF_SIZE);
+								memcpy(rxbuf, e.data(), rx_remaining);
+							}
+						}
+						else if (replay_jtag) {
+							rx_remaining = jtag_replay.read(rxbuf, TCP_BUF_SIZE);
+						}
+						else {
+							rx_remaining = read(sock_fd, &rxbuf, TCP_BUF_SIZE);
+						}
 					}
 					if (rx_remaining == 0) {
-						if (port == 0) {
+						if (port == 0 || inputs.replaying()) {
 							// Presumably EOF, so quit.
 							got_exit_cmd = true;
 						}
 						else {
 							// The socket is closed. Wait for another connection.
-							sock_fd = wait_for_connection(server_fd, port, (struct sockaddr *)&sock_addr, &sock_addr_len);
+							sock_fd = wait_for_connection(server_fd, port, (struct sockaddr *)&sock_addr, &sock_addr_len, out);
 						}
 					}
 				}
 			}
+			if (!jtag_inputs.empty()) {
+				inputs.put(InputLog::JTAG, cycle, jtag_inputs);
+				jtag_inputs.clear();
+			}
 		}
 
-		memio.step(top);
+		// Stimulus events take effect from the next cycle, as IO writes do
+		if ((uint64_t)cycle >= stimulus.next_cycle)
+			stimulus.run(cycle, [&](const StimulusEvent &e) {memio.apply_stimulus(dut, stimulus, e);});
+		memio.step();
+		if (dmi_port != 0)
+			dmi.drive(dut, cycle);
+		if (semihost_en)
+			semihost.drive(dut, cycle);
+		if (restore_arch && !arch_restore.done) {
+			arch_restore.drive(dut, cycle);
+			if (arch_restore.done && sampling)
+				sampler.start(cycle + 1);
+		}
 
-		// The two bus ports are handled identically. This enables swapping out of
+		// All bus ports are handled identically. This enables swapping out of
 		// various `tb.v` hardware integration files containing:
 		//
 		// - A single, dual-ported processor (instruction fetch, load/store ports)
 		// - A single, single-ported processor (instruction fetch + load/store muxed internally)
 		// - A pair of single-ported processors, for dual-core debug tests
+		// - A cluster of single-ported processors, one port each (tb_cluster.v)
+		//
+		// Ports are handled highest-numbered first, which is the order they
+		// win ties with --contention.
+		bool new_access[MAX_BUS_PORTS];
+		for (int p = n_ports - 1; p >= 0; --p) {
+			const bus_port &b = ports[p];
+			port_state &ps = loop.port[p];
+			new_access[p] = false;
 
-		if (top.p_d__hready.get<bool>()) {
-			// Clear bus error by default
-			top.p_d__hresp.set<bool>(false);
+			// With --fast, skip a port with no data phase and no address phase,
+			// as nothing it would drive is sampled. (An error response must
+			// still be completed, and its hresp cleared.)
+			bool active = !fast || ps.req_vld || !b.hready.get() || b.hresp.get() || b.htrans.get() >> 1;
+			if (bstats.live) {
+				bool busy = active && (ps.req_vld || b.htrans.get() >> 1);
+				++(busy ? bstats.total[p].busy : bstats.total[p].idle);
+			}
+			if (!active) {
+				// Idle
+			}
+			else if (!b.hready.get() && b.hresp.get()) {
+				// Phase 2 of error response
+				b.hready.set(true);
+			}
+			else if (ps.timing.stall > 0) {
+				// Wait state
+				--ps.timing.stall;
+				if (bstats.live)
+					++bstats.total[p].stall;
+				b.hready.set(false);
+				b.hresp.set(false);
+			}
+			else {
+				// Clear bus error by default
+				b.hready.set(true);
+				b.hresp.set(false);
 
-			// Handle current data phase
-			req_d.wdata = top.p_d__hwdata.get<uint32_t>();
-			bus_response resp;
-			if (req_d_vld)
-				resp = mem_access(top, memio, req_d);
-			else
-				resp.exokay = !memio.monitor_enabled;
-			if (resp.err) {
-				// Phase 1 of error response
-				top.p_d__hready.set<bool>(false);
-				top.p_d__hresp.set<bool>(true);
-			}
-			top.p_d__hrdata.set<uint32_t>(resp.rdata);
-			top.p_d__hexokay.set<bool>(resp.exokay);
-
-			// Progress current address phase to data phase
-			req_d_vld = top.p_d__htrans.get<uint8_t>() >> 1;
-			req_d.write = top.p_d__hwrite.get<bool>();
-			req_d.size = (bus_size_t)top.p_d__hsize.get<uint8_t>();
-			req_d.addr = top.p_d__haddr.get<uint32_t>();
-			req_d.excl = top.p_d__hexcl.get<bool>();
-		}
-		else {
-			// hready=0. Currently this only happens when we're in the first
-			// phase of an error response, so go to phase 2.
-			top.p_d__hready.set<bool>(true);
-		}
+				// Handle current data phase
+				ps.req.wdata = b.hwdata.get();
+				bus_response resp;
+				if (ps.req_vld) {
+					resp = mem_access(dut, memio, ps.req);
+					if (bstats.live)
+						bstats.data_phase(p, ps.req, resp);
+					if (ahb_trace_en)
+						ahb_trace_data_phase(ahb_trace, cycle, p, ps, resp);
+				}
+				else
+					resp.exokay = !memio.monitor_enabled();
+				if (resp.err) {
+					// Phase 1 of error response
+					bus_error = true;
+					b.hready.set(false);
+					b.hresp.set(true);
+				}
+				b.hrdata.set(resp.rdata);
+				b.hexokay.set(resp.exokay);
 
+				// Progress current address phase to data phase
+				uint32_t htrans = b.htrans.get();
+				ps.req_vld = htrans >> 1;
+				ps.req.write = b.hwrite.get();
+				ps.req.size = (bus_size_t)b.hsize.get();
+				ps.req.addr = b.haddr.get();
+				ps.req.excl = b.hexcl.get();
+				ps.req.fetch = !(b.hprot.get() & 1u);
+				if (ps.req_vld) {
+					ps.req_cycle = cycle;
+					ps.req_seq = htrans == 3;
+					start_access(latency, ps.timing, p, ps.req.addr, ps.req.size, htrans == 3,
+						ps.req.fetch ? icaches[p].get() : nullptr);
+					if (!traffic.empty())
+						ps.timing.stall += traffic.claim(ps.req.addr, ps.timing.stall);
+					new_access[p] = true;
+					if (bstats.live)
+						bstats.address_phase(p, htrans);
+				}
+			}
+		}
 
-		if (top.p_i__hready.get<bool>()) {
-			top.p_i__hresp.set<bool>(false);
+		if (latency.contention)
+			apply_contention(loop.port, n_ports, new_access);
 
-			req_i.wdata = top.p_i__hwdata.get<uint32_t>();
-			bus_response resp;
-			if (req_i_vld)
-				resp = mem_access(top, memio, req_i);
-			else
-				resp.exokay = !memio.monitor_enabled;
-			if (resp.err) {
-				// Phase 1 of error response
-				top.p_i__hready.set<bool>(false);
-				top.p_i__hresp.set<bool>(true);
-			}
-			top.p_i__hrdata.set<uint32_t>(resp.rdata);
-			top.p_i__hexokay.set<bool>(resp.exokay);
-
-			// Progress current address phase to data phase
-			req_i_vld = top.p_i__htrans.get<uint8_t>() >> 1;
-			req_i.write = top.p_i__hwrite.get<bool>();
-			req_i.size = (bus_size_t)top.p_i__hsize.get<uint8_t>();
-			req_i.addr = top.p_i__haddr.get<uint32_t>();
-			req_i.excl = top.p_i__hexcl.get<bool>();
+		bool record_flight = flight && !flight_written;
+		if (sample_waves || record_flight) {
+			// The extra step() is just here to get the bus responses to line up nicely
+			// in the VCD (hopefully is a quick update)
+			dut.step();
 		}
-		else {
-			// hready=0. Currently this only happens when we're in the first
-			// phase of an error response, so go to phase 2.
-			top.p_i__hready.set<bool>(true);
+		if (sample_waves)
+			dut.waves_sample(cycle * 2 + 1);
+		if (record_flight) {
+			recorder.sample(cycle * 2 + 1);
+			// First error only: tests of bus faults would otherwise overwrite it
+			if (bus_error)
+				flight_dump("bus error");
 		}
 
-		if (dump_waves) {
-			// The extra step() is just here to get the bus responses to line up nicely
-			// in the VCD (hopefully is a quick update)
-			top.step();
-			vcd.sample(cycle * 2 + 1);
-			waves_fd << vcd.buffer;
-			vcd.buffer.clear();
+		for (tb_monitor *m : monitors)
+			m->end_cycle(cycle + 1);
+		if (barrier.stopped) {
+			cluster_stopped = true;
+			break;
 		}
 
+		result.cycles = cycle + 1;
+		if (memio.roi_changed)
+			roi_update(cycle + 1);
 		if (memio.exit_req) {
-			printf("CPU requested halt. Exit code %d\n", memio.exit_code);
-			printf("Ran for " I64_FMT " cycles\n", cycle + 1);
+			memio.flush_print();
+			if (first_process) {
+				fprintf(out, "CPU requested halt. Exit code %d\n", memio.exit_code);
+				fprintf(out, "Ran for " I64_FMT " cycles\n", cycle + 1);
+			}
 			break;
 		}
+		if (semihost.failed || arch_restore.failed || sample_done)
+			break;
+		// Everything logged for this cycle should have been taken by now
+		if (inputs.replaying() && !inputs.check(cycle + 1))
+			break;
+		if (save_state && (
+				(save_cycle != 0 && cycle + 1 == save_cycle) || memio.save_req ||
+				(save_cycle == 0 && !save_io && cycle + 1 == max_cycles))) {
+			if (!snapshot_save(save_path, cycle + 1, dut, memio, loop))
+				return -1;
+			memio.flush_print();
+			fprintf(out, "Saved state to %s after " I64_FMT " cycles\n", save_path.c_str(), cycle + 1);
+			save_state = false;
+		}
 		if (cycle + 1 == max_cycles) {
-			printf("Max cycles reached\n");
+			memio.flush_print();
+			if (first_process)
+				fprintf(out, "Max cycles reached\n");
 			timed_out = true;
 		}
 		if (got_exit_cmd)
 			break;
+		if (cycle >= progress_request.load(std::memory_order_relaxed))
+			progress.report(cycle + 1, memio);
+		if (hang.hung && !timed_out) {
+			memio.flush_print();
+			fprintf(out, "Hang detected at pc %08x%s after " I64_FMT " cycles\n", hang.last_pc,
+				hang.clk_en && !*hang.clk_en ? " (in WFI)" : "", cycle + 1);
+			hung = true;
+			break;
+		}
+
+		if (skip_sleep && !save_state) {
+			bool bus_idle = true;
+			for (int p = 0; p < n_ports; ++p)
+				bus_idle = bus_idle && !loop.port[p].req_vld && ports[p].hready.get() && !ports[p].hresp.get();
+			// Leave the last cycle to run as normal, for the max cycles check
+			int64_t limit = max_cycles == 0 ? INT64_MAX : max_cycles - cycle - 2;
+			// ...and the next stimulus event
+			if (stimulus.next_cycle - cycle - 1 < (uint64_t)limit)
+				limit = stimulus.next_cycle - cycle - 1;
+			// ...and whatever a monitor does next, such as the end of a
+			// --bus-stats-series window or the next --shm-cluster barrier
+			for (const tb_monitor *m : monitors)
+				limit = std::min(limit, m->next_cycle() - cycle - 2);
+			int64_t n = skipper.check(bus_idle, limit);
+			if (n > 0) {
+				memio.step(n);
+				for (tb_monitor *m : monitors)
+					m->skip(n);
+				cycle += n;
+			}
+		}
+	}
+	memio.flush_print();
+	if (tb_shm) {
+		// Stop the other processes, and wait for them, so that memory is
+		// final for --dump. (tb_main counts them out.)
+		tb_shm->stop.store(true, std::memory_order_release);
+		while (first_process && tb_shm->ranks_done.load(std::memory_order_acquire) < tb_shm->n_ranks - 1)
+			sched_yield();
+		if (cluster_stopped && first_process)
+			std::cerr << "Another --shm-cluster process stopped without an exit request\n";
 	}
 
-	close(sock_fd);
+	progress.stop();
+	if (port != 0) {
+		close(sock_fd);
+		close(server_fd);
+	}
 	if (dump_jtag) {
-		jtag_dump_fd.close();
+		jtag_dump.close();
 	}
-	if (replay_jtag) {
-		jtag_replay_fd.close();
+	if (dump_waves)
+		dut.waves_close();
+#ifdef COSIM
+	// Check whatever is left in the ring buffer
+	if (cosim && !cosim_failed)
+		cosim_failed = !checker.drain();
+	if (cosim && !cosim_failed)
+		fprintf(out, "Co-simulation: %lu instructions matched\n", (unsigned long)checker.n_checked);
+#endif
+	if (!profile_path.empty() && !profile.profiler.write(profile_path, load_elf ? &elf : nullptr, out)) {
+		std::cerr << "Failed to write profile to \"" << profile_path << "\"\n";
+		return -1;
+	}
+	if (heatmap && !heatmap->write(heatmap_path, out)) {
+		std::cerr << "Failed to write heatmap to \"" << heatmap_path << "\"\n";
+		return -1;
+	}
+	if (btrace_en) {
+		btrace.close();
+		btrace.print(out);
+	}
+	if (csr_profile)
+		csr_profile->profile.print(out, 0, load_elf ? &elf : nullptr);
+	if (sampling)
+		sampler.print(out);
+	if (irq_latency_en)
+		irq_latency.print(out);
+	memio.faults.print(out);
+	for (int p = 0; p < n_ports; ++p) {
+		// D ports don't fetch
+		if (icaches[p] && icaches[p]->hits + icaches[p]->misses)
+			icaches[p]->print(out, ("Port " + std::to_string(p)).c_str());
+	}
+	memio.roi = RoiStats::NONE;
+	roi.update(result.cycles, memio);
+	roi.stats.print(out);
+	if (bus_stats_en) {
+		// Last, partial window
+		if (bstats.series && result.cycles > bstats.next_window - bstats.window)
+			bstats.end_window(result.cycles);
+		bstats.print(out);
+	}
+	traffic.print(out, result.cycles);
+	if (power_stats_en) {
+		if (power.stats.series && result.cycles > power.stats.next_window - power.stats.window)
+			power.stats.end_window(result.cycles);
+		power.stats.print(out, result.cycles);
+	}
+	if (toggle_en) {
+		toggles.print(out);
+		if (!toggles.write(toggle_path)) {
+			std::cerr << "Failed to write toggle counts to \"" << toggle_path << "\"\n";
+			return -1;
+		}
+	}
+	if (coverage_en) {
+		rtl_coverage.print(out, false);
+		if (!rtl_coverage.save(coverage_path)) {
+			std::cerr << "Failed to write coverage to \"" << coverage_path << "\"\n";
+			return -1;
+		}
+	}
+	if (flight && !flight_written) {
+		if (cosim_failed)
+			flight_dump("co-simulation mismatch");
+		else if (timed_out)
+			flight_dump("timeout");
+		else if (hung)
+			flight_dump("hang");
+		else if (memio.exit_req && memio.exit_code != 0)
+			flight_dump("nonzero exit code");
 	}
 
+	if (!first_process) {
+		dump_ranges.clear();
+		dump_bins.clear();
+		expects.clear();
+	}
 	for (auto r : dump_ranges) {
-		printf("Dumping memory from %08x to %08x:\n", r.first, r.second);
+		fprintf(out, "Dumping memory from %08x to %08x:\n", r.first, r.second);
 		for (int i = 0; i < r.second - r.first; ++i)
-			printf("%02x%c", memio.mem[r.first + i], i % 16 == 15 ? '\n' : ' ');
-		printf("\n");
+			fprintf(out, "%02x%c", memio.mem[r.first + i], i % 16 == 15 ? '\n' : ' ');
+		fprintf(out, "\n");
+	}
+
+	bool dump_failed = false;
+	for (auto &d : dump_bins) {
+		std::ofstream f(d.path, std::ios::binary);
+		if (d.start <= d.end && d.end <= (uint32_t)MEM_SIZE)
+			f.write((const char*)memio.mem + d.start, d.end - d.start);
+		if (!(f.good() && d.start <= d.end && d.end <= (uint32_t)MEM_SIZE)) {
+			fprintf(stderr, "Failed to write memory from %08x to %08x to \"%s\"\n", d.start, d.end, d.path.c_str());
+			dump_failed = true;
+		}
+	}
+
+	for (auto &e : expects) {
+		std::ifstream f(e.path, std::ios::binary);
+		std::vector<char> expected((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+		uint64_t end = e.to_file_end ? (uint64_t)e.start + expected.size() : e.end;
+		if (!f.is_open() || end > (uint64_t)MEM_SIZE) {
+			std::cerr << "Failed to open \"" << e.path << "\", or it extends past the end of memory\n";
+			dump_failed = true;
+			continue;
+		}
+		if (end < e.start || end - e.start != expected.size()) {
+			fprintf(out, "Memory from %08x to %08x does not match %s, which is %zu bytes\n", e.start,
+				(uint32_t)end, e.path.c_str(), expected.size());
+			dump_failed = true;
+			continue;
+		}
+		const uint8_t *mem = memio.mem + e.start;
+		if (memcmp(mem, expected.data(), expected.size()) == 0) {
+			fprintf(out, "Memory from %08x to %08x matches %s\n", e.start, (uint32_t)end, e.path.c_str());
+		} else {
+			size_t diff = std::mismatch(expected.begin(), expected.end(), (const char*)mem).first - expected.begin();
+			fprintf(out, "Memory from %08x to %08x does not match %s: first difference at %08x\n",
+				e.start, (uint32_t)end, e.path.c_str(), e.start + (uint32_t)diff);
+			dump_failed = true;
+		}
 	}
+	result.dump_check_pass = result.dump_check_pass && !dump_failed;
 
-	if (propagate_return_code && timed_out) {
+	bool signature_failed = false;
+	if (!signature_path.empty() && first_process) {
+		std::ofstream f(signature_path, std::ios::binary);
+		f.write((const char*)memio.mem + signature_start, signature_end - signature_start);
+		signature_failed = !f.good();
+		if (signature_failed)
+			std::cerr << "Failed to write signature to \"" << signature_path << "\"\n";
+	}
+
+	result.exited = memio.exit_req;
+	result.exit_code = memio.exit_code;
+	result.timed_out = timed_out || hung;
+	result.hung = hung;
+
+	if (inputs.failed)
+		std::cerr << inputs.error << "\n";
+	if (cosim_failed || semihost.failed || arch_restore.failed || inputs.failed || signature_failed || dump_failed ||
+			(propagate_return_code && timed_out) ||
+			(cluster_stopped && first_process)) {
 		return -1;
 	}
+	else if (propagate_return_code && hung) {
+		return -2;
+	}
 	else if (propagate_return_code && memio.exit_req) {
 		return memio.exit_code;
 	}
@@ -690,3 +5060,384 @@ int main(int argc, char **argv) {
 		return 0;
 	}
 }
+
+static std::string json_string(const std::string &s) {
+	std::string out = "\"";
+	for (char c : s) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if ((unsigned char)c < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			out += buf;
+		} else {
+			out += c;
+		}
+	}
+	return out + "\"";
+}
+
+struct batch_test {
+	std::string name;
+	std::vector<std::string> args;
+	std::string log_path;
+	// Set for a bad manifest line, which fails without running
+	std::string error;
+};
+
+// Run every test in a manifest, with the test's own options appended to the
+// common options. Each test's output goes to its --log file (or stderr), so
+// that stdout carries only the results.
+//
+// With more than one thread, each thread has a design of its own, and takes
+// the next test from the manifest whenever it finishes one. All of a run's
+// state belongs to its call to run(), so runs only share what is read-only:
+// the manifest, and the page cache behind each --bin, which is mapped rather
+// than read. A test without --log has its output held until it ends, then
+// written to stderr, so that tests don't interleave. Results are in order of
+// completion.
+int run_batch(const std::string &manifest, const std::vector<std::string> &common_args, int n_threads) {
+	std::ifstream f(manifest);
+	if (!f.is_open()) {
+		std::cerr << "Failed to open \"" << manifest << "\"\n";
+		return -1;
+	}
+	std::vector<batch_test> tests;
+	std::string line;
+	while (std::getline(f, line)) {
+		std::istringstream ss(line);
+		batch_test t;
+		if (!(ss >> t.name) || t.name[0] == '#')
+			continue;
+		t.args = common_args;
+		std::string arg;
+		while (ss >> arg) {
+			if (arg == "--log") {
+				if (!(ss >> t.log_path))
+					t.error = "Option --log requires an argument";
+			} else {
+				t.args.push_back(arg);
+			}
+		}
+		// Progress requests are per process (SIGUSR1), not per run
+		for (auto &a : t.args) {
+			if (n_threads > 1 && (a == "--progress" || a == "--progress-socket"))
+				t.error = a + " is not compatible with --threads";
+		}
+		tests.push_back(t);
+	}
+
+	std::mutex results_mutex;
+	std::atomic<size_t> next_test(0);
+	bool all_passed = true;
+	bool log_failed = false;
+
+	auto worker = [&]() {
+		std::unique_ptr<tb_dut> dut(new tb_dut);
+		dut->save_initial();
+		bool first = true;
+		size_t i;
+		while ((i = next_test.fetch_add(1)) < tests.size()) {
+			batch_test &t = tests[i];
+			std::vector<char*> argv;
+			argv.push_back((char*)"tb");
+			for (auto &a : t.args)
+				argv.push_back(&a[0]);
+			argv.push_back(nullptr);
+
+			if (!first)
+				dut->reset();
+			first = false;
+
+			char *held = nullptr;
+			size_t held_size = 0;
+			FILE *log;
+			if (!t.log_path.empty())
+				log = fopen(t.log_path.c_str(), "w");
+			else if (n_threads > 1)
+				log = open_memstream(&held, &held_size);
+			else
+				log = stderr;
+			if (!log) {
+				std::lock_guard<std::mutex> lock(results_mutex);
+				std::cerr << "Failed to open \"" << t.log_path << "\"\n";
+				log_failed = true;
+				next_test.store(tests.size());
+				return;
+			}
+			run_result r;
+			int rc = -1;
+			if (!t.error.empty()) {
+				r.error = t.error;
+				fprintf(log, "%s\n", r.error.c_str());
+			} else {
+				try {
+					rc = run(argv.size() - 1, argv.data(), *dut, r, log);
+				}
+				catch (bad_usage e) {
+					// Trailing newline is for the help text
+					r.error = e.errtext.substr(0, e.errtext.find_last_not_of('\n') + 1);
+					fprintf(log, "%s\n", r.error.c_str());
+				}
+			}
+			if (log != stderr)
+				fclose(log);
+			else
+				fflush(log);
+
+			bool pass = rc == 0 && r.exited && r.exit_code == 0 && r.dump_check_pass;
+			std::lock_guard<std::mutex> lock(results_mutex);
+			if (held) {
+				fwrite(held, 1, held_size, stderr);
+				free(held);
+			}
+			all_passed = all_passed && pass;
+			printf("{\"test\": %s, \"exit_code\": %s, \"cycles\": " I64_FMT ", \"timed_out\": %s, "
+				"\"hung\": %s, \"dump_check\": %s, \"pass\": %s%s}\n",
+				json_string(t.name).c_str(), r.exited ? std::to_string(r.exit_code).c_str() : "null",
+				r.cycles, r.timed_out ? "true" : "false", r.hung ? "true" : "false",
+				r.dump_check_pass ? "true" : "false", pass ? "true" : "false",
+				r.error.empty() ? "" : (", \"error\": " + json_string(r.error)).c_str());
+			fflush(stdout);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (int i = 1; i < n_threads; ++i)
+		threads.emplace_back(worker);
+	worker();
+	for (auto &t : threads)
+		t.join();
+	if (log_failed)
+		return -1;
+	return all_passed ? 0 : 1;
+}
+
+struct fuzz_options {
+	uint64_t iterations = 0; // 0 for no limit
+	uint64_t seed = 1;
+	size_t len = 200;
+	std::string out_dir = ".";
+};
+
+#ifdef COSIM
+static bool write_file(const std::string &path, const void *data, size_t size) {
+	std::ofstream f(path, std::ios::binary);
+	f.write((const char*)data, size);
+	return f.good();
+}
+
+// Coverage-guided differential fuzzing: run generated programs under
+// --cosim, in this process, resetting the design between runs as for
+// --batch. Programs which reach new coverage in the reference core, or with
+// --coverage new RTL coverage, join the corpus that later programs are
+// mutated from. A program which mismatches
+// or times out is written out with its log, to rerun with --bin and --cosim.
+int run_fuzz(const fuzz_options &opts, const std::vector<std::string> &common_args) {
+	tb_dut dut;
+	if (design_harts(dut) != 1) {
+		std::cerr << "--fuzz requires a single-hart topology\n";
+		return -1;
+	}
+	dut.save_initial();
+
+	// Each run's output goes to a scratch file, kept only on failure
+	FILE *log = tmpfile();
+	if (!log) {
+		std::cerr << "Failed to create log file\n";
+		return -1;
+	}
+	int log_fd = fileno(log);
+
+	FuzzGenerator gen(opts.seed);
+	FuzzCoverage coverage;
+	coverage_map rtl_coverage;
+	std::vector<FuzzProgram> corpus;
+	uint64_t n_failed = 0;
+	uint64_t iter = 0;
+	auto t_start = std::chrono::steady_clock::now();
+	auto t_report = t_start;
+	auto report = [&]() {
+		double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+		fprintf(stdout, "%lu runs (%.0f/s), %zu in corpus, %lu failed, coverage: ",
+			(unsigned long)iter, t > 0 ? iter / t : 0.0, corpus.size(), (unsigned long)n_failed);
+		coverage.print(stdout);
+		fprintf(stdout, "\n");
+		if (!rtl_coverage.sets.empty())
+			rtl_coverage.print(stdout, false);
+		fflush(stdout);
+	};
+
+	for (; opts.iterations == 0 || iter < opts.iterations; ++iter) {
+		FuzzProgram prog;
+		if (corpus.empty() || gen.rand32() % 4 == 0) {
+			gen.generate(prog, opts.len);
+		} else {
+			prog = corpus[gen.rand32() % corpus.size()];
+			gen.mutate(prog, corpus[gen.rand32() % corpus.size()]);
+		}
+		std::vector<uint8_t> image = prog.assemble();
+		// Generated programs always exit, so a timeout is a failure. Options
+		// from the command line come later, so win.
+		std::vector<std::string> args = {"tb", "--cosim", "--cycles", std::to_string(100 * prog.body.size() + 10000)};
+		args.insert(args.end(), common_args.begin(), common_args.end());
+		std::vector<char*> argv;
+		for (auto &a : args)
+			argv.push_back(&a[0]);
+		argv.push_back(nullptr);
+
+		if (iter != 0)
+			dut.reset();
+		rewind(log);
+		if (ftruncate(log_fd, 0) != 0) {
+			std::cerr << "Failed to truncate log file\n";
+			return -1;
+		}
+		size_t n_hit = coverage.n_hit;
+		uint64_t rtl_n_hit = rtl_coverage.n_hit();
+		coverage.reset();
+		fuzz_run fr = {&image, &coverage, &rtl_coverage};
+		run_result r;
+		int rc = run(argv.size() - 1, argv.data(), dut, r, log, &fr);
+		fflush(log);
+
+		if (rc != 0 || r.timed_out) {
+			++n_failed;
+			std::string path = opts.out_dir + "/fuzz-" + std::to_string(opts.seed) + "-" + std::to_string(iter);
+			std::string log_text(lseek(log_fd, 0, SEEK_CUR), '\0');
+			bool saved = pread(log_fd, &log_text[0], log_text.size(), 0) == (ssize_t)log_text.size() &&
+				write_file(path + ".bin", image.data(), image.size()) &&
+				write_file(path + ".log", log_text.data(), log_text.size());
+			fprintf(stdout, "Run %lu failed (%s)", (unsigned long)iter, r.timed_out ? "timeout" : "mismatch");
+			if (saved)
+				fprintf(stdout, ": rerun with --bin %s.bin --cosim, log in %s.log\n", path.c_str(), path.c_str());
+			else
+				fprintf(stdout, ", and failed to write %s.bin\n", path.c_str());
+		} else if (coverage.n_hit > n_hit || rtl_coverage.n_hit() > rtl_n_hit) {
+			corpus.push_back(prog);
+		}
+		auto now = std::chrono::steady_clock::now();
+		if (now - t_report >= std::chrono::seconds(5)) {
+			t_report = now;
+			report();
+		}
+	}
+	report();
+	fclose(log);
+	return n_failed ? 1 : 0;
+}
+#endif
+
+// --coverage-merge: OR together coverage files from runs of the same design
+static int run_coverage_merge(const std::string &out, const std::vector<std::string> &inputs) {
+	coverage_map merged;
+	for (size_t i = 0; i < inputs.size(); ++i) {
+		coverage_map m;
+		if (!m.load(inputs[i])) {
+			std::cerr << "Failed to read coverage from \"" << inputs[i] << "\"\n";
+			return -1;
+		}
+		if (i == 0) {
+			merged = m;
+		} else if (!merged.merge(m)) {
+			std::cerr << "Coverage points in \"" << inputs[i] << "\" differ from \"" << inputs[0] << "\"\n";
+			return -1;
+		}
+	}
+	if (!merged.save(out)) {
+		std::cerr << "Failed to write coverage to \"" << out << "\"\n";
+		return -1;
+	}
+	merged.print(stdout, true);
+	return 0;
+}
+
+int tb_main(int argc, char **argv) {
+	std::string manifest;
+	std::vector<std::string> common_args;
+	int n_threads = 1;
+	bool fuzz = false;
+	fuzz_options fuzz_opts;
+	if (argc >= 2 && std::string(argv[1]) == "--coverage-merge") {
+		if (argc < 4)
+			exit_help("Option --coverage-merge requires an output file and at least one input file\n");
+		return run_coverage_merge(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+	}
+	for (int i = 1; i < argc; ++i) {
+		std::string s(argv[i]);
+		if (s == "--batch") {
+			if (argc - i < 2)
+				exit_help("Option --batch requires an argument\n");
+			manifest = argv[++i];
+		} else if (s == "--threads") {
+			if (argc - i < 2)
+				exit_help("Option --threads requires an argument\n");
+			try {
+				n_threads = parse_signed(argv[++i]);
+			}
+			catch (bad_usage e) {
+				exit_help(e.errtext);
+			}
+			if (n_threads < 1)
+				exit_help("--threads must be at least 1\n");
+		} else if (s == "--fuzz" || s == "--fuzz-seed" || s == "--fuzz-len" || s == "--fuzz-out") {
+			if (argc - i < 2)
+				exit_help("Option " + s + " requires an argument\n");
+			std::string v = argv[++i];
+			if (s == "--fuzz") {
+				fuzz = true;
+				fuzz_opts.iterations = std::stoull(v, 0, 0);
+			} else if (s == "--fuzz-seed") {
+				fuzz_opts.seed = std::stoull(v, 0, 0);
+			} else if (s == "--fuzz-len") {
+				fuzz_opts.len = std::stoul(v, 0, 0);
+				if (fuzz_opts.len < 1 || fuzz_opts.len > 8192)
+					exit_help("--fuzz-len must be from 1 to 8192\n");
+			} else {
+				fuzz_opts.out_dir = v;
+			}
+		} else {
+			common_args.push_back(argv[i]);
+		}
+	}
+	if (!manifest.empty() && tb_shm)
+		exit_help("--batch is not compatible with --shm-cluster\n");
+	if (n_threads > 1 && manifest.empty())
+		exit_help("--threads requires --batch\n");
+	if (fuzz && (tb_shm || !manifest.empty()))
+		exit_help("--fuzz is not compatible with --shm-cluster or --batch\n");
+	if (fuzz) {
+#ifdef COSIM
+		try {
+			return run_fuzz(fuzz_opts, common_args);
+		}
+		catch (bad_usage e) {
+			exit_help(e.errtext);
+		}
+#else
+		exit_help("Option --fuzz requires tb to be built with `make COSIM=1`\n");
+#endif
+	}
+	if (!manifest.empty())
+		return run_batch(manifest, common_args, n_threads);
+	tb_dut dut;
+	run_result result;
+	try {
+		return run(argc, argv, dut, result);
+	}
+	catch (bad_usage e) {
+		exit_help(e.errtext);
+	}
+}
+
+#ifdef TB_TOPOLOGY
+}
+#else
+tb_shm_cluster *tb_shm = nullptr;
+int tb_shm_rank = 0;
+
+int main(int argc, char **argv) {
+	return tb_main(argc, argv);
+}
+#endif
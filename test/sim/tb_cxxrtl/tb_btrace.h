@@ -0,0 +1,189 @@
+#pragma once
+
+// Branch trace (tb --btrace), in the style of the RISC-V E-trace branch
+// trace: only changes of control flow are recorded, and btrace_decode
+// rebuilds the full PC stream from them and the program's ELF. Shared by
+// tb.cpp and btrace_decode.cpp. C++14, and no dependencies on the design.
+//
+// The file is the magic, then the start PC (the first retired instruction)
+// as a varint, then one packet per discontinuity. A packet's header is a
+// varint of (n << 3 | kind), where n is the number of instructions retired
+// since the previous packet, in a straight line from where it left off, the
+// last of which leads to the discontinuity. Kinds:
+//
+// - DIRECT: the last instruction is a branch or direct jump, which went to
+//   its target. Nothing follows, as the target is in the instruction.
+// - JUMP: the last instruction went somewhere else, e.g. jalr, mret, or
+//   resuming from Debug Mode
+// - EXCEPTION: the last instruction trapped, and went to the trap vector
+// - INTERRUPT: an interrupt was taken after the last instruction
+// - END: the trace ends after the last instruction
+//
+// Apart from DIRECT and END, the header is followed by the new PC, as a
+// zigzag varint of its difference from the PC of the last instruction
+// retired, in halfwords. A taken branch or jal is one byte for up to 15
+// instructions between discontinuities.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "tb_output.h"
+
+static const char BTRACE_MAGIC[8] = {'h', '3', 'b', 't', 'r', 'c', 'e', '1'};
+
+enum btrace_kind {
+	BTRACE_DIRECT = 0,
+	BTRACE_JUMP = 1,
+	BTRACE_EXCEPTION = 2,
+	BTRACE_INTERRUPT = 3,
+	BTRACE_END = 4
+};
+
+static inline unsigned btrace_instr_len(uint32_t instr) {
+	return (instr & 0x3u) == 0x3u ? 4 : 2;
+}
+
+// If instr at pc is a conditional branch or direct jump (jal, c.j, c.jal,
+// c.beqz, c.bnez), sets target to where it goes when taken, and returns
+// true
+static inline bool btrace_direct_target(uint32_t instr, uint32_t pc, uint32_t &target) {
+	auto sext = [](uint32_t x, int bits) {return (uint32_t)((int32_t)(x << (32 - bits)) >> (32 - bits));};
+	auto bit = [&](int n) {return instr >> n & 1u;};
+	if ((instr & 0x7fu) == 0x6fu) {
+		// jal
+		uint32_t imm = bit(31) << 20 | (instr >> 12 & 0xffu) << 12 | bit(20) << 11 | (instr >> 21 & 0x3ffu) << 1;
+		target = pc + sext(imm, 21);
+		return true;
+	}
+	if ((instr & 0x7fu) == 0x63u && (instr >> 12 & 0x7u) != 2 && (instr >> 12 & 0x7u) != 3) {
+		// beq, bne, blt, bge, bltu, bgeu
+		uint32_t imm = bit(31) << 12 | bit(7) << 11 | (instr >> 25 & 0x3fu) << 5 | (instr >> 8 & 0xfu) << 1;
+		target = pc + sext(imm, 13);
+		return true;
+	}
+	uint32_t op = (instr & 0x3u) | (instr >> 13 & 0x7u) << 2;
+	if ((instr & 0x3u) != 0x3u && (op == 0x05 || op == 0x15)) {
+		// c.jal, c.j
+		uint32_t imm = bit(12) << 11 | bit(11) << 4 | (instr >> 9 & 0x3u) << 8 | bit(8) << 10 | bit(7) << 6 |
+			bit(6) << 7 | (instr >> 3 & 0x7u) << 1 | bit(2) << 5;
+		target = pc + sext(imm, 12);
+		return true;
+	}
+	if ((instr & 0x3u) != 0x3u && (op == 0x19 || op == 0x1d)) {
+		// c.beqz, c.bnez
+		uint32_t imm = bit(12) << 8 | (instr >> 10 & 0x3u) << 3 | (instr >> 5 & 0x3u) << 6 | (instr >> 3 & 0x3u) << 1 |
+			bit(2) << 5;
+		target = pc + sext(imm, 9);
+		return true;
+	}
+	return false;
+}
+
+static inline void btrace_put_varint(std::vector<uint8_t> &buf, uint64_t x) {
+	while (x >= 0x80) {
+		buf.push_back((uint8_t)(x | 0x80));
+		x >>= 7;
+	}
+	buf.push_back((uint8_t)x);
+}
+
+static inline uint64_t btrace_zigzag(uint32_t target, uint32_t from) {
+	int32_t d = (int32_t)(target - from) >> 1;
+	return (uint32_t)(d << 1) ^ (uint32_t)(d >> 31);
+}
+
+static inline uint32_t btrace_unzigzag(uint64_t z, uint32_t from) {
+	int32_t d = (int32_t)((uint32_t)z >> 1) ^ -(int32_t)(z & 1u);
+	return from + ((uint32_t)d << 1);
+}
+
+struct btrace_writer {
+	static const size_t BUF_SIZE = 1u << 16;
+	static const size_t RING_SIZE = 1u << 22;
+
+	tb_output_stream out;
+	std::vector<uint8_t> buf;
+	uint64_t bytes;
+	uint64_t packets;
+
+	btrace_writer(): bytes(0), packets(0) {}
+
+	~btrace_writer() {
+		close();
+	}
+
+	bool open(const std::string &path) {
+		if (!out.open(path, RING_SIZE))
+			return false;
+		out.write(BTRACE_MAGIC, sizeof(BTRACE_MAGIC));
+		bytes = sizeof(BTRACE_MAGIC);
+		buf.reserve(BUF_SIZE + 16);
+		return true;
+	}
+
+	void start(uint32_t pc) {
+		btrace_put_varint(buf, pc);
+	}
+
+	void packet(btrace_kind kind, uint64_t n, uint32_t target = 0, uint32_t from = 0) {
+		btrace_put_varint(buf, n << 3 | kind);
+		if (kind != BTRACE_DIRECT && kind != BTRACE_END)
+			btrace_put_varint(buf, btrace_zigzag(target, from));
+		++packets;
+		if (buf.size() >= BUF_SIZE)
+			flush();
+	}
+
+	void close() {
+		if (!out.is_open())
+			return;
+		flush();
+		out.close();
+	}
+
+private:
+	void flush() {
+		out.write(buf.data(), buf.size());
+		bytes += buf.size();
+		buf.clear();
+	}
+};
+
+struct btrace_reader {
+	std::vector<uint8_t> data;
+	size_t pos;
+
+	btrace_reader(): pos(0) {}
+
+	// Returns false if the file can't be read or isn't a branch trace
+	bool open(const std::string &path) {
+		FILE *f = fopen(path.c_str(), "rb");
+		if (!f)
+			return false;
+		uint8_t chunk[1 << 16];
+		size_t n;
+		while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+			data.insert(data.end(), chunk, chunk + n);
+		fclose(f);
+		if (data.size() < sizeof(BTRACE_MAGIC) || memcmp(data.data(), BTRACE_MAGIC, sizeof(BTRACE_MAGIC)))
+			return false;
+		pos = sizeof(BTRACE_MAGIC);
+		return true;
+	}
+
+	// Returns false at the end of the file, including partway through a
+	// varint (a trace cut short)
+	bool varint(uint64_t &x) {
+		x = 0;
+		for (int shift = 0; pos < data.size() && shift < 64; shift += 7) {
+			uint8_t b = data[pos++];
+			x |= (uint64_t)(b & 0x7fu) << shift;
+			if (!(b & 0x80u))
+				return true;
+		}
+		return false;
+	}
+};
@@ -0,0 +1,460 @@
+#pragma once
+
+// Bus timing and transaction traces, shared by tb.cpp and ahb_replay.cpp:
+// the latency model for --waitstates and --contention, the background
+// masters of --traffic, and the format of --ahb-trace, which ahb_replay
+// plays back through the latency model without the design. C++14, and no
+// dependencies on the design. The --xip I-cache model is rvcpp's, from
+// rv_icache.h.
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../rvcpp/include/rv_icache.h"
+#include "tb_output.h"
+#include "tb_shm.h"
+
+// Latency model: wait states for an address range, for some set of ports.
+// An access is sequential if it is htrans=SEQ, or directly follows the
+// previous access from the same port (as for flash with a prefetch buffer).
+// Hazard3 only issues SINGLE NONSEQ transfers, so the second case is how
+// linear fetch and memcpy-style traffic get the sequential discount.
+enum {
+	PORT_I = 0,
+	PORT_D = 1
+};
+
+struct wait_region {
+	uint32_t start;
+	uint32_t end;
+	// Bit n set for port n
+	uint32_t port_mask;
+	int nonseq;
+	int seq;
+};
+
+struct latency_model {
+	std::vector<wait_region> regions;
+	// With contention, an access to a region which is busy with another
+	// port's data phase waits for it to finish. The higher-numbered port
+	// (the D port, for tb.v) wins ties.
+	bool contention;
+	latency_model(): contention(false) {}
+
+	// Region index for an access, or -1 for zero wait states
+	int lookup(int port, uint32_t addr) const {
+		for (size_t i = 0; i < regions.size(); ++i) {
+			const wait_region &r = regions[i];
+			if ((r.port_mask >> port & 1u) && addr >= r.start && addr < r.end)
+				return i;
+		}
+		return -1;
+	}
+};
+
+struct port_timing {
+	// Wait states left to insert before the current data phase completes
+	int stall;
+	int region;
+	// Address following the previous access, for detecting sequential access
+	uint32_t next_addr;
+	port_timing(): stall(0), region(-1), next_addr(0) {}
+};
+
+// Called on each address phase, to set the wait states for its data phase.
+// A fetch through the port's --xip I-cache (if any) also waits for that.
+static inline void start_access(const latency_model &lat, port_timing &t, int port,
+		uint32_t addr, unsigned size, bool htrans_seq, XipCache *icache = nullptr) {
+	bool seq = htrans_seq || addr == t.next_addr;
+	t.next_addr = addr + (1u << size);
+	int xip = icache && icache->covers(addr) ? icache->fetch(addr) : 0;
+	if (lat.regions.empty()) {
+		t.stall = xip;
+		return;
+	}
+	t.region = lat.lookup(port, addr);
+	if (t.region < 0)
+		t.stall = xip;
+	else
+		t.stall = xip + (seq ? lat.regions[t.region].seq : lat.regions[t.region].nonseq);
+}
+
+
+// A new data phase waits for the data phases of other ports in the same
+// region (including their access cycles). Of data phases starting together,
+// the higher-numbered port's goes first, and its wait states are already
+// final here. Each of ports[] has the port's req_vld and timing.
+template <typename Ports>
+static inline void apply_contention(Ports &ports, int n_ports, const bool *new_access) {
+	for (int p = n_ports - 1; p >= 0; --p) {
+		port_timing &t = ports[p].timing;
+		if (!new_access[p] || t.region < 0)
+			continue;
+		int wait = 0;
+		for (int q = 0; q < n_ports; ++q) {
+			if (q != p && ports[q].req_vld && ports[q].timing.region == t.region &&
+					(q > p || !new_access[q]))
+				wait = std::max(wait, ports[q].timing.stall + 1);
+		}
+		t.stall += wait;
+	}
+}
+
+// The arguments of --waitstates: ports (i, d, id or a list of port numbers),
+// start, end, nonseq and seq. Returns an error message, or nullptr.
+static inline const char *parse_wait_region(char **argv, wait_region &r) {
+	std::string ports(argv[0]);
+	r.port_mask = 0;
+	if (ports.find_first_not_of("id") == std::string::npos) {
+		r.port_mask |= ports.find('i') != std::string::npos ? 1u << PORT_I : 0;
+		r.port_mask |= ports.find('d') != std::string::npos ? 1u << PORT_D : 0;
+	} else if (ports.find_first_not_of("0123456789,") == std::string::npos) {
+		std::stringstream ss(ports);
+		std::string port;
+		while (std::getline(ss, port, ',')) {
+			if (port.empty() || std::stoul(port) >= (unsigned long)MAX_BUS_PORTS)
+				return "Bad port number in --waitstates\n";
+			r.port_mask |= 1u << std::stoul(port);
+		}
+	}
+	if (!r.port_mask)
+		return "Ports for --waitstates must be i, d, id or a list of port numbers\n";
+	r.start = std::stoul(argv[1], 0, 0);
+	r.end = std::stoul(argv[2], 0, 0);
+	r.nonseq = std::stol(argv[3], 0, 0);
+	r.seq = std::stol(argv[4], 0, 0);
+	if (r.nonseq < 0 || r.seq < 0)
+		return "Wait states can't be negative\n";
+	return nullptr;
+}
+
+// Background bus masters for --traffic, such as a DMA or a display
+// controller sharing memory with the core. Each moves bursts of word beats
+// through its address window, at an average bandwidth, and contends with the
+// core's ports for that window. The window goes to one master at a time: a
+// core data phase in the window waits for whatever the generator has already
+// claimed. A low-priority generator only takes the window when no core data
+// phase is using it, one beat at a time. A high-priority generator claims
+// each burst whole, as soon as the data phases already in the window are
+// done, and the core waits for all of it. Traffic is timing only, and leaves
+// memory as it was. Generators don't contend with each other.
+//
+// A beat takes one cycle, plus the wait states of the first --waitstates
+// region (for any port) that the burst starts in. Beats after the first are
+// sequential for a linear pattern, and non-sequential otherwise.
+enum traffic_pattern {
+	TRAFFIC_LINEAR,
+	TRAFFIC_STRIDE,
+	TRAFFIC_RANDOM
+};
+
+struct traffic_gen {
+	uint32_t start;
+	uint32_t end;
+	// Requested beats per cycle, from 0 to 1
+	double bandwidth;
+	int burst;
+	traffic_pattern pattern;
+	uint32_t stride;
+	bool high_priority;
+
+	// Beats owed by the bandwidth so far. A burst starts once there are
+	// enough, and at most two bursts' worth are kept while held off.
+	double credit;
+	// Of the current burst, for low priority
+	int beats_left;
+	// Cycles until what the generator has claimed is done, and until the
+	// core's data phases in the window are done
+	int gen_left;
+	int core_left;
+	int first_cost, next_cost;
+	uint32_t addr;
+	uint32_t rng;
+
+	uint64_t bursts, beats, busy, held, core_waits;
+
+	traffic_gen(): start(0), end(0), bandwidth(0), burst(1), pattern(TRAFFIC_LINEAR), stride(4),
+		high_priority(false), credit(0), beats_left(0), gen_left(0), core_left(0), first_cost(1),
+		next_cost(1), addr(0), rng(1), bursts(0), beats(0), busy(0), held(0), core_waits(0) {}
+
+	bool covers(uint32_t a) const {
+		return a >= start && a < end;
+	}
+
+	// Called on a core port's address phase, with the wait states its data
+	// phase has so far. Returns the wait states to add.
+	int claim(uint32_t a, int stall) {
+		if (!covers(a))
+			return 0;
+		int wait = gen_left;
+		core_left = std::max(core_left, wait + stall + 1);
+		core_waits += wait;
+		return wait;
+	}
+
+	void step(const latency_model &lat) {
+		credit = std::min(credit + bandwidth, 2.0 * burst);
+		if (gen_left == 0 && (beats_left > 0 || credit >= burst)) {
+			if (high_priority) {
+				start_burst(lat);
+				int cycles = first_cost + (burst - 1) * next_cost;
+				for (int i = 0; i < burst; ++i)
+					next_addr();
+				beats += burst;
+				busy += cycles;
+				held += core_left;
+				gen_left = core_left + cycles;
+			} else if (core_left > 0) {
+				++held;
+			} else {
+				if (beats_left == 0) {
+					start_burst(lat);
+					beats_left = burst;
+				}
+				gen_left = beats_left == burst ? first_cost : next_cost;
+				next_addr();
+				--beats_left;
+				++beats;
+				busy += gen_left;
+			}
+		}
+		if (gen_left > 0)
+			--gen_left;
+		if (core_left > 0)
+			--core_left;
+	}
+
+	void print(FILE *f, int index, uint64_t cycles) const {
+		auto percent = [](uint64_t n, uint64_t d) {return d ? 100.0 * n / d : 0.0;};
+		fprintf(f, "Traffic %d: %08x to %08x, %s priority: %" PRIu64 " beats in %" PRIu64 " bursts, "
+			"%.1f%% of cycles for %.1f%% requested\n", index, start, end, high_priority ? "high" : "low",
+			beats, bursts, percent(beats, cycles), 100.0 * bandwidth);
+		fprintf(f, "  Busy %" PRIu64 " cycles (%.1f%%), held off %" PRIu64 " cycles, core ports waited %"
+			PRIu64 " cycles\n", busy, percent(busy, cycles), held, core_waits);
+	}
+
+private:
+	void start_burst(const latency_model &lat) {
+		credit -= burst;
+		++bursts;
+		first_cost = next_cost = 1;
+		for (const wait_region &r : lat.regions) {
+			if (addr >= r.start && addr < r.end) {
+				first_cost += r.nonseq;
+				next_cost += pattern == TRAFFIC_LINEAR ? r.seq : r.nonseq;
+				break;
+			}
+		}
+	}
+
+	void next_addr() {
+		uint32_t size = end - start;
+		if (pattern == TRAFFIC_RANDOM) {
+			// xorshift32
+			rng ^= rng << 13;
+			rng ^= rng >> 17;
+			rng ^= rng << 5;
+			addr = start + (rng % (size / 4)) * 4;
+		} else {
+			addr = start + (addr - start + stride) % size;
+		}
+	}
+};
+
+struct traffic_model {
+	std::vector<traffic_gen> gens;
+
+	bool empty() const {
+		return gens.empty();
+	}
+
+	int claim(uint32_t addr, int stall) {
+		int wait = 0;
+		for (traffic_gen &g : gens)
+			wait += g.claim(addr, stall + wait);
+		return wait;
+	}
+
+	void step(const latency_model &lat) {
+		for (traffic_gen &g : gens)
+			g.step(lat);
+	}
+
+	void skip(int64_t n, const latency_model &lat) {
+		for (int64_t i = 0; i < n; ++i)
+			step(lat);
+	}
+
+	void print(FILE *f, uint64_t cycles) const {
+		for (size_t i = 0; i < gens.size(); ++i)
+			gens[i].print(f, i, cycles);
+	}
+};
+
+// The arguments of --traffic: start, end, bandwidth (percent of cycles with
+// a beat), burst (beats), pattern (linear, random or a stride in bytes) and
+// priority (high or low). Returns an error message, or nullptr.
+static inline const char *parse_traffic(char **argv, traffic_gen &g) {
+	g.start = std::stoul(argv[0], 0, 0);
+	g.end = std::stoul(argv[1], 0, 0);
+	double percent = std::stod(argv[2]);
+	g.burst = std::stol(argv[3], 0, 0);
+	std::string pattern(argv[4]), priority(argv[5]);
+	if ((g.start | g.end) & 0x3u || g.end <= g.start)
+		return "--traffic window must be word-aligned and non-empty\n";
+	if (percent < 0 || percent > 100)
+		return "--traffic bandwidth must be from 0 to 100 percent\n";
+	g.bandwidth = percent / 100;
+	if (g.burst < 1 || g.burst > 1024)
+		return "--traffic burst must be from 1 to 1024 beats\n";
+	if (pattern == "linear") {
+		g.pattern = TRAFFIC_LINEAR;
+		g.stride = 4;
+	} else if (pattern == "random") {
+		g.pattern = TRAFFIC_RANDOM;
+	} else if (pattern.find_first_not_of("0123456789xabcdefABCDEF") == std::string::npos) {
+		g.stride = std::stoul(pattern, 0, 0);
+		g.pattern = g.stride == 4 ? TRAFFIC_LINEAR : TRAFFIC_STRIDE;
+		if (g.stride == 0 || g.stride & 0x3u)
+			return "--traffic stride must be a non-zero multiple of 4\n";
+	} else {
+		return "--traffic pattern must be linear, random or a stride in bytes\n";
+	}
+	if (priority != "high" && priority != "low")
+		return "--traffic priority must be high or low\n";
+	g.high_priority = priority == "high";
+	g.addr = g.start;
+	// Any non-zero seed will do, but differ between windows
+	g.rng = (g.start >> 2) * 2654435761u | 1u;
+	return nullptr;
+}
+
+// --ahb-trace format: the magic, then one fixed-size record per completed
+// data phase, in the order they completed. The fields are little-endian:
+//
+// - cycle (8 bytes): when the address phase was accepted
+// - addr (4 bytes)
+// - data (4 bytes): hwdata for a write, hrdata for a read
+// - waits (2 bytes): wait states of the data phase, saturating
+// - port (1 byte)
+// - flags (1 byte): the AHB_* bits below, and hsize in bits 5:4
+//
+// The data phase completed on cycle + 1 + waits.
+struct ahb_record {
+	enum {
+		AHB_WRITE  = 0x01,
+		AHB_EXCL   = 0x02,
+		AHB_FETCH  = 0x04,
+		AHB_SEQ    = 0x08, // htrans=SEQ
+		AHB_ERR    = 0x40,
+		AHB_EXOKAY = 0x80
+	};
+	static const size_t SIZE = 20;
+
+	uint64_t cycle;
+	uint32_t addr;
+	uint32_t data;
+	uint16_t waits;
+	uint8_t port;
+	uint8_t flags;
+
+	unsigned size() const {
+		return flags >> 4 & 0x3;
+	}
+
+	void encode(uint8_t *p) const {
+		for (int i = 0; i < 8; ++i)
+			p[i] = cycle >> 8 * i;
+		for (int i = 0; i < 4; ++i) {
+			p[8 + i] = addr >> 8 * i;
+			p[12 + i] = data >> 8 * i;
+		}
+		p[16] = waits;
+		p[17] = waits >> 8;
+		p[18] = port;
+		p[19] = flags;
+	}
+
+	void decode(const uint8_t *p) {
+		cycle = 0;
+		addr = 0;
+		data = 0;
+		for (int i = 0; i < 8; ++i)
+			cycle |= (uint64_t)p[i] << 8 * i;
+		for (int i = 0; i < 4; ++i) {
+			addr |= (uint32_t)p[8 + i] << 8 * i;
+			data |= (uint32_t)p[12 + i] << 8 * i;
+		}
+		waits = p[16] | p[17] << 8;
+		port = p[18];
+		flags = p[19];
+	}
+};
+
+static const char AHB_TRACE_MAGIC[8] = {'h', '3', 'a', 'h', 'b', 't', 'r', '1'};
+
+struct ahb_trace_writer {
+	static const size_t BUF_RECORDS = 1u << 16;
+	static const size_t RING_SIZE = 1u << 24;
+
+	tb_output_stream out;
+	std::vector<uint8_t> buf;
+
+	~ahb_trace_writer() {
+		close();
+	}
+
+	bool open(const std::string &path) {
+		if (!out.open(path, RING_SIZE))
+			return false;
+		out.write(AHB_TRACE_MAGIC, sizeof(AHB_TRACE_MAGIC));
+		buf.reserve(BUF_RECORDS * ahb_record::SIZE);
+		return true;
+	}
+
+	void record(const ahb_record &r) {
+		size_t n = buf.size();
+		buf.resize(n + ahb_record::SIZE);
+		r.encode(&buf[n]);
+		if (buf.size() >= BUF_RECORDS * ahb_record::SIZE)
+			flush();
+	}
+
+	void close() {
+		if (!out.is_open())
+			return;
+		flush();
+		out.close();
+	}
+
+private:
+	void flush() {
+		out.write(buf.data(), buf.size());
+		buf.clear();
+	}
+};
+
+// Reads a whole trace. Returns false if it can't be read or isn't a trace.
+static inline bool ahb_trace_load(const std::string &path, std::vector<ahb_record> &records) {
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f)
+		return false;
+	char magic[sizeof(AHB_TRACE_MAGIC)];
+	bool ok = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && !memcmp(magic, AHB_TRACE_MAGIC, sizeof(magic));
+	std::vector<uint8_t> buf(ahb_trace_writer::BUF_RECORDS * ahb_record::SIZE);
+	size_t n;
+	while (ok && (n = fread(buf.data(), ahb_record::SIZE, ahb_trace_writer::BUF_RECORDS, f)) > 0) {
+		for (size_t i = 0; i < n; ++i) {
+			records.emplace_back();
+			records.back().decode(&buf[i * ahb_record::SIZE]);
+		}
+	}
+	fclose(f);
+	return ok;
+}
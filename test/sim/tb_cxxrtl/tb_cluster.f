@@ -0,0 +1,2 @@
+file tb_cluster.v
+list tb_common.f
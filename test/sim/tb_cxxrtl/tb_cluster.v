@@ -0,0 +1,307 @@
+// An integration of JTAG-DTM + DM + a cluster of N_HARTS single-ported CPUs,
+// for multicore software tests. Each bus signal is one vector with a slice
+// per hart, e.g. hart n's address is haddr[n * 32 +: 32]. The Makefile sets
+// N_HARTS (and HART_BASE, the first mhartid) from the topology name, e.g.
+// tb_cluster4, or tb_cluster2_2 for harts 2 and 3 of a system simulated in
+// several processes.
+
+`default_nettype none
+
+module tb #(
+	parameter N_HARTS   = 4,
+	parameter HART_BASE = 0,
+	parameter W_ADDR    = 32, // do not modify
+	parameter W_DATA    = 32  // do not modify
+) (
+	// Global signals
+	input wire                        clk,
+	input wire                        rst_n,
+
+	// JTAG port
+	input  wire                       tck,
+	input  wire                       trst_n,
+	input  wire                       tms,
+	input  wire                       tdi,
+	output wire                       tdo,
+
+	// Direct DMI access from the testbench, bypassing the DTM
+	input  wire                       dmi_direct_en,
+	input  wire                       dmi_direct_psel,
+	input  wire                       dmi_direct_penable,
+	input  wire                       dmi_direct_pwrite,
+	input  wire [8:0]                 dmi_direct_paddr,
+	input  wire [31:0]                dmi_direct_pwdata,
+	output wire [31:0]                dmi_direct_prdata,
+	output wire                       dmi_direct_pready,
+	output wire                       dmi_direct_pslverr,
+
+	// One bus port per hart
+	output wire [N_HARTS*W_ADDR-1:0]  haddr,
+	output wire [N_HARTS-1:0]         hwrite,
+	output wire [N_HARTS*2-1:0]       htrans,
+	output wire [N_HARTS-1:0]         hexcl,
+	output wire [N_HARTS*3-1:0]       hsize,
+	output wire [N_HARTS*4-1:0]       hprot,
+	input  wire [N_HARTS-1:0]         hready,
+	input  wire [N_HARTS-1:0]         hresp,
+	input  wire [N_HARTS-1:0]         hexokay,
+	output wire [N_HARTS*W_DATA-1:0]  hwdata,
+	input  wire [N_HARTS*W_DATA-1:0]  hrdata,
+
+	// Level-sensitive interrupt sources
+	input wire [NUM_IRQS-1:0]         irq,       // -> mip.meip
+	input wire [N_HARTS-1:0]          soft_irq,  // -> mip.msip
+	input wire [N_HARTS-1:0]          timer_irq  // -> mip.mtip
+);
+
+// JTAG-DTM IDCODE, selected after TAP reset, would normally be a
+// JEP106-compliant ID
+localparam IDCODE = 32'hdeadbeef;
+
+wire              dmi_psel;
+wire              dmi_penable;
+wire              dmi_pwrite;
+wire [8:0]        dmi_paddr;
+wire [31:0]       dmi_pwdata;
+reg  [31:0]       dmi_prdata;
+wire              dmi_pready;
+wire              dmi_pslverr;
+
+wire              dtm_psel;
+wire              dtm_penable;
+wire              dtm_pwrite;
+wire [8:0]        dtm_paddr;
+wire [31:0]       dtm_pwdata;
+
+// The DM is driven either by the DTM or by the testbench. While the
+// testbench has it, DTM accesses complete immediately with an error.
+assign dmi_psel           = dmi_direct_en ? dmi_direct_psel    : dtm_psel;
+assign dmi_penable        = dmi_direct_en ? dmi_direct_penable : dtm_penable;
+assign dmi_pwrite         = dmi_direct_en ? dmi_direct_pwrite  : dtm_pwrite;
+assign dmi_paddr          = dmi_direct_en ? dmi_direct_paddr   : dtm_paddr;
+assign dmi_pwdata         = dmi_direct_en ? dmi_direct_pwdata  : dtm_pwdata;
+assign dmi_direct_prdata  = dmi_prdata;
+assign dmi_direct_pready  = dmi_pready;
+assign dmi_direct_pslverr = dmi_pslverr;
+
+wire dmihardreset_req;
+wire assert_dmi_reset = !rst_n || dmihardreset_req;
+wire rst_n_dmi;
+
+hazard3_reset_sync dmi_reset_sync_u (
+	.clk       (clk),
+	.rst_n_in  (!assert_dmi_reset),
+	.rst_n_out (rst_n_dmi)
+);
+
+hazard3_jtag_dtm #(
+	.IDCODE          (IDCODE),
+	.DTMCS_IDLE_HINT (8)
+) inst_hazard3_jtag_dtm (
+	.tck              (tck),
+	.trst_n           (trst_n),
+	.tms              (tms),
+	.tdi              (tdi),
+	.tdo              (tdo),
+
+	.dmihardreset_req (dmihardreset_req),
+
+	.clk_dmi          (clk),
+	.rst_n_dmi        (rst_n_dmi),
+
+	.dmi_psel         (dtm_psel),
+	.dmi_penable      (dtm_penable),
+	.dmi_pwrite       (dtm_pwrite),
+	.dmi_paddr        (dtm_paddr),
+	.dmi_pwdata       (dtm_pwdata),
+	.dmi_prdata       (dmi_prdata),
+	.dmi_pready       (dmi_pready || dmi_direct_en),
+	.dmi_pslverr      (dmi_pslverr || dmi_direct_en)
+);
+
+localparam XLEN = 32;
+
+wire                      sys_reset_req;
+wire                      sys_reset_done;
+wire [N_HARTS-1:0]        hart_reset_req;
+wire [N_HARTS-1:0]        hart_reset_done;
+
+wire [N_HARTS-1:0]        hart_req_halt;
+wire [N_HARTS-1:0]        hart_req_halt_on_reset;
+wire [N_HARTS-1:0]        hart_req_resume;
+wire [N_HARTS-1:0]        hart_halted;
+wire [N_HARTS-1:0]        hart_running;
+
+wire [N_HARTS*XLEN-1:0]   hart_data0_rdata;
+wire [N_HARTS*XLEN-1:0]   hart_data0_wdata;
+wire [N_HARTS-1:0]        hart_data0_wen;
+
+wire [N_HARTS*XLEN-1:0]   hart_instr_data;
+wire [N_HARTS-1:0]        hart_instr_data_vld;
+wire [N_HARTS-1:0]        hart_instr_data_rdy;
+wire [N_HARTS-1:0]        hart_instr_caught_exception;
+wire [N_HARTS-1:0]        hart_instr_caught_ebreak;
+
+wire [31:0]               sbus_addr;
+wire                      sbus_write;
+wire [1:0]                sbus_size;
+wire                      sbus_vld;
+wire                      sbus_rdy;
+wire                      sbus_err;
+wire [31:0]               sbus_wdata;
+wire [31:0]               sbus_rdata;
+
+hazard3_dm #(
+	.N_HARTS      (N_HARTS),
+	.HAVE_SBA     (1),
+	.NEXT_DM_ADDR (0)
+) dm (
+	.clk                         (clk),
+	.rst_n                       (rst_n),
+
+	.dmi_psel                    (dmi_psel),
+	.dmi_penable                 (dmi_penable),
+	.dmi_pwrite                  (dmi_pwrite),
+	.dmi_paddr                   (dmi_paddr),
+	.dmi_pwdata                  (dmi_pwdata),
+	.dmi_prdata                  (dmi_prdata),
+	.dmi_pready                  (dmi_pready),
+	.dmi_pslverr                 (dmi_pslverr),
+
+	.sys_reset_req               (sys_reset_req),
+	.sys_reset_done              (sys_reset_done),
+	.hart_reset_req              (hart_reset_req),
+	.hart_reset_done             (hart_reset_done),
+
+	.hart_req_halt               (hart_req_halt),
+	.hart_req_halt_on_reset      (hart_req_halt_on_reset),
+	.hart_req_resume             (hart_req_resume),
+	.hart_halted                 (hart_halted),
+	.hart_running                (hart_running),
+
+	.hart_data0_rdata            (hart_data0_rdata),
+	.hart_data0_wdata            (hart_data0_wdata),
+	.hart_data0_wen              (hart_data0_wen),
+
+	.hart_instr_data             (hart_instr_data),
+	.hart_instr_data_vld         (hart_instr_data_vld),
+	.hart_instr_data_rdy         (hart_instr_data_rdy),
+	.hart_instr_caught_exception (hart_instr_caught_exception),
+	.hart_instr_caught_ebreak    (hart_instr_caught_ebreak),
+
+	.sbus_addr                   (sbus_addr),
+	.sbus_write                  (sbus_write),
+	.sbus_size                   (sbus_size),
+	.sbus_vld                    (sbus_vld),
+	.sbus_rdy                    (sbus_rdy),
+	.sbus_err                    (sbus_err),
+	.sbus_wdata                  (sbus_wdata),
+	.sbus_rdata                  (sbus_rdata)
+
+);
+
+// Generate resynchronised reset for each CPU based on upstream reset and
+// on reset requests from DM.
+
+wire [N_HARTS-1:0]        rst_n_cpu;
+
+// See tb_multicore.v about the reset handshake
+assign sys_reset_done = &rst_n_cpu;
+assign hart_reset_done = rst_n_cpu;
+
+`ifndef CONFIG_HEADER
+`define CONFIG_HEADER "config_default.vh"
+`endif
+`include `CONFIG_HEADER
+
+wire [N_HARTS-1:0]        unblock_out;
+
+wire [N_HARTS-1:0]        sbus_rdy_hart;
+wire [N_HARTS-1:0]        sbus_err_hart;
+wire [N_HARTS*32-1:0]     sbus_rdata_hart;
+
+assign sbus_rdy   = sbus_rdy_hart[N_HARTS - 1];
+assign sbus_err   = sbus_err_hart[N_HARTS - 1];
+assign sbus_rdata = sbus_rdata_hart[(N_HARTS - 1) * 32 +: 32];
+
+genvar i;
+generate
+for (i = 0; i < N_HARTS; i = i + 1) begin: hart
+
+	wire assert_cpu_reset = !rst_n || sys_reset_req || hart_reset_req[i];
+
+	hazard3_reset_sync cpu_reset_sync (
+		.clk       (clk),
+		.rst_n_in  (!assert_cpu_reset),
+		.rst_n_out (rst_n_cpu[i])
+	);
+
+	wire pwrup_req;
+
+	// SBA is routed through the last hart, so tie off on the others
+	localparam SBA = i == N_HARTS - 1;
+
+	hazard3_cpu_1port #(
+		.MHARTID_VAL (HART_BASE + i),
+`define HAZARD3_CONFIG_INST_NO_MHARTID
+`include "hazard3_config_inst.vh"
+	) cpu (
+		.clk                        (clk),
+		.clk_always_on              (clk),
+		.rst_n                      (rst_n_cpu[i]),
+
+		.pwrup_req                  (pwrup_req),
+		.pwrup_ack                  (pwrup_req),
+		.clk_en                     (),
+		.unblock_out                (unblock_out[i]),
+		.unblock_in                 (|(unblock_out & ~(1 << i))),
+
+		.haddr                      (haddr                      [i * W_ADDR +: W_ADDR]),
+		.hexcl                      (hexcl                      [i]),
+		.hwrite                     (hwrite                     [i]),
+		.htrans                     (htrans                     [i * 2 +: 2]),
+		.hsize                      (hsize                      [i * 3 +: 3]),
+		.hburst                     (),
+		.hprot                      (hprot                      [i * 4 +: 4]),
+		.hmastlock                  (),
+		.hmaster                    (),
+		.hready                     (hready                     [i]),
+		.hresp                      (hresp                      [i]),
+		.hexokay                    (hexokay                    [i]),
+		.hwdata                     (hwdata                     [i * W_DATA +: W_DATA]),
+		.hrdata                     (hrdata                     [i * W_DATA +: W_DATA]),
+
+		.dbg_req_halt               (hart_req_halt              [i]),
+		.dbg_req_halt_on_reset      (hart_req_halt_on_reset     [i]),
+		.dbg_req_resume             (hart_req_resume            [i]),
+		.dbg_halted                 (hart_halted                [i]),
+		.dbg_running                (hart_running               [i]),
+
+		.dbg_data0_rdata            (hart_data0_rdata           [i * XLEN +: XLEN]),
+		.dbg_data0_wdata            (hart_data0_wdata           [i * XLEN +: XLEN]),
+		.dbg_data0_wen              (hart_data0_wen             [i]),
+
+		.dbg_instr_data             (hart_instr_data            [i * XLEN +: XLEN]),
+		.dbg_instr_data_vld         (hart_instr_data_vld        [i]),
+		.dbg_instr_data_rdy         (hart_instr_data_rdy        [i]),
+		.dbg_instr_caught_exception (hart_instr_caught_exception[i]),
+		.dbg_instr_caught_ebreak    (hart_instr_caught_ebreak   [i]),
+
+		.dbg_sbus_addr              (SBA ? sbus_addr  : 32'h0),
+		.dbg_sbus_write             (SBA ? sbus_write : 1'b0),
+		.dbg_sbus_size              (SBA ? sbus_size  : 2'h0),
+		.dbg_sbus_vld               (SBA ? sbus_vld   : 1'b0),
+		.dbg_sbus_rdy               (sbus_rdy_hart[i]),
+		.dbg_sbus_err               (sbus_err_hart[i]),
+		.dbg_sbus_wdata             (SBA ? sbus_wdata : 32'h0),
+		.dbg_sbus_rdata             (sbus_rdata_hart[i * 32 +: 32]),
+
+		.irq                        (irq),
+		.soft_irq                   (soft_irq[i]),
+		.timer_irq                  (timer_irq[i])
+	);
+
+end
+endgenerate
+
+endmodule
@@ -0,0 +1,217 @@
+#pragma once
+
+// RTL coverage for --coverage, kept as bitsets so that the results of many
+// runs merge by OR (tb --coverage-merge). C++14, and no dependencies on the
+// design: tb.cpp binds each point set to the design's debug items.
+//
+// - Toggle coverage: for each bit of a net (or memory), whether it has risen
+//   and whether it has fallen. The rises are in the first n_words words of
+//   the bitset and the falls in the next n_words, each laid out as the
+//   net's CXXRTL chunks, so a cycle's sample is two ANDs and ORs per chunk.
+// - FSM coverage: for a state register of up to 16 bits, each value it has
+//   held, and for up to 8 bits, each change from one value to another.
+//
+// A file is a magic number, the number of sets, then each set's kind, width
+// in bits, words per value, name and bitset. Files only merge if their sets
+// match, i.e. they come from the same design with the same selections.
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+struct coverage_set {
+	enum Kind : uint32_t {
+		TOGGLE = 0,
+		FSM = 1
+	};
+	static const uint32_t FSM_MAX_WIDTH = 16;
+	static const uint32_t FSM_MAX_TRANSITION_WIDTH = 8;
+
+	Kind kind;
+	std::string name;
+	// For TOGGLE, bits per row times rows
+	uint32_t width;
+	// For TOGGLE, 32-bit words (chunks) to hold one value of the net
+	uint32_t n_words;
+	std::vector<uint32_t> bits;
+
+	coverage_set(Kind kind_, const std::string &name_, uint32_t width_, uint32_t n_words_):
+			kind(kind_), name(name_), width(width_), n_words(n_words_) {
+		bits.resize(kind == TOGGLE ? 2 * n_words : words(fsm_bits()), 0);
+	}
+
+	bool has_transitions() const {
+		return kind == FSM && width <= FSM_MAX_TRANSITION_WIDTH;
+	}
+
+	// FSM bitsets are states, then transitions indexed by from << width | to
+	uint64_t fsm_bits() const {
+		uint64_t states = 1ull << width;
+		return states + (has_transitions() ? states * states : 0);
+	}
+
+	void mark(uint64_t point) {
+		bits[point >> 5] |= 1u << (point & 31);
+	}
+
+	bool hit(uint64_t point) const {
+		return bits[point >> 5] >> (point & 31) & 1u;
+	}
+
+	// Points which can be hit: two per bit for TOGGLE. FSM values are
+	// counted as hit only, as most registers never hold most values.
+	uint64_t n_points() const {
+		return kind == TOGGLE ? 2ull * width : 0;
+	}
+
+	uint64_t n_hit() const {
+		uint64_t n = 0;
+		for (uint32_t w : bits)
+			n += __builtin_popcount(w);
+		return n;
+	}
+
+	// For FSM: values held and transitions taken
+	void fsm_counts(uint64_t &states, uint64_t &transitions) const {
+		states = transitions = 0;
+		for (uint64_t i = 0; i < fsm_bits(); ++i) {
+			if (hit(i))
+				++(i < (1ull << width) ? states : transitions);
+		}
+	}
+
+	static size_t words(uint64_t n_bits) {
+		return (n_bits + 31) / 32;
+	}
+};
+
+struct coverage_map {
+	std::vector<coverage_set> sets;
+
+	uint64_t n_hit() const {
+		uint64_t n = 0;
+		for (const coverage_set &s : sets)
+			n += s.n_hit();
+		return n;
+	}
+
+	bool matches(const coverage_map &other) const {
+		if (sets.size() != other.sets.size())
+			return false;
+		for (size_t i = 0; i < sets.size(); ++i) {
+			const coverage_set &a = sets[i], &b = other.sets[i];
+			if (a.kind != b.kind || a.name != b.name || a.width != b.width || a.bits.size() != b.bits.size())
+				return false;
+		}
+		return true;
+	}
+
+	// OR in another map with the same sets
+	bool merge(const coverage_map &other) {
+		if (!matches(other))
+			return false;
+		for (size_t i = 0; i < sets.size(); ++i) {
+			uint32_t *dst = sets[i].bits.data();
+			const uint32_t *src = other.sets[i].bits.data();
+			for (size_t k = 0; k < sets[i].bits.size(); ++k)
+				dst[k] |= src[k];
+		}
+		return true;
+	}
+
+	bool save(const std::string &path) const {
+		FILE *f = fopen(path.c_str(), "wb");
+		if (!f)
+			return false;
+		bool ok = fwrite(magic(), 1, MAGIC_SIZE, f) == MAGIC_SIZE;
+		ok = ok && put32(f, sets.size());
+		for (const coverage_set &s : sets) {
+			ok = ok && put32(f, s.kind) && put32(f, s.width) && put32(f, s.n_words) && put32(f, s.name.size()) &&
+				fwrite(s.name.data(), 1, s.name.size(), f) == s.name.size() &&
+				fwrite(s.bits.data(), sizeof(uint32_t), s.bits.size(), f) == s.bits.size();
+		}
+		return fclose(f) == 0 && ok;
+	}
+
+	bool load(const std::string &path) {
+		FILE *f = fopen(path.c_str(), "rb");
+		if (!f)
+			return false;
+		char buf[MAGIC_SIZE];
+		uint32_t n_sets = 0;
+		bool ok = fread(buf, 1, MAGIC_SIZE, f) == MAGIC_SIZE && std::string(buf, MAGIC_SIZE) == magic() &&
+			get32(f, n_sets);
+		sets.clear();
+		for (uint32_t i = 0; ok && i < n_sets; ++i) {
+			uint32_t kind, width, n_words, name_len;
+			ok = get32(f, kind) && get32(f, width) && get32(f, n_words) && get32(f, name_len) &&
+				kind <= coverage_set::FSM && name_len < 4096 &&
+				(kind == coverage_set::TOGGLE || width <= coverage_set::FSM_MAX_WIDTH);
+			if (!ok)
+				break;
+			std::string name(name_len, '\0');
+			ok = fread(&name[0], 1, name_len, f) == name_len;
+			sets.emplace_back((coverage_set::Kind)kind, name, width, n_words);
+			std::vector<uint32_t> &bits = sets.back().bits;
+			ok = ok && fread(bits.data(), sizeof(uint32_t), bits.size(), f) == bits.size();
+		}
+		fclose(f);
+		return ok;
+	}
+
+	// Totals, and with `detail`, a line for each set which isn't fully
+	// covered (toggles) or has been hit at all (FSMs)
+	void print(FILE *f, bool detail) const {
+		uint64_t toggle_points = 0, toggle_hit = 0, fsm_states = 0, fsm_transitions = 0;
+		size_t n_fsms = 0;
+		for (const coverage_set &s : sets) {
+			if (s.kind == coverage_set::TOGGLE) {
+				toggle_points += s.n_points();
+				toggle_hit += s.n_hit();
+			} else {
+				uint64_t states, transitions;
+				s.fsm_counts(states, transitions);
+				fsm_states += states;
+				fsm_transitions += transitions;
+				++n_fsms;
+			}
+		}
+		fprintf(f, "Coverage: toggles %" PRIu64 "/%" PRIu64 " (%.2f%%), %zu FSMs: %" PRIu64 " states, %" PRIu64
+			" transitions\n", toggle_hit, toggle_points, toggle_points ? 100.0 * toggle_hit / toggle_points : 0.0,
+			n_fsms, fsm_states, fsm_transitions);
+		if (!detail)
+			return;
+		for (const coverage_set &s : sets) {
+			if (s.kind == coverage_set::TOGGLE && s.n_hit() < s.n_points()) {
+				fprintf(f, "  toggle %s: %" PRIu64 "/%" PRIu64 "\n", s.name.c_str(), s.n_hit(), s.n_points());
+			} else if (s.kind == coverage_set::FSM) {
+				uint64_t states, transitions;
+				s.fsm_counts(states, transitions);
+				fprintf(f, "  fsm %s: %" PRIu64 " states, %" PRIu64 " transitions, values", s.name.c_str(),
+					states, transitions);
+				for (uint64_t v = 0; v < (1ull << s.width); ++v) {
+					if (s.hit(v))
+						fprintf(f, " %" PRIu64, v);
+				}
+				fprintf(f, "\n");
+			}
+		}
+	}
+
+private:
+	static const size_t MAGIC_SIZE = 8;
+
+	static const char *magic() {
+		return "h3cover1";
+	}
+
+	static bool put32(FILE *f, uint32_t x) {
+		return fwrite(&x, sizeof(x), 1, f) == 1;
+	}
+
+	static bool get32(FILE *f, uint32_t &x) {
+		return fread(&x, sizeof(x), 1, f) == 1;
+	}
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+// Testbench devices which act at scheduled times, rather than every cycle.
+// The main loop advances time through tb_event_queue, which wakes only the
+// devices whose time has come, so a device costs nothing on the cycles it
+// spends waiting. Bus accesses reach a device through its IoDevice handlers
+// (rv_iomap.h), which can reschedule it. C++14, and no dependencies on the
+// design.
+
+#include <cstdint>
+#include <vector>
+
+static const uint64_t TB_NEVER = UINT64_MAX;
+
+struct tb_timed_device {
+	// Time of the next wake(), or TB_NEVER
+	uint64_t wake_time;
+	tb_timed_device(): wake_time(TB_NEVER) {}
+	virtual ~tb_timed_device() {}
+	// Called once time reaches wake_time, after descheduling the device: it
+	// schedules itself again here if it has anything more to do
+	virtual void wake(uint64_t now) = 0;
+};
+
+// There are only ever a few devices, so they're kept in a list, and the
+// earliest wake time is found again whenever a device is scheduled. The main
+// loop only compares against next_time.
+struct tb_event_queue {
+	// Testbench cycles since the queue was created (not mtime, which
+	// software can write)
+	uint64_t now;
+	uint64_t next_time;
+	std::vector<tb_timed_device*> devices;
+
+	tb_event_queue(): now(0), next_time(TB_NEVER) {}
+
+	void add(tb_timed_device *dev) {
+		devices.push_back(dev);
+		update_next();
+	}
+
+	// Replaces any earlier schedule for dev
+	void schedule(tb_timed_device *dev, uint64_t time) {
+		dev->wake_time = time;
+		update_next();
+	}
+
+	// Cycles until the next wake, e.g. for skipping ahead through sleep
+	uint64_t idle_cycles() const {
+		return next_time > now ? next_time - now : 0;
+	}
+
+	void advance(uint64_t n = 1) {
+		now += n;
+		if (now >= next_time)
+			run();
+	}
+
+private:
+	void run() {
+		while (next_time <= now) {
+			for (tb_timed_device *dev : devices) {
+				if (dev->wake_time <= now) {
+					dev->wake_time = TB_NEVER;
+					dev->wake(now);
+				}
+			}
+			update_next();
+		}
+	}
+
+	void update_next() {
+		next_time = TB_NEVER;
+		for (const tb_timed_device *dev : devices)
+			next_time = dev->wake_time < next_time ? dev->wake_time : next_time;
+	}
+};
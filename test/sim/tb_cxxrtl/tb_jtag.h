@@ -0,0 +1,154 @@
+#pragma once
+
+// OpenOCD remote_bitbang server, shared by tb (tb.cpp) and the example SoC
+// testbench (../soc_cxxrtl). tb runs its own command loop, as it interleaves
+// the commands with --jtagdump, --jtagreplay and its input log, so it only
+// takes the socket setup from here. jtag_bitbang_server is the plain
+// lockstep loop, for testbenches with none of those. C++14, and no
+// dependencies on the design.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static const int TCP_BUF_SIZE = 64 * 1024;
+
+static inline int open_server(uint16_t port, struct sockaddr_in &sock_addr) {
+	int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (server_fd == 0) {
+		fprintf(stderr, "socket creation failed\n");
+		exit(-1);
+	}
+
+	int sock_opt = 1;
+	int setsockopt_rc = setsockopt(
+		server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT,
+		&sock_opt, sizeof(sock_opt)
+	);
+
+	if (setsockopt_rc) {
+		fprintf(stderr, "setsockopt failed\n");
+		exit(-1);
+	}
+
+	sock_addr.sin_family = AF_INET;
+	sock_addr.sin_addr.s_addr = INADDR_ANY;
+	sock_addr.sin_port = htons(port);
+	if (bind(server_fd, (struct sockaddr *)&sock_addr, sizeof(sock_addr)) < 0) {
+		fprintf(stderr, "bind failed\n");
+		exit(-1);
+	}
+	return server_fd;
+}
+
+// Progress messages go to out
+static inline int wait_for_connection(int server_fd, uint16_t port, struct sockaddr *sock_addr,
+		socklen_t *sock_addr_len, FILE *out = stdout) {
+	int sock_fd;
+	fprintf(out, "Waiting for connection on port %u\n", port);
+	if (listen(server_fd, 3) < 0) {
+		fprintf(stderr, "listen failed\n");
+		exit(-1);
+	}
+	sock_fd = accept(server_fd, sock_addr, sock_addr_len);
+	if (sock_fd < 0) {
+		fprintf(stderr, "accept failed\n");
+		exit(-1);
+	}
+	// Responses are already coalesced into as few sends as possible, so
+	// don't let Nagle hold them back waiting for an ACK
+	int nodelay = 1;
+	setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	fprintf(out, "Connected\n");
+	return sock_fd;
+}
+
+// Runs the simulation in lockstep with the bitbang commands, one pin write
+// per cycle, as tb does by default. `Pins` has set_trst_n(bool),
+// set(tck, tms, tdi) and bool tdo(). When OpenOCD disconnects, waits for it
+// to connect again.
+struct jtag_bitbang_server {
+	uint16_t port;
+	int server_fd, sock_fd;
+	struct sockaddr_in sock_addr;
+	std::vector<char> txbuf, rxbuf;
+	int rx_ptr, rx_remaining, tx_ptr;
+
+	jtag_bitbang_server(): port(0), server_fd(-1), sock_fd(-1), rx_ptr(0), rx_remaining(0), tx_ptr(0) {}
+
+	~jtag_bitbang_server() {
+		if (sock_fd >= 0)
+			close(sock_fd);
+		if (server_fd >= 0)
+			close(server_fd);
+	}
+
+	// Blocks until OpenOCD connects
+	void start(uint16_t port_) {
+		port = port_;
+		txbuf.resize(TCP_BUF_SIZE);
+		rxbuf.resize(TCP_BUF_SIZE);
+		server_fd = open_server(port, sock_addr);
+		accept_connection();
+	}
+
+	// Take commands up to the next one which needs a clock cycle to pass.
+	// Returns false if OpenOCD sent the quit command.
+	template <typename Pins>
+	bool cycle(Pins &pins) {
+		while (true) {
+			if (rx_remaining > 0) {
+				char c = rxbuf[rx_ptr++];
+				--rx_remaining;
+				if (c == 'r' || c == 's') {
+					pins.set_trst_n(true);
+					return true;
+				} else if (c == 't' || c == 'u') {
+					pins.set_trst_n(false);
+				} else if (c >= '0' && c <= '7') {
+					int mask = c - '0';
+					pins.set(mask & 0x4, mask & 0x2, mask & 0x1);
+					return true;
+				} else if (c == 'R') {
+					txbuf[tx_ptr++] = pins.tdo() ? '1' : '0';
+					if (tx_ptr >= TCP_BUF_SIZE)
+						flush();
+				} else if (c == 'Q') {
+					printf("OpenOCD sent quit command\n");
+					return false;
+				}
+			} else {
+				// As in tb: take whatever has arrived without blocking, so
+				// responses are coalesced, and flush before blocking
+				rx_ptr = 0;
+				rx_remaining = recv(sock_fd, rxbuf.data(), TCP_BUF_SIZE, MSG_DONTWAIT);
+				if (rx_remaining <= 0) {
+					flush();
+					rx_remaining = read(sock_fd, rxbuf.data(), TCP_BUF_SIZE);
+				}
+				if (rx_remaining <= 0) {
+					rx_remaining = 0;
+					close(sock_fd);
+					accept_connection();
+				}
+			}
+		}
+	}
+
+private:
+	void accept_connection() {
+		socklen_t len = sizeof(sock_addr);
+		sock_fd = wait_for_connection(server_fd, port, (struct sockaddr *)&sock_addr, &len);
+	}
+
+	void flush() {
+		if (tx_ptr > 0)
+			send(sock_fd, txbuf.data(), tx_ptr, 0);
+		tx_ptr = 0;
+	}
+};
@@ -0,0 +1,168 @@
+// Entry point for a tb built with more than one topology. The Makefile builds
+// tb.cpp once per topology, each copy in namespace topology_<name>, and this
+// picks one from --topology, or from the name that tb was run as (so that a
+// tb_multicore link to tb runs the multicore topology). With --shm-cluster,
+// this instead forks one process per listed topology, sharing memory, and
+// waits for them.
+
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "tb_shm.h"
+
+tb_shm_cluster *tb_shm = nullptr;
+int tb_shm_rank = 0;
+
+// Must match MEM_SIZE in tb.cpp
+static const size_t SHM_MEM_SIZE = 16 * 1024 * 1024;
+
+// Set by the Makefile, from TOPOLOGIES
+#ifndef TB_TOPOLOGIES
+#define TB_TOPOLOGIES(X) X(tb) X(tb_multicore)
+#endif
+
+#define TB_DECLARE(name) namespace topology_ ## name { int tb_main(int argc, char **argv); }
+TB_TOPOLOGIES(TB_DECLARE)
+#undef TB_DECLARE
+
+struct topology {
+	const char *name;
+	int (*main)(int argc, char **argv);
+};
+
+static const topology topologies[] = {
+#define TB_ENTRY(name) {#name, topology_ ## name::tb_main},
+	TB_TOPOLOGIES(TB_ENTRY)
+#undef TB_ENTRY
+};
+
+static const topology *find_topology(const std::string &name) {
+	for (const topology &t : topologies) {
+		if (name == t.name)
+			return &t;
+	}
+	std::cerr << "Unknown topology \"" << name << "\". This tb was built with:";
+	for (const topology &t : topologies)
+		std::cerr << " " << t.name;
+	std::cerr << "\n";
+	return nullptr;
+}
+
+// Run each process of a --shm-cluster simulation in a child, stopping them
+// all once any one exits. Returns the first process's exit status.
+static int run_cluster(const std::vector<const topology*> &ranks, uint32_t quantum, std::vector<char*> &args) {
+	if (ranks.size() > (size_t)tb_shm_cluster::MAX_RANKS) {
+		std::cerr << "--shm-cluster supports up to " << (int)tb_shm_cluster::MAX_RANKS << " processes\n";
+		return -1;
+	}
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t mem_offset = (sizeof(tb_shm_cluster) + page - 1) / page * page;
+	void *p = mmap(nullptr, mem_offset + SHM_MEM_SIZE, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		std::cerr << "Failed to allocate shared memory\n";
+		return -1;
+	}
+	tb_shm = new (p) tb_shm_cluster();
+	tb_shm->mem_offset = mem_offset;
+	tb_shm->mem_size = SHM_MEM_SIZE;
+	tb_shm->n_ranks = ranks.size();
+	tb_shm->quantum = quantum;
+
+	std::vector<pid_t> pids;
+	for (size_t r = 0; r < ranks.size(); ++r) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			std::cerr << "Failed to fork\n";
+			tb_shm->stop.store(true);
+			break;
+		}
+		if (pid == 0) {
+			tb_shm_rank = r;
+			int rc = ranks[r]->main(args.size() - 1, args.data());
+			fflush(stdout);
+			fflush(stderr);
+			_exit(rc);
+		}
+		pids.push_back(pid);
+	}
+
+	int rc = -1;
+	for (size_t n = 0; n < pids.size(); ++n) {
+		int status;
+		pid_t pid = wait(&status);
+		if (pid < 0)
+			break;
+		// Any process finishing stops the rest (even if it crashed)
+		tb_shm->stop.store(true, std::memory_order_release);
+		if (pid == pids[0])
+			rc = WIFEXITED(status) ? (int8_t)WEXITSTATUS(status) : -1;
+		else
+			tb_shm->ranks_done.fetch_add(1, std::memory_order_release);
+	}
+	return rc;
+}
+
+int main(int argc, char **argv) {
+	// Longest topology name which prefixes the executable's name, e.g.
+	// tb_multicore-cosim runs tb_multicore
+	const char *exec_name = strrchr(argv[0], '/');
+	exec_name = exec_name ? exec_name + 1 : argv[0];
+	const topology *selected = &topologies[0];
+	size_t match_len = 0;
+	for (const topology &t : topologies) {
+		size_t len = strlen(t.name);
+		if (len > match_len && strncmp(exec_name, t.name, len) == 0) {
+			selected = &t;
+			match_len = len;
+		}
+	}
+
+	std::vector<char*> args;
+	std::vector<const topology*> cluster;
+	uint32_t quantum = tb_shm_cluster::DEFAULT_QUANTUM;
+	for (int i = 0; i < argc; ++i) {
+		bool is_topology = strcmp(argv[i], "--topology") == 0;
+		bool is_cluster = strcmp(argv[i], "--shm-cluster") == 0;
+		bool is_quantum = strcmp(argv[i], "--quantum") == 0;
+		if (!is_topology && !is_cluster && !is_quantum) {
+			args.push_back(argv[i]);
+			continue;
+		}
+		if (i + 1 >= argc) {
+			std::cerr << "Option " << argv[i] << " requires an argument\n";
+			return -1;
+		}
+		std::string value = argv[++i];
+		if (is_topology) {
+			selected = find_topology(value);
+			if (!selected)
+				return -1;
+		} else if (is_cluster) {
+			std::stringstream ss(value);
+			std::string name;
+			while (std::getline(ss, name, ',')) {
+				cluster.push_back(find_topology(name));
+				if (!cluster.back())
+					return -1;
+			}
+		} else {
+			quantum = std::stoul(value, 0, 0);
+			if (quantum == 0) {
+				std::cerr << "--quantum must be at least 1\n";
+				return -1;
+			}
+		}
+	}
+	args.push_back(nullptr);
+	if (!cluster.empty())
+		return run_cluster(cluster, quantum, args);
+	return selected->main(args.size() - 1, args.data());
+}
@@ -0,0 +1,534 @@
+#pragma once
+
+// Monitors driven by the main loop of tb's run(), which see the design and
+// the testbench once a cycle, and keep up with the cycles which are skipped
+// through clock-gated sleep. Each is a tb_monitor, and run() keeps a list of
+// those enabled, so the loop doesn't need to know what each one does. Unlike
+// the other tb_*.h headers, these bind to the design: tb.cpp includes this
+// inside its topology namespace, once tb_dut and mem_io_state are defined,
+// so it includes nothing itself. (rv_power.h, rv_profile.h, tb_bus.h and
+// tb_shm.h are included at the top of tb.cpp.)
+
+struct tb_monitor {
+	virtual ~tb_monitor() {}
+
+	// Call after the rising edge of each cycle which runs, before the bus
+	// ports are serviced
+	virtual void sample() {}
+
+	// Call at the end of each cycle which runs, with the number of cycles
+	// run so far
+	virtual void end_cycle(int64_t cycles) {}
+
+	// n cycles were skipped, with every hart's clock gated and the bus idle
+	virtual void skip(int64_t n) {}
+
+	// The number of cycles run at which end_cycle() must next be called, so
+	// that skipping stops short of it
+	virtual int64_t next_cycle() const {
+		return INT64_MAX;
+	}
+};
+
+// -----------------------------------------------------------------------------
+// Sampling profiler (--profile)
+
+// Follows the instructions reported by hazard3_cosim_monitor.vh. Cycles are
+// attributed to the most recently retired instruction, and the instruction
+// itself is read back from memory, for tracking calls and returns.
+struct profile_monitor: tb_monitor {
+	Profiler profiler;
+	const mem_io_state *memio;
+	const cxxrtl::chunk_t *valid, *pc, *trap, *intr;
+	uint32_t last_pc;
+	// Cleared outside the region of interest, with --roi
+	bool live;
+
+	profile_monitor(uint64_t interval, bool track_calls): profiler(interval, track_calls), memio(nullptr),
+		valid(nullptr), pc(nullptr), trap(nullptr), intr(nullptr), last_pc(RESET_VECTOR), live(true) {}
+
+	bool init(tb_dut &dut, const mem_io_state &memio_) {
+		memio = &memio_;
+		const cxxrtl::debug_items &items = dut.debug_info();
+		// Hart 0 only, on multicore tb
+		std::string prefix = items.table.count("cpu core cosim_valid") ? "cpu core " : "cpu0 core ";
+		auto find = [&](const char *name) -> const cxxrtl::chunk_t* {
+			auto it = items.table.find(prefix + name);
+			return it == items.table.end() ? nullptr : it->second[0].curr;
+		};
+		valid = find("cosim_valid");
+		pc = find("cosim_pc");
+		trap = find("cosim_trap");
+		intr = find("cosim_intr");
+		if (!(valid && pc && trap && intr)) {
+			std::cerr << "Retirement monitor not found in design\n";
+			return false;
+		}
+		return true;
+	}
+
+	void sample() override {
+		if (!live)
+			return;
+		profiler.tick(last_pc);
+		if (!*valid)
+			return;
+		if (*intr)
+			profiler.trap(last_pc);
+		last_pc = *pc;
+		if (*trap) {
+			profiler.trap(last_pc);
+		} else if (last_pc <= (uint32_t)MEM_SIZE - 4) {
+			uint32_t instr;
+			memcpy(&instr, memio->mem + last_pc, sizeof(instr));
+			profiler.retire(last_pc, (instr & 0x3) == 0x3 ? instr : instr & 0xffffu);
+		}
+	}
+
+	// Nothing retires while asleep
+	void skip(int64_t n) override {
+		if (live)
+			profiler.tick(last_pc, n);
+	}
+};
+
+// -----------------------------------------------------------------------------
+// Bus statistics (--bus-stats)
+
+// Counted per port. A port is busy on a cycle with an address phase or a
+// data phase (including wait states), else idle. Stalls are wait states
+// inserted by the testbench (--waitstates, --contention and --traffic), not counting
+// the two-cycle error response.
+struct bus_port_stats {
+	uint64_t busy = 0, idle = 0, stall = 0;
+	uint64_t nonseq = 0, seq = 0;
+	uint64_t reads = 0, writes = 0;
+	uint64_t size[3] = {};
+	uint64_t excl_reads = 0, excl_writes = 0, excl_write_fails = 0;
+	uint64_t errors = 0;
+};
+
+// The per-port counts are made by the bus loop of run(), while live
+struct bus_stats: tb_monitor {
+	// Ports are numbered from port_base, the first hart's mhartid
+	int port_base;
+	std::vector<bus_port_stats> total;
+	// Per-window time series, written as each window ends
+	FILE *series;
+	int64_t window;
+	int64_t next_window;
+	std::vector<bus_port_stats> last;
+	// Set by init(), and cleared outside the region of interest with --roi
+	bool live;
+
+	bus_stats(): port_base(0), series(nullptr), window(0), next_window(INT64_MAX), live(false) {}
+
+	~bus_stats() {
+		if (series)
+			fclose(series);
+	}
+
+	bool init(int n_ports, int port_base_, const std::string &series_path, int64_t window_, int64_t start_cycle) {
+		port_base = port_base_;
+		total.resize(n_ports);
+		last.resize(n_ports);
+		live = true;
+		if (series_path.empty())
+			return true;
+		series = fopen(series_path.c_str(), "w");
+		if (!series) {
+			std::cerr << "Failed to open \"" << series_path << "\"\n";
+			return false;
+		}
+		window = window_;
+		next_window = start_cycle + window;
+		fprintf(series, "cycle,port,busy,stall,nonseq,seq,reads,writes,excl_write_fails,errors\n");
+		return true;
+	}
+
+	void address_phase(int port, uint32_t htrans) {
+		++(htrans == 3 ? total[port].seq : total[port].nonseq);
+	}
+
+	void data_phase(int port, const bus_request &req, const bus_response &resp) {
+		bus_port_stats &t = total[port];
+		++(req.write ? t.writes : t.reads);
+		if (req.size <= SIZE_WORD)
+			++t.size[req.size];
+		if (req.excl && req.write) {
+			++t.excl_writes;
+			t.excl_write_fails += !resp.exokay;
+		} else if (req.excl) {
+			++t.excl_reads;
+		}
+		t.errors += resp.err;
+	}
+
+	void end_cycle(int64_t cycles) override {
+		if (cycles >= next_window)
+			end_window(cycles);
+	}
+
+	// Idle, for all ports
+	void skip(int64_t n) override {
+		if (!live)
+			return;
+		for (bus_port_stats &t : total)
+			t.idle += n;
+	}
+
+	int64_t next_cycle() const override {
+		return next_window;
+	}
+
+	// Call with the number of cycles run so far
+	void end_window(int64_t cycles) {
+		for (size_t p = 0; p < total.size(); ++p) {
+			const bus_port_stats &t = total[p], &l = last[p];
+			fprintf(series, I64_FMT ",%d,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+				",%" PRIu64 ",%" PRIu64 "\n", cycles, port_base + (int)p, t.busy - l.busy, t.stall - l.stall,
+				t.nonseq - l.nonseq, t.seq - l.seq, t.reads - l.reads, t.writes - l.writes,
+				t.excl_write_fails - l.excl_write_fails, t.errors - l.errors);
+		}
+		last = total;
+		next_window = cycles + window;
+	}
+
+	void print(FILE *f) const {
+		auto percent = [](uint64_t x, uint64_t total) {return total ? 100.0 * x / total : 0.0;};
+		for (size_t p = 0; p < total.size(); ++p) {
+			const bus_port_stats &t = total[p];
+			uint64_t cycles = t.busy + t.idle;
+			uint64_t transfers = t.nonseq + t.seq;
+			fprintf(f, "Bus port %d: busy %" PRIu64 " of %" PRIu64 " cycles (%.1f%%), %" PRIu64 " stalled (%.1f%%)\n",
+				port_base + (int)p, t.busy, cycles, percent(t.busy, cycles), t.stall, percent(t.stall, cycles));
+			fprintf(f, "  %" PRIu64 " transfers: %" PRIu64 " nonseq, %" PRIu64 " seq (%.1f%%), %" PRIu64 " reads, %" PRIu64 " writes\n",
+				transfers, t.nonseq, t.seq, percent(t.seq, transfers), t.reads, t.writes);
+			fprintf(f, "  Size: %" PRIu64 " byte, %" PRIu64 " halfword, %" PRIu64 " word\n",
+				t.size[SIZE_BYTE], t.size[SIZE_HWORD], t.size[SIZE_WORD]);
+			fprintf(f, "  Exclusive: %" PRIu64 " reads, %" PRIu64 " writes of which %" PRIu64 " failed (%.1f%%)\n",
+				t.excl_reads, t.excl_writes, t.excl_write_fails, percent(t.excl_write_fails, t.excl_writes));
+			fprintf(f, "  Error responses: %" PRIu64 "\n", t.errors);
+		}
+	}
+};
+
+// -----------------------------------------------------------------------------
+// Background bus traffic (--traffic)
+
+// The generators of tb_bus.h claim their share of the bus once a cycle
+struct traffic_monitor: tb_monitor {
+	traffic_model &traffic;
+	const latency_model &latency;
+
+	traffic_monitor(traffic_model &traffic_, const latency_model &latency_): traffic(traffic_), latency(latency_) {}
+
+	void end_cycle(int64_t cycles) override {
+		traffic.step(latency);
+	}
+
+	void skip(int64_t n) override {
+		traffic.skip(n, latency);
+	}
+};
+
+// -----------------------------------------------------------------------------
+// Hang detection
+
+// A single-hart design is hung, and would only run on until --cycles, once
+// hart 0 has its clock stopped in WFI, or keeps retiring at the same pc
+// (which only a jump or trap to itself can do, with the same state each
+// time), with its IRQ inputs unchanged for long enough to be seen, and none
+// of them can change. (Any IRQ which the hart could take, it already would
+// have.) The caller rules out stimulus events and anything else outside
+// the design which could change them, through quiet. The timer IRQ only
+// rises again while mtime is below mtimecmp.
+struct hang_detector: tb_monitor {
+	static const int SETTLE_CYCLES = 8;
+	static const int REPEATS = 8;
+
+	tb_dut *dut;
+	const mem_io_state *memio;
+	// False if anything outside the design may change its IRQ inputs
+	std::function<bool()> quiet;
+	const cxxrtl::chunk_t *valid, *pc, *clk_en;
+	uint32_t last_pc;
+	int repeats;
+	int settled_cycles;
+	uint32_t last_irq;
+	uint8_t last_soft_irq, last_timer_irq;
+	bool hung;
+
+	hang_detector(): dut(nullptr), memio(nullptr), valid(nullptr), pc(nullptr), clk_en(nullptr), last_pc(0),
+		repeats(0), settled_cycles(0), last_irq(0), last_soft_irq(0), last_timer_irq(0), hung(false) {}
+
+	// Returns false, and nothing is detected, if the design has no
+	// retirement monitor
+	bool init(tb_dut &dut_, const mem_io_state &memio_) {
+		dut = &dut_;
+		memio = &memio_;
+		const cxxrtl::debug_items &items = dut->debug_info();
+		std::string prefix = items.table.count("cpu core cosim_valid") ? "cpu core " : "cpu0 core ";
+		auto find = [&](const std::string &name) -> const cxxrtl::chunk_t* {
+			auto it = items.table.find(name);
+			return it == items.table.end() ? nullptr : it->second[0].curr;
+		};
+		valid = find(prefix + "cosim_valid");
+		pc = find(prefix + "cosim_pc");
+		// Without a power controller, only spinning is detected
+		clk_en = find(prefix + "power_ctrl clk_en");
+		return valid && pc;
+	}
+
+	void end_cycle(int64_t cycles) override {
+		if (*valid) {
+			repeats = *pc == last_pc ? repeats + 1 : 0;
+			last_pc = *pc;
+		}
+		uint32_t irq = dut->irq.get();
+		uint8_t soft_irq = dut->soft_irq.get();
+		uint8_t timer_irq = dut->timer_irq.get();
+		bool same = irq == last_irq && soft_irq == last_soft_irq && timer_irq == last_timer_irq;
+		settled_cycles = same ? settled_cycles + 1 : 0;
+		last_irq = irq;
+		last_soft_irq = soft_irq;
+		last_timer_irq = timer_irq;
+		hung = settled_cycles >= SETTLE_CYCLES && (repeats >= REPEATS || (clk_en && !*clk_en)) && quiet() &&
+			memio->mtime >= memio->io->mtimecmp[memio->hart_base].load(std::memory_order_relaxed);
+	}
+};
+
+// -----------------------------------------------------------------------------
+// Skipping ahead through clock-gated sleep
+
+// tb.v doesn't wire up the clock gate, as CXXRTL can't simulate gated clocks,
+// but once every hart's power controller has clk_en low, the only things
+// which still change are the harts' mcycle counters, until an IRQ input does.
+// Without a debugger or any other outside stimulus, the only IRQ input which
+// can change is the timer IRQ (or another timed device's output), so the
+// testbench jumps straight to the next device event, such as mtime reaching
+// the next mtimecmp, and advances mcycle to match. The other monitors are
+// skipped at the same time, and skipping stops short of their next_cycle().
+struct sleep_skipper: tb_monitor {
+	// Cycles with clk_en low and the IRQ inputs unchanged before skipping,
+	// so that the IRQ input synchronisers have settled
+	static const int SETTLE_CYCLES = 4;
+
+	struct hart_items {
+		const cxxrtl::chunk_t *clk_en;
+		// Null if the hart has no counters
+		const cxxrtl::chunk_t *inhibit;
+		cxxrtl::debug_item mcycle, mcycleh;
+	};
+	tb_dut *dut;
+	const mem_io_state *memio;
+	std::vector<hart_items> harts;
+	int asleep_cycles;
+	uint32_t last_irq;
+	uint8_t last_soft_irq, last_timer_irq;
+
+	sleep_skipper(): dut(nullptr), memio(nullptr), asleep_cycles(0), last_irq(0), last_soft_irq(0),
+		last_timer_irq(0) {}
+
+	bool init(tb_dut &dut_, const mem_io_state &memio_) {
+		dut = &dut_;
+		memio = &memio_;
+		const cxxrtl::debug_items &items = dut->debug_info();
+		const std::string suffix = "power_ctrl clk_en";
+		for (auto &it : items.table) {
+			const std::string &name = it.first;
+			if (name.size() < suffix.size() || name.compare(name.size() - suffix.size(), suffix.size(), suffix))
+				continue;
+			std::string prefix = name.substr(0, name.size() - suffix.size());
+			hart_items h;
+			h.clk_en = it.second[0].curr;
+			h.inhibit = nullptr;
+			auto mcycle = items.table.find(prefix + "csr_u mcycle");
+			auto mcycleh = items.table.find(prefix + "csr_u mcycleh");
+			auto inhibit = items.table.find(prefix + "csr_u mcountinhibit_cy");
+			if (mcycle != items.table.end() && mcycleh != items.table.end() && inhibit != items.table.end() &&
+					mcycle->second[0].next && mcycleh->second[0].next) {
+				h.mcycle = mcycle->second[0];
+				h.mcycleh = mcycleh->second[0];
+				h.inhibit = inhibit->second[0].curr;
+			}
+			harts.push_back(h);
+		}
+		if (harts.empty()) {
+			std::cerr << "Power controller not found in design\n";
+			return false;
+		}
+		return true;
+	}
+
+	// Call at the end of each cycle, with the bus idle state for the next
+	// cycle. Returns the number of cycles which can be skipped, up to limit.
+	int64_t check(bool bus_idle, int64_t limit) {
+		uint32_t irq = dut->irq.get();
+		uint8_t soft_irq = dut->soft_irq.get();
+		uint8_t timer_irq = dut->timer_irq.get();
+		bool asleep = bus_idle && irq == last_irq && soft_irq == last_soft_irq && timer_irq == last_timer_irq;
+		for (const hart_items &h : harts)
+			asleep = asleep && !*h.clk_en;
+		last_irq = irq;
+		last_soft_irq = soft_irq;
+		last_timer_irq = timer_irq;
+		asleep_cycles = asleep ? asleep_cycles + 1 : 0;
+		if (asleep_cycles < SETTLE_CYCLES)
+			return 0;
+		// Next device event, such as a change of the timer IRQ
+		uint64_t idle = memio->events.idle_cycles();
+		return idle < (uint64_t)limit ? (int64_t)idle : limit;
+	}
+
+	void skip(int64_t n) override {
+		for (hart_items &h : harts) {
+			if (!h.inhibit || *h.inhibit)
+				continue;
+			uint64_t mcycle = ((uint64_t)h.mcycleh.curr[0] << 32 | h.mcycle.curr[0]) + n;
+			h.mcycle.curr[0] = h.mcycle.next[0] = mcycle;
+			h.mcycleh.curr[0] = h.mcycleh.next[0] = mcycle >> 32;
+		}
+	}
+};
+
+// -----------------------------------------------------------------------------
+// Power-state residency (--power-stats)
+
+// Each hart's state is read from its power controller and sleep pipeline
+// flags at the end of every cycle: power-up request low is powered down,
+// else clock enable low is deep sleep, else the core is asleep on h3.block
+// or WFI, else active. A wake is put down to the IRQ inputs it sees on its
+// first active cycle: the hart's timer or soft IRQ, or any external IRQ,
+// else an unblock if it slept on h3.block.
+struct power_monitor: tb_monitor {
+	struct hart_items {
+		const cxxrtl::chunk_t *pwrup_req, *clk_en, *sleep_wfi, *sleep_block;
+		bool was_block;
+	};
+	tb_dut *dut;
+	std::vector<hart_items> harts;
+	PowerStats stats;
+
+	power_monitor(): dut(nullptr) {}
+
+	bool init(tb_dut &dut_, int n_harts, int hart_base, const std::string &series_path, int64_t window,
+			int64_t start_cycle) {
+		dut = &dut_;
+		const cxxrtl::debug_items &items = dut->debug_info();
+		const std::string suffix = "power_ctrl clk_en";
+		auto find = [&](const std::string &name) -> const cxxrtl::chunk_t* {
+			auto it = items.table.find(name);
+			return it == items.table.end() ? nullptr : it->second[0].curr;
+		};
+		for (auto &it : items.table) {
+			const std::string &name = it.first;
+			if (name.size() < suffix.size() || name.compare(name.size() - suffix.size(), suffix.size(), suffix))
+				continue;
+			std::string prefix = name.substr(0, name.size() - suffix.size());
+			hart_items h;
+			h.clk_en = it.second[0].curr;
+			h.pwrup_req = find(prefix + "power_ctrl pwrup_req");
+			h.sleep_wfi = find(prefix + "xm_sleep_wfi");
+			h.sleep_block = find(prefix + "xm_sleep_block");
+			h.was_block = false;
+			if (!(h.pwrup_req && h.sleep_wfi && h.sleep_block))
+				continue;
+			harts.push_back(h);
+		}
+		if (harts.empty()) {
+			std::cerr << "Power controller not found in design\n";
+			return false;
+		}
+		return stats.init(n_harts, hart_base, series_path, window, start_cycle);
+	}
+
+	void end_cycle(int64_t cycles) override {
+		for (size_t i = 0; i < harts.size() && i < stats.harts.size(); ++i) {
+			hart_items &h = harts[i];
+			PowerStats::State s = !*h.pwrup_req ? PowerStats::POWERED_DOWN : !*h.clk_en ? PowerStats::DEEP_SLEEP :
+				*h.sleep_block ? PowerStats::SLEEP : *h.sleep_wfi ? PowerStats::WFI : PowerStats::ACTIVE;
+			PowerStats::Hart &ph = stats.harts[i];
+			if (s != PowerStats::ACTIVE && ph.state == PowerStats::ACTIVE)
+				h.was_block = *h.sleep_block;
+			if (!ph.add(s))
+				continue;
+			if (dut->timer_irq.get() >> i & 1)
+				ph.wake(PowerStats::WAKE_TIMER);
+			else if (dut->soft_irq.get() >> i & 1)
+				ph.wake(PowerStats::WAKE_SOFT);
+			else if (dut->irq.get())
+				ph.wake(PowerStats::WAKE_EXTERNAL);
+			else
+				ph.wake(h.was_block ? PowerStats::WAKE_UNBLOCK : PowerStats::WAKE_OTHER);
+		}
+		if (cycles >= stats.next_window)
+			stats.end_window(cycles);
+	}
+
+	void skip(int64_t n) override {
+		stats.skip(n);
+	}
+
+	int64_t next_cycle() const override {
+		return stats.next_window;
+	}
+};
+
+// -----------------------------------------------------------------------------
+// --shm-cluster barrier
+
+// Each process of a --shm-cluster simulation waits for the others at the end
+// of every quantum. Once past the first barrier, all processes have their
+// harts registered, and memory is loaded. Other processes may have changed
+// the shared IRQ state, and written our harts' mtimecmp, in the meantime.
+struct shm_barrier_monitor: tb_monitor {
+	tb_dut *dut;
+	mem_io_state *memio;
+	int64_t next_sync;
+	// Another process stopped without an exit request
+	bool stopped;
+
+	shm_barrier_monitor(): dut(nullptr), memio(nullptr), next_sync(INT64_MAX), stopped(false) {}
+
+	// Waits at the first barrier, and checks the other processes' harts
+	bool init(tb_dut &dut_, mem_io_state &memio_, int64_t start_cycle) {
+		dut = &dut_;
+		memio = &memio_;
+		if (!tb_shm->barrier.wait(tb_shm->n_ranks, tb_shm->stop))
+			return false;
+		for (int r = 0; r < tb_shm->n_ranks; ++r) {
+			const tb_shm_cluster::rank_harts &h = tb_shm->harts[r];
+			memio->io_harts = std::max(memio->io_harts, h.base + h.count);
+			if (r != tb_shm_rank && h.base < memio->hart_base + memio->n_harts && memio->hart_base < h.base + h.count) {
+				std::cerr << "Harts of processes " << tb_shm_rank << " and " << r << " overlap: " <<
+					"use a tb_cluster<N>_<base> topology for each process\n";
+				return false;
+			}
+		}
+		next_sync = start_cycle + tb_shm->quantum;
+		return true;
+	}
+
+	void end_cycle(int64_t cycles) override {
+		if (cycles != next_sync)
+			return;
+		next_sync += tb_shm->quantum;
+		if (!tb_shm->barrier.wait(tb_shm->n_ranks, tb_shm->stop) && !memio->exit_req) {
+			// Another process stopped: exit too, if it was an exit request
+			int64_t status = tb_shm->exit_status.load();
+			if (status < 0) {
+				stopped = true;
+				return;
+			}
+			memio->exit_req = true;
+			memio->exit_code = status;
+		}
+		memio->sync_irqs(*dut);
+		memio->timer_changed();
+	}
+
+	int64_t next_cycle() const override {
+		return next_sync;
+	}
+};
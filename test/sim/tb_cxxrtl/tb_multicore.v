@@ -18,6 +18,17 @@ module tb #(
     input  wire               tdi,
     output wire               tdo,
 
+	// Direct DMI access from the testbench, bypassing the DTM
+	input  wire               dmi_direct_en,
+	input  wire               dmi_direct_psel,
+	input  wire               dmi_direct_penable,
+	input  wire               dmi_direct_pwrite,
+	input  wire [8:0]         dmi_direct_paddr,
+	input  wire [31:0]        dmi_direct_pwdata,
+	output wire [31:0]        dmi_direct_prdata,
+	output wire               dmi_direct_pready,
+	output wire               dmi_direct_pslverr,
+
 	// Core 0 bus (named I for consistency with 1-core 2-port tb)
 	output wire [W_ADDR-1:0]  i_haddr,
 	output wire               i_hwrite,
@@ -69,6 +80,23 @@ reg  [31:0]       dmi_prdata;
 wire              dmi_pready;
 wire              dmi_pslverr;
 
+wire              dtm_psel;
+wire              dtm_penable;
+wire              dtm_pwrite;
+wire [8:0]        dtm_paddr;
+wire [31:0]       dtm_pwdata;
+
+// The DM is driven either by the DTM or by the testbench. While the
+// testbench has it, DTM accesses complete immediately with an error.
+assign dmi_psel           = dmi_direct_en ? dmi_direct_psel    : dtm_psel;
+assign dmi_penable        = dmi_direct_en ? dmi_direct_penable : dtm_penable;
+assign dmi_pwrite         = dmi_direct_en ? dmi_direct_pwrite  : dtm_pwrite;
+assign dmi_paddr          = dmi_direct_en ? dmi_direct_paddr   : dtm_paddr;
+assign dmi_pwdata         = dmi_direct_en ? dmi_direct_pwdata  : dtm_pwdata;
+assign dmi_direct_prdata  = dmi_prdata;
+assign dmi_direct_pready  = dmi_pready;
+assign dmi_direct_pslverr = dmi_pslverr;
+
 wire dmihardreset_req;
 wire assert_dmi_reset = !rst_n || dmihardreset_req;
 wire rst_n_dmi;
@@ -94,14 +122,14 @@ hazard3_jtag_dtm #(
 	.clk_dmi          (clk),
 	.rst_n_dmi        (rst_n_dmi),
 
-	.dmi_psel         (dmi_psel),
-	.dmi_penable      (dmi_penable),
-	.dmi_pwrite       (dmi_pwrite),
-	.dmi_paddr        (dmi_paddr),
-	.dmi_pwdata       (dmi_pwdata),
+	.dmi_psel         (dtm_psel),
+	.dmi_penable      (dtm_penable),
+	.dmi_pwrite       (dtm_pwrite),
+	.dmi_paddr        (dtm_paddr),
+	.dmi_pwdata       (dtm_pwdata),
 	.dmi_prdata       (dmi_prdata),
-	.dmi_pready       (dmi_pready),
-	.dmi_pslverr      (dmi_pslverr)
+	.dmi_pready       (dmi_pready || dmi_direct_en),
+	.dmi_pslverr      (dmi_pslverr || dmi_direct_en)
 );
 
 localparam N_HARTS = 2;
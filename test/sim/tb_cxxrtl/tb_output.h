@@ -0,0 +1,219 @@
+#pragma once
+
+// Output files of tb (guest console output, waveforms and traces), written
+// out by one background thread, so that the simulation only waits on a slow
+// terminal, pipe or file system if a stream gets a whole ring ahead of it.
+// Each stream is a single-producer, single-consumer ring: only the simulation
+// thread writes to it, and only the output thread drains it, so the order of
+// each stream is kept. C++14, and no dependencies on the design.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct tb_output_stream;
+
+// Runs while any stream is open. Opening and closing streams is rare, so the
+// list of streams is just kept under a mutex.
+struct tb_output_thread {
+	static void add(tb_output_stream *s) {
+		tb_output_thread &t = get();
+		std::lock_guard<std::mutex> lock(t.mutex);
+		t.streams.push_back(s);
+		if (!t.thread.joinable()) {
+			t.stop = false;
+			t.thread = std::thread([&t] {t.run();});
+		}
+	}
+
+	static void remove(tb_output_stream *s) {
+		tb_output_thread &t = get();
+		std::unique_lock<std::mutex> lock(t.mutex);
+		t.streams.erase(std::remove(t.streams.begin(), t.streams.end(), s), t.streams.end());
+		if (t.streams.empty() && t.thread.joinable()) {
+			t.stop = true;
+			lock.unlock();
+			t.thread.join();
+		}
+	}
+
+private:
+	std::mutex mutex;
+	std::vector<tb_output_stream*> streams;
+	std::thread thread;
+	bool stop;
+
+	tb_output_thread(): stop(false) {}
+
+	// Streams still open at exit() lose whatever is left in their rings
+	~tb_output_thread() {
+		if (thread.joinable()) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stop = true;
+			}
+			thread.join();
+		}
+	}
+
+	static tb_output_thread &get() {
+		static tb_output_thread t;
+		return t;
+	}
+
+	inline void run();
+};
+
+struct tb_output_stream {
+	tb_output_stream(): f(nullptr), mode(NONE), size(0), head(0), tail(0) {}
+
+	tb_output_stream(const tb_output_stream&) = delete;
+
+	~tb_output_stream() {
+		close();
+	}
+
+	// A file opened with fopen(), or a pipe to a command's stdin. Returns
+	// false if it can't be opened.
+	bool open(const std::string &path, size_t ring_size) {
+		return attach(fopen(path.c_str(), "wb"), ring_size, FILE_CLOSE);
+	}
+
+	bool open_pipe(const std::string &cmd, size_t ring_size) {
+		return attach(popen(cmd.c_str(), "w"), ring_size, PIPE_CLOSE);
+	}
+
+	// A file which stays open after close(), such as stdout
+	bool open_file(FILE *file, size_t ring_size) {
+		return attach(file, ring_size, KEEP_OPEN);
+	}
+
+	bool is_open() const {
+		return f;
+	}
+
+	// Bytes written so far, which is the file offset of the next one
+	uint64_t offset() const {
+		return head.load(std::memory_order_relaxed);
+	}
+
+	void write(const void *data, size_t n) {
+		const char *p = (const char*)data;
+		while (n > 0) {
+			size_t h = head.load(std::memory_order_relaxed);
+			size_t space = size - (h - tail.load(std::memory_order_acquire));
+			if (space == 0) {
+				std::this_thread::yield();
+				continue;
+			}
+			size_t chunk = std::min(std::min(space, n), size - h % size);
+			memcpy(ring.get() + h % size, p, chunk);
+			head.store(h + chunk, std::memory_order_release);
+			p += chunk;
+			n -= chunk;
+		}
+	}
+
+	void write(const std::string &s) {
+		write(s.data(), s.size());
+	}
+
+	void put(char c) {
+		write(&c, 1);
+	}
+
+	// Wait until everything written so far is in the file, e.g. before the
+	// same file is written some other way
+	void sync() {
+		if (!f)
+			return;
+		while (tail.load(std::memory_order_acquire) != head.load(std::memory_order_relaxed))
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		std::lock_guard<std::mutex> lock(flush_mutex);
+		fflush(f);
+	}
+
+	void close() {
+		if (!f)
+			return;
+		sync();
+		tb_output_thread::remove(this);
+		if (mode == FILE_CLOSE)
+			fclose(f);
+		else if (mode == PIPE_CLOSE)
+			pclose(f);
+		f = nullptr;
+		ring.reset();
+	}
+
+private:
+	friend struct tb_output_thread;
+	enum close_mode {NONE, FILE_CLOSE, PIPE_CLOSE, KEEP_OPEN};
+
+	FILE *f;
+	close_mode mode;
+	std::unique_ptr<char[]> ring;
+	size_t size;
+	std::atomic<size_t> head;
+	std::atomic<size_t> tail;
+	// Held by the output thread while it writes to f
+	std::mutex flush_mutex;
+
+	bool attach(FILE *file, size_t ring_size, close_mode m) {
+		close();
+		if (!file)
+			return false;
+		f = file;
+		mode = m;
+		size = ring_size;
+		ring.reset(new char[size]);
+		head.store(0, std::memory_order_relaxed);
+		tail.store(0, std::memory_order_relaxed);
+		tb_output_thread::add(this);
+		return true;
+	}
+
+	// Called by the output thread. Writes out whatever is in the ring, and
+	// returns false if there was nothing.
+	bool drain() {
+		size_t t = tail.load(std::memory_order_relaxed);
+		size_t avail = head.load(std::memory_order_acquire) - t;
+		if (avail == 0)
+			return false;
+		std::lock_guard<std::mutex> lock(flush_mutex);
+		while (avail > 0) {
+			size_t n = std::min(avail, size - t % size);
+			fwrite(ring.get() + t % size, 1, n, f);
+			t += n;
+			avail -= n;
+			tail.store(t, std::memory_order_release);
+		}
+		// Flush at the end of each burst, for output to a terminal
+		if (mode == KEEP_OPEN)
+			fflush(f);
+		return true;
+	}
+};
+
+inline void tb_output_thread::run() {
+	while (true) {
+		bool busy = false;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (stop)
+				return;
+			for (tb_output_stream *s : streams)
+				busy = s->drain() || busy;
+		}
+		if (!busy)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+// State shared by the processes of a --shm-cluster simulation. Each process
+// simulates some of a multicore system's harts (one tb_cluster topology per
+// process), and guest RAM is in shared memory. The processes run in lockstep
+// to within a quantum of cycles, by waiting at a barrier every quantum
+// cycles; accesses from different processes within a quantum are unordered.
+//
+// Included by tb_main.cpp, which sets up the shared memory, so C++14 and no
+// dependencies on the design.
+
+#include <atomic>
+#include <cstdint>
+#include <sched.h>
+
+// Bus ports and harts across all processes. Port n belongs to hart n, in
+// every multicore topology.
+static const int MAX_BUS_PORTS = 32;
+
+static inline void tb_cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+struct tb_spinlock {
+	std::atomic<bool> locked;
+
+	tb_spinlock(): locked(false) {}
+
+	void lock() {
+		while (locked.exchange(true, std::memory_order_acquire)) {
+			while (locked.load(std::memory_order_relaxed))
+				tb_cpu_relax();
+		}
+	}
+
+	void unlock() {
+		locked.store(false, std::memory_order_release);
+	}
+};
+
+// Sense-reversing barrier. Spins for a while, then yields, so that more
+// processes than host cores still make progress.
+struct tb_barrier {
+	static const unsigned SPINS_BEFORE_YIELD = 4096;
+
+	std::atomic<uint32_t> count;
+	std::atomic<uint32_t> generation;
+
+	tb_barrier(): count(0), generation(0) {}
+
+	// Returns false, without waiting any longer, if stop is set
+	bool wait(uint32_t n, const std::atomic<bool> &stop) {
+		uint32_t gen = generation.load(std::memory_order_acquire);
+		if (count.fetch_add(1, std::memory_order_acq_rel) + 1 == n) {
+			count.store(0, std::memory_order_relaxed);
+			generation.store(gen + 1, std::memory_order_release);
+			return true;
+		}
+		for (unsigned spins = 0; generation.load(std::memory_order_acquire) == gen; ++spins) {
+			if (stop.load(std::memory_order_acquire))
+				return false;
+			if (spins < SPINS_BEFORE_YIELD)
+				tb_cpu_relax();
+			else
+				sched_yield();
+		}
+		return true;
+	}
+};
+
+// Global monitor for exclusive accesses, with one reservation per bus port.
+// Each valid reservation is also recorded in a bitmap of ports for a hash of
+// its address, so a write only checks the ports whose reservations hash the
+// same, rather than every port. Only may_hold() can be called without
+// holding the monitor lock in tb_shared_io.
+struct global_monitor {
+	static const int HASH_SIZE = 256;
+
+	bool valid[MAX_BUS_PORTS];
+	uint32_t addr[MAX_BUS_PORTS];
+	std::atomic<uint32_t> holders[HASH_SIZE];
+
+	global_monitor() {
+		for (int i = 0; i < MAX_BUS_PORTS; ++i) {
+			valid[i] = false;
+			addr[i] = 0;
+		}
+		for (std::atomic<uint32_t> &h : holders)
+			h.store(0, std::memory_order_relaxed);
+	}
+
+	static unsigned hash(uint32_t a) {
+		return (a >> 3 ^ a >> 11) & (HASH_SIZE - 1);
+	}
+
+	void clear(int port) {
+		if (valid[port]) {
+			valid[port] = false;
+			holders[hash(addr[port])].fetch_and(~(1u << port), std::memory_order_relaxed);
+		}
+	}
+
+	void reserve(int port, uint32_t a) {
+		clear(port);
+		valid[port] = true;
+		addr[port] = a;
+		holders[hash(a)].fetch_or(1u << port, std::memory_order_relaxed);
+	}
+
+	// False if no port holds a reservation of a
+	bool may_hold(uint32_t a) const {
+		return holders[hash(a)].load(std::memory_order_relaxed) != 0;
+	}
+
+	bool holds(int port, uint32_t a) const {
+		return valid[port] && addr[port] == a;
+	}
+
+	// Clear other ports' reservations of a, on a write
+	void snoop(int port, uint32_t a) {
+		uint32_t others = holders[hash(a)].load(std::memory_order_relaxed) & ~(1u << port);
+		while (others) {
+			int i = __builtin_ctz(others);
+			others &= others - 1;
+			if (addr[i] == a)
+				clear(i);
+		}
+	}
+};
+
+// Testbench IO state seen by every hart: the IRQ inputs, mtimecmp and the
+// global monitor. A tb process has its own, except in a --shm-cluster
+// simulation, where all processes share one. (mtime is kept by each process,
+// as its cycle count, and is not shared.)
+struct tb_shared_io {
+	// Bit n for hart n
+	std::atomic<uint32_t> soft_irq;
+	std::atomic<uint32_t> irq;
+	std::atomic<bool> monitor_enabled;
+	std::atomic<uint64_t> mtimecmp[MAX_BUS_PORTS];
+	tb_spinlock monitor_lock;
+	global_monitor monitor;
+
+	tb_shared_io(): soft_irq(0), irq(0), monitor_enabled(false) {
+		for (std::atomic<uint64_t> &cmp : mtimecmp)
+			cmp.store(0, std::memory_order_relaxed);
+	}
+};
+
+struct tb_shm_cluster {
+	static const uint32_t DEFAULT_QUANTUM = 1000;
+	// Each process has at least one hart
+	static const int MAX_RANKS = MAX_BUS_PORTS;
+
+	// Guest RAM follows this struct, at a page-aligned offset
+	size_t mem_offset;
+	size_t mem_size;
+	int n_ranks;
+	uint32_t quantum;
+
+	// Harts simulated by each process, written before the first barrier
+	struct rank_harts {
+		int base;
+		int count;
+	} harts[MAX_RANKS];
+
+	tb_barrier barrier;
+	// Set when any process stops, so that the others stop at their next
+	// barrier rather than waiting for it forever
+	std::atomic<bool> stop;
+	// First exit code requested by any hart, or -1
+	std::atomic<int64_t> exit_status;
+	// Processes other than rank 0 which have finished
+	std::atomic<int> ranks_done;
+	tb_shared_io io;
+
+	tb_shm_cluster(): mem_offset(0), mem_size(0), n_ranks(0), quantum(DEFAULT_QUANTUM),
+		stop(false), exit_status(-1), ranks_done(0) {}
+
+	void request_exit(uint32_t code) {
+		int64_t none = -1;
+		exit_status.compare_exchange_strong(none, code);
+		stop.store(true, std::memory_order_release);
+	}
+};
+
+// Set by tb_main.cpp in each process of a --shm-cluster simulation, and null
+// otherwise
+extern tb_shm_cluster *tb_shm;
+extern int tb_shm_rank;